@@ -0,0 +1,145 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cabloom.h"
+#include "util.h"
+
+struct CaBloom {
+        uint64_t n_hash;
+        uint64_t n_bits;
+        uint8_t *bits;
+};
+
+CaBloom *ca_bloom_new(uint64_t n_entries) {
+        CaBloom *b;
+        uint64_t n_bytes;
+
+        /* Allocates a filter sized for roughly n_entries entries. If the requested size exceeds
+         * CA_BLOOM_SIZE_MAX the filter is clamped instead of refused: an undersized filter merely degrades
+         * the false positive rate, it never produces false negatives. */
+
+        if (n_entries < 1)
+                n_entries = 1;
+
+        n_bytes = (n_entries * CA_BLOOM_BITS_PER_ENTRY + 7) / 8;
+        if (n_bytes < 64)
+                n_bytes = 64;
+        if (n_bytes > CA_BLOOM_SIZE_MAX)
+                n_bytes = CA_BLOOM_SIZE_MAX;
+
+        b = new0(CaBloom, 1);
+        if (!b)
+                return NULL;
+
+        b->bits = new0(uint8_t, n_bytes);
+        if (!b->bits) {
+                free(b);
+                return NULL;
+        }
+
+        b->n_bits = n_bytes * 8;
+        b->n_hash = CA_BLOOM_DEFAULT_N_HASH;
+
+        return b;
+}
+
+CaBloom *ca_bloom_new_from_data(uint64_t n_hash, const void *data, size_t size) {
+        CaBloom *b;
+
+        /* Reconstructs a filter from its serialized bit array, as received from a peer */
+
+        if (n_hash < 1 || n_hash > 64)
+                return NULL;
+        if (!data)
+                return NULL;
+        if (size < 1 || size > CA_BLOOM_SIZE_MAX)
+                return NULL;
+
+        b = new0(CaBloom, 1);
+        if (!b)
+                return NULL;
+
+        b->bits = memdup(data, size);
+        if (!b->bits) {
+                free(b);
+                return NULL;
+        }
+
+        b->n_bits = (uint64_t) size * 8;
+        b->n_hash = n_hash;
+
+        return b;
+}
+
+CaBloom *ca_bloom_unref(CaBloom *b) {
+        if (!b)
+                return NULL;
+
+        free(b->bits);
+        return mfree(b);
+}
+
+static uint64_t ca_bloom_bit(CaBloom *b, const CaChunkID *id, uint64_t i) {
+        assert(b);
+        assert(id);
+
+        /* Classic double hashing: the first two 64 bit words of the chunk ID serve as the two hash
+         * functions. Forcing the increment odd guarantees all probes differ for n_bits that aren't
+         * pathological. */
+
+        return (id->u64[0] + i * (id->u64[1] | 1)) % b->n_bits;
+}
+
+int ca_bloom_add(CaBloom *b, const CaChunkID *id) {
+        uint64_t i;
+
+        if (!b)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+
+        for (i = 0; i < b->n_hash; i++) {
+                uint64_t bit = ca_bloom_bit(b, id, i);
+
+                b->bits[bit / 8] |= 1U << (bit % 8);
+        }
+
+        return 0;
+}
+
+int ca_bloom_may_have(CaBloom *b, const CaChunkID *id) {
+        uint64_t i;
+
+        if (!b)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+
+        for (i = 0; i < b->n_hash; i++) {
+                uint64_t bit = ca_bloom_bit(b, id, i);
+
+                if (!(b->bits[bit / 8] & (1U << (bit % 8))))
+                        return 0;
+        }
+
+        return 1;
+}
+
+uint64_t ca_bloom_get_n_hash(CaBloom *b) {
+        assert(b);
+
+        return b->n_hash;
+}
+
+const void *ca_bloom_get_data(CaBloom *b) {
+        assert(b);
+
+        return b->bits;
+}
+
+size_t ca_bloom_get_size(CaBloom *b) {
+        assert(b);
+
+        return b->n_bits / 8;
+}
@@ -0,0 +1,34 @@
+#ifndef foocabloomhfoo
+#define foocabloomhfoo
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include "cachunkid.h"
+
+/* A simple bloom filter over chunk IDs. Since chunk IDs are cryptographic hashes their bits are uniformly
+ * distributed already, hence we don't hash again, but derive the filter's probe positions directly from the
+ * ID via double hashing. A filter never returns false negatives: if ca_bloom_may_have() returns 0 the chunk
+ * was definitely never added. */
+
+typedef struct CaBloom CaBloom;
+
+/* With 10 bits and 7 probes per entry the false positive rate is slightly below 1% */
+#define CA_BLOOM_BITS_PER_ENTRY 10U
+#define CA_BLOOM_DEFAULT_N_HASH 7U
+
+/* Refuse filters larger than this, both when allocating them and when accepting them from peers */
+#define CA_BLOOM_SIZE_MAX (10U*1024U*1024U)
+
+CaBloom *ca_bloom_new(uint64_t n_entries);
+CaBloom *ca_bloom_new_from_data(uint64_t n_hash, const void *data, size_t size);
+CaBloom *ca_bloom_unref(CaBloom *b);
+
+int ca_bloom_add(CaBloom *b, const CaChunkID *id);
+int ca_bloom_may_have(CaBloom *b, const CaChunkID *id);
+
+uint64_t ca_bloom_get_n_hash(CaBloom *b);
+const void *ca_bloom_get_data(CaBloom *b);
+size_t ca_bloom_get_size(CaBloom *b);
+
+#endif
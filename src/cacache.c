@@ -0,0 +1,234 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cacache.h"
+#include "cadigest.h"
+#include "util.h"
+
+struct CaCache {
+        char *path;
+        char *salt;
+        CaDigest *digest;
+        bool mkdir_done;
+};
+
+CaCache *ca_cache_new(void) {
+        CaCache *c;
+
+        c = new0(CaCache, 1);
+        if (!c)
+                return NULL;
+
+        return c;
+}
+
+CaCache *ca_cache_unref(CaCache *c) {
+        if (!c)
+                return NULL;
+
+        free(c->path);
+        free(c->salt);
+        ca_digest_free(c->digest);
+
+        return mfree(c);
+}
+
+int ca_cache_set_path(CaCache *c, const char *path) {
+        if (!c)
+                return -EINVAL;
+        if (isempty(path))
+                return -EINVAL;
+        if (c->path)
+                return -EBUSY;
+
+        c->path = strdup(path);
+        if (!c->path)
+                return -ENOMEM;
+
+        return 0;
+}
+
+int ca_cache_set_salt(CaCache *c, const char *salt) {
+        char *n;
+
+        if (!c)
+                return -EINVAL;
+        if (!salt)
+                return -EINVAL;
+
+        n = strdup(salt);
+        if (!n)
+                return -ENOMEM;
+
+        free(c->salt);
+        c->salt = n;
+        return 0;
+}
+
+static int ca_cache_make_key(
+                CaCache *c,
+                int base_fd,
+                CaLocation *location,
+                char ret_key[CA_CHUNK_ID_FORMAT_MAX],
+                uint64_t *ret_file_size) {
+
+        struct stat st;
+        CaChunkID key_id;
+        char *t;
+        int r;
+
+        assert(c);
+        assert(location);
+        assert(ret_key);
+
+        if (!c->path)
+                return -EUNATCH;
+
+        /* Only payload locations of regular files are cachable: their content is identified by the
+         * file's stat() signature alone. Everything else (entries, filenames, goodbye records) is cheap
+         * to reserialize anyway. */
+        if (location->designator != CA_LOCATION_PAYLOAD)
+                return -ENOTTY;
+        if (isempty(location->path))
+                return -ENOTTY;
+
+        if (fstatat(base_fd, location->path, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                return -errno;
+        if (!S_ISREG(st.st_mode))
+                return -ENOTTY;
+
+        if (!c->digest) {
+                r = ca_digest_new(CA_DIGEST_SHA256, &c->digest);
+                if (r < 0)
+                        return r;
+        }
+
+        if (asprintf(&t, "%s\n%s\n%" PRIu64 "\n%" PRIu64 "\n%" PRIu64,
+                     strempty(c->salt),
+                     location->path,
+                     location->offset,
+                     timespec_to_nsec(st.st_mtim),
+                     (uint64_t) st.st_size) < 0)
+                return -ENOMEM;
+
+        ca_digest_reset(c->digest);
+        ca_digest_write(c->digest, t, strlen(t));
+        free(t);
+
+        if (ca_digest_get_size(c->digest) != sizeof(CaChunkID))
+                return -EINVAL;
+
+        memcpy(&key_id, ca_digest_read(c->digest), sizeof(CaChunkID));
+
+        if (!ca_chunk_id_format(&key_id, ret_key))
+                return -EINVAL;
+
+        if (ret_file_size)
+                *ret_file_size = (uint64_t) st.st_size;
+
+        return 0;
+}
+
+int ca_cache_get(CaCache *c, int base_fd, CaLocation *location, CaChunkID *ret_id, uint64_t *ret_size) {
+        char key[CA_CHUNK_ID_FORMAT_MAX], ids[CA_CHUNK_ID_FORMAT_MAX];
+        uint64_t size, file_size;
+        char *target = NULL;
+        const char *p;
+        CaChunkID id;
+        char *e;
+        int r;
+
+        if (!c)
+                return -EINVAL;
+        if (!location)
+                return -EINVAL;
+        if (!ret_id)
+                return -EINVAL;
+        if (!ret_size)
+                return -EINVAL;
+
+        r = ca_cache_make_key(c, base_fd, location, key, &file_size);
+        if (r < 0)
+                return r;
+
+        p = strjoina(c->path, "/", strndupa(key, 4), "/", key);
+        r = readlink_malloc(p, &target);
+        if (r < 0)
+                return r;
+
+        /* The target has the form <chunk id>:<chunk size> */
+        e = strchr(target, ':');
+        if (!e)
+                goto invalid;
+        if ((size_t) (e - target) != CA_CHUNK_ID_FORMAT_MAX - 1)
+                goto invalid;
+
+        memcpy(ids, target, CA_CHUNK_ID_FORMAT_MAX - 1);
+        ids[CA_CHUNK_ID_FORMAT_MAX - 1] = 0;
+        if (!ca_chunk_id_parse(ids, &id))
+                goto invalid;
+
+        if (safe_atou64(e + 1, &size) < 0)
+                goto invalid;
+        if (size == 0)
+                goto invalid;
+
+        free(target);
+
+        /* Refuse entries pointing past the file's current end, the tail must have changed */
+        if (location->offset + size > file_size)
+                return -ESTALE;
+
+        *ret_id = id;
+        *ret_size = size;
+        return 0;
+
+invalid:
+        free(target);
+        (void) unlink(p);
+        return -ENOENT;
+}
+
+int ca_cache_put(CaCache *c, int base_fd, CaLocation *location, const CaChunkID *id, uint64_t size) {
+        char key[CA_CHUNK_ID_FORMAT_MAX], ids[CA_CHUNK_ID_FORMAT_MAX];
+        char target[CA_CHUNK_ID_FORMAT_MAX + DECIMAL_STR_MAX(uint64_t) + 1];
+        const char *d, *p;
+        int r;
+
+        if (!c)
+                return -EINVAL;
+        if (!location)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+        if (size == 0)
+                return -EINVAL;
+
+        r = ca_cache_make_key(c, base_fd, location, key, NULL);
+        if (r < 0)
+                return r;
+
+        if (!ca_chunk_id_format(id, ids))
+                return -EINVAL;
+
+        if (!c->mkdir_done) {
+                if (mkdir(c->path, 0777) < 0 && errno != EEXIST)
+                        return -errno;
+
+                c->mkdir_done = true;
+        }
+
+        d = strjoina(c->path, "/", strndupa(key, 4));
+        (void) mkdir(d, 0777);
+
+        p = strjoina(d, "/", key);
+        sprintf(target, "%s:%" PRIu64, ids, size);
+
+        if (symlink(target, p) < 0 && errno != EEXIST)
+                return -errno;
+
+        return 0;
+}
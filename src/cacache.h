@@ -0,0 +1,32 @@
+#ifndef foocacachehfoo
+#define foocacachehfoo
+
+#include "cachunkid.h"
+#include "calocation.h"
+
+/* Maps locations in a directory tree's serialization to the chunks they produced in an earlier "make"
+ * run, so that unchanged files need not be rechunked, rehashed and recompressed again. This is the
+ * inverse of the seed cache: where the seed cache resolves a chunk ID to a location, this resolves a
+ * location to a chunk ID.
+ *
+ * Entries are symlinks in a directory hierarchy like a chunk store's: the link name is a digest of the
+ * location (file path, payload offset) plus the referenced file's stat() signature, the link target
+ * carries the chunk ID and chunk size. Since mtime and size are part of the key, entries for modified
+ * files simply stop matching, no explicit invalidation is necessary. */
+
+typedef struct CaCache CaCache;
+
+CaCache *ca_cache_new(void);
+CaCache *ca_cache_unref(CaCache *c);
+
+int ca_cache_set_path(CaCache *c, const char *path);
+
+/* The salt is mixed into every key, and shall identify all encoding parameters that influence the
+ * serialization and its chunking (feature flags, chunk sizes), so that entries made under different
+ * settings never match. */
+int ca_cache_set_salt(CaCache *c, const char *salt);
+
+int ca_cache_get(CaCache *c, int base_fd, CaLocation *location, CaChunkID *ret_id, uint64_t *ret_size);
+int ca_cache_put(CaCache *c, int base_fd, CaLocation *location, const CaChunkID *id, uint64_t size);
+
+#endif
@@ -10,44 +10,298 @@
 #include "def.h"
 #include "util.h"
 
+/* Sized for the deepest/widest fan-out, so that buffers don't depend on the configuration in effect */
 #define CHUNK_PATH_SIZE(prefix, suffix)                                 \
-        (strlen_null(prefix) + 4 + 1 + CA_CHUNK_ID_FORMAT_MAX + strlen_null(suffix))
+        (strlen_null(prefix) +                                          \
+         CA_CHUNK_FANOUT_DIGITS_MAX * CA_CHUNK_FANOUT_LEVELS_MAX + CA_CHUNK_FANOUT_LEVELS_MAX + \
+         CA_CHUNK_ID_FORMAT_MAX + strlen_null(suffix))
+
+bool ca_chunk_fanout_valid(const CaChunkFanout *fanout) {
+        if (!fanout)
+                return false;
+
+        return fanout->digits >= 1 && fanout->digits <= CA_CHUNK_FANOUT_DIGITS_MAX &&
+                fanout->levels >= 1 && fanout->levels <= CA_CHUNK_FANOUT_LEVELS_MAX;
+}
+
+bool ca_chunk_fanout_equal(const CaChunkFanout *a, const CaChunkFanout *b) {
+        assert(a);
+        assert(b);
+
+        return a->digits == b->digits && a->levels == b->levels;
+}
+
+int ca_chunk_fanout_parse(const char *s, CaChunkFanout *ret) {
+        char digits[DECIMAL_STR_MAX(unsigned)];
+        CaChunkFanout f;
+        const char *x;
+        size_t n;
+        int r;
+
+        if (isempty(s))
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        x = strchr(s, 'x');
+        if (!x)
+                return -EINVAL;
+
+        n = x - s;
+        if (n == 0 || n >= sizeof(digits))
+                return -EINVAL;
+
+        memcpy(digits, s, n);
+        digits[n] = 0;
+
+        r = safe_atou(digits, &f.digits);
+        if (r < 0)
+                return r;
+
+        r = safe_atou(x + 1, &f.levels);
+        if (r < 0)
+                return r;
+
+        if (!ca_chunk_fanout_valid(&f))
+                return -ERANGE;
+
+        *ret = f;
+        return 0;
+}
+
+int ca_chunk_fanout_read(int dir_fd, const char *prefix, CaChunkFanout *ret) {
+        char path[strlen_null(prefix) + sizeof(CA_CHUNK_FANOUT_FILENAME)];
+        char contents[DECIMAL_STR_MAX(unsigned) * 2 + 2];
+        ssize_t n;
+        int fd, r;
+
+        /* Reads the persisted fan-out configuration of the store below 'dir_fd'/'prefix'. An absent
+         * configuration file means the classic default layout; that's not an error. Returns > 0 if a
+         * configuration file was found, 0 if the default was assumed. */
+
+        if (dir_fd < 0 && dir_fd != AT_FDCWD)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        sprintf(path, "%s%s", strempty(prefix), CA_CHUNK_FANOUT_FILENAME);
+
+        fd = openat(dir_fd, path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0) {
+                if (errno != ENOENT)
+                        return -errno;
+
+                *ret = CA_CHUNK_FANOUT_DEFAULT;
+                return 0;
+        }
+
+        n = read(fd, contents, sizeof(contents) - 1);
+        safe_close(fd);
+        if (n < 0)
+                return -errno;
+
+        while (n > 0 && strchr(WHITESPACE, contents[n-1]))
+                n--;
+        contents[n] = 0;
+
+        r = ca_chunk_fanout_parse(contents, ret);
+        if (r < 0)
+                return -EBADMSG;
+
+        return 1;
+}
+
+int ca_chunk_fanout_write(int dir_fd, const char *prefix, const CaChunkFanout *fanout) {
+        char path[strlen_null(prefix) + sizeof(CA_CHUNK_FANOUT_FILENAME)];
+        char t[strlen_null(prefix) + sizeof(CA_CHUNK_FANOUT_FILENAME) + 1 + 16 + 4];
+        char contents[DECIMAL_STR_MAX(unsigned) * 2 + 2];
+        int fd, r;
+
+        /* Persists the fan-out configuration, atomically via a temporary file, so that concurrent store
+         * users see either the old or the new layout, never a partial file. */
+
+        if (dir_fd < 0 && dir_fd != AT_FDCWD)
+                return -EINVAL;
+        if (!ca_chunk_fanout_valid(fanout))
+                return -EINVAL;
+
+        sprintf(path, "%s%s", strempty(prefix), CA_CHUNK_FANOUT_FILENAME);
+        sprintf(t, "%s%s.%" PRIx64 ".tmp", strempty(prefix), CA_CHUNK_FANOUT_FILENAME, random_u64());
+        sprintf(contents, "%ux%u\n", fanout->digits, fanout->levels);
+
+        fd = openat(dir_fd, t, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC|O_NOCTTY, 0644);
+        if (fd < 0)
+                return -errno;
+
+        r = loop_write(fd, contents, strlen(contents));
+        safe_close(fd);
+        if (r < 0) {
+                (void) unlinkat(dir_fd, t, 0);
+                return r;
+        }
+
+        if (renameat(dir_fd, t, dir_fd, path) < 0) {
+                r = -errno;
+                (void) unlinkat(dir_fd, t, 0);
+                return r;
+        }
+
+        return 0;
+}
 
 static char* ca_format_chunk_path(
                 const char *prefix,
+                const CaChunkFanout *fanout,
                 const CaChunkID *chunkid,
                 const char *suffix,
                 char buffer[]) {
 
+        char ids[CA_CHUNK_ID_FORMAT_MAX];
         size_t n;
+        unsigned i;
 
         assert(chunkid);
         assert(buffer);
 
+        if (!fanout)
+                fanout = &(const CaChunkFanout) { .digits = 4, .levels = 1 };
+
+        assert(ca_chunk_fanout_valid(fanout));
+
         if (prefix) {
                 n = strlen(prefix);
                 memcpy(buffer, prefix, n);
         } else
                 n = 0;
 
-        ca_chunk_id_format(chunkid, buffer + n + 4 + 1);
-        memcpy(buffer + n, buffer + n + 4 + 1, 4);
-        buffer[n + 4] = '/';
+        ca_chunk_id_format(chunkid, ids);
+
+        for (i = 0; i < fanout->levels; i++) {
+                memcpy(buffer + n, ids + i * fanout->digits, fanout->digits);
+                n += fanout->digits;
+                buffer[n++] = '/';
+        }
+
+        memcpy(buffer + n, ids, CA_CHUNK_ID_FORMAT_MAX - 1);
+        n += CA_CHUNK_ID_FORMAT_MAX - 1;
 
         if (suffix)
-                strcpy(buffer + n + 4 + 1 + CA_CHUNK_ID_FORMAT_MAX - 1, suffix);
+                strcpy(buffer + n, suffix);
+        else
+                buffer[n] = 0;
 
         return buffer;
 }
 
+int ca_chunk_file_format_path(const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid, const char *suffix, char **ret) {
+        char path[CHUNK_PATH_SIZE(prefix, suffix)], *c;
+
+        if (!chunkid)
+                return -EINVAL;
+        if (fanout && !ca_chunk_fanout_valid(fanout))
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        ca_format_chunk_path(prefix, fanout, chunkid, suffix, path);
+
+        c = strdup(path);
+        if (!c)
+                return -ENOMEM;
+
+        *ret = c;
+        return 0;
+}
+
+/* Creates the fan-out directory levels leading up to the last component of 'path', which starts after the
+ * 'prefix_len' prefix characters. Returns > 0 if the deepest level had to be created, 0 if it existed. */
+static int ca_chunk_dir_mkdir(int chunk_fd, char *path, size_t prefix_len) {
+        bool made = false;
+        char *p, *slash;
+
+        for (p = path + prefix_len; (slash = strchr(p, '/')); p = slash + 1) {
+                *slash = 0;
+
+                if (mkdirat(chunk_fd, path, 0777) < 0) {
+                        if (errno != EEXIST) {
+                                int r = -errno;
+                                *slash = '/';
+                                return r;
+                        }
+
+                        made = false;
+                } else
+                        made = true;
+
+                *slash = '/';
+        }
+
+        return made;
+}
+
+/* Opportunistically removes now-empty fan-out directories from the deepest level upward. 'path' names a
+ * file inside them and is truncated in the process. */
+static void ca_chunk_dir_prune(int chunk_fd, char *path, size_t prefix_len) {
+        char *slash;
+
+        for (;;) {
+                slash = strrchr(path, '/');
+                if (!slash || slash < path + prefix_len)
+                        break;
+
+                *slash = 0;
+
+                if (unlinkat(chunk_fd, path, AT_REMOVEDIR) < 0)
+                        break;
+        }
+}
+
 int ca_load_fd(int fd, ReallocBuffer *buffer) {
         uint64_t count = 0;
+        struct stat st;
 
         if (fd < 0)
                 return -EINVAL;
         if (!buffer)
                 return -EINVAL;
 
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        if (S_ISREG(st.st_mode) && st.st_size > 0) {
+                size_t done = 0;
+                void *p;
+
+                /* For regular files we know the size up front, hence grab a buffer of the right size in one
+                 * go and fill it with a single large read, instead of growing the buffer one block at a
+                 * time and copying it around with each growth. We still fall through into the generic loop
+                 * below, which detects EOF (and catches files that grew or shrank in the meantime). */
+
+                if ((uint64_t) st.st_size >= CA_CHUNK_SIZE_LIMIT_MAX)
+                        return -EBADMSG;
+
+                (void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+                p = realloc_buffer_extend(buffer, st.st_size);
+                if (!p)
+                        return -ENOMEM;
+
+                while (done < (size_t) st.st_size) {
+                        ssize_t l;
+
+                        l = read(fd, (uint8_t*) p + done, st.st_size - done);
+                        if (l < 0)
+                                return -errno;
+                        if (l == 0)
+                                break;
+
+                        done += l;
+                }
+
+                realloc_buffer_shorten(buffer, st.st_size - done);
+                count = done;
+        }
+
         for (;;) {
                 ssize_t l;
                 void *p;
@@ -287,6 +541,10 @@ int ca_save_fd(int fd, const void *data, size_t size) {
 }
 
 int ca_save_and_compress_fd(int fd, CaCompressionType compression_type, const void *data, size_t size) {
+        return ca_save_and_compress_fd_level(fd, compression_type, CA_COMPRESSION_LEVEL_DEFAULT, data, size);
+}
+
+int ca_save_and_compress_fd_level(int fd, CaCompressionType compression_type, int level, const void *data, size_t size) {
         CompressorContext context = COMPRESSOR_CONTEXT_INIT;
         uint64_t ccount = 0;
         int r;
@@ -304,7 +562,7 @@ int ca_save_and_compress_fd(int fd, CaCompressionType compression_type, const vo
         if (compression_type >= _CA_COMPRESSION_TYPE_MAX)
                 return -EOPNOTSUPP;
 
-        r = compressor_start_encode(&context, compression_type);
+        r = compressor_start_encode_level(&context, compression_type, level);
         if (r < 0)
                 return r;
 
@@ -417,7 +675,33 @@ finish:
         return r;
 }
 
+int ca_compression_pick_level(CaCompressionType compression_type, int level, const void *p, size_t size) {
+        int e;
+
+        if (level != CA_COMPRESSION_LEVEL_AUTO)
+                return level;
+
+        e = compressor_estimate_entropy(p, size);
+        if (e < 0)
+                return CA_COMPRESSION_LEVEL_DEFAULT;
+
+        /* Nearly random data (jpeg, video, already-compressed payloads) gains nothing from any effort,
+         * hence store it as-is; moderately dense data still compresses, but rarely enough to warrant more
+         * than the fastest level. */
+
+        if (e >= 780)
+                return -ENODATA;
+        if (e >= 640)
+                return compression_type == CA_COMPRESSION_XZ ? 0 : 1;
+
+        return CA_COMPRESSION_LEVEL_DEFAULT;
+}
+
 int ca_compress(CaCompressionType compression_type, const void *data, size_t size, ReallocBuffer *buffer) {
+        return ca_compress_level(compression_type, CA_COMPRESSION_LEVEL_DEFAULT, data, size, buffer);
+}
+
+int ca_compress_level(CaCompressionType compression_type, int level, const void *data, size_t size, ReallocBuffer *buffer) {
         CompressorContext context = COMPRESSOR_CONTEXT_INIT;
         uint64_t ccount = 0;
         int r;
@@ -431,7 +715,7 @@ int ca_compress(CaCompressionType compression_type, const void *data, size_t siz
         if (!data)
                 return -EINVAL;
 
-        r = compressor_start_encode(&context, compression_type);
+        r = compressor_start_encode_level(&context, compression_type, level);
         if (r < 0)
                 return r;
 
@@ -544,45 +828,32 @@ finish:
         return r;
 }
 
-int ca_chunk_file_open(int chunk_fd, const char *prefix, const CaChunkID *chunkid, const char *suffix, int flags) {
+int ca_chunk_file_open(int chunk_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid, const char *suffix, int flags) {
 
         char path[CHUNK_PATH_SIZE(prefix, suffix)];
-        bool made = false;
-        char *slash = NULL;
-        int r, fd;
+        int r, fd, made = 0;
 
-        /* Opens a file below the directory identified by 'chunk_fd', built as <prefix><4ch id prefix>/<id><suffix>. */
+        /* Opens a file below the directory identified by 'chunk_fd', built as <prefix><fan-out dirs>/<id><suffix>. */
 
         if (chunk_fd < 0 && chunk_fd != AT_FDCWD)
                 return -EINVAL;
         if (!chunkid)
                 return -EINVAL;
 
-        ca_format_chunk_path(prefix, chunkid, suffix, path);
+        ca_format_chunk_path(prefix, fanout, chunkid, suffix, path);
 
         if ((flags & O_CREAT) == O_CREAT) {
-                assert_se(slash = strrchr(path, '/'));
-                *slash = 0;
-
-                if (mkdirat(chunk_fd, path, 0777) < 0) {
-                        if (errno != EEXIST)
-                                return -errno;
-                } else
-                        made = true;
-
-                *slash = '/';
+                made = ca_chunk_dir_mkdir(chunk_fd, path, strlen_null(prefix));
+                if (made < 0)
+                        return made;
         }
 
         fd = openat(chunk_fd, path, flags, 0444); /* we mark the chunk files read-only, as they should be considered immutable after creation */
         if (fd < 0) {
                 r = -errno;
 
-                if (made) {
-                        assert(slash);
-                        *slash = 0;
-
-                        (void) unlinkat(chunk_fd, path, AT_REMOVEDIR);
-                }
+                if (made > 0)
+                        ca_chunk_dir_prune(chunk_fd, path, strlen_null(prefix));
 
                 return r;
         }
@@ -590,7 +861,33 @@ int ca_chunk_file_open(int chunk_fd, const char *prefix, const CaChunkID *chunki
         return fd;
 }
 
-static int ca_chunk_file_access(int chunk_fd, const char *prefix, const CaChunkID *chunkid, const char *suffix) {
+int ca_chunk_file_touch(int chunk_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid) {
+        char path[CHUNK_PATH_SIZE(prefix, ca_compressed_chunk_suffix())];
+
+        /* Updates the mtime of a chunk file to now, trying the uncompressed name first and the compressed
+         * name second, mirroring ca_chunk_file_load(). */
+
+        if (chunk_fd < 0 && chunk_fd != AT_FDCWD)
+                return -EINVAL;
+        if (!chunkid)
+                return -EINVAL;
+
+        ca_format_chunk_path(prefix, fanout, chunkid, NULL, path);
+
+        if (utimensat(chunk_fd, path, NULL, AT_SYMLINK_NOFOLLOW) >= 0)
+                return 0;
+        if (errno != ENOENT)
+                return -errno;
+
+        ca_format_chunk_path(prefix, fanout, chunkid, ca_compressed_chunk_suffix(), path);
+
+        if (utimensat(chunk_fd, path, NULL, AT_SYMLINK_NOFOLLOW) < 0)
+                return -errno;
+
+        return 0;
+}
+
+static int ca_chunk_file_access(int chunk_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid, const char *suffix) {
         char path[CHUNK_PATH_SIZE(prefix, suffix)];
 
         if (chunk_fd < 0 && chunk_fd != AT_FDCWD)
@@ -598,7 +895,7 @@ static int ca_chunk_file_access(int chunk_fd, const char *prefix, const CaChunkI
         if (!chunkid)
                 return -EINVAL;
 
-        ca_format_chunk_path(prefix, chunkid, suffix, path);
+        ca_format_chunk_path(prefix, fanout, chunkid, suffix, path);
 
         if (faccessat(chunk_fd, path, F_OK, AT_SYMLINK_NOFOLLOW) < 0)
                 return errno == ENOENT ? 0 : -errno;
@@ -606,29 +903,25 @@ static int ca_chunk_file_access(int chunk_fd, const char *prefix, const CaChunkI
         return 1;
 }
 
-static int ca_chunk_file_unlink(int chunk_fd, const char *prefix, const CaChunkID *chunkid, const char *suffix) {
-        char path[CHUNK_PATH_SIZE(prefix, suffix)], *slash;
+static int ca_chunk_file_unlink(int chunk_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid, const char *suffix) {
+        char path[CHUNK_PATH_SIZE(prefix, suffix)];
 
         if (chunk_fd < 0 && chunk_fd != AT_FDCWD)
                 return -EINVAL;
         if (!chunkid)
                 return -EINVAL;
 
-        ca_format_chunk_path(prefix, chunkid, suffix, path);
+        ca_format_chunk_path(prefix, fanout, chunkid, suffix, path);
 
         if (unlinkat(chunk_fd, path, 0) < 0)
                 return -errno;
 
-        slash = strrchr(path, '/');
-        assert(slash);
-        *slash = 0;
-
-        (void) unlinkat(chunk_fd, path, AT_REMOVEDIR);
+        ca_chunk_dir_prune(chunk_fd, path, strlen_null(prefix));
 
         return 0;
 }
 
-static int ca_chunk_file_rename(int chunk_fd, const char *prefix, const CaChunkID *chunkid, const char *old_suffix, const char *new_suffix) {
+static int ca_chunk_file_rename(int chunk_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid, const char *old_suffix, const char *new_suffix) {
         char old_path[CHUNK_PATH_SIZE(prefix, old_suffix)], new_path[CHUNK_PATH_SIZE(prefix, new_suffix)];
         int r;
 
@@ -637,8 +930,8 @@ static int ca_chunk_file_rename(int chunk_fd, const char *prefix, const CaChunkI
         if (!chunkid)
                 return -EINVAL;
 
-        ca_format_chunk_path(prefix, chunkid, old_suffix, old_path);
-        ca_format_chunk_path(prefix, chunkid, new_suffix, new_path);
+        ca_format_chunk_path(prefix, fanout, chunkid, old_suffix, old_path);
+        ca_format_chunk_path(prefix, fanout, chunkid, new_suffix, new_path);
 
         r = rename_noreplace(chunk_fd, old_path, chunk_fd, new_path);
         if (r < 0)
@@ -647,9 +940,74 @@ static int ca_chunk_file_rename(int chunk_fd, const char *prefix, const CaChunkI
         return 0;
 }
 
+static int ca_chunk_file_open_tmpfile(int chunk_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid) {
+#ifdef O_TMPFILE
+        char path[CHUNK_PATH_SIZE(prefix, NULL)];
+        char *slash;
+        int fd, made;
+
+        /* Opens an anonymous temporary file in the chunk's subdirectory, to be linked into place with
+         * ca_chunk_file_link_tmpfile() when fully written. Compared to the classic visible .tmp name plus
+         * rename scheme this costs only one directory modification per chunk instead of two. */
+
+        if (chunk_fd < 0 && chunk_fd != AT_FDCWD)
+                return -EINVAL;
+        if (!chunkid)
+                return -EINVAL;
+
+        ca_format_chunk_path(prefix, fanout, chunkid, NULL, path);
+
+        made = ca_chunk_dir_mkdir(chunk_fd, path, strlen_null(prefix));
+        if (made < 0)
+                return made;
+
+        assert_se(slash = strrchr(path, '/'));
+        *slash = 0;
+
+        fd = openat(chunk_fd, path, O_TMPFILE|O_WRONLY|O_NOCTTY|O_CLOEXEC, 0444);
+        if (fd < 0) {
+                int r = -errno;
+
+                *slash = '/';
+                if (made > 0)
+                        ca_chunk_dir_prune(chunk_fd, path, strlen_null(prefix));
+
+                return r;
+        }
+
+        return fd;
+#else
+        return -EOPNOTSUPP;
+#endif
+}
+
+static int ca_chunk_file_link_tmpfile(int chunk_fd, int fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid, const char *suffix) {
+        char proc_path[strlen("/proc/self/fd/") + DECIMAL_STR_MAX(int) + 1];
+        char path[CHUNK_PATH_SIZE(prefix, suffix)];
+
+        if (chunk_fd < 0 && chunk_fd != AT_FDCWD)
+                return -EINVAL;
+        if (fd < 0)
+                return -EINVAL;
+        if (!chunkid)
+                return -EINVAL;
+
+        ca_format_chunk_path(prefix, fanout, chunkid, suffix, path);
+
+        sprintf(proc_path, "/proc/self/fd/%i", fd);
+
+        /* linkat() with AT_EMPTY_PATH requires CAP_DAC_READ_SEARCH, hence take the detour through /proc
+         * which works unprivileged */
+        if (linkat(AT_FDCWD, proc_path, chunk_fd, path, AT_SYMLINK_FOLLOW) < 0)
+                return -errno;
+
+        return 0;
+}
+
 int ca_chunk_file_load(
                 int chunk_fd,
                 const char *prefix,
+                const CaChunkFanout *fanout,
                 const CaChunkID *chunkid,
                 CaChunkCompression desired_compression,
                 CaCompressionType compression_type,
@@ -669,14 +1027,14 @@ int ca_chunk_file_load(
         if (!buffer)
                 return -EINVAL;
 
-        fd = ca_chunk_file_open(chunk_fd, prefix, chunkid, NULL, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
+        fd = ca_chunk_file_open(chunk_fd, prefix, fanout, chunkid, NULL, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
         if (fd < 0) {
                 if (fd == -ELOOP) /* If it's a symlink, then it's marked as "missing" */
                         return -EADDRNOTAVAIL;
                 if (fd != -ENOENT)
                         return fd;
 
-                fd = ca_chunk_file_open(chunk_fd, prefix, chunkid, ca_compressed_chunk_suffix(), O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
+                fd = ca_chunk_file_open(chunk_fd, prefix, fanout, chunkid, ca_compressed_chunk_suffix(), O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
                 if (fd == -ELOOP)
                         return -EADDRNOTAVAIL;
                 if (fd < 0)
@@ -707,10 +1065,12 @@ int ca_chunk_file_load(
 int ca_chunk_file_save(
                 int chunk_fd,
                 const char *prefix,
+                const CaChunkFanout *fanout,
                 const CaChunkID *chunkid,
                 CaChunkCompression effective_compression,
                 CaChunkCompression desired_compression,
                 CaCompressionType compression_type,
+                int compression_level,
                 const void *p,
                 uint64_t l) {
 
@@ -736,28 +1096,61 @@ int ca_chunk_file_save(
         if (l <= 0)
                 return -EINVAL;
 
-        r = ca_chunk_file_test(chunk_fd, prefix, chunkid);
+        r = ca_chunk_file_test(chunk_fd, prefix, fanout, chunkid);
         if (r < 0)
                 return r;
         if (r > 0)
                 return -EEXIST;
 
+        if (desired_compression == CA_CHUNK_AS_IS)
+                desired_compression = effective_compression;
+
+        if (desired_compression == CA_CHUNK_COMPRESSED && effective_compression == CA_CHUNK_UNCOMPRESSED) {
+                compression_level = ca_compression_pick_level(compression_type, compression_level, p, l);
+                if (compression_level == -ENODATA)
+                        /* High-entropy chunk: storing it as-is is just as small, and much cheaper. Mixed
+                         * stores are fine, lookups try both forms anyway. */
+                        desired_compression = CA_CHUNK_UNCOMPRESSED;
+        }
+
+        fd = ca_chunk_file_open_tmpfile(chunk_fd, prefix, fanout, chunkid);
+        if (fd >= 0) {
+
+                if (desired_compression == effective_compression)
+                        r = loop_write(fd, p, l);
+                else if (desired_compression == CA_CHUNK_COMPRESSED)
+                        r = ca_save_and_compress_fd_level(fd, compression_type, compression_level, p, l);
+                else {
+                        assert(desired_compression == CA_CHUNK_UNCOMPRESSED);
+                        r = ca_save_and_decompress_fd(fd, p, l);
+                }
+
+                if (r >= 0)
+                        r = ca_chunk_file_link_tmpfile(chunk_fd, fd, prefix, fanout, chunkid,
+                                                       desired_compression == CA_CHUNK_COMPRESSED ? ca_compressed_chunk_suffix() : NULL);
+
+                safe_close(fd);
+                return r;
+        }
+        if (!IN_SET(fd, -EOPNOTSUPP, -EINVAL, -EISDIR))
+                return fd;
+
+        /* The backing file system doesn't support O_TMPFILE, fall back to writing to a visible temporary
+         * name that is renamed into place */
+
         if (asprintf(&suffix, ".%" PRIx64 ".tmp", random_u64()) < 0)
                 return -ENOMEM;
 
-        fd = ca_chunk_file_open(chunk_fd, prefix, chunkid, suffix, O_WRONLY|O_CREAT|O_EXCL|O_NOCTTY|O_CLOEXEC);
+        fd = ca_chunk_file_open(chunk_fd, prefix, fanout, chunkid, suffix, O_WRONLY|O_CREAT|O_EXCL|O_NOCTTY|O_CLOEXEC);
         if (fd < 0) {
                 free(suffix);
                 return fd;
         }
 
-        if (desired_compression == CA_CHUNK_AS_IS)
-                desired_compression = effective_compression;
-
         if (desired_compression == effective_compression)
                 r = loop_write(fd, p, l);
         else if (desired_compression == CA_CHUNK_COMPRESSED)
-                r = ca_save_and_compress_fd(fd, compression_type, p, l);
+                r = ca_save_and_compress_fd_level(fd, compression_type, compression_level, p, l);
         else {
                 assert(desired_compression == CA_CHUNK_UNCOMPRESSED);
                 r = ca_save_and_decompress_fd(fd, p, l);
@@ -766,7 +1159,7 @@ int ca_chunk_file_save(
         if (r < 0)
                 goto fail;
 
-        r = ca_chunk_file_rename(chunk_fd, prefix, chunkid, suffix, desired_compression == CA_CHUNK_COMPRESSED ? ca_compressed_chunk_suffix() : NULL);
+        r = ca_chunk_file_rename(chunk_fd, prefix, fanout, chunkid, suffix, desired_compression == CA_CHUNK_COMPRESSED ? ca_compressed_chunk_suffix() : NULL);
         if (r < 0)
                 goto fail;
 
@@ -774,49 +1167,37 @@ int ca_chunk_file_save(
         return 0;
 
 fail:
-        (void) ca_chunk_file_unlink(chunk_fd, prefix, chunkid, suffix);
+        (void) ca_chunk_file_unlink(chunk_fd, prefix, fanout, chunkid, suffix);
         free(suffix);
         return r;
 }
 
-int ca_chunk_file_mark_missing(int chunk_fd, const char *prefix, const CaChunkID *chunkid) {
+int ca_chunk_file_mark_missing(int chunk_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid) {
         char path[CHUNK_PATH_SIZE(prefix, NULL)];
-        bool made = false;
-        char *slash;
-        int r;
+        int r, made;
 
         if (chunk_fd < 0 && chunk_fd != AT_FDCWD)
                 return -EINVAL;
         if (!chunkid)
                 return -EINVAL;
 
-        r = ca_chunk_file_test(chunk_fd, prefix, chunkid);
+        r = ca_chunk_file_test(chunk_fd, prefix, fanout, chunkid);
         if (r < 0)
                 return r;
         if (r > 0)
                 return -EEXIST;
 
-        ca_format_chunk_path(prefix, chunkid, NULL, path);
-
-        assert_se(slash = strrchr(path, '/'));
-        *slash = 0;
-
-        if (mkdirat(chunk_fd, path, 0777) < 0) {
-                if (errno != EEXIST)
-                        return -errno;
-        } else
-                made = true;
+        ca_format_chunk_path(prefix, fanout, chunkid, NULL, path);
 
-        *slash = '/';
+        made = ca_chunk_dir_mkdir(chunk_fd, path, strlen_null(prefix));
+        if (made < 0)
+                return made;
 
         if (symlinkat("/dev/null", chunk_fd, path) < 0) {
                 r = -errno;
 
-                if (made) {
-                        *slash = 0;
-
-                        (void) unlinkat(chunk_fd, path, AT_REMOVEDIR);
-                }
+                if (made > 0)
+                        ca_chunk_dir_prune(chunk_fd, path, strlen_null(prefix));
 
                 return r;
         }
@@ -824,7 +1205,33 @@ int ca_chunk_file_mark_missing(int chunk_fd, const char *prefix, const CaChunkID
         return 0;
 }
 
-int ca_chunk_file_test(int chunk_fd, const char *prefix, const CaChunkID *chunkid) {
+int ca_chunk_file_prefetch(int chunk_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid) {
+        int fd;
+
+        /* Asks the kernel to start reading the specified chunk file into the page cache, so that a
+         * subsequent load finds the data there. This is how we keep many chunk reads in flight at once on
+         * high-latency backing stores. */
+
+        if (chunk_fd < 0 && chunk_fd != AT_FDCWD)
+                return -EINVAL;
+        if (!chunkid)
+                return -EINVAL;
+
+        fd = ca_chunk_file_open(chunk_fd, prefix, fanout, chunkid, NULL, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
+        if (fd == -ENOENT)
+                fd = ca_chunk_file_open(chunk_fd, prefix, fanout, chunkid, ca_compressed_chunk_suffix(), O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
+        if (fd == -ELOOP) /* If it's a symlink, then it's marked as "missing" */
+                return -EADDRNOTAVAIL;
+        if (fd < 0)
+                return fd;
+
+        (void) posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+        safe_close(fd);
+        return 0;
+}
+
+int ca_chunk_file_test(int chunk_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid) {
         int r;
 
         if (chunk_fd < 0 && chunk_fd != AT_FDCWD)
@@ -832,14 +1239,14 @@ int ca_chunk_file_test(int chunk_fd, const char *prefix, const CaChunkID *chunki
         if (!chunkid)
                 return -EINVAL;
 
-        r = ca_chunk_file_access(chunk_fd, prefix, chunkid, NULL);
+        r = ca_chunk_file_access(chunk_fd, prefix, fanout, chunkid, NULL);
         if (r != 0)
                 return r;
 
-        return ca_chunk_file_access(chunk_fd, prefix, chunkid, ca_compressed_chunk_suffix());
+        return ca_chunk_file_access(chunk_fd, prefix, fanout, chunkid, ca_compressed_chunk_suffix());
 }
 
-int ca_chunk_file_remove(int chunk_fd, const char *prefix, const CaChunkID *chunkid) {
+int ca_chunk_file_remove(int chunk_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid) {
         int r;
 
         if (chunk_fd < 0 && chunk_fd != AT_FDCWD)
@@ -847,9 +1254,9 @@ int ca_chunk_file_remove(int chunk_fd, const char *prefix, const CaChunkID *chun
         if (!chunkid)
                 return -EINVAL;
 
-        r = ca_chunk_file_unlink(chunk_fd, prefix, chunkid, NULL);
+        r = ca_chunk_file_unlink(chunk_fd, prefix, fanout, chunkid, NULL);
         if (r < 0 && r != -ENOENT)
                 return -EINVAL;
 
-        return ca_chunk_file_unlink(chunk_fd, prefix, chunkid, ca_compressed_chunk_suffix());
+        return ca_chunk_file_unlink(chunk_fd, prefix, fanout, chunkid, ca_compressed_chunk_suffix());
 }
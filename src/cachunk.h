@@ -23,16 +23,49 @@ int ca_load_and_compress_fd(int fd, CaCompressionType compression_type, ReallocB
 int ca_save_fd(int fd, const void *data, size_t size);
 int ca_save_and_decompress_fd(int fd, const void *data, size_t size);
 int ca_save_and_compress_fd(int fd, CaCompressionType compression_type, const void *data, size_t size);
+int ca_save_and_compress_fd_level(int fd, CaCompressionType compression_type, int level, const void *data, size_t size);
 
 int ca_decompress(const void *data, size_t size, ReallocBuffer *buffer);
 int ca_compress(CaCompressionType compression_type, const void *data, size_t size, ReallocBuffer *buffer);
+int ca_compress_level(CaCompressionType compression_type, int level, const void *data, size_t size, ReallocBuffer *buffer);
 
-int ca_chunk_file_open(int cache_fd, const char *prefix, const CaChunkID *chunkid, const char *suffix, int flags);
+/* Resolves CA_COMPRESSION_LEVEL_AUTO for a specific chunk payload: a cheap entropy estimate selects
+ * between not compressing at all (returns -ENODATA), a fast level and the algorithm default. Other levels
+ * pass through unmodified. */
+int ca_compression_pick_level(CaCompressionType compression_type, int level, const void *p, size_t size);
 
-int ca_chunk_file_test(int cache_fd, const char *prefix, const CaChunkID *chunkid);
-int ca_chunk_file_load(int cache_fd, const char *prefix, const CaChunkID *chunkid, CaChunkCompression desired_compression, CaCompressionType compression_type, ReallocBuffer *buffer, CaChunkCompression *ret_effective_compression);
-int ca_chunk_file_save(int cache_fd, const char *prefix, const CaChunkID *chunkid, CaChunkCompression effective_compression, CaChunkCompression desired_compression, CaCompressionType compression_type, const void *p, uint64_t l);
-int ca_chunk_file_mark_missing(int cache_fd, const char *prefix, const CaChunkID *chunkid);
-int ca_chunk_file_remove(int chunk_fd, const char *prefix, const CaChunkID *chunkid);
+/* How a chunk store fans its chunk files out into subdirectories: 'levels' nested directory levels of
+ * 'digits' hex digits each, all taken from the front of the chunk ID. The classic layout — and the default
+ * whenever no configuration is present — is a single level of four digits. Stores that deviate persist
+ * their layout in a CA_CHUNK_FANOUT_FILENAME file in the store root, as "<digits>x<levels>". */
+typedef struct CaChunkFanout {
+        unsigned digits;
+        unsigned levels;
+} CaChunkFanout;
+
+#define CA_CHUNK_FANOUT_DEFAULT ((CaChunkFanout) { .digits = 4, .levels = 1 })
+#define CA_CHUNK_FANOUT_DIGITS_MAX 8U
+#define CA_CHUNK_FANOUT_LEVELS_MAX 4U
+#define CA_CHUNK_FANOUT_FILENAME ".fanout"
+
+bool ca_chunk_fanout_valid(const CaChunkFanout *fanout);
+bool ca_chunk_fanout_equal(const CaChunkFanout *a, const CaChunkFanout *b);
+int ca_chunk_fanout_parse(const char *s, CaChunkFanout *ret);
+
+int ca_chunk_fanout_read(int dir_fd, const char *prefix, CaChunkFanout *ret);
+int ca_chunk_fanout_write(int dir_fd, const char *prefix, const CaChunkFanout *fanout);
+
+int ca_chunk_file_format_path(const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid, const char *suffix, char **ret);
+
+/* All of the following take the store's fan-out configuration; NULL means the default layout */
+int ca_chunk_file_open(int cache_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid, const char *suffix, int flags);
+
+int ca_chunk_file_test(int cache_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid);
+int ca_chunk_file_touch(int cache_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid);
+int ca_chunk_file_prefetch(int cache_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid);
+int ca_chunk_file_load(int cache_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid, CaChunkCompression desired_compression, CaCompressionType compression_type, ReallocBuffer *buffer, CaChunkCompression *ret_effective_compression);
+int ca_chunk_file_save(int cache_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid, CaChunkCompression effective_compression, CaChunkCompression desired_compression, CaCompressionType compression_type, int compression_level, const void *p, uint64_t l);
+int ca_chunk_file_mark_missing(int cache_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid);
+int ca_chunk_file_remove(int chunk_fd, const char *prefix, const CaChunkFanout *fanout, const CaChunkID *chunkid);
 
 #endif
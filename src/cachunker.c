@@ -4,6 +4,69 @@
 #include "cachunker.h"
 #include "util.h"
 
+static const char* const ca_chunker_algorithm_table[_CA_CHUNKER_ALGORITHM_MAX] = {
+        [CA_CHUNKER_BUZHASH] = "buzhash",
+        [CA_CHUNKER_FASTCDC] = "fastcdc",
+};
+
+const char *ca_chunker_algorithm_to_string(CaChunkerAlgorithm a) {
+        if (a < 0)
+                return NULL;
+        if (a >= _CA_CHUNKER_ALGORITHM_MAX)
+                return NULL;
+
+        return ca_chunker_algorithm_table[a];
+}
+
+CaChunkerAlgorithm ca_chunker_algorithm_from_string(const char *s) {
+        CaChunkerAlgorithm i;
+
+        if (isempty(s))
+                return _CA_CHUNKER_ALGORITHM_INVALID;
+
+        for (i = 0; i < _CA_CHUNKER_ALGORITHM_MAX; i++)
+                if (streq(ca_chunker_algorithm_table[i], s))
+                        return i;
+
+        return _CA_CHUNKER_ALGORITHM_INVALID;
+}
+
+int ca_chunker_set_algorithm(CaChunker *c, CaChunkerAlgorithm a) {
+        assert(c);
+
+        if (a < 0 || a >= _CA_CHUNKER_ALGORITHM_MAX)
+                return -EINVAL;
+
+        if (a == c->algorithm)
+                return 0;
+
+        if (c->window_size != 0 || c->chunk_size != 0) /* Already started? */
+                return -EBUSY;
+
+        c->algorithm = a;
+        return 0;
+}
+
+/* The gear hash cut masks, for normalized chunking: below the average chunk size a cut needs log2(avg)+2
+ * zero bits, above it log2(avg)-2 suffice. This squeezes the chunk size distribution towards the average
+ * from both sides. The masks cover the topmost bits of the hash since those accumulate the longest data
+ * history — bit i of the gear hash depends on the last i+1 bytes only. */
+static void ca_chunker_setup_gear_masks(CaChunker *c) {
+        unsigned bits = 0;
+        size_t avg;
+
+        assert(c);
+        assert(c->chunk_size_avg >= CA_CHUNK_SIZE_LIMIT_MIN);
+
+        for (avg = c->chunk_size_avg; avg > 1; avg >>= 1)
+                bits++;
+
+        c->gear_mask_strict = bits + 2 >= 64 ? UINT64_MAX :
+                ((UINT64_C(1) << (bits + 2)) - 1) << (62 - bits);
+        c->gear_mask_loose = bits <= 3 ? UINT64_C(1) << 63 :
+                ((UINT64_C(1) << (bits - 2)) - 1) << (66 - bits);
+}
+
 int ca_chunker_set_size(
                 CaChunker *c,
                 size_t min_size,
@@ -79,6 +142,7 @@ int ca_chunker_set_size(
         c->chunk_size_max = max_size;
 
         c->discriminator = discriminator;
+        ca_chunker_setup_gear_masks(c);
 
         /* fprintf(stderr, "Setting min/avg/max chunk size: %zu/%zu/%zu.\n", */
         /*         c->chunk_size_min, c->chunk_size_avg, c->chunk_size_max); */
@@ -153,6 +217,139 @@ static const uint32_t buzhash_table[] = {
         0x7bf7cabc, 0xf9c18d66, 0x593ade65, 0xd95ddf11,
 };
 
+/* The gear table for the FastCDC chunker: one random 64bit constant per byte value. Part of the on-disk
+ * format (it determines where chunk boundaries fall), hence must never change. */
+static const uint64_t gear_table[256] = {
+        UINT64_C(0xbb6a0dc19624bd0a), UINT64_C(0xec0ae81bef5bc252),
+        UINT64_C(0x840504aa20cc1be0), UINT64_C(0x9c16899d535bc878),
+        UINT64_C(0xafae764deb10253e), UINT64_C(0x0e491ef1cd16b8ce),
+        UINT64_C(0xb532e847a754ba32), UINT64_C(0x0a6986f5d828e357),
+        UINT64_C(0x6dda07bfdbf86ab3), UINT64_C(0x552a5a3383cb8af9),
+        UINT64_C(0x6db95818459aab40), UINT64_C(0x2b5a0bc476b9aeaa),
+        UINT64_C(0x1fcc88365bb903f0), UINT64_C(0x36a9a90f4339f5d5),
+        UINT64_C(0x831fc3b85ad7b321), UINT64_C(0x72a764db10c2b644),
+        UINT64_C(0x4017d65a16d383be), UINT64_C(0x4f8e546a5c98b29e),
+        UINT64_C(0x4fbdb4fc562530cb), UINT64_C(0x30fe9386f2f51059),
+        UINT64_C(0x7e32032d7a0abcfb), UINT64_C(0xaeeaeba23475c0bb),
+        UINT64_C(0x48182c1e97676c19), UINT64_C(0x4dac0c6aa0d209d7),
+        UINT64_C(0xf2b563bb8134e6df), UINT64_C(0x159e86c28f53a3c5),
+        UINT64_C(0xa233ba0ab9809ce3), UINT64_C(0xe2399e7d5032dd9c),
+        UINT64_C(0x587c7701b2968b0e), UINT64_C(0xe0b9ac34fccba1b2),
+        UINT64_C(0xefdf1d30a639bc75), UINT64_C(0x63a164b5ac987554),
+        UINT64_C(0x1c93b531d86e24d8), UINT64_C(0x02f2aadee540bccf),
+        UINT64_C(0xde3c07a990fa590f), UINT64_C(0x2275338661ec88c9),
+        UINT64_C(0x27b6cf6d0e40bfcf), UINT64_C(0x167aae8b772c4458),
+        UINT64_C(0xad8c38ad0207137d), UINT64_C(0xcde48bcc4342ea21),
+        UINT64_C(0x9be34255a1143118), UINT64_C(0x87095320c635c507),
+        UINT64_C(0x610f85fba737b704), UINT64_C(0xa5c4946ab790369a),
+        UINT64_C(0x7a7180f6c92cd561), UINT64_C(0x2a945e1cca4fe3a8),
+        UINT64_C(0x1eb9a11f3d8ea9cd), UINT64_C(0x0b11bab9424ffaec),
+        UINT64_C(0x3cc83ca36be9b778), UINT64_C(0x0084b09fca6f7fcd),
+        UINT64_C(0xa789d778b227584b), UINT64_C(0x2af04c4ac9fe6017),
+        UINT64_C(0x2668299f466c6eaa), UINT64_C(0xca6159ac946a3788),
+        UINT64_C(0xf19cccba75b6abeb), UINT64_C(0xeb029fbe3b6cda37),
+        UINT64_C(0xdb134b3e48609a9f), UINT64_C(0x6b0c44e011a5566f),
+        UINT64_C(0x573b4442977ac0e7), UINT64_C(0xccbf141fc9c9b34c),
+        UINT64_C(0xbd00e9a4e4868380), UINT64_C(0x4df2c8ffe37b682e),
+        UINT64_C(0x672d6f97183e1bd0), UINT64_C(0xc6aeea36c3591cc7),
+        UINT64_C(0x165edbc59e0f186b), UINT64_C(0x75e7a61c69941287),
+        UINT64_C(0x76ec41cc589a0a2b), UINT64_C(0x10e1d4548f2c16d3),
+        UINT64_C(0x19bc20f1ecc5af53), UINT64_C(0x4c2e8c6793d09af3),
+        UINT64_C(0x511e5708cdad49d8), UINT64_C(0x21c2d73ab5ff99ad),
+        UINT64_C(0x1dff9535c599327e), UINT64_C(0x633f5ea69f5ce7c1),
+        UINT64_C(0x3a746c6fc16a5f96), UINT64_C(0x53936b60ff69fe1c),
+        UINT64_C(0xbab9f142d01f60f2), UINT64_C(0xf59d27c8efc90e9e),
+        UINT64_C(0x29f6d8b3b281ef63), UINT64_C(0x44edb4d61760bb28),
+        UINT64_C(0xe361a2e1703d8c2e), UINT64_C(0x7f4032cef843f681),
+        UINT64_C(0xaab1d4eecc2d2608), UINT64_C(0x13f71ccf64d263af),
+        UINT64_C(0x7999ae5b87eddd5f), UINT64_C(0x0df18d9374f1cb96),
+        UINT64_C(0x607add21e163b59b), UINT64_C(0xadb0de6d04b83605),
+        UINT64_C(0x3d2a40840234b1ea), UINT64_C(0x7dbe0fd0bf946309),
+        UINT64_C(0x7f40e968d2c0b0cc), UINT64_C(0x895d278484dc6b06),
+        UINT64_C(0x9bec988a47b8a449), UINT64_C(0x20fcfcc7d9a789c2),
+        UINT64_C(0xd080194b6e309250), UINT64_C(0x888966730dc7116f),
+        UINT64_C(0xc925ae6154d334fb), UINT64_C(0x8476a29a3ce33d08),
+        UINT64_C(0xebb5c76715fffd03), UINT64_C(0xc85e0e5f5a09173e),
+        UINT64_C(0x1e0aa5d956613209), UINT64_C(0xe2f0ca05a95e7bbe),
+        UINT64_C(0x634c7241012f415f), UINT64_C(0x57c72d489c2cc7ef),
+        UINT64_C(0x83b9e3c4272ce08b), UINT64_C(0x297d7f70bba7268e),
+        UINT64_C(0xd20afbb24a1263d5), UINT64_C(0x104c80811f51bf8f),
+        UINT64_C(0xcc2ee9d9e01929df), UINT64_C(0x214e185dc7d11df4),
+        UINT64_C(0x24b0d26f1d480829), UINT64_C(0x8dd4ee80d51b4c84),
+        UINT64_C(0x6cabf701cafd065b), UINT64_C(0x173f0f4bf3582869),
+        UINT64_C(0x490975f76bf48e10), UINT64_C(0x239f9b690da11efb),
+        UINT64_C(0xd0d6d668ade972f9), UINT64_C(0xe60cab0acae7505f),
+        UINT64_C(0x9ee5a46a85238aa3), UINT64_C(0xf2c8939cdbfec33f),
+        UINT64_C(0xdcbf299d34b65c85), UINT64_C(0xaa8d1eaf91ec7aaa),
+        UINT64_C(0xfb9df2d3197bf34b), UINT64_C(0x357a3831e743cd12),
+        UINT64_C(0xf5e9ffa4292bc842), UINT64_C(0x8bc46b01b6b93f35),
+        UINT64_C(0xa43e9249471021b1), UINT64_C(0x5d30959f9fbe264f),
+        UINT64_C(0x3df05a09d9722e37), UINT64_C(0x455d940556c8efce),
+        UINT64_C(0xe9a4c0ef26cb196d), UINT64_C(0x4286b91c9c6661ef),
+        UINT64_C(0xf296400c0f89d351), UINT64_C(0x8c47be20287af2c2),
+        UINT64_C(0xb5b3fd3125a2c449), UINT64_C(0x7cf8b07b9194c72a),
+        UINT64_C(0x15439276d758d7a2), UINT64_C(0x4069567f719f0c20),
+        UINT64_C(0x139013a17ac03764), UINT64_C(0xb4b1b54a68d4b9d6),
+        UINT64_C(0xae85a80c4fc89018), UINT64_C(0x6369b45cd7bb1eee),
+        UINT64_C(0xc528e662efb86e5e), UINT64_C(0xb4e4064c6bbaea83),
+        UINT64_C(0x49228a2d435e9d89), UINT64_C(0xff050e308229c1b2),
+        UINT64_C(0x03aa019e13ac21a6), UINT64_C(0xca96f811618921fe),
+        UINT64_C(0x0d0fc1e5c940e40b), UINT64_C(0x879a007d58799acb),
+        UINT64_C(0x0897b7374eb4c58c), UINT64_C(0xf244bd792c1a3ba6),
+        UINT64_C(0x741f1be1f3407681), UINT64_C(0x7f6e265df95a5484),
+        UINT64_C(0x48feaa7037844288), UINT64_C(0x8df9b2f33b64ccd4),
+        UINT64_C(0xbd63342daf131f4f), UINT64_C(0x611f7345a906ae0a),
+        UINT64_C(0xc26291fae5d35f35), UINT64_C(0xe6931b2676a47a22),
+        UINT64_C(0xa4d35dfea49d64f5), UINT64_C(0x71e9eef95fc312d7),
+        UINT64_C(0xb0f37f902236c196), UINT64_C(0x2edd2f6929741d8a),
+        UINT64_C(0x4144236b0aabe2fc), UINT64_C(0xbd065cb720e652d2),
+        UINT64_C(0x2a7698221fb1e3bf), UINT64_C(0x58fd2c792e74af22),
+        UINT64_C(0xae21f0241c0cc670), UINT64_C(0x536f3a28467ca513),
+        UINT64_C(0x483d5a8252d64a67), UINT64_C(0xa5d3739f415e789a),
+        UINT64_C(0xbbc81edfd9985ef3), UINT64_C(0x2d7cab653d86cda3),
+        UINT64_C(0x2a0d8c2b88808f07), UINT64_C(0x755e78118001db6c),
+        UINT64_C(0x39e3802cca22d69f), UINT64_C(0x83fcb5389e71e904),
+        UINT64_C(0x61c85806ccf88ccc), UINT64_C(0xa655f0f41db007c4),
+        UINT64_C(0x4251c0c9938e97b6), UINT64_C(0x89a7d93c04733961),
+        UINT64_C(0x8eaeab18f98ecf54), UINT64_C(0x4d433f86477df47a),
+        UINT64_C(0x1b89ac2b3ce86ea0), UINT64_C(0x652f5abcdaf46811),
+        UINT64_C(0x7ab115a0805283ae), UINT64_C(0xf23835e01484bd72),
+        UINT64_C(0x9b257943e1f873f0), UINT64_C(0x6f6c5c6d3ea1605b),
+        UINT64_C(0xedd898be736e289e), UINT64_C(0x1357c2639ed81ee8),
+        UINT64_C(0xe8e5c840558740b2), UINT64_C(0xb56fd427bac611d7),
+        UINT64_C(0xe7393a9908bf6b20), UINT64_C(0x9b7ff48de90c1f4a),
+        UINT64_C(0x9415afde715533be), UINT64_C(0xaabdcb91f06cd352),
+        UINT64_C(0xc3d4e60fe1a3a80f), UINT64_C(0xc62a17f6bef0d4c7),
+        UINT64_C(0x6e4b5470826033ca), UINT64_C(0x6f8d3385d9193ca3),
+        UINT64_C(0x7d1e85f873bd2910), UINT64_C(0xc3571e8858e5dce9),
+        UINT64_C(0x3572a47389bd9acc), UINT64_C(0x0572a8ebdf196016),
+        UINT64_C(0xaf7c5052d94f9850), UINT64_C(0xa8b29c49133fe189),
+        UINT64_C(0xff9ac84055847c90), UINT64_C(0xbdf8e002eb18e8e2),
+        UINT64_C(0xee04165c9ad0b946), UINT64_C(0x72304b70ba56ea62),
+        UINT64_C(0x742638d08e18d58f), UINT64_C(0xb22539262f58b505),
+        UINT64_C(0x8ae25394cf7b424a), UINT64_C(0xd2ca00e7ec1f2932),
+        UINT64_C(0xe505901dcdc290e0), UINT64_C(0xbc8739da12d43b6f),
+        UINT64_C(0xb4bb0bc58135cc39), UINT64_C(0x770a94f1f750b976),
+        UINT64_C(0xa97a09e1a5892b65), UINT64_C(0xd4270e09c7d79760),
+        UINT64_C(0xfd0208a42d0a8560), UINT64_C(0xff2895a1f818b240),
+        UINT64_C(0x804c42a59174c11b), UINT64_C(0x7ca3ee71a3abbcb2),
+        UINT64_C(0xee854889d0f5043c), UINT64_C(0xe4a6be3ea9d9f492),
+        UINT64_C(0x5e7ae2eb72823477), UINT64_C(0x246578156729dd60),
+        UINT64_C(0xf811aabf21307127), UINT64_C(0x1580fbbafb9e4fb8),
+        UINT64_C(0x5362c3c03d356b6f), UINT64_C(0xcc198e6d1ac6d2de),
+        UINT64_C(0x8f218c5aa7a5b90b), UINT64_C(0x8a26189ff0110ecb),
+        UINT64_C(0xf373ef1dd22d6e47), UINT64_C(0x890457788acf812f),
+        UINT64_C(0x65d18173d96c1774), UINT64_C(0x096acc3c43ce5e2d),
+        UINT64_C(0x6db190bcb5afb7fa), UINT64_C(0x6e7c162bf89fe79d),
+        UINT64_C(0xc92c5c1b97abda5b), UINT64_C(0x786a8a8682300fdb),
+        UINT64_C(0x3d593203deec51ea), UINT64_C(0xe9e3a872a81031ac),
+        UINT64_C(0x1e37c23d5991178d), UINT64_C(0xdb24b6e2fe50cd73),
+        UINT64_C(0x9e297a2de2b6bc09), UINT64_C(0x91067dfd77586fc3),
+        UINT64_C(0xf1326a7738ce51b9), UINT64_C(0xab814f118064684a),
+        UINT64_C(0x9403d7130377e0d0), UINT64_C(0x98ebfd750e7a6642),
+        UINT64_C(0x74e7be3757a3b7cf), UINT64_C(0x6f141440bfbff975),
+};
+
 uint32_t ca_chunker_start(CaChunker *c, const void *p, size_t n) {
         const uint8_t *q = p;
         size_t i;
@@ -195,6 +392,112 @@ static bool shall_break(CaChunker *c, uint32_t v) {
         return (v % c->discriminator) == (c->discriminator - 1);
 }
 
+/* Only bother with the zero run fast path for runs at least this long */
+#define CA_CHUNKER_ZERO_RUN_MIN 1024U
+
+/* How many bytes to scan at most before checking for a zero run again */
+#define CA_CHUNKER_SCAN_STRETCH 1024U
+
+static size_t ca_chunker_skip_zeroes(CaChunker *c, uint32_t *h, size_t *cs, size_t z, bool *ret_cut) {
+        uint32_t cycle[64], constant;
+        size_t limit, jmin, j, i;
+
+        assert(c);
+        assert(h);
+        assert(cs);
+        assert(z > 0);
+        assert(ret_cut);
+        assert(*cs < c->chunk_size_max);
+
+        /* Over a run of zero bytes (preceded by an all-zero window) the buzhash evolves independently of the
+         * data: h' = rol32(h, 1) ^ constant, which makes the sequence of hash values periodic with a period
+         * of 64. Hence precompute the at most 64 distinct values the hash will assume across the run, decide
+         * whether any of them triggers a chunk cut, and if not skip the entire run at memory bandwidth
+         * instead of hashing it byte by byte. The resulting chunk boundaries are exactly the ones the
+         * byte-wise scan would produce. */
+
+        constant = rol32(buzhash_table[0], CA_CHUNKER_WINDOW_SIZE) ^ buzhash_table[0];
+
+        cycle[0] = *h;
+        for (i = 1; i < 64; i++)
+                cycle[i] = rol32(cycle[i-1], 1) ^ constant;
+
+        /* A cut is forced at the maximum chunk size, no need to look beyond it */
+        limit = MIN(z, c->chunk_size_max - *cs);
+
+        /* The hash based cut test is only armed once the minimum chunk size is reached */
+        jmin = *cs + 1 >= c->chunk_size_min ? 1 : c->chunk_size_min - *cs;
+
+        for (j = jmin; j <= limit && j < jmin + 64; j++)
+                if ((cycle[j % 64] % c->discriminator) == c->discriminator - 1) {
+                        *h = cycle[j % 64];
+                        *cs += j;
+                        *ret_cut = true;
+                        return j;
+                }
+
+        /* If 64 consecutive positions don't cut, none further in the run will either */
+
+        if (z >= c->chunk_size_max - *cs) {
+                *h = cycle[limit % 64];
+                *cs += limit;
+                *ret_cut = true;
+                return limit;
+        }
+
+        *h = cycle[z % 64];
+        *cs += z;
+        *ret_cut = false;
+        return z;
+}
+
+static size_t ca_chunker_scan_fastcdc(CaChunker *c, const uint8_t *q, size_t n) {
+        uint64_t h = c->gear;
+        size_t cs = c->chunk_size, k = 0;
+
+        assert(c);
+        assert(q || n == 0);
+
+        if (c->gear_mask_strict == 0) /* Came straight from CA_CHUNKER_INIT, derive the masks now */
+                ca_chunker_setup_gear_masks(c);
+
+        /* The gear hash has an implicit window of 64 bytes — older bytes shift out at the top — so no
+         * position an entire window below the minimum chunk size can influence a cut. Skip there without
+         * hashing at all, which is one of the main speed advantages over the buzhash scan. */
+        if (cs + 64 < c->chunk_size_min) {
+                size_t skip;
+
+                skip = MIN(n, c->chunk_size_min - 64 - cs);
+                cs += skip;
+                k += skip;
+        }
+
+        while (k < n) {
+                h = (h << 1) + gear_table[q[k]];
+                k++;
+                cs++;
+
+                if (cs >= c->chunk_size_max)
+                        goto now;
+                if (cs < c->chunk_size_min)
+                        continue;
+
+                if ((h & (cs < c->chunk_size_avg ? c->gear_mask_strict : c->gear_mask_loose)) == 0)
+                        goto now;
+        }
+
+        c->gear = h;
+        c->chunk_size = cs;
+
+        return (size_t) -1;
+
+now:
+        c->gear = 0;
+        c->chunk_size = 0;
+
+        return k;
+}
+
 size_t ca_chunker_scan(CaChunker *c, const void* p, size_t n) {
         const uint8_t *q = p;
         uint32_t v;
@@ -206,6 +509,9 @@ size_t ca_chunker_scan(CaChunker *c, const void* p, size_t n) {
         /* Scans the specified bytes for chunk borders. Returns (size_t) -1 if no border was discovered, otherwise the
          * chunk size. */
 
+        if (c->algorithm == CA_CHUNKER_FASTCDC)
+                return ca_chunker_scan_fastcdc(c, p, n);
+
         if (c->window_size < CA_CHUNKER_WINDOW_SIZE) {
                 size_t m;
 
@@ -232,7 +538,9 @@ size_t ca_chunker_scan(CaChunker *c, const void* p, size_t n) {
 
         idx = c->chunk_size % CA_CHUNKER_WINDOW_SIZE;
 
-        while (n > 0) {
+        /* For the first window's worth of bytes of each buffer the byte leaving the rolling window has to
+         * come from the window copy we keep in the chunker object. */
+        while (n > 0 && k < CA_CHUNKER_WINDOW_SIZE) {
                 v = ca_chunker_roll(c, c->window[idx], *q);
                 c->chunk_size++;
                 k++;
@@ -247,6 +555,87 @@ size_t ca_chunker_scan(CaChunker *c, const void* p, size_t n) {
                 q++, n--;
         }
 
+        /* After that the leaving byte is available in the input buffer itself, which permits a much tighter
+         * inner loop that neither loads from nor stores to the window copy. Note that the buzhash rolls
+         * through each byte strictly sequentially, hence keep this scalar, but hoist the minimum chunk size
+         * check out of the loop: below it no cut test (i.e. no division) is necessary at all. The scalar scan
+         * proceeds in bounded stretches, so that long zero regions (ubiquitous in sparse VM images) are
+         * detected along the way and fast-forwarded through wholesale. */
+        if (n > 0) {
+                uint32_t h = c->h;
+                size_t cs = c->chunk_size;
+
+                while (n > 0) {
+                        size_t budget;
+
+                        /* If a long zero run lies ahead, and only zeroes leave the hash window, skip
+                         * through it without hashing each byte */
+                        if (n >= CA_CHUNKER_ZERO_RUN_MIN &&
+                            zero_run_size(q - CA_CHUNKER_WINDOW_SIZE, CA_CHUNKER_WINDOW_SIZE) == CA_CHUNKER_WINDOW_SIZE) {
+                                size_t z;
+
+                                z = zero_run_size(q, n);
+                                if (z >= CA_CHUNKER_ZERO_RUN_MIN) {
+                                        size_t skip;
+                                        bool cut;
+
+                                        skip = ca_chunker_skip_zeroes(c, &h, &cs, z, &cut);
+                                        k += skip;
+                                        q += skip, n -= skip;
+
+                                        if (cut) {
+                                                c->h = h;
+                                                c->chunk_size = cs;
+                                                goto now;
+                                        }
+
+                                        continue;
+                                }
+                        }
+
+                        budget = MIN(n, (size_t) CA_CHUNKER_SCAN_STRETCH);
+
+                        while (budget > 0 && cs + 1 < c->chunk_size_min) {
+                                h = rol32(h, 1) ^
+                                    rol32(buzhash_table[q[-CA_CHUNKER_WINDOW_SIZE]], CA_CHUNKER_WINDOW_SIZE) ^
+                                    buzhash_table[*q];
+                                cs++;
+                                k++;
+                                q++, n--, budget--;
+                        }
+
+                        while (budget > 0) {
+                                h = rol32(h, 1) ^
+                                    rol32(buzhash_table[q[-CA_CHUNKER_WINDOW_SIZE]], CA_CHUNKER_WINDOW_SIZE) ^
+                                    buzhash_table[*q];
+                                cs++;
+                                k++;
+                                q++, n--, budget--;
+
+                                if (cs >= c->chunk_size_max ||
+                                    (cs >= c->chunk_size_min && (h % c->discriminator) == c->discriminator - 1)) {
+                                        c->h = h;
+                                        c->chunk_size = cs;
+                                        goto now;
+                                }
+                        }
+                }
+
+                c->h = h;
+                c->chunk_size = cs;
+        }
+
+        /* Bring the window copy up-to-date again for the next invocation, the fast path above didn't
+         * maintain it. */
+        if (k > CA_CHUNKER_WINDOW_SIZE) {
+                size_t pos = c->chunk_size, j;
+
+                for (j = 0; j < CA_CHUNKER_WINDOW_SIZE; j++) {
+                        pos--;
+                        c->window[pos % CA_CHUNKER_WINDOW_SIZE] = *(q - 1 - j);
+                }
+        }
+
         return (size_t) -1;
 
 now:
@@ -256,3 +645,12 @@ now:
 
         return k;
 }
+
+void ca_chunker_restart(CaChunker *c) {
+        assert(c);
+
+        c->h = 0;
+        c->gear = 0;
+        c->chunk_size = 0;
+        c->window_size = 0;
+}
@@ -17,8 +17,25 @@
  * maximum chunk size as avg*4. If they are picked differently the result might be skewed into either direction. */
 #define CA_CHUNKER_DISCRIMINATOR_FROM_AVG(avg) ((size_t) (avg / (-1.42888852e-7 * avg + 1.33237515)))
 
+/* The cut-point selection algorithm. The classic buzhash discriminator is the default, and the only thing
+ * older versions understand. The FastCDC-style gear hash rolls through the data noticeably faster and — due
+ * to its normalized cut-point selection, which applies a stricter cut test below the average chunk size and
+ * a looser one above it — yields a tighter chunk size distribution, improving both dedup and per-chunk
+ * overheads. Which algorithm an index was made with is recorded in its feature flags
+ * (CA_FORMAT_FASTCDC_CHUNKER), since seeds and incremental updates must chunk with the same algorithm to
+ * line up. */
+typedef enum CaChunkerAlgorithm {
+        CA_CHUNKER_BUZHASH = 0,
+        CA_CHUNKER_FASTCDC,
+        _CA_CHUNKER_ALGORITHM_MAX,
+        _CA_CHUNKER_ALGORITHM_INVALID = -1,
+} CaChunkerAlgorithm;
+
 typedef struct CaChunker {
+        CaChunkerAlgorithm algorithm;
+
         uint32_t h;
+        uint64_t gear;
 
         size_t window_size;
         size_t chunk_size;
@@ -29,6 +46,10 @@ typedef struct CaChunker {
 
         size_t discriminator;
 
+        /* FastCDC cut masks: the strict one applies below the average chunk size, the loose one above it */
+        uint64_t gear_mask_strict;
+        uint64_t gear_mask_loose;
+
         uint8_t window[CA_CHUNKER_WINDOW_SIZE];
 } CaChunker;
 
@@ -44,10 +65,20 @@ typedef struct CaChunker {
 /* Set the min/avg/max chunk size. Each parameter may be 0, in which case a default is used. */
 int ca_chunker_set_size(CaChunker *c, size_t min_size, size_t avg_size, size_t max_size);
 
+/* Select the cut-point algorithm. Must be called before the first byte is fed. */
+int ca_chunker_set_algorithm(CaChunker *c, CaChunkerAlgorithm a);
+
+const char *ca_chunker_algorithm_to_string(CaChunkerAlgorithm a);
+CaChunkerAlgorithm ca_chunker_algorithm_from_string(const char *s);
+
 /* Scans the specified data for a chunk border. Returns (size_t) -1 if none was found (and the function should be
  * called with more data later on), or another value indicating the position of a border. */
 size_t ca_chunker_scan(CaChunker *c, const void* p, size_t n);
 
+/* Drops the rolling state, so that the next byte fed starts a fresh chunk. Used to force a cut at a
+ * caller-chosen boundary. */
+void ca_chunker_restart(CaChunker *c);
+
 /* Low-level buzhash functions. Only exported for testing purposes. */
 uint32_t ca_chunker_start(CaChunker *c, const void *p, size_t n);
 uint32_t ca_chunker_roll(CaChunker *c, uint8_t pop_byte, uint8_t push_byte);
@@ -4,10 +4,7 @@
 #include "cachunk.h"
 #include "cachunkid.h"
 
-static char encode_char(uint8_t x) {
-        x &= 0xF;
-        return (x < 10 ? '0' : 'a' - 10) + x;
-}
+static const char hex_chars[16] = "0123456789abcdef";
 
 static int decode_char(char x) {
         if (x >= '0' && x <= '9')
@@ -51,9 +48,11 @@ char* ca_chunk_id_format(const CaChunkID *id, char v[CA_CHUNK_ID_FORMAT_MAX]) {
         assert(id);
         assert(v);
 
+        /* Formatting is on the hot path of listings and store path construction; the table lookup keeps
+         * this a branch-free load/store loop. */
         for (i = 0; i < sizeof(CaChunkID); i++) {
-                v[i*2] = encode_char(id->bytes[i] >> 4);
-                v[i*2+1] = encode_char(id->bytes[i] & 0xF);
+                v[i*2] = hex_chars[id->bytes[i] >> 4];
+                v[i*2+1] = hex_chars[id->bytes[i] & 0xF];
         }
 
         v[sizeof(CaChunkID) * 2] = 0;
@@ -61,13 +60,49 @@ char* ca_chunk_id_format(const CaChunkID *id, char v[CA_CHUNK_ID_FORMAT_MAX]) {
 }
 
 int ca_chunk_id_make(CaDigest *digest, const void *p, size_t l, CaChunkID *ret) {
+        int r;
+
+        if (!p)
+                return -EINVAL;
+
+        r = ca_chunk_id_make_init(digest);
+        if (r < 0)
+                return r;
+
+        r = ca_chunk_id_make_write(digest, p, l);
+        if (r < 0)
+                return r;
+
+        return ca_chunk_id_make_final(digest, l, ret);
+}
+
+int ca_chunk_id_make_init(CaDigest *digest) {
         if (!digest)
                 return -EINVAL;
-        if (!p)
+
+        if (ca_digest_get_size(digest) != sizeof(CaChunkID))
+                return -EINVAL;
+
+        ca_digest_reset(digest);
+        return 0;
+}
+
+int ca_chunk_id_make_write(CaDigest *digest, const void *p, size_t l) {
+        if (!digest)
+                return -EINVAL;
+        if (!p && l > 0)
                 return -EINVAL;
-        if (l < CA_CHUNK_SIZE_LIMIT_MIN)
+
+        ca_digest_write(digest, p, l);
+        return 0;
+}
+
+int ca_chunk_id_make_final(CaDigest *digest, uint64_t size, CaChunkID *ret) {
+        if (!digest)
+                return -EINVAL;
+        if (size < CA_CHUNK_SIZE_LIMIT_MIN)
                 return -EINVAL;
-        if (l > CA_CHUNK_SIZE_LIMIT_MAX)
+        if (size > CA_CHUNK_SIZE_LIMIT_MAX)
                 return -EINVAL;
         if (!ret)
                 return -EINVAL;
@@ -75,9 +110,29 @@ int ca_chunk_id_make(CaDigest *digest, const void *p, size_t l, CaChunkID *ret)
         if (ca_digest_get_size(digest) != sizeof(CaChunkID))
                 return -EINVAL;
 
-        ca_digest_reset(digest);
-        ca_digest_write(digest, p, l);
-
         memcpy(ret, ca_digest_read(digest), sizeof(CaChunkID));
         return 0;
 }
+
+int ca_chunk_id_make_iovec(CaDigest *digest, const struct iovec *iov, size_t n_iov, CaChunkID *ret) {
+        uint64_t size = 0;
+        size_t i;
+        int r;
+
+        if (!iov && n_iov > 0)
+                return -EINVAL;
+
+        r = ca_chunk_id_make_init(digest);
+        if (r < 0)
+                return r;
+
+        for (i = 0; i < n_iov; i++) {
+                r = ca_chunk_id_make_write(digest, iov[i].iov_base, iov[i].iov_len);
+                if (r < 0)
+                        return r;
+
+                size += iov[i].iov_len;
+        }
+
+        return ca_chunk_id_make_final(digest, size, ret);
+}
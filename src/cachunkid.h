@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "cadigest.h"
 
@@ -46,4 +47,15 @@ static inline bool ca_chunk_id_is_null(const CaChunkID *a) {
 
 int ca_chunk_id_make(CaDigest *digest, const void *p, size_t l, CaChunkID *ret);
 
+/* Incremental variant of ca_chunk_id_make(), for callers whose chunk data is not contiguous in memory
+ * (scattered pack extents, splice pipelines): ca_chunk_id_make_init() starts a new chunk on the digest,
+ * ca_chunk_id_make_write() feeds one extent, ca_chunk_id_make_final() checks the accumulated size against
+ * the chunk size limits and returns the ID. */
+int ca_chunk_id_make_init(CaDigest *digest);
+int ca_chunk_id_make_write(CaDigest *digest, const void *p, size_t l);
+int ca_chunk_id_make_final(CaDigest *digest, uint64_t size, CaChunkID *ret);
+
+/* Batched convenience wrapper: hashes a whole chunk scattered over an iovec array in one call. */
+int ca_chunk_id_make_iovec(CaDigest *digest, const struct iovec *iov, size_t n_iov, CaChunkID *ret);
+
 #endif
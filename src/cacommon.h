@@ -11,4 +11,12 @@ typedef enum CaIterate {
         _CA_ITERATE_INVALID = -1,
 } CaIterate;
 
+typedef enum CaSyncMode {
+        CA_SYNC_MODE_NONE,  /* No explicit disk syncing (the default) */
+        CA_SYNC_MODE_BATCH, /* A single syncfs() per written file system when decoding completes */
+        CA_SYNC_MODE_FULL,  /* fsync() every file and directory as it is finalized */
+        _CA_SYNC_MODE_MAX,
+        _CA_SYNC_MODE_INVALID = -1,
+} CaSyncMode;
+
 #endif
@@ -5,12 +5,27 @@ typedef enum CaCompressionType {
         CA_COMPRESSION_XZ,
         CA_COMPRESSION_GZIP,
         CA_COMPRESSION_ZSTD,
+        /* zstd with long-distance matching and a large window, for blob archives of disk images chunked
+         * with big chunk sizes. The frames it produces are regular zstd frames, only the encoder is
+         * configured differently, hence stores mixing both types stay fully interoperable. */
+        CA_COMPRESSION_ZSTD_LDM,
         _CA_COMPRESSION_TYPE_MAX,
         CA_COMPRESSION_DEFAULT = CA_COMPRESSION_ZSTD,
         _CA_COMPRESSION_TYPE_INVALID = -1,
 } CaCompressionType;
 
+/* Compression effort, in the selected algorithm's native scale (xz preset 0-9, gzip level 1-9, zstd
+ * level). The two special values select the algorithm's built-in default, or adaptive per-chunk effort
+ * based on a cheap entropy estimate. */
+#define CA_COMPRESSION_LEVEL_DEFAULT (-1)
+#define CA_COMPRESSION_LEVEL_AUTO (-2)
+
 const char* ca_compression_type_to_string(CaCompressionType c);
 CaCompressionType ca_compression_type_from_string(const char *s);
 
+/* Long-distance matching frames are regular zstd frames as far as signatures and decoding go */
+static inline CaCompressionType ca_compression_type_normalize(CaCompressionType c) {
+        return c == CA_COMPRESSION_ZSTD_LDM ? CA_COMPRESSION_ZSTD : c;
+}
+
 #endif
@@ -0,0 +1,70 @@
+#include "cacrc32c.h"
+#include "util.h"
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+
+uint32_t ca_crc32c(uint32_t crc, const void *p, size_t n) {
+        const uint8_t *q = p;
+
+        crc = ~crc;
+
+        while (n >= sizeof(uint64_t)) {
+                uint64_t v;
+
+                memcpy(&v, q, sizeof(v));
+                crc = (uint32_t) _mm_crc32_u64(crc, v);
+
+                q += sizeof(v);
+                n -= sizeof(v);
+        }
+
+        while (n > 0) {
+                crc = _mm_crc32_u8(crc, *q);
+                q++, n--;
+        }
+
+        return ~crc;
+}
+
+#else
+
+/* Software fallback: byte-wise table CRC. The table is generated once on first use — the values only depend
+ * on the (fixed) polynomial, hence a racing second initialization writes the very same bytes. */
+
+#define CRC32C_POLY UINT32_C(0x82f63b78) /* Castagnoli, reflected */
+
+static uint32_t crc32c_table[256];
+static bool crc32c_table_valid = false;
+
+static void crc32c_table_init(void) {
+        size_t i;
+
+        for (i = 0; i < 256; i++) {
+                uint32_t v = (uint32_t) i;
+                unsigned j;
+
+                for (j = 0; j < 8; j++)
+                        v = (v >> 1) ^ (v & 1 ? CRC32C_POLY : 0);
+
+                crc32c_table[i] = v;
+        }
+
+        crc32c_table_valid = true;
+}
+
+uint32_t ca_crc32c(uint32_t crc, const void *p, size_t n) {
+        const uint8_t *q = p;
+
+        if (!crc32c_table_valid)
+                crc32c_table_init();
+
+        crc = ~crc;
+
+        for (; n > 0; q++, n--)
+                crc = (crc >> 8) ^ crc32c_table[(crc ^ *q) & 0xff];
+
+        return ~crc;
+}
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef foocacrc32chfoo
+#define foocacrc32chfoo
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+/* CRC32C (Castagnoli), as used for cheap link-error detection on protocol frames. This is emphatically not
+ * a cryptographic checksum — it only guards against bit flips and truncation on transports that are already
+ * authenticated, so that the full chunk digest doesn't have to be recomputed for every frame. Uses the
+ * dedicated CPU instruction where the build targets one. */
+
+uint32_t ca_crc32c(uint32_t crc, const void *p, size_t n);
+
+#endif
@@ -1,5 +1,6 @@
 #include <fcntl.h>
 #include <grp.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stddef.h>
 #include <sys/acl.h>
@@ -19,8 +20,11 @@
 #include "cadecoder.h"
 #include "caformat-util.h"
 #include "caformat.h"
+#include "camakebst.h"
 #include "cautil.h"
+#include "copy.h"
 #include "def.h"
+#include "fssize.h"
 #include "realloc-buffer.h"
 #include "reflink.h"
 #include "rm-rf.h"
@@ -63,6 +67,47 @@ typedef struct CaDecoderACLEntry {
         };
 } CaDecoderACLEntry;
 
+/* The attribute tail of a finalized regular file (ownership, permissions, extended attributes,
+ * capabilities, timestamp), applied by one of the worker threads. Jobs operate on a duplicate of the
+ * file's fd exclusively, hence never interfere with the decoder's directory traversal, and plain files
+ * inherit nothing from each other at this stage. Everything that does have ordering or inheritance
+ * semantics (directories, ACLs, SELinux labels, chattr flags, the rename into place) stays on the
+ * decoder's own thread.
+ *
+ * Alternatively a job removes one stale directory entry (see delete_name below): with deletion enabled,
+ * subtrees that aren't in the archive are purged by the pool too, in parallel and overlapping with
+ * extraction, since nothing the decoder still has to write can collide with a name it is about to
+ * remove. */
+typedef struct CaDecoderApplyJob {
+        struct CaDecoderApplyJob *next;
+
+        int fd;
+
+        bool change_owner;
+        uid_t uid;
+        gid_t gid;
+
+        bool change_mode;
+        mode_t mode;
+
+        bool apply_xattrs;
+        CaDecoderExtendedAttribute *xattrs_first, *xattrs_last;
+
+        bool set_fcaps;
+        bool drop_fcaps;
+        void *fcaps;
+        size_t fcaps_size;
+
+        bool change_mtime;
+        uint64_t mtime;
+
+        /* When set this is a deletion job: remove this entry beneath the directory fd refers to. The
+         * mtime fields above then carry the directory's timestamp, to be restored once the removal —
+         * which just altered it — is complete. */
+        char *delete_name;
+        RemoveFlags delete_flags;
+} CaDecoderApplyJob;
+
 typedef struct CaDecoderNode {
         int fd;
 
@@ -117,6 +162,11 @@ typedef struct CaDecoderNode {
         bool hardlinked;
 } CaDecoderNode;
 
+typedef struct CaDecoderSyncFs {
+        dev_t dev;
+        int fd;
+} CaDecoderSyncFs;
+
 typedef enum CaDecoderState {
         CA_DECODER_INIT,
         CA_DECODER_ENTERED,
@@ -197,6 +247,10 @@ struct CaDecoder {
         char *cached_user_name;
         char *cached_group_name;
 
+        /* I/O geometry of the extraction target, so that writes and hole punching can align to it, see
+         * probe_file_system_geometry() */
+        CaFsGeometry geometry;
+
         /* A cached pair of st_dev and magic, so that we don't have to call statfs() for each file */
         dev_t cached_st_dev;
         statfs_f_type_t cached_magic;
@@ -209,11 +263,41 @@ struct CaDecoder {
         bool delete:1;
         bool payload:1;
         bool undo_immutable:1;
+        bool payload_clone_impossible:1;
+
+        CaSyncMode sync_mode;
+
+        /* In batch sync mode: one entry per file system we wrote to, so that we can issue exactly one
+         * syncfs() for each when we are done */
+        CaDecoderSyncFs *sync_fs;
+        size_t n_sync_fs;
+        size_t sync_fs_allocated;
+
+        /* Worker threads applying the attribute tail of regular files, see CaDecoderApplyJob above */
+        size_t n_threads;
+
+        pthread_t *workers;
+        size_t n_workers;
+        bool workers_exit;
+        int worker_error;
+        pthread_mutex_t job_mutex;
+        pthread_cond_t job_submitted_cond;
+        pthread_cond_t job_finished_cond;
+        CaDecoderApplyJob *job_queue, *job_queue_tail;
+        size_t n_jobs;
 
         uint64_t n_punch_holes_bytes;
         uint64_t n_reflink_bytes;
         uint64_t n_hardlink_bytes;
 
+        /* Write coalescing for block device targets: payload is gathered in an aligned multi-megabyte
+         * buffer and written out in large, aligned chunks, see ca_decoder_batch_write() */
+        uint8_t *batch_buffer;
+        size_t batch_fill;
+        size_t batch_limit;
+        bool direct_io:1;        /* Caller asked for O_DIRECT on block device targets */
+        bool direct_io_active:1; /* We actually turned it on on the output fd */
+
         uid_t uid_shift;
         uid_t uid_range; /* uid_range == 0 means "full range" */
 
@@ -295,9 +379,350 @@ CaDecoder *ca_decoder_new(void) {
         d->delete = true;
         d->payload = true;
 
+        d->job_mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+        d->job_submitted_cond = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+        d->job_finished_cond = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+
         return d;
 }
 
+static CaDecoderApplyJob *ca_decoder_apply_job_free(CaDecoderApplyJob *j) {
+        if (!j)
+                return NULL;
+
+        while (j->xattrs_first) {
+                CaDecoderExtendedAttribute *x = j->xattrs_first;
+
+                j->xattrs_first = x->next;
+                free(x);
+        }
+
+        safe_close(j->fd);
+        free(j->fcaps);
+        free(j->delete_name);
+        return mfree(j);
+}
+
+static int ca_decoder_apply_job_run(CaDecoderApplyJob *j) {
+        assert(j);
+        assert(j->fd >= 0);
+
+        /* Runs on a worker thread. The order of operations matches the synchronous path in
+         * ca_decoder_finalize_child(): the chown() comes first as it drops set-user-id bits and file
+         * capabilities, the timestamp goes last. */
+
+        if (j->delete_name) {
+                int r;
+
+                r = rm_rf_at(j->fd, j->delete_name, j->delete_flags);
+                if (r < 0)
+                        return r;
+
+                if (j->change_mtime) {
+                        struct timespec ts[2] = {
+                                { .tv_nsec = UTIME_OMIT },
+                                nsec_to_timespec(j->mtime),
+                        };
+
+                        if (futimens(j->fd, ts) < 0)
+                                return -errno;
+                }
+
+                return 0;
+        }
+
+        if (j->change_owner)
+                if (fchown(j->fd, j->uid, j->gid) < 0)
+                        return -errno;
+
+        if (j->change_mode)
+                if (fchmod(j->fd, j->mode) < 0)
+                        return -errno;
+
+        if (j->apply_xattrs) {
+                CaDecoderExtendedAttribute *x;
+                size_t space = 256;
+                ssize_t l;
+                char *p, *q;
+
+                p = new(char, space);
+                if (!p)
+                        return -ENOMEM;
+
+                for (;;) {
+                        l = flistxattr(j->fd, p, space);
+                        if (l < 0) {
+                                if (IN_SET(errno, EOPNOTSUPP, EBADF)) {
+                                        p = mfree(p);
+                                        l = 0;
+                                        break;
+                                }
+
+                                if (errno != ERANGE) {
+                                        free(p);
+                                        return -errno;
+                                }
+                        } else
+                                break;
+
+                        free(p);
+
+                        if (space*2 <= space)
+                                return -ENOMEM;
+
+                        space *= 2;
+                        p = new(char, space);
+                        if (!p)
+                                return -ENOMEM;
+                }
+
+                /* Remove xattrs set that don't appear in our list */
+                q = p;
+                for (;;) {
+                        bool found = false;
+                        size_t z;
+
+                        if (l == 0)
+                                break;
+
+                        z = strlen(q);
+                        assert(z + 1 <= (size_t) l);
+
+                        if (!ca_xattr_name_store(q))
+                                goto next;
+
+                        for (x = j->xattrs_first; x; x = x->next)
+                                if (streq((char*) x->format.name_and_value, q)) {
+                                        found = true;
+                                        break;
+                                }
+
+                        if (found)
+                                goto next;
+
+                        if (fremovexattr(j->fd, q) < 0) {
+                                int r = -errno;
+
+                                free(p);
+                                return r;
+                        }
+
+                next:
+                        q += z + 1;
+                        l -= z + 1;
+                }
+
+                free(p);
+
+                for (x = j->xattrs_first; x; x = x->next) {
+                        size_t k;
+
+                        k = strlen((char*) x->format.name_and_value);
+
+                        if (fsetxattr(j->fd, (char*) x->format.name_and_value,
+                                      x->format.name_and_value + k + 1,
+                                      read_le64(&x->format.header.size) - offsetof(CaFormatXAttr, name_and_value) - k - 1,
+                                      0) < 0)
+                                return -errno;
+                }
+        }
+
+        if (j->set_fcaps) {
+                if (fsetxattr(j->fd, "security.capability", j->fcaps, j->fcaps_size, 0) < 0)
+                        return -errno;
+        } else if (j->drop_fcaps) {
+                char v;
+
+                if (fgetxattr(j->fd, "security.capability", &v, sizeof(v)) < 0) {
+                        if (!IN_SET(errno, EOPNOTSUPP, ENODATA))
+                                return -errno;
+                } else if (fremovexattr(j->fd, "security.capability") < 0)
+                        return -errno;
+        }
+
+        if (j->change_mtime) {
+                struct timespec ts[2] = {
+                        { .tv_nsec = UTIME_OMIT },
+                        nsec_to_timespec(j->mtime),
+                };
+
+                if (futimens(j->fd, ts) < 0)
+                        return -errno;
+        }
+
+        return 0;
+}
+
+static void *ca_decoder_worker_thread(void *arg) {
+        CaDecoder *d = arg;
+        int r;
+
+        for (;;) {
+                CaDecoderApplyJob *j;
+
+                assert_se(pthread_mutex_lock(&d->job_mutex) == 0);
+
+                while (!d->job_queue && !d->workers_exit)
+                        assert_se(pthread_cond_wait(&d->job_submitted_cond, &d->job_mutex) == 0);
+
+                if (!d->job_queue) {
+                        assert_se(pthread_mutex_unlock(&d->job_mutex) == 0);
+                        return NULL;
+                }
+
+                j = d->job_queue;
+                d->job_queue = j->next;
+                if (!d->job_queue)
+                        d->job_queue_tail = NULL;
+
+                assert_se(pthread_mutex_unlock(&d->job_mutex) == 0);
+
+                r = ca_decoder_apply_job_run(j);
+                ca_decoder_apply_job_free(j);
+
+                assert_se(pthread_mutex_lock(&d->job_mutex) == 0);
+
+                if (r < 0 && d->worker_error == 0)
+                        d->worker_error = r;
+
+                assert(d->n_jobs > 0);
+                d->n_jobs--;
+
+                assert_se(pthread_cond_broadcast(&d->job_finished_cond) == 0);
+                assert_se(pthread_mutex_unlock(&d->job_mutex) == 0);
+        }
+}
+
+static int ca_decoder_start_workers(CaDecoder *d) {
+        size_t n;
+        int r;
+
+        assert(d);
+
+        if (d->n_workers > 0)
+                return 0;
+
+        n = d->n_threads;
+        if (n == 0) {
+                long v;
+
+                v = sysconf(_SC_NPROCESSORS_ONLN);
+                n = v <= 0 ? 1 : (size_t) v;
+        }
+
+        if (n <= 1) /* No point in a pool for a single thread, apply in-line then */
+                return 0;
+
+        d->workers = new0(pthread_t, n);
+        if (!d->workers)
+                return -ENOMEM;
+
+        d->workers_exit = false;
+        d->worker_error = 0;
+
+        r = 0;
+        for (d->n_workers = 0; d->n_workers < n; d->n_workers++) {
+                r = pthread_create(d->workers + d->n_workers, NULL, ca_decoder_worker_thread, d);
+                if (r != 0)
+                        break;
+        }
+
+        if (d->n_workers == 0) {
+                d->workers = mfree(d->workers);
+                return -r;
+        }
+
+        return 1;
+}
+
+static void ca_decoder_stop_workers(CaDecoder *d) {
+        size_t i;
+
+        assert(d);
+
+        if (d->n_workers == 0)
+                return;
+
+        assert_se(pthread_mutex_lock(&d->job_mutex) == 0);
+        d->workers_exit = true;
+        assert_se(pthread_cond_broadcast(&d->job_submitted_cond) == 0);
+        assert_se(pthread_mutex_unlock(&d->job_mutex) == 0);
+
+        /* The workers drain the queue before exiting */
+        for (i = 0; i < d->n_workers; i++)
+                assert_se(pthread_join(d->workers[i], NULL) == 0);
+
+        d->workers = mfree(d->workers);
+        d->n_workers = 0;
+        d->workers_exit = false;
+}
+
+static int ca_decoder_submit_apply_job(CaDecoder *d, CaDecoderApplyJob *j) {
+        int r;
+
+        assert(d);
+        assert(j);
+        assert(d->n_workers > 0);
+
+        assert_se(pthread_mutex_lock(&d->job_mutex) == 0);
+
+        /* Keep the queue bounded, the stream typically produces small files faster than their
+         * attributes can be applied */
+        while (d->n_jobs >= d->n_workers * 4 && d->worker_error == 0)
+                assert_se(pthread_cond_wait(&d->job_finished_cond, &d->job_mutex) == 0);
+
+        r = d->worker_error;
+        if (r < 0) {
+                assert_se(pthread_mutex_unlock(&d->job_mutex) == 0);
+                ca_decoder_apply_job_free(j);
+                return r;
+        }
+
+        j->next = NULL;
+        if (d->job_queue_tail)
+                d->job_queue_tail->next = j;
+        else
+                d->job_queue = j;
+        d->job_queue_tail = j;
+        d->n_jobs++;
+
+        assert_se(pthread_cond_signal(&d->job_submitted_cond) == 0);
+        assert_se(pthread_mutex_unlock(&d->job_mutex) == 0);
+
+        return 0;
+}
+
+static int ca_decoder_drain_apply_jobs(CaDecoder *d) {
+        int r;
+
+        assert(d);
+
+        if (d->n_workers == 0)
+                return 0;
+
+        assert_se(pthread_mutex_lock(&d->job_mutex) == 0);
+
+        while (d->n_jobs > 0)
+                assert_se(pthread_cond_wait(&d->job_finished_cond, &d->job_mutex) == 0);
+
+        r = d->worker_error;
+        d->worker_error = 0;
+
+        assert_se(pthread_mutex_unlock(&d->job_mutex) == 0);
+
+        return r;
+}
+
+int ca_decoder_set_threads(CaDecoder *d, size_t n_threads) {
+        if (!d)
+                return -EINVAL;
+        if (d->n_workers > 0)
+                return -EBUSY;
+
+        d->n_threads = n_threads;
+        return 0;
+}
+
 static void ca_decoder_node_free_xattrs(CaDecoderNode *n) {
         CaDecoderExtendedAttribute *i;
 
@@ -400,14 +825,24 @@ static void ca_decoder_flush_nodes(CaDecoder *d, size_t leave) {
 }
 
 CaDecoder *ca_decoder_unref(CaDecoder *d) {
+        size_t i;
+
         if (!d)
                 return NULL;
 
+        ca_decoder_stop_workers(d);
+
         ca_decoder_flush_nodes(d, 0);
 
+        for (i = 0; i < d->n_sync_fs; i++)
+                safe_close(d->sync_fs[i].fd);
+        free(d->sync_fs);
+
         realloc_buffer_free(&d->buffer);
         ca_origin_unref(d->buffer_origin);
 
+        free(d->batch_buffer);
+
         free(d->cached_user_name);
         free(d->cached_group_name);
 
@@ -495,6 +930,8 @@ int ca_decoder_set_base_fd(CaDecoder *d, int fd) {
         d->cached_magic = sfs.f_type;
         d->cached_st_dev = st.st_dev;
 
+        (void) probe_file_system_geometry(fd, &d->geometry);
+
         return 0;
 }
 
@@ -541,6 +978,8 @@ int ca_decoder_set_boundary_fd(CaDecoder *d, int fd) {
         d->cached_magic = sfs.f_type;
         d->cached_st_dev = st.st_dev;
 
+        (void) probe_file_system_geometry(fd, &d->geometry);
+
         return 0;
 }
 
@@ -1319,45 +1758,19 @@ static int compare_format_acl_group(const CaFormatACLGroup *a, const CaFormatACL
         return 0;
 }
 
-static const CaFormatGoodbyeItem* format_goodbye_search_inner(
-                const CaFormatGoodbyeItem *table,
-                uint64_t n,
-                uint64_t h,
-                uint64_t i,
-                uint64_t *idx) {
-
-        const CaFormatGoodbyeItem *f;
+static int compare_goodbye_hash(const void *key, const void *item) {
+        const uint64_t *h = key;
+        const CaFormatGoodbyeItem *i = item;
         uint64_t p;
 
-        assert(table);
-
-        if (i >= n)
-                return NULL;
-
-        p = read_le64(&table[i].hash);
+        p = read_le64(&i->hash);
 
-        if (p == h) {
-
-                /* There might be multiple entries with the same hash value in the table. We'll skip *idx of those */
-                if (*idx == 0)
-                        return table + i;
-
-                (*idx) --;
-        }
-
-        if (h <= p) {
-                f = format_goodbye_search_inner(table, n, h, 2*i+1, idx);
-                if (f)
-                        return f;
-        }
-
-        if (h >= p) {
-                f = format_goodbye_search_inner(table, n, h, 2*i+2, idx);
-                if (f)
-                        return f;
-        }
+        if (*h < p)
+                return -1;
+        if (*h > p)
+                return 1;
 
-        return NULL;
+        return 0;
 }
 
 static uint64_t format_goodbye_items(const CaFormatGoodbye *g) {
@@ -1381,6 +1794,7 @@ static const CaFormatGoodbyeItem* format_goodbye_search(
                 uint64_t idx) {
 
         uint64_t n, hash;
+        size_t i;
 
         assert(g);
         assert(name);
@@ -1391,7 +1805,26 @@ static const CaFormatGoodbyeItem* format_goodbye_search(
         if (n == UINT64_MAX)
                 return NULL;
 
-        return format_goodbye_search_inner(g->items, n, hash, 0, &idx);
+        /* The table is stored in ca_make_bst() layout, hence look it up with the matching iterative query:
+         * a single monotonic descent instead of recursively exploring both subtrees. There might be multiple
+         * entries with the same hash value in the table; those are adjacent in the tree's order, so the
+         * idx-th of them is reached by stepping to the in-order successor idx times. */
+
+        i = ca_bst_find(g->items, (size_t) n, sizeof(CaFormatGoodbyeItem), &hash, compare_goodbye_hash);
+        if (i == (size_t) -1)
+                return NULL;
+
+        while (idx > 0) {
+                i = ca_bst_successor((size_t) n, i);
+                if (i == (size_t) -1)
+                        return NULL;
+                if (read_le64(&g->items[i].hash) != hash)
+                        return NULL;
+
+                idx--;
+        }
+
+        return g->items + i;
 }
 
 static int path_get_component(const char **p, char **ret) {
@@ -3249,6 +3682,70 @@ static inline void* safe_bsearch(
         return bsearch(key, base, nmemb, size, fn);
 }
 
+static int ca_decoder_maybe_submit_delete_job(CaDecoder *d, CaDecoderNode *n, const char *name) {
+        CaDecoderApplyJob *j;
+        int r;
+
+        assert(d);
+        assert(n);
+        assert(name);
+
+        /* Hands the removal of one stale directory entry off to the worker pool, if possible. Stale
+         * subtrees are independent of anything the decoder still has to extract — their names aren't in
+         * the archive — hence they may be purged in parallel, overlapping with the extraction instead of
+         * stalling it. Returns > 0 if the job was submitted, 0 if the synchronous path shall be taken
+         * instead. */
+
+        if (d->n_threads == 1)
+                return 0;
+        if (n->fd < 0)
+                return 0;
+
+        r = ca_decoder_start_workers(d);
+        if (r < 0)
+                return r;
+        if (d->n_workers == 0)
+                return 0;
+
+        j = new0(CaDecoderApplyJob, 1);
+        if (!j)
+                return -ENOMEM;
+
+        j->fd = -1;
+
+        j->delete_name = strdup(name);
+        if (!j->delete_name) {
+                r = -ENOMEM;
+                goto fail;
+        }
+
+        j->delete_flags = REMOVE_ROOT|REMOVE_PHYSICAL|(d->undo_immutable ? REMOVE_UNDO_IMMUTABLE : 0);
+
+        /* The removal bumps the directory's mtime, have the job put it back when it's done. Whichever of
+         * the job and the synchronous attribute replay runs last writes the same, correct value. */
+        if (n->entry &&
+            (d->replay_feature_flags & (CA_FORMAT_WITH_SEC_TIME|CA_FORMAT_WITH_USEC_TIME|CA_FORMAT_WITH_NSEC_TIME|CA_FORMAT_WITH_2SEC_TIME))) {
+                j->change_mtime = true;
+                j->mtime = read_le64(&n->entry->mtime);
+        }
+
+        j->fd = fcntl(n->fd, F_DUPFD_CLOEXEC, 3);
+        if (j->fd < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        r = ca_decoder_submit_apply_job(d, j); /* consumes the job, even on failure */
+        if (r < 0)
+                return r;
+
+        return 1;
+
+fail:
+        ca_decoder_apply_job_free(j);
+        return r;
+}
+
 static int ca_decoder_node_delete(CaDecoder *d, CaDecoderNode *n) {
         int r, fd_copy;
         mode_t mode;
@@ -3308,6 +3805,12 @@ static int ca_decoder_node_delete(CaDecoder *d, CaDecoderNode *n) {
                 if (safe_bsearch(&key, n->dirents, n->n_dirents, sizeof(char*), comparison_fn_strcmpp))
                         continue;
 
+                r = ca_decoder_maybe_submit_delete_job(d, n, de->d_name);
+                if (r < 0)
+                        goto finish;
+                if (r > 0)
+                        continue;
+
                 r = rm_rf_at(n->fd, de->d_name, REMOVE_ROOT|REMOVE_PHYSICAL|(d->undo_immutable ? REMOVE_UNDO_IMMUTABLE : 0));
                 if (r < 0)
                         goto finish;
@@ -3392,46 +3895,282 @@ static int ca_decoder_install_file(CaDecoder *d, int dir_fd, const char *tempora
                         r = renameat(dir_fd, temporary_name, dir_fd, name) < 0 ? -errno : 0;
         }
 
-        if (r < 0) {
-                if (!IN_SET(r, -ENOTDIR, -EISDIR))
-                        return r;
+        if (r < 0) {
+                if (!IN_SET(r, -ENOTDIR, -EISDIR))
+                        return r;
+
+                /* The destination exists already, and we couldn't rename the file overriding it. This most likely
+                 * happened because we tried to move a directory over a regular file or vice versa. Let's now try to
+                 * swap the temporary file and the destination. If that works, we can remove the temporary file, and
+                 * expose atomic behaviour to the outside. */
+
+                r = renameat2(dir_fd, temporary_name, dir_fd, name, RENAME_EXCHANGE) < 0 ? -errno : 0;
+                if (r == -EPERM && d->undo_immutable) {
+                        /* EPERM could mean the immutable flag was set on the destination, let's see if we can drop that. */
+                        r = drop_immutable(dir_fd, name);
+                        if (r < 0)
+                                return r;
+                        if (r == 0) /* Couldn't change? */
+                                r = -EPERM;
+                        else
+                                r = renameat2(dir_fd, temporary_name, dir_fd, name, RENAME_EXCHANGE) < 0 ? -errno : 0;
+                }
+                if (r < 0) {
+
+                        /* If that didn't work (kernel too old?), then let's remove the destination first, and
+                         * then try again. Of course in this mode we lose atomicity, but it's the best we can
+                         * do */
+
+                        (void) rm_rf_at(dir_fd, name, REMOVE_ROOT|REMOVE_PHYSICAL|(d->undo_immutable ? REMOVE_UNDO_IMMUTABLE : 0));
+
+                        if (renameat(dir_fd, temporary_name, dir_fd, name) < 0)
+                                return -errno;
+                } else {
+                        /* The exchange worked! In that case the temporary name is now the old version, let's remove it */
+
+                        r = rm_rf_at(dir_fd, temporary_name, REMOVE_ROOT|REMOVE_PHYSICAL|(d->undo_immutable ? REMOVE_UNDO_IMMUTABLE : 0));
+                        if (r < 0)
+                                return r;
+                }
+        }
+
+        return 0;
+}
+
+static int ca_decoder_sync_child(CaDecoder *d, CaDecoderNode *child, const struct stat *st) {
+        size_t i;
+        int fd;
+
+        assert(d);
+        assert(child);
+        assert(st);
+
+        /* Entries without an fd of their own (symlinks, device nodes, …) become durable when their
+         * containing directory is synced, which happens when that directory node is finalized itself. */
+        if (child->fd < 0)
+                return 0;
+
+        if (d->sync_mode == CA_SYNC_MODE_FULL) {
+                if (fsync(child->fd) < 0)
+                        return -errno;
+
+                return 0;
+        }
+
+        assert(d->sync_mode == CA_SYNC_MODE_BATCH);
+
+        /* In batch mode we only remember which file systems we touched, and issue one syncfs() per file
+         * system when the whole tree has been written. */
+
+        for (i = 0; i < d->n_sync_fs; i++)
+                if (d->sync_fs[i].dev == st->st_dev)
+                        return 0;
+
+        if (!GREEDY_REALLOC(d->sync_fs, d->sync_fs_allocated, d->n_sync_fs + 1))
+                return -ENOMEM;
+
+        fd = fcntl(child->fd, F_DUPFD_CLOEXEC, 3);
+        if (fd < 0)
+                return -errno;
+
+        d->sync_fs[d->n_sync_fs++] = (CaDecoderSyncFs) {
+                .dev = st->st_dev,
+                .fd = fd,
+        };
+
+        return 0;
+}
+
+static int ca_decoder_sync_file_systems(CaDecoder *d) {
+        int r = 0;
+        size_t i;
+
+        assert(d);
+
+        for (i = 0; i < d->n_sync_fs; i++) {
+                if (syncfs(d->sync_fs[i].fd) < 0 && r == 0)
+                        r = -errno;
+
+                d->sync_fs[i].fd = safe_close(d->sync_fs[i].fd);
+        }
+
+        d->n_sync_fs = 0;
+
+        return r;
+}
+
+static int ca_decoder_maybe_submit_apply_job(CaDecoder *d, CaDecoderNode *child, const struct stat *st) {
+        CaDecoderApplyJob *j;
+        int r;
+
+        assert(d);
+        assert(child);
+        assert(st);
+
+        /* Hands the attribute tail of a plain regular file off to the worker pool, if possible. Returns
+         * > 0 if the attributes are taken care of (possibly there was nothing to do), 0 if the
+         * synchronous path shall be taken instead. */
+
+        if (d->n_threads == 1)
+                return 0;
+        if (child->fd < 0)
+                return 0;
+        if (!S_ISREG(st->st_mode))
+                return 0;
+        if (d->sync_mode != CA_SYNC_MODE_NONE) /* The attributes shall hit the disk with the data */
+                return 0;
+        if (d->replay_feature_flags & (CA_FORMAT_WITH_ACL|CA_FORMAT_WITH_SELINUX|CA_FORMAT_WITH_CHATTR|CA_FORMAT_WITH_FAT_ATTRS))
+                return 0;
+
+        r = ca_decoder_start_workers(d);
+        if (r < 0)
+                return r;
+        if (d->n_workers == 0)
+                return 0;
+
+        j = new0(CaDecoderApplyJob, 1);
+        if (!j)
+                return -ENOMEM;
+
+        j->fd = -1;
+
+        if (d->replay_feature_flags & (CA_FORMAT_WITH_32BIT_UIDS|CA_FORMAT_WITH_16BIT_UIDS|CA_FORMAT_WITH_USER_NAMES)) {
+                uid_t uid;
+                gid_t gid;
+
+                if ((d->replay_feature_flags & CA_FORMAT_WITH_USER_NAMES) && child->user_name) {
+                        r = name_to_uid(d, child->user_name, &uid);
+                        if (r < 0)
+                                goto fail;
+                } else {
+                        uid = (uid_t) read_le64(&child->entry->uid);
+
+                        uid = ca_decoder_shift_uid(d, uid);
+                        if (!uid_is_valid(uid)) {
+                                r = -EINVAL;
+                                goto fail;
+                        }
+                }
+
+                if ((d->replay_feature_flags & CA_FORMAT_WITH_USER_NAMES) && child->group_name) {
+                        r = name_to_gid(d, child->group_name, &gid);
+                        if (r < 0)
+                                goto fail;
+                } else {
+                        gid = (gid_t) read_le64(&child->entry->gid);
+
+                        gid = ca_decoder_shift_gid(d, gid);
+                        if (!gid_is_valid(gid)) {
+                                r = -EINVAL;
+                                goto fail;
+                        }
+                }
+
+                if (st->st_uid != uid || st->st_gid != gid) {
+                        j->change_owner = true;
+                        j->uid = uid;
+                        j->gid = gid;
+                }
+        }
+
+        if (d->replay_feature_flags & CA_FORMAT_WITH_READ_ONLY) {
+
+                if ((st->st_mode & 0400) == 0 || /* not readable? */
+                    !(read_le64(&child->entry->mode) & 0222) != !(st->st_mode & 0200)) { /* writable bit doesn't match what it should be? */
+
+                        mode_t new_mode;
+
+                        new_mode = (st->st_mode & 0444) | 0400;
+
+                        if (read_le64(&child->entry->mode) & 0222)
+                                new_mode |= 0200 |
+                                        ((new_mode & 0040) ? 0020 : 0000) |
+                                        ((new_mode & 0004) ? 0002 : 0000);
+                        else
+                                new_mode &= ~0444;
+
+                        j->change_mode = true;
+                        j->mode = new_mode;
+                }
+
+        } else if (d->replay_feature_flags & CA_FORMAT_WITH_PERMISSIONS) {
+
+                if ((st->st_mode & 07777) != (read_le64(&child->entry->mode) & 07777)) {
+                        j->change_mode = true;
+                        j->mode = read_le64(&child->entry->mode) & 07777;
+                }
+        }
+
+        if (d->replay_feature_flags & CA_FORMAT_WITH_XATTRS) {
+                CaDecoderExtendedAttribute *x;
 
-                /* The destination exists already, and we couldn't rename the file overriding it. This most likely
-                 * happened because we tried to move a directory over a regular file or vice versa. Let's now try to
-                 * swap the temporary file and the destination. If that works, we can remove the temporary file, and
-                 * expose atomic behaviour to the outside. */
+                j->apply_xattrs = true;
 
-                r = renameat2(dir_fd, temporary_name, dir_fd, name, RENAME_EXCHANGE) < 0 ? -errno : 0;
-                if (r == -EPERM && d->undo_immutable) {
-                        /* EPERM could mean the immutable flag was set on the destination, let's see if we can drop that. */
-                        r = drop_immutable(dir_fd, name);
-                        if (r < 0)
-                                return r;
-                        if (r == 0) /* Couldn't change? */
-                                r = -EPERM;
+                for (x = child->xattrs_first; x; x = x->next) {
+                        CaDecoderExtendedAttribute *c;
+                        uint64_t sz;
+
+                        sz = read_le64(&x->format.header.size);
+
+                        c = malloc(offsetof(CaDecoderExtendedAttribute, format) + sz);
+                        if (!c) {
+                                r = -ENOMEM;
+                                goto fail;
+                        }
+
+                        memcpy(&c->format, &x->format, sz);
+                        c->next = c->previous = NULL;
+
+                        if (j->xattrs_last)
+                                j->xattrs_last->next = c;
                         else
-                                r = renameat2(dir_fd, temporary_name, dir_fd, name, RENAME_EXCHANGE) < 0 ? -errno : 0;
+                                j->xattrs_first = c;
+                        j->xattrs_last = c;
                 }
-                if (r < 0) {
+        }
 
-                        /* If that didn't work (kernel too old?), then let's remove the destination first, and
-                         * then try again. Of course in this mode we lose atomicity, but it's the best we can
-                         * do */
+        if (d->replay_feature_flags & CA_FORMAT_WITH_FCAPS) {
 
-                        (void) rm_rf_at(dir_fd, name, REMOVE_ROOT|REMOVE_PHYSICAL|(d->undo_immutable ? REMOVE_UNDO_IMMUTABLE : 0));
+                if (child->have_fcaps) {
+                        j->fcaps = memdup(child->fcaps, child->fcaps_size);
+                        if (!j->fcaps && child->fcaps_size > 0) {
+                                r = -ENOMEM;
+                                goto fail;
+                        }
 
-                        if (renameat(dir_fd, temporary_name, dir_fd, name) < 0)
-                                return -errno;
-                } else {
-                        /* The exchange worked! In that case the temporary name is now the old version, let's remove it */
+                        j->fcaps_size = child->fcaps_size;
+                        j->set_fcaps = true;
+                } else
+                        j->drop_fcaps = true;
+        }
 
-                        r = rm_rf_at(dir_fd, temporary_name, REMOVE_ROOT|REMOVE_PHYSICAL|(d->undo_immutable ? REMOVE_UNDO_IMMUTABLE : 0));
-                        if (r < 0)
-                                return r;
-                }
+        if (d->replay_feature_flags & (CA_FORMAT_WITH_SEC_TIME|CA_FORMAT_WITH_USEC_TIME|CA_FORMAT_WITH_NSEC_TIME|CA_FORMAT_WITH_2SEC_TIME)) {
+                j->change_mtime = true;
+                j->mtime = read_le64(&child->entry->mtime);
         }
 
-        return 0;
+        if (!j->change_owner && !j->change_mode && !j->apply_xattrs &&
+            !j->set_fcaps && !j->drop_fcaps && !j->change_mtime) {
+                /* Nothing to apply for this file after all */
+                ca_decoder_apply_job_free(j);
+                return 1;
+        }
+
+        j->fd = fcntl(child->fd, F_DUPFD_CLOEXEC, 3);
+        if (j->fd < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        r = ca_decoder_submit_apply_job(d, j); /* consumes the job, even on failure */
+        if (r < 0)
+                return r;
+
+        return 1;
+
+fail:
+        ca_decoder_apply_job_free(j);
+        return r;
 }
 
 static int ca_decoder_finalize_child(CaDecoder *d, CaDecoderNode *n, CaDecoderNode *child) {
@@ -3472,8 +4211,19 @@ static int ca_decoder_finalize_child(CaDecoder *d, CaDecoderNode *n, CaDecoderNo
         }
 
         /* If this is a naked file, then exit early, as we don't need to adjust metadata */
-        if (CA_DECODER_IS_NAKED(d))
+        if (CA_DECODER_IS_NAKED(d)) {
+
+                if (d->sync_mode != CA_SYNC_MODE_NONE && child->fd >= 0) {
+                        if (fstat(child->fd, &st) < 0)
+                                return -errno;
+
+                        r = ca_decoder_sync_child(d, child, &st);
+                        if (r < 0)
+                                return r;
+                }
+
                 return 0;
+        }
 
         /* Ignore entries we are not supposed to replay */
         if (S_ISLNK(mode) && (d->replay_feature_flags & CA_FORMAT_WITH_SYMLINKS) == 0)
@@ -3546,6 +4296,14 @@ static int ca_decoder_finalize_child(CaDecoder *d, CaDecoderNode *n, CaDecoderNo
                         return r;
         }
 
+        /* If this is a plain regular file whose attribute replay carries no ordering constraints, hand the
+         * rest off to the worker pool and proceed straight to installing the file. */
+        r = ca_decoder_maybe_submit_apply_job(d, child, &st);
+        if (r < 0)
+                return r;
+        if (r > 0)
+                goto install;
+
         if (d->replay_feature_flags & (CA_FORMAT_WITH_32BIT_UIDS|CA_FORMAT_WITH_16BIT_UIDS|CA_FORMAT_WITH_USER_NAMES)) {
                 uid_t uid;
                 gid_t gid;
@@ -3884,6 +4642,7 @@ static int ca_decoder_finalize_child(CaDecoder *d, CaDecoderNode *n, CaDecoderNo
                         return -errno;
         }
 
+install:
         if (child->temporary_name && child->name) {
                 /* Move the final result into place. Note that the chattr() file attributes we only apply after this,
                  * as they might make prohibit us from renaming the file (consider the "immutable" flag) */
@@ -3969,9 +4728,17 @@ static int ca_decoder_finalize_child(CaDecoder *d, CaDecoderNode *n, CaDecoderNo
                 }
         }
 
+        if (d->sync_mode != CA_SYNC_MODE_NONE) {
+                r = ca_decoder_sync_child(d, child, &st);
+                if (r < 0)
+                        return r;
+        }
+
         return 0;
 }
 
+static int ca_decoder_flush_batch(CaDecoder *d, CaDecoderNode *n);
+
 static void ca_decoder_apply_seek_offset(CaDecoder *d) {
         assert(d);
 
@@ -4149,6 +4916,11 @@ static int ca_decoder_step_node(CaDecoder *d, CaDecoderNode *n) {
         case CA_DECODER_FINALIZE: {
                 CaDecoderNode *saved_child = n;
 
+                /* Flush out whatever the write coalescing still holds before we sync and finalize */
+                r = ca_decoder_flush_batch(d, n);
+                if (r < 0)
+                        return r;
+
                 r = ca_decoder_leave_child(d);
                 if (r < 0)
                         return r;
@@ -4171,6 +4943,10 @@ static int ca_decoder_step_node(CaDecoder *d, CaDecoderNode *n) {
                 if (r < 0)
                         return r;
 
+                r = ca_decoder_sync_file_systems(d);
+                if (r < 0)
+                        return r;
+
                 ca_decoder_enter_state(d, CA_DECODER_EOF);
                 return CA_DECODER_FINISHED;
         }
@@ -4184,6 +4960,11 @@ static int ca_decoder_step_node(CaDecoder *d, CaDecoderNode *n) {
 
                 assert(S_ISREG(mode) || S_ISBLK(mode));
 
+                /* Coalesced writes belong before the seek target, get them out first */
+                r = ca_decoder_flush_batch(d, n);
+                if (r < 0)
+                        return r;
+
                 ca_decoder_enter_state(d, CA_DECODER_SEEKING_TO_OFFSET);
                 ca_decoder_apply_seek_offset(d);
 
@@ -4305,6 +5086,173 @@ static int ca_decoder_step_node(CaDecoder *d, CaDecoderNode *n) {
         return 0;
 }
 
+static int ca_decoder_clone_payload(CaDecoder *d, CaDecoderNode *n, uint64_t size) {
+        uint64_t done = 0, covered = 0;
+        size_t i;
+        int r;
+
+        assert(d);
+        assert(n);
+        assert(n->fd >= 0);
+
+        /* Tries to produce the next payload bytes by cloning them in the kernel directly from the files the
+         * buffer origin points to, instead of writing out the copy we hold in memory. Returns > 0 if the
+         * entire step was cloned (leaving the file offset advanced accordingly), 0 if the caller shall write
+         * the data the regular way. */
+
+        if (!d->reflink)
+                return 0;
+        if (d->payload_clone_impossible)
+                return 0;
+        if (!d->buffer_origin)
+                return 0;
+
+        /* Only bother if the whole step is covered by payload ranges of other files */
+        for (i = 0; covered < size; i++) {
+                CaLocation *l;
+
+                l = ca_origin_get(d->buffer_origin, i);
+                if (!l)
+                        return 0;
+                if (l->designator != CA_LOCATION_PAYLOAD)
+                        return 0;
+                if (l->size == UINT64_MAX)
+                        return 0;
+
+                covered += l->size;
+        }
+
+        for (i = 0; done < size; i++) {
+                CaLocation *l;
+                uint64_t m;
+                int source_fd;
+
+                l = ca_origin_get(d->buffer_origin, i);
+                assert(l);
+
+                m = MIN(l->size, size - done);
+
+                source_fd = ca_location_open(l);
+                if (source_fd < 0)
+                        return 0;
+
+                r = clone_file_range_fd(source_fd, l->offset, n->fd, d->payload_offset + done, m, NULL);
+                safe_close(source_fd);
+                if (r == -ENOSYS) {
+                        /* Not available at all? Then don't try again */
+                        d->payload_clone_impossible = true;
+                        return 0;
+                }
+                if (r < 0)
+                        /* Clones so far wrote the same bytes the caller will now write again, hence no harm done */
+                        return 0;
+
+                done += m;
+        }
+
+        /* clone_file_range_fd() doesn't move the file offset, hence advance it past the cloned range now.
+         * Note that we don't count the bytes here: where the file system actually shares extents the
+         * per-file reflink pass will visit (and account for) these ranges anyway. */
+        if (lseek(n->fd, size, SEEK_CUR) == (off_t) -1)
+                return -errno;
+
+        return 1;
+}
+
+/* Block device targets take large aligned writes a lot better than a stream of chunk-sized ones, hence
+ * gather payload in an aligned buffer of this size before writing it out */
+#define CA_DECODER_WRITE_BATCH_SIZE (4U*1024U*1024U)
+#define CA_DECODER_WRITE_ALIGNMENT 4096U
+
+static int ca_decoder_flush_batch(CaDecoder *d, CaDecoderNode *n) {
+        int r;
+
+        assert(d);
+        assert(n);
+
+        if (d->batch_fill == 0)
+                return 0;
+
+        assert(n->fd >= 0);
+
+        /* O_DIRECT insists on block-aligned writes. The final flush of an extraction is usually shorter
+         * than that, hence turn it off again before issuing it. */
+        if (d->direct_io_active && (d->batch_fill % CA_DECODER_WRITE_ALIGNMENT) != 0) {
+                int fl;
+
+                fl = fcntl(n->fd, F_GETFL);
+                if (fl < 0)
+                        return -errno;
+
+                if (fcntl(n->fd, F_SETFL, fl & ~O_DIRECT) < 0)
+                        return -errno;
+
+                d->direct_io_active = false;
+        }
+
+        r = loop_write(n->fd, d->batch_buffer, d->batch_fill);
+        if (r < 0)
+                return r;
+
+        d->batch_fill = 0;
+        return 0;
+}
+
+static int ca_decoder_batch_write(CaDecoder *d, CaDecoderNode *n, const void *p, size_t size) {
+        int r;
+
+        assert(d);
+        assert(n);
+        assert(p || size == 0);
+        assert(n->fd >= 0);
+
+        if (!d->batch_buffer) {
+                void *q;
+
+                if (posix_memalign(&q, CA_DECODER_WRITE_ALIGNMENT, CA_DECODER_WRITE_BATCH_SIZE) != 0)
+                        return -ENOMEM;
+
+                d->batch_buffer = q;
+
+                /* Flush on a multiple of the device's stripe size, so that every batch covers whole
+                 * stripes and the array needn't read-modify-write its parity */
+                d->batch_limit = CA_DECODER_WRITE_BATCH_SIZE;
+                if (d->geometry.stripe_size >= CA_DECODER_WRITE_ALIGNMENT &&
+                    d->geometry.stripe_size <= CA_DECODER_WRITE_BATCH_SIZE &&
+                    (d->geometry.stripe_size % CA_DECODER_WRITE_ALIGNMENT) == 0)
+                        d->batch_limit = CA_DECODER_WRITE_BATCH_SIZE / d->geometry.stripe_size * d->geometry.stripe_size;
+
+                /* If the caller asked for it, bypass the page cache for the device. If the device doesn't
+                 * take O_DIRECT we quietly stick to buffered writes. */
+                if (d->direct_io) {
+                        int fl;
+
+                        fl = fcntl(n->fd, F_GETFL);
+                        if (fl >= 0 && fcntl(n->fd, F_SETFL, fl | O_DIRECT) >= 0)
+                                d->direct_io_active = true;
+                }
+        }
+
+        while (size > 0) {
+                size_t m;
+
+                m = MIN(size, d->batch_limit - d->batch_fill);
+                memcpy(d->batch_buffer + d->batch_fill, p, m);
+
+                d->batch_fill += m;
+                p = (const uint8_t*) p + m;
+                size -= m;
+
+                if (d->batch_fill == d->batch_limit) {
+                        r = ca_decoder_flush_batch(d, n);
+                        if (r < 0)
+                                return r;
+                }
+        }
+
+        return 0;
+}
+
 static int ca_decoder_advance_buffer(CaDecoder *d, CaDecoderNode *n) {
         int r;
 
@@ -4325,19 +5273,37 @@ static int ca_decoder_advance_buffer(CaDecoder *d, CaDecoderNode *n) {
                         if (mode == (mode_t) -1)
                                 return -EUNATCH;
 
-                        /* If hole punching is supported and we are writing to a regular file, use it */
-                        if (d->punch_holes && S_ISREG(mode)) {
-                                uint64_t n_punched;
-
-                                r = loop_write_with_holes(n->fd, realloc_buffer_data(&d->buffer), d->step_size, &n_punched);
-                                if (r < 0)
-                                        return r;
-
-                                d->n_punch_holes_bytes += n_punched;
-                        } else {
-                                r = loop_write(n->fd, realloc_buffer_data(&d->buffer), d->step_size);
-                                if (r < 0)
-                                        return r;
+                        /* If the payload is coming from files on disk anyway, try to clone it in the kernel
+                         * rather than writing out our in-memory copy */
+                        r = S_ISREG(mode) ? ca_decoder_clone_payload(d, n, d->step_size) : 0;
+                        if (r < 0)
+                                return r;
+                        if (r == 0) {
+                                /* If hole punching is supported and we are writing to a regular file, use it */
+                                if (d->punch_holes && S_ISREG(mode)) {
+                                        uint64_t n_punched;
+
+                                        /* Align the holes to the target geometry, so that neither the
+                                         * punching nor the writes it splits off straddle blocks */
+                                        r = loop_write_with_holes_full(n->fd, realloc_buffer_data(&d->buffer), d->step_size,
+                                                                       d->payload_offset,
+                                                                       MAX(d->geometry.block_size, d->geometry.discard_granularity),
+                                                                       &n_punched);
+                                        if (r < 0)
+                                                return r;
+
+                                        d->n_punch_holes_bytes += n_punched;
+                                } else if (S_ISBLK(mode)) {
+                                        /* Coalesce block device writes into large aligned ones, raw flash
+                                         * in particular handles those much better */
+                                        r = ca_decoder_batch_write(d, n, realloc_buffer_data(&d->buffer), d->step_size);
+                                        if (r < 0)
+                                                return r;
+                                } else {
+                                        r = loop_write(n->fd, realloc_buffer_data(&d->buffer), d->step_size);
+                                        if (r < 0)
+                                                return r;
+                                }
                         }
                 }
 
@@ -4390,7 +5356,17 @@ int ca_decoder_step(CaDecoder *d) {
         if (r < 0)
                 return r;
 
-        return ca_decoder_step_node(d, n);
+        r = ca_decoder_step_node(d, n);
+        if (r == CA_DECODER_FINISHED) {
+                int q;
+
+                /* Before we report completion, wait for all queued attribute jobs to be applied */
+                q = ca_decoder_drain_apply_jobs(d);
+                if (q < 0)
+                        return q;
+        }
+
+        return r;
 }
 
 int ca_decoder_get_request_offset(CaDecoder *d, uint64_t *ret) {
@@ -4452,6 +5428,89 @@ int ca_decoder_put_eof(CaDecoder *d) {
         return 0;
 }
 
+int ca_decoder_can_put_data_fd(CaDecoder *d) {
+        CaDecoderNode *n;
+
+        if (!d)
+                return -EINVAL;
+
+        /* Returns > 0 if the decoder is at a point where payload data would flow to the output file
+         * descriptor verbatim, and nobody needs to see a copy of it in memory: we are decoding a naked
+         * blob, are inside the payload with nothing buffered, and neither digesting, reflinking, hole
+         * punching nor payload delivery to the caller is active. In that case ca_decoder_put_data_fd()
+         * may be used instead of ca_decoder_put_data(), which copies the data to the output inside the
+         * kernel. */
+
+        if (d->state != CA_DECODER_IN_PAYLOAD)
+                return 0;
+        if (!CA_DECODER_IS_NAKED(d))
+                return 0;
+        if (d->eof)
+                return 0;
+        if (realloc_buffer_size(&d->buffer) > 0)
+                return 0;
+        if (d->payload)
+                return 0;
+        if (d->want_archive_digest)
+                return 0;
+        if (d->want_payload_digest && !d->payload_digest_invalid)
+                return 0;
+        if (d->want_hardlink_digest && !d->hardlink_digest_invalid)
+                return 0;
+        if (d->reflink || d->punch_holes)
+                return 0;
+
+        n = ca_decoder_current_node(d);
+        if (!n)
+                return 0;
+        if (n->fd < 0)
+                return 0;
+
+        /* Block device writes go through the write coalescing buffer instead, which beats chunk-by-chunk
+         * kernel copies on raw flash */
+        if (S_ISBLK(ca_decoder_node_mode(n)))
+                return 0;
+
+        return 1;
+}
+
+int ca_decoder_put_data_fd(CaDecoder *d, int fd, uint64_t size) {
+        CaDecoderNode *n;
+        int r;
+
+        if (!d)
+                return -EINVAL;
+        if (fd < 0)
+                return -EINVAL;
+        if (size == 0)
+                return 0;
+
+        r = ca_decoder_can_put_data_fd(d);
+        if (r < 0)
+                return r;
+        if (r == 0)
+                return -ENOTTY;
+
+        assert_se(n = ca_decoder_current_node(d));
+
+        /* Refuse to copy past the end of the payload, anything after it is format data we need to parse */
+        if (n->size != UINT64_MAX && size > n->size - d->payload_offset)
+                return -ENOTTY;
+
+        /* copy_bytes() uses copy_file_range()/sendfile()/splice() where available, i.e. the data moves
+         * from the source file to the output without a trip through our address space */
+        r = copy_bytes(fd, n->fd, size);
+        if (r < 0)
+                return r;
+        if (r == 0) /* EOF before the promised size? Then the source file was truncated */
+                return -EPIPE;
+
+        d->payload_offset += size;
+        d->archive_offset += size;
+
+        return 0;
+}
+
 int ca_decoder_get_payload(CaDecoder *d, const void **ret, size_t *ret_size) {
         CaDecoderNode *n;
         mode_t mode;
@@ -5135,6 +6194,15 @@ int ca_decoder_set_punch_holes(CaDecoder *d, bool enabled) {
         return 0;
 }
 
+int ca_decoder_set_direct_io(CaDecoder *d, bool enabled) {
+
+        if (!d)
+                return -EINVAL;
+
+        d->direct_io = enabled;
+        return 0;
+}
+
 int ca_decoder_set_reflink(CaDecoder *d, bool enabled) {
 
         if (!d)
@@ -5180,6 +6248,17 @@ int ca_decoder_set_undo_immutable(CaDecoder *d, bool enabled) {
         return 0;
 }
 
+int ca_decoder_set_sync_mode(CaDecoder *d, CaSyncMode mode) {
+
+        if (!d)
+                return -EINVAL;
+        if (mode < 0 || mode >= _CA_SYNC_MODE_MAX)
+                return -EINVAL;
+
+        d->sync_mode = mode;
+        return 0;
+}
+
 int ca_decoder_get_punch_holes_bytes(CaDecoder *d, uint64_t *ret) {
         if (!d)
                 return -EINVAL;
@@ -44,12 +44,19 @@ int ca_decoder_set_feature_flags_mask(CaDecoder *d, uint64_t flags);
 
 /* Various booleans to configure the mode of operation */
 int ca_decoder_set_punch_holes(CaDecoder *d, bool enabled);
+int ca_decoder_set_direct_io(CaDecoder *d, bool enabled); /* use O_DIRECT for block device targets */
 int ca_decoder_set_reflink(CaDecoder *d, bool enabled);
 int ca_decoder_set_hardlink(CaDecoder *d, bool enabled);
 int ca_decoder_set_delete(CaDecoder *d, bool enabled);
 int ca_decoder_set_payload(CaDecoder *d, bool enabled);
 int ca_decoder_set_undo_immutable(CaDecoder *d, bool enabled);
 
+/* Number of worker threads to apply file attributes with, 0 for automatic */
+int ca_decoder_set_threads(CaDecoder *d, size_t n_threads);
+
+/* How eagerly to sync written files to disk */
+int ca_decoder_set_sync_mode(CaDecoder *d, CaSyncMode mode);
+
 /* Apply UID shifting */
 int ca_decoder_set_uid_shift(CaDecoder *e, uid_t u);
 int ca_decoder_set_uid_range(CaDecoder *e, uid_t u);
@@ -78,6 +85,8 @@ int ca_decoder_get_skip_size(CaDecoder *d, uint64_t *ret);
 
 /* Input: archive stream data */
 int ca_decoder_put_data(CaDecoder *d, const void *p, size_t size, CaOrigin *origin);
+int ca_decoder_can_put_data_fd(CaDecoder *d);
+int ca_decoder_put_data_fd(CaDecoder *d, int fd, uint64_t size);
 int ca_decoder_put_eof(CaDecoder *d);
 
 /* Output: payload data */
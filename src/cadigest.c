@@ -1,16 +1,34 @@
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
 #include <openssl/sha.h>
 
 #include "cadigest.h"
 #include "util.h"
 
+/* Use the EVP interface rather than the low-level SHA256_xyz()/SHA512_xyz() calls, since only the former is
+ * guaranteed to dispatch at runtime to the fastest implementation for the local CPU (SHA-NI, ARMv8 crypto
+ * extensions, AVX2, …). */
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+#define HAVE_EVP_SHA512_256 1
+#else
+#define HAVE_EVP_SHA512_256 0
+#endif
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
 struct CaDigest {
         CaDigestType type;
         uint8_t result[CONST_MAX(SHA256_DIGEST_LENGTH, SHA512_DIGEST_LENGTH)];
 
-        union {
-                SHA256_CTX sha256;
-                SHA512_CTX sha512;
-        };
+        EVP_MD_CTX *md_ctx;
+
+#if !HAVE_EVP_SHA512_256
+        SHA512_CTX sha512;
+#endif
 };
 
 void ca_digest_reset(CaDigest *d) {
@@ -20,14 +38,16 @@ void ca_digest_reset(CaDigest *d) {
         switch (d->type) {
 
         case CA_DIGEST_SHA256:
-                SHA256_Init(&d->sha256);
+                assert_se(EVP_DigestInit_ex(d->md_ctx, EVP_sha256(), NULL) == 1);
                 break;
 
         case CA_DIGEST_SHA512_256:
 
+#if HAVE_EVP_SHA512_256
+                assert_se(EVP_DigestInit_ex(d->md_ctx, EVP_sha512_256(), NULL) == 1);
+#else
                 /* SHA512/256 is identical to SHA512 truncated to 256 bit, except that the start values are slightly
-                 * different. Since OpenSSL doesn't support them natively, let's hack them in here. As soon as OpenSSL
-                 * learns SHA512/256 natively, let's switch over to that. */
+                 * different. Since older OpenSSL doesn't support them natively, let's hack them in here. */
 
                 SHA512_Init(&d->sha512);
                 d->sha512.h[0] = UINT64_C(0x22312194fc2bf72c);
@@ -38,6 +58,7 @@ void ca_digest_reset(CaDigest *d) {
                 d->sha512.h[5] = UINT64_C(0xbe5e1e2553863992);
                 d->sha512.h[6] = UINT64_C(0x2b0199fc2c85b8aa);
                 d->sha512.h[7] = UINT64_C(0x0eb72ddc81c52ca2);
+#endif
 
                 break;
 
@@ -62,6 +83,12 @@ int ca_digest_new(CaDigestType t, CaDigest **ret) {
 
         d->type = t;
 
+        d->md_ctx = EVP_MD_CTX_new();
+        if (!d->md_ctx) {
+                free(d);
+                return -ENOMEM;
+        }
+
         ca_digest_reset(d);
 
         *ret = d;
@@ -69,6 +96,10 @@ int ca_digest_new(CaDigestType t, CaDigest **ret) {
 }
 
 CaDigest *ca_digest_free(CaDigest *d) {
+        if (!d)
+                return NULL;
+
+        EVP_MD_CTX_free(d->md_ctx);
         return mfree(d);
 }
 
@@ -83,11 +114,15 @@ void ca_digest_write(CaDigest *d, const void *p, size_t l) {
         switch (d->type) {
 
         case CA_DIGEST_SHA256:
-                SHA256_Update(&d->sha256, p, l);
+                assert_se(EVP_DigestUpdate(d->md_ctx, p, l) == 1);
                 break;
 
         case CA_DIGEST_SHA512_256:
+#if HAVE_EVP_SHA512_256
+                assert_se(EVP_DigestUpdate(d->md_ctx, p, l) == 1);
+#else
                 SHA512_Update(&d->sha512, p, l);
+#endif
                 break;
 
         default:
@@ -103,12 +138,17 @@ const void* ca_digest_read(CaDigest *d) {
 
         case CA_DIGEST_SHA256:
                 assert(sizeof(d->result) >= SHA256_DIGEST_LENGTH);
-                SHA256_Final(d->result, &d->sha256);
+                assert_se(EVP_DigestFinal_ex(d->md_ctx, d->result, NULL) == 1);
                 break;
 
         case CA_DIGEST_SHA512_256:
+#if HAVE_EVP_SHA512_256
+                assert(sizeof(d->result) >= SHA256_DIGEST_LENGTH);
+                assert_se(EVP_DigestFinal_ex(d->md_ctx, d->result, NULL) == 1);
+#else
                 assert(sizeof(d->result) >= SHA512_DIGEST_LENGTH);
                 SHA512_Final(d->result, &d->sha512);
+#endif
                 break;
 
         default:
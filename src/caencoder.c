@@ -12,6 +12,7 @@
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/sysmacros.h>
 #include <sys/xattr.h>
 #include <unistd.h>
@@ -41,6 +42,14 @@
 /* #undef ENXIO */
 /* #define ENXIO __LINE__ */
 
+/* If our working buffers grew beyond this threshold, shrink them again when we are done with a file, so
+ * that a single outlier (think: a file with tons of xattrs, or a gigantic directory) doesn't pin its
+ * high-water allocation for the rest of the run. */
+#define CA_ENCODER_DEFAULT_BUFFER_BUDGET (16U*1024U*1024U)
+
+/* How far beyond the buffer handed to the chunker we ask the kernel to read ahead in the payload file */
+#define CA_ENCODER_READAHEAD_SIZE (4U*BUFFER_SIZE)
+
 typedef struct CaEncoderExtendedAttribute {
         char *name;
         void *data;
@@ -69,7 +78,8 @@ typedef struct CaEncoderNode {
         statfs_f_type_t magic;
 
         /* For S_ISDIR */
-        struct dirent **dirents;
+        struct dirent **dirents; /* sorted pointers into 'dirent_data' */
+        void *dirent_data;       /* raw getdents64 records, in one contiguous buffer */
         size_t n_dirents;
         size_t dirent_idx;
 
@@ -165,9 +175,19 @@ struct CaEncoder {
         ReallocBuffer xattr_list_buffer;
         ReallocBuffer xattr_value_buffer;
 
+        /* The largest xattr list/value we saw so far, so that files after the first don't have to probe
+         * with a small buffer and retry on ERANGE */
+        size_t xattr_list_size_hint;
+        size_t xattr_value_size_hint;
+
         uint64_t archive_offset;
         uint64_t payload_offset;
 
+        uint64_t buffer_budget;
+
+        /* Absolute payload offset up to which we already issued POSIX_FADV_WILLNEED on the current file */
+        uint64_t readahead_offset;
+
         uid_t cached_uid;
         gid_t cached_gid;
 
@@ -187,6 +207,10 @@ struct CaEncoder {
         bool want_archive_digest:1;
         bool want_payload_digest:1;
         bool want_hardlink_digest:1;
+
+        /* Set once lseek(SEEK_DATA) failed, so that we don't retry it on every payload read on kernels or
+         * file systems that lack it */
+        bool sparse_unsupported:1;
 };
 
 #define CA_ENCODER_AT_ROOT(e) ((e)->node_idx == 0)
@@ -211,6 +235,7 @@ CaEncoder *ca_encoder_new(void) {
 
         assert_se(ca_feature_flags_normalize(CA_FORMAT_DEFAULT, &e->feature_flags) >= 0);
         e->time_granularity = 1;
+        e->buffer_budget = CA_ENCODER_DEFAULT_BUFFER_BUDGET;
 
         return e;
 }
@@ -234,9 +259,8 @@ static void ca_encoder_node_free(CaEncoderNode *n) {
         else
                 n->fd = -1;
 
-        for (i = 0; i < n->n_dirents; i++)
-                free(n->dirents[i]);
         n->dirents = mfree(n->dirents);
+        n->dirent_data = mfree(n->dirent_data);
         n->n_dirents = 0;
 
         n->symlink_target = mfree(n->symlink_target);
@@ -456,43 +480,115 @@ static const struct dirent *ca_encoder_node_current_dirent(CaEncoderNode *n) {
         return n->dirents[n->dirent_idx];
 }
 
-static int scandir_filter(const struct dirent *de) {
-        assert(de);
+static int dirent_compare(const void *a, const void *b) {
+        const struct dirent *const *x = a, *const *y = b;
 
-        /* Filter out "." and ".." */
+        /* We don't use alphasort() here, as we want locale-independent ordering */
 
-        return !dot_or_dot_dot(de->d_name);
+        return strcmp((*x)->d_name, (*y)->d_name);
 }
 
-static int scandir_compare(const struct dirent **a, const struct dirent **b) {
-        assert(a);
-        assert(b);
-
-        /* We don't use alphasort() here, as we want locale-independent ordering */
-
-        return strcmp((*a)->d_name, (*b)->d_name);
+static ssize_t ca_getdents64(int fd, void *buffer, size_t length) {
+        return syscall(__NR_getdents64, fd, buffer, length);
 }
 
+#define DIRENT_BUFFER_SIZE (256U*1024U)
+
 static int ca_encoder_node_read_dirents(CaEncoderNode *n) {
-        int r;
+        size_t allocated = 0, used = 0, n_entries = 0, allocated_offsets = 0, *offsets = NULL, i;
+        struct dirent **entries = NULL;
+        uint8_t *data = NULL;
+        int dir_fd = -1, r;
 
         assert(n);
 
-        if (n->dirents)
+        if (n->dirent_data)
                 return 0;
         if (!S_ISDIR(n->stat.st_mode))
                 return -ENOTDIR;
         if (n->fd < 0)
                 return -EBADFD;
 
-        r = scandirat(n->fd, ".", &n->dirents, scandir_filter, scandir_compare);
-        if (r < 0)
+        /* Read the raw getdents64 records into one contiguous buffer, instead of one allocation per entry
+         * as scandirat() would do it — on maildir-style directories with millions of entries that's the
+         * difference between gigabytes and a compact name table. The kernel's record layout matches glibc's
+         * struct dirent, hence we may point into the buffer directly. */
+
+        dir_fd = openat(n->fd, ".", O_RDONLY|O_CLOEXEC|O_DIRECTORY|O_NOCTTY);
+        if (dir_fd < 0)
                 return -errno;
 
-        n->n_dirents = (size_t) r;
+        for (;;) {
+                size_t o;
+                ssize_t l;
+
+                if (!GREEDY_REALLOC(data, allocated, used + DIRENT_BUFFER_SIZE)) {
+                        r = -ENOMEM;
+                        goto fail;
+                }
+
+                l = ca_getdents64(dir_fd, data + used, allocated - used);
+                if (l < 0) {
+                        r = -errno;
+                        goto fail;
+                }
+                if (l == 0)
+                        break;
+
+                o = used;
+                used += l;
+
+                while (o < used) {
+                        const struct dirent *de = (const struct dirent*) (data + o);
+
+                        if (de->d_reclen == 0 || o + de->d_reclen > used) {
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        if (!dot_or_dot_dot(de->d_name)) {
+                                if (!GREEDY_REALLOC(offsets, allocated_offsets, n_entries + 1)) {
+                                        r = -ENOMEM;
+                                        goto fail;
+                                }
+
+                                offsets[n_entries++] = o;
+                        }
+
+                        o += de->d_reclen;
+                }
+        }
+
+        if (n_entries > 0) {
+                entries = new(struct dirent*, n_entries);
+                if (!entries) {
+                        r = -ENOMEM;
+                        goto fail;
+                }
+
+                for (i = 0; i < n_entries; i++)
+                        entries[i] = (struct dirent*) (data + offsets[i]);
+
+                qsort(entries, n_entries, sizeof(struct dirent*), dirent_compare);
+        }
+
+        free(offsets);
+        safe_close(dir_fd);
+
+        n->dirent_data = data;
+        n->dirents = entries;
+        n->n_dirents = n_entries;
         n->dirent_idx = 0;
 
         return 1;
+
+fail:
+        free(offsets);
+        free(entries);
+        free(data);
+        safe_close(dir_fd);
+
+        return r;
 }
 
 static int ca_encoder_node_read_device_size(CaEncoderNode *n) {
@@ -734,7 +830,7 @@ static int ca_encoder_node_read_xattrs(
                 CaEncoder *e,
                 CaEncoderNode *n) {
 
-        size_t space = 256, left, count = 0;
+        size_t space, left, count = 0;
         bool has_fcaps = false;
         int path_fd = -1, r;
         char *q;
@@ -745,6 +841,12 @@ static int ca_encoder_node_read_xattrs(
         if ((e->feature_flags & (CA_FORMAT_WITH_XATTRS|CA_FORMAT_WITH_FCAPS)) == 0)
                 return 0;
 
+        /* If only the file capabilities are wanted, there's nothing to list on anything but regular files */
+        if ((e->feature_flags & CA_FORMAT_WITH_XATTRS) == 0 && !S_ISREG(n->stat.st_mode)) {
+                n->xattrs_valid = true;
+                return 0;
+        }
+
         if (n->xattrs_valid)
                 return 0;
 
@@ -780,6 +882,8 @@ static int ca_encoder_node_read_xattrs(
                 }
         }
 
+        space = MAX(e->xattr_list_size_hint, 256U);
+
         for (;;) {
                 ssize_t l;
                 char *p;
@@ -805,6 +909,9 @@ static int ca_encoder_node_read_xattrs(
                                 goto finish;
                         }
                 } else {
+                        if ((size_t) l > e->xattr_list_size_hint)
+                                e->xattr_list_size_hint = l;
+
                         realloc_buffer_truncate(&e->xattr_list_buffer, l);
                         break;
                 }
@@ -863,7 +970,7 @@ static int ca_encoder_node_read_xattrs(
                     (streq(q, "security.capability") && S_ISREG(n->stat.st_mode))) {
                         bool good = false;
 
-                        space = 256;
+                        space = MAX(e->xattr_value_size_hint, 256U);
 
                         for (;;) {
                                 ssize_t l;
@@ -885,6 +992,9 @@ static int ca_encoder_node_read_xattrs(
                                                 goto finish;
                                         }
                                 } else {
+                                        if ((size_t) l > e->xattr_value_size_hint)
+                                                e->xattr_value_size_hint = l;
+
                                         realloc_buffer_truncate(&e->xattr_value_buffer, l);
                                         good = true;
                                         break;
@@ -1814,6 +1924,25 @@ static void ca_encoder_enter_state(CaEncoder *e, CaEncoderState state) {
         e->payload_offset = 0;
 }
 
+static void ca_encoder_compact_buffers(CaEncoder *e) {
+        assert(e);
+
+        /* Called whenever we finished serializing a node. If our buffers ballooned while processing it,
+         * give the excess memory back, so that encoding stays within a bounded budget no matter how large
+         * individual files or directories are. This is cheap enough that we don't bother making it
+         * conditional on anything but the actual allocation sizes. */
+
+        if (e->buffer_budget == 0) /* No budget set? Then never shrink. */
+                return;
+
+        if (e->buffer.allocated + e->xattr_list_buffer.allocated + e->xattr_value_buffer.allocated <= e->buffer_budget)
+                return;
+
+        realloc_buffer_compact(&e->buffer, BUFFER_SIZE);
+        realloc_buffer_compact(&e->xattr_list_buffer, 0);
+        realloc_buffer_compact(&e->xattr_value_buffer, 0);
+}
+
 static int ca_encoder_step_node(CaEncoder *e, CaEncoderNode *n) {
         int r;
 
@@ -2011,6 +2140,8 @@ static int ca_encoder_step_node(CaEncoder *e, CaEncoderNode *n) {
                 return CA_ENCODER_DONE_FILE;
 
         case CA_ENCODER_FINALIZE:
+                ca_encoder_compact_buffers(e);
+
                 r = ca_encoder_leave_child(e);
                 if (r < 0)
                         return r;
@@ -2068,7 +2199,7 @@ int ca_encoder_step(CaEncoder *e) {
 }
 
 static int ca_encoder_get_payload_data(CaEncoder *e, CaEncoderNode *n) {
-        uint64_t size;
+        uint64_t size, next;
         ssize_t m;
         size_t k;
         void *p;
@@ -2089,13 +2220,62 @@ static int ca_encoder_get_payload_data(CaEncoder *e, CaEncoderNode *n) {
         if (realloc_buffer_size(&e->buffer) > 0) /* already in buffer? */
                 return 1;
 
+        if (e->payload_offset == 0) {
+                /* Starting on a new file, which we'll stream front to back: let the kernel widen its
+                 * readahead window right away */
+                (void) posix_fadvise(n->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+                e->readahead_offset = 0;
+        }
+
         k = (size_t) MIN(BUFFER_SIZE, size - e->payload_offset);
 
+        if (S_ISREG(n->stat.st_mode) && !e->sparse_unsupported) {
+                off_t o;
+
+                /* Ask the VFS where the next data is, so that holes in sparse files are synthesized as zero
+                 * runs instead of being read at full cost. ENXIO means there is no data anymore, i.e. the
+                 * rest of the file is one big hole. */
+
+                o = lseek(n->fd, (off_t) e->payload_offset, SEEK_DATA);
+                if (o < 0 && errno == ENXIO)
+                        o = (off_t) size;
+                if (o < 0) {
+                        if (!IN_SET(errno, EINVAL, EOPNOTSUPP))
+                                return -errno;
+
+                        e->sparse_unsupported = true;
+                } else if ((uint64_t) o > e->payload_offset) {
+                        uint64_t hole;
+
+                        /* We are inside a hole. Synthesize the zeroes; the chunker's zero-run scan and the
+                         * cached zero-chunk ID make everything downstream of this cheap. */
+
+                        hole = MIN((uint64_t) o, size) - e->payload_offset;
+                        k = (size_t) MIN((uint64_t) BUFFER_SIZE, hole);
+
+                        p = realloc_buffer_acquire(&e->buffer, k);
+                        if (!p)
+                                return -ENOMEM;
+
+                        memzero(p, k);
+                        return 1;
+                } else {
+                        /* We are on data. Don't read beyond its end, so that the next call starts exactly on
+                         * the following hole and takes the branch above. */
+
+                        o = lseek(n->fd, (off_t) e->payload_offset, SEEK_HOLE);
+                        if (o > 0 && (uint64_t) o > e->payload_offset)
+                                k = (size_t) MIN((uint64_t) k, (uint64_t) o - e->payload_offset);
+                }
+        }
+
         p = realloc_buffer_acquire(&e->buffer, k);
         if (!p)
                 return -ENOMEM;
 
-        m = read(n->fd, p, k);
+        /* Note that this is a positioned read: the SEEK_DATA/SEEK_HOLE probes above move the file offset
+         * around, hence we can't rely on it anymore. */
+        m = pread(n->fd, p, k, (off_t) e->payload_offset);
         if (m < 0) {
                 r = -errno;
                 goto fail;
@@ -2105,6 +2285,17 @@ static int ca_encoder_get_payload_data(CaEncoder *e, CaEncoderNode *n) {
                 goto fail;
         }
 
+        /* While the chunker and the digests grind through this buffer, have the kernel stream the next
+         * couple of buffers into the page cache, so that the following read doesn't wait for the device. */
+        next = e->payload_offset + k;
+        if (next < size && next + k > e->readahead_offset) {
+                uint64_t ra;
+
+                ra = MIN(size - next, (uint64_t) CA_ENCODER_READAHEAD_SIZE);
+                (void) posix_fadvise(n->fd, (off_t) next, (off_t) ra, POSIX_FADV_WILLNEED);
+                e->readahead_offset = next + ra;
+        }
+
         return 1;
 
 fail:
@@ -3517,6 +3708,17 @@ int ca_encoder_set_uid_range(CaEncoder *e, uid_t u) {
         return 0;
 }
 
+int ca_encoder_set_buffer_budget(CaEncoder *e, uint64_t bytes) {
+        if (!e)
+                return -EINVAL;
+
+        /* Sets the allocation size above which our working buffers are shrunk again after each file. Zero
+         * means "unbounded", i.e. buffers keep their high-water allocation. */
+
+        e->buffer_budget = bytes;
+        return 0;
+}
+
 int ca_encoder_enable_archive_digest(CaEncoder *e, bool b) {
         if (!e)
                 return -EINVAL;
@@ -1,3 +1,5 @@
+#include <fcntl.h>
+
 #include "cafileroot.h"
 #include "util.h"
 
@@ -39,6 +41,21 @@ CaFileRoot* ca_file_root_ref(CaFileRoot *root) {
         return root;
 }
 
+static void ca_file_root_flush_fd_cache(CaFileRoot *root) {
+        size_t i;
+
+        assert(root);
+
+        for (i = 0; i < CA_FILE_ROOT_FD_CACHE_MAX; i++) {
+                if (root->fd_cache[i].last_used == 0)
+                        continue;
+
+                root->fd_cache[i].path = mfree(root->fd_cache[i].path);
+                root->fd_cache[i].fd = safe_close(root->fd_cache[i].fd);
+                root->fd_cache[i].last_used = 0;
+        }
+}
+
 CaFileRoot* ca_file_root_unref(CaFileRoot *root) {
         if (!root)
                 return NULL;
@@ -49,6 +66,8 @@ CaFileRoot* ca_file_root_unref(CaFileRoot *root) {
         if (root->n_ref > 0)
                 return NULL;
 
+        ca_file_root_flush_fd_cache(root);
+
         root->fd = -1;
         free(root->path);
 
@@ -59,8 +78,92 @@ void ca_file_root_invalidate(CaFileRoot *root) {
         if (!root)
                 return;
 
+        ca_file_root_flush_fd_cache(root);
+
         root->fd = -1;
         root->path = mfree(root->path);
 
         root->invalidated = true;
 }
+
+int ca_file_root_cache_get(CaFileRoot *root, const char *path) {
+        size_t i;
+        int copy;
+
+        if (!root)
+                return -EINVAL;
+        if (root->invalidated)
+                return -EUNATCH;
+
+        for (i = 0; i < CA_FILE_ROOT_FD_CACHE_MAX; i++) {
+                if (root->fd_cache[i].last_used == 0)
+                        continue;
+                if (!streq(root->fd_cache[i].path, strempty(path)))
+                        continue;
+
+                root->fd_cache[i].last_used = ++root->fd_cache_generation;
+
+                /* Hand out a duplicate, the caller owns (and closes) what we return. The cached fds are
+                 * only ever used with offset-explicit calls (pread(), copy_file_range(), FICLONERANGE),
+                 * hence the shared file offset of the duplicates is harmless. */
+                copy = fcntl(root->fd_cache[i].fd, F_DUPFD_CLOEXEC, 3);
+                if (copy < 0)
+                        return -errno;
+
+                return copy;
+        }
+
+        return -ENOENT;
+}
+
+int ca_file_root_cache_put(CaFileRoot *root, const char *path, int fd) {
+        CaFileRootCacheItem *dest = NULL;
+        size_t i;
+        int copy;
+        char *p;
+
+        if (!root)
+                return -EINVAL;
+        if (fd < 0)
+                return -EINVAL;
+        if (root->invalidated)
+                return -EUNATCH;
+
+        /* Find the existing entry for this path, a free slot, or failing both the least recently used slot */
+        for (i = 0; i < CA_FILE_ROOT_FD_CACHE_MAX; i++) {
+                if (root->fd_cache[i].last_used != 0 &&
+                    streq(root->fd_cache[i].path, strempty(path))) {
+                        dest = root->fd_cache + i;
+                        break;
+                }
+
+                if (root->fd_cache[i].last_used == 0) {
+                        dest = root->fd_cache + i;
+                        break;
+                }
+
+                if (!dest || root->fd_cache[i].last_used < dest->last_used)
+                        dest = root->fd_cache + i;
+        }
+
+        copy = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+        if (copy < 0)
+                return -errno;
+
+        p = strdup(strempty(path));
+        if (!p) {
+                safe_close(copy);
+                return -ENOMEM;
+        }
+
+        if (dest->last_used != 0) {
+                free(dest->path);
+                safe_close(dest->fd);
+        }
+
+        dest->path = p;
+        dest->fd = copy;
+        dest->last_used = ++root->fd_cache_generation;
+
+        return 0;
+}
@@ -1,13 +1,28 @@
 #ifndef foocafileroothfoo
 #define foocafileroothfoo
 
+#include <inttypes.h>
 #include <stdbool.h>
 
+/* A small LRU cache of open file descriptors below the root, so that operations which access the same files
+ * over and over by path — such as cloning many chunk-sized ranges out of one seed file — don't pay a full
+ * per-component path walk on every access. Flushed when the root is invalidated or released. */
+#define CA_FILE_ROOT_FD_CACHE_MAX 16U
+
+typedef struct CaFileRootCacheItem {
+        char *path;
+        int fd;
+        uint64_t last_used; /* 0 if the slot is unused */
+} CaFileRootCacheItem;
+
 typedef struct CaFileRoot {
         unsigned n_ref;
         char *path;
         int fd;
         bool invalidated;
+
+        CaFileRootCacheItem fd_cache[CA_FILE_ROOT_FD_CACHE_MAX];
+        uint64_t fd_cache_generation;
 } CaFileRoot;
 
 int ca_file_root_new(const char *path, int fd, CaFileRoot **ret);
@@ -17,4 +32,8 @@ CaFileRoot* ca_file_root_unref(CaFileRoot *root);
 
 void ca_file_root_invalidate(CaFileRoot *root);
 
+/* Returns a dup of a cached fd for the specified path, or -ENOENT */
+int ca_file_root_cache_get(CaFileRoot *root, const char *path);
+int ca_file_root_cache_put(CaFileRoot *root, const char *path, int fd);
+
 #endif
@@ -149,7 +149,7 @@ int ca_with_feature_flags_format(uint64_t features, char **ret) {
                 features &= ~f;
         }
 
-        if ((features & ~(CA_FORMAT_EXCLUDE_NODUMP|CA_FORMAT_EXCLUDE_SUBMOUNTS|CA_FORMAT_SHA512_256)) != 0) {
+        if ((features & ~(CA_FORMAT_EXCLUDE_NODUMP|CA_FORMAT_EXCLUDE_SUBMOUNTS|CA_FORMAT_TOC|CA_FORMAT_FASTCDC_CHUNKER|CA_FORMAT_FILE_ALIGNED_CHUNKS|CA_FORMAT_INLINE_CHUNKS|CA_FORMAT_SHA512_256)) != 0) {
                 free(s);
                 return -EINVAL;
         }
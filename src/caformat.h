@@ -72,6 +72,12 @@ enum {
 
         /* The end marker used in the TABLE object */
         CA_FORMAT_TABLE_TAIL_MARKER     = UINT64_C(0x4b4f050e5549ecd1),
+
+        /* The end marker used in the inline chunk section that may follow the TABLE object */
+        CA_FORMAT_INLINE_CHUNK_TAIL_MARKER = UINT64_C(0x927f35cb8c3dcf16),
+
+        /* The end marker used in the table of contents section that may follow the TABLE object */
+        CA_FORMAT_TOC_TAIL_MARKER       = UINT64_C(0x62e1c8a94f0b73d5),
 };
 
 /* Feature flags */
@@ -117,6 +123,10 @@ enum {
         CA_FORMAT_WITH_SELINUX           = 0x40000000,
         CA_FORMAT_WITH_FCAPS             = 0x80000000,
 
+        CA_FORMAT_TOC                    = UINT64_C(0x0200000000000000),
+        CA_FORMAT_FASTCDC_CHUNKER        = UINT64_C(0x0400000000000000),
+        CA_FORMAT_FILE_ALIGNED_CHUNKS    = UINT64_C(0x0800000000000000),
+        CA_FORMAT_INLINE_CHUNKS          = UINT64_C(0x1000000000000000),
         CA_FORMAT_SHA512_256             = UINT64_C(0x2000000000000000),
         CA_FORMAT_EXCLUDE_SUBMOUNTS      = UINT64_C(0x4000000000000000),
         CA_FORMAT_EXCLUDE_NODUMP         = UINT64_C(0x8000000000000000),
@@ -256,6 +266,10 @@ enum {
                 CA_FORMAT_WITH_MASK|
                 CA_FORMAT_EXCLUDE_NODUMP|
                 CA_FORMAT_EXCLUDE_SUBMOUNTS|
+                CA_FORMAT_TOC|
+                CA_FORMAT_FASTCDC_CHUNKER|
+                CA_FORMAT_FILE_ALIGNED_CHUNKS|
+                CA_FORMAT_INLINE_CHUNKS|
                 CA_FORMAT_SHA512_256,
 };
 
@@ -428,4 +442,44 @@ typedef struct CaFormatTable {
         /* Followed by one CaFormatTableTail */
 } CaFormatTable;
 
+/* If CA_FORMAT_INLINE_CHUNKS is set in the feature flags, the TABLE object is followed by a series of
+ * inline chunk records, carrying the store encoding of chunks small enough to ship with the index file
+ * itself, terminated by a single CaFormatInlineChunkTail. */
+
+typedef struct CaFormatInlineChunk {
+        le64_t size;                     /* Size of this record, including this field and the chunk ID */
+        uint8_t chunk[CA_CHUNK_ID_SIZE];
+        uint8_t data[];                  /* The chunk's store encoding, i.e. compressed */
+} CaFormatInlineChunk;
+
+typedef struct CaFormatInlineChunkTail {
+        le64_t size;   /* Size of the whole inline chunk section, including this tail */
+        le64_t marker; /* CA_FORMAT_INLINE_CHUNK_TAIL_MARKER */
+} CaFormatInlineChunkTail;
+
+/* If CA_FORMAT_TOC is set in the feature flags, the TABLE object is followed by a table of contents: one
+ * record per archive member, carrying its path, the archive offset of its ENTRY object and its file mode,
+ * terminated by a single CaFormatTOCTail. This permits resolving any path to its place in the archive —
+ * and enumerating directories — without decoding the archive stream up to it. Records are sorted by path,
+ * with '/' ordered below every other byte, which is precisely the depth-first order the encoder serializes
+ * members in. If CA_FORMAT_INLINE_CHUNKS is also set the inline chunk section follows the TOC. */
+
+typedef struct CaFormatTOCItem {
+        le64_t size;   /* Size of this record, including this field and the path's NUL byte */
+        le64_t offset; /* Archive offset of the member's ENTRY object */
+        le64_t mode;   /* File type and access mode, as in CaFormatEntry */
+        char path[];   /* NUL-terminated, relative to the archive root, empty for the root itself */
+} CaFormatTOCItem;
+
+typedef struct CaFormatTOCTail {
+        le64_t size;   /* Size of the whole TOC section, including this tail */
+        le64_t marker; /* CA_FORMAT_TOC_TAIL_MARKER */
+} CaFormatTOCTail;
+
+/* If CA_FORMAT_FILE_ALIGNED_CHUNKS is set in the feature flags, the encoder forces a chunk boundary
+ * wherever the payload of a sufficiently large file begins, so that inserting or modifying one file doesn't
+ * shift the chunking of everything that follows it in the archive. Like CA_FORMAT_INLINE_CHUNKS this is a
+ * property of the chunking, not of the serialization: the archive byte stream is unaffected, the flag is
+ * recorded in the index so that re-encodes chunk the same way. */
+
 #endif
@@ -3,17 +3,36 @@
 #include <fuse.h>
 #include <linux/fs.h>
 #include <linux/msdos_fs.h>
+#include <poll.h>
 
 #include "caformat-util.h"
 #include "caformat.h"
 #include "cafuse.h"
 #include "notify.h"
+#include "realloc-buffer.h"
 #include "signal-handler.h"
 #include "util.h"
 
 static CaSync *instance = NULL;
+static CaSync *populate_instance = NULL;
 static struct fuse *fuse = NULL;
 
+/* Sequential read detection: when a read() continues exactly where the previous one on the same path left
+ * off, we keep decoding from the current position instead of re-seeking the whole pipeline, which lets the
+ * synchronizer's chunk prefetch work across read() boundaries. stream_buffer holds payload the decoder
+ * already produced beyond what the last read() consumed; stream_offset is the file offset of its first
+ * byte (or of the next byte the decoder will produce, if it is empty). */
+static char *stream_path = NULL;
+static uint64_t stream_offset = 0;
+static ReallocBuffer stream_buffer = {};
+static bool stream_valid = false;
+
+static void stream_invalidate(void) {
+        stream_path = mfree(stream_path);
+        realloc_buffer_empty(&stream_buffer);
+        stream_valid = false;
+}
+
 static void fuse_exit_signal_handler(int signo) {
 
         /* Call our own generic handler */
@@ -79,6 +98,9 @@ static int seek_to_path(CaSync *s, const char *path) {
         assert(s);
         assert(path);
 
+        /* Any repositioning of the shared state machine ends a sequential read stream */
+        stream_invalidate();
+
         r = ca_sync_seek_path(s, path);
         if (r < 0) {
                 fprintf(stderr, "Failed to seek for stat to %s: %s\n", path, strerror(-r));
@@ -131,6 +153,12 @@ static int fill_stat(CaSync *s, struct stat *stbuf) {
 }
 
 static void *casync_init(struct fuse_conn_info *conn) {
+
+        /* Ask the kernel for aggressive readahead: sequential readers then send us large, back-to-back
+         * read requests, which the sequential stream detection in casync_read() turns into one continuous
+         * decode instead of a re-seek per request. */
+        conn->max_readahead = 16U*1024U*1024U;
+
         return NULL;
 }
 
@@ -322,6 +350,7 @@ static int casync_open(const char *path, struct fuse_file_info *fi) {
         return 0;
 }
 static int casync_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+        bool sequential;
         int r, sum = 0;
 
         assert(path);
@@ -331,16 +360,46 @@ static int casync_read(const char *path, char *buf, size_t size, off_t offset, s
 
         /* fprintf(stderr, "Got request for read(%s@%" PRIu64 ").\n", path, (uint64_t) offset); */
 
-        r = ca_sync_set_payload(instance, true);
-        if (r < 0) {
-                fprintf(stderr, "Failed to turn on payload: %s\n", strerror(-r));
-                return r;
+        sequential = stream_valid &&
+                stream_path &&
+                streq(stream_path, path) &&
+                (uint64_t) offset == stream_offset;
+
+        if (!sequential) {
+                stream_invalidate();
+
+                r = ca_sync_set_payload(instance, true);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to turn on payload: %s\n", strerror(-r));
+                        return r;
+                }
+
+                r = ca_sync_seek_path_offset(instance, path, offset);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to seek to path %s@%" PRIu64 ": %s\n", path, (uint64_t) offset, strerror(-r));
+                        return r;
+                }
+
+                stream_path = strdup(path);
+                if (!stream_path)
+                        return -ENOMEM;
+
+                stream_offset = offset;
+                stream_valid = true;
         }
 
-        r = ca_sync_seek_path_offset(instance, path, offset);
-        if (r < 0) {
-                fprintf(stderr, "Failed to seek to path %s@%" PRIu64 ": %s\n", path, (uint64_t) offset, strerror(-r));
-                return r;
+        /* First serve whatever the decoder already produced beyond the previous read */
+        if (realloc_buffer_size(&stream_buffer) > 0) {
+                size_t n;
+
+                n = MIN(size, realloc_buffer_size(&stream_buffer));
+                memcpy(buf, realloc_buffer_data(&stream_buffer), n);
+                realloc_buffer_advance(&stream_buffer, n);
+
+                stream_offset += n;
+                buf += n;
+                size -= n;
+                sum += n;
         }
 
         for (;;) {
@@ -353,6 +412,7 @@ static int casync_read(const char *path, char *buf, size_t size, off_t offset, s
                 step = ca_sync_step(instance);
                 if (step < 0) {
                         fprintf(stderr, "Failed to run synchronizer: %s\n", strerror(-step));
+                        stream_invalidate();
                         return step;
                 }
 
@@ -364,22 +424,29 @@ static int casync_read(const char *path, char *buf, size_t size, off_t offset, s
 
                 case CA_SYNC_PAYLOAD: {
                         const void *p;
-                        size_t n;
+                        size_t n, m;
 
                         r = ca_sync_get_payload(instance, &p, &n);
                         if (r < 0) {
                                 fprintf(stderr, "Failed to acquire payload: %s\n", strerror(-r));
+                                stream_invalidate();
                                 return r;
                         }
 
-                        if (n > size)
-                                n = size;
+                        m = MIN(n, size);
+                        memcpy(buf, p, m);
 
-                        memcpy(buf, p, n);
+                        stream_offset += m;
+                        buf += m;
+                        size -= m;
+                        sum += m;
 
-                        buf += n;
-                        size -= n;
-                        sum += n;
+                        /* Keep any excess around for the next sequential read */
+                        if (m < n &&
+                            !realloc_buffer_append(&stream_buffer, (const uint8_t*) p + m, n - m)) {
+                                stream_invalidate();
+                                return -ENOMEM;
+                        }
 
                         break;
                 }
@@ -398,6 +465,7 @@ static int casync_read(const char *path, char *buf, size_t size, off_t offset, s
                                 return r;
                         if (r < 0) {
                                 fprintf(stderr, "Failed to poll: %s\n", strerror(-r));
+                                stream_invalidate();
                                 return r;
                         }
 
@@ -405,11 +473,14 @@ static int casync_read(const char *path, char *buf, size_t size, off_t offset, s
 
                 case CA_SYNC_NOT_FOUND:
                         /* fprintf(stderr, "Not found: %s@%" PRIu64 "\n", path, (uint64_t) offset); */
+                        stream_invalidate();
                         return -ENOENT;
                 }
 
-                if (eof)
+                if (eof) {
+                        stream_invalidate();
                         break;
+                }
         }
 
         /* fprintf(stderr, "read(%s@%" PRIu64 ") successful!\n", path, (uint64_t) offset); */
@@ -423,6 +494,8 @@ static int casync_statfs(const char *path, struct statvfs *sfs) {
 
         /* fprintf(stderr, "Got request for stats().\n"); */
 
+        stream_invalidate();
+
         for (;;) {
                 int step;
 
@@ -699,7 +772,97 @@ static int feature_flags_warning(CaSync *s) {
         return 0;
 }
 
-int ca_fuse_run(CaSync *s, const char *what, const char *where, bool do_mkdir) {
+static int fuse_lazy_loop(struct fuse_chan *fc) {
+        struct fuse_session *se;
+        bool populate_done = false;
+        size_t bufsize;
+        char *buf;
+        int r = 0;
+
+        assert(fuse);
+        assert(populate_instance);
+
+        /* Like fuse_loop(), but interleaves the background materialization with request processing: while
+         * the mount is idle we advance the populate synchronizer, and only once it finished do we block on
+         * the FUSE channel indefinitely. Both synchronizers run on this thread, which is what sharing
+         * their chunk cache requires anyway. */
+
+        se = fuse_get_session(fuse);
+        bufsize = fuse_chan_bufsize(fc);
+
+        buf = malloc(bufsize);
+        if (!buf)
+                return log_oom();
+
+        while (!fuse_session_exited(se)) {
+                struct pollfd pfd = {
+                        .fd = fuse_chan_fd(fc),
+                        .events = POLLIN,
+                };
+                struct fuse_chan *tmpch = fc;
+                int timeout = -1;
+                ssize_t res;
+
+                if (!populate_done) {
+                        int step;
+
+                        step = ca_sync_step(populate_instance);
+                        if (step < 0) {
+                                fprintf(stderr, "Failed to populate tree, serving the mount without it: %s\n", strerror(-step));
+                                populate_done = true;
+                        } else
+                                switch (step) {
+
+                                case CA_SYNC_FINISHED:
+                                        fprintf(stderr, "Tree fully populated.\n");
+                                        populate_done = true;
+                                        break;
+
+                                case CA_SYNC_POLL:
+                                        /* The populate side stalled on remote I/O. Its fds can't be folded
+                                         * into our poll set through the public API, hence wait on the FUSE
+                                         * channel with a small timeout and retry. */
+                                        timeout = 100;
+                                        break;
+
+                                default:
+                                        timeout = 0; /* Made progress, just check for requests in passing */
+                                        break;
+                                }
+                }
+
+                if (quit)
+                        break;
+
+                r = poll(&pfd, 1, timeout);
+                if (r < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        r = -errno;
+                        fprintf(stderr, "Failed to poll FUSE channel: %s\n", strerror(-r));
+                        break;
+                }
+                if (r == 0)
+                        continue;
+
+                res = fuse_chan_recv(&tmpch, buf, bufsize);
+                if (res == -EINTR || res == -EAGAIN)
+                        continue;
+                if (res <= 0) {
+                        r = (int) res;
+                        break;
+                }
+
+                fuse_session_process(se, buf, (size_t) res, tmpch);
+                r = 0;
+        }
+
+        free(buf);
+        return r;
+}
+
+int ca_fuse_run(CaSync *s, CaSync *populate, const char *what, const char *where, bool do_mkdir) {
         struct fuse_chan *fc = NULL;
         const char * arguments[] = {
                 "casync",
@@ -721,7 +884,7 @@ int ca_fuse_run(CaSync *s, const char *what, const char *where, bool do_mkdir) {
         assert(!fuse);
         assert(!instance);
 
-        opts = "-oro,default_permissions,kernel_cache,subtype=casync";
+        opts = "-oro,default_permissions,kernel_cache,subtype=casync,max_read=1048576";
         if (geteuid() == 0)
                 opts = strjoina(opts, ",allow_other");
         if (what)
@@ -729,6 +892,7 @@ int ca_fuse_run(CaSync *s, const char *what, const char *where, bool do_mkdir) {
         arguments[1] = opts;
 
         instance = s;
+        populate_instance = populate;
 
         errno = 0;
         fc = fuse_mount(where, &args);
@@ -778,7 +942,10 @@ int ca_fuse_run(CaSync *s, const char *what, const char *where, bool do_mkdir) {
 
         (void) send_notify("READY=1");
 
-        r = fuse_loop(fuse);
+        if (populate_instance)
+                r = fuse_lazy_loop(fc);
+        else
+                r = fuse_loop(fuse);
         if (r < 0) {
                 fprintf(stderr, "Failed to run FUSE loop: %s\n", strerror(-r));
                 goto finish;
@@ -799,7 +966,11 @@ finish:
                 fuse = NULL;
         }
 
+        stream_invalidate();
+        realloc_buffer_free(&stream_buffer);
+
         instance = NULL;
+        populate_instance = NULL;
 
         return r;
 }
@@ -3,6 +3,9 @@
 
 #include "casync.h"
 
-int ca_fuse_run(CaSync *s, const char *what, const char *where, bool do_mkdir);
+/* 'populate' may be an optional second decode synchronizer set up to extract the same archive to a real
+ * directory; it is advanced in the background whenever the mount is idle, so that the tree materializes on
+ * disk while reads are already being served. */
+int ca_fuse_run(CaSync *s, CaSync *populate, const char *what, const char *where, bool do_mkdir);
 
 #endif
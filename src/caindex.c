@@ -22,6 +22,18 @@ typedef enum CaIndexMode {
         CA_INDEX_INCREMENTAL_READ,       /* incremental raw writing + cooked reading back */
 } CaIndexMode;
 
+typedef struct CaIndexInlineChunk {
+        CaChunkID id;
+        uint64_t size;
+        void *data; /* the chunk's store encoding, i.e. compressed */
+} CaIndexInlineChunk;
+
+typedef struct CaIndexTOCEntry {
+        char *path;
+        uint64_t offset;
+        mode_t mode;
+} CaIndexTOCEntry;
+
 struct CaIndex {
         CaIndexMode mode;
 
@@ -46,6 +58,24 @@ struct CaIndex {
 
         uint64_t file_size; /* The size of the index file */
         uint64_t blob_size; /* The size of the blob this index file describes */
+
+        /* Sampled chunk end offsets for fast seeking, see ca_index_make_skip_table() */
+        uint64_t *skip_table;
+        uint64_t n_skip_table;
+
+        /* In-memory copy of the inline chunk section, sorted by chunk ID, see CA_FORMAT_INLINE_CHUNKS */
+        CaIndexInlineChunk *inline_chunks;
+        size_t n_inline_chunks;
+        size_t n_inline_chunks_allocated;
+        uint64_t inline_section_size; /* On-disk size of the section, including its tail, 0 if absent */
+        bool inline_chunks_loaded;
+
+        /* In-memory copy of the table of contents section, sorted by path, see CA_FORMAT_TOC */
+        CaIndexTOCEntry *toc_entries;
+        size_t n_toc_entries;
+        size_t n_toc_entries_allocated;
+        uint64_t toc_section_size; /* On-disk size of the section, including its tail, 0 if absent */
+        bool toc_loaded;
 };
 
 static inline uint64_t CA_INDEX_METADATA_SIZE(CaIndex *i) {
@@ -127,6 +157,8 @@ CaIndex *ca_index_new_incremental_read(void) {
 }
 
 CaIndex *ca_index_unref(CaIndex *i) {
+        size_t n;
+
         if (!i)
                 return NULL;
 
@@ -140,6 +172,16 @@ CaIndex *ca_index_unref(CaIndex *i) {
         if (i->fd >= 2)
                 safe_close(i->fd);
 
+        free(i->skip_table);
+
+        for (n = 0; n < i->n_inline_chunks; n++)
+                free(i->inline_chunks[n].data);
+        free(i->inline_chunks);
+
+        for (n = 0; n < i->n_toc_entries; n++)
+                free(i->toc_entries[n].path);
+        free(i->toc_entries);
+
         return mfree(i);
 }
 
@@ -466,6 +508,313 @@ int ca_index_write_chunk(CaIndex *i, const CaChunkID *id, uint64_t size) {
         return 0;
 }
 
+static bool ca_index_has_inline_chunks(CaIndex *i) {
+        assert(i);
+
+        return i->feature_flags != UINT64_MAX && (i->feature_flags & CA_FORMAT_INLINE_CHUNKS);
+}
+
+static size_t ca_index_inline_chunk_search(CaIndex *i, const CaChunkID *id, bool *ret_found) {
+        size_t lo = 0, hi;
+
+        assert(i);
+        assert(id);
+        assert(ret_found);
+
+        /* Binary search in the sorted inline chunk array. Returns either the index of the matching entry,
+         * or the position a new entry would have to be inserted at. */
+
+        hi = i->n_inline_chunks;
+
+        while (lo < hi) {
+                size_t m = lo + (hi - lo) / 2;
+                int c;
+
+                c = memcmp(id, &i->inline_chunks[m].id, sizeof(CaChunkID));
+                if (c == 0) {
+                        *ret_found = true;
+                        return m;
+                }
+
+                if (c < 0)
+                        hi = m;
+                else
+                        lo = m + 1;
+        }
+
+        *ret_found = false;
+        return lo;
+}
+
+static int ca_index_inline_chunk_add(CaIndex *i, const CaChunkID *id, const void *data, uint64_t size) {
+        CaIndexInlineChunk *c;
+        size_t idx;
+        bool found;
+        void *copy;
+
+        assert(i);
+        assert(id);
+        assert(data);
+        assert(size > 0);
+
+        idx = ca_index_inline_chunk_search(i, id, &found);
+        if (found) /* Already have it, the table may reference the same chunk many times */
+                return 0;
+
+        if (!GREEDY_REALLOC(i->inline_chunks, i->n_inline_chunks_allocated, i->n_inline_chunks+1))
+                return -ENOMEM;
+
+        copy = memdup(data, size);
+        if (!copy)
+                return -ENOMEM;
+
+        c = i->inline_chunks + idx;
+        memmove(c + 1, c, (i->n_inline_chunks - idx) * sizeof(CaIndexInlineChunk));
+
+        c->id = *id;
+        c->size = size;
+        c->data = copy;
+
+        i->n_inline_chunks++;
+        return 1;
+}
+
+int ca_index_write_inline_chunk(CaIndex *i, const CaChunkID *id, const void *data, uint64_t size) {
+        if (!i)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+        if (!data)
+                return -EINVAL;
+        if (size == 0)
+                return -EINVAL;
+        if (!IN_SET(i->mode, CA_INDEX_WRITE, CA_INDEX_INCREMENTAL_WRITE))
+                return -ENOTTY;
+        if (i->wrote_eof)
+                return -EBUSY;
+
+        /* Collects the store encoding of sufficiently small chunks, to be appended to the index file after
+         * the TABLE object by ca_index_write_eof(). Chunks that don't qualify are silently left to the
+         * store alone, callers hand us every chunk they have the store encoding of at hand. */
+
+        if (!ca_index_has_inline_chunks(i))
+                return 0;
+        if (size > CA_INDEX_INLINE_CHUNK_SIZE_MAX)
+                return 0;
+
+        return ca_index_inline_chunk_add(i, id, data, size);
+}
+
+static int ca_index_write_inline_section(CaIndex *i) {
+        CaFormatInlineChunkTail tail = {};
+        uint64_t section_size;
+        size_t n;
+        int r;
+
+        assert(i);
+
+        if (!ca_index_has_inline_chunks(i))
+                return 0;
+
+        /* Appends the inline chunk section after the TABLE object: one record per collected chunk,
+         * followed by a tail carrying the section size, so that readers can locate both the section and
+         * the end of the TABLE from the end of the file. */
+
+        section_size = sizeof(tail);
+
+        for (n = 0; n < i->n_inline_chunks; n++) {
+                CaIndexInlineChunk *c = i->inline_chunks + n;
+                CaFormatInlineChunk record = {
+                        .size = htole64(offsetof(CaFormatInlineChunk, data) + c->size),
+                };
+
+                memcpy(record.chunk, &c->id, sizeof(CaChunkID));
+
+                r = loop_write(i->fd, &record, offsetof(CaFormatInlineChunk, data));
+                if (r < 0)
+                        return r;
+
+                r = loop_write(i->fd, c->data, c->size);
+                if (r < 0)
+                        return r;
+
+                section_size += offsetof(CaFormatInlineChunk, data) + c->size;
+        }
+
+        tail.size = htole64(section_size);
+        tail.marker = htole64(CA_FORMAT_INLINE_CHUNK_TAIL_MARKER);
+
+        r = loop_write(i->fd, &tail, sizeof(tail));
+        if (r < 0)
+                return r;
+
+        i->cooked_offset += section_size;
+        i->inline_section_size = section_size;
+
+        return 0;
+}
+
+static bool ca_index_has_toc(CaIndex *i) {
+        assert(i);
+
+        return i->feature_flags != UINT64_MAX && (i->feature_flags & CA_FORMAT_TOC);
+}
+
+static int ca_index_toc_path_compare(const char *a, const char *b) {
+        assert(a);
+        assert(b);
+
+        /* Compares two member paths, ordering '/' below every other byte. This makes the sorted order
+         * identical to the depth-first order the encoder serializes members in: a directory sorts right
+         * before its contents, and ahead of any sibling whose name merely shares a prefix. */
+
+        for (;; a++, b++) {
+                uint8_t x = *a == '/' ? 1 : (uint8_t) *a,
+                        y = *b == '/' ? 1 : (uint8_t) *b;
+
+                if (x != y)
+                        return x < y ? -1 : 1;
+                if (x == 0)
+                        return 0;
+        }
+}
+
+static size_t ca_index_toc_search(CaIndex *i, const char *path, bool *ret_found) {
+        size_t lo = 0, hi;
+
+        assert(i);
+        assert(path);
+        assert(ret_found);
+
+        /* Binary search in the sorted TOC entry array. Returns either the index of the matching entry, or
+         * the position a new entry would have to be inserted at. */
+
+        hi = i->n_toc_entries;
+
+        while (lo < hi) {
+                size_t m = lo + (hi - lo) / 2;
+                int c;
+
+                c = ca_index_toc_path_compare(path, i->toc_entries[m].path);
+                if (c == 0) {
+                        *ret_found = true;
+                        return m;
+                }
+
+                if (c < 0)
+                        hi = m;
+                else
+                        lo = m + 1;
+        }
+
+        *ret_found = false;
+        return lo;
+}
+
+static int ca_index_toc_add(CaIndex *i, const char *path, uint64_t offset, mode_t mode) {
+        CaIndexTOCEntry *e;
+        size_t idx;
+        bool found;
+        char *copy;
+
+        assert(i);
+        assert(path);
+
+        idx = ca_index_toc_search(i, path, &found);
+        if (found) /* Paths are unique within an archive, quietly ignore duplicates */
+                return 0;
+
+        if (!GREEDY_REALLOC(i->toc_entries, i->n_toc_entries_allocated, i->n_toc_entries+1))
+                return -ENOMEM;
+
+        copy = strdup(path);
+        if (!copy)
+                return -ENOMEM;
+
+        e = i->toc_entries + idx;
+        memmove(e + 1, e, (i->n_toc_entries - idx) * sizeof(CaIndexTOCEntry));
+
+        e->path = copy;
+        e->offset = offset;
+        e->mode = mode;
+
+        i->n_toc_entries++;
+        return 1;
+}
+
+int ca_index_write_toc_entry(CaIndex *i, const char *path, uint64_t offset, mode_t mode) {
+        if (!i)
+                return -EINVAL;
+        if (!path)
+                return -EINVAL;
+        if (offset == UINT64_MAX)
+                return -EINVAL;
+        if (!IN_SET(i->mode, CA_INDEX_WRITE, CA_INDEX_INCREMENTAL_WRITE))
+                return -ENOTTY;
+        if (i->wrote_eof)
+                return -EBUSY;
+
+        /* Collects one table of contents entry per archive member, to be appended to the index file after
+         * the TABLE object by ca_index_write_eof(). A no-op unless the feature flag asks for a TOC, so that
+         * callers may hand us every member unconditionally. */
+
+        if (!ca_index_has_toc(i))
+                return 0;
+
+        return ca_index_toc_add(i, path, offset, mode);
+}
+
+static int ca_index_write_toc_section(CaIndex *i) {
+        CaFormatTOCTail tail = {};
+        uint64_t section_size;
+        size_t n;
+        int r;
+
+        assert(i);
+
+        if (!ca_index_has_toc(i))
+                return 0;
+
+        /* Appends the table of contents section after the TABLE object: one record per archive member,
+         * followed by a tail carrying the section size, so that readers can locate the section from the
+         * end of the file. Written before the inline chunk section, if any, whose own tail must remain
+         * last. */
+
+        section_size = sizeof(tail);
+
+        for (n = 0; n < i->n_toc_entries; n++) {
+                CaIndexTOCEntry *e = i->toc_entries + n;
+                uint64_t l = strlen(e->path) + 1;
+                CaFormatTOCItem record = {
+                        .size = htole64(offsetof(CaFormatTOCItem, path) + l),
+                        .offset = htole64(e->offset),
+                        .mode = htole64((uint64_t) e->mode),
+                };
+
+                r = loop_write(i->fd, &record, offsetof(CaFormatTOCItem, path));
+                if (r < 0)
+                        return r;
+
+                r = loop_write(i->fd, e->path, l);
+                if (r < 0)
+                        return r;
+
+                section_size += offsetof(CaFormatTOCItem, path) + l;
+        }
+
+        tail.size = htole64(section_size);
+        tail.marker = htole64(CA_FORMAT_TOC_TAIL_MARKER);
+
+        r = loop_write(i->fd, &tail, sizeof(tail));
+        if (r < 0)
+                return r;
+
+        i->cooked_offset += section_size;
+        i->toc_section_size = section_size;
+
+        return 0;
+}
+
 int ca_index_write_eof(CaIndex *i) {
         CaFormatTableTail tail = {};
         int r;
@@ -495,11 +844,21 @@ int ca_index_write_eof(CaIndex *i) {
 
         i->cooked_offset += sizeof(tail);
 
+        r = ca_index_write_toc_section(i);
+        if (r < 0)
+                return r;
+
+        r = ca_index_write_inline_section(i);
+        if (r < 0)
+                return r;
+
         i->wrote_eof = true;
 
         return 0;
 }
 
+static int ca_index_load_inline_chunks(CaIndex *i);
+
 int ca_index_read_chunk(CaIndex *i, CaChunkID *ret_id, uint64_t *ret_offset_end, uint64_t *ret_size) {
         union {
                 CaFormatTableItem item;
@@ -543,14 +902,31 @@ int ca_index_read_chunk(CaIndex *i, CaChunkID *ret_id, uint64_t *ret_offset_end,
             buffer.tail._zero_fill2 == 0 &&
             buffer.tail.index_offset == htole64(sizeof(CaFormatIndex)) &&
             le64toh(buffer.tail.size) == (i->cooked_offset - i->start_offset + offsetof(CaFormatTable, items) + sizeof(CaFormatTableTail))) {
-                uint8_t final_byte;
 
-                /* We try to read one more byte than we expect. if we can read it there's trailing garbage. */
-                n = read(i->fd, &final_byte, sizeof(final_byte));
-                if (n < 0)
-                        return -errno;
-                if (n != 0)
-                        return -EBADMSG;
+                if (ca_index_has_inline_chunks(i)) {
+                        /* An inline chunk section follows the TABLE, load it instead of insisting on EOF */
+
+                        r = ca_index_load_inline_chunks(i);
+                        if (r == -EAGAIN) {
+                                /* The section hasn't fully arrived yet. Rewind, so that the caller retries
+                                 * this once more data has been written. */
+                                if (lseek(i->fd, -(off_t) sizeof(buffer), SEEK_CUR) == (off_t) -1)
+                                        return -errno;
+
+                                return -EAGAIN;
+                        }
+                        if (r < 0)
+                                return r;
+                } else {
+                        uint8_t final_byte;
+
+                        /* We try to read one more byte than we expect. if we can read it there's trailing garbage. */
+                        n = read(i->fd, &final_byte, sizeof(final_byte));
+                        if (n < 0)
+                                return -errno;
+                        if (n != 0)
+                                return -EBADMSG;
+                }
 
                 if (ret_id)
                         memset(ret_id, 0, sizeof(CaChunkID));
@@ -649,6 +1025,366 @@ static int read_file_size(CaIndex *i) {
         return 1;
 }
 
+static int ca_index_load_inline_chunks(CaIndex *i) {
+        CaFormatInlineChunkTail tail;
+        uint64_t available, section_size, body_size, p;
+        uint8_t *section = NULL;
+        ssize_t n;
+        int r;
+
+        assert(i);
+
+        if (i->inline_chunks_loaded)
+                return 0;
+
+        if (!IN_SET(i->mode, CA_INDEX_READ, CA_INDEX_INCREMENTAL_READ))
+                return -ENOTTY;
+        if (!ca_index_has_inline_chunks(i))
+                return -ENODATA;
+
+        /* Loads the inline chunk section into memory. The section sits at the very end of the file, with a
+         * tail record carrying its size, hence locate it from the back. */
+
+        if (i->mode == CA_INDEX_READ) {
+                r = read_file_size(i);
+                if (r < 0)
+                        return r;
+
+                available = i->file_size;
+        } else {
+                if (!i->wrote_eof) /* Wait until the raw writer delivered the whole file */
+                        return -EAGAIN;
+
+                available = i->raw_offset;
+        }
+
+        if (available < CA_INDEX_METADATA_SIZE(i) + sizeof(tail))
+                return -EBADMSG;
+
+        n = pread(i->fd, &tail, sizeof(tail), available - sizeof(tail));
+        if (n < 0)
+                return -errno;
+        if (n != sizeof(tail))
+                return -EBADMSG;
+
+        if (le64toh(tail.marker) != CA_FORMAT_INLINE_CHUNK_TAIL_MARKER)
+                return -EBADMSG;
+
+        section_size = le64toh(tail.size);
+        if (section_size < sizeof(tail))
+                return -EBADMSG;
+        if (section_size > available - CA_INDEX_METADATA_SIZE(i))
+                return -EBADMSG;
+
+        body_size = section_size - sizeof(tail);
+        if (body_size > 0) {
+                section = malloc(body_size);
+                if (!section)
+                        return -ENOMEM;
+
+                n = pread(i->fd, section, body_size, available - section_size);
+                if (n < 0) {
+                        r = -errno;
+                        goto fail;
+                }
+                if ((uint64_t) n != body_size) {
+                        r = -EBADMSG;
+                        goto fail;
+                }
+        }
+
+        p = 0;
+        while (p < body_size) {
+                uint64_t record_size, data_size;
+
+                if (body_size - p <= offsetof(CaFormatInlineChunk, data)) {
+                        r = -EBADMSG;
+                        goto fail;
+                }
+
+                record_size = read_le64(section + p);
+                if (record_size <= offsetof(CaFormatInlineChunk, data) ||
+                    record_size > body_size - p) {
+                        r = -EBADMSG;
+                        goto fail;
+                }
+
+                data_size = record_size - offsetof(CaFormatInlineChunk, data);
+                if (data_size > CA_INDEX_INLINE_CHUNK_SIZE_MAX) {
+                        r = -EBADMSG;
+                        goto fail;
+                }
+
+                r = ca_index_inline_chunk_add(i,
+                                              (const CaChunkID*) (section + p + offsetof(CaFormatInlineChunk, chunk)),
+                                              section + p + offsetof(CaFormatInlineChunk, data),
+                                              data_size);
+                if (r < 0)
+                        goto fail;
+
+                p += record_size;
+        }
+
+        free(section);
+
+        i->inline_section_size = section_size;
+        i->inline_chunks_loaded = true;
+
+        return 0;
+
+fail:
+        free(section);
+        return r;
+}
+
+int ca_index_get_inline_chunk(CaIndex *i, const CaChunkID *id, const void **ret, uint64_t *ret_size) {
+        size_t idx;
+        bool found;
+        int r;
+
+        if (!i)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+        if (!ret_size)
+                return -EINVAL;
+
+        if (!IN_SET(i->mode, CA_INDEX_READ, CA_INDEX_INCREMENTAL_READ))
+                return -ENOTTY;
+
+        if (!ca_index_has_inline_chunks(i))
+                return -ENODATA;
+
+        r = ca_index_load_inline_chunks(i);
+        if (r == -EAGAIN) /* Not fully downloaded yet, the caller shall fall back to the store */
+                return -ENODATA;
+        if (r < 0)
+                return r;
+
+        idx = ca_index_inline_chunk_search(i, id, &found);
+        if (!found)
+                return -ENOENT;
+
+        /* Note that the data is returned in its store encoding, i.e. compressed */
+        *ret = i->inline_chunks[idx].data;
+        *ret_size = i->inline_chunks[idx].size;
+
+        return 0;
+}
+
+static int ca_index_load_toc(CaIndex *i) {
+        CaFormatTOCTail tail;
+        uint64_t available, section_size, body_size, p;
+        uint8_t *section = NULL;
+        ssize_t n;
+        int r;
+
+        assert(i);
+
+        if (i->toc_loaded)
+                return 0;
+
+        if (!IN_SET(i->mode, CA_INDEX_READ, CA_INDEX_INCREMENTAL_READ))
+                return -ENOTTY;
+        if (!ca_index_has_toc(i))
+                return -ENODATA;
+
+        /* Loads the table of contents section into memory. Like the inline chunk section it sits at the
+         * back of the file, with a tail record carrying its size; if an inline chunk section exists it
+         * follows the TOC, hence skip over it first. */
+
+        if (i->mode == CA_INDEX_READ) {
+                r = read_file_size(i);
+                if (r < 0)
+                        return r;
+
+                available = i->file_size;
+        } else {
+                if (!i->wrote_eof) /* Wait until the raw writer delivered the whole file */
+                        return -EAGAIN;
+
+                available = i->raw_offset;
+        }
+
+        if (ca_index_has_inline_chunks(i)) {
+                CaFormatInlineChunkTail inline_tail;
+
+                if (available < CA_INDEX_METADATA_SIZE(i) + sizeof(inline_tail))
+                        return -EBADMSG;
+
+                n = pread(i->fd, &inline_tail, sizeof(inline_tail), available - sizeof(inline_tail));
+                if (n < 0)
+                        return -errno;
+                if (n != sizeof(inline_tail))
+                        return -EBADMSG;
+
+                if (le64toh(inline_tail.marker) != CA_FORMAT_INLINE_CHUNK_TAIL_MARKER)
+                        return -EBADMSG;
+
+                section_size = le64toh(inline_tail.size);
+                if (section_size < sizeof(inline_tail))
+                        return -EBADMSG;
+                if (section_size > available - CA_INDEX_METADATA_SIZE(i))
+                        return -EBADMSG;
+
+                available -= section_size;
+        }
+
+        if (available < CA_INDEX_METADATA_SIZE(i) + sizeof(tail))
+                return -EBADMSG;
+
+        n = pread(i->fd, &tail, sizeof(tail), available - sizeof(tail));
+        if (n < 0)
+                return -errno;
+        if (n != sizeof(tail))
+                return -EBADMSG;
+
+        if (le64toh(tail.marker) != CA_FORMAT_TOC_TAIL_MARKER)
+                return -EBADMSG;
+
+        section_size = le64toh(tail.size);
+        if (section_size < sizeof(tail))
+                return -EBADMSG;
+        if (section_size > available - CA_INDEX_METADATA_SIZE(i))
+                return -EBADMSG;
+
+        body_size = section_size - sizeof(tail);
+        if (body_size > 0) {
+                section = malloc(body_size);
+                if (!section)
+                        return -ENOMEM;
+
+                n = pread(i->fd, section, body_size, available - section_size);
+                if (n < 0) {
+                        r = -errno;
+                        goto fail;
+                }
+                if ((uint64_t) n != body_size) {
+                        r = -EBADMSG;
+                        goto fail;
+                }
+        }
+
+        p = 0;
+        while (p < body_size) {
+                uint64_t record_size, mode;
+
+                if (body_size - p <= offsetof(CaFormatTOCItem, path)) {
+                        r = -EBADMSG;
+                        goto fail;
+                }
+
+                record_size = read_le64(section + p);
+                if (record_size <= offsetof(CaFormatTOCItem, path) ||
+                    record_size > body_size - p) {
+                        r = -EBADMSG;
+                        goto fail;
+                }
+
+                if (section[p + record_size - 1] != 0) { /* The path must be NUL-terminated */
+                        r = -EBADMSG;
+                        goto fail;
+                }
+
+                mode = read_le64(section + p + offsetof(CaFormatTOCItem, mode));
+                if ((mode & ~(uint64_t) (S_IFMT|07777)) != 0) {
+                        r = -EBADMSG;
+                        goto fail;
+                }
+
+                r = ca_index_toc_add(i,
+                                     (const char*) section + p + offsetof(CaFormatTOCItem, path),
+                                     read_le64(section + p + offsetof(CaFormatTOCItem, offset)),
+                                     (mode_t) mode);
+                if (r < 0)
+                        goto fail;
+
+                p += record_size;
+        }
+
+        free(section);
+
+        i->toc_section_size = section_size;
+        i->toc_loaded = true;
+
+        return 0;
+
+fail:
+        free(section);
+        return r;
+}
+
+int ca_index_get_toc_entry(CaIndex *i, const char *path, uint64_t *ret_offset, mode_t *ret_mode) {
+        size_t idx;
+        bool found;
+        int r;
+
+        if (!i)
+                return -EINVAL;
+        if (!path)
+                return -EINVAL;
+
+        if (!IN_SET(i->mode, CA_INDEX_READ, CA_INDEX_INCREMENTAL_READ))
+                return -ENOTTY;
+
+        if (!ca_index_has_toc(i))
+                return -ENODATA;
+
+        r = ca_index_load_toc(i);
+        if (r == -EAGAIN) /* Not fully downloaded yet, the caller shall fall back to decoding the archive */
+                return -ENODATA;
+        if (r < 0)
+                return r;
+
+        path += strspn(path, "/");
+
+        idx = ca_index_toc_search(i, path, &found);
+        if (!found)
+                return -ENOENT;
+
+        if (ret_offset)
+                *ret_offset = i->toc_entries[idx].offset;
+        if (ret_mode)
+                *ret_mode = i->toc_entries[idx].mode;
+
+        return 0;
+}
+
+int ca_index_get_toc_entry_by_index(CaIndex *i, size_t n, const char **ret_path, uint64_t *ret_offset, mode_t *ret_mode) {
+        int r;
+
+        if (!i)
+                return -EINVAL;
+
+        if (!IN_SET(i->mode, CA_INDEX_READ, CA_INDEX_INCREMENTAL_READ))
+                return -ENOTTY;
+
+        if (!ca_index_has_toc(i))
+                return -ENODATA;
+
+        r = ca_index_load_toc(i);
+        if (r == -EAGAIN)
+                return -ENODATA;
+        if (r < 0)
+                return r;
+
+        /* Enumerates the TOC in its stored order, i.e. the depth-first order of the archive */
+
+        if (n >= i->n_toc_entries)
+                return -ERANGE;
+
+        if (ret_path)
+                *ret_path = i->toc_entries[n].path;
+        if (ret_offset)
+                *ret_offset = i->toc_entries[n].offset;
+        if (ret_mode)
+                *ret_mode = i->toc_entries[n].mode;
+
+        return 0;
+}
+
 int ca_index_get_available_chunks(CaIndex *i, uint64_t *ret) {
         uint64_t available, metadata_size, n;
         int r;
@@ -678,6 +1414,18 @@ int ca_index_get_available_chunks(CaIndex *i, uint64_t *ret) {
         else
                 return -ENOTTY;
 
+        if (ca_index_has_inline_chunks(i)) {
+                if (i->mode == CA_INDEX_READ || i->wrote_eof) {
+                        r = ca_index_load_inline_chunks(i);
+                        if (r < 0)
+                                return r;
+                }
+
+                /* While a download is still in progress this may count a few bytes of the trailing inline
+                 * chunk section as items, ca_index_read_chunk() sorts that out when it reaches the end */
+                available -= MIN(available, i->inline_section_size);
+        }
+
         metadata_size = CA_INDEX_METADATA_SIZE(i);;
         if (available < metadata_size) {
 
@@ -909,6 +1657,19 @@ int ca_index_get_index_size(CaIndex *i, uint64_t *ret) {
                 return -ENOTTY;
         }
 
+        if (ca_index_has_inline_chunks(i)) {
+                r = ca_index_load_inline_chunks(i);
+                if (r < 0)
+                        return r;
+
+                /* Report the size of the index/table portion only, the trailing inline chunk section isn't
+                 * part of the chunk list */
+                if (size < i->inline_section_size)
+                        return -EBADMSG;
+
+                size -= i->inline_section_size;
+        }
+
         /* Some size validation checks */
         metadata_size = CA_INDEX_METADATA_SIZE(i);
         if (size < metadata_size)
@@ -1002,6 +1763,83 @@ int ca_index_get_blob_size(CaIndex *i, uint64_t *ret) {
         return 0;
 }
 
+/* Every 64th chunk end offset is sampled into the in-memory skip table, which keeps it at 1/320th of the
+ * index file's size */
+#define CA_INDEX_SKIP_TABLE_STEP 64U
+
+static int ca_index_make_skip_table(CaIndex *i, uint64_t n_chunks) {
+        uint64_t *table, pos = 0, n;
+        uint8_t *block = NULL;
+        int r;
+
+        assert(i);
+        assert(n_chunks > 0);
+
+        if (i->skip_table)
+                return 1;
+
+        /* Without this table every seek bisects through the file with one pread() per probe, and the FUSE
+         * and NBD frontends seek for every random read. The chunk records are of fixed size, hence sample
+         * every CA_INDEX_SKIP_TABLE_STEPth end offset into memory with a single sequential pass, so that
+         * later seeks narrow down to a small window without any I/O. */
+
+        if (i->mode != CA_INDEX_READ) /* Only worth it (and only safe) on complete, seekable index files */
+                return 0;
+
+        n = (n_chunks + CA_INDEX_SKIP_TABLE_STEP - 1) / CA_INDEX_SKIP_TABLE_STEP;
+
+        table = new(uint64_t, n);
+        if (!table)
+                return 0; /* Not having the table is fine, we'll simply bisect through the file */
+
+        block = malloc(BUFFER_SIZE);
+        if (!block) {
+                free(table);
+                return 0;
+        }
+
+        while (pos < n_chunks) {
+                uint64_t m, k;
+                ssize_t l;
+
+                m = MIN(n_chunks - pos, (uint64_t) (BUFFER_SIZE / sizeof(CaFormatTableItem)));
+
+                l = pread(i->fd, block, m * sizeof(CaFormatTableItem),
+                          i->start_offset + pos * sizeof(CaFormatTableItem));
+                if (l < 0) {
+                        r = -errno;
+                        goto fail;
+                }
+                if ((size_t) l != m * sizeof(CaFormatTableItem)) {
+                        r = -EPIPE;
+                        goto fail;
+                }
+
+                for (k = pos % CA_INDEX_SKIP_TABLE_STEP == 0 ? pos : pos + CA_INDEX_SKIP_TABLE_STEP - pos % CA_INDEX_SKIP_TABLE_STEP;
+                     k < pos + m;
+                     k += CA_INDEX_SKIP_TABLE_STEP) {
+                        const CaFormatTableItem *item;
+
+                        item = (const CaFormatTableItem*) (block + (k - pos) * sizeof(CaFormatTableItem));
+                        table[k / CA_INDEX_SKIP_TABLE_STEP] = le64toh(item->offset);
+                }
+
+                pos += m;
+        }
+
+        free(block);
+
+        i->skip_table = table;
+        i->n_skip_table = n;
+
+        return 1;
+
+fail:
+        free(block);
+        free(table);
+        return r;
+}
+
 int ca_index_seek(CaIndex *i, uint64_t offset, uint64_t *ret_skip) {
         uint64_t size, n_chunks, left, right;
         int r;
@@ -1037,6 +1875,31 @@ int ca_index_seek(CaIndex *i, uint64_t offset, uint64_t *ret_skip) {
         /* Implement bisection to find the right chunk */
         left = 0;
         right = n_chunks - 2;
+
+        r = ca_index_make_skip_table(i, n_chunks);
+        if (r < 0)
+                return r;
+        if (r > 0 && i->n_skip_table > 0) {
+                uint64_t lo = 0, hi = i->n_skip_table;
+
+                /* Find the first sampled chunk that ends beyond the target offset; the covering chunk then
+                 * lies between it and the previous sample, hence bisect through the file only within that
+                 * window. */
+
+                while (lo < hi) {
+                        uint64_t p = lo + (hi - lo) / 2;
+
+                        if (offset < i->skip_table[p])
+                                hi = p;
+                        else
+                                lo = p + 1;
+                }
+
+                if (lo > 0)
+                        left = (lo - 1) * CA_INDEX_SKIP_TABLE_STEP;
+                if (lo < i->n_skip_table)
+                        right = MIN(right, lo * CA_INDEX_SKIP_TABLE_STEP);
+        }
         for (;;) {
                 uint64_t first_chunk_end, second_chunk_end, p;
 
@@ -26,6 +26,20 @@ int ca_index_write_eof(CaIndex *i);
 
 int ca_index_read_chunk(CaIndex *i, CaChunkID *id, uint64_t *ret_offset_end, uint64_t *ret_size);
 
+/* If the CA_FORMAT_INLINE_CHUNKS feature flag is set, chunks whose store encoding is this small also
+ * travel inside the index file itself, so that extraction gets them with the index read */
+#define CA_INDEX_INLINE_CHUNK_SIZE_MAX 256U
+
+int ca_index_write_inline_chunk(CaIndex *i, const CaChunkID *id, const void *data, uint64_t size);
+int ca_index_get_inline_chunk(CaIndex *i, const CaChunkID *id, const void **ret, uint64_t *ret_size);
+
+/* If the CA_FORMAT_TOC feature flag is set, the index carries a table of contents mapping each archive
+ * member's path to the archive offset of its ENTRY object and its file mode, so that paths resolve and
+ * directories list without decoding the archive stream up to them */
+int ca_index_write_toc_entry(CaIndex *i, const char *path, uint64_t offset, mode_t mode);
+int ca_index_get_toc_entry(CaIndex *i, const char *path, uint64_t *ret_offset, mode_t *ret_mode);
+int ca_index_get_toc_entry_by_index(CaIndex *i, size_t n, const char **ret_path, uint64_t *ret_offset, mode_t *ret_mode);
+
 int ca_index_set_position(CaIndex *i, uint64_t position);
 int ca_index_get_position(CaIndex *i, uint64_t *ret);
 int ca_index_get_available_chunks(CaIndex *i, uint64_t *ret);
@@ -1,8 +1,91 @@
+#include <stddef.h>
 #include <sys/fcntl.h>
 
 #include "calocation.h"
 #include "util.h"
 
+/* CaLocation objects are created and released at a very high rate during seed-assisted operation — at least
+ * one per chunk —, and most of them are short-lived, with the path identical across long runs of subsequent
+ * locations. Hence recycle the (fixed-size) objects through a small per-thread pool, and intern the path
+ * strings, so that subsequent locations within the same file share one allocation. */
+
+struct CaLocationPath {
+        unsigned n_ref;
+        char string[];
+};
+
+#define CA_LOCATION_POOL_MAX 512U
+
+static __thread CaLocation *location_pool[CA_LOCATION_POOL_MAX];
+static __thread size_t n_location_pool = 0;
+
+/* The most recently interned path. The cache holds a reference of its own. */
+static __thread CaLocationPath *last_interned_path = NULL;
+
+static CaLocationPath* ca_location_path_ref(CaLocationPath *p) {
+        if (!p)
+                return NULL;
+
+        assert(p->n_ref > 0);
+        p->n_ref++;
+
+        return p;
+}
+
+static CaLocationPath* ca_location_path_unref(CaLocationPath *p) {
+        if (!p)
+                return NULL;
+
+        assert(p->n_ref > 0);
+        p->n_ref--;
+
+        if (p->n_ref > 0)
+                return NULL;
+
+        return mfree(p);
+}
+
+static int ca_location_path_intern(const char *s, CaLocationPath **ret) {
+        CaLocationPath *p;
+        size_t n;
+
+        assert(s);
+        assert(ret);
+
+        if (last_interned_path && streq(last_interned_path->string, s)) {
+                *ret = ca_location_path_ref(last_interned_path);
+                return 0;
+        }
+
+        n = strlen(s);
+
+        p = malloc(offsetof(CaLocationPath, string) + n + 1);
+        if (!p)
+                return -ENOMEM;
+
+        p->n_ref = 2; /* One reference for the caller, one for the cache */
+        memcpy(p->string, s, n + 1);
+
+        ca_location_path_unref(last_interned_path);
+        last_interned_path = p;
+
+        *ret = p;
+        return 0;
+}
+
+static CaLocation* ca_location_allocate(void) {
+
+        if (n_location_pool > 0) {
+                CaLocation *l;
+
+                l = location_pool[--n_location_pool];
+                memzero(l, sizeof(CaLocation));
+                return l;
+        }
+
+        return new0(CaLocation, 1);
+}
+
 int ca_location_new(
                 const char *path,
                 CaLocationDesignator designator,
@@ -22,22 +105,24 @@ int ca_location_new(
         if (size != UINT64_MAX && offset + size < offset)
                 return -EINVAL;
 
-        l = new0(CaLocation, 1);
+        l = ca_location_allocate();
         if (!l)
                 return -ENOMEM;
 
+        l->n_ref = 1;
+
         if (path) {
-                l->path = strdup(path);
-                if (!l->path) {
-                        free(l);
+                if (ca_location_path_intern(path, &l->interned_path) < 0) {
+                        ca_location_unref(l);
                         return -ENOMEM;
                 }
+
+                l->path = l->interned_path->string;
         }
 
         l->designator = designator;
         l->offset = designator == CA_LOCATION_VOID ? 0 : offset;
         l->size = size;
-        l->n_ref = 1;
 
         *ret = l;
         return 0;
@@ -53,11 +138,16 @@ CaLocation* ca_location_unref(CaLocation *l) {
         if (l->n_ref > 0)
                 return NULL;
 
-        free(l->path);
+        ca_location_path_unref(l->interned_path);
         free(l->formatted);
 
         ca_file_root_unref(l->root);
 
+        if (n_location_pool < CA_LOCATION_POOL_MAX) {
+                location_pool[n_location_pool++] = l;
+                return NULL;
+        }
+
         return mfree(l);
 }
 
@@ -93,7 +183,6 @@ int ca_location_parse(const char *text, CaLocation **ret) {
         uint64_t offset, size;
         const char *e, *c;
         CaLocation *l;
-        char *n;
         int r;
 
         if (!text)
@@ -135,30 +224,28 @@ int ca_location_parse(const char *text, CaLocation **ret) {
         if (size != UINT64_MAX && offset + size < offset)
                 return -EINVAL;
 
-        if (e == text)
-                n = NULL;
-        else {
-                n = strndup(text, e - text);
-                if (!n)
-                        return -ENOMEM;
-        }
-
-        if (e[1] == CA_LOCATION_VOID && !isempty(n)) {
-                free(n);
+        if (e[1] == CA_LOCATION_VOID && e != text)
                 return -EINVAL;
-        }
 
-        l = new0(CaLocation, 1);
-        if (!l) {
-                free(n);
+        l = ca_location_allocate();
+        if (!l)
                 return -ENOMEM;
+
+        l->n_ref = 1;
+
+        if (e != text) {
+                r = ca_location_path_intern(strndupa(text, e - text), &l->interned_path);
+                if (r < 0) {
+                        ca_location_unref(l);
+                        return r;
+                }
+
+                l->path = l->interned_path->string;
         }
 
-        l->path = n;
         l->offset = e[1] == CA_LOCATION_VOID ? 0 : offset;
         l->size = size;
         l->designator = e[1];
-        l->n_ref = 1;
 
         *ret = l;
         return 0;
@@ -327,6 +414,12 @@ int ca_location_open(CaLocation *l) {
         if (l->root->invalidated)
                 return -EUNATCH;
 
+        /* Consecutive locations tend to point into the same file (e.g. when chunk ranges are cloned out of
+         * a seed one by one), hence check the root's fd cache before walking the path again */
+        r = ca_file_root_cache_get(l->root, l->path);
+        if (r >= 0)
+                return r;
+
         if (l->root->fd >= 0) {
 
                 if (isempty(l->path))
@@ -352,5 +445,7 @@ int ca_location_open(CaLocation *l) {
         if (r < 0)
                 return -errno;
 
+        (void) ca_file_root_cache_put(l->root, l->path, r);
+
         return r;
 }
@@ -28,16 +28,19 @@ static inline bool CA_LOCATION_DESIGNATOR_VALID(CaLocationDesignator d) {
                       CA_LOCATION_VOID);
 }
 
+typedef struct CaLocationPath CaLocationPath;
+
 /* A location in the serialization of a directory tree. This is considered immutable as soon as it was created
  * once. When we change it we make copies. */
 typedef struct CaLocation {
         unsigned n_ref;
         CaLocationDesignator designator;
-        char *path;
+        char *path; /* points into 'interned_path', do not free or modify */
         uint64_t offset;
         uint64_t size; /* if unspecified, may be UINT64_MAX */
         char *formatted;
         CaFileRoot *root;
+        CaLocationPath *interned_path;
 } CaLocation;
 
 int ca_location_new(const char *path, CaLocationDesignator designator, uint64_t offset, uint64_t size, CaLocation **ret);
@@ -79,3 +79,64 @@ void ca_make_bst(const void *input, size_t n, size_t size, void *output) {
 
         make_bst_inner(input, n, size, log_of_2(n) + 1, output, 0);
 }
+
+size_t ca_bst_find(
+                const void *t,
+                size_t n,
+                size_t size,
+                const void *key,
+                int (*compare)(const void *key, const void *item)) {
+
+        size_t i = 0, found = (size_t) -1;
+
+        assert(size > 0);
+        assert(compare);
+
+        /* Iterative descent through the linearized tree. Child indexes grow strictly monotonically, so this
+         * touches each cache line of the array at most once and needs no stack. On equality we keep
+         * descending to the left, so that when the tree contains runs of equal items we end up on the
+         * in-order first of them. */
+
+        while (i < n) {
+                int c;
+
+                c = compare(key, (const uint8_t*) t + i * size);
+                if (c <= 0) {
+                        if (c == 0)
+                                found = i;
+
+                        i = 2*i+1;
+                } else
+                        i = 2*i+2;
+        }
+
+        return found;
+}
+
+size_t ca_bst_successor(size_t n, size_t i) {
+        assert(i < n);
+
+        /* The in-order successor needs no comparisons at all: either the leftmost item of the right subtree,
+         * or the first ancestor we reach from a left child. The layout is "heap-shaped" (every index < n is
+         * occupied, nothing beyond), hence plain index arithmetic suffices. */
+
+        if (2*i+2 < n) {
+                i = 2*i+2;
+
+                while (2*i+1 < n)
+                        i = 2*i+1;
+
+                return i;
+        }
+
+        while (i > 0) {
+                size_t p = (i-1)/2;
+
+                if (i == 2*p+1)
+                        return p;
+
+                i = p;
+        }
+
+        return (size_t) -1;
+}
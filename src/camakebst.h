@@ -5,4 +5,11 @@
 
 void ca_make_bst(const void *input, size_t n, size_t size, void *output);
 
+/* Queries on an array in ca_make_bst() layout. ca_bst_find() returns the index of the in-order first item
+ * comparing equal to the key, or (size_t) -1 if there is none. ca_bst_successor() returns the index of the
+ * in-order successor of item i, or (size_t) -1 if i is the largest item; combined they enumerate runs of
+ * equal items without ever materializing the sorted order. */
+size_t ca_bst_find(const void *t, size_t n, size_t size, const void *key, int (*compare)(const void *key, const void *item));
+size_t ca_bst_successor(size_t n, size_t i);
+
 #endif
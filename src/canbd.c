@@ -18,6 +18,10 @@
 
 #define NBD_MAX 1024
 
+/* Maximum number of requests we are willing to pick up from the socket before servicing one. The kernel limits
+ * in-flight commands per device anyway, this is merely a safety cap against unbounded queue growth. */
+#define NBD_QUEUE_MAX 256U
+
 struct CaBlockDevice {
         int device_fd;
         int socket_fd[2];
@@ -28,6 +32,15 @@ struct CaBlockDevice {
 
         struct nbd_request last_request;
 
+        /* Requests read off the socket but not serviced yet. The kernel issues many commands in parallel, we
+         * pick them up eagerly and service them elevator-style (sorted by offset), replying out of order via
+         * each request's handle. */
+        struct nbd_request *queue;
+        size_t n_queue;
+        size_t queue_allocated;
+
+        uint64_t last_serviced_offset;
+
         uint64_t size;
 
         int friendly_name_fd;
@@ -66,6 +79,7 @@ CaBlockDevice *ca_block_device_unref(CaBlockDevice *d) {
         }
 
         free(d->device_path);
+        free(d->queue);
 
         safe_close(d->friendly_name_fd);
         free(d->friendly_name);
@@ -350,7 +364,10 @@ int ca_block_device_open(CaBlockDevice *d) {
                 goto fail;
         }
 
-        if (ioctl(d->device_fd, NBD_SET_FLAGS, (unsigned long) NBD_FLAG_READ_ONLY) < 0) {
+        /* We advertise TRIM even though we are read-only: the block layer may still discard regions (e.g. via
+         * BLKDISCARD before a reformat of a stacked device), and since we materialize nothing there's nothing
+         * to do for it but acknowledge. */
+        if (ioctl(d->device_fd, NBD_SET_FLAGS, (unsigned long) (NBD_FLAG_HAS_FLAGS|NBD_FLAG_READ_ONLY|NBD_FLAG_SEND_TRIM)) < 0) {
                 r = -errno;
                 goto fail;
         }
@@ -389,8 +406,23 @@ fail:
         return r;
 }
 
+static int ca_block_device_send_reply(CaBlockDevice *d, const struct nbd_request *req, int error) {
+        struct nbd_reply reply = {
+                .magic = htobe32(NBD_REPLY_MAGIC),
+                .error = htobe32(error),
+        };
+
+        assert(d);
+        assert(req);
+
+        memcpy(reply.handle, req->handle, sizeof(reply.handle));
+
+        return loop_write_block(d->socket_fd[0], &reply, sizeof(reply));
+}
+
 int ca_block_device_step(CaBlockDevice *d) {
-        ssize_t l;
+        size_t i, j;
+        int r;
 
         if (!d)
                 return -EINVAL;
@@ -398,24 +430,85 @@ int ca_block_device_step(CaBlockDevice *d) {
         if (d->last_request.magic != 0)
                 return CA_BLOCK_DEVICE_REQUEST;
 
-        l = read(d->socket_fd[0], &d->last_request, sizeof(d->last_request));
-        if (l < 0) {
-                if (errno == EAGAIN)
-                        return CA_BLOCK_DEVICE_POLL;
+        /* Drain everything the kernel has queued up for us before servicing anything, so that we know the
+         * full set of outstanding requests and may pick the cheapest one to go for next. */
 
-                return -errno;
+        while (d->n_queue < NBD_QUEUE_MAX) {
+                struct nbd_request req;
+                ssize_t l;
+
+                l = read(d->socket_fd[0], &req, sizeof(req));
+                if (l < 0) {
+                        if (errno == EAGAIN)
+                                break;
+
+                        return -errno;
+                }
+                if (l != sizeof(req))
+                        return -EBADMSG;
+
+                if (be32toh(req.magic) != NBD_REQUEST_MAGIC)
+                        return -EBADMSG;
+
+                switch (be32toh(req.type)) {
+
+                case NBD_CMD_READ:
+                        if (be32toh(req.len) == 0)
+                                return -EBADMSG;
+
+                        if (!GREEDY_REALLOC(d->queue, d->queue_allocated, d->n_queue + 1))
+                                return -ENOMEM;
+
+                        d->queue[d->n_queue++] = req;
+                        break;
+
+                case NBD_CMD_TRIM:
+                        /* We never materialize anything, hence there's nothing to discard. Acknowledge
+                         * immediately, out of order, so that discards don't stall behind reads. */
+
+                        r = ca_block_device_send_reply(d, &req, 0);
+                        if (r < 0)
+                                return r;
+
+                        break;
+
+                default:
+                        return -EBADMSG;
+                }
         }
-        if (l != sizeof(d->last_request))
-                return -EBADMSG;
 
-        if (be32toh(d->last_request.magic) != NBD_REQUEST_MAGIC)
-                return -EBADMSG;
+        if (d->n_queue == 0)
+                return CA_BLOCK_DEVICE_POLL;
+
+        /* Service requests elevator-style: pick the pending request with the lowest offset at or beyond the
+         * last serviced one, so that the (inherently sequential) synchronizer pipeline behind us seeks as
+         * little as possible. If nothing lies ahead anymore, wrap around to the lowest offset. */
+
+        j = (size_t) -1;
+        for (i = 0; i < d->n_queue; i++) {
+                uint64_t from;
 
-        if (be32toh(d->last_request.type) != NBD_CMD_READ)
-                return -EBADMSG;
+                from = be64toh(d->queue[i].from);
 
-        if (be32toh(d->last_request.len) == 0)
-                return -EBADMSG;
+                if (j == (size_t) -1) {
+                        j = i;
+                        continue;
+                }
+
+                if ((from >= d->last_serviced_offset) != (be64toh(d->queue[j].from) >= d->last_serviced_offset)) {
+                        if (from >= d->last_serviced_offset)
+                                j = i;
+                        continue;
+                }
+
+                if (from < be64toh(d->queue[j].from))
+                        j = i;
+        }
+
+        d->last_request = d->queue[j];
+
+        memmove(d->queue + j, d->queue + j + 1, (d->n_queue - j - 1) * sizeof(struct nbd_request));
+        d->n_queue--;
 
         /* fprintf(stderr, "Got request for +%" PRIu64 " (%" PRIu32 ") fsize=%" PRIu64 "\n", */
         /*         be64toh(d->last_request.from), */
@@ -452,10 +545,6 @@ int ca_block_device_get_request_size(CaBlockDevice *d, uint64_t *ret) {
 }
 
 int ca_block_device_put_data(CaBlockDevice *d, uint64_t offset, const void *data, size_t size) {
-        struct nbd_reply reply = {
-                .magic = htobe32(NBD_REPLY_MAGIC),
-                .error = 0
-        };
         int r;
 
         if (!d)
@@ -472,9 +561,7 @@ int ca_block_device_put_data(CaBlockDevice *d, uint64_t offset, const void *data
         if (size != be32toh(d->last_request.len))
                 return -EBADR;
 
-        memcpy(reply.handle, d->last_request.handle, sizeof(reply.handle));
-
-        r = loop_write_block(d->socket_fd[0], &reply, sizeof(reply));
+        r = ca_block_device_send_reply(d, &d->last_request, 0);
         if (r < 0)
                 return r;
 
@@ -482,6 +569,7 @@ int ca_block_device_put_data(CaBlockDevice *d, uint64_t offset, const void *data
         if (r < 0)
                 return r;
 
+        d->last_serviced_offset = offset + size;
         memset(&d->last_request, 0, sizeof(d->last_request));
 
         return 0;
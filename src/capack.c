@@ -0,0 +1,781 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "capack.h"
+#include "util.h"
+
+/* Once the pack being written grows beyond this we finalize it and start a new one */
+#define CA_PACK_MAX_SIZE (UINT64_C(1) << 30)
+
+typedef struct CaPackItem {
+        CaChunkID id;
+        size_t file_index; /* SIZE_MAX while the entry lives in the pack currently being written */
+        uint64_t offset;
+        uint64_t size;
+        CaChunkCompression compression;
+} CaPackItem;
+
+struct CaPack {
+        char *path; /* the pack/ subdirectory */
+
+        char **files; /* finalized pack files, lazily opened in parallel fds[] */
+        int *fds;
+        size_t n_files;
+        size_t files_allocated;
+        size_t fds_allocated;
+
+        /* All known entries, plus an open-addressed bucket table over them */
+        CaPackItem *items;
+        size_t n_items;
+        size_t items_allocated;
+        size_t *buckets; /* SIZE_MAX denotes an empty bucket, n_buckets is a power of two */
+        size_t n_buckets;
+
+        bool loaded;
+
+        /* The pack currently being written */
+        int write_fd;
+        char *write_path;
+        uint64_t write_offset;
+        size_t first_write_item; /* index into items[] of the first entry of the open pack */
+};
+
+CaPack *ca_pack_new(void) {
+        CaPack *p;
+
+        p = new0(CaPack, 1);
+        if (!p)
+                return NULL;
+
+        p->write_fd = -1;
+
+        return p;
+}
+
+int ca_pack_set_path(CaPack *p, const char *path) {
+        if (!p)
+                return -EINVAL;
+        if (!path)
+                return -EINVAL;
+
+        if (p->path)
+                return -EBUSY;
+
+        p->path = strdup(path);
+        if (!p->path)
+                return -ENOMEM;
+
+        return 0;
+}
+
+static void ca_pack_bucket_insert(CaPack *p, size_t item_index) {
+        size_t i;
+
+        assert(p);
+        assert(p->n_buckets > 0);
+
+        i = (size_t) (p->items[item_index].id.u64[0] & (p->n_buckets - 1));
+
+        while (p->buckets[i] != SIZE_MAX)
+                i = (i + 1) & (p->n_buckets - 1);
+
+        p->buckets[i] = item_index;
+}
+
+static int ca_pack_index_add(CaPack *p, const CaPackItem *item) {
+        assert(p);
+        assert(item);
+
+        if (!GREEDY_REALLOC(p->items, p->items_allocated, p->n_items + 1))
+                return -ENOMEM;
+
+        /* Keep the bucket table at most half full */
+        if ((p->n_items + 1) * 2 > p->n_buckets) {
+                size_t *nb, new_n, i;
+
+                new_n = MAX((size_t) 1024U, p->n_buckets * 2);
+
+                nb = new(size_t, new_n);
+                if (!nb)
+                        return -ENOMEM;
+
+                for (i = 0; i < new_n; i++)
+                        nb[i] = SIZE_MAX;
+
+                free(p->buckets);
+                p->buckets = nb;
+                p->n_buckets = new_n;
+
+                for (i = 0; i < p->n_items; i++)
+                        ca_pack_bucket_insert(p, i);
+        }
+
+        p->items[p->n_items++] = *item;
+        ca_pack_bucket_insert(p, p->n_items - 1);
+
+        return 0;
+}
+
+static CaPackItem *ca_pack_find(CaPack *p, const CaChunkID *chunk_id) {
+        size_t i;
+
+        assert(p);
+        assert(chunk_id);
+
+        if (p->n_buckets == 0)
+                return NULL;
+
+        i = (size_t) (chunk_id->u64[0] & (p->n_buckets - 1));
+
+        while (p->buckets[i] != SIZE_MAX) {
+                CaPackItem *item = p->items + p->buckets[i];
+
+                if (ca_chunk_id_equal(&item->id, chunk_id))
+                        return item;
+
+                i = (i + 1) & (p->n_buckets - 1);
+        }
+
+        return NULL;
+}
+
+static int ca_pack_write_index_file(CaPack *p, const char *pack_path, size_t first_item, uint64_t pack_size) {
+        CaPackIndexHeader h = {
+                .magic = htole64(CA_PACK_INDEX_MAGIC),
+        };
+        char *t = NULL, *final = NULL;
+        size_t i;
+        int fd = -1, r;
+
+        assert(p);
+        assert(pack_path);
+        assert(first_item <= p->n_items);
+
+        /* Writes the sidecar index for the pack entries items[first_item..n_items). Purely an acceleration
+         * structure: if it is missing or stale it is rebuilt by scanning the pack's entry headers. */
+
+        final = strjoin(pack_path, ".index", NULL);
+        if (!final)
+                return -ENOMEM;
+
+        if (asprintf(&t, "%s.%" PRIx64 ".tmp", final, random_u64()) < 0) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        fd = open(t, O_WRONLY|O_CREAT|O_EXCL|O_NOCTTY|O_CLOEXEC, 0444);
+        if (fd < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        write_le64(&h.n_items, p->n_items - first_item);
+        write_le64(&h.pack_size, pack_size);
+
+        r = loop_write(fd, &h, sizeof(h));
+        if (r < 0)
+                goto finish;
+
+        for (i = first_item; i < p->n_items; i++) {
+                CaPackIndexItem item = {};
+
+                memcpy(item.id, p->items[i].id.bytes, CA_CHUNK_ID_SIZE);
+                write_le64(&item.offset, p->items[i].offset);
+                write_le64(&item.size, p->items[i].size);
+                write_le64(&item.compression, (uint64_t) p->items[i].compression);
+
+                r = loop_write(fd, &item, sizeof(item));
+                if (r < 0)
+                        goto finish;
+        }
+
+        if (rename(t, final) < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        t = mfree(t);
+        r = 0;
+
+finish:
+        safe_close(fd);
+
+        if (t)
+                (void) unlink(t);
+
+        free(t);
+        free(final);
+
+        return r;
+}
+
+static int ca_pack_load_index_file(CaPack *p, const char *pack_path, size_t file_index, uint64_t pack_size) {
+        CaPackIndexHeader h;
+        const char *q;
+        uint64_t n, i;
+        ssize_t l;
+        int fd, r;
+
+        assert(p);
+        assert(pack_path);
+
+        /* Returns 1 if the sidecar index was loaded, 0 if it is missing or stale (in which case the caller
+         * shall scan the pack file instead), negative on real errors. */
+
+        q = strjoina(pack_path, ".index");
+
+        fd = open(q, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0)
+                return errno == ENOENT ? 0 : -errno;
+
+        l = loop_read(fd, &h, sizeof(h));
+        if (l < 0) {
+                r = (int) l;
+                goto finish;
+        }
+        if ((size_t) l != sizeof(h) ||
+            le64toh(h.magic) != CA_PACK_INDEX_MAGIC ||
+            read_le64(&h.pack_size) != pack_size) {
+                r = 0; /* Stale or corrupted, rebuild by scanning */
+                goto finish;
+        }
+
+        n = read_le64(&h.n_items);
+
+        for (i = 0; i < n; i++) {
+                CaPackIndexItem buf;
+                CaPackItem item;
+
+                l = loop_read(fd, &buf, sizeof(buf));
+                if (l < 0) {
+                        r = (int) l;
+                        goto finish;
+                }
+                if ((size_t) l != sizeof(buf)) {
+                        r = 0;
+                        goto finish;
+                }
+
+                item = (CaPackItem) {
+                        .file_index = file_index,
+                        .offset = read_le64(&buf.offset),
+                        .size = read_le64(&buf.size),
+                        .compression = (CaChunkCompression) read_le64(&buf.compression),
+                };
+                memcpy(item.id.bytes, buf.id, CA_CHUNK_ID_SIZE);
+
+                if (!IN_SET(item.compression, CA_CHUNK_UNCOMPRESSED, CA_CHUNK_COMPRESSED) ||
+                    item.size == 0 || item.size > CA_PACK_ENTRY_SIZE_MAX ||
+                    item.offset + item.size > pack_size) {
+                        r = 0;
+                        goto finish;
+                }
+
+                r = ca_pack_index_add(p, &item);
+                if (r < 0)
+                        goto finish;
+        }
+
+        r = 1;
+
+finish:
+        safe_close(fd);
+        return r;
+}
+
+static int ca_pack_scan_pack(CaPack *p, size_t file_index, int fd, uint64_t pack_size) {
+        uint64_t offset = sizeof(CaPackHeader);
+        int r;
+
+        assert(p);
+        assert(fd >= 0);
+
+        /* Walks the entry headers of a pack file and registers every complete entry. Trailing partial
+         * entries (from an interrupted writer) are silently ignored. */
+
+        for (;;) {
+                CaPackEntry e;
+                CaPackItem item;
+                ssize_t n;
+
+                n = pread(fd, &e, sizeof(e), offset);
+                if (n < 0)
+                        return -errno;
+                if ((size_t) n != sizeof(e))
+                        break;
+
+                item = (CaPackItem) {
+                        .file_index = file_index,
+                        .offset = offset + sizeof(e),
+                        .size = read_le64(&e.size),
+                        .compression = (CaChunkCompression) read_le64(&e.compression),
+                };
+                memcpy(item.id.bytes, e.id, CA_CHUNK_ID_SIZE);
+
+                if (!IN_SET(item.compression, CA_CHUNK_UNCOMPRESSED, CA_CHUNK_COMPRESSED) ||
+                    item.size == 0 || item.size > CA_PACK_ENTRY_SIZE_MAX)
+                        break;
+                if (item.offset + item.size > pack_size)
+                        break;
+
+                r = ca_pack_index_add(p, &item);
+                if (r < 0)
+                        return r;
+
+                offset = item.offset + item.size;
+        }
+
+        return 0;
+}
+
+static int ca_pack_load(CaPack *p) {
+        struct dirent *de;
+        DIR *d;
+        int r;
+
+        assert(p);
+
+        if (p->loaded)
+                return 0;
+        if (!p->path)
+                return -EUNATCH;
+
+        d = opendir(p->path);
+        if (!d) {
+                if (errno != ENOENT)
+                        return -errno;
+
+                /* No packs (yet) */
+                p->loaded = true;
+                return 0;
+        }
+
+        for (;;) {
+                CaPackHeader h;
+                struct stat st;
+                char *joined;
+                size_t start;
+                ssize_t n;
+                int fd;
+
+                errno = 0;
+                de = readdir(d);
+                if (!de) {
+                        if (errno != 0) {
+                                r = -errno;
+                                goto finish;
+                        }
+
+                        break;
+                }
+
+                if (dot_or_dot_dot(de->d_name))
+                        continue;
+                if (!endswith(de->d_name, CA_PACK_SUFFIX))
+                        continue;
+
+                joined = strjoin(p->path, "/", de->d_name, NULL);
+                if (!joined) {
+                        r = -ENOMEM;
+                        goto finish;
+                }
+
+                fd = open(joined, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+                if (fd < 0) {
+                        r = -errno;
+                        free(joined);
+                        goto finish;
+                }
+
+                if (fstat(fd, &st) < 0) {
+                        r = -errno;
+                        safe_close(fd);
+                        free(joined);
+                        goto finish;
+                }
+
+                n = pread(fd, &h, sizeof(h), 0);
+                if (n < 0) {
+                        r = -errno;
+                        safe_close(fd);
+                        free(joined);
+                        goto finish;
+                }
+                if ((size_t) n != sizeof(h) || le64toh(h.magic) != CA_PACK_MAGIC) {
+                        /* Not one of ours, skip it */
+                        safe_close(fd);
+                        free(joined);
+                        continue;
+                }
+
+                if (!GREEDY_REALLOC(p->files, p->files_allocated, p->n_files + 1) ||
+                    !GREEDY_REALLOC(p->fds, p->fds_allocated, p->n_files + 1)) {
+                        r = -ENOMEM;
+                        safe_close(fd);
+                        free(joined);
+                        goto finish;
+                }
+
+                start = p->n_items;
+
+                r = ca_pack_load_index_file(p, joined, p->n_files, (uint64_t) st.st_size);
+                if (r == 0) {
+                        r = ca_pack_scan_pack(p, p->n_files, fd, (uint64_t) st.st_size);
+                        if (r >= 0)
+                                /* Leave a fresh sidecar behind so the next open is cheap */
+                                (void) ca_pack_write_index_file(p, joined, start, (uint64_t) st.st_size);
+                }
+                free(joined);
+                if (r < 0) {
+                        safe_close(fd);
+                        goto finish;
+                }
+
+                p->fds[p->n_files] = fd;
+                p->files[p->n_files] = NULL; /* name not needed after loading */
+                p->n_files++;
+        }
+
+        p->loaded = true;
+        r = 0;
+
+finish:
+        closedir(d);
+        return r;
+}
+
+int ca_pack_has(CaPack *p, const CaChunkID *chunk_id) {
+        int r;
+
+        if (!p)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+
+        r = ca_pack_load(p);
+        if (r < 0)
+                return r;
+
+        return ca_pack_find(p, chunk_id) ? 1 : 0;
+}
+
+int ca_pack_iterate(CaPack *p, uint64_t *idx, CaChunkID *ret_id) {
+        int r;
+
+        if (!p)
+                return -EINVAL;
+        if (!idx)
+                return -EINVAL;
+        if (!ret_id)
+                return -EINVAL;
+
+        r = ca_pack_load(p);
+        if (r < 0)
+                return r;
+
+        if (*idx >= p->n_items)
+                return 0;
+
+        *ret_id = p->items[*idx].id;
+        (*idx)++;
+
+        return 1;
+}
+
+int ca_pack_get(CaPack *p, const CaChunkID *chunk_id, ReallocBuffer *buffer, CaChunkCompression *ret_effective_compression) {
+        CaPackItem *item;
+        ssize_t n;
+        void *q;
+        int fd, r;
+
+        if (!p)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+        if (!buffer)
+                return -EINVAL;
+
+        r = ca_pack_load(p);
+        if (r < 0)
+                return r;
+
+        item = ca_pack_find(p, chunk_id);
+        if (!item)
+                return -ENOENT;
+
+        fd = item->file_index == SIZE_MAX ? p->write_fd : p->fds[item->file_index];
+        if (fd < 0)
+                return -EUNATCH;
+
+        q = realloc_buffer_extend(buffer, item->size);
+        if (!q)
+                return -ENOMEM;
+
+        n = pread(fd, q, item->size, item->offset);
+        if (n < 0) {
+                r = -errno;
+                realloc_buffer_shorten(buffer, item->size);
+                return r;
+        }
+        if ((uint64_t) n != item->size) {
+                realloc_buffer_shorten(buffer, item->size);
+                return -EPIPE;
+        }
+
+        if (ret_effective_compression)
+                *ret_effective_compression = item->compression;
+
+        return 0;
+}
+
+static int ca_pack_write_manifest(CaPack *p) {
+        ReallocBuffer buf = {};
+        char *tmp = NULL, *final = NULL;
+        DIR *d;
+        int fd = -1, r;
+
+        assert(p);
+
+        /* Rewrites the manifest listing all finalized pack files, so that clients without directory
+         * listings can discover them. Purely an acceleration, callers invoke this best effort. */
+
+        d = opendir(p->path);
+        if (!d)
+                return -errno;
+
+        for (;;) {
+                struct dirent *de;
+
+                errno = 0;
+                de = readdir(d);
+                if (!de) {
+                        if (errno != 0) {
+                                r = -errno;
+                                goto finish;
+                        }
+
+                        break;
+                }
+
+                if (de->d_name[0] == '.')
+                        continue;
+                if (!endswith(de->d_name, CA_PACK_SUFFIX))
+                        continue;
+
+                if (!realloc_buffer_append(&buf, de->d_name, strlen(de->d_name)) ||
+                    !realloc_buffer_append(&buf, "\n", 1)) {
+                        r = -ENOMEM;
+                        goto finish;
+                }
+        }
+
+        if (asprintf(&tmp, "%s/.%s.%" PRIx64 ".tmp", p->path, CA_PACK_MANIFEST_FILENAME, random_u64()) < 0) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOCTTY|O_CLOEXEC, 0444);
+        if (fd < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        r = loop_write(fd, realloc_buffer_data(&buf), realloc_buffer_size(&buf));
+        if (r < 0)
+                goto finish;
+
+        if (asprintf(&final, "%s/%s", p->path, CA_PACK_MANIFEST_FILENAME) < 0) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        if (rename(tmp, final) < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        tmp = mfree(tmp);
+        r = 0;
+
+finish:
+        if (tmp)
+                (void) unlink(tmp);
+        free(tmp);
+        free(final);
+        safe_close(fd);
+        realloc_buffer_free(&buf);
+        closedir(d);
+
+        return r;
+}
+
+static int ca_pack_finalize(CaPack *p) {
+        char *final = NULL;
+        size_t i, file_index;
+        int r;
+
+        assert(p);
+
+        if (p->write_fd < 0)
+                return 0;
+
+        if (!GREEDY_REALLOC(p->files, p->files_allocated, p->n_files + 1) ||
+            !GREEDY_REALLOC(p->fds, p->fds_allocated, p->n_files + 1))
+                return -ENOMEM;
+
+        if (asprintf(&final, "%s/%016" PRIx64 CA_PACK_SUFFIX, p->path, random_u64()) < 0)
+                return -ENOMEM;
+
+        if (rename(p->write_path, final) < 0) {
+                free(final);
+                return -errno;
+        }
+
+        /* Best effort — if this fails the pack is simply rescanned on the next open */
+        (void) ca_pack_write_index_file(p, final, p->first_write_item, p->write_offset);
+
+        /* Also best effort — without it remote clients fall back to chunk-wise fetching */
+        (void) ca_pack_write_manifest(p);
+
+        free(final);
+
+        file_index = p->n_files;
+        p->fds[file_index] = p->write_fd;
+        p->files[file_index] = NULL;
+        p->n_files++;
+
+        for (i = p->first_write_item; i < p->n_items; i++)
+                if (p->items[i].file_index == SIZE_MAX)
+                        p->items[i].file_index = file_index;
+
+        p->write_fd = -1; /* ownership moved to fds[] */
+        p->write_path = mfree(p->write_path);
+        p->write_offset = 0;
+
+        r = 0;
+        return r;
+}
+
+int ca_pack_put(CaPack *p, const CaChunkID *chunk_id, CaChunkCompression effective_compression, const void *data, uint64_t size) {
+        CaPackEntry e = {};
+        CaPackItem item;
+        int r;
+
+        if (!p)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+        if (!IN_SET(effective_compression, CA_CHUNK_UNCOMPRESSED, CA_CHUNK_COMPRESSED))
+                return -EINVAL;
+        if (!data)
+                return -EINVAL;
+        if (size <= 0)
+                return -EINVAL;
+
+        r = ca_pack_load(p);
+        if (r < 0)
+                return r;
+
+        if (ca_pack_find(p, chunk_id))
+                return -EEXIST;
+
+        if (p->write_fd < 0) {
+                CaPackHeader h = {
+                        .magic = htole64(CA_PACK_MAGIC),
+                };
+
+                if (mkdir(p->path, 0777) < 0 && errno != EEXIST)
+                        return -errno;
+
+                /* The pack is written under a hidden temporary name, and only given its final name (plus its
+                 * index) when complete, so that concurrent readers never see a growing pack. */
+                if (asprintf(&p->write_path, "%s/.%" PRIx64 ".tmp", p->path, random_u64()) < 0)
+                        return -ENOMEM;
+
+                p->write_fd = open(p->write_path, O_RDWR|O_CREAT|O_EXCL|O_NOCTTY|O_CLOEXEC, 0444);
+                if (p->write_fd < 0) {
+                        r = -errno;
+                        p->write_path = mfree(p->write_path);
+                        return r;
+                }
+
+                r = loop_write(p->write_fd, &h, sizeof(h));
+                if (r < 0)
+                        return r;
+
+                p->write_offset = sizeof(h);
+                p->first_write_item = p->n_items;
+        }
+
+        write_le64(&e.size, size);
+        write_le64(&e.compression, (uint64_t) effective_compression);
+        memcpy(e.id, chunk_id->bytes, CA_CHUNK_ID_SIZE);
+
+        r = loop_write(p->write_fd, &e, sizeof(e));
+        if (r < 0)
+                return r;
+
+        r = loop_write(p->write_fd, data, size);
+        if (r < 0)
+                return r;
+
+        item = (CaPackItem) {
+                .id = *chunk_id,
+                .file_index = SIZE_MAX,
+                .offset = p->write_offset + sizeof(e),
+                .size = size,
+                .compression = effective_compression,
+        };
+
+        r = ca_pack_index_add(p, &item);
+        if (r < 0)
+                return r;
+
+        p->write_offset += sizeof(e) + size;
+
+        if (p->write_offset >= CA_PACK_MAX_SIZE)
+                return ca_pack_finalize(p);
+
+        return 0;
+}
+
+int ca_pack_flush(CaPack *p) {
+        if (!p)
+                return -EINVAL;
+
+        return ca_pack_finalize(p);
+}
+
+CaPack *ca_pack_unref(CaPack *p) {
+        size_t i;
+
+        if (!p)
+                return NULL;
+
+        (void) ca_pack_finalize(p);
+
+        for (i = 0; i < p->n_files; i++) {
+                safe_close(p->fds[i]);
+                free(p->files[i]);
+        }
+        free(p->files);
+        free(p->fds);
+
+        if (p->write_fd >= 0) {
+                /* Finalizing failed, don't leave the temporary file around */
+                safe_close(p->write_fd);
+
+                if (p->write_path)
+                        (void) unlink(p->write_path);
+        }
+        free(p->write_path);
+
+        free(p->items);
+        free(p->buckets);
+        free(p->path);
+
+        return mfree(p);
+}
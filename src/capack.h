@@ -0,0 +1,76 @@
+#ifndef foocapackhfoo
+#define foocapackhfoo
+
+#include <inttypes.h>
+
+#include "cachunk.h"
+#include "cachunkid.h"
+#include "realloc-buffer.h"
+#include "util.h"
+
+/* An alternative chunk storage backend: instead of one loose file per chunk, chunks are appended to large
+ * pack files living in a "pack/" subdirectory of the store, each accompanied by a sidecar index mapping
+ * chunk IDs to (offset, size, compression). Reads become a single pread(), writes append sequentially, and
+ * directory entries scale with the number of packs instead of the number of chunks. Loose chunks continue to
+ * work alongside packs in the same store. */
+
+#define CA_PACK_MAGIC UINT64_C(0x636b6e7550616b31)       /* "ckn uPak1" */
+#define CA_PACK_INDEX_MAGIC UINT64_C(0x636b6e7549647831) /* "ckn uIdx1" */
+
+#define CA_PACK_SUFFIX ".capack"
+#define CA_PACK_INDEX_SUFFIX ".capack.index"
+
+/* A plain text file in the pack/ subdirectory listing all finalized pack file names, one per line, so that
+ * clients without directory listings (e.g. the HTTP helper talking to a dumb CDN) can discover the packs */
+#define CA_PACK_MANIFEST_FILENAME "manifest"
+
+/* An upper bound for sane entry sizes, used to detect corrupted pack files and indexes. Compressed entries
+ * may exceed the chunk size limit slightly for incompressible data, hence be generous. */
+#define CA_PACK_ENTRY_SIZE_MAX (CA_CHUNK_SIZE_LIMIT_MAX * 2)
+
+/* The on-disk format: a pack file is a CaPackHeader followed by (CaPackEntry, payload) pairs; the sidecar
+ * index is a CaPackIndexHeader followed by CaPackIndexItem records. These are public so that remoting
+ * helpers can parse indexes they fetched from afar. */
+
+typedef struct CaPackHeader {
+        le64_t magic;
+} CaPackHeader;
+
+typedef struct CaPackEntry {
+        le64_t size;        /* size of the payload following this header */
+        le64_t compression; /* CaChunkCompression, never CA_CHUNK_AS_IS */
+        uint8_t id[CA_CHUNK_ID_SIZE];
+        /* Followed by the payload */
+} CaPackEntry;
+
+typedef struct CaPackIndexHeader {
+        le64_t magic;
+        le64_t n_items;
+        le64_t pack_size; /* size of the pack file this index describes, for staleness detection */
+} CaPackIndexHeader;
+
+typedef struct CaPackIndexItem {
+        uint8_t id[CA_CHUNK_ID_SIZE];
+        le64_t offset; /* file offset of the payload */
+        le64_t size;
+        le64_t compression;
+} CaPackIndexItem;
+
+typedef struct CaPack CaPack;
+
+CaPack *ca_pack_new(void);
+CaPack *ca_pack_unref(CaPack *p);
+
+int ca_pack_set_path(CaPack *p, const char *path);
+
+int ca_pack_has(CaPack *p, const CaChunkID *chunk_id);
+
+/* Iterate over all chunk IDs in the packs: initialize *idx to 0, returns > 0 per entry, 0 at the end */
+int ca_pack_iterate(CaPack *p, uint64_t *idx, CaChunkID *ret_id);
+int ca_pack_get(CaPack *p, const CaChunkID *chunk_id, ReallocBuffer *buffer, CaChunkCompression *ret_effective_compression);
+int ca_pack_put(CaPack *p, const CaChunkID *chunk_id, CaChunkCompression effective_compression, const void *data, uint64_t size);
+
+/* Finalize the pack currently being written, if any: give it its final name and write its sidecar index */
+int ca_pack_flush(CaPack *p);
+
+#endif
@@ -0,0 +1,34 @@
+#include "caprofile.h"
+
+const char *ca_profile_stage_to_string(CaProfileStage stage) {
+
+        switch (stage) {
+
+        case CA_PROFILE_CHUNKER:
+                return "chunker";
+
+        case CA_PROFILE_DIGEST:
+                return "digest";
+
+        case CA_PROFILE_ENCODER:
+                return "encoder";
+
+        case CA_PROFILE_DECODER:
+                return "decoder";
+
+        case CA_PROFILE_SEED_GET:
+                return "seed-get";
+
+        case CA_PROFILE_STORE_GET:
+                return "store-get";
+
+        case CA_PROFILE_STORE_PUT:
+                return "store-put";
+
+        case CA_PROFILE_POLL:
+                return "poll";
+
+        default:
+                return NULL;
+        }
+}
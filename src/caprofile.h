@@ -0,0 +1,65 @@
+#ifndef foocaprofilehfoo
+#define foocaprofilehfoo
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "util.h"
+
+/* Lightweight per-stage performance counters: wall-clock time, bytes processed and number of calls,
+ * accumulated per pipeline stage. The sampling is a clock_gettime() pair per operation and is only taken
+ * when profiling was explicitly enabled, hence this stays compiled in unconditionally. */
+
+typedef enum CaProfileStage {
+        CA_PROFILE_CHUNKER,    /* splitting the payload stream into chunks */
+        CA_PROFILE_DIGEST,     /* computing chunk IDs */
+        CA_PROFILE_ENCODER,    /* serializing the file system into the archive stream */
+        CA_PROFILE_DECODER,    /* writing the archive stream back to the file system */
+        CA_PROFILE_SEED_GET,   /* chunk lookups in the local seeds */
+        CA_PROFILE_STORE_GET,  /* chunk reads from local stores */
+        CA_PROFILE_STORE_PUT,  /* chunk writes to local stores, including compression */
+        CA_PROFILE_POLL,       /* waiting for remote stores and I/O */
+        _CA_PROFILE_STAGE_MAX,
+        _CA_PROFILE_STAGE_INVALID = -1,
+} CaProfileStage;
+
+typedef struct CaProfileCounter {
+        uint64_t nsec;
+        uint64_t bytes;
+        uint64_t n_calls;
+} CaProfileCounter;
+
+typedef struct CaProfile {
+        bool enabled;
+        CaProfileCounter counters[_CA_PROFILE_STAGE_MAX];
+} CaProfile;
+
+const char *ca_profile_stage_to_string(CaProfileStage stage);
+
+/* Returns the start timestamp of an operation, or 0 when profiling is off, so that the fast path is a
+ * single branch */
+static inline uint64_t ca_profile_begin(const CaProfile *p) {
+
+        if (!p || !p->enabled)
+                return 0;
+
+        return now(CLOCK_MONOTONIC);
+}
+
+static inline void ca_profile_end(CaProfile *p, CaProfileStage stage, uint64_t t, uint64_t n_bytes) {
+        CaProfileCounter *c;
+
+        if (t == 0) /* profiling was off when the operation began */
+                return;
+
+        assert(p);
+        assert(stage >= 0 && stage < _CA_PROFILE_STAGE_MAX);
+
+        c = p->counters + stage;
+        c->nsec += now(CLOCK_MONOTONIC) - t;
+        c->bytes += n_bytes;
+        c->n_calls++;
+}
+
+#endif
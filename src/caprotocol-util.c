@@ -28,6 +28,9 @@ const char *ca_protocol_type_name(uint64_t u) {
         case CA_PROTOCOL_MISSING:
                 return "missing";
 
+        case CA_PROTOCOL_BLOOM:
+                return "bloom";
+
         case CA_PROTOCOL_GOODBYE:
                 return "goodbye";
 
@@ -15,6 +15,7 @@ enum {
         CA_PROTOCOL_REQUEST     = UINT64_C(0x8ab427e0f89d9210),
         CA_PROTOCOL_CHUNK       = UINT64_C(0x5213dd180a84bc8c),
         CA_PROTOCOL_MISSING     = UINT64_C(0xd010f9fac82b7b6c),
+        CA_PROTOCOL_BLOOM       = UINT64_C(0x7a4d0c81f3b569e2),
         CA_PROTOCOL_GOODBYE     = UINT64_C(0xad205dbf1a3686c3),
         CA_PROTOCOL_ABORT       = UINT64_C(0xe7d9136b7efea352),
 };
@@ -38,6 +39,17 @@ enum {
  *      C → S: CA_PROTOCOL_REQUEST
  *      S → C: CA_PROTOCOL_CHUNK
  *
+ *      A single CA_PROTOCOL_REQUEST frame may carry any number of chunk IDs. If both sides
+ *      announced CA_PROTOCOL_PIPELINE in their HELLO, the requestor keeps a large number of
+ *      requests outstanding and the responder batches many CHUNK frames per write, so that high
+ *      round-trip-time links aren't throttled to one chunk per round trip.
+ *
+ *      If both sides announced CA_PROTOCOL_BLOOM_FILTER, the side serving chunks may send a
+ *      single CA_PROTOCOL_BLOOM frame right after the HELLO exchange, carrying a bloom filter
+ *      of all chunk IDs in its stores. Since the filter has no false negatives, the peer may
+ *      then skip requests for chunks the filter rules out, instead of burning a round trip on a
+ *      MISSING reply. Chunks the filter claims present still need to be requested as usual.
+ *
  *      Finshed by:
  *      C → S: CA_PROTOCOL_GOODBYE (optional)
  *
@@ -91,7 +103,21 @@ enum {
         CA_PROTOCOL_PUSH_INDEX_CHUNKS = 0x800,  /* I'd like you to pull chunks from me, that are declared in the index I just pulled */
         CA_PROTOCOL_PUSH_ARCHIVE      = 0x1000, /* I'd like to push an archive to you */
 
-        CA_PROTOCOL_FEATURE_FLAGS_MAX = 0x1fff,
+        /* Protocol variations I support */
+        CA_PROTOCOL_PIPELINE          = 0x2000, /* I can handle a deep request/response pipeline */
+        CA_PROTOCOL_BLOOM_FILTER      = 0x4000, /* I can send/evaluate bloom filters of chunk IDs */
+        CA_PROTOCOL_COMPRESSED_INDEX  = 0x8000, /* I can send/receive index data with each frame individually compressed */
+
+        /* The compression algorithm my stores use. If both sides announce the same algorithm, chunks are
+         * passed through in their stored encoding instead of being transcoded for the wire. */
+        CA_PROTOCOL_COMPRESSION_XZ    = 0x10000,
+        CA_PROTOCOL_COMPRESSION_GZIP  = 0x20000,
+        CA_PROTOCOL_COMPRESSION_ZSTD  = 0x40000,
+
+        CA_PROTOCOL_PRIORITY_LANES    = 0x80000, /* I understand multi-lane request priorities */
+        CA_PROTOCOL_CRC32C            = 0x100000, /* I understand CRC32C checksums on CHUNK frames */
+
+        CA_PROTOCOL_FEATURE_FLAGS_MAX = 0x1fffff,
 };
 
 typedef struct CaProtocolFile {  /* Used for index as well as archive */
@@ -111,7 +137,15 @@ typedef struct CaProtocolRequest {
 
 enum {
         CA_PROTOCOL_REQUEST_HIGH_PRIORITY = 1,
-        CA_PROTOCOL_REQUEST_FLAG_MAX = 1,
+
+        /* If both sides announced CA_PROTOCOL_PRIORITY_LANES, the two low bits of the flags field carry a
+         * lane index instead of a plain boolean: 0 = background readahead, 1 = elevated, 2 = interactive
+         * (somebody's read() is blocking on this chunk right now). The responder serves higher lanes first.
+         * When talking to an older peer lanes above 1 degrade to CA_PROTOCOL_REQUEST_HIGH_PRIORITY, which
+         * older implementations interpret exactly as before. */
+        CA_PROTOCOL_REQUEST_PRIORITY_MASK = 3,
+
+        CA_PROTOCOL_REQUEST_FLAG_MAX = 3,
 };
 
 typedef struct CaProtocolChunk {
@@ -123,7 +157,14 @@ typedef struct CaProtocolChunk {
 
 enum {
         CA_PROTOCOL_CHUNK_COMPRESSED = 1,
-        CA_PROTOCOL_CHUNK_FLAG_MAX = 1,
+
+        /* If both sides announced CA_PROTOCOL_CRC32C, the sender may set this bit, in which case the upper
+         * 32 bits of the flags field carry the CRC32C of the data payload. This is cheap link-error
+         * detection (bit flips, truncation) for already-authenticated transports, not a security measure —
+         * it merely allows the receiver to relax the full digest verification of every chunk. */
+        CA_PROTOCOL_CHUNK_CRC32C = 2,
+
+        CA_PROTOCOL_CHUNK_FLAG_MAX = 3,
 };
 
 typedef struct CaProtocolMissing {
@@ -131,6 +172,12 @@ typedef struct CaProtocolMissing {
         uint8_t chunk[CA_CHUNK_ID_SIZE];
 } CaProtocolMissing;
 
+typedef struct CaProtocolBloom {
+        CaProtocolHeader header;
+        le64_t n_hash;
+        uint8_t data[]; /* the filter's bit array, its size follows from the frame size */
+} CaProtocolBloom;
+
 typedef struct CaProtocolGoodbye {
         CaProtocolHeader header;
 } CaProtocolGoodbye;
@@ -1,3 +1,4 @@
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stddef.h>
@@ -5,12 +6,14 @@
 #include <sys/prctl.h>
 #include <sys/stat.h>
 
+#include "cabloom.h"
 #include "caformat-util.h"
 #include "caformat.h"
 #include "caprotocol-util.h"
 #include "caprotocol.h"
 #include "caremote.h"
 #include "def.h"
+#include "cacrc32c.h"
 #include "realloc-buffer.h"
 #include "rm-rf.h"
 #include "util.h"
@@ -56,14 +59,22 @@ struct CaRemote {
         int output_fd;
 
         uint64_t rate_limit_bps;
+        uint64_t rate_limit_burst;  /* token bucket capacity in bytes, 0 → pick a default */
+        uint64_t rate_limit_tokens;
+        uint64_t rate_limit_nsec;   /* time of the last bucket refill, 0 if no shaped write happened yet */
+
+        uint64_t n_wire_bytes_read; /* raw wire bytes, for achieved-rate accounting */
+        uint64_t n_wire_bytes_written;
+        uint64_t io_start_nsec;
 
         ReallocBuffer input_buffer;
         ReallocBuffer output_buffer;
         ReallocBuffer chunk_buffer;
         ReallocBuffer validate_buffer;
+        ReallocBuffer index_xfer_buffer; /* scratch space for compressing/decompressing index frames */
 
-        uint64_t queue_start_high, queue_start_low;
-        uint64_t queue_end_high, queue_end_low;
+        uint64_t queue_start[_CA_REMOTE_PRIORITY_MAX];
+        uint64_t queue_end[_CA_REMOTE_PRIORITY_MAX];
 
         uint64_t local_feature_flags;
         uint64_t remote_feature_flags;
@@ -74,19 +85,49 @@ struct CaRemote {
         CaChunkID last_chunk;
         bool last_chunk_valid;
 
+        /* The payload of the most recently received chunk, kept around in memory, so that a prompt request
+         * for it doesn't have to take the round-trip through the on-disk cache. */
+        CaChunkID staged_chunk;
+        CaChunkCompression staged_chunk_compression;
+        ReallocBuffer staged_chunk_buffer;
+        bool staged_chunk_valid;
+
         pid_t pid;
 
         bool sent_hello;
         bool sent_goodbye;
+        bool sent_bloom;
+
+        CaBloom *local_bloom; /* Filter of our own stores' chunk IDs, to be sent to the peer */
+        CaBloom *peer_bloom;  /* Filter the peer sent us, covering its stores' chunk IDs */
 
         size_t frame_size;
 
         CaDigestType digest_type;
         CaDigest* validate_digest;
 
+        CaRemoteVerify verify;
+        uint64_t n_validated;       /* counts validation opportunities, for the sampled policy */
+
+        /* Adaptive request window, sized from a bandwidth-delay estimate */
+        uint64_t n_inflight;        /* chunk requests sent but not yet answered by CHUNK/MISSING */
+        uint64_t srtt_nsec;         /* smoothed request→chunk round trip time, 0 → no sample yet */
+        uint64_t window_bytes;      /* smoothed bytes delivered per round trip, 0 → no sample yet */
+        uint64_t chunk_size_est;    /* running average of received chunk payload sizes */
+        CaChunkID rtt_probe_id;
+        uint64_t rtt_probe_nsec;    /* when the probe request was sent, 0 → no probe in flight */
+        uint64_t rtt_probe_bytes;   /* wire bytes read at the time the probe was sent */
+
         uint64_t n_requests;
         uint64_t n_request_bytes;
 
+        uint64_t cache_size_max;   /* If non-zero, keep the on-disk chunk cache below this many bytes */
+        uint64_t cache_usage;      /* Estimated current size of the cache, valid while cache_usage_valid */
+        bool cache_usage_valid;
+
+        uint64_t n_cache_hits;
+        uint64_t n_cache_misses;
+
         CaCompressionType compression_type;
 };
 
@@ -152,7 +193,7 @@ static void ca_remote_remove_cache(CaRemote *rr) {
 
         /* If we shall not remove the cache, at least remove the queueing symlinks */
 
-        FOREACH_STRING(c, "low-priority/", "high-priority/", "chunks/") {
+        FOREACH_STRING(c, "low-priority/", "high-priority/", "interactive/", "chunks/") {
 
                 int fd;
 
@@ -211,6 +252,8 @@ CaRemote* ca_remote_unref(CaRemote *rr) {
         realloc_buffer_free(&rr->output_buffer);
         realloc_buffer_free(&rr->chunk_buffer);
         realloc_buffer_free(&rr->validate_buffer);
+        realloc_buffer_free(&rr->index_xfer_buffer);
+        realloc_buffer_free(&rr->staged_chunk_buffer);
 
         ca_remote_file_free(&rr->index_file);
         ca_remote_file_free(&rr->archive_file);
@@ -222,6 +265,9 @@ CaRemote* ca_remote_unref(CaRemote *rr) {
 
         ca_digest_free(rr->validate_digest);
 
+        ca_bloom_unref(rr->local_bloom);
+        ca_bloom_unref(rr->peer_bloom);
+
         return mfree(rr);
 }
 
@@ -234,6 +280,15 @@ int ca_remote_set_rate_limit_bps(CaRemote *rr, uint64_t rate_limit_bps) {
         return 0;
 }
 
+int ca_remote_set_rate_limit_burst(CaRemote *rr, uint64_t burst_bytes) {
+        if (!rr)
+                return -EINVAL;
+
+        rr->rate_limit_burst = burst_bytes;
+
+        return 0;
+}
+
 int ca_remote_set_local_feature_flags(CaRemote *rr, uint64_t flags) {
         if (!rr)
                 return -EINVAL;
@@ -333,6 +388,57 @@ int ca_remote_get_io_fds(CaRemote *rr, int *ret_input_fd, int *ret_output_fd) {
         return 0;
 }
 
+static uint64_t ca_protocol_compression_flag(CaCompressionType c) {
+
+        /* Maps a compression algorithm to the HELLO feature flag announcing it */
+
+        switch (c) {
+
+        case CA_COMPRESSION_XZ:
+                return CA_PROTOCOL_COMPRESSION_XZ;
+
+        case CA_COMPRESSION_GZIP:
+                return CA_PROTOCOL_COMPRESSION_GZIP;
+
+        case CA_COMPRESSION_ZSTD:
+        case CA_COMPRESSION_ZSTD_LDM: /* produces regular zstd frames, only encoded differently */
+                return CA_PROTOCOL_COMPRESSION_ZSTD;
+
+        default:
+                return 0;
+        }
+}
+
+int ca_remote_no_transcode(CaRemote *rr) {
+        if (!rr)
+                return -EINVAL;
+
+        /* Returns > 0 if the peer announced it uses the same compression algorithm we do. In that case
+         * chunks may travel in whatever encoding the local store keeps them in, and the receiving side
+         * stores them as-is: neither side ever needs to run the compressor for the transfer. */
+
+        if (rr->remote_feature_flags == UINT64_MAX) /* No HELLO seen yet */
+                return 0;
+
+        return !!(rr->remote_feature_flags & ca_protocol_compression_flag(rr->compression_type));
+}
+
+static size_t ca_remote_get_output_low_water(CaRemote *rr) {
+        assert(rr);
+
+        /* Return the output buffer fill level below which we are willing to generate more frames. We
+         * advertise CA_PROTOCOL_PIPELINE in our HELLO unconditionally; if the other side did so too, we may
+         * keep a full buffer of frames queued, so that chunk requests and chunk data are batched into large
+         * writes and high-latency links aren't limited to one frame per round trip. When talking to an older
+         * peer, stick to the old shallow queue. */
+
+        if (rr->remote_feature_flags != UINT64_MAX &&
+            (rr->remote_feature_flags & CA_PROTOCOL_PIPELINE))
+                return REMOTE_BUFFER_SIZE;
+
+        return REMOTE_BUFFER_LOW;
+}
+
 static size_t ca_remote_get_read_size(CaRemote *rr) {
         assert(rr);
 
@@ -343,6 +449,17 @@ static size_t ca_remote_get_read_size(CaRemote *rr) {
         return MAX(rr->frame_size, REMOTE_BUFFER_SIZE);
 }
 
+static bool ca_remote_input_paused(CaRemote *rr) {
+        assert(rr);
+
+        /* Under global memory pressure stop refilling the input buffer as long as unprocessed data is
+         * queued, so that the pending frames drain before more pile up. Reading is never paused on an empty
+         * buffer, hence forward progress remains guaranteed. */
+
+        return realloc_buffer_under_memory_pressure() &&
+                realloc_buffer_size(&rr->input_buffer) > 0;
+}
+
 int ca_remote_get_io_events(CaRemote *rr, short *ret_input_events, short *ret_output_events) {
 
         if (!rr)
@@ -352,7 +469,8 @@ int ca_remote_get_io_events(CaRemote *rr, short *ret_input_events, short *ret_ou
         if (!ret_output_events)
                 return -EINVAL;
 
-        if (realloc_buffer_size(&rr->input_buffer) < ca_remote_get_read_size(rr))
+        if (realloc_buffer_size(&rr->input_buffer) < ca_remote_get_read_size(rr) &&
+            !ca_remote_input_paused(rr))
                 *ret_input_events = POLLIN;
         else
                 *ret_input_events = 0;
@@ -595,6 +713,181 @@ int ca_remote_set_cache_fd(CaRemote *rr, int fd) {
         return 0;
 }
 
+int ca_remote_set_cache_size_max(CaRemote *rr, uint64_t max_size) {
+        if (!rr)
+                return -EINVAL;
+
+        rr->cache_size_max = max_size;
+        return 0;
+}
+
+typedef struct CacheItem {
+        char *path;     /* relative to the cache directory */
+        uint64_t mtime; /* CLOCK_REALTIME in nsec */
+        uint64_t size;
+} CacheItem;
+
+static int cache_item_compare(const void *a, const void *b) {
+        const CacheItem *x = a, *y = b;
+
+        if (x->mtime < y->mtime)
+                return -1;
+        if (x->mtime > y->mtime)
+                return 1;
+
+        return 0;
+}
+
+static int ca_remote_cache_make_room(CaRemote *rr) {
+        size_t n_items = 0, items_allocated = 0, i;
+        CacheItem *items = NULL;
+        uint64_t usage = 0, goal;
+        DIR *d = NULL;
+        int r;
+
+        assert(rr);
+        assert(rr->cache_fd >= 0);
+        assert(rr->cache_size_max > 0);
+
+        /* Enumerates all chunk files in the cache, and removes the least recently used ones until the cache
+         * fits the configured limit again, with an eighth of slack so that we don't run the scan for every
+         * newly cached chunk. The scan also refreshes our usage estimate, which may have drifted if another
+         * instance operates on the same cache directory. Concurrent instances race benignly here: chunk
+         * files are created atomically by rename, and removal of an already removed file is ignored. */
+
+        r = xopendirat(rr->cache_fd, ".", 0, &d);
+        if (r < 0)
+                return r;
+
+        for (;;) {
+                struct dirent *de;
+                struct dirent *de2;
+                DIR *sub;
+                int fd;
+
+                errno = 0;
+                de = readdir(d);
+                if (!de) {
+                        if (errno != 0) {
+                                r = -errno;
+                                goto finish;
+                        }
+                        break;
+                }
+
+                /* Chunk files live in 4-hexchar prefix directories, skip everything else, in particular the
+                 * request queue directories. */
+                if (strlen(de->d_name) != 4 ||
+                    strspn(de->d_name, "0123456789abcdef") != 4)
+                        continue;
+
+                r = xopendirat(rr->cache_fd, de->d_name, O_NOFOLLOW, &sub);
+                if (r == -ENOENT)
+                        continue;
+                if (r < 0)
+                        goto finish;
+
+                fd = dirfd(sub);
+
+                for (;;) {
+                        struct stat st;
+
+                        errno = 0;
+                        de2 = readdir(sub);
+                        if (!de2) {
+                                if (errno != 0) {
+                                        r = -errno;
+                                        closedir(sub);
+                                        goto finish;
+                                }
+                                break;
+                        }
+
+                        if (dot_or_dot_dot(de2->d_name))
+                                continue;
+
+                        if (fstatat(fd, de2->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                                if (errno == ENOENT)
+                                        continue;
+
+                                r = -errno;
+                                closedir(sub);
+                                goto finish;
+                        }
+
+                        if (!S_ISREG(st.st_mode))
+                                continue;
+
+                        if (!GREEDY_REALLOC(items, items_allocated, n_items + 1)) {
+                                r = -ENOMEM;
+                                closedir(sub);
+                                goto finish;
+                        }
+
+                        items[n_items].path = strjoin(de->d_name, "/", de2->d_name);
+                        if (!items[n_items].path) {
+                                r = -ENOMEM;
+                                closedir(sub);
+                                goto finish;
+                        }
+
+                        items[n_items].mtime = timespec_to_nsec(st.st_mtim);
+                        items[n_items].size = (uint64_t) st.st_size;
+                        n_items++;
+
+                        usage += (uint64_t) st.st_size;
+                }
+
+                closedir(sub);
+        }
+
+        goal = rr->cache_size_max - rr->cache_size_max / 8;
+
+        if (usage > goal) {
+                qsort(items, n_items, sizeof(CacheItem), cache_item_compare);
+
+                for (i = 0; i < n_items && usage > goal; i++) {
+                        char *slash;
+
+                        if (unlinkat(rr->cache_fd, items[i].path, 0) < 0 && errno != ENOENT)
+                                continue; /* Skip chunks we can't remove, another instance may hold them open */
+
+                        usage -= MIN(usage, items[i].size);
+
+                        assert_se(slash = strrchr(items[i].path, '/'));
+                        *slash = 0;
+                        (void) unlinkat(rr->cache_fd, items[i].path, AT_REMOVEDIR);
+                }
+        }
+
+        rr->cache_usage = usage;
+        rr->cache_usage_valid = true;
+
+        r = 0;
+
+finish:
+        for (i = 0; i < n_items; i++)
+                free(items[i].path);
+        free(items);
+
+        if (d)
+                closedir(d);
+
+        return r;
+}
+
+static void ca_remote_cache_chunk_added(CaRemote *rr, uint64_t size) {
+        assert(rr);
+
+        if (rr->cache_size_max == 0)
+                return;
+
+        rr->cache_usage += size;
+
+        if (!rr->cache_usage_valid || rr->cache_usage > rr->cache_size_max)
+                (void) ca_remote_cache_make_room(rr);
+}
+
 static int ca_remote_file_set_path(CaRemoteFile *f, const char *path) {
         assert(f);
         assert(path);
@@ -690,7 +983,34 @@ static int ca_remote_init_cache(CaRemote *rr) {
         return 1;
 }
 
-static int ca_remote_enqueue_request(CaRemote *rr, const CaChunkID *id, bool high_priority, bool please_requeue) {
+/* On-disk directory per scheduling lane. The first two names predate the interactive lane, hence the
+ * slightly odd naming. */
+static const char* const ca_remote_queue_name[_CA_REMOTE_PRIORITY_MAX] = {
+        [CA_REMOTE_PRIORITY_BACKGROUND]  = "low-priority/",
+        [CA_REMOTE_PRIORITY_HIGH]        = "high-priority/",
+        [CA_REMOTE_PRIORITY_INTERACTIVE] = "interactive/",
+};
+
+static int ca_remote_queue_name_parse(const char *qpos, const char **ret_position) {
+        CaRemotePriority p;
+
+        assert(qpos);
+
+        for (p = 0; p < _CA_REMOTE_PRIORITY_MAX; p++) {
+                const char *e;
+
+                e = startswith(qpos, ca_remote_queue_name[p]);
+                if (e) {
+                        if (ret_position)
+                                *ret_position = e;
+                        return (int) p;
+                }
+        }
+
+        return -EBADMSG;
+}
+
+static int ca_remote_enqueue_request(CaRemote *rr, const CaChunkID *id, CaRemotePriority priority, bool please_requeue) {
         char ids[CA_CHUNK_ID_FORMAT_MAX];
         uint64_t position;
         const char *f, *queue_name;
@@ -699,27 +1019,23 @@ static int ca_remote_enqueue_request(CaRemote *rr, const CaChunkID *id, bool hig
 
         assert(rr);
         assert(id);
+        assert(priority >= 0 && priority < _CA_REMOTE_PRIORITY_MAX);
 
         r = ca_remote_init_cache(rr);
         if (r < 0)
                 return r;
 
-        /* Enqueues a GET request. We maintain a 2-level priority queue on disk for this, in two directories
-         * "low-priority" and "high-priority". This could be much easier if we could maintain this entirely in memory,
-         * but given that the list might be quite large we use a symlink farm instead. For each queued GET request we
-         * create two symlinks: one pointing from the queue position to the chunk hash, and one the other way. That
+        /* Enqueues a GET request. We maintain a multi-lane priority queue on disk for this, one directory
+         * per lane. This could be much easier if we could maintain this entirely in memory, but given that
+         * the list might be quite large we use a symlink farm instead. For each queued GET request we create
+         * two symlinks: one pointing from the queue position to the chunk hash, and one the other way. That
          * way we can easily enqueue, dequeue and check whether a specific chunk is already queued. */
 
         if (!ca_chunk_id_format(id, ids))
                 return -EINVAL;
 
-        if (high_priority) {
-                queue_name = "high-priority/";
-                position = rr->queue_end_high;
-        } else {
-                queue_name = "low-priority/";
-                position = rr->queue_end_low;
-        }
+        queue_name = ca_remote_queue_name[priority];
+        position = rr->queue_end[priority];
 
         /* Check whether the chunk is already enqueued */
         f = strjoina("chunks/", ids);
@@ -730,32 +1046,35 @@ static int ca_remote_enqueue_request(CaRemote *rr, const CaChunkID *id, bool hig
         if (r >= 0) {
                 uint64_t old_position;
                 const char *p;
+                int old_priority;
 
-                /* Already queued on the same priority? Then there's nothing to do. */
-                if (startswith(qpos, queue_name)) {
-                        r = 0;
+                old_priority = ca_remote_queue_name_parse(qpos, &p);
+                if (old_priority < 0) {
+                        r = old_priority;
                         goto finish;
                 }
 
-                /* Not matching, but the new priority is low? Then there's nothing to do.*/
-                if (!high_priority) {
+                /* Already queued on the same or a more urgent lane? Then there's nothing to do. */
+                if (old_priority >= (int) priority) {
                         r = 0;
                         goto finish;
                 }
 
-                p = startswith(qpos, "low-priority/");
-                if (!p) {
-                        r = -EBADMSG;
-                        goto finish;
-                }
                 r = safe_atou64(p, &old_position);
                 if (r < 0)
                         goto finish;
 
-                /* Was the old low-priority item already dispatched? Don't requeue the item then, except this is explicitly requested. */
-                if (old_position < rr->queue_start_low && !please_requeue) {
-                        r = 0;
-                        goto finish;
+                /* Was the old lower-priority item already dispatched? Don't requeue the item then, except this is explicitly requested. */
+                if (old_position < rr->queue_start[old_priority]) {
+                        if (!please_requeue) {
+                                r = 0;
+                                goto finish;
+                        }
+
+                        /* The chunk will be dispatched a second time, but only one answer will arrive —
+                         * keep the in-flight accounting straight */
+                        if (rr->n_inflight > 0)
+                                rr->n_inflight--;
                 }
 
                 if (unlinkat(rr->cache_fd, f, 0) < 0) {
@@ -790,10 +1109,7 @@ static int ca_remote_enqueue_request(CaRemote *rr, const CaChunkID *id, bool hig
                 goto finish;
         }
 
-        if (high_priority)
-                rr->queue_end_high++;
-        else
-                rr->queue_end_low++;
+        rr->queue_end[priority]++;
 
         /* fprintf(stderr, PID_FMT ": Enqueued request for %s (%s)\n", getpid(), ids, qpos); */
 
@@ -804,12 +1120,11 @@ finish:
         return r;
 }
 
-static int ca_remote_dequeue_request(CaRemote *rr, int only_high_priority, CaChunkID *ret, bool *ret_high_priority) {
-        const char *queue_name;
+static int ca_remote_dequeue_request(CaRemote *rr, int only_priority, CaChunkID *ret, CaRemotePriority *ret_priority) {
         uint64_t position;
         char *ids;
         CaChunkID id;
-        bool hp;
+        CaRemotePriority p;
         int r;
 
         assert(rr);
@@ -819,20 +1134,28 @@ static int ca_remote_dequeue_request(CaRemote *rr, int only_high_priority, CaChu
                 return -ENODATA;
 
         for (;;) {
+                int found = -1;
                 char *qpos;
 
-                if (rr->queue_start_high < rr->queue_end_high && only_high_priority != 0) {
-                        hp = true;
-                        position = rr->queue_start_high;
-                        queue_name = "high-priority/";
-                } else if (rr->queue_start_low < rr->queue_end_low && only_high_priority <= 0) {
-                        hp = false;
-                        position = rr->queue_start_low;
-                        queue_name = "low-priority/";
-                } else
+                /* Pick the most urgent non-empty lane, unless we are asked to stick to a specific one. */
+                for (p = _CA_REMOTE_PRIORITY_MAX; p > 0; ) {
+                        p--;
+
+                        if (only_priority >= 0 && (int) p != only_priority)
+                                continue;
+
+                        if (rr->queue_start[p] < rr->queue_end[p]) {
+                                found = (int) p;
+                                break;
+                        }
+                }
+                if (found < 0)
                         return -ENODATA;
 
-                if (asprintf(&qpos, "%s%" PRIu64, queue_name, position) < 0)
+                p = (CaRemotePriority) found;
+                position = rr->queue_start[p];
+
+                if (asprintf(&qpos, "%s%" PRIu64, ca_remote_queue_name[p], position) < 0)
                         return -ENOMEM;
 
                 r = readlinkat_malloc(rr->cache_fd, qpos, &ids);
@@ -843,10 +1166,7 @@ static int ca_remote_dequeue_request(CaRemote *rr, int only_high_priority, CaChu
                         return r;
 
                 /* Hmm, this symlink is missing? I figure it was already processed otherwise */
-                if (hp)
-                        rr->queue_start_high++;
-                else
-                        rr->queue_start_low++;
+                rr->queue_start[p]++;
         }
 
         if (!ca_chunk_id_parse(ids, &id)) {
@@ -857,15 +1177,12 @@ static int ca_remote_dequeue_request(CaRemote *rr, int only_high_priority, CaChu
         /* fprintf(stderr, PID_FMT ": Dequeued request for %s\n", getpid(), ids); */
         free(ids);
 
-        if (hp)
-                rr->queue_start_high++;
-        else
-                rr->queue_start_low++;
+        rr->queue_start[p]++;
 
         *ret = id;
 
-        if (ret_high_priority)
-                *ret_high_priority = hp;
+        if (ret_priority)
+                *ret_priority = p;
 
         return 0;
 }
@@ -983,6 +1300,8 @@ static int ca_remote_start(CaRemote *rr) {
 
                         if (rr->rate_limit_bps != UINT64_MAX)
                                 argc++;
+                        if (rr->rate_limit_burst != 0)
+                                argc++;
 
                         args = newa(char*, argc + 1);
 
@@ -1021,6 +1340,14 @@ static int ca_remote_start(CaRemote *rr) {
                                 i++;
                         }
 
+                        if (rr->rate_limit_burst != 0) {
+                                r = asprintf(args + i, "--rate-limit-burst=%" PRIu64, rr->rate_limit_burst);
+                                if (r < 0)
+                                        return log_oom();
+
+                                i++;
+                        }
+
                         args[i++] = (char*) ((rr->local_feature_flags & (CA_PROTOCOL_PUSH_CHUNKS|CA_PROTOCOL_PUSH_INDEX|CA_PROTOCOL_PUSH_ARCHIVE)) ? "push" : "pull");
                         args[i++] = /* rr->base_url ? rr->base_url + skip :*/ (char*) "-";
                         args[i++] = rr->archive_url ? rr->archive_url + skip : (char*) "-";
@@ -1082,6 +1409,92 @@ static int ca_remote_start(CaRemote *rr) {
         return CA_REMOTE_POLL;
 }
 
+static uint64_t ca_remote_rate_limit_get_burst(CaRemote *rr) {
+        assert(rr);
+        assert(rr->rate_limit_bps != UINT64_MAX);
+
+        if (rr->rate_limit_burst != 0)
+                return rr->rate_limit_burst;
+
+        /* Default to 100ms worth of traffic, but at least one full write, so that moderate limits don't
+         * degenerate into one tiny write per wakeup. */
+        return MAX((uint64_t) BUFFER_SIZE, rr->rate_limit_bps / 10);
+}
+
+static uint64_t ca_remote_rate_limit_refill(CaRemote *rr) {
+        uint64_t t, burst;
+
+        assert(rr);
+        assert(rr->rate_limit_bps != UINT64_MAX);
+
+        /* Tops up the token bucket with everything accrued since the last refill, and returns the current
+         * token count, i.e. how many bytes we may write right now. */
+
+        burst = ca_remote_rate_limit_get_burst(rr);
+        t = now(CLOCK_MONOTONIC);
+
+        if (rr->rate_limit_nsec == 0)
+                /* First shaped write: start with a full bucket */
+                rr->rate_limit_tokens = burst;
+        else if (t > rr->rate_limit_nsec) {
+                uint64_t elapsed, whole, frac, refill;
+
+                elapsed = t - rr->rate_limit_nsec;
+                whole = elapsed / NSEC_PER_SEC;
+                frac = elapsed % NSEC_PER_SEC;
+
+                if (whole > 0 && rr->rate_limit_bps > UINT64_MAX / whole)
+                        refill = UINT64_MAX;
+                else
+                        refill = whole * rr->rate_limit_bps;
+
+                if (rr->rate_limit_bps < UINT64_MAX / NSEC_PER_SEC) {
+                        uint64_t add;
+
+                        add = rr->rate_limit_bps * frac / NSEC_PER_SEC;
+                        refill = refill > UINT64_MAX - add ? UINT64_MAX : refill + add;
+                } else
+                        refill = UINT64_MAX;
+
+                rr->rate_limit_tokens = rr->rate_limit_tokens > UINT64_MAX - refill ?
+                        UINT64_MAX : rr->rate_limit_tokens + refill;
+                rr->rate_limit_tokens = MIN(rr->rate_limit_tokens, burst);
+        }
+
+        rr->rate_limit_nsec = t;
+        return rr->rate_limit_tokens;
+}
+
+static uint64_t ca_remote_rate_limit_wait_nsec(CaRemote *rr) {
+        uint64_t need;
+
+        assert(rr);
+        assert(rr->rate_limit_bps != UINT64_MAX);
+
+        /* How long until the bucket holds enough tokens for a useful write again? */
+
+        need = MIN((uint64_t) realloc_buffer_size(&rr->output_buffer),
+                   ca_remote_rate_limit_get_burst(rr));
+        if (need <= rr->rate_limit_tokens)
+                return 0;
+        need -= rr->rate_limit_tokens;
+
+        if (need > UINT64_MAX / NSEC_PER_SEC)
+                return UINT64_MAX;
+
+        return need * NSEC_PER_SEC / MAX(rr->rate_limit_bps, UINT64_C(1));
+}
+
+static void ca_remote_account_io(CaRemote *rr, uint64_t n_read, uint64_t n_written) {
+        assert(rr);
+
+        if (rr->io_start_nsec == 0)
+                rr->io_start_nsec = now(CLOCK_MONOTONIC);
+
+        rr->n_wire_bytes_read += n_read;
+        rr->n_wire_bytes_written += n_written;
+}
+
 static int ca_remote_read(CaRemote *rr) {
         size_t left, rsize;
         ssize_t n;
@@ -1094,6 +1507,9 @@ static int ca_remote_read(CaRemote *rr) {
         if (realloc_buffer_size(&rr->input_buffer) >= rsize)
                 return CA_REMOTE_POLL;
 
+        if (ca_remote_input_paused(rr))
+                return CA_REMOTE_POLL;
+
         left = rsize - realloc_buffer_size(&rr->input_buffer);
 
         p = realloc_buffer_extend(&rr->input_buffer, left);
@@ -1107,21 +1523,45 @@ static int ca_remote_read(CaRemote *rr) {
         if (n == 0) /* EOF */
                 return -EPIPE;
 
+        ca_remote_account_io(rr, (uint64_t) n, 0);
+
         return CA_REMOTE_STEP;
 }
 
 static int ca_remote_write(CaRemote *rr) {
+        size_t m;
         ssize_t n;
 
         assert(rr);
 
-        if (realloc_buffer_size(&rr->output_buffer) == 0)
+        m = realloc_buffer_size(&rr->output_buffer);
+        if (m == 0)
                 return CA_REMOTE_POLL;
 
-        n = write(rr->output_fd, realloc_buffer_data(&rr->output_buffer), realloc_buffer_size(&rr->output_buffer));
+        if (rr->rate_limit_bps != UINT64_MAX) {
+                uint64_t quota;
+
+                /* Pace writes with a token bucket instead of dumping whole buffers at line rate: the bucket
+                 * fills continuously at the configured rate and never holds more than the burst size, so
+                 * traffic stays smooth. When it's empty, ca_remote_poll() sleeps until the next tokens have
+                 * accrued. */
+
+                quota = ca_remote_rate_limit_refill(rr);
+                if (quota == 0)
+                        return CA_REMOTE_POLL;
+
+                m = (size_t) MIN((uint64_t) m, quota);
+        }
+
+        n = write(rr->output_fd, realloc_buffer_data(&rr->output_buffer), m);
         if (n < 0)
                 return errno == EAGAIN ? CA_REMOTE_POLL : -errno;
 
+        if (rr->rate_limit_bps != UINT64_MAX)
+                rr->rate_limit_tokens -= MIN(rr->rate_limit_tokens, (uint64_t) n);
+
+        ca_remote_account_io(rr, 0, (uint64_t) n);
+
         realloc_buffer_advance(&rr->output_buffer, n);
 
         if (rr->sent_goodbye && realloc_buffer_size(&rr->output_buffer) == 0)
@@ -1179,24 +1619,31 @@ static int ca_remote_process_hello(CaRemote *rr, const CaProtocolHello *hello) {
         return CA_REMOTE_STEP;
 }
 
-static int ca_remote_file_process(CaRemoteFile *f, const CaProtocolFile *p) {
-        size_t sz;
+static bool ca_remote_index_compressed(CaRemote *rr) {
+        assert(rr);
+
+        /* We always announce CA_PROTOCOL_COMPRESSED_INDEX ourselves, hence index frames are compressed
+         * whenever the peer announced it too. */
+
+        return rr->remote_feature_flags != UINT64_MAX &&
+                (rr->remote_feature_flags & CA_PROTOCOL_COMPRESSED_INDEX);
+}
+
+static int ca_remote_file_process(CaRemoteFile *f, const void *data, size_t sz) {
         int r;
 
         assert(f);
-        assert(p);
+        assert(data || sz == 0);
 
         if (f->complete)
                 return -EBADMSG;
 
-        sz = read_le64(&p->header.size) - offsetof(CaProtocolFile, data);
-
         if (f->fd >=0) {
-                r = loop_write(f->fd, p->data, sz);
+                r = loop_write(f->fd, data, sz);
                 if (r < 0)
                         return r;
         } else {
-                if (!realloc_buffer_append(&f->buffer, p->data, sz))
+                if (!realloc_buffer_append(&f->buffer, data, sz))
                         return -ENOMEM;
         }
 
@@ -1215,12 +1662,26 @@ static int ca_remote_file_process_eof(CaRemoteFile *f, const CaProtocolFileEOF *
 }
 
 static int ca_remote_process_index(CaRemote *rr, const CaProtocolFile *p) {
+        size_t sz;
         int r;
 
         assert(rr);
         assert(p);
 
-        r = ca_remote_file_process(&rr->index_file, p);
+        sz = read_le64(&p->header.size) - offsetof(CaProtocolFile, data);
+
+        if (ca_remote_index_compressed(rr)) {
+                realloc_buffer_empty(&rr->index_xfer_buffer);
+
+                r = ca_decompress(p->data, sz, &rr->index_xfer_buffer);
+                if (r < 0)
+                        return r;
+
+                r = ca_remote_file_process(&rr->index_file,
+                                           realloc_buffer_data(&rr->index_xfer_buffer),
+                                           realloc_buffer_size(&rr->index_xfer_buffer));
+        } else
+                r = ca_remote_file_process(&rr->index_file, p->data, sz);
         if (r < 0)
                 return r;
 
@@ -1246,7 +1707,7 @@ static int ca_remote_process_archive(CaRemote *rr, const CaProtocolFile *p) {
         assert(rr);
         assert(p);
 
-        r = ca_remote_file_process(&rr->archive_file, p);
+        r = ca_remote_file_process(&rr->archive_file, p->data, read_le64(&p->header.size) - offsetof(CaProtocolFile, data));
         if (r < 0)
                 return r;
 
@@ -1267,6 +1728,7 @@ static int ca_remote_process_archive_eof(CaRemote *rr, const CaProtocolFileEOF *
 }
 
 static int ca_remote_process_request(CaRemote *rr, const CaProtocolRequest *req) {
+        CaRemotePriority priority;
         const uint8_t *p;
         size_t ms;
         int r;
@@ -1274,40 +1736,221 @@ static int ca_remote_process_request(CaRemote *rr, const CaProtocolRequest *req)
         assert(rr);
         assert(req);
 
-        ms = read_le64(&req->header.size) - offsetof(CaProtocolRequest, chunks);
+        ms = read_le64(&req->header.size) - offsetof(CaProtocolRequest, chunks);
+
+        /* Old peers only ever set the HIGH_PRIORITY bit, which decodes as lane 1, exactly as before. Clamp
+         * reserved lane values to the most urgent lane we know. */
+        priority = read_le64(&req->flags) & CA_PROTOCOL_REQUEST_PRIORITY_MASK;
+        if (priority >= _CA_REMOTE_PRIORITY_MAX)
+                priority = _CA_REMOTE_PRIORITY_MAX - 1;
+
+        for (p = req->chunks; p < req->chunks + ms; p += CA_CHUNK_ID_SIZE) {
+                r = ca_remote_enqueue_request(rr, (const CaChunkID*) p, priority, false);
+                if (r < 0)
+                        return r;
+        }
+
+        return CA_REMOTE_REQUEST;
+}
+
+/* Initial window before the first round trip measurement, and the bounds the controller operates in */
+#define CA_REMOTE_WINDOW_BYTES_INITIAL (16U*1024U*1024U)
+#define CA_REMOTE_REQUEST_WINDOW_MIN 8U
+#define CA_REMOTE_REQUEST_WINDOW_MAX 4096U
+
+static uint64_t ca_remote_request_window(CaRemote *rr) {
+        uint64_t wb, per_chunk, w;
+
+        assert(rr);
+
+        /* How many chunk requests to keep in flight. We estimate the path's bandwidth-delay product from
+         * paired RTT/goodput probes — the bytes that arrived between sending a probe request and receiving
+         * its chunk are precisely one round trip's worth of delivery — and allow twice that (in chunks), so
+         * that the window can keep growing until the link, not the window, is the limit. This way the same
+         * binary saturates both high-latency CDN paths and rack-local mirrors without tuning. */
+
+        wb = rr->window_bytes != 0 ? rr->window_bytes : CA_REMOTE_WINDOW_BYTES_INITIAL;
+        per_chunk = rr->chunk_size_est != 0 ? rr->chunk_size_est : (uint64_t) BUFFER_SIZE;
+
+        w = wb * 2 / MAX(per_chunk, UINT64_C(1));
+
+        return MIN(MAX(w, (uint64_t) CA_REMOTE_REQUEST_WINDOW_MIN), (uint64_t) CA_REMOTE_REQUEST_WINDOW_MAX);
+}
+
+static void ca_remote_request_sent(CaRemote *rr, const CaChunkID *id) {
+        uint64_t t;
+
+        assert(rr);
+        assert(id);
+
+        rr->n_inflight++;
+
+        t = now(CLOCK_MONOTONIC);
+
+        /* Drop a probe that was apparently lost (requeued, or answered out of band), so that measurement
+         * doesn't stall forever */
+        if (rr->rtt_probe_nsec != 0 &&
+            t > rr->rtt_probe_nsec + MAX(UINT64_C(10) * rr->srtt_nsec, UINT64_C(30) * NSEC_PER_SEC))
+                rr->rtt_probe_nsec = 0;
+
+        if (rr->rtt_probe_nsec == 0) {
+                rr->rtt_probe_id = *id;
+                rr->rtt_probe_nsec = t;
+                rr->rtt_probe_bytes = rr->n_wire_bytes_read;
+        }
+}
+
+static void ca_remote_request_answered(CaRemote *rr, const CaChunkID *id) {
+        uint64_t t;
+
+        assert(rr);
+        assert(id);
+
+        if (rr->n_inflight > 0)
+                rr->n_inflight--;
+
+        if (rr->rtt_probe_nsec == 0 || !ca_chunk_id_equal(id, &rr->rtt_probe_id))
+                return;
+
+        t = now(CLOCK_MONOTONIC);
+        if (t > rr->rtt_probe_nsec) {
+                uint64_t sample, delivered;
+
+                sample = t - rr->rtt_probe_nsec;
+                rr->srtt_nsec = rr->srtt_nsec == 0 ? sample : (7 * rr->srtt_nsec + sample) / 8;
+
+                delivered = rr->n_wire_bytes_read - rr->rtt_probe_bytes;
+                rr->window_bytes = rr->window_bytes == 0 ? delivered : (7 * rr->window_bytes + delivered) / 8;
+        }
+
+        rr->rtt_probe_nsec = 0;
+}
+
+static bool ca_remote_crc_negotiated(CaRemote *rr) {
+        assert(rr);
+
+        return rr->remote_feature_flags != UINT64_MAX &&
+                (rr->remote_feature_flags & CA_PROTOCOL_CRC32C);
+}
+
+static int ca_remote_process_chunk(CaRemote *rr, const CaProtocolChunk *chunk) {
+        size_t ms;
+        int r;
+
+        assert(rr);
+        assert(chunk);
+
+        if (rr->cache_fd < 0)
+                return -ENOTTY;
+
+        memcpy(&rr->last_chunk, chunk->chunk, CA_CHUNK_ID_SIZE);
+        rr->last_chunk_valid = true;
+
+        ms = read_le64(&chunk->header.size) - offsetof(CaProtocolChunk, data);
+
+        ca_remote_request_answered(rr, &rr->last_chunk);
+        rr->chunk_size_est = rr->chunk_size_est == 0 ? ms : (7 * rr->chunk_size_est + ms) / 8;
+
+        if (read_le64(&chunk->flags) & CA_PROTOCOL_CHUNK_CRC32C) {
+                /* Cheap link-error detection: the frame carries the CRC32C of the payload in the upper half
+                 * of the flags field. A mismatch means the transport corrupted data, treat it like any
+                 * other malformed frame. */
+                if ((uint32_t) (read_le64(&chunk->flags) >> 32) != ca_crc32c(0, chunk->data, ms))
+                        return -EBADMSG;
+        }
+
+        r = ca_chunk_file_save(rr->cache_fd,
+                               NULL,
+                               NULL,
+                               &rr->last_chunk,
+                               (read_le64(&chunk->flags) & CA_PROTOCOL_CHUNK_COMPRESSED) ? CA_CHUNK_COMPRESSED : CA_CHUNK_UNCOMPRESSED,
+                               CA_CHUNK_AS_IS,
+                               CA_COMPRESSION_DEFAULT,
+                               CA_COMPRESSION_LEVEL_DEFAULT,
+                               chunk->data,
+                               ms);
+        if (r == -EEXIST)
+                return CA_REMOTE_STEP;
+        if (r < 0)
+                return r;
+
+        ca_remote_cache_chunk_added(rr, ms);
+
+        /* Also keep the payload around in memory, so that a prompt request for this chunk can be served
+         * without reading it back from the cache. */
+        rr->staged_chunk_valid = false;
+        realloc_buffer_empty(&rr->staged_chunk_buffer);
+        if (realloc_buffer_append(&rr->staged_chunk_buffer, chunk->data, ms)) {
+                rr->staged_chunk = rr->last_chunk;
+                rr->staged_chunk_compression = (read_le64(&chunk->flags) & CA_PROTOCOL_CHUNK_COMPRESSED) ? CA_CHUNK_COMPRESSED : CA_CHUNK_UNCOMPRESSED;
+                rr->staged_chunk_valid = true;
+        }
+
+        return CA_REMOTE_CHUNK;
+}
+
+static int ca_remote_fetch_staged_chunk(
+                CaRemote *rr,
+                const CaChunkID *chunk_id,
+                CaChunkCompression desired_compression,
+                CaChunkCompression *ret_effective_compression) {
+
+        int r;
+
+        assert(rr);
+        assert(chunk_id);
+
+        /* Copies the in-memory staging copy of the specified chunk into the regular chunk buffer, in the
+         * compression requested. Returns -ENOENT if the chunk is not staged (or would have to be compressed
+         * first, in which case the on-disk cache is just as good). */
+
+        if (!rr->staged_chunk_valid)
+                return -ENOENT;
+        if (!ca_chunk_id_equal(&rr->staged_chunk, chunk_id))
+                return -ENOENT;
+
+        if (desired_compression == CA_CHUNK_AS_IS || desired_compression == rr->staged_chunk_compression) {
+
+                realloc_buffer_empty(&rr->chunk_buffer);
+
+                if (!realloc_buffer_append(&rr->chunk_buffer,
+                                           realloc_buffer_data(&rr->staged_chunk_buffer),
+                                           realloc_buffer_size(&rr->staged_chunk_buffer)))
+                        return -ENOMEM;
+
+                if (ret_effective_compression)
+                        *ret_effective_compression = rr->staged_chunk_compression;
+
+        } else if (desired_compression == CA_CHUNK_UNCOMPRESSED) {
 
-        for (p = req->chunks; p < req->chunks + ms; p += CA_CHUNK_ID_SIZE) {
-                r = ca_remote_enqueue_request(rr, (const CaChunkID*) p, read_le64(&req->flags) & CA_PROTOCOL_REQUEST_HIGH_PRIORITY, false);
+                realloc_buffer_empty(&rr->chunk_buffer);
+
+                r = ca_decompress(realloc_buffer_data(&rr->staged_chunk_buffer),
+                                  realloc_buffer_size(&rr->staged_chunk_buffer),
+                                  &rr->chunk_buffer);
                 if (r < 0)
                         return r;
-        }
 
-        return CA_REMOTE_REQUEST;
+                if (ret_effective_compression)
+                        *ret_effective_compression = CA_CHUNK_UNCOMPRESSED;
+        } else
+                return -ENOENT;
+
+        return 0;
 }
 
-static int ca_remote_process_chunk(CaRemote *rr, const CaProtocolChunk *chunk) {
-        size_t ms;
+static int ca_remote_process_missing(CaRemote *rr, const CaProtocolMissing *missing) {
         int r;
 
         assert(rr);
-        assert(chunk);
+        assert(missing);
 
         if (rr->cache_fd < 0)
                 return -ENOTTY;
 
-        memcpy(&rr->last_chunk, chunk->chunk, CA_CHUNK_ID_SIZE);
-        rr->last_chunk_valid = true;
-
-        ms = read_le64(&chunk->header.size) - offsetof(CaProtocolChunk, data);
+        ca_remote_request_answered(rr, (const CaChunkID*) missing->chunk);
 
-        r = ca_chunk_file_save(rr->cache_fd,
-                               NULL,
-                               &rr->last_chunk,
-                               (read_le64(&chunk->flags) & CA_PROTOCOL_CHUNK_COMPRESSED) ? CA_CHUNK_COMPRESSED : CA_CHUNK_UNCOMPRESSED,
-                               CA_CHUNK_AS_IS,
-                               CA_COMPRESSION_DEFAULT,
-                               chunk->data,
-                               ms);
+        r = ca_chunk_file_mark_missing(rr->cache_fd, NULL, NULL, (const CaChunkID*) missing->chunk);
         if (r == -EEXIST)
                 return CA_REMOTE_STEP;
         if (r < 0)
@@ -1316,22 +1959,22 @@ static int ca_remote_process_chunk(CaRemote *rr, const CaProtocolChunk *chunk) {
         return CA_REMOTE_CHUNK;
 }
 
-static int ca_remote_process_missing(CaRemote *rr, const CaProtocolMissing *missing) {
-        int r;
+static int ca_remote_process_bloom(CaRemote *rr, const CaProtocolBloom *bloom, uint64_t msize) {
+        CaBloom *b;
 
         assert(rr);
-        assert(missing);
+        assert(bloom);
 
-        if (rr->cache_fd < 0)
-                return -ENOTTY;
+        if (rr->peer_bloom) /* Only a single filter per connection, please */
+                return -EBADMSG;
 
-        r = ca_chunk_file_mark_missing(rr->cache_fd, NULL, (const CaChunkID*) missing->chunk);
-        if (r == -EEXIST)
-                return CA_REMOTE_STEP;
-        if (r < 0)
-                return r;
+        b = ca_bloom_new_from_data(read_le64(&bloom->n_hash), bloom->data, msize - offsetof(CaProtocolBloom, data));
+        if (!b)
+                return -ENOMEM;
 
-        return CA_REMOTE_CHUNK;
+        rr->peer_bloom = b;
+
+        return CA_REMOTE_STEP;
 }
 
 static int ca_remote_file_install(CaRemoteFile *f) {
@@ -1462,7 +2105,17 @@ static const CaProtocolChunk* validate_chunk(CaRemote *rr, const CaProtocolHeade
 
 
         flags = read_le64(&c->flags);
-        if (flags & ~CA_PROTOCOL_CHUNK_FLAG_MAX)
+        if (flags & CA_PROTOCOL_CHUNK_CRC32C) {
+                /* The CRC bit is only valid if we announced the feature, and permits the CRC itself in the
+                 * upper half of the flags field */
+                if (!ca_remote_crc_negotiated(rr))
+                        return NULL;
+
+                flags &= UINT32_MAX;
+        } else if (flags > UINT32_MAX)
+                return NULL;
+
+        if (flags & ~(uint64_t) CA_PROTOCOL_CHUNK_FLAG_MAX)
                 return NULL;
 
         return c;
@@ -1480,6 +2133,29 @@ static const CaProtocolMissing* validate_missing(CaRemote *rr, const CaProtocolH
         return (const CaProtocolMissing*) h;
 }
 
+static const CaProtocolBloom* validate_bloom(CaRemote *rr, const CaProtocolHeader *h) {
+        const CaProtocolBloom *bloom;
+        uint64_t n_hash;
+
+        assert(rr);
+        assert(h);
+
+        if (read_le64(&h->size) < offsetof(CaProtocolBloom, data) + 1)
+                return NULL;
+        if (read_le64(&h->size) > offsetof(CaProtocolBloom, data) + CA_BLOOM_SIZE_MAX)
+                return NULL;
+        if (read_le64(&h->type) != CA_PROTOCOL_BLOOM)
+                return NULL;
+
+        bloom = (const CaProtocolBloom*) h;
+
+        n_hash = read_le64(&bloom->n_hash);
+        if (n_hash < 1 || n_hash > 64)
+                return NULL;
+
+        return bloom;
+}
+
 static const CaProtocolGoodbye* validate_goodbye(CaRemote *rr, const CaProtocolHeader *h) {
         assert(rr);
         assert(h);
@@ -1688,6 +2364,22 @@ static int ca_remote_process_message(CaRemote *rr) {
                 break;
         }
 
+        case CA_PROTOCOL_BLOOM: {
+                const CaProtocolBloom *bloom;
+
+                if (rr->state != CA_REMOTE_RUNNING)
+                        return -EBADMSG;
+                if ((rr->remote_feature_flags & CA_PROTOCOL_BLOOM_FILTER) == 0)
+                        return -EBADMSG;
+
+                bloom = validate_bloom(rr, h);
+                if (!bloom)
+                        return -EBADMSG;
+
+                step = ca_remote_process_bloom(rr, bloom, size);
+                break;
+        }
+
         case CA_PROTOCOL_GOODBYE: {
                 const CaProtocolGoodbye *goodbye;
 
@@ -1743,7 +2435,18 @@ static int ca_remote_send_hello(CaRemote *rr) {
 
         write_le64(&hello->header.size, sizeof(CaProtocolHello));
         write_le64(&hello->header.type, CA_PROTOCOL_HELLO);
-        write_le64(&hello->feature_flags, rr->local_feature_flags);
+
+        /* The pipelined request window, bloom filter reception, index compression and request priority
+         * lanes are implemented entirely in this engine, hence announce them on behalf of all our
+         * callers. */
+        write_le64(&hello->feature_flags,
+                   rr->local_feature_flags |
+                   CA_PROTOCOL_PIPELINE |
+                   CA_PROTOCOL_BLOOM_FILTER |
+                   CA_PROTOCOL_COMPRESSED_INDEX |
+                   CA_PROTOCOL_PRIORITY_LANES |
+                   CA_PROTOCOL_CRC32C |
+                   ca_protocol_compression_flag(rr->compression_type));
 
         rr->sent_hello = true;
         return CA_REMOTE_STEP;
@@ -1754,7 +2457,8 @@ static int ca_remote_send_file(
                 CaRemoteFile *f,
                 uint64_t file_type,
                 uint64_t eof_type,
-                int request_step) {
+                int request_step,
+                bool compressed) {
 
         ssize_t n;
         void *p;
@@ -1775,6 +2479,51 @@ static int ca_remote_send_file(
         if (f->fd < 0)
                 return request_step; /* request more data from caller */
 
+        if (compressed) {
+                uint8_t buffer[BUFFER_SIZE];
+
+                n = read(f->fd, buffer, BUFFER_SIZE);
+                if (n < 0)
+                        return -errno;
+
+                if (n == 0) {
+                        CaProtocolFileEOF *eof;
+
+                        eof = realloc_buffer_extend(&rr->output_buffer, sizeof(CaProtocolFileEOF));
+                        if (!eof)
+                                return -ENOMEM;
+
+                        write_le64(&eof->header.size, sizeof(CaProtocolFileEOF));
+                        write_le64(&eof->header.type, eof_type);
+
+                        f->complete = true;
+                } else {
+                        CaProtocolFile *idx;
+                        size_t msz;
+
+                        realloc_buffer_empty(&rr->index_xfer_buffer);
+
+                        r = ca_compress(rr->compression_type, buffer, n, &rr->index_xfer_buffer);
+                        if (r < 0)
+                                return r;
+
+                        msz = offsetof(CaProtocolFile, data) + realloc_buffer_size(&rr->index_xfer_buffer);
+
+                        idx = realloc_buffer_extend(&rr->output_buffer, msz);
+                        if (!idx)
+                                return -ENOMEM;
+
+                        write_le64(&idx->header.size, msz);
+                        write_le64(&idx->header.type, file_type);
+
+                        memcpy(idx->data,
+                               realloc_buffer_data(&rr->index_xfer_buffer),
+                               realloc_buffer_size(&rr->index_xfer_buffer));
+                }
+
+                return CA_REMOTE_STEP;
+        }
+
         p = realloc_buffer_extend(&rr->output_buffer, offsetof(CaProtocolFile, data) + BUFFER_SIZE);
         if (!p)
                 return -ENOMEM;
@@ -1824,7 +2573,8 @@ static int ca_remote_send_index(CaRemote *rr) {
                         &rr->index_file,
                         CA_PROTOCOL_INDEX,
                         CA_PROTOCOL_INDEX_EOF,
-                        CA_REMOTE_WRITE_INDEX);
+                        CA_REMOTE_WRITE_INDEX,
+                        ca_remote_index_compressed(rr));
 }
 
 static int ca_remote_send_archive(CaRemote *rr) {
@@ -1839,12 +2589,50 @@ static int ca_remote_send_archive(CaRemote *rr) {
                         &rr->archive_file,
                         CA_PROTOCOL_ARCHIVE,
                         CA_PROTOCOL_ARCHIVE_EOF,
-                        CA_REMOTE_WRITE_ARCHIVE);
+                        CA_REMOTE_WRITE_ARCHIVE,
+                        false);
+}
+
+static int ca_remote_send_bloom(CaRemote *rr) {
+        CaProtocolBloom *bloom;
+        size_t sz;
+
+        assert(rr);
+
+        if (rr->sent_bloom)
+                return CA_REMOTE_POLL;
+        if (!rr->local_bloom)
+                return CA_REMOTE_POLL;
+        if (rr->state != CA_REMOTE_RUNNING)
+                return CA_REMOTE_POLL;
+
+        if ((rr->remote_feature_flags & CA_PROTOCOL_BLOOM_FILTER) == 0) {
+                /* The peer can't make use of it, hence don't bother */
+                rr->local_bloom = ca_bloom_unref(rr->local_bloom);
+                rr->sent_bloom = true;
+                return CA_REMOTE_POLL;
+        }
+
+        sz = ca_bloom_get_size(rr->local_bloom);
+
+        bloom = realloc_buffer_extend(&rr->output_buffer, offsetof(CaProtocolBloom, data) + sz);
+        if (!bloom)
+                return -ENOMEM;
+
+        write_le64(&bloom->header.size, offsetof(CaProtocolBloom, data) + sz);
+        write_le64(&bloom->header.type, CA_PROTOCOL_BLOOM);
+        write_le64(&bloom->n_hash, ca_bloom_get_n_hash(rr->local_bloom));
+        memcpy(bloom->data, ca_bloom_get_data(rr->local_bloom), sz);
+
+        rr->local_bloom = ca_bloom_unref(rr->local_bloom);
+        rr->sent_bloom = true;
+
+        return CA_REMOTE_STEP;
 }
 
 static int ca_remote_send_request(CaRemote *rr) {
         size_t header_offset = (size_t) -1;
-        int only_high_priority = -1, r;
+        int only_priority = -1, r;
 
         assert(rr);
 
@@ -1856,16 +2644,21 @@ static int ca_remote_send_request(CaRemote *rr) {
                 return CA_REMOTE_POLL;
 
         /* Only write out queue when the send queue is short */
-        if (realloc_buffer_size(&rr->output_buffer) > REMOTE_BUFFER_LOW)
+        if (realloc_buffer_size(&rr->output_buffer) > ca_remote_get_output_low_water(rr))
                 return CA_REMOTE_POLL;
 
         for (;;) {
                 CaProtocolRequest *req;
-                bool high_priority;
+                CaRemotePriority priority;
                 CaChunkID id;
                 void *p;
 
-                r = ca_remote_dequeue_request(rr, only_high_priority, &id, &high_priority);
+                /* Respect the adaptive in-flight window: what stays queued now goes out as answers come
+                 * back in */
+                if (rr->n_inflight >= ca_remote_request_window(rr))
+                        break;
+
+                r = ca_remote_dequeue_request(rr, only_priority, &id, &priority);
                 if (r == -ENODATA)
                         break;
                 if (r < 0)
@@ -1882,6 +2675,8 @@ static int ca_remote_send_request(CaRemote *rr) {
 
                         write_le64(&req->header.size, read_le64(&req->header.size) + CA_CHUNK_ID_SIZE);
                 } else {
+                        uint64_t flags;
+
                         header_offset = realloc_buffer_size(&rr->output_buffer);
 
                         /* If we don't have a request frame yet, allocate one with one item. */
@@ -1889,15 +2684,26 @@ static int ca_remote_send_request(CaRemote *rr) {
                         if (!req)
                                 return -ENOMEM;
 
+                        /* Peers that announced the feature get the full lane index; for older peers
+                         * anything above the background lane collapses to the classic high-priority
+                         * bit. */
+                        if (rr->remote_feature_flags != UINT64_MAX &&
+                            (rr->remote_feature_flags & CA_PROTOCOL_PRIORITY_LANES))
+                                flags = (uint64_t) priority;
+                        else
+                                flags = priority > CA_REMOTE_PRIORITY_BACKGROUND ? CA_PROTOCOL_REQUEST_HIGH_PRIORITY : 0;
+
                         write_le64(&req->header.type, CA_PROTOCOL_REQUEST);
                         write_le64(&req->header.size, offsetof(CaProtocolRequest, chunks) + CA_CHUNK_ID_SIZE);
-                        write_le64(&req->flags, high_priority ? CA_PROTOCOL_REQUEST_HIGH_PRIORITY : 0);
+                        write_le64(&req->flags, flags);
 
                         p = req->chunks;
                 }
 
                 memcpy(p, &id, CA_CHUNK_ID_SIZE);
-                only_high_priority = high_priority;
+                only_priority = (int) priority;
+
+                ca_remote_request_sent(rr, &id);
 
                 /* Is the frame already large enough? If so, let's stop it for now */
                 if (read_le64(&req->header.size) >= BUFFER_SIZE)
@@ -1934,6 +2740,10 @@ int ca_remote_step(CaRemote *rr) {
         if (r != CA_REMOTE_POLL)
                 return r;
 
+        r = ca_remote_send_bloom(rr);
+        if (r != CA_REMOTE_POLL)
+                return r;
+
         r = ca_remote_send_request(rr);
         if (r != CA_REMOTE_POLL)
                 return r;
@@ -1955,6 +2765,7 @@ int ca_remote_step(CaRemote *rr) {
 
 int ca_remote_poll(CaRemote *rr, uint64_t timeout_nsec, const sigset_t *ss) {
         struct pollfd pollfd[2];
+        bool throttled = false;
         size_t n = 0;
         int r;
 
@@ -1965,19 +2776,38 @@ int ca_remote_poll(CaRemote *rr, uint64_t timeout_nsec, const sigset_t *ss) {
         if (rr->input_fd < 0 || rr->output_fd < 0)
                 return -EUNATCH;
 
-        if (realloc_buffer_size(&rr->input_buffer) < ca_remote_get_read_size(rr)) {
+        if (realloc_buffer_size(&rr->input_buffer) < ca_remote_get_read_size(rr) &&
+            !ca_remote_input_paused(rr)) {
                 pollfd[n].fd = rr->input_fd;
                 pollfd[n].events = POLLIN;
                 n++;
         }
 
         if (realloc_buffer_size(&rr->output_buffer) > 0) {
-                pollfd[n].fd = rr->output_fd;
-                pollfd[n].events = POLLOUT;
-                n++;
+                uint64_t quota = UINT64_MAX;
+
+                if (rr->rate_limit_bps != UINT64_MAX)
+                        quota = ca_remote_rate_limit_refill(rr);
+
+                if (quota > 0) {
+                        pollfd[n].fd = rr->output_fd;
+                        pollfd[n].events = POLLOUT;
+                        n++;
+                } else {
+                        uint64_t wait;
+
+                        /* We are waiting for tokens, not for the fd: cap the timeout at the point the
+                         * bucket holds enough for the next write, instead of spinning on a writable fd. */
+
+                        throttled = true;
+
+                        wait = ca_remote_rate_limit_wait_nsec(rr);
+                        if (wait < timeout_nsec)
+                                timeout_nsec = wait;
+                }
         }
 
-        if (n == 0)
+        if (n == 0 && !throttled)
                 return 0;
 
         if (timeout_nsec != UINT64_MAX) {
@@ -2017,6 +2847,20 @@ static int ca_remote_validate_chunk(
         if (l > CA_CHUNK_SIZE_LIMIT_MAX)
                 return -EINVAL;
 
+        if (rr->verify != CA_REMOTE_VERIFY_FULL) {
+                /* Relaxed verification policies: with "crc" we skip the digest entirely as long as the
+                 * connection checks frame CRCs, since the wire is then covered and the cache is local. With
+                 * "sampled" only every 16th chunk gets the full digest treatment. Both are only meant for
+                 * authenticated transports where recomputing a full digest per chunk at wire speed is the
+                 * bottleneck. */
+
+                if (rr->verify == CA_REMOTE_VERIFY_CRC && ca_remote_crc_negotiated(rr))
+                        return 0;
+
+                if (rr->verify == CA_REMOTE_VERIFY_SAMPLED && (rr->n_validated++ % 16) != 0)
+                        return 0;
+        }
+
         if (compression == CA_CHUNK_COMPRESSED) {
                 realloc_buffer_empty(&rr->validate_buffer);
 
@@ -2082,7 +2926,7 @@ static int ca_remote_validate_chunk(
 int ca_remote_request(
                 CaRemote *rr,
                 const CaChunkID *chunk_id,
-                bool high_priority,
+                CaRemotePriority priority,
                 CaChunkCompression desired_compression,
                 const void **ret,
                 uint64_t *ret_size,
@@ -2099,6 +2943,8 @@ int ca_remote_request(
                 return -EINVAL;
         if (!ret_size)
                 return -EINVAL;
+        if (priority < 0 || priority >= _CA_REMOTE_PRIORITY_MAX)
+                return -EINVAL;
 
         if (!(rr->local_feature_flags & CA_PROTOCOL_PULL_CHUNKS))
                 return -ENOTTY;
@@ -2109,23 +2955,31 @@ int ca_remote_request(
         if (r < 0)
                 return r;
 
-        realloc_buffer_empty(&rr->chunk_buffer);
+        r = ca_remote_fetch_staged_chunk(rr, chunk_id, desired_compression, &compression);
+        if (r < 0) {
+                realloc_buffer_empty(&rr->chunk_buffer);
+
+                r = ca_chunk_file_load(rr->cache_fd, NULL, NULL, chunk_id, desired_compression, rr->compression_type, &rr->chunk_buffer, &compression);
+                if (r >= 0 && rr->cache_size_max > 0)
+                        /* Refresh the file's timestamp, it's what the LRU eviction orders by */
+                        (void) ca_chunk_file_touch(rr->cache_fd, NULL, NULL, chunk_id);
+                if (r == -ENOENT) {
+                        rr->n_cache_misses++;
+
+                        /* We don't have it right now. Enqueue it */
+                        r = ca_remote_enqueue_request(rr, chunk_id, priority, true);
+                        if (r < 0)
+                                return r;
+                        if (r > 0)
+                                return -EAGAIN; /* Not a failure, but we don't have it right now, but have enqueued it. */
 
-        r = ca_chunk_file_load(rr->cache_fd, NULL, chunk_id, desired_compression, rr->compression_type, &rr->chunk_buffer, &compression);
-        if (r == -ENOENT) {
-                /* We don't have it right now. Enqueue it */
-                r = ca_remote_enqueue_request(rr, chunk_id, high_priority, true);
+                        return -EALREADY; /* Not a failure, but we don't have it right now, but it was already enqueued it. */
+                }
+                if (r == -EADDRNOTAVAIL) /* We really don't have this */
+                        return -ENOENT;
                 if (r < 0)
                         return r;
-                if (r > 0)
-                        return -EAGAIN; /* Not a failure, but we don't have it right now, but have enqueued it. */
-
-                return -EALREADY; /* Not a failure, but we don't have it right now, but it was already enqueued it. */
         }
-        if (r == -EADDRNOTAVAIL) /* We really don't have this */
-                return -ENOENT;
-        if (r < 0)
-                return r;
 
         /* We already have the chunk. Now, validate it before returning it. */
 
@@ -2141,15 +2995,18 @@ int ca_remote_request(
 
         rr->n_requests++;
         rr->n_request_bytes += realloc_buffer_size(&rr->chunk_buffer);
+        rr->n_cache_hits++;
 
         return 1;
 }
 
-int ca_remote_request_async(CaRemote *rr, const CaChunkID *chunk_id, bool high_priority) {
+int ca_remote_request_async(CaRemote *rr, const CaChunkID *chunk_id, CaRemotePriority priority) {
         if (!rr)
                 return -EINVAL;
         if (!chunk_id)
                 return -EINVAL;
+        if (priority < 0 || priority >= _CA_REMOTE_PRIORITY_MAX)
+                return -EINVAL;
 
         if (!(rr->local_feature_flags & CA_PROTOCOL_PULL_CHUNKS) &&
             !(rr->remote_feature_flags & CA_PROTOCOL_PUSH_INDEX_CHUNKS))
@@ -2157,7 +3014,7 @@ int ca_remote_request_async(CaRemote *rr, const CaChunkID *chunk_id, bool high_p
         if (rr->state == CA_REMOTE_EOF)
                 return -EPIPE;
 
-        return ca_remote_enqueue_request(rr, chunk_id, high_priority, true);
+        return ca_remote_enqueue_request(rr, chunk_id, priority, true);
 }
 
 int ca_remote_next_request(CaRemote *rr, CaChunkID *ret) {
@@ -2190,7 +3047,7 @@ int ca_remote_can_put_chunk(CaRemote *rr) {
 
         if (rr->state != CA_REMOTE_RUNNING)
                 return 0; /* can't take your data right now. */
-        if (realloc_buffer_size(&rr->output_buffer) > REMOTE_BUFFER_LOW)
+        if (realloc_buffer_size(&rr->output_buffer) > ca_remote_get_output_low_water(rr))
                 return 0; /* won't take your data right now, already got enough in my queue */
 
         return 1;
@@ -2204,7 +3061,7 @@ int ca_remote_put_chunk(
                 uint64_t size) {
 
         CaProtocolChunk *chunk;
-        uint64_t msz;
+        uint64_t msz, flags;
         int r;
 
         if (!rr)
@@ -2242,7 +3099,12 @@ int ca_remote_put_chunk(
 
         write_le64(&chunk->header.type, CA_PROTOCOL_CHUNK);
         write_le64(&chunk->header.size, msz);
-        write_le64(&chunk->flags, compression == CA_CHUNK_COMPRESSED ? CA_PROTOCOL_CHUNK_COMPRESSED : 0);
+
+        flags = compression == CA_CHUNK_COMPRESSED ? CA_PROTOCOL_CHUNK_COMPRESSED : 0;
+        if (ca_remote_crc_negotiated(rr))
+                flags |= CA_PROTOCOL_CHUNK_CRC32C | ((uint64_t) ca_crc32c(0, data, size) << 32);
+
+        write_le64(&chunk->flags, flags);
 
         memcpy(chunk->chunk, chunk_id, CA_CHUNK_ID_SIZE);
         memcpy(chunk->data, data, size);
@@ -2281,6 +3143,37 @@ int ca_remote_put_missing(CaRemote *rr, const CaChunkID *chunk_id) {
         return 0;
 }
 
+int ca_remote_set_bloom(CaRemote *rr, CaBloom *bloom) {
+        if (!rr)
+                return -EINVAL;
+        if (!bloom)
+                return -EINVAL;
+
+        if (rr->local_bloom || rr->sent_bloom)
+                return -EBUSY;
+
+        /* Takes ownership of the filter. It is sent (and freed) as soon as the HELLO exchange completed,
+         * provided the peer announced CA_PROTOCOL_BLOOM_FILTER. */
+        rr->local_bloom = bloom;
+
+        return 0;
+}
+
+int ca_remote_test_bloom(CaRemote *rr, const CaChunkID *chunk_id) {
+        if (!rr)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+
+        /* Returns > 0 if the peer may have the chunk, 0 if it definitely doesn't have it, and -ENODATA if
+         * the peer didn't send us a filter (yet). */
+
+        if (!rr->peer_bloom)
+                return -ENODATA;
+
+        return ca_bloom_may_have(rr->peer_bloom, chunk_id);
+}
+
 static int ca_remote_file_can_put(CaRemote *rr, CaRemoteFile *f) {
         assert(rr);
         assert(f);
@@ -2357,6 +3250,19 @@ int ca_remote_put_index(CaRemote *rr, const void *data, size_t size) {
         if (r == 0)
                 return -EAGAIN;
 
+        if (ca_remote_index_compressed(rr)) {
+                /* Compress each frame individually, so that the peer can process them as they arrive */
+                realloc_buffer_empty(&rr->index_xfer_buffer);
+
+                r = ca_compress(rr->compression_type, data, size, &rr->index_xfer_buffer);
+                if (r < 0)
+                        return r;
+
+                return ca_remote_file_put(rr, &rr->index_file, CA_PROTOCOL_INDEX,
+                                          realloc_buffer_data(&rr->index_xfer_buffer),
+                                          realloc_buffer_size(&rr->index_xfer_buffer));
+        }
+
         return ca_remote_file_put(rr, &rr->index_file, CA_PROTOCOL_INDEX, data, size);
 }
 
@@ -2571,6 +3477,8 @@ int ca_remote_abort(CaRemote *rr, int error, const char *message) {
 }
 
 int ca_remote_has_pending_requests(CaRemote *rr) {
+        CaRemotePriority p;
+
         if (!rr)
                 return -EINVAL;
 
@@ -2579,9 +3487,9 @@ int ca_remote_has_pending_requests(CaRemote *rr) {
                 return 0;
 
         /* Does this have locally queued requests? */
-        if ((rr->queue_start_high < rr->queue_end_high) ||
-            (rr->queue_start_low < rr->queue_end_low))
-                return 1;
+        for (p = 0; p < _CA_REMOTE_PRIORITY_MAX; p++)
+                if (rr->queue_start[p] < rr->queue_end[p])
+                        return 1;
 
         return 0;
 }
@@ -2614,11 +3522,14 @@ int ca_remote_next_chunk(
         if (ret_data) {
                 CaChunkCompression compression;
 
-                realloc_buffer_empty(&rr->chunk_buffer);
+                r = ca_remote_fetch_staged_chunk(rr, &rr->last_chunk, desired_compression, &compression);
+                if (r < 0) {
+                        realloc_buffer_empty(&rr->chunk_buffer);
 
-                r = ca_chunk_file_load(rr->cache_fd, NULL, &rr->last_chunk, desired_compression, rr->compression_type, &rr->chunk_buffer, &compression);
-                if (r < 0)
-                        return r;
+                        r = ca_chunk_file_load(rr->cache_fd, NULL, NULL, &rr->last_chunk, desired_compression, rr->compression_type, &rr->chunk_buffer, &compression);
+                        if (r < 0)
+                                return r;
+                }
 
                 r = ca_remote_validate_chunk(rr, &rr->last_chunk, compression, realloc_buffer_data(&rr->chunk_buffer), realloc_buffer_size(&rr->chunk_buffer));
                 if (r < 0)
@@ -2719,6 +3630,11 @@ int ca_remote_forget_chunk(CaRemote *rr, const CaChunkID *id) {
         if (!ca_chunk_id_format(id, ids))
                 return -EINVAL;
 
+        if (rr->staged_chunk_valid && ca_chunk_id_equal(&rr->staged_chunk, id)) {
+                rr->staged_chunk_valid = false;
+                realloc_buffer_empty(&rr->staged_chunk_buffer);
+        }
+
         f = strjoina("chunks/", ids);
         r = readlinkat_malloc(rr->cache_fd, f, &qpos);
         if (r < 0 && r != -ENOENT)
@@ -2727,14 +3643,9 @@ int ca_remote_forget_chunk(CaRemote *rr, const CaChunkID *id) {
         if (r >= 0) {
                 const char *p;
 
-                p = startswith(qpos, "low-priority/");
-                if (!p) {
-                        p = startswith(qpos, "high-priority/");
-                        if (!p) {
-                                r = -EBADMSG;
-                                goto finish;
-                        }
-                }
+                r = ca_remote_queue_name_parse(qpos, &p);
+                if (r < 0)
+                        goto finish;
 
                 r = safe_atou64(p, NULL);
                 if (r < 0)
@@ -2750,7 +3661,7 @@ int ca_remote_forget_chunk(CaRemote *rr, const CaChunkID *id) {
                 }
         }
 
-        r = ca_chunk_file_remove(rr->cache_fd, NULL, id);
+        r = ca_chunk_file_remove(rr->cache_fd, NULL, NULL, id);
         if (r < 0 && r != -ENOENT)
                 goto finish;
 
@@ -2761,6 +3672,44 @@ finish:
         return r;
 }
 
+int ca_remote_set_verify(CaRemote *rr, CaRemoteVerify v) {
+        if (!rr)
+                return -EINVAL;
+        if (v < 0 || v >= _CA_REMOTE_VERIFY_MAX)
+                return -EINVAL;
+
+        rr->verify = v;
+        return 0;
+}
+
+static const char* const ca_remote_verify_table[_CA_REMOTE_VERIFY_MAX] = {
+        [CA_REMOTE_VERIFY_FULL] = "full",
+        [CA_REMOTE_VERIFY_SAMPLED] = "sampled",
+        [CA_REMOTE_VERIFY_CRC] = "crc",
+};
+
+const char *ca_remote_verify_to_string(CaRemoteVerify v) {
+        if (v < 0)
+                return NULL;
+        if (v >= _CA_REMOTE_VERIFY_MAX)
+                return NULL;
+
+        return ca_remote_verify_table[v];
+}
+
+CaRemoteVerify ca_remote_verify_from_string(const char *s) {
+        CaRemoteVerify i;
+
+        if (isempty(s))
+                return _CA_REMOTE_VERIFY_INVALID;
+
+        for (i = 0; i < _CA_REMOTE_VERIFY_MAX; i++)
+                if (streq(ca_remote_verify_table[i], s))
+                        return i;
+
+        return _CA_REMOTE_VERIFY_INVALID;
+}
+
 int ca_remote_set_digest_type(CaRemote *rr, CaDigestType type) {
         int r;
 
@@ -2814,6 +3763,76 @@ int ca_remote_get_request_bytes(CaRemote *rr, uint64_t *ret) {
         return 0;
 }
 
+int ca_remote_get_cache_hits(CaRemote *rr, uint64_t *ret) {
+        if (!rr)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        *ret = rr->n_cache_hits;
+        return 0;
+}
+
+int ca_remote_get_cache_misses(CaRemote *rr, uint64_t *ret) {
+        if (!rr)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        *ret = rr->n_cache_misses;
+        return 0;
+}
+
+int ca_remote_get_wire_bytes_read(CaRemote *rr, uint64_t *ret) {
+        if (!rr)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        *ret = rr->n_wire_bytes_read;
+        return 0;
+}
+
+int ca_remote_get_wire_bytes_written(CaRemote *rr, uint64_t *ret) {
+        if (!rr)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        *ret = rr->n_wire_bytes_written;
+        return 0;
+}
+
+int ca_remote_get_achieved_rate_bps(CaRemote *rr, uint64_t *ret_read_bps, uint64_t *ret_write_bps) {
+        uint64_t elapsed;
+
+        if (!rr)
+                return -EINVAL;
+        if (!ret_read_bps && !ret_write_bps)
+                return -EINVAL;
+
+        /* Returns the rate actually achieved since the first wire byte moved, so that the effect of the
+         * shaper (or its absence) can be observed. */
+
+        if (rr->io_start_nsec == 0)
+                return -ENODATA;
+
+        elapsed = now(CLOCK_MONOTONIC) - rr->io_start_nsec;
+        if (elapsed == 0)
+                elapsed = 1;
+
+        if (ret_read_bps)
+                *ret_read_bps = rr->n_wire_bytes_read < UINT64_MAX / NSEC_PER_SEC ?
+                        rr->n_wire_bytes_read * NSEC_PER_SEC / elapsed :
+                        rr->n_wire_bytes_read / MAX(elapsed / NSEC_PER_SEC, UINT64_C(1));
+        if (ret_write_bps)
+                *ret_write_bps = rr->n_wire_bytes_written < UINT64_MAX / NSEC_PER_SEC ?
+                        rr->n_wire_bytes_written * NSEC_PER_SEC / elapsed :
+                        rr->n_wire_bytes_written / MAX(elapsed / NSEC_PER_SEC, UINT64_C(1));
+
+        return 0;
+}
+
 int ca_remote_set_compression_type(CaRemote *rr, CaCompressionType ct) {
         if (!rr)
                 return -EINVAL;
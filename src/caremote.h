@@ -5,11 +5,34 @@
 #include <signal.h>
 #include <stdbool.h>
 
+#include "cabloom.h"
 #include "cachunk.h"
 #include "cachunkid.h"
 
 typedef struct CaRemote CaRemote;
 
+/* Request scheduling lanes, ordered by urgency. Requests in a higher lane are dispatched — and, on peers
+ * that understand CA_PROTOCOL_PRIORITY_LANES, served — before anything in the lanes below, so that e.g. a
+ * blocking FUSE page read overtakes background readahead instead of queueing behind it. */
+typedef enum CaRemotePriority {
+        CA_REMOTE_PRIORITY_BACKGROUND = 0, /* bulk prefetch, nobody is waiting for this yet */
+        CA_REMOTE_PRIORITY_HIGH = 1,       /* ahead of the bulk queue, but nobody is stalled on it */
+        CA_REMOTE_PRIORITY_INTERACTIVE = 2,/* a consumer is blocking on this chunk right now */
+        _CA_REMOTE_PRIORITY_MAX,
+} CaRemotePriority;
+
+/* How thoroughly to verify the payload of received chunks. The CRC32C covers the wire (it is checked the
+ * moment a frame is parsed, where negotiated); this policy controls the full chunk digest computed at
+ * consumption time, which also guards the local frame cache. Anything but "full" trades end-to-end
+ * integrity checking for CPU — only appropriate on authenticated transports. */
+typedef enum CaRemoteVerify {
+        CA_REMOTE_VERIFY_FULL = 0,  /* digest every chunk (default) */
+        CA_REMOTE_VERIFY_SAMPLED,   /* digest every 16th chunk only */
+        CA_REMOTE_VERIFY_CRC,       /* rely on the frame CRC32C where negotiated, digest otherwise */
+        _CA_REMOTE_VERIFY_MAX,
+        _CA_REMOTE_VERIFY_INVALID = -1,
+} CaRemoteVerify;
+
 enum {
         CA_REMOTE_POLL,             /* Nothing to do, sleep with ca_remote_poll() please! */
         CA_REMOTE_FINISHED,         /* Done! */
@@ -36,7 +59,13 @@ int ca_remote_get_remote_feature_flags(CaRemote *rr, uint64_t* flags);
 int ca_remote_set_digest_type(CaRemote *rr, CaDigestType type);
 int ca_remote_get_digest_type(CaRemote *rr, CaDigestType *ret);
 
+int ca_remote_set_verify(CaRemote *rr, CaRemoteVerify v);
+
+const char *ca_remote_verify_to_string(CaRemoteVerify v);
+CaRemoteVerify ca_remote_verify_from_string(const char *s);
+
 int ca_remote_set_rate_limit_bps(CaRemote *rr, uint64_t rate_limit_bps);
+int ca_remote_set_rate_limit_burst(CaRemote *rr, uint64_t burst_bytes); /* token bucket capacity, 0 → default */
 
 int ca_remote_set_io_fds(CaRemote *rr, int input_fd, int output_fd);
 int ca_remote_get_io_fds(CaRemote *rr, int *ret_input_fd, int *ret_output_fd);
@@ -50,6 +79,7 @@ int ca_remote_add_store_url(CaRemote *rr, const char *url);
 
 int ca_remote_set_cache_path(CaRemote *rr, const char *path);
 int ca_remote_set_cache_fd(CaRemote *rr, int fd);
+int ca_remote_set_cache_size_max(CaRemote *rr, uint64_t max_size); /* 0 for unbounded */
 
 int ca_remote_set_index_path(CaRemote *rr, const char *path);
 int ca_remote_set_index_fd(CaRemote *rr, int fd);
@@ -62,8 +92,8 @@ int ca_remote_step(CaRemote *rr);
 int ca_remote_poll(CaRemote *rr, uint64_t timeout_nsec, const sigset_t *ss);
 
 /* When we are in "pull" mode, interfaces for retrieving chunks, or enqueing requests for them */
-int ca_remote_request(CaRemote *rr, const CaChunkID *chunk_id, bool priority, CaChunkCompression desired_compression, const void **ret, uint64_t *ret_size, CaChunkCompression *ret_effective_compression);
-int ca_remote_request_async(CaRemote *rr, const CaChunkID *chunk_id, bool priority);
+int ca_remote_request(CaRemote *rr, const CaChunkID *chunk_id, CaRemotePriority priority, CaChunkCompression desired_compression, const void **ret, uint64_t *ret_size, CaChunkCompression *ret_effective_compression);
+int ca_remote_request_async(CaRemote *rr, const CaChunkID *chunk_id, CaRemotePriority priority);
 int ca_remote_next_chunk(CaRemote *rr, CaChunkCompression desired_compression, CaChunkID *ret_id, const void **ret_data, size_t *ret_size, CaChunkCompression *ret_compression);
 
 /* When we are in "push" mode, interfaces for processing requests and pushing chunks */
@@ -72,6 +102,11 @@ int ca_remote_can_put_chunk(CaRemote *rr);
 int ca_remote_put_chunk(CaRemote *rr, const CaChunkID *chunk_id, CaChunkCompression compression, const void *data, uint64_t size);
 int ca_remote_put_missing(CaRemote *rr, const CaChunkID *chunk_id);
 
+/* push mode: hand over a bloom filter of our stores' chunk IDs, to be sent once the handshake completed.
+ * pull mode: test a chunk ID against the filter the peer sent us, if any */
+int ca_remote_set_bloom(CaRemote *rr, CaBloom *bloom);
+int ca_remote_test_bloom(CaRemote *rr, const CaChunkID *chunk_id);
+
 /* pull mode: Read index data */
 int ca_remote_read_index(CaRemote *rr, const void **ret, size_t *ret_size);
 
@@ -100,6 +135,13 @@ int ca_remote_forget_chunk(CaRemote *rr, const CaChunkID *id);
 
 int ca_remote_get_requests(CaRemote *rr, uint64_t *ret);
 int ca_remote_get_request_bytes(CaRemote *rr, uint64_t *ret);
+int ca_remote_get_cache_hits(CaRemote *rr, uint64_t *ret);
+int ca_remote_get_cache_misses(CaRemote *rr, uint64_t *ret);
+int ca_remote_get_wire_bytes_read(CaRemote *rr, uint64_t *ret);
+int ca_remote_get_wire_bytes_written(CaRemote *rr, uint64_t *ret);
+int ca_remote_get_achieved_rate_bps(CaRemote *rr, uint64_t *ret_read_bps, uint64_t *ret_write_bps);
+
+int ca_remote_no_transcode(CaRemote *rr); /* > 0 if both sides use the same compression algorithm, i.e. chunks can travel as stored */
 
 int ca_remote_set_compression_type(CaRemote *rr, CaCompressionType ct);
 
@@ -1,5 +1,6 @@
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "cachunk.h"
 #include "cachunker.h"
@@ -22,6 +23,17 @@
 /* #undef EUNATCH */
 /* #define EUNATCH __LINE__ */
 
+/* A chunk whose digest (and hence cache entry) is computed by one of the worker threads. The target
+ * location string is prepared by the scanning thread, only the hashing and the symlink creation are
+ * offloaded. */
+typedef struct CaSeedChunkJob CaSeedChunkJob;
+struct CaSeedChunkJob {
+        CaSeedChunkJob *next;
+        char *target; /* the location string the cache symlink shall point to */
+        size_t size;
+        uint8_t data[];
+};
+
 struct CaSeed {
         CaEncoder *encoder;
         int base_fd;
@@ -35,8 +47,10 @@ struct CaSeed {
         bool remove_cache:1;
         bool cache_hardlink:1;
         bool cache_chunks:1;
+        bool checked_manifest:1;
 
         ReallocBuffer buffer;
+        ReallocBuffer manifest;
         CaLocation *buffer_location;
 
         CaFileRoot *root;
@@ -45,6 +59,21 @@ struct CaSeed {
 
         uint64_t n_requests;
         uint64_t n_request_bytes;
+        uint64_t n_misses;
+
+        /* Iteration state of ca_seed_enumerate_cached_chunks() */
+        DIR *enumerate_dir, *enumerate_subdir;
+
+        size_t n_threads;
+        pthread_t *workers;
+        size_t n_workers;
+        bool workers_exit;
+        int worker_error;
+        pthread_mutex_t job_mutex;
+        pthread_cond_t job_submitted_cond;
+        pthread_cond_t job_finished_cond;
+        CaSeedChunkJob *job_queue, *job_queue_tail;
+        size_t n_jobs;
 };
 
 CaSeed *ca_seed_new(void) {
@@ -63,9 +92,218 @@ CaSeed *ca_seed_new(void) {
 
         assert_se(ca_feature_flags_normalize(CA_FORMAT_DEFAULT, &s->feature_flags) >= 0);
 
+        s->job_mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+        s->job_submitted_cond = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+        s->job_finished_cond = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+
         return s;
 }
 
+static void *ca_seed_worker_thread(void *arg) {
+        CaDigest *digest = NULL;
+        CaSeed *s = arg;
+        int r;
+
+        for (;;) {
+                CaSeedChunkJob *j;
+
+                assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
+
+                while (!s->job_queue && !s->workers_exit)
+                        assert_se(pthread_cond_wait(&s->job_submitted_cond, &s->job_mutex) == 0);
+
+                if (!s->job_queue) {
+                        assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
+                        break;
+                }
+
+                j = s->job_queue;
+                s->job_queue = j->next;
+                if (!s->job_queue)
+                        s->job_queue_tail = NULL;
+
+                assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
+
+                if (digest)
+                        r = 0;
+                else
+                        r = ca_digest_new(ca_feature_flags_to_digest_type(s->feature_flags), &digest);
+
+                if (r >= 0) {
+                        char ids[CA_CHUNK_ID_FORMAT_MAX];
+                        CaChunkID id;
+
+                        r = ca_chunk_id_make(digest, j->data, j->size, &id);
+                        if (r >= 0) {
+
+                                if (ca_chunk_id_format(&id, ids)) {
+                                        const char *four, *combined;
+
+                                        four = strndupa(ids, 4);
+                                        combined = strjoina(four, "/", ids);
+
+                                        (void) mkdirat(s->cache_fd, four, 0777);
+
+                                        if (symlinkat(j->target, s->cache_fd, combined) < 0 && errno != EEXIST)
+                                                r = -errno;
+                                } else
+                                        r = -EINVAL;
+                        }
+                }
+
+                free(j->target);
+                free(j);
+
+                assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
+
+                if (r < 0 && s->worker_error == 0)
+                        s->worker_error = r;
+
+                assert(s->n_jobs > 0);
+                s->n_jobs--;
+
+                assert_se(pthread_cond_broadcast(&s->job_finished_cond) == 0);
+                assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
+        }
+
+        ca_digest_free(digest);
+        return NULL;
+}
+
+static int ca_seed_start_workers(CaSeed *s) {
+        size_t n;
+        int r;
+
+        assert(s);
+
+        if (s->n_workers > 0)
+                return 0;
+
+        n = s->n_threads;
+        if (n == 0) {
+                long v;
+
+                v = sysconf(_SC_NPROCESSORS_ONLN);
+                n = v <= 0 ? 1 : (size_t) v;
+        }
+
+        if (n <= 1) /* No point in a pool for a single thread, hash in-line then */
+                return 0;
+
+        s->workers = new0(pthread_t, n);
+        if (!s->workers)
+                return -ENOMEM;
+
+        s->workers_exit = false;
+        s->worker_error = 0;
+
+        r = 0;
+        for (s->n_workers = 0; s->n_workers < n; s->n_workers++) {
+                r = pthread_create(s->workers + s->n_workers, NULL, ca_seed_worker_thread, s);
+                if (r != 0)
+                        break;
+        }
+
+        if (s->n_workers == 0) {
+                s->workers = mfree(s->workers);
+                return -r;
+        }
+
+        return 1;
+}
+
+static void ca_seed_stop_workers(CaSeed *s) {
+        size_t i;
+
+        assert(s);
+
+        if (s->n_workers == 0)
+                return;
+
+        assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
+        s->workers_exit = true;
+        assert_se(pthread_cond_broadcast(&s->job_submitted_cond) == 0);
+        assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
+
+        /* The workers drain the queue before exiting */
+        for (i = 0; i < s->n_workers; i++)
+                assert_se(pthread_join(s->workers[i], NULL) == 0);
+
+        s->workers = mfree(s->workers);
+        s->n_workers = 0;
+        s->workers_exit = false;
+}
+
+static int ca_seed_submit_chunk_job(CaSeed *s, const char *target, const void *data, size_t l) {
+        CaSeedChunkJob *j;
+        int r;
+
+        assert(s);
+        assert(target);
+        assert(data);
+        assert(l > 0);
+        assert(s->n_workers > 0);
+
+        j = malloc(offsetof(CaSeedChunkJob, data) + l);
+        if (!j)
+                return -ENOMEM;
+
+        j->next = NULL;
+        j->size = l;
+        memcpy(j->data, data, l);
+
+        j->target = strdup(target);
+        if (!j->target) {
+                free(j);
+                return -ENOMEM;
+        }
+
+        assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
+
+        /* Keep the queue bounded, scanning produces chunks faster than they can be hashed */
+        while (s->n_jobs >= s->n_workers * 4 && s->worker_error == 0)
+                assert_se(pthread_cond_wait(&s->job_finished_cond, &s->job_mutex) == 0);
+
+        r = s->worker_error;
+        if (r < 0) {
+                assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
+                free(j->target);
+                free(j);
+                return r;
+        }
+
+        if (s->job_queue_tail)
+                s->job_queue_tail->next = j;
+        else
+                s->job_queue = j;
+        s->job_queue_tail = j;
+        s->n_jobs++;
+
+        assert_se(pthread_cond_signal(&s->job_submitted_cond) == 0);
+        assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
+
+        return 0;
+}
+
+static int ca_seed_drain_chunk_jobs(CaSeed *s) {
+        int r;
+
+        assert(s);
+
+        if (s->n_workers == 0)
+                return 0;
+
+        assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
+
+        while (s->n_jobs > 0)
+                assert_se(pthread_cond_wait(&s->job_finished_cond, &s->job_mutex) == 0);
+
+        r = s->worker_error;
+        assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
+
+        return r;
+}
+
 static void ca_seed_remove_and_close_cache(CaSeed *s) {
         assert(s);
 
@@ -86,6 +324,8 @@ CaSeed *ca_seed_unref(CaSeed *s) {
         if (!s)
                 return NULL;
 
+        ca_seed_stop_workers(s);
+
         ca_file_root_invalidate(s->root);
 
         ca_seed_remove_and_close_cache(s);
@@ -99,8 +339,14 @@ CaSeed *ca_seed_unref(CaSeed *s) {
         ca_digest_free(s->chunk_digest);
 
         realloc_buffer_free(&s->buffer);
+        realloc_buffer_free(&s->manifest);
         ca_location_unref(s->buffer_location);
 
+        if (s->enumerate_dir)
+                closedir(s->enumerate_dir);
+        if (s->enumerate_subdir)
+                closedir(s->enumerate_subdir);
+
         ca_file_root_unref(s->root);
 
         return mfree(s);
@@ -259,6 +505,9 @@ static int ca_seed_write_cache_entry(CaSeed *s, CaLocation *location, const void
         if (!t)
                 return -ENOMEM;
 
+        if (s->n_workers > 0) /* Let one of the worker threads hash this chunk and create the entry */
+                return ca_seed_submit_chunk_job(s, t, data, l);
+
         r = ca_seed_make_chunk_id(s, data, l, &id);
         if (r < 0)
                 return r;
@@ -428,6 +677,180 @@ finish:
         return r;
 }
 
+#define CA_SEED_MANIFEST_NAME "manifest"
+#define CA_SEED_MANIFEST_TEMPORARY_NAME ".manifest.tmp"
+
+static int ca_seed_manifest_record(CaSeed *s) {
+        char *path = NULL, *line = NULL;
+        struct stat st;
+        mode_t mode;
+        int base_fd, r;
+
+        assert(s);
+
+        /* Records the identity of the regular file the encoder just finished in the in-memory manifest, so
+         * that a later run can tell whether the cache symlink farm is still current without re-reading any
+         * file contents. For throw-away caches this would be wasted work, hence skip it there. */
+
+        if (s->remove_cache)
+                return 0;
+        if (!s->encoder)
+                return -EUNATCH;
+
+        r = ca_encoder_current_mode(s->encoder, &mode);
+        if (r < 0)
+                return r;
+        if (!S_ISREG(mode))
+                return 0;
+
+        base_fd = ca_encoder_get_base_fd(s->encoder);
+        if (base_fd < 0)
+                return base_fd;
+
+        r = ca_encoder_current_path(s->encoder, &path);
+        if (r < 0)
+                return r;
+
+        if (fstatat(base_fd, path, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        if (asprintf(&line, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %s\n",
+                     (uint64_t) st.st_dev,
+                     (uint64_t) st.st_ino,
+                     timespec_to_nsec(st.st_mtim),
+                     (uint64_t) st.st_size,
+                     path) < 0) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        if (!realloc_buffer_append(&s->manifest, line, strlen(line))) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        r = 0;
+
+finish:
+        free(path);
+        free(line);
+        return r;
+}
+
+static int ca_seed_write_manifest(CaSeed *s) {
+        int fd, r;
+
+        assert(s);
+
+        if (s->remove_cache)
+                return 0;
+        if (realloc_buffer_size(&s->manifest) == 0)
+                return 0;
+
+        fd = openat(s->cache_fd, CA_SEED_MANIFEST_TEMPORARY_NAME, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW, 0666);
+        if (fd < 0)
+                return -errno;
+
+        r = loop_write(fd, realloc_buffer_data(&s->manifest), realloc_buffer_size(&s->manifest));
+        safe_close(fd);
+        if (r < 0) {
+                (void) unlinkat(s->cache_fd, CA_SEED_MANIFEST_TEMPORARY_NAME, 0);
+                return r;
+        }
+
+        if (renameat(s->cache_fd, CA_SEED_MANIFEST_TEMPORARY_NAME, s->cache_fd, CA_SEED_MANIFEST_NAME) < 0) {
+                r = -errno;
+                (void) unlinkat(s->cache_fd, CA_SEED_MANIFEST_TEMPORARY_NAME, 0);
+                return r;
+        }
+
+        realloc_buffer_empty(&s->manifest);
+        return 0;
+}
+
+static int ca_seed_verify_manifest(CaSeed *s) {
+        size_t line_allocated = 0;
+        char *line = NULL;
+        int base_fd, r;
+        FILE *f;
+        int fd;
+
+        assert(s);
+        assert(s->encoder);
+
+        /* Returns > 0 if a manifest from a previous run exists and every file it lists is unmodified, in
+         * which case the cache symlink farm can be reused as-is and the seed doesn't need to be read
+         * again. Returns 0 if there is no manifest or anything changed. Note that chunks in the seed
+         * archive stream may span file boundaries, hence the cache is only ever reused wholesale. Reusing
+         * it is safe in any case, as ca_seed_get() verifies each chunk digest against the actual file
+         * contents and returns -ESTALE on mismatch. */
+
+        if (s->remove_cache)
+                return 0;
+
+        base_fd = ca_encoder_get_base_fd(s->encoder);
+        if (base_fd < 0)
+                return base_fd;
+
+        fd = openat(s->cache_fd, CA_SEED_MANIFEST_NAME, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
+        if (fd < 0)
+                return errno == ENOENT ? 0 : -errno;
+
+        f = fdopen(fd, "re");
+        if (!f) {
+                safe_close(fd);
+                return -errno;
+        }
+
+        for (;;) {
+                uint64_t dev, ino, mtime, size;
+                struct stat st;
+                ssize_t k;
+                int n = 0;
+
+                errno = 0;
+                k = getline(&line, &line_allocated, f);
+                if (k < 0) {
+                        if (errno == 0) { /* EOF? Then everything checked out */
+                                r = 1;
+                                goto finish;
+                        }
+
+                        r = -errno;
+                        goto finish;
+                }
+
+                truncate_nl(line);
+
+                if (sscanf(line, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %n", &dev, &ino, &mtime, &size, &n) != 4 ||
+                    n <= 0 || isempty(line + n)) {
+                        r = 0; /* Manifest corrupted? Then just rebuild the cache */
+                        goto finish;
+                }
+
+                if (fstatat(base_fd, line + n, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                        r = 0;
+                        goto finish;
+                }
+
+                if (!S_ISREG(st.st_mode) ||
+                    (uint64_t) st.st_dev != dev ||
+                    (uint64_t) st.st_ino != ino ||
+                    timespec_to_nsec(st.st_mtim) != mtime ||
+                    (uint64_t) st.st_size != size) {
+                        r = 0;
+                        goto finish;
+                }
+        }
+
+finish:
+        free(line);
+        fclose(f);
+        return r;
+}
+
 int ca_seed_step(CaSeed *s) {
         int r;
 
@@ -446,6 +869,25 @@ int ca_seed_step(CaSeed *s) {
         if (r < 0)
                 return r;
 
+        if (!s->checked_manifest) {
+                s->checked_manifest = true;
+
+                r = ca_seed_verify_manifest(s);
+                if (r < 0)
+                        return r;
+                if (r > 0) {
+                        /* Nothing in the seed changed since the cache was built, reuse it as-is */
+                        s->ready = true;
+                        return CA_SEED_READY;
+                }
+        }
+
+        if (s->cache_chunks) {
+                r = ca_seed_start_workers(s);
+                if (r < 0)
+                        return r;
+        }
+
         for (;;) {
                 int step;
 
@@ -461,6 +903,16 @@ int ca_seed_step(CaSeed *s) {
                         if (r < 0)
                                 return r;
 
+                        r = ca_seed_drain_chunk_jobs(s);
+                        if (r < 0)
+                                return r;
+
+                        ca_seed_stop_workers(s);
+
+                        r = ca_seed_write_manifest(s);
+                        if (r < 0)
+                                return r;
+
                         s->ready = true;
                         return CA_SEED_READY;
 
@@ -477,6 +929,10 @@ int ca_seed_step(CaSeed *s) {
                                 r = ca_seed_cache_hardlink(s);
                                 if (r < 0)
                                         return r;
+
+                                r = ca_seed_manifest_record(s);
+                                if (r < 0)
+                                        return r;
                         }
 
                         return step == CA_ENCODER_NEXT_FILE ? CA_SEED_NEXT_FILE :
@@ -523,8 +979,11 @@ int ca_seed_get(CaSeed *s,
         combined = strjoina(four, "/", id);
 
         r = readlinkat_malloc(s->cache_fd, combined, &target);
-        if (r < 0)
+        if (r < 0) {
+                if (r == -ENOENT)
+                        s->n_misses++;
                 return r;
+        }
 
         /* fprintf(stderr, "GOT %s → %s\n", combined, target); */
 
@@ -623,6 +1082,7 @@ int ca_seed_get(CaSeed *s,
                                         /* fprintf(stderr, "SEED CHUNK CORRUPTED (%" PRIu64 "):\n", size); */
                                         /* hexdump(stderr, p, MIN(1024U, size)); */
 
+                                        s->n_misses++;
                                         r = -ESTALE;
                                         goto finish;
                                 }
@@ -696,7 +1156,7 @@ int ca_seed_get_hardlink_target(
         char v[CA_CHUNK_ID_FORMAT_MAX];
         const char *four, *combined;
         CaLocation *l = NULL;
-        char *target;
+        char *target, *p;
         int r;
 
         if (!s)
@@ -732,9 +1192,13 @@ int ca_seed_get_hardlink_target(
                 goto finish;
         }
 
-        *ret = l->path;
-        l->path = NULL;
+        p = strdup(l->path);
+        if (!p) {
+                r = -ENOMEM;
+                goto finish;
+        }
 
+        *ret = p;
         r = 0;
 
 finish:
@@ -767,10 +1231,29 @@ int ca_seed_current_mode(CaSeed *seed, mode_t *ret) {
 }
 
 int ca_seed_set_feature_flags(CaSeed *s, uint64_t flags) {
+        int r;
+
         if (!s)
                 return -EINVAL;
 
-        return ca_feature_flags_normalize(flags, &s->feature_flags);
+        r = ca_feature_flags_normalize(flags, &s->feature_flags);
+        if (r < 0)
+                return r;
+
+        /* The seed needs to cut chunks with the same algorithm the index was made with, otherwise nothing
+         * will ever line up. */
+        return ca_chunker_set_algorithm(&s->chunker,
+                                        (s->feature_flags & CA_FORMAT_FASTCDC_CHUNKER) ? CA_CHUNKER_FASTCDC : CA_CHUNKER_BUZHASH);
+}
+
+int ca_seed_set_threads(CaSeed *s, size_t n_threads) {
+        if (!s)
+                return -EINVAL;
+        if (s->n_workers > 0)
+                return -EBUSY;
+
+        s->n_threads = n_threads;
+        return 0;
 }
 
 int ca_seed_set_chunk_size_min(CaSeed *s, size_t cmin) {
@@ -895,3 +1378,87 @@ int ca_seed_get_request_bytes(CaSeed *s, uint64_t *ret) {
         *ret = s->n_request_bytes;
         return 0;
 }
+
+int ca_seed_get_misses(CaSeed *s, uint64_t *ret) {
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (!s->cache_chunks)
+                return -ENOTTY;
+
+        *ret = s->n_misses;
+        return 0;
+}
+
+int ca_seed_enumerate_cached_chunks(CaSeed *s, CaChunkID *ret) {
+        int r;
+
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+        if (s->cache_fd < 0)
+                return -EUNATCH;
+        if (!s->cache_chunks)
+                return -ENOMEDIUM;
+
+        /* Iterates through the chunk IDs present in the cache, one call returning one ID. Returns > 0 when
+         * an ID was returned, and 0 when the enumeration hit the end (resetting it for the next caller). */
+
+        if (!s->enumerate_dir) {
+                r = xopendirat(s->cache_fd, ".", 0, &s->enumerate_dir);
+                if (r < 0)
+                        return r;
+        }
+
+        for (;;) {
+                struct dirent *de;
+
+                if (s->enumerate_subdir) {
+
+                        errno = 0;
+                        de = readdir(s->enumerate_subdir);
+                        if (!de) {
+                                if (errno != 0)
+                                        return -errno;
+
+                                closedir(s->enumerate_subdir);
+                                s->enumerate_subdir = NULL;
+                                continue;
+                        }
+
+                        if (dot_or_dot_dot(de->d_name))
+                                continue;
+                        if (strlen(de->d_name) != CA_CHUNK_ID_FORMAT_MAX - 1)
+                                continue;
+                        if (!ca_chunk_id_parse(de->d_name, ret))
+                                continue;
+
+                        return 1;
+                }
+
+                errno = 0;
+                de = readdir(s->enumerate_dir);
+                if (!de) {
+                        if (errno != 0)
+                                return -errno;
+
+                        closedir(s->enumerate_dir);
+                        s->enumerate_dir = NULL;
+
+                        return 0;
+                }
+
+                if (strlen(de->d_name) != 4 ||
+                    strspn(de->d_name, "0123456789abcdef") != 4)
+                        continue;
+
+                r = xopendirat(dirfd(s->enumerate_dir), de->d_name, O_NOFOLLOW, &s->enumerate_subdir);
+                if (r == -ENOENT)
+                        continue;
+                if (r < 0)
+                        return r;
+        }
+}
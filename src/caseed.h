@@ -36,6 +36,8 @@ int ca_seed_current_mode(CaSeed *seed, mode_t *ret);
 
 int ca_seed_set_feature_flags(CaSeed *s, uint64_t flags);
 
+int ca_seed_set_threads(CaSeed *s, size_t n_threads);
+
 int ca_seed_set_chunk_size_min(CaSeed *s, size_t cmin);
 int ca_seed_set_chunk_size_avg(CaSeed *s, size_t cavg);
 int ca_seed_set_chunk_size_max(CaSeed *s, size_t cmax);
@@ -47,5 +49,8 @@ int ca_seed_get_file_root(CaSeed *s, CaFileRoot **ret);
 
 int ca_seed_get_requests(CaSeed *s, uint64_t *ret);
 int ca_seed_get_request_bytes(CaSeed *s, uint64_t *ret);
+int ca_seed_get_misses(CaSeed *s, uint64_t *ret);
+
+int ca_seed_enumerate_cached_chunks(CaSeed *s, CaChunkID *ret);
 
 #endif
@@ -3,7 +3,9 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "capack.h"
 #include "castore.h"
+#include "compressor.h"
 #include "def.h"
 #include "realloc-buffer.h"
 #include "rm-rf.h"
@@ -19,19 +21,39 @@ struct CaStore {
         char *root;
         bool is_cache:1;
         bool mkdir_done:1;
+        bool pack_mode:1; /* if true, new chunks go into pack files instead of loose files */
+        bool fanout_loaded:1;
+        CaChunkFanout fanout;
         ReallocBuffer buffer;
 
+        CaPack *pack;
+
         CaDigestType digest_type;
         ReallocBuffer validate_buffer;
         CaDigest *validate_digest;
 
         CaChunkCompression compression;
         CaCompressionType compression_type;
+        int compression_level;
 
         uint64_t n_requests;
         uint64_t n_request_bytes;
+
+        /* Direct-mapped cache of chunk IDs we recently determined to be absent, so that the encoder's
+         * existence check per produced chunk doesn't hit the file system again and again on huge stores.
+         * Entries are invalidated when the chunk is eventually stored. Allocated on first use. */
+        CaChunkID *negative_cache;
+        uint8_t *negative_cache_valid;
 };
 
+#define CA_STORE_NEGATIVE_CACHE_SLOTS 4096U
+
+static size_t ca_store_negative_cache_slot(const CaChunkID *chunk_id) {
+        /* The chunk ID is itself a uniformly distributed hash, hence deriving the slot from its first
+         * 64 bit is as good as hashing it again */
+        return (size_t) (chunk_id->u64[0] % CA_STORE_NEGATIVE_CACHE_SLOTS);
+}
+
 CaStore* ca_store_new(void) {
         CaStore *store;
 
@@ -43,6 +65,7 @@ CaStore* ca_store_new(void) {
 
         store->compression = CA_CHUNK_COMPRESSED;
         store->compression_type = CA_COMPRESSION_DEFAULT;
+        store->compression_level = CA_COMPRESSION_LEVEL_DEFAULT;
 
         return store;
 }
@@ -56,6 +79,7 @@ CaStore *ca_store_new_cache(void) {
 
         s->is_cache = true;
         s->compression = CA_CHUNK_AS_IS;
+        s->compression_level = CA_COMPRESSION_LEVEL_DEFAULT;
 
         return s;
 }
@@ -73,10 +97,72 @@ CaStore* ca_store_unref(CaStore *store) {
         ca_digest_free(store->validate_digest);
         realloc_buffer_free(&store->validate_buffer);
 
+        free(store->negative_cache);
+        free(store->negative_cache_valid);
+
+        ca_pack_unref(store->pack);
+
         return mfree(store);
 }
 
+static int ca_store_load_dictionary(CaStore *store) {
+        ReallocBuffer buffer = {};
+        const char *p;
+        int fd, r;
+
+        assert(store);
+        assert(store->root);
+
+        /* If the store carries a compression dictionary, load it, so that all zstd contexts we create from
+         * here on make use of it. */
+
+        p = strjoina(store->root, CA_STORE_DICTIONARY_FILENAME);
+
+        fd = open(p, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0)
+                return errno == ENOENT ? 0 : -errno;
+
+        r = ca_load_fd(fd, &buffer);
+        safe_close(fd);
+        if (r < 0)
+                goto finish;
+
+        r = compressor_load_dictionary(realloc_buffer_data(&buffer), realloc_buffer_size(&buffer));
+
+finish:
+        realloc_buffer_free(&buffer);
+        return r;
+}
+
+static int ca_store_ensure_pack(CaStore *store) {
+        const char *q;
+        int r;
+
+        assert(store);
+        assert(store->root);
+
+        if (store->pack)
+                return 0;
+
+        store->pack = ca_pack_new();
+        if (!store->pack)
+                return -ENOMEM;
+
+        q = strjoina(store->root, "pack");
+
+        r = ca_pack_set_path(store->pack, q);
+        if (r < 0) {
+                store->pack = ca_pack_unref(store->pack);
+                return r;
+        }
+
+        return 0;
+}
+
 int ca_store_set_path(CaStore *store, const char *path) {
+        const char *q;
+        int r;
+
         if (!store)
                 return -EINVAL;
         if (!path)
@@ -92,6 +178,22 @@ int ca_store_set_path(CaStore *store, const char *path) {
         if (!store->root)
                 return -ENOMEM;
 
+        /* If the store carries pack files, hook them up, so that lookups cover them too */
+        q = strjoina(store->root, "pack");
+        if (access(q, F_OK) >= 0) {
+                r = ca_store_ensure_pack(store);
+                if (r < 0)
+                        return r;
+        }
+
+        return ca_store_load_dictionary(store);
+}
+
+int ca_store_set_pack_mode(CaStore *store, bool b) {
+        if (!store)
+                return -EINVAL;
+
+        store->pack_mode = b;
         return 0;
 }
 
@@ -119,6 +221,35 @@ int ca_store_set_compression_type(CaStore *store, CaCompressionType compression_
         return 0;
 }
 
+int ca_store_set_compression_level(CaStore *store, int level) {
+        if (!store)
+                return -EINVAL;
+        if (level < CA_COMPRESSION_LEVEL_AUTO)
+                return -EINVAL;
+
+        store->compression_level = level;
+        return 0;
+}
+
+static int ca_store_load_fanout(CaStore *store) {
+        int r;
+
+        assert(store);
+        assert(store->root);
+
+        if (store->fanout_loaded)
+                return 0;
+
+        /* Stores carry a deviating directory fan-out as a small configuration file in their root,
+         * absence means the classic single level of four digits. Read it once and cache it. */
+        r = ca_chunk_fanout_read(AT_FDCWD, store->root, &store->fanout);
+        if (r < 0)
+                return r;
+
+        store->fanout_loaded = true;
+        return 0;
+}
+
 int ca_store_get(
                 CaStore *store,
                 const CaChunkID *chunk_id,
@@ -141,9 +272,50 @@ int ca_store_get(
         if (!store->root)
                 return store->is_cache ? -ENOENT : -EUNATCH;
 
+        r = ca_store_load_fanout(store);
+        if (r < 0)
+                return r;
+
         realloc_buffer_empty(&store->buffer);
 
-        r = ca_chunk_file_load(AT_FDCWD, store->root, chunk_id, desired_compression, store->compression_type, &store->buffer, &effective);
+        r = ca_chunk_file_load(AT_FDCWD, store->root, &store->fanout, chunk_id, desired_compression, store->compression_type, &store->buffer, &effective);
+        if (r == -ENOENT && store->pack) {
+                CaChunkCompression stored;
+
+                /* Not available as a loose chunk, but maybe a pack file carries it */
+
+                realloc_buffer_empty(&store->buffer);
+
+                r = ca_pack_get(store->pack, chunk_id, &store->buffer, &stored);
+                if (r >= 0) {
+
+                        if (desired_compression == CA_CHUNK_AS_IS || desired_compression == stored)
+                                effective = stored;
+                        else {
+                                realloc_buffer_empty(&store->validate_buffer);
+
+                                if (desired_compression == CA_CHUNK_UNCOMPRESSED)
+                                        r = ca_decompress(realloc_buffer_data(&store->buffer),
+                                                          realloc_buffer_size(&store->buffer),
+                                                          &store->validate_buffer);
+                                else
+                                        r = ca_compress(store->compression_type,
+                                                        realloc_buffer_data(&store->buffer),
+                                                        realloc_buffer_size(&store->buffer),
+                                                        &store->validate_buffer);
+                                if (r < 0)
+                                        return r;
+
+                                realloc_buffer_empty(&store->buffer);
+                                if (!realloc_buffer_append(&store->buffer,
+                                                           realloc_buffer_data(&store->validate_buffer),
+                                                           realloc_buffer_size(&store->validate_buffer)))
+                                        return -ENOMEM;
+
+                                effective = desired_compression;
+                        }
+                }
+        }
         if (r < 0)
                 return r;
 
@@ -217,14 +389,123 @@ int ca_store_get(
         return r;
 }
 
+int ca_store_get_fd(
+                CaStore *store,
+                const CaChunkID *chunk_id,
+                uint64_t *ret_size) {
+
+        struct stat st;
+        int fd;
+
+        if (!store)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+
+        /* Opens the file backing a chunk, for copying its contents to a destination inside the kernel.
+         * Only loose chunk files stored uncompressed qualify, anything else (compressed files, pack
+         * files) has to pass through memory anyway and is reported as -ENOENT here. Note that unlike
+         * ca_store_get() this hands out the data without validating it against the chunk ID, callers
+         * trade that check for the zero-copy path. */
+
+        if (!store->root)
+                return store->is_cache ? -ENOENT : -EUNATCH;
+
+        fd = ca_store_load_fanout(store);
+        if (fd < 0)
+                return fd;
+
+        fd = ca_chunk_file_open(AT_FDCWD, store->root, &store->fanout, chunk_id, NULL, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
+        if (fd == -ELOOP) /* If it's a symlink, then it's marked as "missing" */
+                return -EADDRNOTAVAIL;
+        if (fd < 0)
+                return fd;
+
+        if (fstat(fd, &st) < 0) {
+                int r = -errno;
+                safe_close(fd);
+                return r;
+        }
+
+        if (!S_ISREG(st.st_mode)) {
+                safe_close(fd);
+                return -ENOENT;
+        }
+
+        if (ret_size)
+                *ret_size = (uint64_t) st.st_size;
+
+        store->n_requests++;
+        store->n_request_bytes += (uint64_t) st.st_size;
+
+        return fd;
+}
+
 int ca_store_has(CaStore *store, const CaChunkID *chunk_id) {
+        size_t slot;
+        int r;
 
         if (!store)
                 return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
         if (!store->root)
                 return store->is_cache ? -ENOENT : -EUNATCH;
 
-        return ca_chunk_file_test(AT_FDCWD, store->root, chunk_id);
+        slot = ca_store_negative_cache_slot(chunk_id);
+
+        if (store->negative_cache &&
+            store->negative_cache_valid[slot] &&
+            ca_chunk_id_equal(store->negative_cache + slot, chunk_id))
+                return 0;
+
+        r = ca_store_load_fanout(store);
+        if (r < 0)
+                return r;
+
+        r = ca_chunk_file_test(AT_FDCWD, store->root, &store->fanout, chunk_id);
+        if (r != 0)
+                return r;
+
+        if (store->pack) {
+                r = ca_pack_has(store->pack, chunk_id);
+                if (r != 0)
+                        return r;
+        }
+
+        if (!store->negative_cache) {
+                store->negative_cache = new0(CaChunkID, CA_STORE_NEGATIVE_CACHE_SLOTS);
+                store->negative_cache_valid = new0(uint8_t, CA_STORE_NEGATIVE_CACHE_SLOTS);
+
+                if (!store->negative_cache || !store->negative_cache_valid) {
+                        /* The cache is a pure optimization, proceed without it */
+                        store->negative_cache = mfree(store->negative_cache);
+                        store->negative_cache_valid = mfree(store->negative_cache_valid);
+                        return 0;
+                }
+        }
+
+        store->negative_cache[slot] = *chunk_id;
+        store->negative_cache_valid[slot] = true;
+
+        return 0;
+}
+
+int ca_store_prefetch(CaStore *store, const CaChunkID *chunk_id) {
+        int r;
+
+        if (!store)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+        if (!store->root)
+                return store->is_cache ? -ENOENT : -EUNATCH;
+
+        r = ca_store_load_fanout(store);
+        if (r < 0)
+                return r;
+
+        return ca_chunk_file_prefetch(AT_FDCWD, store->root, &store->fanout, chunk_id);
 }
 
 int ca_store_put(
@@ -260,12 +541,72 @@ int ca_store_put(
                 store->mkdir_done = true;
         }
 
-        return ca_chunk_file_save(
-                        AT_FDCWD, store->root,
-                        chunk_id,
-                        effective_compression, store->compression,
-                        store->compression_type,
-                        data, size);
+        r = ca_store_load_fanout(store);
+        if (r < 0)
+                return r;
+
+        if (store->pack_mode) {
+                CaChunkCompression desired;
+                int level = store->compression_level;
+
+                r = ca_store_ensure_pack(store);
+                if (r < 0)
+                        return r;
+
+                /* Also check the loose files, so that we don't store a second copy of a chunk that is
+                 * already present in classic form */
+                r = ca_chunk_file_test(AT_FDCWD, store->root, &store->fanout, chunk_id);
+                if (r < 0)
+                        return r;
+                if (r > 0)
+                        return -EEXIST;
+
+                desired = store->compression == CA_CHUNK_AS_IS ? effective_compression : store->compression;
+
+                if (desired == CA_CHUNK_COMPRESSED && effective_compression == CA_CHUNK_UNCOMPRESSED) {
+                        level = ca_compression_pick_level(store->compression_type, level, data, size);
+                        if (level == -ENODATA)
+                                /* High-entropy chunk, storing it as-is is just as small and much cheaper */
+                                desired = CA_CHUNK_UNCOMPRESSED;
+                }
+
+                if (desired == effective_compression)
+                        r = ca_pack_put(store->pack, chunk_id, effective_compression, data, size);
+                else {
+                        realloc_buffer_empty(&store->validate_buffer);
+
+                        if (desired == CA_CHUNK_COMPRESSED)
+                                r = ca_compress_level(store->compression_type, level, data, size, &store->validate_buffer);
+                        else
+                                r = ca_decompress(data, size, &store->validate_buffer);
+                        if (r < 0)
+                                return r;
+
+                        r = ca_pack_put(store->pack, chunk_id, desired,
+                                        realloc_buffer_data(&store->validate_buffer),
+                                        realloc_buffer_size(&store->validate_buffer));
+                }
+        } else
+                r = ca_chunk_file_save(
+                                AT_FDCWD, store->root, &store->fanout,
+                                chunk_id,
+                                effective_compression, store->compression,
+                                store->compression_type, store->compression_level,
+                                data, size);
+
+        /* The chunk exists now (either we just wrote it, or somebody else beat us to it), hence forget any
+         * cached negative lookup for it */
+        if ((r >= 0 || r == -EEXIST) && store->negative_cache) {
+                size_t slot;
+
+                slot = ca_store_negative_cache_slot(chunk_id);
+
+                if (store->negative_cache_valid[slot] &&
+                    ca_chunk_id_equal(store->negative_cache + slot, chunk_id))
+                        store->negative_cache_valid[slot] = false;
+        }
+
+        return r;
 }
 
 int ca_store_get_requests(CaStore *s, uint64_t *ret) {
@@ -5,6 +5,10 @@
 #include "cachunkid.h"
 #include "cautil.h"
 
+/* If a file by this name exists in a store's root, it is loaded as zstd compression dictionary, see
+ * "casync train-dictionary" */
+#define CA_STORE_DICTIONARY_FILENAME "zstd.cadict"
+
 typedef struct CaStore CaStore;
 
 CaStore* ca_store_new(void);
@@ -14,9 +18,13 @@ CaStore* ca_store_unref(CaStore *store);
 int ca_store_set_path(CaStore *store, const char *path);
 int ca_store_set_compression(CaStore *store, CaChunkCompression c);
 int ca_store_set_compression_type(CaStore *store, CaCompressionType compression);
+int ca_store_set_compression_level(CaStore *store, int level);
+int ca_store_set_pack_mode(CaStore *store, bool b);
 
 int ca_store_get(CaStore *store, const CaChunkID *chunk_id, CaChunkCompression desired_compression, const void **ret, uint64_t *ret_size, CaChunkCompression *ret_effective_compression);
+int ca_store_get_fd(CaStore *store, const CaChunkID *chunk_id, uint64_t *ret_size); /* returns an fd to the uncompressed chunk file, without validating it */
 int ca_store_has(CaStore *store, const CaChunkID *chunk_id);
+int ca_store_prefetch(CaStore *store, const CaChunkID *chunk_id);
 int ca_store_put(CaStore *store, const CaChunkID *chunk_id, CaChunkCompression effective_compression, const void *data, uint64_t size);
 
 int ca_store_get_requests(CaStore *s, uint64_t *ret);
@@ -1,15 +1,57 @@
 #include <curl/curl.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
 #include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
+#include "capack.h"
 #include "caprotocol.h"
 #include "caremote.h"
 #include "cautil.h"
 #include "realloc-buffer.h"
+#include "signal-handler.h"
 #include "util.h"
 
 static bool arg_verbose = false;
 static curl_off_t arg_rate_limit_bps = 0;
+static size_t arg_connections = 32;
+static const char *arg_daemon = NULL;
+
+/* Shared between all easy handles of this process, so that DNS results, TLS sessions and (with newer
+ * libcurl) established connections carry over from one transfer — and in daemon mode from one casync
+ * invocation — to the next. The helper is single-threaded, hence no lock callbacks are needed. */
+static CURLSH *curl_share = NULL;
+
+/* When the store publishes pack files we coalesce runs of requested chunks into a single range request
+ * each: runs may skip over at most RANGE_GAP_MAX unrequested bytes (which are downloaded and thrown away),
+ * and never span more than RANGE_RUN_MAX bytes. Up to REQUEST_QUEUE_MAX engine requests are drained into
+ * the local planning queue at a time. */
+#define RANGE_GAP_MAX (64U*1024U)
+#define RANGE_RUN_MAX (4U*1024U*1024U)
+#define REQUEST_QUEUE_MAX 256U
+
+/* One entry of the pack map, built from the pack indexes the store publishes: where a chunk lives */
+typedef struct PackChunk {
+        CaChunkID id;
+        size_t pack; /* index into pack_urls[] */
+        uint64_t offset;
+        uint64_t size;
+        CaChunkCompression compression;
+} PackChunk;
+
+static char **pack_urls = NULL;
+static size_t n_pack_urls = 0, pack_urls_allocated = 0;
+static PackChunk *pack_map = NULL; /* sorted by chunk ID */
+static size_t n_pack_map = 0, pack_map_allocated = 0;
+
+/* Engine requests wait here until the planner turns them into single or range transfers; chunks of a
+ * failed range transfer are parked in the retry queue and fetched individually */
+static CaChunkID *queued_requests = NULL;
+static size_t n_queued_requests = 0, queued_requests_allocated = 0;
+static CaChunkID *retry_requests = NULL;
+static size_t n_retry_requests = 0, retry_requests_allocated = 0;
 
 static enum {
         ARG_PROTOCOL_HTTP,
@@ -262,6 +304,728 @@ static char *chunk_url(const char *store_url, const CaChunkID *id) {
         return buffer;
 }
 
+static bool protocol_status_ok(long protocol_status) {
+        return (IN_SET(arg_protocol, ARG_PROTOCOL_HTTP, ARG_PROTOCOL_HTTPS) && protocol_status == 200) ||
+               (arg_protocol == ARG_PROTOCOL_FTP && protocol_status >= 200 && protocol_status <= 299) ||
+               (arg_protocol == ARG_PROTOCOL_SFTP && protocol_status == 0);
+}
+
+static char *pack_file_url(const char *store_url, const char *name) {
+        char *buffer;
+        size_t n;
+
+        /* Builds the URL of a file in the store's pack/ subdirectory, chopping off URL arguments and
+         * trailing dashes like chunk_url() does */
+
+        n = strcspn(store_url, "?;");
+        while (n > 0 && store_url[n-1] == '/')
+                n--;
+
+        if (asprintf(&buffer, "%.*s/pack/%s", (int) n, store_url, name) < 0)
+                return NULL;
+
+        return buffer;
+}
+
+static int acquire_buffer(CURL *curl, const char *url, ReallocBuffer *buffer, long *ret_protocol_status) {
+        assert(curl);
+        assert(url);
+        assert(buffer);
+        assert(ret_protocol_status);
+
+        realloc_buffer_empty(buffer);
+
+        if (curl_easy_setopt(curl, CURLOPT_URL, url) != CURLE_OK) {
+                fprintf(stderr, "Failed to set CURL URL to: %s\n", url);
+                return -EIO;
+        }
+
+        if (curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_chunk) != CURLE_OK) {
+                fprintf(stderr, "Failed to set CURL callback function.\n");
+                return -EIO;
+        }
+
+        if (curl_easy_setopt(curl, CURLOPT_WRITEDATA, buffer) != CURLE_OK) {
+                fprintf(stderr, "Failed to set CURL private data.\n");
+                return -EIO;
+        }
+
+        if (arg_verbose)
+                fprintf(stderr, "Acquiring %s...\n", url);
+
+        if (curl_easy_perform(curl) != CURLE_OK)
+                return -EIO;
+
+        if (curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, ret_protocol_status) != CURLE_OK) {
+                fprintf(stderr, "Failed to query response code\n");
+                return -EIO;
+        }
+
+        return 0;
+}
+
+static int pack_chunk_compare(const void *a, const void *b) {
+        const PackChunk *x = a, *y = b;
+
+        return memcmp(x->id.bytes, y->id.bytes, CA_CHUNK_ID_SIZE);
+}
+
+static const PackChunk *pack_map_find(const CaChunkID *id) {
+        PackChunk key = { .id = *id };
+
+        return bsearch(&key, pack_map, n_pack_map, sizeof(PackChunk), pack_chunk_compare);
+}
+
+static int load_pack_index(CURL *curl, const char *store_url, const char *name) {
+        const CaPackIndexHeader *h;
+        const CaPackIndexItem *items;
+        ReallocBuffer buffer = {};
+        char *index_url = NULL, *url = NULL;
+        long protocol_status;
+        uint64_t n_items, i;
+        int r;
+
+        assert(curl);
+        assert(store_url);
+        assert(name);
+
+        index_url = pack_file_url(store_url, strjoina(name, ".index"));
+        if (!index_url)
+                return log_oom();
+
+        r = acquire_buffer(curl, index_url, &buffer, &protocol_status);
+        if (r < 0)
+                goto finish;
+        if (!protocol_status_ok(protocol_status)) {
+                r = 0; /* No index for this pack, skip it */
+                goto finish;
+        }
+
+        if (realloc_buffer_size(&buffer) < sizeof(CaPackIndexHeader)) {
+                r = 0;
+                goto finish;
+        }
+
+        h = realloc_buffer_data(&buffer);
+        n_items = read_le64(&h->n_items);
+
+        if (read_le64(&h->magic) != CA_PACK_INDEX_MAGIC ||
+            sizeof(CaPackIndexHeader) + n_items * sizeof(CaPackIndexItem) != realloc_buffer_size(&buffer)) {
+                r = 0; /* Corrupted or foreign, skip it */
+                goto finish;
+        }
+
+        url = pack_file_url(store_url, name);
+        if (!url) {
+                r = log_oom();
+                goto finish;
+        }
+
+        if (!GREEDY_REALLOC(pack_urls, pack_urls_allocated, n_pack_urls + 1)) {
+                r = log_oom();
+                goto finish;
+        }
+
+        items = (const CaPackIndexItem*) ((const uint8_t*) realloc_buffer_data(&buffer) + sizeof(CaPackIndexHeader));
+
+        for (i = 0; i < n_items; i++) {
+                uint64_t size, compression;
+
+                size = read_le64(&items[i].size);
+                compression = read_le64(&items[i].compression);
+
+                if (size < 1 || size > CA_PACK_ENTRY_SIZE_MAX)
+                        continue;
+                if (!IN_SET(compression, CA_CHUNK_UNCOMPRESSED, CA_CHUNK_COMPRESSED))
+                        continue;
+
+                if (!GREEDY_REALLOC(pack_map, pack_map_allocated, n_pack_map + 1)) {
+                        r = log_oom();
+                        goto finish;
+                }
+
+                pack_map[n_pack_map++] = (PackChunk) {
+                        .pack = n_pack_urls,
+                        .offset = read_le64(&items[i].offset),
+                        .size = size,
+                        .compression = compression,
+                };
+                memcpy(pack_map[n_pack_map-1].id.bytes, items[i].id, CA_CHUNK_ID_SIZE);
+        }
+
+        pack_urls[n_pack_urls++] = url;
+        url = NULL;
+
+        r = 1;
+
+finish:
+        free(index_url);
+        free(url);
+        realloc_buffer_free(&buffer);
+
+        return r;
+}
+
+static int load_pack_map(CURL *curl, const char *store_url) {
+        ReallocBuffer buffer = {};
+        char *manifest_url = NULL;
+        long protocol_status;
+        const char *q;
+        size_t left;
+        int r;
+
+        assert(curl);
+        assert(store_url);
+
+        /* If the store publishes pack files (see capack.c), fetch the manifest and the pack indexes, so
+         * that runs of adjacent chunks can be fetched with a single range request each. Stores without
+         * packs simply don't have a manifest, then every chunk is fetched individually as before. */
+
+        manifest_url = pack_file_url(store_url, CA_PACK_MANIFEST_FILENAME);
+        if (!manifest_url)
+                return log_oom();
+
+        r = acquire_buffer(curl, manifest_url, &buffer, &protocol_status);
+        if (r < 0)
+                goto finish;
+        if (!protocol_status_ok(protocol_status)) {
+                r = 0;
+                goto finish;
+        }
+
+        q = realloc_buffer_data(&buffer);
+        left = realloc_buffer_size(&buffer);
+
+        while (left > 0) {
+                char name[256];
+                const char *nl;
+                size_t l;
+
+                nl = memchr(q, '\n', left);
+                l = nl ? (size_t) (nl - q) : left;
+
+                if (l > 0 && l < sizeof(name)) {
+                        memcpy(name, q, l);
+                        name[l] = 0;
+
+                        if (name[0] != '.' &&
+                            !strchr(name, '/') &&
+                            endswith(name, CA_PACK_SUFFIX)) {
+                                r = load_pack_index(curl, store_url, name);
+                                if (r < 0)
+                                        goto finish;
+                        }
+                }
+
+                q += l + !!nl;
+                left -= l + !!nl;
+        }
+
+        qsort(pack_map, n_pack_map, sizeof(PackChunk), pack_chunk_compare);
+
+        if (arg_verbose)
+                fprintf(stderr, "Loaded %zu pack index entries from %zu pack(s).\n", n_pack_map, n_pack_urls);
+
+        r = 0;
+
+finish:
+        free(manifest_url);
+        realloc_buffer_free(&buffer);
+
+        return r;
+}
+
+static int make_curl_share(void) {
+        CURLSH *sh;
+
+        if (curl_share)
+                return 0;
+
+        sh = curl_share_init();
+        if (!sh)
+                return log_oom();
+
+        (void) curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        (void) curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+        (void) curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
+        curl_share = sh;
+        return 0;
+}
+
+static int make_curl_easy_handle(CURL **ret) {
+        CURL *curl;
+        int r;
+
+        assert(ret);
+
+        r = make_curl_share();
+        if (r < 0)
+                return r;
+
+        curl = curl_easy_init();
+        if (!curl)
+                return log_oom();
+
+        if (curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L) != CURLE_OK) {
+                fprintf(stderr, "Failed to turn on location following.\n");
+                goto fail;
+        }
+
+        if (curl_easy_setopt(curl, CURLOPT_SHARE, curl_share) != CURLE_OK) {
+                fprintf(stderr, "Failed to attach share handle.\n");
+                goto fail;
+        }
+
+        /* Resolver results are good for as long as we live; short-lived invocations shouldn't resolve the
+         * same host more than once, and the daemon keeps them across clients */
+        (void) curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, -1L);
+
+        (void) curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+#if LIBCURL_VERSION_NUM >= 0x073100
+        /* Best effort: saves a round trip on fresh connections where the kernel and server support it */
+        (void) curl_easy_setopt(curl, CURLOPT_TCP_FASTOPEN, 1L);
+#endif
+
+        if (curl_easy_setopt(curl, CURLOPT_PROTOCOLS, arg_protocol == ARG_PROTOCOL_FTP ? CURLPROTO_FTP :
+                                                      arg_protocol == ARG_PROTOCOL_SFTP? CURLPROTO_SFTP: CURLPROTO_HTTP|CURLPROTO_HTTPS) != CURLE_OK) {
+                fprintf(stderr, "Failed to limit protocols to HTTP/HTTPS/FTP/SFTP.\n");
+                goto fail;
+        }
+
+        if (arg_protocol == ARG_PROTOCOL_SFTP) {
+                /* activate the ssh agent. For this to work you need
+                   to have ssh-agent running (type set | grep SSH_AGENT to check) */
+                if (curl_easy_setopt(curl, CURLOPT_SSH_AUTH_TYPES, CURLSSH_AUTH_AGENT) != CURLE_OK)
+                        fprintf(stderr, "Failed to turn on ssh agent support, ignoring.\n");
+        }
+
+        if (arg_rate_limit_bps > 0) {
+                if (curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE, arg_rate_limit_bps) != CURLE_OK) {
+                        fprintf(stderr, "Failed to set CURL send speed limit.\n");
+                        goto fail;
+                }
+
+                if (curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, arg_rate_limit_bps) != CURLE_OK) {
+                        fprintf(stderr, "Failed to set CURL receive speed limit.\n");
+                        goto fail;
+                }
+        }
+
+        /* (void) curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L); */
+
+        *ret = curl;
+        return 0;
+
+fail:
+        curl_easy_cleanup(curl);
+        return -EIO;
+}
+
+/* One chunk of a coalesced range transfer, with its position within the pack file */
+typedef struct RunItem {
+        CaChunkID id;
+        uint64_t offset;
+        uint64_t size;
+        CaChunkCompression compression;
+} RunItem;
+
+/* One slot of the parallel chunk download pool. Each slot owns a CURL easy handle (and hence a
+ * connection, which libcurl keeps alive between transfers), plus the buffer the data currently in
+ * flight is downloaded into. A slot either downloads a single loose chunk, or — if the store
+ * publishes packs — a range of a pack file covering a whole run of requested chunks. */
+typedef struct ChunkTransfer {
+        CURL *curl;
+        CaChunkID id;
+        char *url;
+        ReallocBuffer buffer;
+        bool in_use;
+
+        bool is_run;
+        RunItem *items;
+        size_t n_items;
+        uint64_t span_start, span_end;
+} ChunkTransfer;
+
+static int submit_transfer(ChunkTransfer *t, CURLM *multi, const char *range) {
+        int r;
+
+        assert(t);
+        assert(!t->in_use);
+        assert(multi);
+        assert(t->url);
+
+        if (!t->curl) {
+                r = make_curl_easy_handle(&t->curl);
+                if (r < 0)
+                        return r;
+
+                if (curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, write_chunk) != CURLE_OK) {
+                        fprintf(stderr, "Failed to set CURL callback function.\n");
+                        return -EIO;
+                }
+
+                if (curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, &t->buffer) != CURLE_OK) {
+                        fprintf(stderr, "Failed to set CURL private data.\n");
+                        return -EIO;
+                }
+
+                if (curl_easy_setopt(t->curl, CURLOPT_PRIVATE, t) != CURLE_OK) {
+                        fprintf(stderr, "Failed to set CURL transfer pointer.\n");
+                        return -EIO;
+                }
+        }
+
+        if (curl_easy_setopt(t->curl, CURLOPT_URL, t->url) != CURLE_OK) {
+                fprintf(stderr, "Failed to set CURL URL to: %s\n", t->url);
+                return -EIO;
+        }
+
+        if (curl_easy_setopt(t->curl, CURLOPT_RANGE, range) != CURLE_OK) {
+                fprintf(stderr, "Failed to set CURL range option.\n");
+                return -EIO;
+        }
+
+        if (curl_multi_add_handle(multi, t->curl) != CURLM_OK) {
+                fprintf(stderr, "Failed to add transfer to CURL multi handle.\n");
+                return -EIO;
+        }
+
+        if (arg_verbose) {
+                if (range)
+                        fprintf(stderr, "Acquiring %s (bytes %s)...\n", t->url, range);
+                else
+                        fprintf(stderr, "Acquiring %s...\n", t->url);
+        }
+
+        t->in_use = true;
+        return 0;
+}
+
+static int start_chunk_transfer(ChunkTransfer *t, CURLM *multi, const char *store_url, const CaChunkID *id) {
+        assert(t);
+        assert(store_url);
+        assert(id);
+
+        t->id = *id;
+        t->is_run = false;
+
+        free(t->url);
+        t->url = chunk_url(store_url, id);
+        if (!t->url)
+                return log_oom();
+
+        return submit_transfer(t, multi, NULL);
+}
+
+static int start_run_transfer(
+                ChunkTransfer *t,
+                CURLM *multi,
+                size_t pack,
+                RunItem *items, /* Takes possession! */
+                size_t n_items,
+                uint64_t span_start,
+                uint64_t span_end) {
+
+        char range[DECIMAL_STR_MAX(uint64_t) * 2 + 2], *u;
+
+        assert(t);
+        assert(pack < n_pack_urls);
+        assert(items);
+        assert(n_items > 0);
+        assert(span_start < span_end);
+
+        u = strdup(pack_urls[pack]);
+        if (!u) {
+                free(items);
+                return log_oom();
+        }
+
+        free(t->url);
+        t->url = u;
+
+        t->is_run = true;
+        free(t->items);
+        t->items = items;
+        t->n_items = n_items;
+        t->span_start = span_start;
+        t->span_end = span_end;
+
+        sprintf(range, "%" PRIu64 "-%" PRIu64, span_start, span_end - 1);
+
+        return submit_transfer(t, multi, range);
+}
+
+typedef struct RunCandidate {
+        RunItem item;
+        size_t qidx; /* index into queued_requests[] */
+} RunCandidate;
+
+static int run_candidate_compare_offset(const void *a, const void *b) {
+        const RunCandidate *x = a, *y = b;
+
+        if (x->item.offset < y->item.offset)
+                return -1;
+        if (x->item.offset > y->item.offset)
+                return 1;
+
+        return 0;
+}
+
+static int run_candidate_compare_qidx_desc(const void *a, const void *b) {
+        const RunCandidate *x = a, *y = b;
+
+        if (x->qidx > y->qidx)
+                return -1;
+        if (x->qidx < y->qidx)
+                return 1;
+
+        return 0;
+}
+
+static void dequeue_request(size_t idx) {
+        assert(idx < n_queued_requests);
+
+        memmove(queued_requests + idx, queued_requests + idx + 1,
+                (n_queued_requests - idx - 1) * sizeof(CaChunkID));
+        n_queued_requests--;
+}
+
+static int plan_and_start(ChunkTransfer *t, CURLM *multi, const char *store_url) {
+        RunCandidate *candidates = NULL;
+        size_t n_candidates = 0, n_take, i;
+        uint64_t span_start, span_end;
+        const PackChunk *pc;
+        RunItem *items;
+        CaChunkID id;
+        int r;
+
+        assert(t);
+        assert(multi);
+        assert(store_url);
+
+        /* Chunks whose range transfer failed are fetched individually first */
+        if (n_retry_requests > 0) {
+                id = retry_requests[--n_retry_requests];
+                return start_chunk_transfer(t, multi, store_url, &id);
+        }
+
+        assert(n_queued_requests > 0);
+
+        pc = pack_map_find(&queued_requests[0]);
+        if (!pc) {
+                id = queued_requests[0];
+                dequeue_request(0);
+                return start_chunk_transfer(t, multi, store_url, &id);
+        }
+
+        /* The chunk lives in a pack: gather everything else queued from the same pack, and coalesce the run
+         * starting at the lowest offset into a single range request. Even a lone pack chunk is fetched via
+         * the pack, as it might not exist as a loose file at all. */
+
+        candidates = new(RunCandidate, n_queued_requests);
+        if (!candidates)
+                return log_oom();
+
+        for (i = 0; i < n_queued_requests; i++) {
+                const PackChunk *q;
+
+                q = pack_map_find(&queued_requests[i]);
+                if (!q || q->pack != pc->pack)
+                        continue;
+
+                candidates[n_candidates++] = (RunCandidate) {
+                        .item = {
+                                .id = queued_requests[i],
+                                .offset = q->offset,
+                                .size = q->size,
+                                .compression = q->compression,
+                        },
+                        .qidx = i,
+                };
+        }
+
+        assert(n_candidates > 0);
+        qsort(candidates, n_candidates, sizeof(RunCandidate), run_candidate_compare_offset);
+
+        span_start = candidates[0].item.offset;
+        span_end = span_start + candidates[0].item.size;
+        n_take = 1;
+
+        for (i = 1; i < n_candidates; i++) {
+                uint64_t e;
+
+                if (candidates[i].item.offset > span_end + RANGE_GAP_MAX)
+                        break;
+
+                e = MAX(span_end, candidates[i].item.offset + candidates[i].item.size);
+                if (e - span_start > RANGE_RUN_MAX)
+                        break;
+
+                span_end = e;
+                n_take++;
+        }
+
+        items = new(RunItem, n_take);
+        if (!items) {
+                free(candidates);
+                return log_oom();
+        }
+        for (i = 0; i < n_take; i++)
+                items[i] = candidates[i].item;
+
+        /* Drop the coalesced chunks from the queue, back to front so the indexes stay valid */
+        qsort(candidates, n_take, sizeof(RunCandidate), run_candidate_compare_qidx_desc);
+        for (i = 0; i < n_take; i++)
+                dequeue_request(candidates[i].qidx);
+
+        free(candidates);
+
+        r = start_run_transfer(t, multi, pc->pack, items, n_take, span_start, span_end);
+        if (r < 0)
+                return r;
+
+        if (arg_verbose && n_take > 1)
+                fprintf(stderr, "Coalesced %zu chunk requests into one range request of %" PRIu64 " bytes.\n",
+                        n_take, span_end - span_start);
+
+        return 0;
+}
+
+static int retry_request_push(const CaChunkID *id) {
+        assert(id);
+
+        if (!GREEDY_REALLOC(retry_requests, retry_requests_allocated, n_retry_requests + 1))
+                return log_oom();
+
+        retry_requests[n_retry_requests++] = *id;
+        return 0;
+}
+
+static int complete_run_transfer(CaRemote *rr, ChunkTransfer *t, CURLcode result, long protocol_status) {
+        uint64_t base;
+        bool good;
+        size_t i;
+        int r;
+
+        assert(rr);
+        assert(t);
+        assert(t->is_run);
+
+        /* An HTTP server that honoured the range replies with 206 and just the requested span; one that
+         * ignored it replies with 200 and the whole pack file, which we can use just as well, only with a
+         * different base offset. FTP/SFTP REST failures surface as transfer errors instead. */
+
+        if (IN_SET(arg_protocol, ARG_PROTOCOL_HTTP, ARG_PROTOCOL_HTTPS)) {
+                good = result == CURLE_OK && IN_SET(protocol_status, 200, 206);
+                base = protocol_status == 206 ? t->span_start : 0;
+        } else {
+                good = result == CURLE_OK && protocol_status_ok(protocol_status);
+                base = t->span_start;
+        }
+
+        if (!good) {
+                /* The range request failed as a whole — fall back to fetching each chunk of the run as an
+                 * individual loose file */
+
+                if (arg_verbose)
+                        fprintf(stderr, "Range request on %s failed (%li), retrying %zu chunk(s) individually.\n",
+                                t->url, protocol_status, t->n_items);
+
+                for (i = 0; i < t->n_items; i++) {
+                        r = retry_request_push(&t->items[i].id);
+                        if (r < 0)
+                                return r;
+                }
+        } else
+                for (i = 0; i < t->n_items; i++) {
+                        RunItem *item = t->items + i;
+
+                        if (item->offset < base ||
+                            item->offset - base + item->size > realloc_buffer_size(&t->buffer)) {
+                                /* Truncated reply (e.g. the pack shrank since we read its index) — retry
+                                 * this chunk on its own */
+                                r = retry_request_push(&item->id);
+                                if (r < 0)
+                                        return r;
+                                continue;
+                        }
+
+                        r = process_remote(rr, PROCESS_UNTIL_CAN_PUT_CHUNK);
+                        if (r < 0)
+                                return r;
+
+                        r = ca_remote_put_chunk(rr, &item->id, item->compression,
+                                                (const uint8_t*) realloc_buffer_data(&t->buffer) + (item->offset - base),
+                                                item->size);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to write chunk: %s\n", strerror(-r));
+                                return r;
+                        }
+                }
+
+        t->items = mfree(t->items);
+        t->n_items = 0;
+        realloc_buffer_empty(&t->buffer);
+        t->in_use = false;
+
+        return 0;
+}
+
+static int complete_chunk_transfer(CaRemote *rr, ChunkTransfer *t, CURLcode result) {
+        long protocol_status = 0;
+        int r;
+
+        assert(rr);
+        assert(t);
+        assert(t->in_use);
+
+        if (result == CURLE_OK &&
+            curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &protocol_status) != CURLE_OK) {
+                fprintf(stderr, "Failed to query response code\n");
+                return -EIO;
+        }
+
+        if (t->is_run)
+                return complete_run_transfer(rr, t, result, protocol_status);
+
+        if (result != CURLE_OK) {
+                fprintf(stderr, "Failed to acquire %s\n", t->url);
+                return -EIO;
+        }
+
+        r = process_remote(rr, PROCESS_UNTIL_CAN_PUT_CHUNK);
+        if (r < 0)
+                return r;
+
+        if (protocol_status_ok(protocol_status)) {
+
+                r = ca_remote_put_chunk(rr, &t->id, CA_CHUNK_COMPRESSED, realloc_buffer_data(&t->buffer), realloc_buffer_size(&t->buffer));
+                if (r < 0) {
+                        fprintf(stderr, "Failed to write chunk: %s\n", strerror(-r));
+                        return r;
+                }
+
+        } else {
+                if (arg_verbose)
+                        fprintf(stderr, "HTTP/FTP/SFTP server failure %li while requesting %s.\n", protocol_status, t->url);
+
+                r = ca_remote_put_missing(rr, &t->id);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to write missing message: %s\n", strerror(-r));
+                        return r;
+                }
+        }
+
+        realloc_buffer_empty(&t->buffer);
+        t->in_use = false;
+
+        return 0;
+}
+
 static int acquire_file(CaRemote *rr,
                         CURL *curl,
                         const char *url,
@@ -344,14 +1108,13 @@ static int acquire_file(CaRemote *rr,
         return 1;
 }
 
-static int run(int argc, char *argv[]) {
+static int run(int argc, char *argv[], int input_fd, int output_fd) {
         const char *base_url, *archive_url, *index_url, *wstore_url;
-        size_t n_stores = 0, current_store = 0;
-        char *url_buffer = NULL;
+        size_t n_stores = 0, current_store = 0, n_active = 0, i;
+        ChunkTransfer *transfers = NULL;
+        CURLM *multi = NULL;
         CURL *curl = NULL;
-        ReallocBuffer chunk_buffer = {};
         CaRemote *rr = NULL;
-        long protocol_status;
         int r;
 
         if (argc < 5) {
@@ -393,53 +1156,15 @@ static int run(int argc, char *argv[]) {
                 goto finish;
         }
 
-        r = ca_remote_set_io_fds(rr, STDIN_FILENO, STDOUT_FILENO);
+        r = ca_remote_set_io_fds(rr, input_fd, output_fd);
         if (r < 0) {
                 fprintf(stderr, "Failed to set I/O file descriptors: %s\n", strerror(-r));
                 goto finish;
         }
 
-        curl = curl_easy_init();
-        if (!curl) {
-                r = log_oom();
-                goto finish;
-        }
-
-        if (curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L) != CURLE_OK) {
-                fprintf(stderr, "Failed to turn on location following.\n");
-                r = -EIO;
-                goto finish;
-        }
-
-        if (curl_easy_setopt(curl, CURLOPT_PROTOCOLS, arg_protocol == ARG_PROTOCOL_FTP ? CURLPROTO_FTP :
-                                                      arg_protocol == ARG_PROTOCOL_SFTP? CURLPROTO_SFTP: CURLPROTO_HTTP|CURLPROTO_HTTPS) != CURLE_OK) {
-                fprintf(stderr, "Failed to limit protocols to HTTP/HTTPS/FTP/SFTP.\n");
-                r = -EIO;
+        r = make_curl_easy_handle(&curl);
+        if (r < 0)
                 goto finish;
-        }
-
-        if (arg_protocol == ARG_PROTOCOL_SFTP) {
-                /* activate the ssh agent. For this to work you need
-                   to have ssh-agent running (type set | grep SSH_AGENT to check) */
-                if (curl_easy_setopt(curl, CURLOPT_SSH_AUTH_TYPES, CURLSSH_AUTH_AGENT) != CURLE_OK)
-                        fprintf(stderr, "Failed to turn on ssh agent support, ignoring.\n");
-        }
-
-        if (arg_rate_limit_bps > 0) {
-                if (curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE, arg_rate_limit_bps) != CURLE_OK) {
-                        fprintf(stderr, "Failed to set CURL send speed limit.\n");
-                        r = -EIO;
-                        goto finish;
-                }
-
-                if (curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, arg_rate_limit_bps) != CURLE_OK) {
-                        fprintf(stderr, "Failed to set CURL receive speed limit.\n");
-                        r = -EIO;
-                        goto finish;
-                }
-        }
-
-        /* (void) curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L); */
 
         if (archive_url) {
                 r = acquire_file(rr, curl, archive_url, write_archive);
@@ -465,141 +1190,303 @@ static int run(int argc, char *argv[]) {
                         goto finish;
         }
 
-        for (;;) {
-                const char *store_url;
-                CaChunkID id;
-
-                if (n_stores == 0)  /* No stores? Then we did all we could do */
-                        break;
-
-                r = process_remote(rr, PROCESS_UNTIL_HAVE_REQUEST);
-                if (r == -EPIPE) {
-                        r = 0;
-                        goto finish;
-                }
-                if (r < 0)
-                        goto finish;
+        if (n_stores > 0) {
+                /* Chunk requests are served through a pool of parallel transfers on a single multi
+                 * handle, so that many GETs are in flight at any time and connections (and on
+                 * HTTP/2 even a single connection) are shared between them. */
 
-                r = ca_remote_next_request(rr, &id);
-                if (r == -ENODATA)
-                        continue;
-                if (r < 0) {
-                        fprintf(stderr, "Failed to determine next chunk to get: %s\n", strerror(-r));
+                multi = curl_multi_init();
+                if (!multi) {
+                        r = log_oom();
                         goto finish;
                 }
 
-                current_store = current_store % n_stores;
-                if (wstore_url)
-                        store_url = current_store == 0 ? wstore_url : argv[current_store + 5 - 1];
-                else
-                        store_url = argv[current_store + 5];
-                /* current_store++; */
+                (void) curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
 
-                free(url_buffer);
-                url_buffer = chunk_url(store_url, &id);
-                if (!url_buffer) {
+                transfers = new0(ChunkTransfer, arg_connections);
+                if (!transfers) {
                         r = log_oom();
                         goto finish;
                 }
 
-                if (curl_easy_setopt(curl, CURLOPT_URL, url_buffer) != CURLE_OK) {
-                        fprintf(stderr, "Failed to set CURL URL to: %s\n", index_url);
-                        r = -EIO;
-                        goto finish;
-                }
-
-                if (curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_chunk) != CURLE_OK) {
-                        fprintf(stderr, "Failed to set CURL callback function.\n");
-                        r = -EIO;
-                        goto finish;
-                }
+                /* Best effort: without the pack map every chunk is simply fetched individually */
+                r = load_pack_map(curl, wstore_url ? wstore_url : argv[5]);
+                if (r < 0)
+                        fprintf(stderr, "Failed to load pack indexes, fetching chunks individually: %s\n", strerror(-r));
+
+                for (;;) {
+                        bool progress = false;
+                        CURLMsg *message;
+                        int still_running, n_messages;
+
+                        /* Pull pending requests from the engine into the planning queue */
+                        while (n_queued_requests < REQUEST_QUEUE_MAX) {
+                                CaChunkID id;
+
+                                r = ca_remote_has_pending_requests(rr);
+                                if (r == -EPIPE) {
+                                        r = 0;
+                                        goto finish;
+                                }
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to determine whether there are pending requests.\n");
+                                        goto finish;
+                                }
+                                if (r == 0)
+                                        break;
+
+                                r = ca_remote_next_request(rr, &id);
+                                if (r == -ENODATA)
+                                        break;
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to determine next chunk to get: %s\n", strerror(-r));
+                                        goto finish;
+                                }
+
+                                if (!GREEDY_REALLOC(queued_requests, queued_requests_allocated, n_queued_requests + 1)) {
+                                        r = log_oom();
+                                        goto finish;
+                                }
+
+                                queued_requests[n_queued_requests++] = id;
+                                progress = true;
+                        }
 
-                if (curl_easy_setopt(curl, CURLOPT_WRITEDATA, &chunk_buffer) != CURLE_OK) {
-                        fprintf(stderr, "Failed to set CURL private data.\n");
-                        r = -EIO;
-                        goto finish;
-                }
+                        /* Turn the queue into transfers, as long as we have idle slots */
+                        while (n_active < arg_connections &&
+                               (n_retry_requests > 0 || n_queued_requests > 0)) {
+                                const char *store_url;
+                                ChunkTransfer *t = NULL;
+
+                                current_store = current_store % n_stores;
+                                if (wstore_url)
+                                        store_url = current_store == 0 ? wstore_url : argv[current_store + 5 - 1];
+                                else
+                                        store_url = argv[current_store + 5];
+                                /* current_store++; */
+
+                                for (i = 0; i < arg_connections; i++)
+                                        if (!transfers[i].in_use) {
+                                                t = transfers + i;
+                                                break;
+                                        }
+                                assert(t);
+
+                                r = plan_and_start(t, multi, store_url);
+                                if (r < 0)
+                                        goto finish;
+
+                                n_active++;
+                                progress = true;
+                        }
 
-                if (arg_rate_limit_bps > 0) {
-                        if (curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE, arg_rate_limit_bps) != CURLE_OK) {
-                                fprintf(stderr, "Failed to set CURL send speed limit.\n");
+                        if (curl_multi_perform(multi, &still_running) != CURLM_OK) {
+                                fprintf(stderr, "Failed to run CURL transfers.\n");
                                 r = -EIO;
                                 goto finish;
                         }
 
-                        if (curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, arg_rate_limit_bps) != CURLE_OK) {
-                                fprintf(stderr, "Failed to set CURL receive speed limit.\n");
-                                r = -EIO;
-                                goto finish;
+                        /* Pass completed chunks on to the remoting engine */
+                        while ((message = curl_multi_info_read(multi, &n_messages))) {
+                                CURLcode result;
+                                ChunkTransfer *t;
+                                char *p = NULL;
+
+                                if (message->msg != CURLMSG_DONE)
+                                        continue;
+
+                                if (curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &p) != CURLE_OK) {
+                                        fprintf(stderr, "Failed to query CURL transfer pointer.\n");
+                                        r = -EIO;
+                                        goto finish;
+                                }
+                                t = (ChunkTransfer*) p;
+
+                                result = message->data.result;
+                                if (curl_multi_remove_handle(multi, t->curl) != CURLM_OK) {
+                                        fprintf(stderr, "Failed to remove transfer from CURL multi handle.\n");
+                                        r = -EIO;
+                                        goto finish;
+                                }
+
+                                r = complete_chunk_transfer(rr, t, result);
+                                if (r == -EPIPE) {
+                                        r = 0;
+                                        goto finish;
+                                }
+                                if (r < 0)
+                                        goto finish;
+
+                                n_active--;
+                                progress = true;
                         }
-                }
 
-                if (arg_verbose)
-                        fprintf(stderr, "Acquiring %s...\n", url_buffer);
+                        /* Write out finished chunks, pick up new requests */
+                        for (;;) {
+                                r = ca_remote_step(rr);
+                                if (r == -EPIPE || r == CA_REMOTE_FINISHED) {
+                                        r = 0;
+                                        goto finish;
+                                }
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to process remoting engine: %s\n", strerror(-r));
+                                        goto finish;
+                                }
+                                if (r == CA_REMOTE_POLL)
+                                        break;
+
+                                progress = true;
+                        }
 
-                if (curl_easy_perform(curl) != CURLE_OK) {
-                        fprintf(stderr, "Failed to acquire %s\n", url_buffer);
-                        r = -EIO;
-                        goto finish;
+                        if (progress)
+                                continue;
+
+                        /* Nothing happened, wait on both the transfers and the remoting engine fds */
+                        {
+                                struct curl_waitfd waitfds[2] = {};
+                                unsigned n_waitfds = 0;
+                                short input_poll_events, output_poll_events;
+                                int input_fd, output_fd, n_events;
+
+                                r = ca_remote_get_io_fds(rr, &input_fd, &output_fd);
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to query remoting engine file descriptors: %s\n", strerror(-r));
+                                        goto finish;
+                                }
+
+                                r = ca_remote_get_io_events(rr, &input_poll_events, &output_poll_events);
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to query remoting engine I/O events: %s\n", strerror(-r));
+                                        goto finish;
+                                }
+
+                                if (input_poll_events & POLLIN)
+                                        waitfds[n_waitfds++] = (struct curl_waitfd) { .fd = input_fd, .events = CURL_WAIT_POLLIN };
+                                if (output_poll_events & POLLOUT)
+                                        waitfds[n_waitfds++] = (struct curl_waitfd) { .fd = output_fd, .events = CURL_WAIT_POLLOUT };
+
+                                if (curl_multi_wait(multi, waitfds, n_waitfds, 1000, &n_events) != CURLM_OK) {
+                                        fprintf(stderr, "Failed to wait for CURL transfers.\n");
+                                        r = -EIO;
+                                        goto finish;
+                                }
+                        }
                 }
+        }
 
-                if (curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &protocol_status) != CURLE_OK) {
-                        fprintf(stderr, "Failed to query response code\n");
-                        r = -EIO;
-                        goto finish;
-                }
+flush:
+        r = process_remote(rr, PROCESS_UNTIL_FINISHED);
 
-                r = process_remote(rr, PROCESS_UNTIL_CAN_PUT_CHUNK);
-                if (r == -EPIPE) {
-                        r = 0;
-                        goto finish;
+finish:
+        if (transfers) {
+                for (i = 0; i < arg_connections; i++) {
+                        if (transfers[i].in_use && multi)
+                                (void) curl_multi_remove_handle(multi, transfers[i].curl);
+                        if (transfers[i].curl)
+                                curl_easy_cleanup(transfers[i].curl);
+
+                        free(transfers[i].url);
+                        free(transfers[i].items);
+                        realloc_buffer_free(&transfers[i].buffer);
                 }
-                if (r < 0)
-                        goto finish;
 
-                if ((IN_SET(arg_protocol, ARG_PROTOCOL_HTTP, ARG_PROTOCOL_HTTPS) && protocol_status == 200) ||
-                    (arg_protocol == ARG_PROTOCOL_FTP && (protocol_status >= 200 && protocol_status <= 299))||
-                    (arg_protocol == ARG_PROTOCOL_SFTP && (protocol_status == 0))) {
+                free(transfers);
+        }
 
-                        r = ca_remote_put_chunk(rr, &id, CA_CHUNK_COMPRESSED, realloc_buffer_data(&chunk_buffer), realloc_buffer_size(&chunk_buffer));
-                        if (r < 0) {
-                                fprintf(stderr, "Failed to write chunk: %s\n", strerror(-r));
-                                goto finish;
-                        }
+        /* Reset the planning state fully, in daemon mode the next client starts from scratch */
+        for (i = 0; i < n_pack_urls; i++)
+                free(pack_urls[i]);
+        pack_urls = mfree(pack_urls);
+        n_pack_urls = pack_urls_allocated = 0;
+        pack_map = mfree(pack_map);
+        n_pack_map = pack_map_allocated = 0;
+        queued_requests = mfree(queued_requests);
+        n_queued_requests = queued_requests_allocated = 0;
+        retry_requests = mfree(retry_requests);
+        n_retry_requests = retry_requests_allocated = 0;
+
+        if (multi)
+                curl_multi_cleanup(multi);
 
-                } else {
-                        if (arg_verbose)
-                                fprintf(stderr, "HTTP/FTP/SFTP server failure %li while requesting %s.\n", protocol_status, url_buffer);
+        if (curl)
+                curl_easy_cleanup(curl);
 
-                        r = ca_remote_put_missing(rr, &id);
-                        if (r < 0) {
-                                fprintf(stderr, "Failed to write missing message: %s\n", strerror(-r));
-                                goto finish;
-                        }
-                }
+        ca_remote_unref(rr);
 
-                realloc_buffer_empty(&chunk_buffer);
+        return r;
+}
 
-                r = process_remote(rr, PROCESS_UNTIL_WRITTEN);
-                if (r == -EPIPE) {
-                        r = 0;
+static int run_daemon(int argc, char *argv[]) {
+        struct sockaddr_un sa = { .sun_family = AF_UNIX };
+        int fd = -1, r;
+
+        /* Persists between casync invocations, serving one at a time over a unix socket. What makes this
+         * worthwhile is the state the curl share handle keeps across clients: resolved host names, TLS
+         * sessions and live connections, so a fleet of short-lived update checks doesn't pay resolver and
+         * handshake latency for every single one. */
+
+        if (strlen(arg_daemon) >= sizeof(sa.sun_path)) {
+                fprintf(stderr, "Socket path too long: %s\n", arg_daemon);
+                return -EINVAL;
+        }
+        strcpy(sa.sun_path, arg_daemon);
+
+        fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                r = -errno;
+                fprintf(stderr, "Failed to allocate socket: %s\n", strerror(-r));
+                return r;
+        }
+
+        (void) unlink(arg_daemon);
+
+        if (bind(fd, (struct sockaddr*) &sa, sizeof(sa)) < 0) {
+                r = -errno;
+                fprintf(stderr, "Failed to bind to %s: %s\n", arg_daemon, strerror(-r));
+                goto finish;
+        }
+
+        if (listen(fd, SOMAXCONN) < 0) {
+                r = -errno;
+                fprintf(stderr, "Failed to listen on %s: %s\n", arg_daemon, strerror(-r));
+                goto finish;
+        }
+
+        install_exit_handler(NULL);
+
+        if (arg_verbose)
+                fprintf(stderr, "Listening on %s.\n", arg_daemon);
+
+        while (!quit) {
+                int cfd, cfd2;
+
+                cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+                if (cfd < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        r = -errno;
+                        fprintf(stderr, "Failed to accept connection: %s\n", strerror(-r));
                         goto finish;
                 }
-                if (r < 0)
-                        goto finish;
-        }
 
-flush:
-        r = process_remote(rr, PROCESS_UNTIL_FINISHED);
+                /* The remote engine closes both of its fds, hence hand it two */
+                cfd2 = fcntl(cfd, F_DUPFD_CLOEXEC, 3);
+                if (cfd2 < 0) {
+                        safe_close(cfd);
+                        continue;
+                }
 
-finish:
-        if (curl)
-                curl_easy_cleanup(curl);
+                r = run(argc, argv, cfd, cfd2);
+                if (r < 0 && arg_verbose)
+                        fprintf(stderr, "Request failed, waiting for the next client: %s\n", strerror(-r));
+        }
 
-        free(url_buffer);
-        realloc_buffer_free(&chunk_buffer);
+        r = 0;
 
-        ca_remote_unref(rr);
+finish:
+        safe_close(fd);
+        (void) unlink(arg_daemon);
 
         return r;
 }
@@ -610,13 +1497,19 @@ static void help(void) {
 
 static int parse_argv(int argc, char *argv[]) {
 
+        enum {
+                ARG_DAEMON = 0x100,
+        };
+
         static const struct option options[] = {
                 { "help",           no_argument,       NULL, 'h'                },
                 { "verbose",        no_argument,       NULL, 'v'                },
                 { "rate-limit-bps", required_argument, NULL, 'l'                },
+                { "daemon",         required_argument, NULL, ARG_DAEMON         },
                 {}
         };
 
+        const char *e;
         int c;
 
         assert(argc >= 0);
@@ -638,6 +1531,16 @@ static int parse_argv(int argc, char *argv[]) {
         if (getenv_bool("CASYNC_VERBOSE") > 0)
                 arg_verbose = true;
 
+        e = getenv("CASYNC_HTTP_CONNECTIONS");
+        if (e) {
+                uint64_t u;
+
+                if (safe_atou64(e, &u) < 0 || u < 1 || u > 256)
+                        fprintf(stderr, "Invalid $CASYNC_HTTP_CONNECTIONS value, ignoring: %s\n", e);
+                else
+                        arg_connections = (size_t) u;
+        }
+
         while ((c = getopt_long(argc, argv, "hv", options, NULL)) >= 0) {
 
                 switch (c) {
@@ -654,6 +1557,10 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_rate_limit_bps = strtoll(optarg, NULL, 10);
                         break;
 
+                case ARG_DAEMON:
+                        arg_daemon = optarg;
+                        break;
+
                 case '?':
                         return -EINVAL;
 
@@ -686,12 +1593,16 @@ int main(int argc, char* argv[]) {
         }
 
         if (streq(argv[optind], "pull"))
-                r = run(argc - optind, argv + optind);
+                r = arg_daemon ? run_daemon(argc - optind, argv + optind) :
+                                 run(argc - optind, argv + optind, STDIN_FILENO, STDOUT_FILENO);
         else {
                 fprintf(stderr, "Unknown verb: %s\n", argv[optind]);
                 r = -EINVAL;
         }
 
 finish:
+        if (curl_share)
+                curl_share_cleanup(curl_share);
+
         return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -1,26 +1,44 @@
+#include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <netinet/in.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <time.h>
+#include <zdict.h>
 
+#include "cabloom.h"
+#include "cachunk.h"
+#include "cachunker.h"
+#include "cadigest.h"
+#include "caencoder.h"
 #include "caformat-util.h"
 #include "caformat.h"
 #include "cafuse.h"
 #include "caindex.h"
 #include "canbd.h"
+#include "capack.h"
 #include "caprotocol.h"
 #include "caremote.h"
+#include "caseed.h"
 #include "castore.h"
 #include "casync.h"
+#include "cautil.h"
+#include "compressor.h"
+#include "def.h"
 #include "notify.h"
 #include "parse-util.h"
+#include "realloc-buffer.h"
 #include "signal-handler.h"
 #include "util.h"
 
@@ -35,20 +53,35 @@ static enum {
 static bool arg_verbose = false;
 static bool arg_exclude_nodump = true;
 static bool arg_exclude_submounts = false;
+static bool arg_inline_chunks = false;
+static bool arg_file_aligned_chunks = false;
+static bool arg_toc = false;
 static bool arg_reflink = true;
 static bool arg_hardlink = false;
 static bool arg_punch_holes = true;
+static bool arg_direct_io = false;
+static CaSyncMode arg_sync_mode = CA_SYNC_MODE_NONE;
 static bool arg_delete = true;
 static bool arg_undo_immutable = false;
 static bool arg_recursive = true;
 static bool arg_seed_output = true;
+static bool arg_resume = false;
 static char *arg_store = NULL;
 static char **arg_extra_stores = NULL;
 static char **arg_seeds = NULL;
 static size_t arg_chunk_size_min = 0;
 static size_t arg_chunk_size_avg = 0;
 static size_t arg_chunk_size_max = 0;
+static CaChunkerAlgorithm arg_chunker = CA_CHUNKER_BUZHASH;
+static CaRemoteVerify arg_verify = CA_REMOTE_VERIFY_FULL;
 static uint64_t arg_rate_limit_bps = UINT64_MAX;
+static uint64_t arg_rate_limit_burst = 0;
+static char *arg_stats_file = NULL;
+static char *arg_since = NULL;
+static bool arg_batch = false;
+static char *arg_lazy = NULL;
+static uint64_t arg_memory_limit = 0;
+static size_t arg_threads = 0;
 static uint64_t arg_with = 0;
 static uint64_t arg_without = 0;
 static uid_t arg_uid_shift = 0, arg_uid_range = 0x10000U;
@@ -56,6 +89,14 @@ static bool arg_uid_shift_apply = false;
 static bool arg_mkdir = true;
 static CaDigestType arg_digest = CA_DIGEST_DEFAULT;
 static CaCompressionType arg_compression = CA_COMPRESSION_DEFAULT;
+static int arg_compression_level = CA_COMPRESSION_LEVEL_DEFAULT;
+static bool arg_pack = false;
+static char *arg_cache = NULL;
+static char *arg_listen = NULL;
+static unsigned arg_sample = 100;
+static bool arg_profile = false;
+static unsigned arg_iterations = 3;
+static bool arg_drop_caches = false;
 
 static void help(void) {
         printf("%1$s [OPTIONS...] make [ARCHIVE|ARCHIVE_INDEX|BLOB_INDEX] [PATH]\n"
@@ -63,11 +104,22 @@ static void help(void) {
                "%1$s [OPTIONS...] list [ARCHIVE|ARCHIVE_INDEX|DIRECTORY]\n"
                "%1$s [OPTIONS...] mtree [ARCHIVE|ARCHIVE_INDEX|DIRECTORY]\n"
                "%1$s [OPTIONS...] stat [ARCHIVE|ARCHIVE_INDEX|DIRECTORY] [PATH]\n"
+               "%1$s [OPTIONS...] diff [ARCHIVE|ARCHIVE_INDEX] DIRECTORY\n"
+               "%1$s [OPTIONS...] plan BLOB_INDEX|ARCHIVE_INDEX\n"
                "%1$s [OPTIONS...] digest [ARCHIVE|BLOB|ARCHIVE_INDEX|BLOB_INDEX|DIRECTORY]\n"
+               "%1$s [OPTIONS...] analyze [DIRECTORY|BLOB]\n"
 #if HAVE_FUSE
                "%1$s [OPTIONS...] mount [ARCHIVE|ARCHIVE_INDEX] PATH\n"
 #endif
-               "%1$s [OPTIONS...] mkdev [BLOB|BLOB_INDEX] [NODE]\n\n"
+               "%1$s [OPTIONS...] mkdev [BLOB|BLOB_INDEX] [NODE]\n"
+               "%1$s [OPTIONS...] gc BLOB_INDEX|ARCHIVE_INDEX...\n"
+               "%1$s [OPTIONS...] recompress STORE\n"
+               "%1$s [OPTIONS...] reshard DIGITSxLEVELS STORE\n"
+               "%1$s [OPTIONS...] serve STORE\n"
+               "%1$s [OPTIONS...] prefetch BLOB_INDEX|ARCHIVE_INDEX\n"
+               "%1$s [OPTIONS...] verify BLOB_INDEX|ARCHIVE_INDEX [PATH]\n"
+               "%1$s [OPTIONS...] train-dictionary STORE\n"
+               "%1$s [OPTIONS...] benchmark make|extract ARGUMENTS...\n\n"
                "Content-Addressable Data Synchronization Tool\n\n"
                "  -h --help                  Show this help\n"
                "     --version               Show brief version information\n"
@@ -77,28 +129,74 @@ static void help(void) {
                "     --chunk-size=[MIN:]AVG[:MAX]\n"
                "                             The minimal/average/maximum number of bytes in a\n"
                "                             chunk\n"
+               "     --chunker=ALGORITHM     Pick chunking algorithm (buzhash or fastcdc)\n"
                "     --digest=DIGEST         Pick digest algorithm (sha512-256 or sha256)\n"
                "     --compression=COMPRESSION\n"
-               "                             Pick compression algorithm (zstd, xz or gzip)\n"
+               "                             Pick compression algorithm (zstd, zstd-ldm, xz or\n"
+               "                             gzip)\n"
+               "     --compression-level=LEVEL\n"
+               "                             Pick compression effort in the algorithm's native\n"
+               "                             scale, or \"auto\" for per-chunk adaptive effort\n"
+               "     --pack=yes              Store new chunks in pack files combining many\n"
+               "                             chunks, rather than as individual files\n"
+               "     --cache=PATH            Cache directory for incremental \"make\", so that\n"
+               "                             unchanged files are not chunked again\n"
+               "     --listen=[ADDRESS:]PORT Address and port to listen on for the \"serve\"\n"
+               "                             verb (defaults to port 8080 on all addresses)\n"
+               "     --sample=PERCENT        Percentage of chunks to fully digest when\n"
+               "                             verifying, the rest is checked for presence only\n"
+               "     --profile               Print per-stage performance counters when done\n"
+               "     --iterations=N          Number of runs for the benchmark verb\n"
+               "     --drop-caches=yes       Drop the kernel page cache between benchmark\n"
+               "                             runs (needs privileges)\n"
                "     --seed=PATH             Additional file or directory to use as seed\n"
                "     --rate-limit-bps=LIMIT  Maximum bandwidth in bytes/s for remote\n"
                "                             communication\n"
+               "     --rate-limit-burst=SIZE Token bucket burst size in bytes for the rate\n"
+               "                             limiter (defaults to ~100ms worth of traffic)\n"
+               "     --stats-file=PATH       Export progress statistics into a binary mmap'd\n"
+               "                             file (e.g. on /dev/shm) for external monitoring\n"
+               "     --since=INDEX           Index of the previously installed version; only\n"
+               "                             chunks it doesn't list are requested remotely\n"
+               "     --batch                 Treat the extract argument as a manifest listing\n"
+               "                             INDEX TARGET pairs to extract concurrently\n"
+               "     --memory-limit=BYTES    Overall budget for I/O buffer memory, remote\n"
+               "                             transfers are throttled when it runs low\n"
+               "     --verify=POLICY         Chunk verification policy for transfers (full,\n"
+               "                             sampled or crc)\n"
+               "     --threads=COUNT         Number of worker threads for chunking and\n"
+               "                             compression (0 for automatic)\n"
                "     --exclude-nodump=no     Don't exclude files with chattr(1)'s +d 'nodump'\n"
                "                             flag when creating archive\n"
                "     --exclude-submounts=yes Exclude submounts when creating archive\n"
+               "     --inline-chunks=yes     Embed tiny chunks in the index file when\n"
+               "                             creating it\n"
+               "     --file-aligned-chunks=yes\n"
+               "                             Force chunk boundaries at large file payloads\n"
+               "                             when creating archive\n"
+               "     --toc=yes               Embed a table of contents in the index file when\n"
+               "                             creating it, for instant listing\n"
                "     --reflink=no            Don't create reflinks from seeds when extracting\n"
                "     --hardlink=yes          Create hardlinks from seeds when extracting\n"
                "     --punch-holes=no        Don't create sparse files when extracting\n"
+               "     --direct-io=yes         Use O_DIRECT when extracting to a block device\n"
+               "     --sync=none|batch|full  How eagerly to sync extracted files to disk\n"
+               "                             (none: not at all, batch: once per file system\n"
+               "                             when complete, full: file by file)\n"
                "     --delete=no             Don't delete existing files not listed in archive\n"
                "                             after extraction\n"
                "     --undo-immutable=yes    When removing existing files, undo chattr(1)'s +i\n"
                "                             'immutable' flag when extracting\n"
                "     --seed-output=no        Don't implicitly add pre-existing output as seed\n"
                "                             when extracting\n"
+               "     --resume=yes            Journal progress when extracting a blob index and\n"
+               "                             continue an interrupted extraction where it left off\n"
                "     --recursive=no          List non-recursively\n"
 #if HAVE_FUSE
                "     --mkdir=no              Don't automatically create mount directory if it\n"
                "                             is missing\n"
+               "     --lazy=DIR              When mounting, also extract the tree to DIR in\n"
+               "                             the background while reads are being served\n"
 #endif
                "     --uid-shift=yes|SHIFT   Shift UIDs/GIDs\n"
                "     --uid-range=RANGE       Restrict UIDs/GIDs to range\n\n"
@@ -256,25 +354,48 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_STORE = 0x100,
                 ARG_EXTRA_STORE,
                 ARG_CHUNK_SIZE,
+                ARG_CHUNKER,
                 ARG_SEED,
                 ARG_RATE_LIMIT_BPS,
+                ARG_RATE_LIMIT_BURST,
+                ARG_STATS_FILE,
+                ARG_SINCE,
+                ARG_BATCH,
+                ARG_LAZY,
+                ARG_MEMORY_LIMIT,
+                ARG_VERIFY,
+                ARG_THREADS,
                 ARG_WITH,
                 ARG_WITHOUT,
                 ARG_WHAT,
                 ARG_EXCLUDE_NODUMP,
                 ARG_EXCLUDE_SUBMOUNTS,
+                ARG_INLINE_CHUNKS,
+                ARG_FILE_ALIGNED_CHUNKS,
+                ARG_TOC,
                 ARG_UNDO_IMMUTABLE,
                 ARG_PUNCH_HOLES,
+                ARG_DIRECT_IO,
                 ARG_REFLINK,
                 ARG_HARDLINK,
                 ARG_SEED_OUTPUT,
+                ARG_RESUME,
                 ARG_DELETE,
                 ARG_UID_SHIFT,
                 ARG_UID_RANGE,
                 ARG_RECURSIVE,
                 ARG_MKDIR,
+                ARG_SYNC,
                 ARG_DIGEST,
                 ARG_COMPRESSION,
+                ARG_COMPRESSION_LEVEL,
+                ARG_PACK,
+                ARG_CACHE,
+                ARG_LISTEN,
+                ARG_SAMPLE,
+                ARG_PROFILE,
+                ARG_ITERATIONS,
+                ARG_DROP_CACHES,
                 ARG_VERSION,
         };
 
@@ -285,25 +406,48 @@ static int parse_argv(int argc, char *argv[]) {
                 { "store",             required_argument, NULL, ARG_STORE             },
                 { "extra-store",       required_argument, NULL, ARG_EXTRA_STORE       },
                 { "chunk-size",        required_argument, NULL, ARG_CHUNK_SIZE        },
+                { "chunker",           required_argument, NULL, ARG_CHUNKER           },
                 { "seed",              required_argument, NULL, ARG_SEED              },
                 { "rate-limit-bps",    required_argument, NULL, ARG_RATE_LIMIT_BPS    },
+                { "rate-limit-burst",  required_argument, NULL, ARG_RATE_LIMIT_BURST  },
+                { "stats-file",        required_argument, NULL, ARG_STATS_FILE        },
+                { "since",             required_argument, NULL, ARG_SINCE             },
+                { "batch",             no_argument,       NULL, ARG_BATCH             },
+                { "lazy",              required_argument, NULL, ARG_LAZY              },
+                { "memory-limit",      required_argument, NULL, ARG_MEMORY_LIMIT      },
+                { "verify",            required_argument, NULL, ARG_VERIFY            },
+                { "threads",           required_argument, NULL, ARG_THREADS           },
                 { "with",              required_argument, NULL, ARG_WITH              },
                 { "without",           required_argument, NULL, ARG_WITHOUT           },
                 { "what",              required_argument, NULL, ARG_WHAT              },
                 { "exclude-nodump",    required_argument, NULL, ARG_EXCLUDE_NODUMP    },
                 { "exclude-submounts", required_argument, NULL, ARG_EXCLUDE_SUBMOUNTS },
+                { "inline-chunks",     required_argument, NULL, ARG_INLINE_CHUNKS     },
+                { "file-aligned-chunks", required_argument, NULL, ARG_FILE_ALIGNED_CHUNKS },
+                { "toc",               required_argument, NULL, ARG_TOC               },
                 { "undo-immutable",    required_argument, NULL, ARG_UNDO_IMMUTABLE    },
                 { "delete",            required_argument, NULL, ARG_DELETE            },
                 { "punch-holes",       required_argument, NULL, ARG_PUNCH_HOLES       },
+                { "direct-io",         required_argument, NULL, ARG_DIRECT_IO         },
                 { "reflink",           required_argument, NULL, ARG_REFLINK           },
                 { "hardlink",          required_argument, NULL, ARG_HARDLINK          },
                 { "seed-output",       required_argument, NULL, ARG_SEED_OUTPUT       },
+                { "resume",            required_argument, NULL, ARG_RESUME            },
                 { "uid-shift",         required_argument, NULL, ARG_UID_SHIFT         },
                 { "uid-range",         required_argument, NULL, ARG_UID_RANGE         },
                 { "recursive",         required_argument, NULL, ARG_RECURSIVE         },
                 { "mkdir",             required_argument, NULL, ARG_MKDIR             },
+                { "sync",              required_argument, NULL, ARG_SYNC              },
                 { "digest",            required_argument, NULL, ARG_DIGEST            },
                 { "compression",       required_argument, NULL, ARG_COMPRESSION       },
+                { "compression-level", required_argument, NULL, ARG_COMPRESSION_LEVEL },
+                { "pack",              required_argument, NULL, ARG_PACK              },
+                { "cache",             required_argument, NULL, ARG_CACHE             },
+                { "listen",            required_argument, NULL, ARG_LISTEN            },
+                { "sample",            required_argument, NULL, ARG_SAMPLE            },
+                { "profile",           no_argument,       NULL, ARG_PROFILE           },
+                { "iterations",        required_argument, NULL, ARG_ITERATIONS        },
+                { "drop-caches",       required_argument, NULL, ARG_DROP_CACHES       },
                 {}
         };
 
@@ -362,6 +506,15 @@ static int parse_argv(int argc, char *argv[]) {
 
                         break;
 
+                case ARG_CHUNKER:
+                        arg_chunker = ca_chunker_algorithm_from_string(optarg);
+                        if (arg_chunker < 0) {
+                                fprintf(stderr, "Unknown chunker algorithm: %s\n", optarg);
+                                return -EINVAL;
+                        }
+
+                        break;
+
                 case ARG_SEED:
                         r = strv_extend(&arg_seeds, optarg);
                         if (r < 0)
@@ -382,6 +535,94 @@ static int parse_argv(int argc, char *argv[]) {
 
                         break;
 
+                case ARG_RATE_LIMIT_BURST:
+                        r = parse_size(optarg, &arg_rate_limit_burst);
+                        if (r < 0) {
+                                fprintf(stderr, "Unable to parse rate limit burst %s: %s\n", optarg, strerror(-r));
+                                return r;
+                        }
+                        if (arg_rate_limit_burst == 0) {
+                                fprintf(stderr, "Rate limit burst cannot be zero.\n");
+                                return -EINVAL;
+                        }
+
+                        break;
+
+                case ARG_STATS_FILE: {
+                        char *p;
+
+                        p = strdup(optarg);
+                        if (!p)
+                                return log_oom();
+
+                        free(arg_stats_file);
+                        arg_stats_file = p;
+                        break;
+                }
+
+                case ARG_SINCE: {
+                        char *p;
+
+                        p = strdup(optarg);
+                        if (!p)
+                                return log_oom();
+
+                        free(arg_since);
+                        arg_since = p;
+                        break;
+                }
+
+                case ARG_BATCH:
+                        arg_batch = true;
+                        break;
+
+                case ARG_LAZY: {
+                        char *p;
+
+                        p = strdup(optarg);
+                        if (!p)
+                                return log_oom();
+
+                        free(arg_lazy);
+                        arg_lazy = p;
+                        break;
+                }
+
+                case ARG_MEMORY_LIMIT:
+                        r = parse_size(optarg, &arg_memory_limit);
+                        if (r < 0) {
+                                fprintf(stderr, "Unable to parse memory limit %s: %s\n", optarg, strerror(-r));
+                                return r;
+                        }
+                        if (arg_memory_limit == 0) {
+                                fprintf(stderr, "Memory limit cannot be zero.\n");
+                                return -EINVAL;
+                        }
+
+                        break;
+
+                case ARG_VERIFY:
+                        arg_verify = ca_remote_verify_from_string(optarg);
+                        if (arg_verify < 0) {
+                                fprintf(stderr, "Unknown verification policy: %s\n", optarg);
+                                return -EINVAL;
+                        }
+
+                        break;
+
+                case ARG_THREADS: {
+                        uint64_t u;
+
+                        r = safe_atou64(optarg, &u);
+                        if (r < 0) {
+                                fprintf(stderr, "Unable to parse thread count %s.\n", optarg);
+                                return -EINVAL;
+                        }
+
+                        arg_threads = (size_t) u;
+                        break;
+                }
+
                 case ARG_WITH: {
                         uint64_t u;
 
@@ -446,6 +687,36 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_exclude_submounts = r;
                         break;
 
+                case ARG_INLINE_CHUNKS:
+                        r = parse_boolean(optarg);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to parse --inline-chunks= parameter: %s\n", optarg);
+                                return r;
+                        }
+
+                        arg_inline_chunks = r;
+                        break;
+
+                case ARG_FILE_ALIGNED_CHUNKS:
+                        r = parse_boolean(optarg);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to parse --file-aligned-chunks= parameter: %s\n", optarg);
+                                return r;
+                        }
+
+                        arg_file_aligned_chunks = r;
+                        break;
+
+                case ARG_TOC:
+                        r = parse_boolean(optarg);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to parse --toc= parameter: %s\n", optarg);
+                                return r;
+                        }
+
+                        arg_toc = r;
+                        break;
+
                 case ARG_UNDO_IMMUTABLE:
                         r = parse_boolean(optarg);
                         if (r < 0) {
@@ -456,6 +727,20 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_undo_immutable = r;
                         break;
 
+                case ARG_SYNC:
+                        if (streq(optarg, "none"))
+                                arg_sync_mode = CA_SYNC_MODE_NONE;
+                        else if (streq(optarg, "batch"))
+                                arg_sync_mode = CA_SYNC_MODE_BATCH;
+                        else if (streq(optarg, "full"))
+                                arg_sync_mode = CA_SYNC_MODE_FULL;
+                        else {
+                                fprintf(stderr, "Failed to parse --sync= parameter: %s\n", optarg);
+                                return -EINVAL;
+                        }
+
+                        break;
+
                 case ARG_PUNCH_HOLES:
                         r = parse_boolean(optarg);
                         if (r < 0) {
@@ -466,6 +751,16 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_punch_holes = r;
                         break;
 
+                case ARG_DIRECT_IO:
+                        r = parse_boolean(optarg);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to parse --direct-io= parameter: %s\n", optarg);
+                                return r;
+                        }
+
+                        arg_direct_io = r;
+                        break;
+
                 case ARG_REFLINK:
                         r = parse_boolean(optarg);
                         if (r < 0) {
@@ -506,6 +801,16 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_seed_output = r;
                         break;
 
+                case ARG_RESUME:
+                        r = parse_boolean(optarg);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to parse --resume= parameter: %s\n", optarg);
+                                return r;
+                        }
+
+                        arg_resume = r;
+                        break;
+
                 case ARG_MKDIR:
                         r = parse_boolean(optarg);
                         if (r < 0) {
@@ -600,6 +905,99 @@ static int parse_argv(int argc, char *argv[]) {
                         break;
                 }
 
+                case ARG_COMPRESSION_LEVEL: {
+                        int l;
+
+                        if (streq(optarg, "auto"))
+                                l = CA_COMPRESSION_LEVEL_AUTO;
+                        else if (streq(optarg, "default"))
+                                l = CA_COMPRESSION_LEVEL_DEFAULT;
+                        else {
+                                r = safe_atoi(optarg, &l);
+                                if (r < 0 || l < 0) {
+                                        fprintf(stderr, "Failed to parse --compression-level= parameter: %s\n", optarg);
+                                        return -EINVAL;
+                                }
+                        }
+
+                        arg_compression_level = l;
+                        break;
+                }
+
+                case ARG_PACK:
+                        r = parse_boolean(optarg);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to parse --pack= parameter: %s\n", optarg);
+                                return r;
+                        }
+
+                        arg_pack = r;
+                        break;
+
+                case ARG_CACHE: {
+                        char *p;
+
+                        p = strdup(optarg);
+                        if (!p)
+                                return log_oom();
+
+                        free(arg_cache);
+                        arg_cache = p;
+                        break;
+                }
+
+                case ARG_LISTEN: {
+                        char *p;
+
+                        p = strdup(optarg);
+                        if (!p)
+                                return log_oom();
+
+                        free(arg_listen);
+                        arg_listen = p;
+                        break;
+                }
+
+                case ARG_SAMPLE: {
+                        unsigned u;
+
+                        r = safe_atou(optarg, &u);
+                        if (r < 0 || u > 100) {
+                                fprintf(stderr, "Failed to parse --sample= parameter: %s\n", optarg);
+                                return r < 0 ? r : -ERANGE;
+                        }
+
+                        arg_sample = u;
+                        break;
+                }
+
+                case ARG_PROFILE:
+                        arg_profile = true;
+                        break;
+
+                case ARG_ITERATIONS: {
+                        uint64_t u;
+
+                        r = safe_atou64(optarg, &u);
+                        if (r < 0 || u < 1 || u > UINT_MAX) {
+                                fprintf(stderr, "Failed to parse --iterations= parameter: %s\n", optarg);
+                                return r < 0 ? r : -ERANGE;
+                        }
+
+                        arg_iterations = (unsigned) u;
+                        break;
+                }
+
+                case ARG_DROP_CACHES:
+                        r = parse_boolean(optarg);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to parse --drop-caches= parameter: %s\n", optarg);
+                                return r;
+                        }
+
+                        arg_drop_caches = r;
+                        break;
+
                 case '?':
                         return -EINVAL;
 
@@ -684,6 +1082,14 @@ static int load_feature_flags(CaSync *s, uint64_t default_with_flags) {
                 flags |= CA_FORMAT_EXCLUDE_NODUMP;
         if (arg_exclude_submounts)
                 flags |= CA_FORMAT_EXCLUDE_SUBMOUNTS;
+        if (arg_inline_chunks)
+                flags |= CA_FORMAT_INLINE_CHUNKS;
+        if (arg_file_aligned_chunks)
+                flags |= CA_FORMAT_FILE_ALIGNED_CHUNKS;
+        if (arg_toc)
+                flags |= CA_FORMAT_TOC;
+        if (arg_chunker == CA_CHUNKER_FASTCDC)
+                flags |= CA_FORMAT_FASTCDC_CHUNKER;
 
         flags |= ca_feature_flags_from_digest_type(arg_digest);
 
@@ -725,9 +1131,28 @@ static int load_feature_flags(CaSync *s, uint64_t default_with_flags) {
                 return r;
         }
 
+        r = ca_sync_set_compression_level(s, arg_compression_level);
+        if (r < 0 && r != -ENOTTY) {
+                fprintf(stderr, "Failed to set compression level: %s\n", strerror(-r));
+                return r;
+        }
+
         return 0;
 }
 
+static int load_stats_file(CaSync *s) {
+        int r;
+
+        if (!arg_stats_file)
+                return 0;
+
+        r = ca_sync_set_stats_path(s, arg_stats_file);
+        if (r < 0)
+                fprintf(stderr, "Failed to set up statistics file %s: %s\n", arg_stats_file, strerror(-r));
+
+        return r;
+}
+
 static int load_chunk_size(CaSync *s) {
         uint64_t cavg, cmin, cmax;
         int r;
@@ -848,7 +1273,7 @@ static int verbose_print_path(CaSync *s, const char *verb) {
 }
 
 static int verbose_print_done_make(CaSync *s) {
-        uint64_t n_chunks = UINT64_MAX, size = UINT64_MAX, n_reused = UINT64_MAX, covering;
+        uint64_t n_chunks = UINT64_MAX, size = UINT64_MAX, n_reused = UINT64_MAX, n_cache_hits = UINT64_MAX, covering;
         char buffer[FORMAT_BYTES_MAX];
         int r;
 
@@ -899,6 +1324,12 @@ static int verbose_print_done_make(CaSync *s) {
                 return r;
         }
 
+        r = ca_sync_current_cache_hits(s, &n_cache_hits);
+        if (r < 0 && r != -ENODATA) {
+                fprintf(stderr, "Failed to determine number of cache hits: %s\n", strerror(-r));
+                return r;
+        }
+
         r = ca_sync_current_archive_offset(s, &size);
         if (r < 0 && r != -ENODATA) {
                 fprintf(stderr, "Failed to determine archive size: %s\n", strerror(-r));
@@ -916,6 +1347,13 @@ static int verbose_print_done_make(CaSync *s) {
                 else
                         fputc('\n', stderr);
         }
+        if (n_cache_hits != UINT64_MAX) {
+                fprintf(stderr, "Cache hits: %" PRIu64, n_cache_hits);
+                if (n_chunks != UINT64_MAX && n_chunks > 0)
+                        fprintf(stderr, " (%" PRIu64 "%%)\n", (n_cache_hits*100U/n_chunks));
+                else
+                        fputc('\n', stderr);
+        }
 
         if (size != UINT64_MAX && n_chunks != UINT64_MAX)
                 fprintf(stderr, "Effective average chunk size: %s\n", format_bytes(buffer, sizeof(buffer), size/n_chunks));
@@ -1024,6 +1462,35 @@ static int verbose_print_done_extract(CaSync *s) {
         return 1;
 }
 
+static int print_profile(CaSync *s) {
+        const CaProfile *p;
+        CaProfileStage stage;
+        int r;
+
+        if (!arg_profile)
+                return 0;
+
+        r = ca_sync_get_profile(s, &p);
+        if (r < 0) {
+                fprintf(stderr, "Failed to query profile counters: %s\n", strerror(-r));
+                return r;
+        }
+
+        /* One machine-readable line per stage, so that reports from automated runs can be diffed and
+         * trended easily */
+        for (stage = 0; stage < _CA_PROFILE_STAGE_MAX; stage++) {
+                const CaProfileCounter *c = p->counters + stage;
+
+                if (c->n_calls == 0)
+                        continue;
+
+                fprintf(stderr, "profile: stage=%s calls=%" PRIu64 " bytes=%" PRIu64 " nsec=%" PRIu64 "\n",
+                        ca_profile_stage_to_string(stage), c->n_calls, c->bytes, c->nsec);
+        }
+
+        return 0;
+}
+
 static int process_step_generic(CaSync *s, int step, bool quit_ok) {
         int r;
 
@@ -1228,6 +1695,24 @@ static int verb_make(int argc, char *argv[]) {
                 }
         }
 
+        if (arg_rate_limit_burst != 0) {
+                r = ca_sync_set_rate_limit_burst(s, arg_rate_limit_burst);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set rate limit burst: %s\n", strerror(-r));
+                        return r;
+                }
+        }
+
+        r = load_stats_file(s);
+        if (r < 0)
+                goto finish;
+
+        r = ca_sync_set_threads(s, arg_threads);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set thread count: %s\n", strerror(-r));
+                goto finish;
+        }
+
         r = ca_sync_set_base_fd(s, input_fd);
         if (r < 0) {
                 fprintf(stderr, "Failed to set sync base: %s\n", strerror(-r));
@@ -1271,6 +1756,26 @@ static int verb_make(int argc, char *argv[]) {
                 }
         }
 
+        r = ca_sync_set_pack_mode(s, arg_pack);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set pack mode: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        if (arg_cache) {
+                r = ca_sync_set_cache_path(s, arg_cache);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set cache: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        r = ca_sync_set_profile(s, arg_profile);
+        if (r < 0) {
+                fprintf(stderr, "Failed to enable profiling: %s\n", strerror(-r));
+                goto finish;
+        }
+
         r = load_feature_flags(s, operation == MAKE_BLOB_INDEX ? 0 : CA_FORMAT_WITH_MASK);
         if (r < 0)
                 goto finish;
@@ -1303,6 +1808,7 @@ static int verb_make(int argc, char *argv[]) {
                         char t[CA_CHUNK_ID_FORMAT_MAX];
 
                         verbose_print_done_make(s);
+                        print_profile(s);
 
                         assert_se(ca_sync_get_archive_digest(s, &digest) >= 0);
                         printf("%s\n", ca_chunk_id_format(&digest, t));
@@ -1374,38 +1880,435 @@ static const char *normalize_seek_path(const char *p) {
         return p;
 }
 
-static int verb_extract(int argc, char *argv[]) {
+/* How often to journal extraction progress when --resume= is enabled */
+#define RESUME_JOURNAL_INTERVAL_NSEC (30U * NSEC_PER_SEC)
 
-        typedef enum ExtractOperation {
-                EXTRACT_ARCHIVE,
-                EXTRACT_ARCHIVE_INDEX,
-                EXTRACT_BLOB_INDEX,
-                _EXTRACT_OPERATION_INVALID = -1,
-        } ExtractOperation;
+static int resume_journal_load(const char *path, const char *input, uint64_t *ret_offset) {
+        char buffer[4096], *e, *f;
+        uint64_t offset;
+        ssize_t n;
+        int fd, r;
 
-        ExtractOperation operation = _EXTRACT_OPERATION_INVALID;
-        int r, output_fd = -1, input_fd = -1;
-        char *input = NULL, *output = NULL;
-        const char *seek_path = NULL;
-        CaSync *s = NULL;
+        assert(path);
+        assert(input);
+        assert(ret_offset);
 
-        if (argc > 4) {
-                fprintf(stderr, "Input path/URL, output path, and subtree path expected.\n");
-                return -EINVAL;
-        }
+        fd = open(path, O_CLOEXEC|O_RDONLY|O_NOCTTY);
+        if (fd < 0)
+                return -errno;
 
-        if (argc > 1) {
-                input = ca_strip_file_url(argv[1]);
-                if (!input) {
-                        r = log_oom();
-                        goto finish;
-                }
-        }
+        n = read(fd, buffer, sizeof(buffer) - 1);
+        r = n < 0 ? -errno : 0;
+        (void) close(fd);
+        if (r < 0)
+                return r;
 
-        if (argc > 2) {
-                output = ca_strip_file_url(argv[2]);
-                if (!output) {
-                        r = log_oom();
+        buffer[n] = 0;
+
+        /* Line 1: format marker, line 2: byte offset, line 3: the input locator the journal belongs to */
+        e = startswith(buffer, "CASYNC-RESUME-1\n");
+        if (!e)
+                return -EBADMSG;
+
+        f = strchr(e, '\n');
+        if (!f)
+                return -EBADMSG;
+        *f = 0;
+
+        r = safe_atou64(e, &offset);
+        if (r < 0)
+                return r;
+
+        e = f + 1;
+        f = strchr(e, '\n');
+        if (!f)
+                return -EBADMSG;
+        *f = 0;
+
+        if (!streq(e, input)) /* Journal belongs to a different input, start over */
+                return -ESTALE;
+
+        *ret_offset = offset;
+        return 0;
+}
+
+static int resume_journal_save(const char *path, const char *output, const char *input, uint64_t offset) {
+        char *t = NULL, *buffer = NULL;
+        int fd = -1, r;
+
+        assert(path);
+        assert(input);
+
+        /* Make sure everything the journal is about to claim complete actually reached the disk */
+        if (output) {
+                fd = open(output, O_CLOEXEC|O_WRONLY|O_NOCTTY);
+                if (fd >= 0) {
+                        (void) fdatasync(fd);
+                        fd = safe_close(fd);
+                }
+        }
+
+        if (asprintf(&t, "%s.tmp", path) < 0)
+                return -ENOMEM;
+
+        fd = open(t, O_CLOEXEC|O_WRONLY|O_CREAT|O_TRUNC|O_NOCTTY, 0666);
+        if (fd < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        if (asprintf(&buffer, "CASYNC-RESUME-1\n%" PRIu64 "\n%s\n", offset, input) < 0) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        r = loop_write(fd, buffer, strlen(buffer));
+        if (r < 0)
+                goto finish;
+
+        (void) fdatasync(fd);
+
+        if (rename(t, path) < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        t = mfree(t);
+        r = 0;
+
+finish:
+        safe_close(fd);
+
+        if (t) {
+                (void) unlink(t);
+                free(t);
+        }
+
+        free(buffer);
+        return r;
+}
+
+typedef struct BatchJob {
+        char *index;
+        char *target;
+        CaSync *sync;
+        bool finished;
+} BatchJob;
+
+static int verb_extract_batch(int argc, char *argv[]) {
+        BatchJob *jobs = NULL;
+        size_t n_jobs = 0, allocated = 0, n_finished = 0, i;
+        char line[4096];
+        FILE *f = NULL;
+        int r;
+
+        /* Extracts many images within one process under a common scheduler: one round-robin step per
+         * image keeps progress fair, the operations pool their in-memory chunk cache (images provisioned
+         * together overlap heavily) and divide the request window among themselves instead of multiplying
+         * it by the number of images. */
+
+        if (argc != 2) {
+                fprintf(stderr, "A manifest file listing INDEX TARGET pairs expected.\n");
+                return -EINVAL;
+        }
+
+        f = fopen(argv[1], "re");
+        if (!f) {
+                r = -errno;
+                fprintf(stderr, "Failed to open manifest %s: %s\n", argv[1], strerror(-r));
+                goto finish;
+        }
+
+        while (fgets(line, sizeof(line), f)) {
+                char *p, *q, *e;
+
+                truncate_nl(line);
+
+                p = line + strspn(line, WHITESPACE);
+                if (isempty(p) || *p == '#')
+                        continue;
+
+                e = p + strcspn(p, WHITESPACE);
+                if (*e == 0) {
+                        fprintf(stderr, "Manifest line lacks a target, expected INDEX TARGET: %s\n", p);
+                        r = -EINVAL;
+                        goto finish;
+                }
+                *(e++) = 0;
+
+                q = e + strspn(e, WHITESPACE);
+                e = q + strcspn(q, WHITESPACE);
+                *e = 0;
+
+                if (!GREEDY_REALLOC(jobs, allocated, n_jobs + 1)) {
+                        r = log_oom();
+                        goto finish;
+                }
+
+                jobs[n_jobs] = (BatchJob) {
+                        .index = ca_strip_file_url(p),
+                        .target = strdup(q),
+                };
+
+                if (!jobs[n_jobs].index || !jobs[n_jobs].target) {
+                        free(jobs[n_jobs].index);
+                        free(jobs[n_jobs].target);
+                        r = log_oom();
+                        goto finish;
+                }
+
+                n_jobs++;
+        }
+        if (ferror(f)) {
+                r = -EIO;
+                fprintf(stderr, "Failed to read manifest %s.\n", argv[1]);
+                goto finish;
+        }
+
+        fclose(f);
+        f = NULL;
+
+        if (n_jobs == 0) {
+                fprintf(stderr, "Manifest %s lists nothing to extract.\n", argv[1]);
+                r = -EINVAL;
+                goto finish;
+        }
+
+        for (i = 0; i < n_jobs; i++) {
+                BatchJob *j = jobs + i;
+                bool blob;
+
+                if (ca_locator_has_suffix(j->index, ".caidx"))
+                        blob = false;
+                else if (ca_locator_has_suffix(j->index, ".caibx"))
+                        blob = true;
+                else {
+                        fprintf(stderr, "%s: only .caidx or .caibx indexes may be extracted in batch mode.\n", j->index);
+                        r = -EINVAL;
+                        goto finish;
+                }
+
+                j->sync = ca_sync_new_decode();
+                if (!j->sync) {
+                        r = log_oom();
+                        goto finish;
+                }
+
+                r = set_default_store(j->index);
+                if (r < 0)
+                        goto finish;
+
+                r = ca_sync_set_base_mode(j->sync, blob ? S_IFREG : S_IFDIR);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set base mode: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_sync_set_base_path(j->sync, j->target);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set sync base %s: %s\n", j->target, strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_sync_set_index_auto(j->sync, j->index);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set sync index %s: %s\n", j->index, strerror(-r));
+                        goto finish;
+                }
+
+                if (arg_store) {
+                        r = ca_sync_set_store_auto(j->sync, arg_store);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to set store: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                }
+
+                r = load_seeds_and_extra_stores(j->sync);
+                if (r < 0)
+                        goto finish;
+
+                r = load_feature_flags(j->sync, CA_FORMAT_WITH_MASK);
+                if (r < 0)
+                        goto finish;
+
+                r = ca_sync_set_punch_holes(j->sync, arg_punch_holes);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to configure hole punching: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_sync_set_sync_mode(j->sync, arg_sync_mode);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to configure disk syncing: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_sync_set_reflink(j->sync, arg_reflink);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to configure reflinking: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_sync_set_hardlink(j->sync, arg_hardlink);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to configure hardlinking: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                if (arg_rate_limit_bps != UINT64_MAX) {
+                        r = ca_sync_set_rate_limit_bps(j->sync, arg_rate_limit_bps);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to set rate limit: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                }
+
+                if (i > 0) {
+                        r = ca_sync_share_chunk_cache(j->sync, jobs[0].sync);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to pool chunk cache: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                }
+        }
+
+        (void) send_notify("READY=1");
+
+        while (n_finished < n_jobs) {
+                bool progress_made = false;
+                CaSync *pollable = NULL;
+
+                if (quit) {
+                        fprintf(stderr, "Got exit signal, quitting.\n");
+                        r = -ESHUTDOWN;
+                        goto finish;
+                }
+
+                /* One step per image per round, so that all of them advance at the same pace and none
+                 * starves the others */
+                for (i = 0; i < n_jobs; i++) {
+                        BatchJob *j = jobs + i;
+
+                        if (j->finished)
+                                continue;
+
+                        r = ca_sync_step(j->sync);
+                        if (r == -ENOMEDIUM) {
+                                fprintf(stderr, "%s: File, URL or resource not found.\n", j->index);
+                                goto finish;
+                        }
+                        if (r < 0) {
+                                fprintf(stderr, "%s: Failed to run synchronizer: %s\n", j->index, strerror(-r));
+                                goto finish;
+                        }
+
+                        switch (r) {
+
+                        case CA_SYNC_FINISHED:
+                                j->finished = true;
+                                n_finished++;
+                                progress_made = true;
+
+                                if (arg_verbose)
+                                        fprintf(stderr, "Extracted %s to %s.\n", j->index, j->target);
+                                break;
+
+                        case CA_SYNC_POLL:
+                                if (!pollable)
+                                        pollable = j->sync;
+                                break;
+
+                        case CA_SYNC_NEXT_FILE:
+                                r = verbose_print_path(j->sync, "Extracting");
+                                if (r < 0)
+                                        goto finish;
+
+                                progress_made = true;
+                                break;
+
+                        case CA_SYNC_DONE_FILE:
+                                r = verbose_print_path(j->sync, "Extracted");
+                                if (r < 0)
+                                        goto finish;
+
+                                progress_made = true;
+                                break;
+
+                        default:
+                                progress_made = true;
+                                break;
+                        }
+                }
+
+                /* All remaining images wait on remote feedback? Then sleep on one of the blocked
+                 * operations; anything arriving wakes us for another round. */
+                if (!progress_made && pollable) {
+                        r = sync_poll_sigset(pollable);
+                        if (r == -ESHUTDOWN) {
+                                fprintf(stderr, "Got exit signal, quitting.\n");
+                                goto finish;
+                        }
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to poll synchronizer: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                }
+        }
+
+        r = 0;
+
+finish:
+        for (i = 0; i < n_jobs; i++) {
+                ca_sync_unref(jobs[i].sync);
+                free(jobs[i].index);
+                free(jobs[i].target);
+        }
+        free(jobs);
+
+        if (f)
+                fclose(f);
+
+        return r;
+}
+
+static int verb_extract(int argc, char *argv[]) {
+
+        typedef enum ExtractOperation {
+                EXTRACT_ARCHIVE,
+                EXTRACT_ARCHIVE_INDEX,
+                EXTRACT_BLOB_INDEX,
+                _EXTRACT_OPERATION_INVALID = -1,
+        } ExtractOperation;
+
+        ExtractOperation operation = _EXTRACT_OPERATION_INVALID;
+        uint64_t resume_offset = UINT64_MAX, resume_saved_nsec = 0;
+        int r, output_fd = -1, input_fd = -1;
+        char *input = NULL, *output = NULL;
+        char *resume_journal = NULL;
+        const char *seek_path = NULL;
+        CaSync *s = NULL;
+
+        if (arg_batch)
+                return verb_extract_batch(argc, argv);
+
+        if (argc > 4) {
+                fprintf(stderr, "Input path/URL, output path, and subtree path expected.\n");
+                return -EINVAL;
+        }
+
+        if (argc > 1) {
+                input = ca_strip_file_url(argv[1]);
+                if (!input) {
+                        r = log_oom();
+                        goto finish;
+                }
+        }
+
+        if (argc > 2) {
+                output = ca_strip_file_url(argv[2]);
+                if (!output) {
+                        r = log_oom();
                         goto finish;
                 }
         }
@@ -1530,6 +2433,31 @@ static int verb_extract(int argc, char *argv[]) {
 
         seek_path = normalize_seek_path(seek_path);
 
+        if (arg_resume) {
+                if (operation != EXTRACT_BLOB_INDEX || !output || input_fd >= 0) {
+                        fprintf(stderr, "Resume is only supported when extracting a blob index from a locator into a file or block device.\n");
+                        r = -EOPNOTSUPP;
+                        goto finish;
+                }
+
+                resume_journal = strjoin(output, ".caresume");
+                if (!resume_journal) {
+                        r = log_oom();
+                        goto finish;
+                }
+
+                r = resume_journal_load(resume_journal, input, &resume_offset);
+                if (r == -ENOENT)
+                        resume_offset = UINT64_MAX;
+                else if (IN_SET(r, -EBADMSG, -ESTALE)) {
+                        fprintf(stderr, "Resume journal doesn't match this operation, starting from scratch.\n");
+                        resume_offset = UINT64_MAX;
+                } else if (r < 0) {
+                        fprintf(stderr, "Failed to read resume journal: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
         s = ca_sync_new_decode();
         if (!s) {
                 r = log_oom();
@@ -1541,7 +2469,9 @@ static int verb_extract(int argc, char *argv[]) {
                 if (r < 0)
                         goto finish;
 
-                if (arg_seed_output) {
+                /* When resuming, the data below the journaled offset is not re-requested anyway, hence
+                 * don't spend a full scan on seeding the partial output */
+                if (arg_seed_output && resume_offset == UINT64_MAX) {
                         r = ca_sync_add_seed_path(s, output);
                         if (r < 0 && r != -ENOENT)
                                 fprintf(stderr, "Failed to add existing file as seed %s, ignoring: %s\n", output, strerror(-r));
@@ -1556,10 +2486,30 @@ static int verb_extract(int argc, char *argv[]) {
                 }
         }
 
-        if (seek_path) {
-                if (output_fd >= 0)
-                        r = ca_sync_set_boundary_fd(s, output_fd);
-                else
+        if (arg_rate_limit_burst != 0) {
+                r = ca_sync_set_rate_limit_burst(s, arg_rate_limit_burst);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set rate limit burst: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        r = load_stats_file(s);
+        if (r < 0)
+                goto finish;
+
+        if (arg_since) {
+                r = ca_sync_set_since_index_path(s, arg_since);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set old index %s: %s\n", arg_since, strerror(-r));
+                        goto finish;
+                }
+        }
+
+        if (seek_path) {
+                if (output_fd >= 0)
+                        r = ca_sync_set_boundary_fd(s, output_fd);
+                else
                         r = ca_sync_set_boundary_path(s, output);
         } else {
                 if (output_fd >= 0)
@@ -1625,6 +2575,24 @@ static int verb_extract(int argc, char *argv[]) {
                 goto finish;
         }
 
+        r = ca_sync_set_direct_io(s, arg_direct_io);
+        if (r < 0) {
+                fprintf(stderr, "Failed to configure direct I/O: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        r = ca_sync_set_profile(s, arg_profile);
+        if (r < 0) {
+                fprintf(stderr, "Failed to enable profiling: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        r = ca_sync_set_sync_mode(s, arg_sync_mode);
+        if (r < 0) {
+                fprintf(stderr, "Failed to configure disk syncing: %s\n", strerror(-r));
+                goto finish;
+        }
+
         r = ca_sync_set_reflink(s, arg_reflink);
         if (r < 0) {
                 fprintf(stderr, "Failed to configure reflinking: %s\n", strerror(-r));
@@ -1645,10 +2613,30 @@ static int verb_extract(int argc, char *argv[]) {
                 }
         }
 
+        if (resume_offset != UINT64_MAX && resume_offset > 0) {
+                r = ca_sync_seek_offset(s, resume_offset);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to seek to resume offset %" PRIu64 ": %s\n", resume_offset, strerror(-r));
+                        goto finish;
+                }
+
+                if (arg_verbose)
+                        fprintf(stderr, "Resuming extraction at %" PRIu64 " bytes.\n", resume_offset);
+        }
+
+        resume_saved_nsec = now(CLOCK_MONOTONIC);
+
         (void) send_notify("READY=1");
 
         for (;;) {
                 if (quit) {
+                        uint64_t offset;
+
+                        /* Journal where we got to, so that the next invocation picks up right here */
+                        if (resume_journal &&
+                            ca_sync_current_archive_offset(s, &offset) >= 0)
+                                (void) resume_journal_save(resume_journal, output, input, offset);
+
                         fprintf(stderr, "Got exit signal, quitting.\n");
                         r = -ESHUTDOWN;
                         goto finish;
@@ -1667,7 +2655,11 @@ static int verb_extract(int argc, char *argv[]) {
                 switch (r) {
 
                 case CA_SYNC_FINISHED:
+                        if (resume_journal)
+                                (void) unlink(resume_journal);
+
                         verbose_print_done_extract(s);
+                        print_profile(s);
                         r = 0;
                         goto finish;
 
@@ -1703,6 +2695,19 @@ static int verb_extract(int argc, char *argv[]) {
 
                 verbose_print_feature_flags(s);
 
+                if (resume_journal) {
+                        uint64_t n;
+
+                        n = now(CLOCK_MONOTONIC);
+                        if (n >= resume_saved_nsec + RESUME_JOURNAL_INTERVAL_NSEC) {
+                                uint64_t offset;
+
+                                if (ca_sync_current_archive_offset(s, &offset) >= 0 &&
+                                    resume_journal_save(resume_journal, output, input, offset) >= 0)
+                                        resume_saved_nsec = n;
+                        }
+                }
+
                 if (arg_verbose)
                         progress();
         }
@@ -1717,10 +2722,57 @@ finish:
 
         free(input);
         free(output);
+        free(resume_journal);
 
         return r;
 }
 
+static bool mtree_char_needs_escape(char c) {
+        return (uint8_t) c <= (uint8_t) ' ' ||
+               (uint8_t) c >= 127U ||
+               IN_SET(c, '\\', '#');
+}
+
+#define MTREE_SWAR_ONES  UINT64_C(0x0101010101010101)
+#define MTREE_SWAR_HIGHS UINT64_C(0x8080808080808080)
+
+static bool mtree_word_has_less(uint64_t w, uint8_t b) {
+        return ((w - MTREE_SWAR_ONES * b) & ~w & MTREE_SWAR_HIGHS) != 0;
+}
+
+static bool mtree_word_has_byte(uint64_t w, uint8_t b) {
+        return mtree_word_has_less(w ^ (MTREE_SWAR_ONES * b), 1);
+}
+
+static size_t mtree_clean_run_size(const char *p, size_t l) {
+        size_t n = 0;
+
+        /* Returns the length of the leading run of bytes that need no escaping. Almost all path, user and
+         * group name bytes are plain printable ASCII, hence scan word-wise: a byte needs escaping iff it is
+         * < 0x21, >= 0x7F, or one of '\\' and '#', each of which is detectable across all eight bytes of a
+         * word at once with the usual SWAR comparisons. */
+
+        while (n + sizeof(uint64_t) <= l) {
+                uint64_t w;
+
+                memcpy(&w, p + n, sizeof(w));
+
+                if (mtree_word_has_less(w, 0x21) ||
+                    (w & MTREE_SWAR_HIGHS) != 0 ||
+                    mtree_word_has_byte(w, 0x7F) ||
+                    mtree_word_has_byte(w, '\\') ||
+                    mtree_word_has_byte(w, '#'))
+                        break;
+
+                n += sizeof(uint64_t);
+        }
+
+        while (n < l && !mtree_char_needs_escape(p[n]))
+                n++;
+
+        return n;
+}
+
 static int mtree_escape_full(const char *p, size_t l, char **ret) {
         const char *a;
         char *n, *b;
@@ -1736,17 +2788,21 @@ static int mtree_escape_full(const char *p, size_t l, char **ret) {
                 return -ENOMEM;
 
         for (a = p, b = n; a < p + l; a++) {
+                size_t run;
 
-                if ((uint8_t) *a <= (uint8_t) ' ' ||
-                    (uint8_t) *a >= 127U ||
-                    IN_SET(*a, '\\', '#')) {
+                /* Copy the longest possible stretch verbatim, only dropping to the byte-wise escape code
+                 * for the characters that actually need it */
+                run = mtree_clean_run_size(a, l - (size_t) (a - p));
+                memcpy(b, a, run);
+                a += run, b += run;
 
-                        *(b++) = '\\';
-                        *(b++) = octchar((uint8_t) *a / 64U);
-                        *(b++) = octchar(((uint8_t) *a / 8U) % 8U);
-                        *(b++) = octchar((uint8_t) *a % 8U);
-                } else
-                        *(b++) = *a;
+                if (a >= p + l)
+                        break;
+
+                *(b++) = '\\';
+                *(b++) = octchar((uint8_t) *a / 64U);
+                *(b++) = octchar(((uint8_t) *a / 8U) % 8U);
+                *(b++) = octchar((uint8_t) *a % 8U);
         }
 
         *b = 0;
@@ -1759,6 +2815,108 @@ static int mtree_escape(const char *p, char **ret) {
         return mtree_escape_full(p, (size_t) -1, ret);
 }
 
+static int list_from_toc(int input_fd, const char *seek_path) {
+        CaIndex *index = NULL;
+        bool found = false;
+        int r, copy_fd = -1;
+        size_t n;
+
+        /* If the index file carries a table of contents (see CA_FORMAT_TOC), a plain listing can be
+         * answered straight from the index, without fetching or decoding a single chunk of the archive.
+         * Returns > 0 if the listing was produced this way, 0 if there's no TOC and the caller shall
+         * decode the archive as usual. */
+
+        assert(input_fd >= 0);
+
+        copy_fd = fcntl(input_fd, F_DUPFD_CLOEXEC, 3);
+        if (copy_fd < 0)
+                return 0;
+
+        index = ca_index_new_read();
+        if (!index) {
+                r = log_oom();
+                goto finish;
+        }
+
+        r = ca_index_set_fd(index, copy_fd);
+        if (r < 0) {
+                r = 0;
+                goto finish;
+        }
+        copy_fd = -1;
+
+        r = ca_index_open(index);
+        if (r < 0) { /* Not a valid index? Let the slow path generate the error */
+                r = 0;
+                goto finish;
+        }
+
+        r = ca_index_get_toc_entry_by_index(index, 0, NULL, NULL, NULL);
+        if (r == -ENODATA || r == -EBADMSG) { /* No (valid) TOC in this index, fall back to decoding */
+                r = 0;
+                goto finish;
+        }
+        if (r < 0) {
+                fprintf(stderr, "Failed to read table of contents: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        /* The listing is emitted as many short writes per entry; batch them up, so that a large archive
+         * produces a few big write()s instead of one per line */
+        (void) setvbuf(stdout, NULL, _IOFBF, 256U*1024U);
+
+        (void) send_notify("READY=1");
+
+        for (n = 0;; n++) {
+                char ls_mode[LS_FORMAT_MODE_MAX];
+                const char *path;
+                mode_t mode;
+
+                r = ca_index_get_toc_entry_by_index(index, n, &path, NULL, &mode);
+                if (r == -ERANGE)
+                        break;
+                if (r < 0) {
+                        fprintf(stderr, "Failed to read table of contents: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                /* The TOC is stored in the archive's depth-first order, hence this prints exactly what
+                 * decoding the archive would, only without the chunk fetches */
+
+                if (seek_path) {
+                        size_t l = strlen(seek_path);
+
+                        if (strncmp(path, seek_path, l) != 0)
+                                continue;
+                        if (path[l] != 0 && path[l] != '/')
+                                continue;
+                        if (!arg_recursive && path[l] == '/' && strchr(path + l + 1, '/'))
+                                continue;
+                } else if (!arg_recursive && strchr(path, '/'))
+                        continue;
+
+                printf("%s %s\n", ls_format_mode(mode, ls_mode), path);
+                found = true;
+        }
+
+        if (seek_path && !found) {
+                r = -ENOENT;
+                fprintf(stderr, "Failed to seek to %s: %s\n", seek_path, strerror(-r));
+                goto finish;
+        }
+
+        r = 1;
+
+finish:
+        safe_close(copy_fd);
+        ca_index_unref(index);
+
+        /* The index fd shares its file offset with the fd the caller holds on to, rewind it for them */
+        (void) lseek(input_fd, 0, SEEK_SET);
+
+        return r;
+}
+
 static int verb_list(int argc, char *argv[]) {
 
         typedef enum ListOperation {
@@ -1897,6 +3055,18 @@ static int verb_list(int argc, char *argv[]) {
 
         seek_path = normalize_seek_path(seek_path);
 
+        /* A plain listing of an index that carries a table of contents needs no archive chunks at all */
+        if (operation == LIST_ARCHIVE_INDEX &&
+            streq(argv[0], "list") &&
+            input_fd >= 0 && input_fd != STDIN_FILENO) {
+                r = list_from_toc(input_fd, seek_path);
+                if (r != 0) {
+                        if (r > 0)
+                                r = 0;
+                        goto finish;
+                }
+        }
+
         if (operation == LIST_ARCHIVE_INDEX) {
                 r = set_default_store(input);
                 if (r < 0)
@@ -1992,6 +3162,10 @@ static int verb_list(int argc, char *argv[]) {
                 }
         }
 
+        /* The listing is emitted as many short writes per entry; batch them up, so that a large archive
+         * produces a few big write()s instead of one per line */
+        (void) setvbuf(stdout, NULL, _IOFBF, 256U*1024U);
+
         (void) send_notify("READY=1");
 
         for (;;) {
@@ -2391,6 +3565,8 @@ static int verb_list(int argc, char *argv[]) {
         }
 
 finish:
+        fflush(stdout);
+
         ca_sync_unref(s);
 
         if (input_fd >= 3)
@@ -2400,237 +3576,143 @@ finish:
         return r;
 }
 
-static int verb_digest(int argc, char *argv[]) {
+static void diff_add_keyword(char *buf, size_t size, const char *keyword) {
+        size_t l;
 
-        typedef enum DigestOperation {
-                DIGEST_ARCHIVE,
-                DIGEST_ARCHIVE_INDEX,
-                DIGEST_BLOB,
-                DIGEST_BLOB_INDEX,
-                DIGEST_DIRECTORY,
-                _DIGEST_OPERATION_INVALID = -1,
-        } DigestOperation;
+        l = strlen(buf);
+        (void) snprintf(buf + l, size - l, "%s%s", l > 0 ? "," : "", keyword);
+}
 
-        DigestOperation operation = _DIGEST_OPERATION_INVALID;
-        bool set_base_mode = false;
-        const char *seek_path = NULL;
-        int r, input_fd = -1;
-        char *input = NULL;
+static int verb_diff(int argc, char *argv[]) {
+
+        typedef enum DiffOperation {
+                DIFF_ARCHIVE,
+                DIFF_ARCHIVE_INDEX,
+                _DIFF_OPERATION_INVALID = -1,
+        } DiffOperation;
+
+        DiffOperation operation = _DIFF_OPERATION_INVALID;
+        int r, input_fd = -1, dir_fd = -1, suspect_fd = -1;
+        char *input = NULL, *suspect_path = NULL;
+        char suspect_keywords[256] = "";
+        bool suspect_dirty = false, suspect_time_differs = false;
+        uint8_t *compare_buffer = NULL;
+        uint64_t n_differ = 0;
         CaSync *s = NULL;
-        bool show_payload_digest = false;
-        int seeking = false;
 
-        if (argc > 3) {
-                fprintf(stderr, "Input path/URL and subtree path expected.\n");
-                return -EINVAL;
-        }
+        /* Walks the metadata stream of an archive or archive index against a local directory tree, using
+         * stat() data only. Payload is decoded solely for regular files whose size matches but whose mtime
+         * doesn't, in order to determine whether the contents actually changed. On mostly-unchanged trees
+         * this is hence dramatically cheaper than a full "extract"-style verification. */
 
-        if (argc > 1) {
-                input = ca_strip_file_url(argv[1]);
-                if (!input) {
-                        r = log_oom();
-                        goto finish;
-                }
+        if (argc != 3) {
+                fprintf(stderr, "Input path/URL and directory expected.\n");
+                return -EINVAL;
         }
 
-        if (argc > 2)
-                seek_path = argv[2];
+        input = ca_strip_file_url(argv[1]);
+        if (!input)
+                return log_oom();
 
         if (arg_what == WHAT_ARCHIVE)
-                operation = DIGEST_ARCHIVE;
+                operation = DIFF_ARCHIVE;
         else if (arg_what == WHAT_ARCHIVE_INDEX)
-                operation = DIGEST_ARCHIVE_INDEX;
-        else if (arg_what == WHAT_BLOB)
-                operation = DIGEST_BLOB;
-        else if (arg_what == WHAT_BLOB_INDEX)
-                operation = DIGEST_BLOB_INDEX;
-        else if (arg_what == WHAT_DIRECTORY)
-                operation = DIGEST_DIRECTORY;
+                operation = DIFF_ARCHIVE_INDEX;
         else if (arg_what != _WHAT_INVALID) {
-                fprintf(stderr, "\"make\" operation may only be combined with --what=archive, --what=blob, --what=archive-index, --what=blob-index or --what=directory.\n");
+                fprintf(stderr, "\"diff\" operation may only be combined with --what=archive or --what=archive-index.\n");
                 r = -EINVAL;
                 goto finish;
         }
 
-        if (operation == _DIGEST_OPERATION_INVALID && input && !streq(input, "-")) {
-
+        if (operation == _DIFF_OPERATION_INVALID) {
                 if (ca_locator_has_suffix(input, ".catar"))
-                        operation = DIGEST_ARCHIVE;
+                        operation = DIFF_ARCHIVE;
                 else if (ca_locator_has_suffix(input, ".caidx"))
-                        operation = DIGEST_ARCHIVE_INDEX;
-                else if (ca_locator_has_suffix(input, ".caibx"))
-                        operation = DIGEST_BLOB_INDEX;
-        }
-
-        if (!input && IN_SET(operation, DIGEST_DIRECTORY, _DIGEST_OPERATION_INVALID)) {
-                input = strdup(".");
-                if (!input) {
-                        r = log_oom();
+                        operation = DIFF_ARCHIVE_INDEX;
+                else {
+                        fprintf(stderr, "Failed to determine what to diff against. Use --what=archive or --what=archive-index.\n");
+                        r = -EINVAL;
                         goto finish;
                 }
         }
 
-        if (!input || streq(input, "-"))
-                input_fd = STDIN_FILENO;
-        else {
-                CaLocatorClass input_class;
+        dir_fd = open(argv[2], O_RDONLY|O_CLOEXEC|O_DIRECTORY|O_NOCTTY);
+        if (dir_fd < 0) {
+                r = -errno;
+                fprintf(stderr, "Failed to open %s: %s\n", argv[2], strerror(-r));
+                goto finish;
+        }
 
-                input_class = ca_classify_locator(input);
-                if (input_class < 0) {
-                        fprintf(stderr, "Failed to determine class of locator: %s\n", input);
-                        r = -EINVAL;
+        if (ca_classify_locator(input) == CA_LOCATOR_PATH) {
+                input_fd = open(input, O_CLOEXEC|O_RDONLY|O_NOCTTY);
+                if (input_fd < 0) {
+                        r = -errno;
+                        fprintf(stderr, "Failed to open %s: %s\n", input, strerror(-r));
                         goto finish;
                 }
+        }
 
-                if (operation == DIGEST_DIRECTORY && input_class != CA_LOCATOR_PATH) {
-                        fprintf(stderr, "Input must be local path: %s\n", input);
-                        r = -EINVAL;
+        if (operation == DIFF_ARCHIVE_INDEX) {
+                r = set_default_store(input);
+                if (r < 0)
                         goto finish;
-                }
+        }
 
-                if (input_class == CA_LOCATOR_PATH) {
-                        input_fd = open(input, O_CLOEXEC|O_RDONLY|O_NOCTTY);
-                        if (input_fd < 0) {
-                                r = -errno;
-                                fprintf(stderr, "Failed to open %s: %s\n", input, strerror(-r));
-                                goto finish;
-                        }
-                }
+        s = ca_sync_new_decode();
+        if (!s) {
+                r = log_oom();
+                goto finish;
         }
 
-        if (input_fd >= 0) {
-                struct stat st;
+        r = load_chunk_size(s);
+        if (r < 0)
+                goto finish;
 
-                if (fstat(input_fd, &st) < 0) {
-                        r = -errno;
-                        fprintf(stderr, "Failed to stat input: %s\n", strerror(-r));
+        if (operation == DIFF_ARCHIVE) {
+                if (input_fd >= 0)
+                        r = ca_sync_set_archive_fd(s, input_fd);
+                else
+                        r = ca_sync_set_archive_auto(s, input);
+        } else {
+                if (input_fd >= 0)
+                        r = ca_sync_set_index_fd(s, input_fd);
+                else
+                        r = ca_sync_set_index_auto(s, input);
+        }
+        if (r < 0) {
+                fprintf(stderr, "Failed to set sync input: %s\n", strerror(-r));
+                goto finish;
+        }
+        input_fd = -1;
+
+        r = ca_sync_set_base_mode(s, S_IFDIR);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set base mode to directory: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        if (arg_store) {
+                r = ca_sync_set_store_auto(s, arg_store);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set store: %s\n", strerror(-r));
                         goto finish;
                 }
+        }
 
-                if (S_ISDIR(st.st_mode)) {
+        r = load_seeds_and_extra_stores(s);
+        if (r < 0)
+                goto finish;
 
-                        if (operation == _DIGEST_OPERATION_INVALID)
-                                operation = DIGEST_DIRECTORY;
-                        else if (operation != DIGEST_DIRECTORY) {
-                                fprintf(stderr, "Input is a directory, but attempted to list as blob. Refusing.\n");
-                                r = -EINVAL;
-                                goto finish;
-                        }
-
-                } else if (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) {
-
-                        if (operation == _DIGEST_OPERATION_INVALID)
-                                operation = seek_path ? DIGEST_ARCHIVE : DIGEST_BLOB;
-                        else if (!IN_SET(operation, DIGEST_ARCHIVE, DIGEST_BLOB, DIGEST_ARCHIVE_INDEX, DIGEST_BLOB_INDEX)) {
-                                fprintf(stderr, "Input is not a regular file or block device, but attempted to list as one. Refusing.\n");
-                                r = -EINVAL;
-                                goto finish;
-                        }
-                } else {
-                        fprintf(stderr, "Input is a neither a directory, a regular file, nor a block device. Refusing.\n");
-                        r = -EINVAL;
-                        goto finish;
-                }
-        }
-
-        if (streq_ptr(input, "-"))
-                input = NULL;
-
-        if (operation == _DIGEST_OPERATION_INVALID) {
-                fprintf(stderr, "Failed to determine what to calculate digest of. Use --what=archive, --what=blob, --what=archive-index, --what=blob-index or --what=directory.\n");
-                r = -EINVAL;
-                goto finish;
-        }
-
-        if (!IN_SET(operation, DIGEST_ARCHIVE, DIGEST_ARCHIVE_INDEX) && seek_path) {
-                fprintf(stderr, "Subtree path only supported when calculating message digest of archive or archive index.\n");
-                r = -EINVAL;
-                goto finish;
-        }
-
-        seek_path = normalize_seek_path(seek_path);
-
-        if (IN_SET(operation, DIGEST_ARCHIVE_INDEX, DIGEST_BLOB_INDEX)) {
-                r = set_default_store(input);
-                if (r < 0)
-                        goto finish;
-        }
-
-        if (operation == DIGEST_DIRECTORY || (operation == DIGEST_BLOB && input_fd >= 0))
-                s = ca_sync_new_encode();
-        else
-                s = ca_sync_new_decode();
-        if (!s) {
-                r = log_oom();
-                goto finish;
-        }
-
-        r = load_chunk_size(s);
-        if (r < 0)
-                goto finish;
-
-        if (operation == DIGEST_DIRECTORY || (operation == DIGEST_BLOB && input_fd >= 0))
-                r = ca_sync_set_base_fd(s, input_fd);
-        else if (IN_SET(operation, DIGEST_ARCHIVE_INDEX, DIGEST_BLOB_INDEX)) {
-                if (input_fd >= 0)
-                        r = ca_sync_set_index_fd(s, input_fd);
-                else
-                        r = ca_sync_set_index_auto(s, input);
-
-                set_base_mode = true;
-        } else {
-                assert(IN_SET(operation, DIGEST_BLOB, DIGEST_ARCHIVE));
-
-                set_base_mode = true;
-
-                r = ca_sync_set_archive_auto(s, input);
-        }
-        if (r < 0) {
-                fprintf(stderr, "Failed to set sync input: %s", strerror(-r));
-                goto finish;
-        }
-        input_fd = -1;
-
-        if (set_base_mode) {
-                r = ca_sync_set_base_mode(s, IN_SET(operation, DIGEST_ARCHIVE, DIGEST_ARCHIVE_INDEX) ? S_IFDIR : S_IFREG);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to set base mode to regular file: %s\n", strerror(-r));
-                        goto finish;
-                }
-        }
-
-        if (arg_store) {
-                r = ca_sync_set_store_auto(s, arg_store);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to set store: %s\n", strerror(-r));
-                        goto finish;
-                }
-        }
-
-        r = load_seeds_and_extra_stores(s);
-        if (r < 0)
-                goto finish;
-
-        r = load_feature_flags(s, IN_SET(operation, DIGEST_BLOB, DIGEST_BLOB_INDEX) ? 0 : CA_FORMAT_WITH_MASK);
+        r = load_feature_flags(s, CA_FORMAT_WITH_MASK);
         if (r < 0)
                 goto finish;
 
-        r = ca_sync_enable_archive_digest(s, true);
+        r = ca_sync_set_payload(s, false);
         if (r < 0) {
-                fprintf(stderr, "Failed to enable archive digest: %s\n", strerror(-r));
+                fprintf(stderr, "Failed to enable skipping over payload: %s\n", strerror(-r));
                 goto finish;
         }
 
-        if (seek_path) {
-                r = ca_sync_seek_path(s, seek_path);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to seek to %s: %s\n", seek_path, strerror(-r));
-                        goto finish;
-                }
-
-                seeking = true;
-        }
-
         (void) send_notify("READY=1");
 
         for (;;) {
@@ -2653,260 +3735,300 @@ static int verb_digest(int argc, char *argv[]) {
                 switch (r) {
 
                 case CA_SYNC_FINISHED:
+                        if (arg_verbose)
+                                fprintf(stderr, "%" PRIu64 " entries differ.\n", n_differ);
 
-                        if (!show_payload_digest) { /* When we calc the digest of a directory tree (or top-level blob), show the archive digest */
-                                CaChunkID digest;
-                                char t[CA_CHUNK_ID_FORMAT_MAX];
+                        r = 0;
+                        goto finish;
 
-                                r = ca_sync_get_archive_digest(s, &digest);
-                                if (r < 0) {
-                                        fprintf(stderr, "Failed to get archive digest: %s\n", strerror(-r));
-                                        goto finish;
-                                }
+                case CA_SYNC_NEXT_FILE: {
+                        char keywords[256] = "";
+                        uint64_t mtime = UINT64_MAX, size = UINT64_MAX, granularity = 1, flags;
+                        bool time_differs = false;
+                        uid_t uid = UID_INVALID;
+                        gid_t gid = GID_INVALID;
+                        dev_t rdev = (dev_t) -1;
+                        const char *target = NULL;
+                        struct stat st;
+                        char *path;
+                        mode_t mode;
 
-                                printf("%s\n", ca_chunk_id_format(&digest, t));
-                                r = 0;
+                        r = ca_sync_current_mode(s, &mode);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to query current mode: %s\n", strerror(-r));
                                 goto finish;
                         }
 
-                        break;
-
-                case CA_SYNC_NEXT_FILE:
+                        r = ca_sync_current_path(s, &path);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to query current path: %s\n", strerror(-r));
+                                goto finish;
+                        }
 
-                        if (seeking) {
-                                mode_t mode;
+                        if (isempty(path))
+                                r = fstat(dir_fd, &st);
+                        else
+                                r = fstatat(dir_fd, path, &st, AT_SYMLINK_NOFOLLOW);
+                        if (r < 0) {
+                                if (!IN_SET(errno, ENOENT, ENOTDIR)) {
+                                        r = -errno;
+                                        fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(-r));
+                                        free(path);
+                                        goto finish;
+                                }
 
-                                /* If we are seeking to a specific path in our archive, then check here if it is a regular file
-                                 * (in which case we show the payload checksum) or a directory (in which case we show the
-                                 * archive checksum from here. If it is neither, we return failure. */
+                                printf("missing %s\n", isempty(path) ? "." : path);
+                                n_differ++;
 
-                                r = ca_sync_current_mode(s, &mode);
-                                if (r < 0) {
-                                        fprintf(stderr, "Failed to get current mode: %s\n", strerror(-r));
-                                        goto finish;
+                                /* The whole subtree is missing, no need to enumerate it entry by entry */
+                                if (S_ISDIR(mode) && !isempty(path)) {
+                                        r = ca_sync_seek_next_sibling(s);
+                                        if (r < 0) {
+                                                fprintf(stderr, "Failed to seek to next sibling: %s\n", strerror(-r));
+                                                free(path);
+                                                goto finish;
+                                        }
                                 }
 
-                                if (S_ISREG(mode)) {
-                                        show_payload_digest = true;
+                                free(path);
+                                break;
+                        }
 
-                                        r = ca_sync_enable_payload_digest(s, true);
+                        if (((st.st_mode ^ mode) & S_IFMT) != 0) {
+                                printf("type %s\n", isempty(path) ? "." : path);
+                                n_differ++;
+
+                                if (S_ISDIR(mode) && !isempty(path)) {
+                                        r = ca_sync_seek_next_sibling(s);
                                         if (r < 0) {
-                                                fprintf(stderr, "Failed to enable payload digest: %s\n", strerror(-r));
+                                                fprintf(stderr, "Failed to seek to next sibling: %s\n", strerror(-r));
+                                                free(path);
                                                 goto finish;
                                         }
+                                }
 
-                                } else if (S_ISDIR(mode))
-                                        show_payload_digest = false;
-                                else {
-                                        fprintf(stderr, "Path %s does not refer to a file or directory: %s\n", seek_path, strerror(-r));
-                                        r = -ENOTTY;
+                                free(path);
+                                break;
+                        }
+
+                        (void) ca_sync_current_mtime(s, &mtime);
+                        (void) ca_sync_current_size(s, &size);
+                        (void) ca_sync_current_uid(s, &uid);
+                        (void) ca_sync_current_gid(s, &gid);
+                        (void) ca_sync_current_target(s, &target);
+                        (void) ca_sync_current_rdev(s, &rdev);
+
+                        if (((st.st_mode ^ mode) & 07777) != 0)
+                                diff_add_keyword(keywords, sizeof(keywords), "mode");
+
+                        if (uid_is_valid(uid) && st.st_uid != uid)
+                                diff_add_keyword(keywords, sizeof(keywords), "uid");
+                        if (gid_is_valid(gid) && st.st_gid != gid)
+                                diff_add_keyword(keywords, sizeof(keywords), "gid");
+
+                        if (target && S_ISLNK(st.st_mode)) {
+                                char *d = NULL;
+
+                                r = readlinkat_malloc(dir_fd, path, &d);
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to read symlink %s: %s\n", path, strerror(-r));
+                                        free(path);
                                         goto finish;
                                 }
 
-                                seeking = false;
+                                if (!streq(d, target))
+                                        diff_add_keyword(keywords, sizeof(keywords), "target");
+
+                                free(d);
                         }
 
-                        r = process_step_generic(s, r, false);
-                        if (r < 0)
-                                goto finish;
+                        if (rdev != (dev_t) -1 && st.st_rdev != rdev)
+                                diff_add_keyword(keywords, sizeof(keywords), "device");
 
-                        break;
+                        if (mtime != UINT64_MAX) {
+                                if (ca_sync_get_feature_flags(s, &flags) >= 0)
+                                        (void) ca_feature_flags_time_granularity_nsec(flags, &granularity);
 
-                case CA_SYNC_DONE_FILE:
+                                time_differs = mtime / granularity != timespec_to_nsec(st.st_mtim) / granularity;
+                        }
 
-                        if (show_payload_digest) { /* When we calc the digest of a file, show the payload digest */
-                                CaChunkID digest;
-                                char t[CA_CHUNK_ID_FORMAT_MAX];
+                        if (S_ISREG(mode) && size != UINT64_MAX && size != (uint64_t) st.st_size)
+                                diff_add_keyword(keywords, sizeof(keywords), "content");
+                        else if (S_ISREG(mode) && (time_differs || mtime == UINT64_MAX)) {
 
-                                r = ca_sync_get_payload_digest(s, &digest);
+                                /* Size matches but the mtime doesn't (or is unknown) — the only way to tell
+                                 * whether the contents changed is to actually look at the payload. Turn on
+                                 * payload decoding for just this one file, and compare it against the local
+                                 * copy as it streams by. */
+
+                                suspect_fd = openat(dir_fd, path, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
+                                if (suspect_fd < 0) {
+                                        r = -errno;
+                                        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(-r));
+                                        free(path);
+                                        goto finish;
+                                }
+
+                                r = ca_sync_set_payload(s, true);
                                 if (r < 0) {
-                                        fprintf(stderr, "Failed to get payload digest: %s\n", strerror(-r));
+                                        fprintf(stderr, "Failed to enable payload: %s\n", strerror(-r));
+                                        free(path);
                                         goto finish;
                                 }
 
-                                printf("%s\n", ca_chunk_id_format(&digest, t));
-                                r = 0;
-                                goto finish;
+                                suspect_path = path;
+                                suspect_dirty = false;
+                                suspect_time_differs = time_differs;
+                                strcpy(suspect_keywords, keywords);
+                                break;
                         }
 
-                        /* fall through */
+                        if (time_differs)
+                                diff_add_keyword(keywords, sizeof(keywords), "time");
 
-                case CA_SYNC_STEP:
-                case CA_SYNC_PAYLOAD:
-                case CA_SYNC_SEED_NEXT_FILE:
-                case CA_SYNC_SEED_DONE_FILE:
-                case CA_SYNC_POLL:
-                case CA_SYNC_FOUND:
-                case CA_SYNC_NOT_FOUND:
-                        r = process_step_generic(s, r, false);
-                        if (r < 0)
-                                goto finish;
-                        break;
+                        if (!isempty(keywords)) {
+                                printf("%s %s\n", keywords, isempty(path) ? "." : path);
+                                n_differ++;
+                        }
 
-                default:
-                        assert(false);
+                        free(path);
+                        break;
                 }
 
-                verbose_print_feature_flags(s);
+                case CA_SYNC_PAYLOAD: {
+                        const void *p;
+                        size_t sz, i;
 
-                if (arg_verbose)
-                        progress();
-        }
+                        r = ca_sync_get_payload(s, &p, &sz);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to retrieve synchronizer payload: %s\n", strerror(-r));
+                                goto finish;
+                        }
 
-finish:
-        ca_sync_unref(s);
+                        /* Payload may also show up without a file under scrutiny when the archive is remote
+                         * (in which case it cannot be skipped over), simply ignore it then. */
+                        if (suspect_fd < 0 || suspect_dirty)
+                                break;
 
-        if (input_fd >= 3)
-                (void) close(input_fd);
+                        if (!compare_buffer) {
+                                compare_buffer = malloc(BUFFER_SIZE);
+                                if (!compare_buffer) {
+                                        r = log_oom();
+                                        goto finish;
+                                }
+                        }
 
-        free(input);
+                        for (i = 0; i < sz; ) {
+                                size_t m = MIN(sz - i, (size_t) BUFFER_SIZE);
+                                ssize_t n;
 
-        return r;
-}
+                                n = loop_read(suspect_fd, compare_buffer, m);
+                                if (n < 0) {
+                                        r = (int) n;
+                                        fprintf(stderr, "Failed to read %s: %s\n", suspect_path, strerror(-r));
+                                        goto finish;
+                                }
 
-static int verb_mount(int argc, char *argv[]) {
-#if HAVE_FUSE
-        typedef enum MountOperation {
-                MOUNT_ARCHIVE,
-                MOUNT_ARCHIVE_INDEX,
-                _MOUNT_OPERATION_INVALID = -1,
-        } MountOperation;
-        MountOperation operation = _MOUNT_OPERATION_INVALID;
-        const char *mount_path = NULL;
-        int r, input_fd = -1;
-        char *input = NULL;
-        CaSync *s = NULL;
-
-        if (argc > 3 || argc < 2) {
-                fprintf(stderr, "An archive path/URL expected, followed by a mount path.\n");
-                return -EINVAL;
-        }
+                                if ((size_t) n != m || memcmp((const uint8_t*) p + i, compare_buffer, m) != 0) {
+                                        suspect_dirty = true;
 
-        if (argc > 2) {
-                input = ca_strip_file_url(argv[1]);
-                if (!input) {
-                        r = log_oom();
-                        goto finish;
-                }
+                                        /* Verdict reached, skip the rest of this file's payload if we can */
+                                        r = ca_sync_set_payload(s, false);
+                                        if (r < 0) {
+                                                fprintf(stderr, "Failed to disable payload: %s\n", strerror(-r));
+                                                goto finish;
+                                        }
+                                        break;
+                                }
 
-                mount_path = argv[2];
-        } else
-                mount_path = argv[1];
+                                i += m;
+                        }
 
-        if (arg_what == WHAT_ARCHIVE)
-                operation = MOUNT_ARCHIVE;
-        else if (arg_what == WHAT_ARCHIVE_INDEX)
-                operation = MOUNT_ARCHIVE_INDEX;
-        else if (arg_what != _WHAT_INVALID) {
-                fprintf(stderr, "\"mount\" operation may only be combined with --what=archive and --what=archive-index.\n");
-                r = -EINVAL;
-                goto finish;
-        }
+                        break;
+                }
 
-        if (operation == _MOUNT_OPERATION_INVALID && input && !streq(input, "-")) {
-                if (ca_locator_has_suffix(input, ".caidx"))
-                        operation = MOUNT_ARCHIVE_INDEX;
-        }
+                case CA_SYNC_DONE_FILE:
 
-        if (operation == _MOUNT_OPERATION_INVALID)
-                operation = MOUNT_ARCHIVE;
+                        if (suspect_fd >= 0) {
 
-        s = ca_sync_new_decode();
-        if (!s) {
-                r = log_oom();
-                goto finish;
-        }
+                                if (suspect_dirty)
+                                        diff_add_keyword(suspect_keywords, sizeof(suspect_keywords), "content");
+                                else if (suspect_time_differs)
+                                        diff_add_keyword(suspect_keywords, sizeof(suspect_keywords), "time");
 
-        if (!input || streq(input, "-"))
-                input_fd = STDIN_FILENO;
+                                if (!isempty(suspect_keywords)) {
+                                        printf("%s %s\n", suspect_keywords, suspect_path);
+                                        n_differ++;
+                                }
 
-        if (operation == MOUNT_ARCHIVE_INDEX) {
-                r = set_default_store(input);
-                if (r < 0)
-                        goto finish;
-        }
+                                suspect_fd = safe_close(suspect_fd);
+                                suspect_path = mfree(suspect_path);
+                                suspect_keywords[0] = 0;
 
-        if (arg_rate_limit_bps != UINT64_MAX) {
-                r = ca_sync_set_rate_limit_bps(s, arg_rate_limit_bps);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to set rate limit: %s\n", strerror(-r));
-                        goto finish;
-                }
-        }
+                                r = ca_sync_set_payload(s, false);
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to disable payload: %s\n", strerror(-r));
+                                        goto finish;
+                                }
+                        }
 
-        if (operation == MOUNT_ARCHIVE) {
-                if (input_fd >= 0)
-                        r = ca_sync_set_archive_fd(s, input_fd);
-                else
-                        r = ca_sync_set_archive_auto(s, input);
+                        break;
 
-        } else if (operation == MOUNT_ARCHIVE_INDEX) {
-                if (input_fd >= 0)
-                        r = ca_sync_set_index_fd(s, input_fd);
-                else
-                        r = ca_sync_set_index_auto(s, input);
-        } else
-                assert(false);
-        if (r < 0) {
-                fprintf(stderr, "Failed to set sync input: %s\n", strerror(-r));
-                goto finish;
-        }
+                case CA_SYNC_STEP:
+                case CA_SYNC_SEED_NEXT_FILE:
+                case CA_SYNC_SEED_DONE_FILE:
+                case CA_SYNC_POLL:
+                case CA_SYNC_FOUND:
+                case CA_SYNC_NOT_FOUND:
 
-        input_fd = -1;
+                        r = process_step_generic(s, r, false);
+                        if (r < 0)
+                                goto finish;
 
-        r = ca_sync_set_base_mode(s, S_IFDIR);
-        if (r < 0) {
-                fprintf(stderr, "Failed to set base mode to directory: %s\n", strerror(-r));
-                goto finish;
-        }
+                        break;
 
-        if (arg_store) {
-                r = ca_sync_set_store_auto(s, arg_store);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to set store: %s\n", strerror(-r));
-                        goto finish;
+                default:
+                        assert(false);
                 }
         }
 
-        r = load_seeds_and_extra_stores(s);
-        if (r < 0)
-                goto finish;
-
-        r = ca_fuse_run(s, input, mount_path, arg_mkdir);
-
 finish:
         ca_sync_unref(s);
 
+        safe_close(suspect_fd);
+        free(suspect_path);
+        free(compare_buffer);
+
         if (input_fd >= 3)
                 (void) close(input_fd);
+        safe_close(dir_fd);
 
         free(input);
-
         return r;
-#else
-        fprintf(stderr, "Compiled without support for fuse.\n");
-        return -ENOSYS;
-#endif
 }
 
-static int verb_mkdev(int argc, char *argv[]) {
+static int verb_digest(int argc, char *argv[]) {
 
-        typedef enum MkDevOperation {
-                MKDEV_BLOB,
-                MKDEV_BLOB_INDEX,
-                _MKDEV_OPERATION_INVALID = -1,
-        } MkDevOperation;
-        MkDevOperation operation = _MKDEV_OPERATION_INVALID;
-        ReallocBuffer buffer = {};
-        CaBlockDevice *nbd = NULL;
-        const char *path = NULL, *name = NULL;
-        bool make_symlink = false, rm_symlink = false;
+        typedef enum DigestOperation {
+                DIGEST_ARCHIVE,
+                DIGEST_ARCHIVE_INDEX,
+                DIGEST_BLOB,
+                DIGEST_BLOB_INDEX,
+                DIGEST_DIRECTORY,
+                _DIGEST_OPERATION_INVALID = -1,
+        } DigestOperation;
+
+        DigestOperation operation = _DIGEST_OPERATION_INVALID;
+        bool set_base_mode = false;
+        const char *seek_path = NULL;
         int r, input_fd = -1;
         char *input = NULL;
         CaSync *s = NULL;
+        bool show_payload_digest = false;
+        int seeking = false;
 
         if (argc > 3) {
-                fprintf(stderr, "An blob path/URL expected, possibly followed by a device or symlink name.\n");
+                fprintf(stderr, "Input path/URL and subtree path expected.\n");
                 return -EINVAL;
         }
 
@@ -2919,984 +4041,5377 @@ static int verb_mkdev(int argc, char *argv[]) {
         }
 
         if (argc > 2)
-                name = argv[2];
+                seek_path = argv[2];
 
-        if (arg_what == WHAT_BLOB)
-                operation = MKDEV_BLOB;
+        if (arg_what == WHAT_ARCHIVE)
+                operation = DIGEST_ARCHIVE;
+        else if (arg_what == WHAT_ARCHIVE_INDEX)
+                operation = DIGEST_ARCHIVE_INDEX;
+        else if (arg_what == WHAT_BLOB)
+                operation = DIGEST_BLOB;
         else if (arg_what == WHAT_BLOB_INDEX)
-                operation = MKDEV_BLOB_INDEX;
+                operation = DIGEST_BLOB_INDEX;
+        else if (arg_what == WHAT_DIRECTORY)
+                operation = DIGEST_DIRECTORY;
         else if (arg_what != _WHAT_INVALID) {
-                fprintf(stderr, "\"mkdev\" operation may only be combined with --what=blob and --what=blob-index.\n");
+                fprintf(stderr, "\"make\" operation may only be combined with --what=archive, --what=blob, --what=archive-index, --what=blob-index or --what=directory.\n");
                 r = -EINVAL;
                 goto finish;
         }
 
-        if (operation == _MKDEV_OPERATION_INVALID && input && !streq(input, "-")) {
-                if (ca_locator_has_suffix(input, ".caibx"))
-                        operation = MKDEV_BLOB_INDEX;
-        }
+        if (operation == _DIGEST_OPERATION_INVALID && input && !streq(input, "-")) {
 
-        if (operation == _MKDEV_OPERATION_INVALID)
-                operation = MKDEV_BLOB;
+                if (ca_locator_has_suffix(input, ".catar"))
+                        operation = DIGEST_ARCHIVE;
+                else if (ca_locator_has_suffix(input, ".caidx"))
+                        operation = DIGEST_ARCHIVE_INDEX;
+                else if (ca_locator_has_suffix(input, ".caibx"))
+                        operation = DIGEST_BLOB_INDEX;
+        }
 
-        s = ca_sync_new_decode();
-        if (!s) {
-                r = log_oom();
-                goto finish;
+        if (!input && IN_SET(operation, DIGEST_DIRECTORY, _DIGEST_OPERATION_INVALID)) {
+                input = strdup(".");
+                if (!input) {
+                        r = log_oom();
+                        goto finish;
+                }
         }
 
         if (!input || streq(input, "-"))
                 input_fd = STDIN_FILENO;
+        else {
+                CaLocatorClass input_class;
 
-        if (operation == MKDEV_BLOB_INDEX) {
-                r = set_default_store(input);
-                if (r < 0)
+                input_class = ca_classify_locator(input);
+                if (input_class < 0) {
+                        fprintf(stderr, "Failed to determine class of locator: %s\n", input);
+                        r = -EINVAL;
                         goto finish;
-        }
+                }
 
-        if (arg_rate_limit_bps != UINT64_MAX) {
-                r = ca_sync_set_rate_limit_bps(s, arg_rate_limit_bps);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to set rate limit: %s\n", strerror(-r));
+                if (operation == DIGEST_DIRECTORY && input_class != CA_LOCATOR_PATH) {
+                        fprintf(stderr, "Input must be local path: %s\n", input);
+                        r = -EINVAL;
                         goto finish;
                 }
-        }
-
-        if (operation == MKDEV_BLOB) {
-                if (input_fd >= 0)
-                        r = ca_sync_set_archive_fd(s, input_fd);
-                else
-                        r = ca_sync_set_archive_auto(s, input);
 
-        } else if (operation == MKDEV_BLOB_INDEX) {
-                if (input_fd >= 0)
-                        r = ca_sync_set_index_fd(s, input_fd);
-                else
-                        r = ca_sync_set_index_auto(s, input);
-        } else
-                assert(false);
-        if (r < 0) {
-                fprintf(stderr, "Failed to set sync input: %s\n", strerror(-r));
-                goto finish;
+                if (input_class == CA_LOCATOR_PATH) {
+                        input_fd = open(input, O_CLOEXEC|O_RDONLY|O_NOCTTY);
+                        if (input_fd < 0) {
+                                r = -errno;
+                                fprintf(stderr, "Failed to open %s: %s\n", input, strerror(-r));
+                                goto finish;
+                        }
+                }
         }
 
-        input_fd = -1;
-
-        r = ca_sync_set_base_mode(s, S_IFREG);
-        if (r < 0) {
-                fprintf(stderr, "Failed to set base mode to regular file: %s\n", strerror(-r));
-                goto finish;
-        }
+        if (input_fd >= 0) {
+                struct stat st;
 
-        if (arg_store) {
-                r = ca_sync_set_store_auto(s, arg_store);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to set store: %s\n", strerror(-r));
+                if (fstat(input_fd, &st) < 0) {
+                        r = -errno;
+                        fprintf(stderr, "Failed to stat input: %s\n", strerror(-r));
                         goto finish;
                 }
-        }
 
-        r = load_seeds_and_extra_stores(s);
-        if (r < 0)
-                goto finish;
+                if (S_ISDIR(st.st_mode)) {
 
-        nbd = ca_block_device_new();
-        if (!nbd) {
-                r = log_oom();
-                goto finish;
-        }
+                        if (operation == _DIGEST_OPERATION_INVALID)
+                                operation = DIGEST_DIRECTORY;
+                        else if (operation != DIGEST_DIRECTORY) {
+                                fprintf(stderr, "Input is a directory, but attempted to list as blob. Refusing.\n");
+                                r = -EINVAL;
+                                goto finish;
+                        }
 
-        if (name) {
-                r = ca_block_device_test_nbd(name);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to test whether %s is an nbd device: %s\n", name, strerror(-r));
-                        goto finish;
-                } else if (r > 0) {
-                        r = ca_block_device_set_path(nbd, name);
-                        if (r < 0) {
-                                fprintf(stderr, "Failed to set device path to %s: %s\n", name, strerror(-r));
+                } else if (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) {
+
+                        if (operation == _DIGEST_OPERATION_INVALID)
+                                operation = seek_path ? DIGEST_ARCHIVE : DIGEST_BLOB;
+                        else if (!IN_SET(operation, DIGEST_ARCHIVE, DIGEST_BLOB, DIGEST_ARCHIVE_INDEX, DIGEST_BLOB_INDEX)) {
+                                fprintf(stderr, "Input is not a regular file or block device, but attempted to list as one. Refusing.\n");
+                                r = -EINVAL;
                                 goto finish;
                         }
                 } else {
-                        const char *k;
-
-                        k = path_startswith(name, "/dev");
-                        if (k) {
-                                r = ca_block_device_set_friendly_name(nbd, k);
-                                if (r < 0) {
-                                        fprintf(stderr, "Failed to set friendly name to %s: %s\n", k, strerror(-r));
-                                        goto finish;
-                                }
-                        } else
-                                make_symlink = true;
+                        fprintf(stderr, "Input is a neither a directory, a regular file, nor a block device. Refusing.\n");
+                        r = -EINVAL;
+                        goto finish;
                 }
         }
 
-        /* First loop: process as enough so that we can figure out the size of the blob */
-        for (;;) {
-                uint64_t size;
+        if (streq_ptr(input, "-"))
+                input = NULL;
 
-                if (quit) {
-                        r = 0;
-                        goto finish;
-                }
+        if (operation == _DIGEST_OPERATION_INVALID) {
+                fprintf(stderr, "Failed to determine what to calculate digest of. Use --what=archive, --what=blob, --what=archive-index, --what=blob-index or --what=directory.\n");
+                r = -EINVAL;
+                goto finish;
+        }
 
-                r = ca_sync_get_archive_size(s, &size);
-                if (r >= 0) {
-                        r = ca_block_device_set_size(nbd, (size + 511) & ~511);
-                        if (r < 0) {
-                                fprintf(stderr, "Failed to set NBD size: %s\n", strerror(-r));
-                                goto finish;
-                        }
-                        break;
-                }
-                if (r == -ESPIPE) {
-                        fprintf(stderr, "Seekable archive required.\n");
-                        goto finish;
-                }
-                if (r != -EAGAIN) {
-                        fprintf(stderr, "Failed to determine archive size: %s\n", strerror(-r));
-                        goto finish;
-                }
+        if (!IN_SET(operation, DIGEST_ARCHIVE, DIGEST_ARCHIVE_INDEX) && seek_path) {
+                fprintf(stderr, "Subtree path only supported when calculating message digest of archive or archive index.\n");
+                r = -EINVAL;
+                goto finish;
+        }
 
-                r = ca_sync_step(s);
-                if (r == -ENOMEDIUM) {
-                        fprintf(stderr, "File, URL or resource not found.\n");
+        seek_path = normalize_seek_path(seek_path);
+
+        if (IN_SET(operation, DIGEST_ARCHIVE_INDEX, DIGEST_BLOB_INDEX)) {
+                r = set_default_store(input);
+                if (r < 0)
                         goto finish;
-                }
+        }
+
+        if (operation == DIGEST_DIRECTORY || (operation == DIGEST_BLOB && input_fd >= 0))
+                s = ca_sync_new_encode();
+        else
+                s = ca_sync_new_decode();
+        if (!s) {
+                r = log_oom();
+                goto finish;
+        }
+
+        r = load_chunk_size(s);
+        if (r < 0)
+                goto finish;
+
+        if (operation == DIGEST_DIRECTORY || (operation == DIGEST_BLOB && input_fd >= 0))
+                r = ca_sync_set_base_fd(s, input_fd);
+        else if (IN_SET(operation, DIGEST_ARCHIVE_INDEX, DIGEST_BLOB_INDEX)) {
+                if (input_fd >= 0)
+                        r = ca_sync_set_index_fd(s, input_fd);
+                else
+                        r = ca_sync_set_index_auto(s, input);
+
+                set_base_mode = true;
+        } else {
+                assert(IN_SET(operation, DIGEST_BLOB, DIGEST_ARCHIVE));
+
+                set_base_mode = true;
+
+                r = ca_sync_set_archive_auto(s, input);
+        }
+        if (r < 0) {
+                fprintf(stderr, "Failed to set sync input: %s", strerror(-r));
+                goto finish;
+        }
+        input_fd = -1;
+
+        if (set_base_mode) {
+                r = ca_sync_set_base_mode(s, IN_SET(operation, DIGEST_ARCHIVE, DIGEST_ARCHIVE_INDEX) ? S_IFDIR : S_IFREG);
                 if (r < 0) {
-                        fprintf(stderr, "Failed to run synchronizer: %s\n", strerror(-r));
+                        fprintf(stderr, "Failed to set base mode to regular file: %s\n", strerror(-r));
                         goto finish;
                 }
+        }
 
-                switch (r) {
-
-                case CA_SYNC_FINISHED:
-                        fprintf(stderr, "Premature end of archive.\n");
-                        r = -EBADMSG;
+        if (arg_store) {
+                r = ca_sync_set_store_auto(s, arg_store);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set store: %s\n", strerror(-r));
                         goto finish;
-
-                case CA_SYNC_STEP:
-                case CA_SYNC_PAYLOAD:
-                case CA_SYNC_SEED_NEXT_FILE:
-                case CA_SYNC_SEED_DONE_FILE:
-                case CA_SYNC_POLL:
-                        r = process_step_generic(s, r, true);
-                        if (r < 0)
-                                goto finish;
-                        break;
-
-                default:
-                        assert(false);
                 }
         }
 
-        r = ca_block_device_open(nbd);
-        if (r < 0) {
-                fprintf(stderr, "Failed to open NBD device: %s\n", strerror(-r));
+        r = load_seeds_and_extra_stores(s);
+        if (r < 0)
                 goto finish;
-        }
 
-        r = ca_block_device_get_path(nbd, &path);
+        r = load_feature_flags(s, IN_SET(operation, DIGEST_BLOB, DIGEST_BLOB_INDEX) ? 0 : CA_FORMAT_WITH_MASK);
+        if (r < 0)
+                goto finish;
+
+        r = ca_sync_enable_archive_digest(s, true);
         if (r < 0) {
-                fprintf(stderr, "Failed to determine NBD device path: %s\n", strerror(-r));
+                fprintf(stderr, "Failed to enable archive digest: %s\n", strerror(-r));
                 goto finish;
         }
 
-        if (make_symlink) {
-                if (symlink(path, name) < 0) {
-                        r = -errno;
-                        fprintf(stderr, "Failed to create symlink %s → %s: %s\n", name, path, strerror(-r));
+        if (seek_path) {
+                r = ca_sync_seek_path(s, seek_path);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to seek to %s: %s\n", seek_path, strerror(-r));
                         goto finish;
                 }
 
-                rm_symlink = true;
+                seeking = true;
         }
 
-        printf("Attached: %s\n", name ?: path);
-
         (void) send_notify("READY=1");
 
         for (;;) {
-                uint64_t req_offset = 0, req_size = 0;
-
                 if (quit) {
-                        r = 0; /* for the "mkdev" verb quitting does not indicate an incomplete operation, hence return success */
+                        fprintf(stderr, "Got exit signal, quitting.\n");
+                        r = -ESHUTDOWN;
                         goto finish;
                 }
 
-                r = ca_block_device_step(nbd);
+                r = ca_sync_step(s);
+                if (r == -ENOMEDIUM) {
+                        fprintf(stderr, "File, URL or resource not found.\n");
+                        goto finish;
+                }
                 if (r < 0) {
-                        fprintf(stderr, "Failed to read NBD request: %s\n", strerror(-r));
+                        fprintf(stderr, "Failed to run synchronizer: %s\n", strerror(-r));
                         goto finish;
                 }
 
-                if (r == CA_BLOCK_DEVICE_CLOSED)
-                        break;
-
-                if (r == CA_BLOCK_DEVICE_POLL) {
-                        sigset_t ss;
+                switch (r) {
 
-                        block_exit_handler(SIG_BLOCK, &ss);
+                case CA_SYNC_FINISHED:
 
-                        if (quit)
-                                r = -ESHUTDOWN;
-                        else {
-                                r = ca_block_device_poll(nbd, UINT64_MAX, &ss);
-                                if ((r == -EINTR || r >= 0) && quit)
-                                        r = -ESHUTDOWN;
-                        }
+                        if (!show_payload_digest) { /* When we calc the digest of a directory tree (or top-level blob), show the archive digest */
+                                CaChunkID digest;
+                                char t[CA_CHUNK_ID_FORMAT_MAX];
 
-                        block_exit_handler(SIG_UNBLOCK, NULL);
+                                r = ca_sync_get_archive_digest(s, &digest);
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to get archive digest: %s\n", strerror(-r));
+                                        goto finish;
+                                }
 
-                        if (r == -ESHUTDOWN) {
+                                printf("%s\n", ca_chunk_id_format(&digest, t));
                                 r = 0;
                                 goto finish;
-                        } else if (r < 0) {
-                                fprintf(stderr, "Failed to poll for NBD requests: %s\n", strerror(-r));
-                                goto finish;
                         }
 
-                        continue;
-                }
+                        break;
+
+                case CA_SYNC_NEXT_FILE:
+
+                        if (seeking) {
+                                mode_t mode;
+
+                                /* If we are seeking to a specific path in our archive, then check here if it is a regular file
+                                 * (in which case we show the payload checksum) or a directory (in which case we show the
+                                 * archive checksum from here. If it is neither, we return failure. */
+
+                                r = ca_sync_current_mode(s, &mode);
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to get current mode: %s\n", strerror(-r));
+                                        goto finish;
+                                }
+
+                                if (S_ISREG(mode)) {
+                                        show_payload_digest = true;
+
+                                        r = ca_sync_enable_payload_digest(s, true);
+                                        if (r < 0) {
+                                                fprintf(stderr, "Failed to enable payload digest: %s\n", strerror(-r));
+                                                goto finish;
+                                        }
+
+                                } else if (S_ISDIR(mode))
+                                        show_payload_digest = false;
+                                else {
+                                        fprintf(stderr, "Path %s does not refer to a file or directory: %s\n", seek_path, strerror(-r));
+                                        r = -ENOTTY;
+                                        goto finish;
+                                }
+
+                                seeking = false;
+                        }
+
+                        r = process_step_generic(s, r, false);
+                        if (r < 0)
+                                goto finish;
+
+                        break;
+
+                case CA_SYNC_DONE_FILE:
+
+                        if (show_payload_digest) { /* When we calc the digest of a file, show the payload digest */
+                                CaChunkID digest;
+                                char t[CA_CHUNK_ID_FORMAT_MAX];
+
+                                r = ca_sync_get_payload_digest(s, &digest);
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to get payload digest: %s\n", strerror(-r));
+                                        goto finish;
+                                }
+
+                                printf("%s\n", ca_chunk_id_format(&digest, t));
+                                r = 0;
+                                goto finish;
+                        }
+
+                        /* fall through */
+
+                case CA_SYNC_STEP:
+                case CA_SYNC_PAYLOAD:
+                case CA_SYNC_SEED_NEXT_FILE:
+                case CA_SYNC_SEED_DONE_FILE:
+                case CA_SYNC_POLL:
+                case CA_SYNC_FOUND:
+                case CA_SYNC_NOT_FOUND:
+                        r = process_step_generic(s, r, false);
+                        if (r < 0)
+                                goto finish;
+                        break;
+
+                default:
+                        assert(false);
+                }
+
+                verbose_print_feature_flags(s);
+
+                if (arg_verbose)
+                        progress();
+        }
+
+finish:
+        ca_sync_unref(s);
+
+        if (input_fd >= 3)
+                (void) close(input_fd);
+
+        free(input);
+
+        return r;
+}
+
+/* The average chunk sizes the "analyze" verb evaluates in one pass */
+static const size_t analyze_avg_sizes[] = {
+        16U*1024U,
+        32U*1024U,
+        64U*1024U,
+        128U*1024U,
+        256U*1024U,
+};
+
+typedef struct ChunkAnalyzer {
+        CaChunker chunker;
+        CaDigest *digest;
+
+        /* Open-addressed set of truncated chunk digests, to tell new chunks from repeated ones */
+        uint64_t *seen;
+        size_t n_seen;
+        size_t n_buckets;
+
+        uint64_t current_chunk_size;
+
+        uint64_t n_chunks;
+        uint64_t n_unique_chunks;
+        uint64_t unique_bytes;
+        uint64_t total_bytes;
+} ChunkAnalyzer;
+
+static int chunk_analyzer_remember(ChunkAnalyzer *a, uint64_t v) {
+        size_t i;
+
+        assert(a);
+
+        if (v == 0) /* zero marks empty buckets */
+                v = 1;
+
+        if ((a->n_seen + 1) * 4 >= a->n_buckets * 3) { /* Grow at 75% fill level */
+                size_t new_buckets, j;
+                uint64_t *t;
+
+                new_buckets = a->n_buckets == 0 ? 4096 : a->n_buckets * 2;
+
+                t = new0(uint64_t, new_buckets);
+                if (!t)
+                        return -ENOMEM;
+
+                for (j = 0; j < a->n_buckets; j++) {
+                        uint64_t x = a->seen[j];
+                        size_t k;
+
+                        if (x == 0)
+                                continue;
+
+                        for (k = (size_t) x & (new_buckets - 1); t[k] != 0; k = (k + 1) & (new_buckets - 1))
+                                ;
+
+                        t[k] = x;
+                }
+
+                free(a->seen);
+                a->seen = t;
+                a->n_buckets = new_buckets;
+        }
+
+        for (i = (size_t) v & (a->n_buckets - 1);; i = (i + 1) & (a->n_buckets - 1)) {
+
+                if (a->seen[i] == v)
+                        return 0;
+
+                if (a->seen[i] == 0) {
+                        a->seen[i] = v;
+                        a->n_seen++;
+                        return 1;
+                }
+        }
+}
+
+static int chunk_analyzer_cut(ChunkAnalyzer *a) {
+        uint64_t v;
+        int r;
+
+        assert(a);
+        assert(a->current_chunk_size > 0);
+
+        /* The first 64 bit of the digest are plenty for dedup estimation purposes */
+        memcpy(&v, ca_digest_read(a->digest), sizeof(v));
+
+        r = chunk_analyzer_remember(a, v);
+        if (r < 0)
+                return r;
+        if (r > 0) {
+                a->n_unique_chunks++;
+                a->unique_bytes += a->current_chunk_size;
+        }
+
+        a->n_chunks++;
+
+        ca_digest_reset(a->digest);
+        a->current_chunk_size = 0;
+
+        return 0;
+}
+
+static int chunk_analyzer_feed(ChunkAnalyzer *a, const void *p, size_t l) {
+        int r;
+
+        assert(a);
+        assert(p || l == 0);
+
+        a->total_bytes += l;
+
+        while (l > 0) {
+                size_t k;
+
+                k = ca_chunker_scan(&a->chunker, p, l);
+                if (k == (size_t) -1) {
+                        ca_digest_write(a->digest, p, l);
+                        a->current_chunk_size += l;
+                        return 0;
+                }
+
+                ca_digest_write(a->digest, p, k);
+                a->current_chunk_size += k;
+
+                r = chunk_analyzer_cut(a);
+                if (r < 0)
+                        return r;
+
+                p = (const uint8_t*) p + k;
+                l -= k;
+        }
+
+        return 0;
+}
+
+static int verb_analyze(int argc, char *argv[]) {
+        ChunkAnalyzer analyzers[ELEMENTSOF(analyze_avg_sizes)] = {};
+        CaEncoder *e = NULL;
+        int r, input_fd = -1;
+        char *input = NULL;
+        struct stat st;
+        size_t i;
+
+        if (argc > 2) {
+                fprintf(stderr, "An input path expected.\n");
+                return -EINVAL;
+        }
+
+        if (argc > 1) {
+                input = ca_strip_file_url(argv[1]);
+                if (!input) {
+                        r = log_oom();
+                        goto finish;
+                }
+        } else {
+                input = strdup(".");
+                if (!input) {
+                        r = log_oom();
+                        goto finish;
+                }
+        }
+
+        input_fd = open(input, O_CLOEXEC|O_RDONLY|O_NOCTTY);
+        if (input_fd < 0) {
+                r = -errno;
+                fprintf(stderr, "Failed to open %s: %s\n", input, strerror(-r));
+                goto finish;
+        }
+
+        if (fstat(input_fd, &st) < 0) {
+                r = -errno;
+                fprintf(stderr, "Failed to stat input: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode)) {
+                fprintf(stderr, "Input is neither a directory, a regular file, nor a block device. Refusing.\n");
+                r = -EINVAL;
+                goto finish;
+        }
+
+        for (i = 0; i < ELEMENTSOF(analyzers); i++) {
+
+                r = ca_chunker_set_size(&analyzers[i].chunker, 0, analyze_avg_sizes[i], 0);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set chunk size: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_chunker_set_algorithm(&analyzers[i].chunker, arg_chunker);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set chunker algorithm: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_digest_new(CA_DIGEST_DEFAULT, &analyzers[i].digest);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to allocate digest: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        e = ca_encoder_new();
+        if (!e) {
+                r = log_oom();
+                goto finish;
+        }
+
+        r = ca_encoder_set_feature_flags(e, S_ISDIR(st.st_mode) ? CA_FORMAT_WITH_BEST : 0);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set feature flags: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        r = ca_encoder_set_base_fd(e, input_fd);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set encoder input: %s\n", strerror(-r));
+                goto finish;
+        }
+        input_fd = -1;
+
+        (void) send_notify("READY=1");
+
+        for (;;) {
+                int step;
+
+                if (quit) {
+                        fprintf(stderr, "Got exit signal, quitting.\n");
+                        r = -ESHUTDOWN;
+                        goto finish;
+                }
+
+                step = ca_encoder_step(e);
+                if (step < 0) {
+                        fprintf(stderr, "Failed to run encoder: %s\n", strerror(-step));
+                        r = step;
+                        goto finish;
+                }
+
+                if (step == CA_ENCODER_FINISHED)
+                        break;
+
+                if (IN_SET(step, CA_ENCODER_NEXT_FILE, CA_ENCODER_DONE_FILE, CA_ENCODER_PAYLOAD, CA_ENCODER_DATA)) {
+                        const void *p;
+                        size_t l;
+
+                        r = ca_encoder_get_data(e, &p, &l);
+                        if (r == -ENODATA)
+                                continue;
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to read archive data: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        for (i = 0; i < ELEMENTSOF(analyzers); i++) {
+                                r = chunk_analyzer_feed(&analyzers[i], p, l);
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to analyze chunk data: %s\n", strerror(-r));
+                                        goto finish;
+                                }
+                        }
+                }
+        }
+
+        /* Finish the trailing partial chunk of each setting */
+        for (i = 0; i < ELEMENTSOF(analyzers); i++)
+                if (analyzers[i].current_chunk_size > 0) {
+                        r = chunk_analyzer_cut(&analyzers[i]);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to analyze chunk data: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                }
+
+        printf("%10s %12s %14s %8s %16s\n",
+               "AVG-SIZE", "CHUNKS", "UNIQUE-CHUNKS", "DEDUP", "EST-STORE-BYTES");
+
+        for (i = 0; i < ELEMENTSOF(analyzers); i++) {
+                ChunkAnalyzer *a = analyzers + i;
+                double dedup;
+
+                dedup = a->total_bytes > 0 ? 100.0 * (1.0 - (double) a->unique_bytes / (double) a->total_bytes) : 0.0;
+
+                printf("%10zu %12" PRIu64 " %14" PRIu64 " %7.1f%% %16" PRIu64 "\n",
+                       analyze_avg_sizes[i],
+                       a->n_chunks,
+                       a->n_unique_chunks,
+                       dedup,
+                       a->unique_bytes);
+        }
+
+        if (arg_verbose)
+                printf("\nTotal bytes analyzed: %" PRIu64 "\n"
+                       "Estimated store size excludes compression; relative numbers are what matters.\n",
+                       analyzers[0].total_bytes);
+
+        r = 0;
+
+finish:
+        for (i = 0; i < ELEMENTSOF(analyzers); i++) {
+                ca_digest_free(analyzers[i].digest);
+                free(analyzers[i].seen);
+        }
+
+        ca_encoder_unref(e);
+
+        if (input_fd >= 3)
+                (void) close(input_fd);
+
+        free(input);
+
+        return r;
+}
+
+static int verb_mount(int argc, char *argv[]) {
+#if HAVE_FUSE
+        typedef enum MountOperation {
+                MOUNT_ARCHIVE,
+                MOUNT_ARCHIVE_INDEX,
+                _MOUNT_OPERATION_INVALID = -1,
+        } MountOperation;
+        MountOperation operation = _MOUNT_OPERATION_INVALID;
+        const char *mount_path = NULL;
+        int r, input_fd = -1;
+        char *input = NULL;
+        CaSync *s = NULL, *populate = NULL;
+
+        if (argc > 3 || argc < 2) {
+                fprintf(stderr, "An archive path/URL expected, followed by a mount path.\n");
+                return -EINVAL;
+        }
+
+        if (argc > 2) {
+                input = ca_strip_file_url(argv[1]);
+                if (!input) {
+                        r = log_oom();
+                        goto finish;
+                }
+
+                mount_path = argv[2];
+        } else
+                mount_path = argv[1];
+
+        if (arg_what == WHAT_ARCHIVE)
+                operation = MOUNT_ARCHIVE;
+        else if (arg_what == WHAT_ARCHIVE_INDEX)
+                operation = MOUNT_ARCHIVE_INDEX;
+        else if (arg_what != _WHAT_INVALID) {
+                fprintf(stderr, "\"mount\" operation may only be combined with --what=archive and --what=archive-index.\n");
+                r = -EINVAL;
+                goto finish;
+        }
+
+        if (operation == _MOUNT_OPERATION_INVALID && input && !streq(input, "-")) {
+                if (ca_locator_has_suffix(input, ".caidx"))
+                        operation = MOUNT_ARCHIVE_INDEX;
+        }
+
+        if (operation == _MOUNT_OPERATION_INVALID)
+                operation = MOUNT_ARCHIVE;
+
+        s = ca_sync_new_decode();
+        if (!s) {
+                r = log_oom();
+                goto finish;
+        }
+
+        if (!input || streq(input, "-"))
+                input_fd = STDIN_FILENO;
+
+        if (operation == MOUNT_ARCHIVE_INDEX) {
+                r = set_default_store(input);
+                if (r < 0)
+                        goto finish;
+        }
+
+        if (arg_rate_limit_bps != UINT64_MAX) {
+                r = ca_sync_set_rate_limit_bps(s, arg_rate_limit_bps);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set rate limit: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        if (arg_rate_limit_burst != 0) {
+                r = ca_sync_set_rate_limit_burst(s, arg_rate_limit_burst);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set rate limit burst: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        if (operation == MOUNT_ARCHIVE) {
+                if (input_fd >= 0)
+                        r = ca_sync_set_archive_fd(s, input_fd);
+                else
+                        r = ca_sync_set_archive_auto(s, input);
+
+        } else if (operation == MOUNT_ARCHIVE_INDEX) {
+                if (input_fd >= 0)
+                        r = ca_sync_set_index_fd(s, input_fd);
+                else
+                        r = ca_sync_set_index_auto(s, input);
+        } else
+                assert(false);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set sync input: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        input_fd = -1;
+
+        r = ca_sync_set_base_mode(s, S_IFDIR);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set base mode to directory: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        if (arg_store) {
+                r = ca_sync_set_store_auto(s, arg_store);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set store: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        r = load_seeds_and_extra_stores(s);
+        if (r < 0)
+                goto finish;
+
+        if (arg_lazy) {
+                /* Set up a second synchronizer that extracts the same archive to a real directory. It is
+                 * advanced whenever the mount is idle, and shares the mount's in-memory chunk cache, so
+                 * that chunks fetched for on-demand reads feed the materialization and vice versa. */
+
+                if (!input || streq(input, "-")) {
+                        fprintf(stderr, "Lazy population requires the archive as a path or URL, not standard input.\n");
+                        r = -EINVAL;
+                        goto finish;
+                }
+
+                populate = ca_sync_new_decode();
+                if (!populate) {
+                        r = log_oom();
+                        goto finish;
+                }
+
+                if (operation == MOUNT_ARCHIVE)
+                        r = ca_sync_set_archive_auto(populate, input);
+                else
+                        r = ca_sync_set_index_auto(populate, input);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set sync input: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_sync_set_base_mode(populate, S_IFDIR);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set base mode to directory: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_sync_set_base_path(populate, arg_lazy);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set target directory %s: %s\n", arg_lazy, strerror(-r));
+                        goto finish;
+                }
+
+                if (arg_store) {
+                        r = ca_sync_set_store_auto(populate, arg_store);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to set store: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                }
+
+                r = load_seeds_and_extra_stores(populate);
+                if (r < 0)
+                        goto finish;
+
+                r = load_feature_flags(populate, CA_FORMAT_WITH_MASK);
+                if (r < 0)
+                        goto finish;
+
+                r = ca_sync_set_punch_holes(populate, arg_punch_holes);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to configure hole punching: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_sync_set_reflink(populate, arg_reflink);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to configure reflinking: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_sync_set_hardlink(populate, arg_hardlink);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to configure hardlinking: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_sync_share_chunk_cache(populate, s);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to share chunk cache: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        r = ca_fuse_run(s, populate, input, mount_path, arg_mkdir);
+
+finish:
+        ca_sync_unref(populate);
+        ca_sync_unref(s);
+
+        if (input_fd >= 3)
+                (void) close(input_fd);
+
+        free(input);
+
+        return r;
+#else
+        fprintf(stderr, "Compiled without support for fuse.\n");
+        return -ENOSYS;
+#endif
+}
+
+static int verb_mkdev(int argc, char *argv[]) {
+
+        typedef enum MkDevOperation {
+                MKDEV_BLOB,
+                MKDEV_BLOB_INDEX,
+                _MKDEV_OPERATION_INVALID = -1,
+        } MkDevOperation;
+        MkDevOperation operation = _MKDEV_OPERATION_INVALID;
+        ReallocBuffer buffer = {};
+        CaBlockDevice *nbd = NULL;
+        const char *path = NULL, *name = NULL;
+        bool make_symlink = false, rm_symlink = false;
+        int r, input_fd = -1;
+        char *input = NULL;
+        CaSync *s = NULL;
+
+        if (argc > 3) {
+                fprintf(stderr, "An blob path/URL expected, possibly followed by a device or symlink name.\n");
+                return -EINVAL;
+        }
+
+        if (argc > 1) {
+                input = ca_strip_file_url(argv[1]);
+                if (!input) {
+                        r = log_oom();
+                        goto finish;
+                }
+        }
+
+        if (argc > 2)
+                name = argv[2];
+
+        if (arg_what == WHAT_BLOB)
+                operation = MKDEV_BLOB;
+        else if (arg_what == WHAT_BLOB_INDEX)
+                operation = MKDEV_BLOB_INDEX;
+        else if (arg_what != _WHAT_INVALID) {
+                fprintf(stderr, "\"mkdev\" operation may only be combined with --what=blob and --what=blob-index.\n");
+                r = -EINVAL;
+                goto finish;
+        }
+
+        if (operation == _MKDEV_OPERATION_INVALID && input && !streq(input, "-")) {
+                if (ca_locator_has_suffix(input, ".caibx"))
+                        operation = MKDEV_BLOB_INDEX;
+        }
+
+        if (operation == _MKDEV_OPERATION_INVALID)
+                operation = MKDEV_BLOB;
+
+        s = ca_sync_new_decode();
+        if (!s) {
+                r = log_oom();
+                goto finish;
+        }
+
+        if (!input || streq(input, "-"))
+                input_fd = STDIN_FILENO;
+
+        if (operation == MKDEV_BLOB_INDEX) {
+                r = set_default_store(input);
+                if (r < 0)
+                        goto finish;
+        }
+
+        if (arg_rate_limit_bps != UINT64_MAX) {
+                r = ca_sync_set_rate_limit_bps(s, arg_rate_limit_bps);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set rate limit: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        if (arg_rate_limit_burst != 0) {
+                r = ca_sync_set_rate_limit_burst(s, arg_rate_limit_burst);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set rate limit burst: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        if (operation == MKDEV_BLOB) {
+                if (input_fd >= 0)
+                        r = ca_sync_set_archive_fd(s, input_fd);
+                else
+                        r = ca_sync_set_archive_auto(s, input);
+
+        } else if (operation == MKDEV_BLOB_INDEX) {
+                if (input_fd >= 0)
+                        r = ca_sync_set_index_fd(s, input_fd);
+                else
+                        r = ca_sync_set_index_auto(s, input);
+        } else
+                assert(false);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set sync input: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        input_fd = -1;
+
+        r = ca_sync_set_base_mode(s, S_IFREG);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set base mode to regular file: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        if (arg_store) {
+                r = ca_sync_set_store_auto(s, arg_store);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set store: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        r = load_seeds_and_extra_stores(s);
+        if (r < 0)
+                goto finish;
+
+        nbd = ca_block_device_new();
+        if (!nbd) {
+                r = log_oom();
+                goto finish;
+        }
+
+        if (name) {
+                r = ca_block_device_test_nbd(name);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to test whether %s is an nbd device: %s\n", name, strerror(-r));
+                        goto finish;
+                } else if (r > 0) {
+                        r = ca_block_device_set_path(nbd, name);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to set device path to %s: %s\n", name, strerror(-r));
+                                goto finish;
+                        }
+                } else {
+                        const char *k;
+
+                        k = path_startswith(name, "/dev");
+                        if (k) {
+                                r = ca_block_device_set_friendly_name(nbd, k);
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to set friendly name to %s: %s\n", k, strerror(-r));
+                                        goto finish;
+                                }
+                        } else
+                                make_symlink = true;
+                }
+        }
+
+        /* First loop: process as enough so that we can figure out the size of the blob */
+        for (;;) {
+                uint64_t size;
+
+                if (quit) {
+                        r = 0;
+                        goto finish;
+                }
+
+                r = ca_sync_get_archive_size(s, &size);
+                if (r >= 0) {
+                        r = ca_block_device_set_size(nbd, (size + 511) & ~511);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to set NBD size: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                        break;
+                }
+                if (r == -ESPIPE) {
+                        fprintf(stderr, "Seekable archive required.\n");
+                        goto finish;
+                }
+                if (r != -EAGAIN) {
+                        fprintf(stderr, "Failed to determine archive size: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_sync_step(s);
+                if (r == -ENOMEDIUM) {
+                        fprintf(stderr, "File, URL or resource not found.\n");
+                        goto finish;
+                }
+                if (r < 0) {
+                        fprintf(stderr, "Failed to run synchronizer: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                switch (r) {
+
+                case CA_SYNC_FINISHED:
+                        fprintf(stderr, "Premature end of archive.\n");
+                        r = -EBADMSG;
+                        goto finish;
+
+                case CA_SYNC_STEP:
+                case CA_SYNC_PAYLOAD:
+                case CA_SYNC_SEED_NEXT_FILE:
+                case CA_SYNC_SEED_DONE_FILE:
+                case CA_SYNC_POLL:
+                        r = process_step_generic(s, r, true);
+                        if (r < 0)
+                                goto finish;
+                        break;
+
+                default:
+                        assert(false);
+                }
+        }
+
+        r = ca_block_device_open(nbd);
+        if (r < 0) {
+                fprintf(stderr, "Failed to open NBD device: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        r = ca_block_device_get_path(nbd, &path);
+        if (r < 0) {
+                fprintf(stderr, "Failed to determine NBD device path: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        if (make_symlink) {
+                if (symlink(path, name) < 0) {
+                        r = -errno;
+                        fprintf(stderr, "Failed to create symlink %s → %s: %s\n", name, path, strerror(-r));
+                        goto finish;
+                }
+
+                rm_symlink = true;
+        }
+
+        printf("Attached: %s\n", name ?: path);
+
+        (void) send_notify("READY=1");
+
+        for (;;) {
+                uint64_t req_offset = 0, req_size = 0;
+
+                if (quit) {
+                        r = 0; /* for the "mkdev" verb quitting does not indicate an incomplete operation, hence return success */
+                        goto finish;
+                }
+
+                r = ca_block_device_step(nbd);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to read NBD request: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                if (r == CA_BLOCK_DEVICE_CLOSED)
+                        break;
+
+                if (r == CA_BLOCK_DEVICE_POLL) {
+                        sigset_t ss;
+
+                        block_exit_handler(SIG_BLOCK, &ss);
+
+                        if (quit)
+                                r = -ESHUTDOWN;
+                        else {
+                                r = ca_block_device_poll(nbd, UINT64_MAX, &ss);
+                                if ((r == -EINTR || r >= 0) && quit)
+                                        r = -ESHUTDOWN;
+                        }
+
+                        block_exit_handler(SIG_UNBLOCK, NULL);
+
+                        if (r == -ESHUTDOWN) {
+                                r = 0;
+                                goto finish;
+                        } else if (r < 0) {
+                                fprintf(stderr, "Failed to poll for NBD requests: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        continue;
+                }
+
+                assert(r == CA_BLOCK_DEVICE_REQUEST);
+
+                r = ca_block_device_get_request_offset(nbd, &req_offset);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to get NBD request offset: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_block_device_get_request_size(nbd, &req_size);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to get NBD request size: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_sync_seek_offset(s, req_offset);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to seek: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                realloc_buffer_empty(&buffer);
+
+                for (;;) {
+                        bool done = false;
+
+                        if (quit) {
+                                r = 0;
+                                goto finish;
+                        }
+
+                        r = ca_sync_step(s);
+                        if (r == -ENOMEDIUM) {
+                                fprintf(stderr, "File, URL or resource not found.\n");
+                                goto finish;
+                        }
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to run synchronizer: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        switch (r) {
+
+                        case CA_SYNC_FINISHED:
+                                /* We hit EOF but the reply is not yet completed, in this case, fill up with zeroes */
+
+                                assert(realloc_buffer_size(&buffer) < req_size);
+
+                                if (!realloc_buffer_extend0(&buffer, req_size - realloc_buffer_size(&buffer))) {
+                                        r = log_oom();
+                                        goto finish;
+                                }
+
+                                r = ca_block_device_put_data(nbd, req_offset, realloc_buffer_data(&buffer), req_size);
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to send reply: %s\n", strerror(-r));
+                                        goto finish;
+                                }
+
+                                r = realloc_buffer_advance(&buffer, req_size);
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to advance buffer: %s\n", strerror(-r));
+                                        goto finish;
+                                }
+
+                                done = true;
+                                break;
+
+                        case CA_SYNC_PAYLOAD: {
+                                const void *p;
+                                size_t sz;
+
+                                r = ca_sync_get_payload(s, &p, &sz);
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to retrieve synchronizer payload: %s\n", strerror(-r));
+                                        goto finish;
+                                }
+
+                                if (realloc_buffer_size(&buffer) == 0 && sz >= req_size) {
+                                        /* If this is a full reply, then propagate this directly */
+
+                                        r = ca_block_device_put_data(nbd, req_offset, p, MIN(sz, req_size));
+                                        if (r < 0) {
+                                                fprintf(stderr, "Failed to send reply: %s\n", strerror(-r));
+                                                goto finish;
+                                        }
+
+                                        done = true;
+
+                                } else {
+
+                                        if (!realloc_buffer_append(&buffer, p, sz)) {
+                                                r = log_oom();
+                                                goto finish;
+                                        }
+
+                                        if (realloc_buffer_size(&buffer) >= req_size) {
+                                                r = ca_block_device_put_data(nbd, req_offset, realloc_buffer_data(&buffer), req_size);
+                                                if (r < 0) {
+                                                        fprintf(stderr, "Failed to send reply: %s\n", strerror(-r));
+                                                        goto finish;
+                                                }
+
+                                                r = realloc_buffer_advance(&buffer, req_size);
+                                                if (r < 0) {
+                                                        fprintf(stderr, "Failed to advance buffer: %s\n", strerror(-r));
+                                                        goto finish;
+                                                }
+
+                                                done = true;
+                                        }
+                                }
+
+                                break;
+                        }
+
+                        case CA_SYNC_STEP:
+                        case CA_SYNC_SEED_NEXT_FILE:
+                        case CA_SYNC_SEED_DONE_FILE:
+                        case CA_SYNC_POLL:
+                        case CA_SYNC_FOUND:
+                        case CA_SYNC_NOT_FOUND:
+                                r = process_step_generic(s, r, true);
+                                if (r == -ESHUTDOWN) {
+                                        r = 0;
+                                        goto finish;
+                                }
+                                if (r < 0)
+                                        goto finish;
+
+                                break;
+
+                        default:
+                                assert(false);
+                        }
+
+                        if (done)
+                                break;
+                }
+        }
+
+finish:
+        realloc_buffer_free(&buffer);
+
+        ca_sync_unref(s);
+        ca_block_device_unref(nbd);
+
+        if (rm_symlink)
+                (void) unlink(name);
+
+        if (input_fd >= 3)
+                (void) close(input_fd);
+
+        free(input);
+
+        return r;
+}
+
+static void free_stores(CaStore **stores, size_t n_stores) {
+        size_t i;
+
+        assert(stores || n_stores == 0);
+
+        for (i = 0; i < n_stores; i++)
+                ca_store_unref(stores[i]);
+        free(stores);
+}
+
+static int allocate_stores(
+                const char *wstore_path,
+                char **rstore_paths,
+                size_t n_rstores,
+                CaStore ***ret,
+                size_t *ret_n) {
+
+        CaStore **stores = NULL;
+        size_t n_stores, n = 0;
+        char **rstore_path;
+        int r;
+
+        assert(ret);
+        assert(ret_n);
+
+        n_stores = !!wstore_path + n_rstores;
+
+        if (n_stores > 0) {
+                stores = new0(CaStore*, n_stores);
+                if (!stores) {
+                        r = log_oom();
+                        goto fail;
+                }
+        }
+
+        if (wstore_path) {
+                stores[n] = ca_store_new();
+                if (!stores[n]) {
+                        r = log_oom();
+                        goto fail;
+                }
+                n++;
+
+                r = ca_store_set_path(stores[n-1], wstore_path);
+                if (r < 0) {
+                        fprintf(stderr, "Unable to set store path %s: %s\n", wstore_path, strerror(-r));
+                        goto fail;
+                }
+        }
+
+        STRV_FOREACH(rstore_path, rstore_paths) {
+                stores[n] = ca_store_new();
+                if (!stores[n]) {
+                        r = log_oom();
+                        goto fail;
+                }
+                n++;
+
+                r = ca_store_set_path(stores[n-1], *rstore_path);
+                if (r < 0) {
+                        fprintf(stderr, "Unable to set store path %s: %s\n", *rstore_path, strerror(-r));
+                        goto fail;
+                }
+        }
+
+        *ret = stores;
+        *ret_n = n;
+
+        return 0;
+
+fail:
+        free_stores(stores, n);
+
+        return r;
+}
+
+static int store_bloom_scan(const char *path, CaBloom *bloom, uint64_t *n) {
+        const char *pack_path;
+        DIR *d;
+        int r;
+
+        assert(path);
+
+        /* Enumerates all chunk IDs in the store at the specified path, either counting them (bloom is NULL)
+         * or adding them to the specified filter. Covers both loose chunks and pack files, lest the filter
+         * produces false negatives. */
+
+        d = opendir(path);
+        if (!d)
+                return -errno;
+
+        for (;;) {
+                struct dirent *de;
+                DIR *sd;
+
+                errno = 0;
+                de = readdir(d);
+                if (!de) {
+                        if (errno != 0) {
+                                r = -errno;
+                                goto fail;
+                        }
+                        break;
+                }
+
+                if (strlen(de->d_name) != 4 ||
+                    strspn(de->d_name, "0123456789abcdef") != 4)
+                        continue;
+
+                r = xopendirat(dirfd(d), de->d_name, O_NOFOLLOW, &sd);
+                if (r == -ENOENT)
+                        continue;
+                if (r < 0)
+                        goto fail;
+
+                for (;;) {
+                        char name[CA_CHUNK_ID_FORMAT_MAX];
+                        struct dirent *se;
+                        const char *e;
+                        CaChunkID id;
+                        size_t k;
+
+                        errno = 0;
+                        se = readdir(sd);
+                        if (!se) {
+                                if (errno != 0) {
+                                        r = -errno;
+                                        closedir(sd);
+                                        goto fail;
+                                }
+                                break;
+                        }
+
+                        if (dot_or_dot_dot(se->d_name))
+                                continue;
+
+                        /* Accept both compressed and uncompressed chunk file names, skip everything else */
+                        e = endswith(se->d_name, ca_compressed_chunk_suffix());
+                        k = e ? (size_t) (e - se->d_name) : strlen(se->d_name);
+                        if (k != CA_CHUNK_ID_FORMAT_MAX - 1)
+                                continue;
+
+                        memcpy(name, se->d_name, k);
+                        name[k] = 0;
+
+                        if (!ca_chunk_id_parse(name, &id))
+                                continue;
+
+                        if (bloom) {
+                                r = ca_bloom_add(bloom, &id);
+                                if (r < 0) {
+                                        closedir(sd);
+                                        goto fail;
+                                }
+                        }
+                        if (n)
+                                (*n)++;
+                }
+
+                closedir(sd);
+        }
+
+        closedir(d);
+        d = NULL;
+
+        pack_path = strjoina(path, "/pack");
+        if (access(pack_path, F_OK) >= 0) {
+                uint64_t idx = 0;
+                CaChunkID id;
+                CaPack *pack;
+
+                pack = ca_pack_new();
+                if (!pack)
+                        return -ENOMEM;
+
+                r = ca_pack_set_path(pack, pack_path);
+                if (r < 0) {
+                        ca_pack_unref(pack);
+                        return r;
+                }
+
+                for (;;) {
+                        r = ca_pack_iterate(pack, &idx, &id);
+                        if (r <= 0)
+                                break;
+
+                        if (bloom) {
+                                r = ca_bloom_add(bloom, &id);
+                                if (r < 0)
+                                        break;
+                        }
+                        if (n)
+                                (*n)++;
+                }
+
+                ca_pack_unref(pack);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+
+fail:
+        if (d)
+                closedir(d);
+        return r;
+}
+
+static int make_stores_bloom(const char *wstore_path, char *extra_stores[], int n_extra_stores, CaBloom **ret) {
+        CaBloom *bloom;
+        uint64_t n = 0;
+        int r, i;
+
+        assert(ret);
+
+        /* Builds a bloom filter covering the chunk IDs of all stores we serve chunks from, so that the peer
+         * can skip round trips for chunks we definitely don't have. One enumeration pass to size the filter,
+         * a second one to populate it. */
+
+        if (wstore_path) {
+                r = store_bloom_scan(wstore_path, NULL, &n);
+                if (r < 0)
+                        return r;
+        }
+        for (i = 0; i < n_extra_stores; i++) {
+                r = store_bloom_scan(extra_stores[i], NULL, &n);
+                if (r < 0)
+                        return r;
+        }
+
+        bloom = ca_bloom_new(n);
+        if (!bloom)
+                return -ENOMEM;
+
+        if (wstore_path) {
+                r = store_bloom_scan(wstore_path, bloom, NULL);
+                if (r < 0)
+                        goto fail;
+        }
+        for (i = 0; i < n_extra_stores; i++) {
+                r = store_bloom_scan(extra_stores[i], bloom, NULL);
+                if (r < 0)
+                        goto fail;
+        }
+
+        *ret = bloom;
+        return 0;
+
+fail:
+        ca_bloom_unref(bloom);
+        return r;
+}
+
+static int verb_pull(int argc, char *argv[]) {
+        const char *base_path, *archive_path, *index_path, *wstore_path;
+        size_t n_stores = 0, i;
+        CaStore **stores = NULL;
+        CaRemote *rr;
+        int r;
+
+        if (argc < 5) {
+                fprintf(stderr, "Expected at least 5 arguments.\n");
+                return -EINVAL;
+        }
+
+        base_path = empty_or_dash_to_null(argv[1]);
+        archive_path = empty_or_dash_to_null(argv[2]);
+        index_path = empty_or_dash_to_null(argv[3]);
+        wstore_path = empty_or_dash_to_null(argv[4]);
+
+        n_stores = !!wstore_path + (argc - 5);
+
+        if (base_path) {
+                fprintf(stderr, "Pull from base or archive not yet supported.\n");
+                return -EOPNOTSUPP;
+        }
+
+        if (!archive_path && !index_path && n_stores == 0) {
+                fprintf(stderr, "Nothing to do.\n");
+                return -EINVAL;
+        }
+
+        /* fprintf(stderr, "pull archive: %s index: %s wstore: %s\n", strna(archive_path), strna(index_path), strna(wstore_path)); */
+
+        rr = ca_remote_new();
+        if (!rr)
+                return log_oom();
+
+        r = ca_remote_set_local_feature_flags(rr,
+                                              (n_stores > 0 ? CA_PROTOCOL_READABLE_STORE : 0) |
+                                              (index_path ? CA_PROTOCOL_READABLE_INDEX : 0) |
+                                              (archive_path ? CA_PROTOCOL_READABLE_ARCHIVE : 0));
+        if (r < 0) {
+                fprintf(stderr, "Failed to set feature flags: %s\n", strerror(-r));
+                return r;
+        }
+
+        if (arg_rate_limit_bps != UINT64_MAX) {
+                r = ca_remote_set_rate_limit_bps(rr, arg_rate_limit_bps);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set rate limit: %s\n", strerror(-r));
+                        return r;
+                }
+        }
+
+        if (arg_rate_limit_burst != 0) {
+                r = ca_remote_set_rate_limit_burst(rr, arg_rate_limit_burst);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set rate limit burst: %s\n", strerror(-r));
+                        return r;
+                }
+        }
+
+        if (arg_verify != CA_REMOTE_VERIFY_FULL) {
+                r = ca_remote_set_verify(rr, arg_verify);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set verification policy: %s\n", strerror(-r));
+                        return r;
+                }
+        }
+
+        r = ca_remote_set_compression_type(rr, arg_compression);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set compression type: %s\n", strerror(-r));
+                return r;
+        }
+
+        r = ca_remote_set_io_fds(rr, STDIN_FILENO, STDOUT_FILENO);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set I/O file descriptors: %s\n", strerror(-r));
+                return r;
+        }
+
+        if (index_path) {
+                r = ca_remote_set_index_path(rr, index_path);
+                if (r < 0) {
+                        fprintf(stderr, "Unable to set index file %s: %s\n", index_path, strerror(-r));
+                        goto finish;
+                }
+        }
+
+        if (archive_path) {
+                r = ca_remote_set_archive_path(rr, archive_path);
+                if (r < 0) {
+                        fprintf(stderr, "Unable to set archive file %s: %s\n", archive_path, strerror(-r));
+                        goto finish;
+                }
+        }
+
+        r = allocate_stores(wstore_path, argv + 5, argc - 5, &stores, &n_stores);
+        if (r < 0)
+                goto finish;
+
+        if (n_stores > 0) {
+                CaBloom *bloom = NULL;
+
+                /* Best effort: without a filter the peer simply pays a round trip per negative lookup */
+                r = make_stores_bloom(wstore_path, argv + 5, argc - 5, &bloom);
+                if (r < 0)
+                        fprintf(stderr, "Failed to build chunk ID bloom filter, ignoring: %s\n", strerror(-r));
+                else {
+                        r = ca_remote_set_bloom(rr, bloom);
+                        if (r < 0) {
+                                ca_bloom_unref(bloom);
+                                fprintf(stderr, "Failed to pass bloom filter to remoting engine: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                }
+        }
+
+        for (;;) {
+                unsigned put_count;
+                sigset_t ss;
+                int step;
+
+                if (quit) {
+                        fprintf(stderr, "Got exit signal, quitting.\n");
+                        r = -ESHUTDOWN;
+                        goto finish;
+                }
+
+                step = ca_remote_step(rr);
+                if (step == -EPIPE || step == CA_REMOTE_FINISHED) /* When somebody pulls from us, he's welcome to terminate any time he likes */
+                        break;
+                if (step < 0) {
+                        fprintf(stderr, "Failed to process remote: %s\n", strerror(-step));
+                        r = step;
+                        goto finish;
+                }
+
+                put_count = 0;
+                for (;;) {
+                        CaChunkCompression compression;
+                        bool found = false;
+                        const void *p;
+                        CaChunkID id;
+                        uint64_t l;
+
+                        r = ca_remote_can_put_chunk(rr);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to determine whether there's buffer space for sending: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                        if (r == 0) /* No space to put more */
+                                break;
+
+                        r = ca_remote_next_request(rr, &id);
+                        if (r == -ENODATA) /* No data requested */
+                                break;
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to determine which chunk to send next: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        for (i = 0; i < n_stores; i++) {
+                                /* If the peer uses the same compression algorithm as we do, serve chunks
+                                 * in whatever encoding they are stored in, skipping the transcoder */
+                                r = ca_store_get(stores[i], &id,
+                                                 ca_remote_no_transcode(rr) > 0 ? CA_CHUNK_AS_IS : CA_CHUNK_COMPRESSED,
+                                                 &p, &l, &compression);
+                                if (r >= 0) {
+                                        found = true;
+                                        break;
+                                }
+                                if (r != -ENOENT) {
+                                        fprintf(stderr, "Failed to query store: %s\n", strerror(-r));
+                                        goto finish;
+                                }
+                        }
+
+                        if (found)
+                                r = ca_remote_put_chunk(rr, &id, compression, p, l);
+                        else
+                                r = ca_remote_put_missing(rr, &id);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to enqueue response: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        put_count ++;
+                }
+
+                if (put_count > 0) /* We enqueued more, let's do another step, maybe the remoter wants to write this mow */
+                        continue;
+
+                if (step != CA_REMOTE_POLL)
+                        continue;
+
+                block_exit_handler(SIG_BLOCK, &ss);
+
+                if (quit)
+                        r = -ESHUTDOWN;
+                else {
+                        r = ca_remote_poll(rr, UINT64_MAX, &ss);
+                        if ((r == -EINTR || r >= 0) && quit)
+                                r = -ESHUTDOWN;
+                }
+
+                block_exit_handler(SIG_UNBLOCK, NULL);
+
+                if (r == -ESHUTDOWN) {
+                        fprintf(stderr, "Got exit signal, quitting.\n");
+                        goto finish;
+                }
+                if (r < 0) {
+                        fprintf(stderr, "Failed to poll remoting engine: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        r = 0;
+
+finish:
+        free_stores(stores, n_stores);
+        ca_remote_unref(rr);
+
+        return r;
+}
+
+static int verb_push(int argc, char *argv[]) {
+
+        const char *base_path, *archive_path, *index_path, *wstore_path;
+        bool index_processed = false, index_written = false, archive_written = false;
+        CaStore **stores = NULL;
+        CaIndex *index = NULL;
+        CaRemote *rr = NULL;
+        size_t n_stores = 0;
+        int r;
+
+        if (argc < 5) {
+                fprintf(stderr, "Expected at least 5 arguments.\n");
+                return -EINVAL;
+        }
+
+        base_path = empty_or_dash_to_null(argv[1]);
+        archive_path = empty_or_dash_to_null(argv[2]);
+        index_path = empty_or_dash_to_null(argv[3]);
+        wstore_path = empty_or_dash_to_null(argv[4]);
+
+        n_stores = !!wstore_path + (argc - 5);
+
+        if (base_path) {
+                fprintf(stderr, "Push to base not yet supported.\n");
+                return -EOPNOTSUPP;
+        }
+
+        if (!archive_path && !index_path && n_stores == 0) {
+                fprintf(stderr, "Nothing to do.\n");
+                return -EINVAL;
+        }
+
+        /* fprintf(stderr, "push archive: %s index: %s wstore: %s\n", strna(archive_path), strna(index_path), strna(wstore_path)); */
+
+        rr = ca_remote_new();
+        if (!rr)
+                return log_oom();
+
+        r = ca_remote_set_local_feature_flags(rr,
+                                              (wstore_path ? CA_PROTOCOL_WRITABLE_STORE : 0) |
+                                              (index_path ? CA_PROTOCOL_WRITABLE_INDEX : 0) |
+                                              (archive_path ? CA_PROTOCOL_WRITABLE_ARCHIVE : 0));
+        if (r < 0) {
+                fprintf(stderr, "Failed to set feature flags: %s\n", strerror(-r));
+                return r;
+        }
+
+        if (arg_rate_limit_bps != UINT64_MAX) {
+                r = ca_remote_set_rate_limit_bps(rr, arg_rate_limit_bps);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set rate limit: %s\n", strerror(-r));
+                        return r;
+                }
+        }
+
+        if (arg_rate_limit_burst != 0) {
+                r = ca_remote_set_rate_limit_burst(rr, arg_rate_limit_burst);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set rate limit burst: %s\n", strerror(-r));
+                        return r;
+                }
+        }
+
+        if (arg_verify != CA_REMOTE_VERIFY_FULL) {
+                r = ca_remote_set_verify(rr, arg_verify);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set verification policy: %s\n", strerror(-r));
+                        return r;
+                }
+        }
+
+        r = ca_remote_set_compression_type(rr, arg_compression);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set compression type: %s\n", strerror(-r));
+                return r;
+        }
+
+        r = ca_remote_set_io_fds(rr, STDIN_FILENO, STDOUT_FILENO);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set I/O file descriptors: %s\n", strerror(-r));
+                return r;
+        }
+
+        if (index_path) {
+                index = ca_index_new_incremental_read();
+                if (!index) {
+                        r = log_oom();
+                        goto finish;
+                }
+
+                r = ca_index_set_path(index, index_path);
+                if (r < 0) {
+                        fprintf(stderr, "Unable to set index file %s: %s\n", index_path, strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_index_open(index);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to open index file %s: %s\n", index_path, strerror(-r));
+                        goto finish;
+                }
+        }
+
+        if (archive_path) {
+                r = ca_remote_set_archive_path(rr, archive_path);
+                if (r < 0) {
+                        fprintf(stderr, "Unable to set archive file %s: %s\n", archive_path, strerror(-r));
+                        goto finish;
+                }
+        }
+
+        r = allocate_stores(wstore_path, argv + 5, argc - 5, &stores, &n_stores);
+        if (r < 0)
+                goto finish;
+
+        for (;;) {
+                bool finished;
+                int step;
+
+                if (quit) {
+                        fprintf(stderr, "Got exit signal, quitting.\n");
+                        r = -ESHUTDOWN;
+                        goto finish;
+                }
+
+                step = ca_remote_step(rr);
+                if (step < 0) {
+                        fprintf(stderr, "Failed to process remote: %s\n", strerror(-step));
+                        r = step;
+                        goto finish;
+                }
+
+                if (step == CA_REMOTE_FINISHED)
+                        break;
+
+                switch (step) {
+
+                case CA_REMOTE_POLL: {
+                        sigset_t ss;
+
+                        block_exit_handler(SIG_BLOCK, &ss);
+
+                        if (quit)
+                                r = -ESHUTDOWN;
+                        else {
+                                r = ca_remote_poll(rr, UINT64_MAX, &ss);
+                                if ((r == -EINTR || r >= 0) && quit)
+                                        r = -ESHUTDOWN;
+                        }
+
+                        block_exit_handler(SIG_UNBLOCK, NULL);
+
+                        if (r == -ESHUTDOWN) {
+                                fprintf(stderr, "Got exit signal, quitting.\n");
+                                goto finish;
+                        }
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to run remoting engine: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        break;
+                }
+
+                case CA_REMOTE_STEP:
+                case CA_REMOTE_READ_ARCHIVE:
+                        break;
+
+                case CA_REMOTE_READ_ARCHIVE_EOF:
+                        archive_written = true;
+                        break;
+
+                case CA_REMOTE_READ_INDEX: {
+                        const void *p;
+                        size_t n;
+
+                        r = ca_remote_read_index(rr, &p, &n);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to read index data: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        r = ca_index_incremental_write(index, p, n);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to write index data: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        break;
+                }
+
+                case CA_REMOTE_READ_INDEX_EOF:
+                        r = ca_index_incremental_eof(index);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to write index EOF: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        index_written = true;
+                        break;
+
+                case CA_REMOTE_CHUNK: {
+                        CaChunkCompression compression;
+                        const void *p;
+                        CaChunkID id;
+                        size_t n;
+
+                        r = ca_remote_next_chunk(rr, CA_CHUNK_AS_IS, &id, &p, &n, &compression);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to determine most recent chunk: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        r = ca_store_put(stores[0], &id, compression, p, n); /* Write to wstore */
+                        if (r < 0 && r != -EEXIST) {
+                                fprintf(stderr, "Failed to write chunk to store: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        r = ca_remote_forget_chunk(rr, &id);
+                        if (r < 0 && r != -ENOENT) {
+                                fprintf(stderr, "Failed to forget chunk: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        break;
+                }
+
+                default:
+                        assert(false);
+                }
+
+                /* Request all chunks from the client that the index it just send us listed but we don't have locally yet. */
+                for (;;) {
+                        /* char ids[CA_CHUNK_ID_FORMAT_MAX]; */
+                        uint64_t remote_flags;
+                        CaChunkID id;
+                        size_t i;
+
+                        if (!index)
+                                break;
+                        if (index_processed)
+                                break;
+                        if (!wstore_path)
+                                break;
+
+                        r = ca_remote_get_remote_feature_flags(rr, &remote_flags);
+                        if (r == -ENODATA)
+                                break;
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to get remote feature flags: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        /* Only request chunks if this is requested by the client side */
+                        if ((remote_flags & CA_PROTOCOL_PUSH_INDEX_CHUNKS) == 0) {
+                                index_processed = true;
+                                break;
+                        }
+
+                        r = ca_index_read_chunk(index, &id, NULL, NULL);
+                        if (r == -EAGAIN) /* Not read enough yet */
+                                break;
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to read index: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                        if (r == 0) { /* EOF */
+                                index_processed = true;
+                                break;
+                        }
+
+                        /* fprintf(stderr, "Need %s\n", ca_chunk_id_format(&id, ids)); */
+
+                        r = 0;
+                        for (i = 0; i < n_stores; i++) {
+                                r = ca_store_has(stores[i], &id);
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to test whether chunk exists locally already: %s\n", strerror(-r));
+                                        goto finish;
+                                }
+                                if (r > 0)
+                                        break;
+                        }
+                        if (r > 0) {
+                                /* fprintf(stderr, "Already have %s\n", ca_chunk_id_format(&id, ids)); */
+                                continue;
+                        }
+
+                        /* fprintf(stderr, "Requesting %s\n", ca_chunk_id_format(&id, ids)); */
+
+                        r = ca_remote_request_async(rr, &id, CA_REMOTE_PRIORITY_BACKGROUND);
+                        if (r < 0 && r != -EALREADY && r != -EAGAIN) {
+                                fprintf(stderr, "Failed to request chunk: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        /* if (r > 0) */
+                        /*         fprintf(stderr, "New request for %s\n", ca_chunk_id_format(&id, ids)); */
+                }
+
+                finished = true;
+
+                /* If the index isn't written yet, don't finish yet */
+                if (index_path && (!index_written || !index_processed))
+                        finished = false;
+
+                /* If the archive isn't written yet, don't finish yet */
+                if (archive_path && !archive_written)
+                        finished = false;
+
+                /* If there are any chunks queued still, don't finish yet */
+                r = ca_remote_has_chunks(rr);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to determine if further requests are pending: %s\n", strerror(-r));
+                        goto finish;
+                }
+                if (r > 0)
+                        finished = false;
+
+                if (finished) {
+                        r = ca_remote_goodbye(rr);
+                        if (r < 0 && r != -EALREADY) {
+                                fprintf(stderr, "Failed to enqueue goodbye: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                }
+        }
+
+        if (index) {
+                r = ca_index_install(index);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to install index on location: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        r = 0;
+
+finish:
+        free_stores(stores, n_stores);
+        ca_remote_unref(rr);
+        ca_index_unref(index);
+
+        return r;
+}
+
+/* The "prefetch" verb: walk an index and pull every chunk it lists that's not in the local chunk
+ * directory yet, at background priority, without attaching a decoder. Devices that know ahead of time
+ * which image they'll install can run this off-peak, so the actual update window later shrinks to pure
+ * local extraction time. */
+
+static int verb_prefetch(int argc, char *argv[]) {
+
+        uint64_t n_fetched = 0, n_present = 0;
+        bool index_processed = false;
+        CaIndex *index = NULL;
+        CaStore *store = NULL;
+        CaRemote *rr = NULL;
+        char *input = NULL;
+        int r;
+
+        if (argc != 2) {
+                fprintf(stderr, "An index file expected.\n");
+                return -EINVAL;
+        }
+
+        input = ca_strip_file_url(argv[1]);
+        if (!input)
+                return log_oom();
+
+        r = set_default_store(input);
+        if (r < 0)
+                goto finish;
+
+        if (!arg_store) {
+                fprintf(stderr, "Prefetching requires a store to pull from, please use --store= to set one.\n");
+                r = -EINVAL;
+                goto finish;
+        }
+
+        if (ca_classify_locator(arg_store) == CA_LOCATOR_PATH) {
+                fprintf(stderr, "Prefetching only makes sense from a remote store: %s\n", arg_store);
+                r = -EINVAL;
+                goto finish;
+        }
+
+        if (!arg_cache) {
+                fprintf(stderr, "Prefetching requires a local chunk directory to fill, please use --cache= to set one.\n");
+                r = -EINVAL;
+                goto finish;
+        }
+
+        index = ca_index_new_read();
+        if (!index) {
+                r = log_oom();
+                goto finish;
+        }
+
+        r = ca_index_set_path(index, input);
+        if (r < 0) {
+                fprintf(stderr, "Unable to set index file %s: %s\n", input, strerror(-r));
+                goto finish;
+        }
+
+        r = ca_index_open(index);
+        if (r < 0) {
+                fprintf(stderr, "Failed to open index file %s: %s\n", input, strerror(-r));
+                goto finish;
+        }
+
+        store = ca_store_new();
+        if (!store) {
+                r = log_oom();
+                goto finish;
+        }
+
+        r = ca_store_set_path(store, arg_cache);
+        if (r < 0) {
+                fprintf(stderr, "Unable to set store %s: %s\n", arg_cache, strerror(-r));
+                goto finish;
+        }
+
+        rr = ca_remote_new();
+        if (!rr) {
+                r = log_oom();
+                goto finish;
+        }
+
+        r = ca_remote_set_local_feature_flags(rr, CA_PROTOCOL_PULL_CHUNKS);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set feature flags: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        if (arg_rate_limit_bps != UINT64_MAX) {
+                r = ca_remote_set_rate_limit_bps(rr, arg_rate_limit_bps);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set rate limit: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        if (arg_rate_limit_burst != 0) {
+                r = ca_remote_set_rate_limit_burst(rr, arg_rate_limit_burst);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set rate limit burst: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        if (arg_verify != CA_REMOTE_VERIFY_FULL) {
+                r = ca_remote_set_verify(rr, arg_verify);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set verification policy: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        r = ca_remote_set_compression_type(rr, arg_compression);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set compression type: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        r = ca_remote_set_store_url(rr, arg_store);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set store %s: %s\n", arg_store, strerror(-r));
+                goto finish;
+        }
+
+        (void) send_notify("READY=1");
+
+        for (;;) {
+                bool finished;
+                int step;
+
+                if (quit) {
+                        fprintf(stderr, "Got exit signal, quitting.\n");
+                        r = -ESHUTDOWN;
+                        goto finish;
+                }
+
+                step = ca_remote_step(rr);
+                if (step < 0) {
+                        fprintf(stderr, "Failed to process remote: %s\n", strerror(-step));
+                        r = step;
+                        goto finish;
+                }
+
+                if (step == CA_REMOTE_FINISHED)
+                        break;
+
+                switch (step) {
+
+                case CA_REMOTE_POLL: {
+                        sigset_t ss;
+
+                        block_exit_handler(SIG_BLOCK, &ss);
+
+                        if (quit)
+                                r = -ESHUTDOWN;
+                        else {
+                                r = ca_remote_poll(rr, UINT64_MAX, &ss);
+                                if ((r == -EINTR || r >= 0) && quit)
+                                        r = -ESHUTDOWN;
+                        }
+
+                        block_exit_handler(SIG_UNBLOCK, NULL);
+
+                        if (r == -ESHUTDOWN) {
+                                fprintf(stderr, "Got exit signal, quitting.\n");
+                                goto finish;
+                        }
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to run remoting engine: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        break;
+                }
+
+                case CA_REMOTE_STEP:
+                case CA_REMOTE_REQUEST:
+                        break;
+
+                case CA_REMOTE_CHUNK: {
+                        CaChunkCompression compression;
+                        const void *p;
+                        CaChunkID id;
+                        size_t n;
+
+                        r = ca_remote_next_chunk(rr, CA_CHUNK_AS_IS, &id, &p, &n, &compression);
+                        if (r == -EADDRNOTAVAIL) {
+                                char ids[CA_CHUNK_ID_FORMAT_MAX];
+
+                                r = ca_remote_next_chunk(rr, CA_CHUNK_AS_IS, &id, NULL, NULL, NULL);
+                                if (r >= 0) {
+                                        fprintf(stderr, "Chunk %s missing on remote store.\n", ca_chunk_id_format(&id, ids));
+                                        r = -ENOENT;
+                                }
+
+                                goto finish;
+                        }
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to determine most recent chunk: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        r = ca_store_put(store, &id, compression, p, n);
+                        if (r < 0 && r != -EEXIST) {
+                                fprintf(stderr, "Failed to write chunk to store: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        r = ca_remote_forget_chunk(rr, &id);
+                        if (r < 0 && r != -ENOENT) {
+                                fprintf(stderr, "Failed to forget chunk: %s\n", strerror(-r));
+                                goto finish;
+                        }
+
+                        n_fetched++;
+                        break;
+                }
+
+                default:
+                        assert(false);
+                }
+
+                /* Keep the background request lane fed with everything the index lists but the local
+                 * directory lacks. */
+                for (;;) {
+                        CaChunkID id;
+
+                        if (index_processed)
+                                break;
+
+                        r = ca_index_read_chunk(index, &id, NULL, NULL);
+                        if (r == -EAGAIN) /* Not read enough yet */
+                                break;
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to read index: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                        if (r == 0) { /* EOF */
+                                index_processed = true;
+                                break;
+                        }
+
+                        r = ca_store_has(store, &id);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to test whether chunk exists locally already: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                        if (r > 0) {
+                                n_present++;
+                                continue;
+                        }
+
+                        r = ca_remote_request_async(rr, &id, CA_REMOTE_PRIORITY_BACKGROUND);
+                        if (r < 0 && r != -EALREADY && r != -EAGAIN) {
+                                fprintf(stderr, "Failed to request chunk: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                }
+
+                finished = index_processed;
+
+                /* If there are any chunks queued still, don't finish yet */
+                r = ca_remote_has_chunks(rr);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to determine if further requests are pending: %s\n", strerror(-r));
+                        goto finish;
+                }
+                if (r > 0)
+                        finished = false;
+
+                if (finished) {
+                        r = ca_remote_goodbye(rr);
+                        if (r < 0 && r != -EALREADY) {
+                                fprintf(stderr, "Failed to enqueue goodbye: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                }
+        }
+
+        if (arg_verbose)
+                fprintf(stderr, "Prefetched %" PRIu64 " chunks, %" PRIu64 " already present.\n", n_fetched, n_present);
+
+        r = 0;
+
+finish:
+        ca_remote_unref(rr);
+        ca_store_unref(store);
+        ca_index_unref(index);
+        free(input);
+
+        return r;
+}
+
+/* The "serve" verb: a small dedicated HTTP server for chunk stores. Generic web servers pay the full
+ * open()/stat()/header dance for every tiny .cacnk file; we keep the hot chunks in memory, push the cold
+ * ones out with sendfile(), and offer a batch endpoint that answers many chunk requests with a single
+ * response. Single-threaded on an epoll loop — the workload is practically all small reads from the page
+ * cache, so one event loop saturates a NIC long before it saturates a core. */
+
+#define SERVE_REQUEST_MAX 8192U
+#define SERVE_CACHE_SLOTS 512U
+#define SERVE_CACHE_MAX_BYTES (64U*1024U*1024U)
+#define SERVE_CACHE_CHUNK_MAX (256U*1024U)
+#define SERVE_BATCH_MAX 256U
+#define SERVE_EVENTS_MAX 64
+
+typedef struct ServeCacheItem {
+        CaChunkID id;
+        void *data;
+        uint64_t size;
+        uint64_t last_used; /* 0 if the slot is unused */
+} ServeCacheItem;
+
+typedef struct ServeCache {
+        ServeCacheItem slots[SERVE_CACHE_SLOTS];
+        uint64_t total_bytes;
+        uint64_t counter;
+        uint64_t n_hits, n_misses;
+} ServeCache;
+
+typedef struct ServeConnection {
+        int fd;
+
+        char request[SERVE_REQUEST_MAX];
+        size_t request_fill;
+
+        char *headers;            /* Response headers, owned */
+        size_t headers_size, headers_sent;
+
+        uint8_t *body;            /* In-memory response body, owned */
+        uint64_t body_size, body_sent;
+
+        int file_fd;              /* Response body to send out with sendfile() instead */
+        uint64_t file_size, file_sent;
+
+        bool keep_alive;
+        bool writing;
+} ServeConnection;
+
+static ServeConnection *serve_connection_free(ServeConnection *conn) {
+        if (!conn)
+                return NULL;
+
+        safe_close(conn->fd);
+        safe_close(conn->file_fd);
+        free(conn->headers);
+        free(conn->body);
+
+        return mfree(conn);
+}
+
+static void serve_connection_reset(ServeConnection *conn) {
+        assert(conn);
+
+        conn->headers = mfree(conn->headers);
+        conn->headers_size = conn->headers_sent = 0;
+
+        conn->body = mfree(conn->body);
+        conn->body_size = conn->body_sent = 0;
+
+        conn->file_fd = safe_close(conn->file_fd);
+        conn->file_size = conn->file_sent = 0;
+
+        conn->writing = false;
+}
+
+static ServeCacheItem *serve_cache_find(ServeCache *c, const CaChunkID *id) {
+        size_t i;
+
+        assert(c);
+        assert(id);
+
+        for (i = 0; i < SERVE_CACHE_SLOTS; i++)
+                if (c->slots[i].last_used != 0 &&
+                    memcmp(&c->slots[i].id, id, sizeof(CaChunkID)) == 0) {
+                        c->slots[i].last_used = ++c->counter;
+                        c->n_hits++;
+                        return c->slots + i;
+                }
+
+        c->n_misses++;
+        return NULL;
+}
+
+static void serve_cache_put(ServeCache *c, const CaChunkID *id, const void *data, uint64_t size) {
+        ServeCacheItem *dest = NULL;
+        void *copy;
+        size_t i;
+
+        assert(c);
+        assert(id);
+
+        /* During a deploy storm the same small set of chunks is requested over and over; answering those
+         * straight from memory skips the whole openat()/fstat()/read() path. Failure to cache is never an
+         * error, the file system copy remains authoritative. */
+
+        if (size > SERVE_CACHE_CHUNK_MAX)
+                return;
+
+        copy = memdup(data, size);
+        if (!copy)
+                return;
+
+        /* Find a free slot, or failing that, the least recently used one */
+        for (i = 0; i < SERVE_CACHE_SLOTS; i++) {
+                if (c->slots[i].last_used == 0) {
+                        dest = c->slots + i;
+                        break;
+                }
+
+                if (!dest || c->slots[i].last_used < dest->last_used)
+                        dest = c->slots + i;
+        }
+
+        if (dest->last_used != 0) {
+                c->total_bytes -= dest->size;
+                dest->data = mfree(dest->data);
+                dest->last_used = 0;
+        }
+
+        dest->id = *id;
+        dest->data = copy;
+        dest->size = size;
+        dest->last_used = ++c->counter;
+        c->total_bytes += size;
+
+        /* Evict least recently used entries until we are below the memory cap again */
+        while (c->total_bytes > SERVE_CACHE_MAX_BYTES) {
+                ServeCacheItem *victim = NULL;
+
+                for (i = 0; i < SERVE_CACHE_SLOTS; i++) {
+                        if (c->slots[i].last_used == 0 || c->slots + i == dest)
+                                continue;
+
+                        if (!victim || c->slots[i].last_used < victim->last_used)
+                                victim = c->slots + i;
+                }
+
+                if (!victim)
+                        break;
+
+                c->total_bytes -= victim->size;
+                victim->data = mfree(victim->data);
+                victim->last_used = 0;
+        }
+}
+
+static void serve_cache_flush(ServeCache *c) {
+        size_t i;
+
+        if (!c)
+                return;
+
+        for (i = 0; i < SERVE_CACHE_SLOTS; i++)
+                free(c->slots[i].data);
+}
+
+static int serve_begin_response(ServeConnection *conn, const char *status, uint64_t content_length) {
+        char *h;
+
+        assert(conn);
+        assert(status);
+
+        if (asprintf(&h,
+                     "HTTP/1.1 %s\r\n"
+                     "Content-Type: application/octet-stream\r\n"
+                     "Content-Length: %" PRIu64 "\r\n"
+                     "Connection: %s\r\n"
+                     "\r\n",
+                     status,
+                     content_length,
+                     conn->keep_alive ? "keep-alive" : "close") < 0)
+                return -ENOMEM;
+
+        conn->headers = h;
+        conn->headers_size = strlen(h);
+        conn->writing = true;
+
+        return 1;
+}
+
+static bool serve_path_is_safe(const char *p) {
+        const char *q;
+
+        /* Refuses empty paths, absolute paths and anything with empty, "." or ".." components, so that a
+         * request can never escape the store directory. */
+
+        if (isempty(p) || p[0] == '/')
+                return false;
+
+        for (q = p;;) {
+                size_t n = strcspn(q, "/");
+
+                if (n == 0)
+                        return false;
+                if (n <= 2 && strncmp(q, "..", n) == 0)
+                        return false;
+
+                q += n;
+                if (*q == 0)
+                        return true;
+
+                q++;
+        }
+}
+
+static bool serve_path_chunk_id(const char *path, CaChunkID *ret) {
+        char ids[CA_CHUNK_ID_FORMAT_MAX];
+        const char *b, *e;
+
+        assert(path);
+        assert(ret);
+
+        b = strrchr(path, '/');
+        b = b ? b + 1 : path;
+
+        e = endswith(b, ca_compressed_chunk_suffix());
+        if (!e)
+                return false;
+        if ((size_t) (e - b) != CA_CHUNK_ID_FORMAT_MAX - 1)
+                return false;
+
+        memcpy(ids, b, CA_CHUNK_ID_FORMAT_MAX - 1);
+        ids[CA_CHUNK_ID_FORMAT_MAX - 1] = 0;
+
+        return ca_chunk_id_parse(ids, ret) != NULL;
+}
+
+static int serve_open_file(int store_fd, const char *path, int *ret_fd, uint64_t *ret_size) {
+        struct stat st;
+        int fd;
+
+        assert(store_fd >= 0);
+        assert(path);
+        assert(ret_fd);
+        assert(ret_size);
+
+        fd = openat(store_fd, path, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st) < 0) {
+                int r = -errno;
+                safe_close(fd);
+                return r;
+        }
+
+        if (!S_ISREG(st.st_mode)) {
+                safe_close(fd);
+                return -ENOENT;
+        }
+
+        *ret_fd = fd;
+        *ret_size = (uint64_t) st.st_size;
+
+        return 0;
+}
+
+static int serve_load_chunk(int store_fd, ServeCache *cache, const CaChunkID *id, void **ret, uint64_t *ret_size) {
+        char path[4 + 1 + CA_CHUNK_ID_FORMAT_MAX + 8];
+        char ids[CA_CHUNK_ID_FORMAT_MAX];
+        uint64_t size;
+        void *p;
+        ssize_t n;
+        int r, fd = -1;
+
+        assert(store_fd >= 0);
+        assert(cache);
+        assert(id);
+        assert(ret);
+        assert(ret_size);
+
+        /* Loads a chunk's store encoding into memory, trying the compressed file name first and the
+         * uncompressed one second, and drops a copy into the hot-chunk cache. */
+
+        ca_chunk_id_format(id, ids);
+
+        snprintf(path, sizeof(path), "%.4s/%s%s", ids, ids, ca_compressed_chunk_suffix());
+        r = serve_open_file(store_fd, path, &fd, &size);
+        if (r == -ENOENT) {
+                snprintf(path, sizeof(path), "%.4s/%s", ids, ids);
+                r = serve_open_file(store_fd, path, &fd, &size);
+        }
+        if (r < 0)
+                return r;
+
+        p = malloc(size > 0 ? size : 1);
+        if (!p) {
+                safe_close(fd);
+                return -ENOMEM;
+        }
+
+        n = loop_read(fd, p, size);
+        safe_close(fd);
+        if (n < 0 || (uint64_t) n != size) {
+                free(p);
+                return n < 0 ? (int) n : -EIO;
+        }
+
+        serve_cache_put(cache, id, p, size);
+
+        *ret = p;
+        *ret_size = size;
+
+        return 0;
+}
+
+static int serve_build_batch(ServeConnection *conn, int store_fd, ServeCache *cache, const char *list) {
+        size_t body_size = 0, body_allocated = 0, n = 0;
+        uint8_t *body = NULL;
+        const char *q;
+        int r;
+
+        assert(conn);
+        assert(list);
+
+        /* Answers many chunk requests with one response. The body is a sequence of records, one per
+         * requested ID, in request order: a le64 record size (counting the size field and the chunk ID
+         * itself), the 32 byte chunk ID, and the chunk's store encoding. A record without payload marks a
+         * chunk we don't have. Compared to pipelined GETs this saves the per-request header round trip and
+         * lets us batch the disk I/O. */
+
+        for (q = list; *q != 0; ) {
+                char ids[CA_CHUNK_ID_FORMAT_MAX];
+                uint64_t size = 0;
+                const void *data = NULL;
+                void *loaded = NULL;
+                ServeCacheItem *item;
+                size_t l, record_size;
+                CaChunkID id;
+                uint8_t *record;
+
+                l = strcspn(q, ",");
+                if (l != CA_CHUNK_ID_FORMAT_MAX - 1) {
+                        r = -EINVAL;
+                        goto fail;
+                }
+
+                if (++n > SERVE_BATCH_MAX) {
+                        r = -EINVAL;
+                        goto fail;
+                }
+
+                memcpy(ids, q, l);
+                ids[l] = 0;
+
+                if (!ca_chunk_id_parse(ids, &id)) {
+                        r = -EINVAL;
+                        goto fail;
+                }
+
+                item = serve_cache_find(cache, &id);
+                if (item) {
+                        data = item->data;
+                        size = item->size;
+                } else {
+                        r = serve_load_chunk(store_fd, cache, &id, &loaded, &size);
+                        if (r >= 0)
+                                data = loaded;
+                        else if (r != -ENOENT)
+                                goto fail;
+                }
+
+                record_size = sizeof(le64_t) + sizeof(CaChunkID) + size;
+
+                if (!GREEDY_REALLOC(body, body_allocated, body_size + record_size)) {
+                        free(loaded);
+                        r = log_oom();
+                        goto fail;
+                }
+
+                record = body + body_size;
+                write_le64(record, record_size);
+                memcpy(record + sizeof(le64_t), &id, sizeof(CaChunkID));
+                if (size > 0)
+                        memcpy(record + sizeof(le64_t) + sizeof(CaChunkID), data, size);
+
+                body_size += record_size;
+                free(loaded);
+
+                q += l;
+                if (*q == ',')
+                        q++;
+        }
+
+        conn->body = body;
+        conn->body_size = body_size;
+
+        return serve_begin_response(conn, "200 OK", body_size);
+
+fail:
+        free(body);
+        return r;
+}
+
+static int serve_process_request(ServeConnection *conn, int store_fd, ServeCache *cache) {
+        char *header_end, *line_end, *path, *space, *h;
+        size_t consumed;
+        int r;
+
+        assert(conn);
+
+        /* Parses and answers one request from the connection's input buffer. Returns > 0 when a response
+         * has been prepared, 0 when more input is needed, < 0 on failure. */
+
+        conn->request[conn->request_fill] = 0;
+
+        header_end = strstr(conn->request, "\r\n\r\n");
+        if (!header_end) {
+                if (conn->request_fill >= SERVE_REQUEST_MAX - 1)
+                        return -EBADMSG; /* Overlong request head */
+
+                return 0;
+        }
+
+        line_end = strstr(conn->request, "\r\n");
+        assert(line_end <= header_end);
+
+        /* Determine whether to keep the connection open afterwards */
+        conn->keep_alive = true;
+        for (h = line_end + 2; h < header_end; ) {
+                char *next;
+
+                next = strstr(h, "\r\n");
+
+                if (strncasecmp(h, "Connection:", 11) == 0) {
+                        const char *v = h + 11;
+
+                        v += strspn(v, " \t");
+                        if (strncasecmp(v, "close", 5) == 0)
+                                conn->keep_alive = false;
+                }
+
+                h = next + 2;
+        }
+
+        *line_end = 0;
+        consumed = (size_t) (header_end + 4 - conn->request);
+
+        if (!startswith(conn->request, "GET ")) {
+                conn->keep_alive = false;
+                r = serve_begin_response(conn, "405 Method Not Allowed", 0);
+                goto done;
+        }
+
+        path = conn->request + 4;
+        space = strchr(path, ' ');
+        if (!space) {
+                r = -EBADMSG;
+                goto done;
+        }
+        *space = 0;
+
+        if (startswith(space + 1, "HTTP/1.0")) /* HTTP/1.0 closes by default */
+                conn->keep_alive = false;
+
+        if (startswith(path, "/multi/")) {
+                r = serve_build_batch(conn, store_fd, cache, path + strlen("/multi/"));
+                if (r == -EINVAL) {
+                        conn->keep_alive = false;
+                        r = serve_begin_response(conn, "400 Bad Request", 0);
+                }
+        } else {
+                const char *p = path + 1;
+                bool is_chunk;
+                CaChunkID id;
+
+                if (!serve_path_is_safe(p)) {
+                        r = serve_begin_response(conn, "404 Not Found", 0);
+                        goto done;
+                }
+
+                is_chunk = serve_path_chunk_id(p, &id);
+                if (is_chunk) {
+                        ServeCacheItem *item;
+
+                        item = serve_cache_find(cache, &id);
+                        if (item) {
+                                conn->body = memdup(item->data, item->size);
+                                if (!conn->body) {
+                                        r = log_oom();
+                                        goto done;
+                                }
+
+                                conn->body_size = item->size;
+                                r = serve_begin_response(conn, "200 OK", item->size);
+                                goto done;
+                        }
+
+                        /* Small chunks are loaded into memory (and thus into the cache), large ones and
+                         * non-chunk files (e.g. pack files) go out via sendfile() below */
+                        r = serve_load_chunk(store_fd, cache, &id, (void**) &conn->body, &conn->body_size);
+                        if (r >= 0) {
+                                r = serve_begin_response(conn, "200 OK", conn->body_size);
+                                goto done;
+                        }
+                        if (r != -ENOENT)
+                                goto done;
+
+                        r = serve_begin_response(conn, "404 Not Found", 0);
+                        goto done;
+                }
+
+                r = serve_open_file(store_fd, p, &conn->file_fd, &conn->file_size);
+                if (r < 0) {
+                        if (!IN_SET(r, -ENOENT, -EACCES, -ENOTDIR, -ELOOP, -EISDIR))
+                                goto done;
+
+                        r = serve_begin_response(conn, "404 Not Found", 0);
+                        goto done;
+                }
+
+                r = serve_begin_response(conn, "200 OK", conn->file_size);
+        }
+
+done:
+        if (r >= 0) {
+                /* Drop the parsed request from the buffer; a pipelined follow-up may already be behind it */
+                memmove(conn->request, conn->request + consumed, conn->request_fill - consumed);
+                conn->request_fill -= consumed;
+        }
+
+        return r;
+}
+
+static int serve_connection_flush(ServeConnection *conn) {
+        assert(conn);
+
+        /* Returns > 0 when the whole response has been written, 0 when the socket can't take more right
+         * now, < 0 on failure. */
+
+        while (conn->headers_sent < conn->headers_size) {
+                ssize_t k;
+
+                k = write(conn->fd, conn->headers + conn->headers_sent, conn->headers_size - conn->headers_sent);
+                if (k < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN)
+                                return 0;
+
+                        return -errno;
+                }
+
+                conn->headers_sent += (size_t) k;
+        }
+
+        while (conn->body_sent < conn->body_size) {
+                ssize_t k;
+
+                k = write(conn->fd, conn->body + conn->body_sent, conn->body_size - conn->body_sent);
+                if (k < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN)
+                                return 0;
+
+                        return -errno;
+                }
+
+                conn->body_sent += (uint64_t) k;
+        }
+
+        while (conn->file_sent < conn->file_size) {
+                ssize_t k;
+
+                k = sendfile(conn->fd, conn->file_fd, NULL, (size_t) MIN(conn->file_size - conn->file_sent, (uint64_t) SSIZE_MAX));
+                if (k < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN)
+                                return 0;
+
+                        return -errno;
+                }
+                if (k == 0)
+                        return -EIO; /* The source file was truncated under us? */
+
+                conn->file_sent += (uint64_t) k;
+        }
+
+        return 1;
+}
+
+static int serve_connection_rearm(ServeConnection *conn, int epoll_fd, uint32_t mask) {
+        struct epoll_event ev = {
+                .events = mask,
+                .data.ptr = conn,
+        };
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+                return -errno;
+
+        return 0;
+}
+
+static int serve_connection_process(
+                ServeConnection *conn,
+                int epoll_fd,
+                int store_fd,
+                ServeCache *cache,
+                uint64_t *n_requests) {
+
+        int r;
+
+        assert(conn);
+
+        /* Drives a connection as far as it will go without blocking: read while a request is incomplete,
+         * write while a response is pending, and flip the epoll interest mask when the socket runs dry.
+         * Any error means the connection is to be dropped. */
+
+        for (;;) {
+                ssize_t k;
+
+                if (conn->writing) {
+                        r = serve_connection_flush(conn);
+                        if (r < 0)
+                                return r;
+                        if (r == 0)
+                                return serve_connection_rearm(conn, epoll_fd, EPOLLOUT);
+
+                        (*n_requests)++;
+
+                        if (!conn->keep_alive)
+                                return -EPIPE;
+
+                        serve_connection_reset(conn);
+                        continue;
+                }
+
+                r = serve_process_request(conn, store_fd, cache);
+                if (r < 0)
+                        return r;
+                if (r > 0)
+                        continue;
+
+                k = read(conn->fd, conn->request + conn->request_fill, SERVE_REQUEST_MAX - 1 - conn->request_fill);
+                if (k < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN)
+                                return serve_connection_rearm(conn, epoll_fd, EPOLLIN);
+
+                        return -errno;
+                }
+                if (k == 0)
+                        return -ECONNRESET; /* Peer hung up */
+
+                conn->request_fill += (size_t) k;
+        }
+}
+
+static int verb_serve(int argc, char *argv[]) {
+        struct sockaddr_in sa = {
+                .sin_family = AF_INET,
+                .sin_addr.s_addr = htonl(INADDR_ANY),
+        };
+        int r, listen_fd = -1, epoll_fd = -1, store_fd = -1;
+        static const int one = 1;
+        ServeCache *cache = NULL;
+        uint64_t n_requests = 0;
+        const char *store_path;
+        unsigned port = 8080;
+        sigset_t ss;
+
+        if (argc > 2) {
+                fprintf(stderr, "Expected a chunk store path as only argument.\n");
+                return -EINVAL;
+        }
+
+        store_path = argc > 1 ? argv[1] : (arg_store ?: "default.castr");
+
+        if (arg_listen) {
+                const char *t = arg_listen, *colon;
+
+                colon = strrchr(t, ':');
+                if (colon) {
+                        char a[64];
+
+                        if ((size_t) (colon - t) >= sizeof(a)) {
+                                fprintf(stderr, "Failed to parse --listen= address: %s\n", arg_listen);
+                                return -EINVAL;
+                        }
+
+                        memcpy(a, t, colon - t);
+                        a[colon - t] = 0;
+
+                        if (inet_pton(AF_INET, a, &sa.sin_addr) <= 0) {
+                                fprintf(stderr, "Failed to parse --listen= address: %s\n", a);
+                                return -EINVAL;
+                        }
+
+                        t = colon + 1;
+                }
+
+                r = safe_atou(t, &port);
+                if (r < 0 || port == 0 || port > 0xFFFFU) {
+                        fprintf(stderr, "Failed to parse --listen= port: %s\n", t);
+                        return r < 0 ? r : -ERANGE;
+                }
+        }
+
+        sa.sin_port = htons((uint16_t) port);
+
+        store_fd = open(store_path, O_RDONLY|O_CLOEXEC|O_DIRECTORY);
+        if (store_fd < 0) {
+                r = -errno;
+                fprintf(stderr, "Failed to open store %s: %s\n", store_path, strerror(-r));
+                return r;
+        }
+
+        cache = new0(ServeCache, 1);
+        if (!cache) {
+                r = log_oom();
+                goto finish;
+        }
+
+        listen_fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) {
+                r = -errno;
+                fprintf(stderr, "Failed to allocate socket: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        (void) setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        if (bind(listen_fd, (struct sockaddr*) &sa, sizeof(sa)) < 0) {
+                r = -errno;
+                fprintf(stderr, "Failed to bind to port %u: %s\n", port, strerror(-r));
+                goto finish;
+        }
+
+        if (listen(listen_fd, SOMAXCONN) < 0) {
+                r = -errno;
+                fprintf(stderr, "Failed to listen: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0) {
+                r = -errno;
+                fprintf(stderr, "Failed to allocate epoll instance: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        {
+                struct epoll_event ev = {
+                        .events = EPOLLIN,
+                        .data.ptr = NULL, /* NULL marks the listening socket */
+                };
+
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+                        r = -errno;
+                        fprintf(stderr, "Failed to add listening socket to epoll: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        if (arg_verbose)
+                fprintf(stderr, "Serving store %s on port %u.\n", store_path, port);
+
+        block_exit_handler(SIG_BLOCK, &ss);
+
+        while (!quit) {
+                struct epoll_event events[SERVE_EVENTS_MAX];
+                int n, i;
+
+                n = epoll_pwait(epoll_fd, events, SERVE_EVENTS_MAX, -1, &ss);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        r = -errno;
+                        fprintf(stderr, "Failed to wait for events: %s\n", strerror(-r));
+                        block_exit_handler(SIG_UNBLOCK, NULL);
+                        goto finish;
+                }
+
+                for (i = 0; i < n; i++) {
+                        ServeConnection *conn = events[i].data.ptr;
+
+                        if (!conn) {
+                                /* Activity on the listening socket: accept everything that's pending */
+                                for (;;) {
+                                        struct epoll_event ev;
+                                        int cfd;
+
+                                        cfd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+                                        if (cfd < 0) {
+                                                if (errno == EINTR)
+                                                        continue;
+                                                break; /* EAGAIN, or a transient error we can't do much about */
+                                        }
+
+                                        conn = new0(ServeConnection, 1);
+                                        if (!conn) {
+                                                safe_close(cfd);
+                                                break;
+                                        }
+
+                                        conn->fd = cfd;
+                                        conn->file_fd = -1;
+
+                                        ev = (struct epoll_event) {
+                                                .events = EPOLLIN,
+                                                .data.ptr = conn,
+                                        };
+
+                                        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cfd, &ev) < 0) {
+                                                serve_connection_free(conn);
+                                                break;
+                                        }
+                                }
+
+                                continue;
+                        }
+
+                        if (events[i].events & (EPOLLHUP|EPOLLERR)) {
+                                serve_connection_free(conn);
+                                continue;
+                        }
+
+                        if (serve_connection_process(conn, epoll_fd, store_fd, cache, &n_requests) < 0)
+                                serve_connection_free(conn);
+                }
+        }
+
+        block_exit_handler(SIG_UNBLOCK, NULL);
+
+        if (arg_verbose)
+                fprintf(stderr, "Served %" PRIu64 " requests (cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " bytes).\n",
+                        n_requests, cache->n_hits, cache->n_misses, cache->total_bytes);
+
+        r = 0;
+
+finish:
+        /* Established connections go down with the process, no need to track them for this */
+        safe_close(epoll_fd);
+        safe_close(listen_fd);
+        safe_close(store_fd);
+
+        serve_cache_flush(cache);
+        free(cache);
+
+        return r;
+}
+
+static uint64_t gc_chunk_id_prefix(const CaChunkID *id) {
+        uint64_t v;
+
+        /* The first 64 bit of a chunk ID follow from a cryptographic hash, hence are as unique as we need
+         * them to be for set membership during GC: a collision can only retain an unreferenced chunk, never
+         * remove a referenced one, as every chunk ID always matches its own prefix. Keeping only the prefix
+         * makes the mark set a quarter of the size, which matters with tens of millions of chunks. */
+
+        memcpy(&v, id, sizeof(v));
+        return v;
+}
+
+/* An open-addressing hash set of 64 bit chunk ID prefixes. A sorted array needs O(log n) cache misses per
+ * membership test and pays for its incremental growth with realloc copies; with tens of millions of marked
+ * chunks both show up in profiles. This table is sized up-front from the chunk counts the index headers
+ * declare, so the mark phase is a single allocation, and the sweep phase probes one or two cache lines per
+ * lookup. The prefix is taken from a cryptographic hash, hence is itself uniformly distributed and needs no
+ * further mixing. Zero is used as the empty bucket marker; the (cosmically unlikely) all-zero prefix gets a
+ * flag of its own. */
+typedef struct GcMarkSet {
+        uint64_t *buckets;
+        uint64_t n_buckets; /* always a power of two */
+        uint64_t n_entries;
+        bool has_zero;
+} GcMarkSet;
+
+static int gc_mark_set_init(GcMarkSet *m, uint64_t expected) {
+        uint64_t n;
+
+        assert(m);
+
+        /* Size for a load factor of at most 75% at the expected entry count */
+        n = 256;
+        while (n < expected + expected / 3 + 1) {
+                if (n > UINT64_C(1) << 62)
+                        return -ENOMEM;
+                n *= 2;
+        }
+
+        m->buckets = new0(uint64_t, n);
+        if (!m->buckets)
+                return -ENOMEM;
+
+        m->n_buckets = n;
+        m->n_entries = 0;
+        m->has_zero = false;
+
+        return 0;
+}
+
+static void gc_mark_set_release(GcMarkSet *m) {
+        if (!m)
+                return;
+
+        m->buckets = mfree(m->buckets);
+        m->n_buckets = m->n_entries = 0;
+}
+
+static int gc_mark_set_add(GcMarkSet *m, uint64_t v) {
+        uint64_t i;
+
+        assert(m);
+
+        if (v == 0) {
+                m->has_zero = true;
+                return 0;
+        }
+
+        /* Grow when we exceed 75% load, i.e. when the up-front estimate was off */
+        if (m->n_entries >= m->n_buckets - m->n_buckets / 4) {
+                GcMarkSet bigger;
+                int r;
+
+                r = gc_mark_set_init(&bigger, m->n_buckets); /* results in 2x n_buckets */
+                if (r < 0)
+                        return r;
+
+                for (i = 0; i < m->n_buckets; i++)
+                        if (m->buckets[i] != 0)
+                                (void) gc_mark_set_add(&bigger, m->buckets[i]);
+
+                bigger.has_zero = m->has_zero;
+                free(m->buckets);
+                *m = bigger;
+        }
+
+        for (i = v & (m->n_buckets - 1);; i = (i + 1) & (m->n_buckets - 1)) {
+                if (m->buckets[i] == v)
+                        return 0;
+
+                if (m->buckets[i] == 0) {
+                        m->buckets[i] = v;
+                        m->n_entries++;
+                        return 1;
+                }
+        }
+}
+
+static bool gc_mark_set_contains(const GcMarkSet *m, uint64_t v) {
+        uint64_t i;
+
+        assert(m);
+
+        if (v == 0)
+                return m->has_zero;
+
+        for (i = v & (m->n_buckets - 1);; i = (i + 1) & (m->n_buckets - 1)) {
+                if (m->buckets[i] == v)
+                        return true;
+
+                if (m->buckets[i] == 0)
+                        return false;
+        }
+}
+
+/* Enumerates the fan-out subdirectories of a store, at any digit width and nesting depth, so that the
+ * parallel store walkers work on classic and resharded layouts alike. Directories that still carry
+ * further fan-out levels end up in the list too, which is harmless: they contain no chunk files. */
+static int store_collect_shard_dirs(int root_fd, const char *relpath, unsigned depth, char ***subdirs) {
+        DIR *d = NULL;
+        int r;
+
+        if (relpath) {
+                r = xopendirat(root_fd, relpath, O_NOFOLLOW, &d);
+                if (IN_SET(r, -ENOENT, -ENOTDIR))
+                        return 0;
+                if (r < 0)
+                        return r;
+        } else {
+                int fd;
+
+                fd = fcntl(root_fd, F_DUPFD_CLOEXEC, 3);
+                if (fd < 0)
+                        return -errno;
+
+                d = fdopendir(fd);
+                if (!d) {
+                        r = -errno;
+                        safe_close(fd);
+                        return r;
+                }
+
+                rewinddir(d);
+        }
+
+        for (;;) {
+                struct dirent *de;
+                char *joined;
+                size_t n;
+
+                errno = 0;
+                de = readdir(d);
+                if (!de) {
+                        if (errno != 0) {
+                                r = -errno;
+                                goto finish;
+                        }
+                        break;
+                }
+
+                if (dot_or_dot_dot(de->d_name))
+                        continue;
+
+                n = strlen(de->d_name);
+                if (n < 1 || n > CA_CHUNK_FANOUT_DIGITS_MAX ||
+                    strspn(de->d_name, "0123456789abcdef") != n)
+                        continue;
+
+                if (relpath)
+                        r = asprintf(&joined, "%s/%s", relpath, de->d_name) < 0 ? -ENOMEM : 0;
+                else
+                        joined = strdup(de->d_name), r = joined ? 0 : -ENOMEM;
+                if (r < 0)
+                        goto finish;
+
+                r = strv_extend(subdirs, joined);
+                if (r < 0) {
+                        free(joined);
+                        goto finish;
+                }
+
+                if (depth + 1 < CA_CHUNK_FANOUT_LEVELS_MAX) {
+                        r = store_collect_shard_dirs(root_fd, joined, depth + 1, subdirs);
+                        if (r < 0) {
+                                free(joined);
+                                goto finish;
+                        }
+                }
+
+                free(joined);
+        }
+
+        r = 0;
+
+finish:
+        closedir(d);
+        return r;
+}
+
+static int store_enumerate_shard_dirs(const char *store_path, char ***ret_subdirs) {
+        char **subdirs = NULL;
+        int root_fd, r;
+
+        assert(store_path);
+        assert(ret_subdirs);
+
+        root_fd = open(store_path, O_RDONLY|O_CLOEXEC|O_DIRECTORY|O_NOCTTY);
+        if (root_fd < 0)
+                return -errno;
+
+        r = store_collect_shard_dirs(root_fd, NULL, 0, &subdirs);
+        safe_close(root_fd);
+        if (r < 0) {
+                strv_free(subdirs);
+                return r;
+        }
+
+        *ret_subdirs = subdirs;
+        return 0;
+}
+
+typedef struct GcSweep {
+        const char *store_path;
+        const GcMarkSet *marked;
+        char **subdirs;
+        size_t n_subdirs;
+
+        /* The following fields are protected by the lock */
+        pthread_mutex_t lock;
+        size_t next_subdir;
+        uint64_t n_removed, n_kept;
+        uint64_t removed_bytes;
+        int error;
+} GcSweep;
+
+static void *gc_sweep_thread(void *arg) {
+        GcSweep *sw = arg;
+        int root_fd, r = 0;
+
+        /* Unlinking tens of millions of chunk files is bound by synchronous metadata operations, hence
+         * sweep the 4-character prefix directories of the store in parallel, one directory at a time per
+         * thread. The mark set is read-only at this point, only the counters need the lock. */
+
+        root_fd = open(sw->store_path, O_RDONLY|O_CLOEXEC|O_DIRECTORY|O_NOCTTY);
+        if (root_fd < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        for (;;) {
+                uint64_t n_removed = 0, n_kept = 0, removed_bytes = 0;
+                size_t i;
+                DIR *d;
+
+                assert_se(pthread_mutex_lock(&sw->lock) == 0);
+                i = sw->next_subdir++;
+                assert_se(pthread_mutex_unlock(&sw->lock) == 0);
+
+                if (i >= sw->n_subdirs)
+                        break;
+
+                r = xopendirat(root_fd, sw->subdirs[i], O_NOFOLLOW, &d);
+                if (r == -ENOENT) {
+                        r = 0;
+                        continue;
+                }
+                if (r < 0)
+                        goto finish;
+
+                for (;;) {
+                        char name[CA_CHUNK_ID_FORMAT_MAX];
+                        struct dirent *de;
+                        struct stat st;
+                        const char *e;
+                        CaChunkID id;
+                        size_t k;
+
+                        errno = 0;
+                        de = readdir(d);
+                        if (!de) {
+                                if (errno != 0) {
+                                        r = -errno;
+                                        closedir(d);
+                                        goto finish;
+                                }
+                                break;
+                        }
+
+                        if (dot_or_dot_dot(de->d_name))
+                                continue;
+
+                        /* Accept both compressed and uncompressed chunk file names, skip everything else */
+                        e = endswith(de->d_name, ca_compressed_chunk_suffix());
+                        k = e ? (size_t) (e - de->d_name) : strlen(de->d_name);
+                        if (k != CA_CHUNK_ID_FORMAT_MAX - 1)
+                                continue;
+
+                        memcpy(name, de->d_name, k);
+                        name[k] = 0;
+
+                        if (!ca_chunk_id_parse(name, &id))
+                                continue;
+
+                        if (gc_mark_set_contains(sw->marked, gc_chunk_id_prefix(&id))) {
+                                n_kept++;
+                                continue;
+                        }
+
+                        if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) >= 0)
+                                removed_bytes += st.st_size;
+
+                        if (unlinkat(dirfd(d), de->d_name, 0) < 0 && errno != ENOENT) {
+                                r = -errno;
+                                closedir(d);
+                                goto finish;
+                        }
+
+                        n_removed++;
+                }
+
+                closedir(d);
+
+                assert_se(pthread_mutex_lock(&sw->lock) == 0);
+                sw->n_removed += n_removed;
+                sw->n_kept += n_kept;
+                sw->removed_bytes += removed_bytes;
+
+                if (arg_verbose)
+                        fprintf(stderr, "Swept %zu of %zu store directories.\r",
+                                MIN(sw->next_subdir, sw->n_subdirs), sw->n_subdirs);
+
+                assert_se(pthread_mutex_unlock(&sw->lock) == 0);
+        }
+
+finish:
+        safe_close(root_fd);
+
+        if (r < 0) {
+                assert_se(pthread_mutex_lock(&sw->lock) == 0);
+                if (sw->error == 0)
+                        sw->error = r;
+                assert_se(pthread_mutex_unlock(&sw->lock) == 0);
+        }
+
+        return NULL;
+}
+
+static int verb_gc(int argc, char *argv[]) {
+        GcMarkSet marked = {};
+        uint64_t n_expected = 0;
+        size_t n_threads, i;
+        pthread_t *threads = NULL;
+        char **subdirs = NULL;
+        CaIndex *index = NULL;
+        GcSweep sweep;
+        int r, j;
+
+        if (argc < 2) {
+                fprintf(stderr, "At least one index file must be specified.\n");
+                return -EINVAL;
+        }
+
+        r = set_default_store(argv[1]);
+        if (r < 0)
+                return r;
+
+        /* Phase one: mark. Collect the IDs of all chunks referenced by any of the indexes in a hash set of
+         * 64 bit ID prefixes, sized up-front from the chunk counts the index headers declare, so that the
+         * set never needs to rehash while we pour millions of entries into it. */
+
+        for (j = 1; j < argc; j++) {
+                uint64_t n;
+
+                index = ca_index_new_read();
+                if (!index) {
+                        r = log_oom();
+                        goto finish;
+                }
+
+                r = ca_index_set_path(index, argv[j]);
+                if (r >= 0)
+                        r = ca_index_open(index);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to open index file %s: %s\n", argv[j], strerror(-r));
+                        goto finish;
+                }
+
+                if (ca_index_get_total_chunks(index, &n) >= 0 && n != UINT64_MAX)
+                        n_expected += n;
+
+                index = ca_index_unref(index);
+        }
+
+        r = gc_mark_set_init(&marked, n_expected);
+        if (r < 0) {
+                r = log_oom();
+                goto finish;
+        }
+
+        for (j = 1; j < argc; j++) {
+
+                index = ca_index_new_read();
+                if (!index) {
+                        r = log_oom();
+                        goto finish;
+                }
+
+                r = ca_index_set_path(index, argv[j]);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set index file %s: %s\n", argv[j], strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_index_open(index);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to open index file %s: %s\n", argv[j], strerror(-r));
+                        goto finish;
+                }
+
+                for (;;) {
+                        CaChunkID id;
+
+                        r = ca_index_read_chunk(index, &id, NULL, NULL);
+                        if (r == 0)
+                                break;
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to read index file %s: %s\n", argv[j], strerror(-r));
+                                goto finish;
+                        }
+
+                        r = gc_mark_set_add(&marked, gc_chunk_id_prefix(&id));
+                        if (r < 0) {
+                                r = log_oom();
+                                goto finish;
+                        }
+                }
+
+                index = ca_index_unref(index);
+        }
+
+        if (arg_verbose)
+                fprintf(stderr, "%" PRIu64 " chunks referenced by %i index file(s).\n",
+                        marked.n_entries + marked.has_zero, argc - 1);
+
+        /* Phase two: sweep. Enumerate the fan-out directories of the store, then clean them out in
+         * parallel. */
+
+        r = store_enumerate_shard_dirs(arg_store, &subdirs);
+        if (r < 0) {
+                fprintf(stderr, "Failed to enumerate store %s: %s\n", arg_store, strerror(-r));
+                goto finish;
+        }
+
+        sweep = (GcSweep) {
+                .store_path = arg_store,
+                .marked = &marked,
+                .subdirs = subdirs,
+                .n_subdirs = strv_length(subdirs),
+                .lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER,
+        };
+
+        n_threads = arg_threads;
+        if (n_threads == 0) {
+                long v;
+
+                v = sysconf(_SC_NPROCESSORS_ONLN);
+                n_threads = v <= 0 ? 1 : (size_t) v;
+        }
+        if (sweep.n_subdirs > 0 && n_threads > sweep.n_subdirs)
+                n_threads = sweep.n_subdirs;
+
+        threads = new0(pthread_t, n_threads);
+        if (!threads) {
+                r = log_oom();
+                goto finish;
+        }
+
+        for (i = 0; i < n_threads; i++)
+                assert_se(pthread_create(threads + i, NULL, gc_sweep_thread, &sweep) == 0);
+        for (i = 0; i < n_threads; i++)
+                assert_se(pthread_join(threads[i], NULL) == 0);
+
+        if (arg_verbose)
+                fputc('\n', stderr);
+
+        if (sweep.error < 0) {
+                r = sweep.error;
+                fprintf(stderr, "Failed to sweep store %s: %s\n", arg_store, strerror(-r));
+                goto finish;
+        }
+
+        printf("Removed %" PRIu64 " chunks (%" PRIu64 " bytes), kept %" PRIu64 " chunks.\n",
+               sweep.n_removed, sweep.removed_bytes, sweep.n_kept);
+
+        r = 0;
+
+finish:
+        free(threads);
+        strv_free(subdirs);
+        gc_mark_set_release(&marked);
+        ca_index_unref(index);
+
+        return r;
+}
+
+static int verb_plan(int argc, char *argv[]) {
+        char buffer[FORMAT_BYTES_MAX], buffer2[FORMAT_BYTES_MAX];
+        uint64_t total_chunks = 0, total_bytes = 0,
+                 unique_chunks = 0, unique_bytes = 0,
+                 inline_chunks = 0, inline_bytes = 0,
+                 seed_chunks = 0, seed_bytes = 0,
+                 store_chunks = 0, store_bytes = 0,
+                 download_chunks = 0, download_bytes = 0;
+        uint64_t feature_flags = UINT64_MAX, n_expected = 0;
+        size_t cmin = 0, cavg = 0, cmax = 0, n_seeds = 0, n_stores = 0, i;
+        GcMarkSet seen = {};
+        CaSeed **seeds = NULL;
+        CaStore **stores = NULL;
+        CaIndex *index = NULL;
+        char **p;
+        int r;
+
+        /* Answers "how much will this deployment actually transfer?" without writing a single payload
+         * byte: index the configured seeds, then walk the index chunk list once and classify each unique
+         * chunk as inline, seed-satisfiable, present in a local store, or a download. */
+
+        if (argc != 2) {
+                fprintf(stderr, "An index file must be specified.\n");
+                return -EINVAL;
+        }
+
+        r = set_default_store(argv[1]);
+        if (r < 0)
+                return r;
+
+        index = ca_index_new_read();
+        if (!index) {
+                r = log_oom();
+                goto finish;
+        }
+
+        r = ca_index_set_path(index, argv[1]);
+        if (r >= 0)
+                r = ca_index_open(index);
+        if (r < 0) {
+                fprintf(stderr, "Failed to open index file %s: %s\n", argv[1], strerror(-r));
+                goto finish;
+        }
+
+        (void) ca_index_get_feature_flags(index, &feature_flags);
+        (void) ca_index_get_chunk_size_min(index, &cmin);
+        (void) ca_index_get_chunk_size_avg(index, &cavg);
+        (void) ca_index_get_chunk_size_max(index, &cmax);
+
+        if (ca_index_get_total_chunks(index, &n_expected) < 0 || n_expected == UINT64_MAX)
+                n_expected = 0;
+
+        r = gc_mark_set_init(&seen, n_expected);
+        if (r < 0) {
+                r = log_oom();
+                goto finish;
+        }
+
+        /* Open everything that's a local chunk store; remote stores count as downloads, that's the whole
+         * point of the exercise. */
+
+        stores = new0(CaStore*, 1 + strv_length(arg_extra_stores));
+        if (!stores) {
+                r = log_oom();
+                goto finish;
+        }
+
+        if (arg_store && ca_classify_locator(arg_store) == CA_LOCATOR_PATH) {
+                stores[n_stores] = ca_store_new();
+                if (!stores[n_stores]) {
+                        r = log_oom();
+                        goto finish;
+                }
+
+                r = ca_store_set_path(stores[n_stores], arg_store);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set store %s: %s\n", arg_store, strerror(-r));
+                        goto finish;
+                }
+
+                n_stores++;
+        }
+
+        STRV_FOREACH(p, arg_extra_stores) {
+                if (ca_classify_locator(*p) != CA_LOCATOR_PATH)
+                        continue;
+
+                stores[n_stores] = ca_store_new();
+                if (!stores[n_stores]) {
+                        r = log_oom();
+                        goto finish;
+                }
+
+                r = ca_store_set_path(stores[n_stores], *p);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set extra store %s: %s\n", *p, strerror(-r));
+                        goto finish;
+                }
+
+                n_stores++;
+        }
+
+        /* Index the seeds, with the chunking parameters of the index, so that the chunk IDs actually
+         * match */
+
+        seeds = new0(CaSeed*, strv_length(arg_seeds));
+        if (!seeds && !strv_isempty(arg_seeds)) {
+                r = log_oom();
+                goto finish;
+        }
+
+        STRV_FOREACH(p, arg_seeds) {
+                CaSeed *seed;
+
+                seed = ca_seed_new();
+                if (!seed) {
+                        r = log_oom();
+                        goto finish;
+                }
+
+                r = ca_seed_set_base_path(seed, *p);
+                if (r >= 0 && feature_flags != UINT64_MAX)
+                        r = ca_seed_set_feature_flags(seed, feature_flags);
+                if (r >= 0 && cmin > 0)
+                        r = ca_seed_set_chunk_size_min(seed, cmin);
+                if (r >= 0 && cavg > 0)
+                        r = ca_seed_set_chunk_size_avg(seed, cavg);
+                if (r >= 0 && cmax > 0)
+                        r = ca_seed_set_chunk_size_max(seed, cmax);
+                if (r >= 0 && arg_threads != 0)
+                        r = ca_seed_set_threads(seed, arg_threads);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set up seed %s: %s\n", *p, strerror(-r));
+                        ca_seed_unref(seed);
+                        goto finish;
+                }
+
+                if (arg_verbose)
+                        fprintf(stderr, "Indexing seed %s…\n", *p);
+
+                for (;;) {
+                        if (quit) {
+                                ca_seed_unref(seed);
+                                r = -ESHUTDOWN;
+                                goto finish;
+                        }
+
+                        r = ca_seed_step(seed);
+                        if (r < 0 || r == CA_SEED_READY)
+                                break;
+                }
+                if (r < 0) {
+                        fprintf(stderr, "Failed to index seed %s, ignoring: %s\n", *p, strerror(-r));
+                        ca_seed_unref(seed);
+                        continue;
+                }
+
+                seeds[n_seeds++] = seed;
+        }
+
+        /* Now walk the chunk list and classify */
+
+        for (;;) {
+                const void *d;
+                uint64_t size, sz;
+                CaChunkID id;
+                bool found = false;
+
+                if (quit) {
+                        r = -ESHUTDOWN;
+                        goto finish;
+                }
+
+                r = ca_index_read_chunk(index, &id, NULL, &size);
+                if (r == 0)
+                        break;
+                if (r < 0) {
+                        fprintf(stderr, "Failed to read index file %s: %s\n", argv[1], strerror(-r));
+                        goto finish;
+                }
+
+                total_chunks++;
+                total_bytes += size;
+
+                /* Each chunk is fetched (or cloned) only once, however often the index references it */
+                if (gc_mark_set_contains(&seen, gc_chunk_id_prefix(&id)))
+                        continue;
+
+                r = gc_mark_set_add(&seen, gc_chunk_id_prefix(&id));
+                if (r < 0) {
+                        r = log_oom();
+                        goto finish;
+                }
+
+                unique_chunks++;
+                unique_bytes += size;
+
+                if (ca_index_get_inline_chunk(index, &id, &d, &sz) >= 0) {
+                        inline_chunks++;
+                        inline_bytes += size;
+                        continue;
+                }
+
+                for (i = 0; i < n_seeds; i++)
+                        if (ca_seed_has(seeds[i], &id) > 0) {
+                                seed_chunks++;
+                                seed_bytes += size;
+                                found = true;
+                                break;
+                        }
+                if (found)
+                        continue;
+
+                for (i = 0; i < n_stores; i++)
+                        if (ca_store_has(stores[i], &id) > 0) {
+                                store_chunks++;
+                                store_bytes += size;
+                                found = true;
+                                break;
+                        }
+                if (found)
+                        continue;
+
+                download_chunks++;
+                download_bytes += size;
+        }
+
+        printf("Chunks in index:    %" PRIu64 " (%s)\n",
+               total_chunks, format_bytes(buffer, sizeof(buffer), total_bytes));
+        printf("Unique chunks:      %" PRIu64 " (%s)\n",
+               unique_chunks, format_bytes(buffer, sizeof(buffer), unique_bytes));
+        if (inline_chunks > 0)
+                printf("Inline in index:    %" PRIu64 " (%s)\n",
+                       inline_chunks, format_bytes(buffer, sizeof(buffer), inline_bytes));
+        printf("From seeds:         %" PRIu64 " (%s)\n",
+               seed_chunks, format_bytes(buffer, sizeof(buffer), seed_bytes));
+        printf("From local stores:  %" PRIu64 " (%s)\n",
+               store_chunks, format_bytes(buffer, sizeof(buffer), store_bytes));
+        printf("To download:        %" PRIu64 " (%s",
+               download_chunks, format_bytes(buffer, sizeof(buffer), download_bytes));
+        if (unique_bytes > 0)
+                printf(", %" PRIu64 "%% of payload", download_bytes * 100U / unique_bytes);
+        printf(")\n");
+
+        /* The downloaded bytes travel in their store encoding, i.e. typically compressed, hence this is an
+         * upper bound on the transfer */
+        if (arg_rate_limit_bps != UINT64_MAX && download_bytes > 0)
+                printf("Estimated transfer time at %s/s: %" PRIu64 " s (before compression)\n",
+                       format_bytes(buffer2, sizeof(buffer2), arg_rate_limit_bps),
+                       (download_bytes + arg_rate_limit_bps - 1) / arg_rate_limit_bps);
+
+        r = 0;
+
+finish:
+        for (i = 0; i < n_seeds; i++)
+                ca_seed_unref(seeds[i]);
+        free(seeds);
+
+        for (i = 0; i < n_stores; i++)
+                ca_store_unref(stores[i]);
+        free(stores);
+
+        gc_mark_set_release(&seen);
+        ca_index_unref(index);
+
+        return r;
+}
+
+typedef struct Recompress {
+        const char *store_path;
+        CaCompressionType compression;
+        uint64_t rate_limit_bps; /* per thread, 0 means unlimited */
+        char **subdirs;
+        size_t n_subdirs;
+
+        /* The following fields are protected by the lock */
+        pthread_mutex_t lock;
+        size_t next_subdir;
+        uint64_t n_converted, n_skipped;
+        uint64_t old_bytes, new_bytes;
+        int error;
+} Recompress;
+
+static void *recompress_thread(void *arg) {
+        ReallocBuffer compressed = {}, uncompressed = {}, converted = {};
+        Recompress *rc = arg;
+        CaDigest *digest = NULL;
+        uint64_t start_nsec, processed = 0;
+        int root_fd = -1, r;
+
+        /* Transcoding is dominated by decompression CPU, hence work on the 4-character prefix directories
+         * of the store in parallel, one directory at a time per thread. Chunks already stored in the target
+         * format are skipped, which both makes an interrupted run resumable and a finished run idempotent. */
+
+        r = ca_digest_new(arg_digest, &digest);
+        if (r < 0)
+                goto finish;
+
+        root_fd = open(rc->store_path, O_RDONLY|O_CLOEXEC|O_DIRECTORY|O_NOCTTY);
+        if (root_fd < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        start_nsec = now(CLOCK_MONOTONIC);
+
+        for (;;) {
+                uint64_t n_converted = 0, n_skipped = 0, old_bytes = 0, new_bytes = 0;
+                size_t i;
+                DIR *d;
+
+                assert_se(pthread_mutex_lock(&rc->lock) == 0);
+                i = rc->next_subdir++;
+                assert_se(pthread_mutex_unlock(&rc->lock) == 0);
+
+                if (i >= rc->n_subdirs)
+                        break;
+
+                r = xopendirat(root_fd, rc->subdirs[i], O_NOFOLLOW, &d);
+                if (r == -ENOENT) {
+                        r = 0;
+                        continue;
+                }
+                if (r < 0)
+                        goto finish;
+
+                for (;;) {
+                        char name[CA_CHUNK_ID_FORMAT_MAX];
+                        CaChunkID id, actual;
+                        struct dirent *de;
+                        char *t = NULL;
+                        const char *e;
+                        int chunk_fd;
+
+                        errno = 0;
+                        de = readdir(d);
+                        if (!de) {
+                                if (errno != 0) {
+                                        r = -errno;
+                                        closedir(d);
+                                        goto finish;
+                                }
+                                break;
+                        }
+
+                        if (dot_or_dot_dot(de->d_name))
+                                continue;
+
+                        /* Only compressed chunks are eligible, leave uncompressed stores alone */
+                        e = endswith(de->d_name, ca_compressed_chunk_suffix());
+                        if (!e || (size_t) (e - de->d_name) != CA_CHUNK_ID_FORMAT_MAX - 1)
+                                continue;
+
+                        memcpy(name, de->d_name, CA_CHUNK_ID_FORMAT_MAX - 1);
+                        name[CA_CHUNK_ID_FORMAT_MAX - 1] = 0;
+
+                        if (!ca_chunk_id_parse(name, &id))
+                                continue;
+
+                        realloc_buffer_empty(&compressed);
+                        realloc_buffer_empty(&uncompressed);
+                        realloc_buffer_empty(&converted);
+
+                        chunk_fd = openat(dirfd(d), de->d_name, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+                        if (chunk_fd < 0) {
+                                if (errno == ENOENT) /* Somebody removed it underneath us? Fine with us. */
+                                        continue;
+
+                                r = -errno;
+                                closedir(d);
+                                goto finish;
+                        }
+
+                        r = ca_load_fd(chunk_fd, &compressed);
+                        safe_close(chunk_fd);
+                        if (r < 0) {
+                                closedir(d);
+                                goto finish;
+                        }
+
+                        if (detect_compression(realloc_buffer_data(&compressed),
+                                               realloc_buffer_size(&compressed)) == (int) ca_compression_type_normalize(rc->compression)) {
+                                n_skipped++;
+                                continue;
+                        }
+
+                        r = ca_decompress(realloc_buffer_data(&compressed),
+                                          realloc_buffer_size(&compressed),
+                                          &uncompressed);
+                        if (r < 0) {
+                                closedir(d);
+                                goto finish;
+                        }
+
+                        /* Paranoia: verify the chunk really hashes to its file name before we replace the
+                         * only copy of it with a transcoded one. */
+                        r = ca_chunk_id_make(digest,
+                                             realloc_buffer_data(&uncompressed),
+                                             realloc_buffer_size(&uncompressed),
+                                             &actual);
+                        if (r < 0) {
+                                closedir(d);
+                                goto finish;
+                        }
+                        if (!ca_chunk_id_equal(&id, &actual)) {
+                                r = -EBADMSG;
+                                closedir(d);
+                                goto finish;
+                        }
+
+                        r = ca_compress(rc->compression,
+                                        realloc_buffer_data(&uncompressed),
+                                        realloc_buffer_size(&uncompressed),
+                                        &converted);
+                        if (r < 0) {
+                                closedir(d);
+                                goto finish;
+                        }
+
+                        if (asprintf(&t, "%s.%" PRIx64 ".tmp", de->d_name, random_u64()) < 0) {
+                                r = -ENOMEM;
+                                closedir(d);
+                                goto finish;
+                        }
+
+                        chunk_fd = openat(dirfd(d), t, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC|O_NOCTTY, 0666);
+                        if (chunk_fd < 0) {
+                                r = -errno;
+                                free(t);
+                                closedir(d);
+                                goto finish;
+                        }
+
+                        r = loop_write(chunk_fd, realloc_buffer_data(&converted), realloc_buffer_size(&converted));
+                        safe_close(chunk_fd);
+                        if (r < 0) {
+                                (void) unlinkat(dirfd(d), t, 0);
+                                free(t);
+                                closedir(d);
+                                goto finish;
+                        }
+
+                        /* Atomically replace the chunk, so that concurrent readers of a live store see
+                         * either the old or the new encoding, but never anything in between. */
+                        if (renameat(dirfd(d), t, dirfd(d), de->d_name) < 0) {
+                                r = -errno;
+                                (void) unlinkat(dirfd(d), t, 0);
+                                free(t);
+                                closedir(d);
+                                goto finish;
+                        }
+
+                        free(t);
+
+                        n_converted++;
+                        old_bytes += realloc_buffer_size(&compressed);
+                        new_bytes += realloc_buffer_size(&converted);
+                        processed += realloc_buffer_size(&compressed);
+
+                        if (rc->rate_limit_bps > 0) {
+                                uint64_t elapsed, expected;
+
+                                /* Simple pacing: sleep until the bytes we processed so far fit the budget
+                                 * again. The split division avoids overflow for large stores. */
+                                elapsed = now(CLOCK_MONOTONIC) - start_nsec;
+                                expected = processed / rc->rate_limit_bps * NSEC_PER_SEC +
+                                        (processed % rc->rate_limit_bps) * NSEC_PER_SEC / rc->rate_limit_bps;
+
+                                if (expected > elapsed) {
+                                        struct timespec ts = NSEC_TO_TIMESPEC_INIT(expected - elapsed);
+                                        (void) nanosleep(&ts, NULL);
+                                }
+                        }
+                }
+
+                closedir(d);
+
+                assert_se(pthread_mutex_lock(&rc->lock) == 0);
+                rc->n_converted += n_converted;
+                rc->n_skipped += n_skipped;
+                rc->old_bytes += old_bytes;
+                rc->new_bytes += new_bytes;
+
+                if (arg_verbose)
+                        fprintf(stderr, "Recompressed %zu of %zu store directories.\r",
+                                MIN(rc->next_subdir, rc->n_subdirs), rc->n_subdirs);
+
+                assert_se(pthread_mutex_unlock(&rc->lock) == 0);
+        }
+
+finish:
+        safe_close(root_fd);
+
+        realloc_buffer_free(&compressed);
+        realloc_buffer_free(&uncompressed);
+        realloc_buffer_free(&converted);
+
+        ca_digest_free(digest);
+
+        if (r < 0) {
+                assert_se(pthread_mutex_lock(&rc->lock) == 0);
+                if (rc->error == 0)
+                        rc->error = r;
+                assert_se(pthread_mutex_unlock(&rc->lock) == 0);
+        }
+
+        return NULL;
+}
+
+static int verb_recompress(int argc, char *argv[]) {
+        size_t n_threads, i;
+        pthread_t *threads = NULL;
+        char **subdirs = NULL;
+        Recompress recompress;
+        int r;
+
+        if (argc != 2) {
+                fprintf(stderr, "A store path expected.\n");
+                return -EINVAL;
+        }
+
+        /* Enumerate the fan-out directories of the store, then transcode them in parallel. */
+
+        r = store_enumerate_shard_dirs(argv[1], &subdirs);
+        if (r < 0) {
+                fprintf(stderr, "Failed to enumerate store %s: %s\n", argv[1], strerror(-r));
+                goto finish;
+        }
+
+        recompress = (Recompress) {
+                .store_path = argv[1],
+                .compression = arg_compression,
+                .subdirs = subdirs,
+                .n_subdirs = strv_length(subdirs),
+                .lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER,
+        };
+
+        n_threads = arg_threads;
+        if (n_threads == 0) {
+                long v;
+
+                v = sysconf(_SC_NPROCESSORS_ONLN);
+                n_threads = v <= 0 ? 1 : (size_t) v;
+        }
+        if (recompress.n_subdirs > 0 && n_threads > recompress.n_subdirs)
+                n_threads = recompress.n_subdirs;
+
+        if (arg_rate_limit_bps != UINT64_MAX)
+                recompress.rate_limit_bps = MAX(arg_rate_limit_bps / n_threads, UINT64_C(1));
+
+        threads = new0(pthread_t, n_threads);
+        if (!threads) {
+                r = log_oom();
+                goto finish;
+        }
+
+        for (i = 0; i < n_threads; i++)
+                assert_se(pthread_create(threads + i, NULL, recompress_thread, &recompress) == 0);
+        for (i = 0; i < n_threads; i++)
+                assert_se(pthread_join(threads[i], NULL) == 0);
+
+        if (arg_verbose)
+                fputc('\n', stderr);
+
+        if (recompress.error < 0) {
+                r = recompress.error;
+                fprintf(stderr, "Failed to recompress store %s: %s\n", argv[1], strerror(-r));
+                goto finish;
+        }
+
+        printf("Recompressed %" PRIu64 " chunks (%" PRIu64 " → %" PRIu64 " bytes), %" PRIu64 " already converted.\n",
+               recompress.n_converted, recompress.old_bytes, recompress.new_bytes, recompress.n_skipped);
+
+        r = 0;
+
+finish:
+        free(threads);
+        strv_free(subdirs);
+
+        return r;
+}
+
+typedef struct Reshard {
+        const char *store_path;
+        CaChunkFanout fanout; /* the target layout */
+        bool sweep;           /* false: link chunks into the new layout; true: remove stale old names */
+        char **subdirs;
+        size_t n_subdirs;
+
+        /* The following fields are protected by the lock */
+        pthread_mutex_t lock;
+        size_t next_subdir;
+        uint64_t n_linked, n_removed;
+        int error;
+} Reshard;
+
+static int reshard_ensure_dirs(int root_fd, char *path) {
+        char *p, *slash;
+
+        /* Creates the fan-out directories leading up to the last component of 'path' */
+
+        for (p = path; (slash = strchr(p, '/')); p = slash + 1) {
+                *slash = 0;
+
+                if (mkdirat(root_fd, path, 0777) < 0 && errno != EEXIST) {
+                        int r = -errno;
+                        *slash = '/';
+                        return r;
+                }
+
+                *slash = '/';
+        }
+
+        return 0;
+}
+
+static void *reshard_thread(void *arg) {
+        Reshard *rs = arg;
+        int root_fd, r = 0;
+
+        /* Hard-linking (and later unlinking) millions of chunk files is bound by synchronous metadata
+         * operations, hence work on the fan-out directories of the store in parallel, one directory at a
+         * time per thread. */
+
+        root_fd = open(rs->store_path, O_RDONLY|O_CLOEXEC|O_DIRECTORY|O_NOCTTY);
+        if (root_fd < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        for (;;) {
+                uint64_t n_linked = 0, n_removed = 0;
+                size_t i;
+                DIR *d;
+
+                assert_se(pthread_mutex_lock(&rs->lock) == 0);
+                i = rs->next_subdir++;
+                assert_se(pthread_mutex_unlock(&rs->lock) == 0);
+
+                if (i >= rs->n_subdirs)
+                        break;
+
+                r = xopendirat(root_fd, rs->subdirs[i], O_NOFOLLOW, &d);
+                if (IN_SET(r, -ENOENT, -ENOTDIR)) {
+                        r = 0;
+                        continue;
+                }
+                if (r < 0)
+                        goto finish;
+
+                for (;;) {
+                        char name[CA_CHUNK_ID_FORMAT_MAX];
+                        char *actual = NULL, *canonical = NULL;
+                        struct dirent *de;
+                        CaChunkID id;
+
+                        errno = 0;
+                        de = readdir(d);
+                        if (!de) {
+                                if (errno != 0) {
+                                        r = -errno;
+                                        closedir(d);
+                                        goto finish;
+                                }
+                                break;
+                        }
+
+                        if (dot_or_dot_dot(de->d_name))
+                                continue;
+
+                        /* Everything whose name starts with a chunk ID migrates, whatever its suffix, so
+                         * that compressed chunks and "missing" markers survive alike. Temporary files stay
+                         * where they are, their writers still refer to them by the old name. */
+                        if (strlen(de->d_name) < CA_CHUNK_ID_FORMAT_MAX - 1 ||
+                            endswith(de->d_name, ".tmp"))
+                                continue;
+
+                        memcpy(name, de->d_name, CA_CHUNK_ID_FORMAT_MAX - 1);
+                        name[CA_CHUNK_ID_FORMAT_MAX - 1] = 0;
+
+                        if (!ca_chunk_id_parse(name, &id))
+                                continue;
+
+                        if (asprintf(&actual, "%s/%s", rs->subdirs[i], de->d_name) < 0) {
+                                r = -ENOMEM;
+                                closedir(d);
+                                goto finish;
+                        }
+
+                        r = ca_chunk_file_format_path(NULL, &rs->fanout, &id,
+                                                      de->d_name[CA_CHUNK_ID_FORMAT_MAX - 1] != 0 ? de->d_name + CA_CHUNK_ID_FORMAT_MAX - 1 : NULL,
+                                                      &canonical);
+                        if (r < 0) {
+                                free(actual);
+                                closedir(d);
+                                goto finish;
+                        }
+
+                        if (streq(actual, canonical)) {
+                                free(actual);
+                                free(canonical);
+                                continue;
+                        }
+
+                        /* Make the chunk appear under its new name while the old name stays valid. A
+                         * concurrent remover may beat us to the file, a concurrent resharder to the new
+                         * name, both are fine. */
+                        r = reshard_ensure_dirs(root_fd, canonical);
+                        if (r >= 0 &&
+                            linkat(root_fd, actual, root_fd, canonical, 0) < 0 &&
+                            !IN_SET(errno, EEXIST, ENOENT))
+                                r = -errno;
+                        if (r < 0) {
+                                free(actual);
+                                free(canonical);
+                                closedir(d);
+                                goto finish;
+                        }
+
+                        if (rs->sweep) {
+                                char *slash;
+
+                                /* The canonical name exists now, drop the old one and opportunistically
+                                 * clean up the directories it emptied */
+                                if (unlinkat(root_fd, actual, 0) < 0 && errno != ENOENT) {
+                                        r = -errno;
+                                        free(actual);
+                                        free(canonical);
+                                        closedir(d);
+                                        goto finish;
+                                }
+
+                                while ((slash = strrchr(actual, '/'))) {
+                                        *slash = 0;
+
+                                        if (unlinkat(root_fd, actual, AT_REMOVEDIR) < 0)
+                                                break;
+                                }
+
+                                n_removed++;
+                        } else
+                                n_linked++;
+
+                        free(actual);
+                        free(canonical);
+                }
+
+                closedir(d);
+
+                assert_se(pthread_mutex_lock(&rs->lock) == 0);
+                rs->n_linked += n_linked;
+                rs->n_removed += n_removed;
+
+                if (arg_verbose)
+                        fprintf(stderr, "%s %zu of %zu store directories.\r",
+                                rs->sweep ? "Swept" : "Relinked",
+                                MIN(rs->next_subdir, rs->n_subdirs), rs->n_subdirs);
+
+                assert_se(pthread_mutex_unlock(&rs->lock) == 0);
+        }
+
+finish:
+        safe_close(root_fd);
+
+        if (r < 0) {
+                assert_se(pthread_mutex_lock(&rs->lock) == 0);
+                if (rs->error == 0)
+                        rs->error = r;
+                assert_se(pthread_mutex_unlock(&rs->lock) == 0);
+        }
+
+        return NULL;
+}
+
+static int verb_reshard(int argc, char *argv[]) {
+        CaChunkFanout fanout, old_fanout;
+        uint64_t n_linked = 0, n_removed = 0;
+        pthread_t *threads = NULL;
+        char **subdirs = NULL;
+        const char *store_prefix;
+        Reshard reshard;
+        int r, phase;
+
+        if (argc != 3) {
+                fprintf(stderr, "A fan-out specification (e.g. 2x3) and a store path expected.\n");
+                return -EINVAL;
+        }
+
+        r = ca_chunk_fanout_parse(argv[1], &fanout);
+        if (r < 0) {
+                fprintf(stderr, "Failed to parse fan-out specification %s: %s\n", argv[1], strerror(-r));
+                return r;
+        }
+
+        store_prefix = strjoina(argv[2], "/");
+
+        r = ca_chunk_fanout_read(AT_FDCWD, store_prefix, &old_fanout);
+        if (r < 0) {
+                fprintf(stderr, "Failed to read store configuration of %s: %s\n", argv[2], strerror(-r));
+                return r;
+        }
+        if (r > 0 && ca_chunk_fanout_equal(&old_fanout, &fanout)) {
+                printf("Store %s already uses a %ux%u fan-out.\n", argv[2], fanout.digits, fanout.levels);
+                return 0;
+        }
+
+        /* Reshard in two passes, so that the store stays usable throughout: first hard-link every chunk
+         * into its place under the new fan-out while the old names stay valid, then flip the persisted
+         * configuration, and finally sweep the old names — migrating whatever concurrent writers added
+         * under the old layout in the meantime along the way. */
 
-                assert(r == CA_BLOCK_DEVICE_REQUEST);
+        for (phase = 0; phase < 2; phase++) {
+                size_t n_threads, i;
 
-                r = ca_block_device_get_request_offset(nbd, &req_offset);
+                r = store_enumerate_shard_dirs(argv[2], &subdirs);
                 if (r < 0) {
-                        fprintf(stderr, "Failed to get NBD request offset: %s\n", strerror(-r));
+                        fprintf(stderr, "Failed to enumerate store %s: %s\n", argv[2], strerror(-r));
                         goto finish;
                 }
 
-                r = ca_block_device_get_request_size(nbd, &req_size);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to get NBD request size: %s\n", strerror(-r));
-                        goto finish;
+                reshard = (Reshard) {
+                        .store_path = argv[2],
+                        .fanout = fanout,
+                        .sweep = phase > 0,
+                        .subdirs = subdirs,
+                        .n_subdirs = strv_length(subdirs),
+                        .lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER,
+                };
+
+                n_threads = arg_threads;
+                if (n_threads == 0) {
+                        long v;
+
+                        v = sysconf(_SC_NPROCESSORS_ONLN);
+                        n_threads = v <= 0 ? 1 : (size_t) v;
                 }
+                if (reshard.n_subdirs > 0 && n_threads > reshard.n_subdirs)
+                        n_threads = reshard.n_subdirs;
 
-                r = ca_sync_seek_offset(s, req_offset);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to seek: %s\n", strerror(-r));
+                threads = new0(pthread_t, n_threads);
+                if (!threads) {
+                        r = log_oom();
                         goto finish;
                 }
 
-                realloc_buffer_empty(&buffer);
+                for (i = 0; i < n_threads; i++)
+                        assert_se(pthread_create(threads + i, NULL, reshard_thread, &reshard) == 0);
+                for (i = 0; i < n_threads; i++)
+                        assert_se(pthread_join(threads[i], NULL) == 0);
 
-                for (;;) {
-                        bool done = false;
+                if (arg_verbose)
+                        fputc('\n', stderr);
 
-                        if (quit) {
-                                r = 0;
-                                goto finish;
-                        }
+                if (reshard.error < 0) {
+                        r = reshard.error;
+                        fprintf(stderr, "Failed to reshard store %s: %s\n", argv[2], strerror(-r));
+                        goto finish;
+                }
 
-                        r = ca_sync_step(s);
-                        if (r == -ENOMEDIUM) {
-                                fprintf(stderr, "File, URL or resource not found.\n");
-                                goto finish;
-                        }
+                n_linked += reshard.n_linked;
+                n_removed += reshard.n_removed;
+
+                threads = mfree(threads);
+                subdirs = strv_free(subdirs);
+
+                if (phase == 0) {
+                        r = ca_chunk_fanout_write(AT_FDCWD, store_prefix, &fanout);
                         if (r < 0) {
-                                fprintf(stderr, "Failed to run synchronizer: %s\n", strerror(-r));
+                                fprintf(stderr, "Failed to write store configuration of %s: %s\n", argv[2], strerror(-r));
                                 goto finish;
                         }
+                }
+        }
 
-                        switch (r) {
-
-                        case CA_SYNC_FINISHED:
-                                /* We hit EOF but the reply is not yet completed, in this case, fill up with zeroes */
-
-                                assert(realloc_buffer_size(&buffer) < req_size);
+        printf("Resharded store %s to a %ux%u fan-out, linked %" PRIu64 " chunks, removed %" PRIu64 " old names.\n",
+               argv[2], fanout.digits, fanout.levels, n_linked, n_removed);
 
-                                if (!realloc_buffer_extend0(&buffer, req_size - realloc_buffer_size(&buffer))) {
-                                        r = log_oom();
-                                        goto finish;
-                                }
+        r = 0;
 
-                                r = ca_block_device_put_data(nbd, req_offset, realloc_buffer_data(&buffer), req_size);
-                                if (r < 0) {
-                                        fprintf(stderr, "Failed to send reply: %s\n", strerror(-r));
-                                        goto finish;
-                                }
+finish:
+        free(threads);
+        strv_free(subdirs);
 
-                                r = realloc_buffer_advance(&buffer, req_size);
-                                if (r < 0) {
-                                        fprintf(stderr, "Failed to advance buffer: %s\n", strerror(-r));
-                                        goto finish;
-                                }
+        return r;
+}
 
-                                done = true;
-                                break;
+typedef struct VerifyItem {
+        CaChunkID id;
+        uint64_t size; /* uncompressed size, as declared by the index */
+} VerifyItem;
+
+typedef struct Verify {
+        const char *store_path;
+        CaChunkFanout fanout;
+        VerifyItem *items;
+        size_t n_items;
+
+        /* The following fields are protected by the lock */
+        pthread_mutex_t lock;
+        size_t next_item;
+        uint64_t n_ok, n_missing, n_corrupt;
+        uint64_t ok_bytes;
+        int error;
+} Verify;
+
+/* How many chunks a verify thread claims per lock acquisition */
+#define VERIFY_BATCH_SIZE 64U
+
+static int verify_item_compare(const void *a, const void *b) {
+        return memcmp(&((const VerifyItem*) a)->id, &((const VerifyItem*) b)->id, sizeof(CaChunkID));
+}
 
-                        case CA_SYNC_PAYLOAD: {
-                                const void *p;
-                                size_t sz;
+static void *verify_thread(void *arg) {
+        ReallocBuffer buffer = {};
+        Verify *v = arg;
+        CaDigest *digest = NULL;
+        int root_fd = -1, r;
 
-                                r = ca_sync_get_payload(s, &p, &sz);
-                                if (r < 0) {
-                                        fprintf(stderr, "Failed to retrieve synchronizer payload: %s\n", strerror(-r));
-                                        goto finish;
-                                }
+        /* Digesting dominates verification, hence fan the chunks listed in the index out to one worker
+         * per CPU. Chunk files are independent of each other, the only shared state is the item cursor. */
 
-                                if (realloc_buffer_size(&buffer) == 0 && sz >= req_size) {
-                                        /* If this is a full reply, then propagate this directly */
+        r = ca_digest_new(arg_digest, &digest);
+        if (r < 0)
+                goto finish;
 
-                                        r = ca_block_device_put_data(nbd, req_offset, p, MIN(sz, req_size));
-                                        if (r < 0) {
-                                                fprintf(stderr, "Failed to send reply: %s\n", strerror(-r));
-                                                goto finish;
-                                        }
+        root_fd = open(v->store_path, O_RDONLY|O_CLOEXEC|O_DIRECTORY|O_NOCTTY);
+        if (root_fd < 0) {
+                r = -errno;
+                goto finish;
+        }
 
-                                        done = true;
+        for (;;) {
+                uint64_t n_ok = 0, n_missing = 0, n_corrupt = 0, ok_bytes = 0;
+                size_t i, n;
 
-                                } else {
+                assert_se(pthread_mutex_lock(&v->lock) == 0);
+                i = v->next_item;
+                n = MIN(v->n_items - i, (size_t) VERIFY_BATCH_SIZE);
+                v->next_item += n;
+                assert_se(pthread_mutex_unlock(&v->lock) == 0);
 
-                                        if (!realloc_buffer_append(&buffer, p, sz)) {
-                                                r = log_oom();
-                                                goto finish;
-                                        }
+                if (n == 0)
+                        break;
 
-                                        if (realloc_buffer_size(&buffer) >= req_size) {
-                                                r = ca_block_device_put_data(nbd, req_offset, realloc_buffer_data(&buffer), req_size);
-                                                if (r < 0) {
-                                                        fprintf(stderr, "Failed to send reply: %s\n", strerror(-r));
-                                                        goto finish;
-                                                }
+                for (; n > 0; i++, n--) {
+                        VerifyItem *item = v->items + i;
+                        CaChunkID actual;
 
-                                                r = realloc_buffer_advance(&buffer, req_size);
-                                                if (r < 0) {
-                                                        fprintf(stderr, "Failed to advance buffer: %s\n", strerror(-r));
-                                                        goto finish;
-                                                }
+                        /* When sampling is requested only a deterministic subset of the chunks is fully
+                         * digested, the rest is merely checked for presence. The selection keys off the
+                         * chunk ID prefix, hence is uniform and stable across runs with the same ratio. */
+                        if (arg_sample < 100 &&
+                            gc_chunk_id_prefix(&item->id) % 100 >= arg_sample) {
 
-                                                done = true;
-                                        }
+                                r = ca_chunk_file_test(root_fd, NULL, &v->fanout, &item->id);
+                                if (r < 0)
+                                        goto finish;
+                                if (r == 0) {
+                                        n_missing++;
+                                        continue;
                                 }
 
-                                break;
+                                n_ok++;
+                                if (item->size != UINT64_MAX)
+                                        ok_bytes += item->size;
+                                continue;
                         }
 
-                        case CA_SYNC_STEP:
-                        case CA_SYNC_SEED_NEXT_FILE:
-                        case CA_SYNC_SEED_DONE_FILE:
-                        case CA_SYNC_POLL:
-                        case CA_SYNC_FOUND:
-                        case CA_SYNC_NOT_FOUND:
-                                r = process_step_generic(s, r, true);
-                                if (r == -ESHUTDOWN) {
-                                        r = 0;
-                                        goto finish;
-                                }
-                                if (r < 0)
-                                        goto finish;
-
-                                break;
+                        realloc_buffer_empty(&buffer);
 
-                        default:
-                                assert(false);
+                        r = ca_chunk_file_load(root_fd, NULL, &v->fanout, &item->id, CA_CHUNK_UNCOMPRESSED, arg_compression, &buffer, NULL);
+                        if (IN_SET(r, -ENOENT, -EADDRNOTAVAIL)) {
+                                n_missing++;
+                                continue;
+                        }
+                        if (IN_SET(r, -EBADMSG, -EPIPE)) { /* Unpacking the compressed file failed */
+                                n_corrupt++;
+                                continue;
                         }
+                        if (r < 0)
+                                goto finish;
 
-                        if (done)
-                                break;
-                }
-        }
+                        r = ca_chunk_id_make(digest, realloc_buffer_data(&buffer), realloc_buffer_size(&buffer), &actual);
+                        if (r < 0)
+                                goto finish;
 
-finish:
-        realloc_buffer_free(&buffer);
+                        if (!ca_chunk_id_equal(&item->id, &actual) ||
+                            (item->size != UINT64_MAX && realloc_buffer_size(&buffer) != item->size)) {
+                                n_corrupt++;
+                                continue;
+                        }
 
-        ca_sync_unref(s);
-        ca_block_device_unref(nbd);
+                        n_ok++;
+                        ok_bytes += realloc_buffer_size(&buffer);
+                }
 
-        if (rm_symlink)
-                (void) unlink(name);
+                assert_se(pthread_mutex_lock(&v->lock) == 0);
+                v->n_ok += n_ok;
+                v->n_missing += n_missing;
+                v->n_corrupt += n_corrupt;
+                v->ok_bytes += ok_bytes;
 
-        if (input_fd >= 3)
-                (void) close(input_fd);
+                if (arg_verbose)
+                        fprintf(stderr, "Verified %zu of %zu chunks.\r",
+                                MIN(v->next_item, v->n_items), v->n_items);
 
-        free(input);
+                assert_se(pthread_mutex_unlock(&v->lock) == 0);
+        }
 
-        return r;
-}
+        r = 0;
 
-static void free_stores(CaStore **stores, size_t n_stores) {
-        size_t i;
+finish:
+        safe_close(root_fd);
+        realloc_buffer_free(&buffer);
+        ca_digest_free(digest);
 
-        assert(stores || n_stores == 0);
+        if (r < 0) {
+                assert_se(pthread_mutex_lock(&v->lock) == 0);
+                if (v->error == 0)
+                        v->error = r;
+                assert_se(pthread_mutex_unlock(&v->lock) == 0);
+        }
 
-        for (i = 0; i < n_stores; i++)
-                ca_store_unref(stores[i]);
-        free(stores);
+        return NULL;
 }
 
-static int allocate_stores(
-                const char *wstore_path,
-                char **rstore_paths,
-                size_t n_rstores,
-                CaStore ***ret,
-                size_t *ret_n) {
-
-        CaStore **stores = NULL;
-        size_t n_stores, n = 0;
-        char **rstore_path;
-        int r;
+static int verify_tree(const char *index_path, const char *tree_path) {
+        CaIndex *index = NULL, *rechunked = NULL;
+        uint64_t flags, n_chunks = 0, n_differ = 0;
+        size_t cmin, cavg, cmax;
+        CaSync *s = NULL;
+        int r, tmp_fd = -1;
 
-        assert(ret);
-        assert(ret_n);
+        /* Cross-checks a local tree against an index by serializing and re-chunking it only: no chunk
+         * store traffic, no scratch tree, no metadata application. The re-chunked sequence is written to
+         * an unlinked temporary index and compared against the specified one; an identical chunk ID
+         * sequence means the tree would serialize to the exact archive the index describes. */
 
-        n_stores = !!wstore_path + n_rstores;
+        index = ca_index_new_read();
+        if (!index)
+                return log_oom();
 
-        if (n_stores > 0) {
-                stores = new0(CaStore*, n_stores);
-                if (!stores) {
-                        r = log_oom();
-                        goto fail;
-                }
+        r = ca_index_set_path(index, index_path);
+        if (r >= 0)
+                r = ca_index_open(index);
+        if (r < 0) {
+                fprintf(stderr, "Failed to open index file %s: %s\n", index_path, strerror(-r));
+                goto finish;
         }
 
-        if (wstore_path) {
-                stores[n] = ca_store_new();
-                if (!stores[n]) {
-                        r = log_oom();
-                        goto fail;
-                }
-                n++;
-
-                r = ca_store_set_path(stores[n-1], wstore_path);
-                if (r < 0) {
-                        fprintf(stderr, "Unable to set store path %s: %s\n", wstore_path, strerror(-r));
-                        goto fail;
-                }
+        /* Take the feature flags and the chunking parameters from the index, so that the tree is
+         * serialized and cut exactly the way the original "make" did */
+        r = ca_index_get_feature_flags(index, &flags);
+        if (r >= 0)
+                r = ca_index_get_chunk_size_min(index, &cmin);
+        if (r >= 0)
+                r = ca_index_get_chunk_size_avg(index, &cavg);
+        if (r >= 0)
+                r = ca_index_get_chunk_size_max(index, &cmax);
+        if (r < 0) {
+                fprintf(stderr, "Failed to read parameters of index file %s: %s\n", index_path, strerror(-r));
+                goto finish;
         }
 
-        STRV_FOREACH(rstore_path, rstore_paths) {
-                stores[n] = ca_store_new();
-                if (!stores[n]) {
-                        r = log_oom();
-                        goto fail;
-                }
-                n++;
+#ifdef O_TMPFILE
+        tmp_fd = open("/var/tmp", O_TMPFILE|O_RDWR|O_CLOEXEC|O_NOCTTY, 0600);
+#endif
+        if (tmp_fd < 0) {
+                char template[] = "/var/tmp/.casync-verify.XXXXXX";
 
-                r = ca_store_set_path(stores[n-1], *rstore_path);
-                if (r < 0) {
-                        fprintf(stderr, "Unable to set store path %s: %s\n", *rstore_path, strerror(-r));
-                        goto fail;
+                tmp_fd = mkostemp(template, O_CLOEXEC);
+                if (tmp_fd < 0) {
+                        r = -errno;
+                        fprintf(stderr, "Failed to create temporary index: %s\n", strerror(-r));
+                        goto finish;
                 }
-        }
-
-        *ret = stores;
-        *ret_n = n;
-
-        return 0;
-
-fail:
-        free_stores(stores, n);
-
-        return r;
-}
-
-static int verb_pull(int argc, char *argv[]) {
-        const char *base_path, *archive_path, *index_path, *wstore_path;
-        size_t n_stores = 0, i;
-        CaStore **stores = NULL;
-        CaRemote *rr;
-        int r;
-
-        if (argc < 5) {
-                fprintf(stderr, "Expected at least 5 arguments.\n");
-                return -EINVAL;
-        }
-
-        base_path = empty_or_dash_to_null(argv[1]);
-        archive_path = empty_or_dash_to_null(argv[2]);
-        index_path = empty_or_dash_to_null(argv[3]);
-        wstore_path = empty_or_dash_to_null(argv[4]);
-
-        n_stores = !!wstore_path + (argc - 5);
-
-        if (base_path) {
-                fprintf(stderr, "Pull from base or archive not yet supported.\n");
-                return -EOPNOTSUPP;
-        }
 
-        if (!archive_path && !index_path && n_stores == 0) {
-                fprintf(stderr, "Nothing to do.\n");
-                return -EINVAL;
+                (void) unlink(template);
         }
 
-        /* fprintf(stderr, "pull archive: %s index: %s wstore: %s\n", strna(archive_path), strna(index_path), strna(wstore_path)); */
-
-        rr = ca_remote_new();
-        if (!rr)
-                return log_oom();
+        s = ca_sync_new_encode();
+        if (!s) {
+                r = log_oom();
+                goto finish;
+        }
 
-        r = ca_remote_set_local_feature_flags(rr,
-                                              (n_stores > 0 ? CA_PROTOCOL_READABLE_STORE : 0) |
-                                              (index_path ? CA_PROTOCOL_READABLE_INDEX : 0) |
-                                              (archive_path ? CA_PROTOCOL_READABLE_ARCHIVE : 0));
+        r = ca_sync_set_feature_flags(s, flags);
+        if (r >= 0)
+                r = ca_sync_set_chunk_size_min(s, cmin);
+        if (r >= 0)
+                r = ca_sync_set_chunk_size_avg(s, cavg);
+        if (r >= 0)
+                r = ca_sync_set_chunk_size_max(s, cmax);
         if (r < 0) {
-                fprintf(stderr, "Failed to set feature flags: %s\n", strerror(-r));
-                return r;
+                fprintf(stderr, "Failed to configure synchronizer: %s\n", strerror(-r));
+                goto finish;
         }
 
-        if (arg_rate_limit_bps != UINT64_MAX) {
-                r = ca_remote_set_rate_limit_bps(rr, arg_rate_limit_bps);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to set rate limit: %s\n", strerror(-r));
-                        return r;
-                }
+        r = ca_sync_set_threads(s, arg_threads);
+        if (r < 0) {
+                fprintf(stderr, "Failed to configure worker threads: %s\n", strerror(-r));
+                goto finish;
         }
 
-        r = ca_remote_set_io_fds(rr, STDIN_FILENO, STDOUT_FILENO);
+        r = ca_sync_set_base_path(s, tree_path);
         if (r < 0) {
-                fprintf(stderr, "Failed to set I/O file descriptors: %s\n", strerror(-r));
-                return r;
+                fprintf(stderr, "Failed to set base path %s: %s\n", tree_path, strerror(-r));
+                goto finish;
         }
 
-        if (index_path) {
-                r = ca_remote_set_index_path(rr, index_path);
-                if (r < 0) {
-                        fprintf(stderr, "Unable to set index file %s: %s\n", index_path, strerror(-r));
+        {
+                int fd_copy;
+
+                /* The synchronizer closes the index fd it is handed, hence give it a duplicate and keep
+                 * ours for reading the result back */
+                fd_copy = fcntl(tmp_fd, F_DUPFD_CLOEXEC, 3);
+                if (fd_copy < 0) {
+                        r = -errno;
                         goto finish;
                 }
-        }
 
-        if (archive_path) {
-                r = ca_remote_set_archive_path(rr, archive_path);
+                r = ca_sync_set_index_fd(s, fd_copy);
                 if (r < 0) {
-                        fprintf(stderr, "Unable to set archive file %s: %s\n", archive_path, strerror(-r));
+                        safe_close(fd_copy);
+                        fprintf(stderr, "Failed to set temporary index: %s\n", strerror(-r));
                         goto finish;
                 }
         }
 
-        r = allocate_stores(wstore_path, argv + 5, argc - 5, &stores, &n_stores);
-        if (r < 0)
-                goto finish;
-
         for (;;) {
-                unsigned put_count;
-                sigset_t ss;
-                int step;
-
                 if (quit) {
                         fprintf(stderr, "Got exit signal, quitting.\n");
                         r = -ESHUTDOWN;
                         goto finish;
                 }
 
-                step = ca_remote_step(rr);
-                if (step == -EPIPE || step == CA_REMOTE_FINISHED) /* When somebody pulls from us, he's welcome to terminate any time he likes */
-                        break;
-                if (step < 0) {
-                        fprintf(stderr, "Failed to process remote: %s\n", strerror(-step));
-                        r = step;
+                r = ca_sync_step(s);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to re-chunk %s: %s\n", tree_path, strerror(-r));
                         goto finish;
                 }
 
-                put_count = 0;
-                for (;;) {
-                        CaChunkCompression compression;
-                        bool found = false;
-                        const void *p;
-                        CaChunkID id;
-                        uint64_t l;
-
-                        r = ca_remote_can_put_chunk(rr);
-                        if (r < 0) {
-                                fprintf(stderr, "Failed to determine whether there's buffer space for sending: %s\n", strerror(-r));
-                                goto finish;
-                        }
-                        if (r == 0) /* No space to put more */
-                                break;
-
-                        r = ca_remote_next_request(rr, &id);
-                        if (r == -ENODATA) /* No data requested */
-                                break;
-                        if (r < 0) {
-                                fprintf(stderr, "Failed to determine which chunk to send next: %s\n", strerror(-r));
-                                goto finish;
-                        }
-
-                        for (i = 0; i < n_stores; i++) {
-                                r = ca_store_get(stores[i], &id, CA_CHUNK_COMPRESSED, &p, &l, &compression);
-                                if (r >= 0) {
-                                        found = true;
-                                        break;
-                                }
-                                if (r != -ENOENT) {
-                                        fprintf(stderr, "Failed to query store: %s\n", strerror(-r));
-                                        goto finish;
-                                }
-                        }
-
-                        if (found)
-                                r = ca_remote_put_chunk(rr, &id, compression, p, l);
-                        else
-                                r = ca_remote_put_missing(rr, &id);
-                        if (r < 0) {
-                                fprintf(stderr, "Failed to enqueue response: %s\n", strerror(-r));
-                                goto finish;
-                        }
+                if (r == CA_SYNC_FINISHED)
+                        break;
 
-                        put_count ++;
-                }
+                r = process_step_generic(s, r, false);
+                if (r < 0)
+                        goto finish;
+        }
 
-                if (put_count > 0) /* We enqueued more, let's do another step, maybe the remoter wants to write this mow */
-                        continue;
+        s = ca_sync_unref(s); /* flushes and completes the temporary index */
 
-                if (step != CA_REMOTE_POLL)
-                        continue;
+        if (lseek(tmp_fd, 0, SEEK_SET) == (off_t) -1) {
+                r = -errno;
+                goto finish;
+        }
 
-                block_exit_handler(SIG_BLOCK, &ss);
+        rechunked = ca_index_new_read();
+        if (!rechunked) {
+                r = log_oom();
+                goto finish;
+        }
 
-                if (quit)
-                        r = -ESHUTDOWN;
-                else {
-                        r = ca_remote_poll(rr, UINT64_MAX, &ss);
-                        if ((r == -EINTR || r >= 0) && quit)
-                                r = -ESHUTDOWN;
-                }
+        r = ca_index_set_fd(rechunked, tmp_fd);
+        if (r < 0)
+                goto finish;
+        tmp_fd = -1; /* the index owns it now */
 
-                block_exit_handler(SIG_UNBLOCK, NULL);
+        r = ca_index_open(rechunked);
+        if (r < 0) {
+                fprintf(stderr, "Failed to open temporary index: %s\n", strerror(-r));
+                goto finish;
+        }
 
-                if (r == -ESHUTDOWN) {
-                        fprintf(stderr, "Got exit signal, quitting.\n");
+        for (;;) {
+                uint64_t size_a = UINT64_MAX, size_b = UINT64_MAX;
+                CaChunkID a, b;
+                int p, q;
+
+                p = ca_index_read_chunk(index, &a, NULL, &size_a);
+                if (p < 0) {
+                        r = p;
+                        fprintf(stderr, "Failed to read index file %s: %s\n", index_path, strerror(-r));
                         goto finish;
                 }
-                if (r < 0) {
-                        fprintf(stderr, "Failed to poll remoting engine: %s\n", strerror(-r));
+
+                q = ca_index_read_chunk(rechunked, &b, NULL, &size_b);
+                if (q < 0) {
+                        r = q;
+                        fprintf(stderr, "Failed to read temporary index: %s\n", strerror(-r));
                         goto finish;
                 }
+
+                if (p == 0 && q == 0)
+                        break;
+
+                n_chunks++;
+
+                if (p == 0 || q == 0 ||
+                    !ca_chunk_id_equal(&a, &b) ||
+                    size_a != size_b)
+                        n_differ++;
+        }
+
+        if (n_differ > 0) {
+                printf("Tree %s differs from index %s: %" PRIu64 " of %" PRIu64 " chunks differ.\n",
+                       tree_path, index_path, n_differ, n_chunks);
+                r = -EBADMSG;
+                goto finish;
         }
 
+        printf("Tree %s matches index %s (%" PRIu64 " chunks).\n", tree_path, index_path, n_chunks);
         r = 0;
 
 finish:
-        free_stores(stores, n_stores);
-        ca_remote_unref(rr);
+        safe_close(tmp_fd);
+        ca_sync_unref(s);
+        ca_index_unref(index);
+        ca_index_unref(rechunked);
 
         return r;
 }
 
-static int verb_push(int argc, char *argv[]) {
-
-        const char *base_path, *archive_path, *index_path, *wstore_path;
-        bool index_processed = false, index_written = false, archive_written = false;
-        CaStore **stores = NULL;
+static int verb_verify(int argc, char *argv[]) {
+        size_t n_items = 0, items_allocated = 0, n_threads, i, j;
+        VerifyItem *items = NULL;
+        pthread_t *threads = NULL;
         CaIndex *index = NULL;
-        CaRemote *rr = NULL;
-        size_t n_stores = 0;
+        Verify verify;
         int r;
 
-        if (argc < 5) {
-                fprintf(stderr, "Expected at least 5 arguments.\n");
+        if (argc == 3) /* With a second argument, cross-check a local tree by re-chunking it */
+                return verify_tree(argv[1], argv[2]);
+
+        if (argc != 2) {
+                fprintf(stderr, "An index file, optionally followed by a directory or blob, expected.\n");
                 return -EINVAL;
         }
 
-        base_path = empty_or_dash_to_null(argv[1]);
-        archive_path = empty_or_dash_to_null(argv[2]);
-        index_path = empty_or_dash_to_null(argv[3]);
-        wstore_path = empty_or_dash_to_null(argv[4]);
-
-        n_stores = !!wstore_path + (argc - 5);
-
-        if (base_path) {
-                fprintf(stderr, "Push to base not yet supported.\n");
-                return -EOPNOTSUPP;
-        }
+        r = set_default_store(argv[1]);
+        if (r < 0)
+                return r;
 
-        if (!archive_path && !index_path && n_stores == 0) {
-                fprintf(stderr, "Nothing to do.\n");
+        if (!arg_store) {
+                fprintf(stderr, "No store specified.\n");
                 return -EINVAL;
         }
 
-        /* fprintf(stderr, "push archive: %s index: %s wstore: %s\n", strna(archive_path), strna(index_path), strna(wstore_path)); */
-
-        rr = ca_remote_new();
-        if (!rr)
-                return log_oom();
+        /* Collect the IDs and sizes of all chunks the index references, then check each against its
+         * digest on all cores. An index typically references popular chunks many times, hence sort by
+         * ID first and verify each distinct chunk only once. */
 
-        r = ca_remote_set_local_feature_flags(rr,
-                                              (wstore_path ? CA_PROTOCOL_WRITABLE_STORE : 0) |
-                                              (index_path ? CA_PROTOCOL_WRITABLE_INDEX : 0) |
-                                              (archive_path ? CA_PROTOCOL_WRITABLE_ARCHIVE : 0));
-        if (r < 0) {
-                fprintf(stderr, "Failed to set feature flags: %s\n", strerror(-r));
-                return r;
+        index = ca_index_new_read();
+        if (!index) {
+                r = log_oom();
+                goto finish;
         }
 
-        if (arg_rate_limit_bps != UINT64_MAX) {
-                r = ca_remote_set_rate_limit_bps(rr, arg_rate_limit_bps);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to set rate limit: %s\n", strerror(-r));
-                        return r;
-                }
+        r = ca_index_set_path(index, argv[1]);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set index file %s: %s\n", argv[1], strerror(-r));
+                goto finish;
         }
 
-        r = ca_remote_set_io_fds(rr, STDIN_FILENO, STDOUT_FILENO);
+        r = ca_index_open(index);
         if (r < 0) {
-                fprintf(stderr, "Failed to set I/O file descriptors: %s\n", strerror(-r));
-                return r;
+                fprintf(stderr, "Failed to open index file %s: %s\n", argv[1], strerror(-r));
+                goto finish;
         }
 
-        if (index_path) {
-                index = ca_index_new_incremental_read();
-                if (!index) {
-                        r = log_oom();
-                        goto finish;
-                }
+        for (;;) {
+                uint64_t size = UINT64_MAX;
+                CaChunkID id;
 
-                r = ca_index_set_path(index, index_path);
+                r = ca_index_read_chunk(index, &id, NULL, &size);
+                if (r == 0)
+                        break;
                 if (r < 0) {
-                        fprintf(stderr, "Unable to set index file %s: %s\n", index_path, strerror(-r));
+                        fprintf(stderr, "Failed to read index file %s: %s\n", argv[1], strerror(-r));
                         goto finish;
                 }
 
-                r = ca_index_open(index);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to open index file %s: %s\n", index_path, strerror(-r));
+                if (!GREEDY_REALLOC(items, items_allocated, n_items + 1)) {
+                        r = log_oom();
                         goto finish;
                 }
+
+                items[n_items++] = (VerifyItem) {
+                        .id = id,
+                        .size = size,
+                };
         }
 
-        if (archive_path) {
-                r = ca_remote_set_archive_path(rr, archive_path);
-                if (r < 0) {
-                        fprintf(stderr, "Unable to set archive file %s: %s\n", archive_path, strerror(-r));
-                        goto finish;
-                }
+        index = ca_index_unref(index);
+
+        qsort(items, n_items, sizeof(VerifyItem), verify_item_compare);
+
+        for (i = 0, j = 0; i < n_items; i++) {
+                if (j > 0 && ca_chunk_id_equal(&items[j-1].id, &items[i].id))
+                        continue;
+
+                items[j++] = items[i];
         }
 
-        r = allocate_stores(wstore_path, argv + 5, argc - 5, &stores, &n_stores);
-        if (r < 0)
+        if (arg_verbose)
+                fprintf(stderr, "%zu chunks referenced (%zu distinct).\n", n_items, j);
+
+        verify = (Verify) {
+                .store_path = arg_store,
+                .items = items,
+                .n_items = j,
+                .lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER,
+        };
+
+        r = ca_chunk_fanout_read(AT_FDCWD, strjoina(arg_store, "/"), &verify.fanout);
+        if (r < 0) {
+                fprintf(stderr, "Failed to read store configuration of %s: %s\n", arg_store, strerror(-r));
                 goto finish;
+        }
 
-        for (;;) {
-                bool finished;
-                int step;
+        n_threads = arg_threads;
+        if (n_threads == 0) {
+                long v;
 
-                if (quit) {
-                        fprintf(stderr, "Got exit signal, quitting.\n");
-                        r = -ESHUTDOWN;
-                        goto finish;
-                }
+                v = sysconf(_SC_NPROCESSORS_ONLN);
+                n_threads = v <= 0 ? 1 : (size_t) v;
+        }
+        if (verify.n_items > 0 && n_threads > verify.n_items)
+                n_threads = verify.n_items;
 
-                step = ca_remote_step(rr);
-                if (step < 0) {
-                        fprintf(stderr, "Failed to process remote: %s\n", strerror(-step));
-                        r = step;
-                        goto finish;
-                }
+        threads = new0(pthread_t, n_threads);
+        if (!threads) {
+                r = log_oom();
+                goto finish;
+        }
 
-                if (step == CA_REMOTE_FINISHED)
-                        break;
+        for (i = 0; i < n_threads; i++)
+                assert_se(pthread_create(threads + i, NULL, verify_thread, &verify) == 0);
+        for (i = 0; i < n_threads; i++)
+                assert_se(pthread_join(threads[i], NULL) == 0);
+
+        if (arg_verbose)
+                fputc('\n', stderr);
 
-                switch (step) {
+        if (verify.error < 0) {
+                r = verify.error;
+                fprintf(stderr, "Failed to verify store %s: %s\n", arg_store, strerror(-r));
+                goto finish;
+        }
 
-                case CA_REMOTE_POLL: {
-                        sigset_t ss;
+        printf("Verified %" PRIu64 " chunks (%" PRIu64 " bytes), %" PRIu64 " missing, %" PRIu64 " corrupt.\n",
+               verify.n_ok, verify.ok_bytes, verify.n_missing, verify.n_corrupt);
 
-                        block_exit_handler(SIG_BLOCK, &ss);
+        r = verify.n_missing + verify.n_corrupt > 0 ? -EBADMSG : 0;
 
-                        if (quit)
-                                r = -ESHUTDOWN;
-                        else {
-                                r = ca_remote_poll(rr, UINT64_MAX, &ss);
-                                if ((r == -EINTR || r >= 0) && quit)
-                                        r = -ESHUTDOWN;
-                        }
+finish:
+        free(threads);
+        free(items);
+        ca_index_unref(index);
 
-                        block_exit_handler(SIG_UNBLOCK, NULL);
+        return r;
+}
 
-                        if (r == -ESHUTDOWN) {
-                                fprintf(stderr, "Got exit signal, quitting.\n");
-                                goto finish;
-                        }
-                        if (r < 0) {
-                                fprintf(stderr, "Failed to run remoting engine: %s\n", strerror(-r));
-                                goto finish;
-                        }
+/* zstd's own default maximum dictionary size */
+#define DICTIONARY_SIZE_MAX (110U*1024U)
 
-                        break;
-                }
+/* How much uncompressed chunk data to sample at most. zstd recommends roughly a hundred times the
+ * dictionary size, we sample well beyond that when the store is big enough. */
+#define DICTIONARY_SAMPLE_BYTES_MAX (128U*1024U*1024U)
 
-                case CA_REMOTE_STEP:
-                case CA_REMOTE_READ_ARCHIVE:
-                        break;
+static int verb_train_dictionary(int argc, char *argv[]) {
+        ReallocBuffer samples = {}, chunk = {}, uncompressed = {};
+        size_t *sample_sizes = NULL, sample_sizes_allocated = 0, n_samples = 0, z;
+        uint8_t *dictionary = NULL;
+        char **subdirs = NULL, **s;
+        char *t = NULL;
+        DIR *d = NULL;
+        int root_fd = -1, fd, r;
 
-                case CA_REMOTE_READ_ARCHIVE_EOF:
-                        archive_written = true;
-                        break;
+        if (argc != 2) {
+                fprintf(stderr, "A store path expected.\n");
+                return -EINVAL;
+        }
 
-                case CA_REMOTE_READ_INDEX: {
-                        const void *p;
-                        size_t n;
+        /* Samples chunks from the store and trains a zstd dictionary from them, which all further
+         * compression and decompression of the store will then use. Chunk IDs are cryptographic hashes,
+         * hence taking the prefix directories in order still samples uniformly from the chunk content. */
 
-                        r = ca_remote_read_index(rr, &p, &n);
-                        if (r < 0) {
-                                fprintf(stderr, "Failed to read index data: %s\n", strerror(-r));
-                                goto finish;
-                        }
+        root_fd = open(argv[1], O_RDONLY|O_CLOEXEC|O_DIRECTORY|O_NOCTTY);
+        if (root_fd < 0) {
+                r = -errno;
+                fprintf(stderr, "Failed to open store %s: %s\n", argv[1], strerror(-r));
+                goto finish;
+        }
 
-                        r = ca_index_incremental_write(index, p, n);
-                        if (r < 0) {
-                                fprintf(stderr, "Failed to write index data: %s\n", strerror(-r));
-                                goto finish;
-                        }
+        d = opendir(argv[1]);
+        if (!d) {
+                r = -errno;
+                fprintf(stderr, "Failed to open store %s: %s\n", argv[1], strerror(-r));
+                goto finish;
+        }
 
-                        break;
-                }
+        for (;;) {
+                struct dirent *de;
 
-                case CA_REMOTE_READ_INDEX_EOF:
-                        r = ca_index_incremental_eof(index);
-                        if (r < 0) {
-                                fprintf(stderr, "Failed to write index EOF: %s\n", strerror(-r));
+                errno = 0;
+                de = readdir(d);
+                if (!de) {
+                        if (errno != 0) {
+                                r = -errno;
+                                fprintf(stderr, "Failed to enumerate store %s: %s\n", argv[1], strerror(-r));
                                 goto finish;
                         }
-
-                        index_written = true;
                         break;
+                }
 
-                case CA_REMOTE_CHUNK: {
-                        CaChunkCompression compression;
-                        const void *p;
-                        CaChunkID id;
-                        size_t n;
+                if (strlen(de->d_name) != 4 ||
+                    strspn(de->d_name, "0123456789abcdef") != 4)
+                        continue;
 
-                        r = ca_remote_next_chunk(rr, CA_CHUNK_AS_IS, &id, &p, &n, &compression);
-                        if (r < 0) {
-                                fprintf(stderr, "Failed to determine most recent chunk: %s\n", strerror(-r));
-                                goto finish;
-                        }
+                r = strv_extend(&subdirs, de->d_name);
+                if (r < 0) {
+                        r = log_oom();
+                        goto finish;
+                }
+        }
 
-                        r = ca_store_put(stores[0], &id, compression, p, n); /* Write to wstore */
-                        if (r < 0 && r != -EEXIST) {
-                                fprintf(stderr, "Failed to write chunk to store: %s\n", strerror(-r));
-                                goto finish;
-                        }
+        closedir(d);
+        d = NULL;
 
-                        r = ca_remote_forget_chunk(rr, &id);
-                        if (r < 0 && r != -ENOENT) {
-                                fprintf(stderr, "Failed to forget chunk: %s\n", strerror(-r));
-                                goto finish;
-                        }
+        STRV_FOREACH(s, subdirs) {
+                DIR *sd;
 
+                if (realloc_buffer_size(&samples) >= DICTIONARY_SAMPLE_BYTES_MAX)
                         break;
-                }
 
-                default:
-                        assert(false);
-                }
+                r = xopendirat(root_fd, *s, O_NOFOLLOW, &sd);
+                if (r == -ENOENT)
+                        continue;
+                if (r < 0)
+                        goto finish;
 
-                /* Request all chunks from the client that the index it just send us listed but we don't have locally yet. */
                 for (;;) {
-                        /* char ids[CA_CHUNK_ID_FORMAT_MAX]; */
-                        uint64_t remote_flags;
+                        char name[CA_CHUNK_ID_FORMAT_MAX];
+                        const void *p;
+                        struct dirent *de;
+                        const char *e;
                         CaChunkID id;
-                        size_t i;
+                        size_t k, l;
 
-                        if (!index)
-                                break;
-                        if (index_processed)
-                                break;
-                        if (!wstore_path)
+                        if (realloc_buffer_size(&samples) >= DICTIONARY_SAMPLE_BYTES_MAX)
                                 break;
 
-                        r = ca_remote_get_remote_feature_flags(rr, &remote_flags);
-                        if (r == -ENODATA)
+                        errno = 0;
+                        de = readdir(sd);
+                        if (!de) {
+                                if (errno != 0) {
+                                        r = -errno;
+                                        closedir(sd);
+                                        goto finish;
+                                }
                                 break;
-                        if (r < 0) {
-                                fprintf(stderr, "Failed to get remote feature flags: %s\n", strerror(-r));
-                                goto finish;
                         }
 
-                        /* Only request chunks if this is requested by the client side */
-                        if ((remote_flags & CA_PROTOCOL_PUSH_INDEX_CHUNKS) == 0) {
-                                index_processed = true;
-                                break;
+                        if (dot_or_dot_dot(de->d_name))
+                                continue;
+
+                        e = endswith(de->d_name, ca_compressed_chunk_suffix());
+                        k = e ? (size_t) (e - de->d_name) : strlen(de->d_name);
+                        if (k != CA_CHUNK_ID_FORMAT_MAX - 1)
+                                continue;
+
+                        memcpy(name, de->d_name, k);
+                        name[k] = 0;
+
+                        if (!ca_chunk_id_parse(name, &id))
+                                continue;
+
+                        fd = openat(dirfd(sd), de->d_name, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+                        if (fd < 0) {
+                                if (errno == ENOENT)
+                                        continue;
+
+                                r = -errno;
+                                closedir(sd);
+                                goto finish;
                         }
 
-                        r = ca_index_read_chunk(index, &id, NULL, NULL);
-                        if (r == -EAGAIN) /* Not read enough yet */
-                                break;
+                        realloc_buffer_empty(&chunk);
+                        r = ca_load_fd(fd, &chunk);
+                        safe_close(fd);
                         if (r < 0) {
-                                fprintf(stderr, "Failed to read index: %s\n", strerror(-r));
+                                closedir(sd);
                                 goto finish;
                         }
-                        if (r == 0) { /* EOF */
-                                index_processed = true;
-                                break;
-                        }
-
-                        /* fprintf(stderr, "Need %s\n", ca_chunk_id_format(&id, ids)); */
 
-                        r = 0;
-                        for (i = 0; i < n_stores; i++) {
-                                r = ca_store_has(stores[i], &id);
+                        if (e) {
+                                realloc_buffer_empty(&uncompressed);
+                                r = ca_decompress(realloc_buffer_data(&chunk), realloc_buffer_size(&chunk), &uncompressed);
                                 if (r < 0) {
-                                        fprintf(stderr, "Failed to test whether chunk exists locally already: %s\n", strerror(-r));
+                                        closedir(sd);
                                         goto finish;
                                 }
-                                if (r > 0)
-                                        break;
+
+                                p = realloc_buffer_data(&uncompressed);
+                                l = realloc_buffer_size(&uncompressed);
+                        } else {
+                                p = realloc_buffer_data(&chunk);
+                                l = realloc_buffer_size(&chunk);
                         }
-                        if (r > 0) {
-                                /* fprintf(stderr, "Already have %s\n", ca_chunk_id_format(&id, ids)); */
+
+                        if (l == 0)
                                 continue;
-                        }
 
-                        /* fprintf(stderr, "Requesting %s\n", ca_chunk_id_format(&id, ids)); */
+                        if (!realloc_buffer_append(&samples, p, l)) {
+                                r = log_oom();
+                                closedir(sd);
+                                goto finish;
+                        }
 
-                        r = ca_remote_request_async(rr, &id, false);
-                        if (r < 0 && r != -EALREADY && r != -EAGAIN) {
-                                fprintf(stderr, "Failed to request chunk: %s\n", strerror(-r));
+                        if (!GREEDY_REALLOC(sample_sizes, sample_sizes_allocated, n_samples + 1)) {
+                                r = log_oom();
+                                closedir(sd);
                                 goto finish;
                         }
 
-                        /* if (r > 0) */
-                        /*         fprintf(stderr, "New request for %s\n", ca_chunk_id_format(&id, ids)); */
+                        sample_sizes[n_samples++] = l;
                 }
 
-                finished = true;
+                closedir(sd);
+        }
 
-                /* If the index isn't written yet, don't finish yet */
-                if (index_path && (!index_written || !index_processed))
-                        finished = false;
+        if (n_samples < 10) {
+                fprintf(stderr, "Store %s contains too few chunks to train a dictionary from.\n", argv[1]);
+                r = -ENODATA;
+                goto finish;
+        }
 
-                /* If the archive isn't written yet, don't finish yet */
-                if (archive_path && !archive_written)
-                        finished = false;
+        if (arg_verbose)
+                fprintf(stderr, "Sampled %zu chunks (%zu bytes), training...\n",
+                        n_samples, realloc_buffer_size(&samples));
 
-                /* If there are any chunks queued still, don't finish yet */
-                r = ca_remote_has_chunks(rr);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to determine if further requests are pending: %s\n", strerror(-r));
-                        goto finish;
-                }
-                if (r > 0)
-                        finished = false;
+        dictionary = malloc(DICTIONARY_SIZE_MAX);
+        if (!dictionary) {
+                r = log_oom();
+                goto finish;
+        }
 
-                if (finished) {
-                        r = ca_remote_goodbye(rr);
-                        if (r < 0 && r != -EALREADY) {
-                                fprintf(stderr, "Failed to enqueue goodbye: %s\n", strerror(-r));
-                                goto finish;
-                        }
-                }
+        z = ZDICT_trainFromBuffer(dictionary, DICTIONARY_SIZE_MAX,
+                                  realloc_buffer_data(&samples), sample_sizes, (unsigned) n_samples);
+        if (ZDICT_isError(z)) {
+                fprintf(stderr, "Failed to train dictionary: %s\n", ZDICT_getErrorName(z));
+                r = -EIO;
+                goto finish;
         }
 
-        if (index) {
-                r = ca_index_install(index);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to install index on location: %s\n", strerror(-r));
-                        goto finish;
-                }
+        if (asprintf(&t, CA_STORE_DICTIONARY_FILENAME ".%" PRIx64 ".tmp", random_u64()) < 0) {
+                r = log_oom();
+                goto finish;
+        }
+
+        fd = openat(root_fd, t, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC|O_NOCTTY, 0666);
+        if (fd < 0) {
+                r = -errno;
+                fprintf(stderr, "Failed to create dictionary file: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        r = loop_write(fd, dictionary, z);
+        safe_close(fd);
+        if (r < 0) {
+                (void) unlinkat(root_fd, t, 0);
+                fprintf(stderr, "Failed to write dictionary file: %s\n", strerror(-r));
+                goto finish;
         }
 
+        if (renameat(root_fd, t, root_fd, CA_STORE_DICTIONARY_FILENAME) < 0) {
+                r = -errno;
+                (void) unlinkat(root_fd, t, 0);
+                fprintf(stderr, "Failed to install dictionary file: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        printf("Trained %zu byte dictionary from %zu chunks (%zu bytes of samples).\n",
+               z, n_samples, realloc_buffer_size(&samples));
+
         r = 0;
 
 finish:
-        free_stores(stores, n_stores);
-        ca_remote_unref(rr);
-        ca_index_unref(index);
+        if (d)
+                closedir(d);
+
+        safe_close(root_fd);
+
+        realloc_buffer_free(&samples);
+        realloc_buffer_free(&chunk);
+        realloc_buffer_free(&uncompressed);
+
+        free(sample_sizes);
+        free(dictionary);
+        free(t);
+        strv_free(subdirs);
 
         return r;
 }
@@ -3973,6 +9488,74 @@ static int verb_udev(int argc, char *argv[]) {
         return 0;
 }
 
+static int drop_caches(void) {
+        int fd, r;
+
+        /* Flush dirty pages first, so that dropping the cache actually empties it */
+        sync();
+
+        fd = open("/proc/sys/vm/drop_caches", O_WRONLY|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0)
+                return -errno;
+
+        r = loop_write(fd, "3\n", 2);
+        safe_close(fd);
+
+        return r;
+}
+
+static int verb_benchmark(int argc, char *argv[]) {
+        uint64_t total_nsec = 0, min_nsec = UINT64_MAX, max_nsec = 0;
+        unsigned i;
+        int r;
+
+        /* Runs a verb through the full ca_sync_step() pipeline a number of times and reports the wall time
+         * of each run, plus a summary. Combined with --profile this yields per-stage breakdowns, with
+         * --verbose the chunk hit rate and byte counters, replacing ad-hoc scripting around time(1). */
+
+        if (argc < 2) {
+                fprintf(stderr, "A verb to benchmark expected.\n");
+                return -EINVAL;
+        }
+
+        if (!STR_IN_SET(argv[1], "make", "extract")) {
+                fprintf(stderr, "Only the make and extract verbs can be benchmarked.\n");
+                return -EINVAL;
+        }
+
+        for (i = 0; i < arg_iterations; i++) {
+                uint64_t t;
+
+                if (arg_drop_caches) {
+                        r = drop_caches();
+                        if (r < 0)
+                                fprintf(stderr, "Failed to drop caches, ignoring: %s\n", strerror(-r));
+                }
+
+                t = now(CLOCK_MONOTONIC);
+
+                if (streq(argv[1], "make"))
+                        r = verb_make(argc - 1, argv + 1);
+                else
+                        r = verb_extract(argc - 1, argv + 1);
+                if (r < 0)
+                        return r;
+
+                t = now(CLOCK_MONOTONIC) - t;
+
+                fprintf(stderr, "benchmark: run=%u nsec=%" PRIu64 "\n", i + 1, t);
+
+                total_nsec += t;
+                min_nsec = MIN(min_nsec, t);
+                max_nsec = MAX(max_nsec, t);
+        }
+
+        fprintf(stderr, "benchmark: runs=%u min_nsec=%" PRIu64 " avg_nsec=%" PRIu64 " max_nsec=%" PRIu64 "\n",
+                arg_iterations, min_nsec, total_nsec / arg_iterations, max_nsec);
+
+        return 0;
+}
+
 static int dispatch_verb(int argc, char *argv[]) {
         int r;
 
@@ -3990,12 +9573,34 @@ static int dispatch_verb(int argc, char *argv[]) {
                 r = verb_extract(argc, argv);
         else if (STR_IN_SET(argv[0], "list", "mtree", "stat"))
                 r = verb_list(argc, argv);
+        else if (streq(argv[0], "diff"))
+                r = verb_diff(argc, argv);
+        else if (streq(argv[0], "plan"))
+                r = verb_plan(argc, argv);
         else if (streq(argv[0], "digest"))
                 r = verb_digest(argc, argv);
+        else if (streq(argv[0], "analyze"))
+                r = verb_analyze(argc, argv);
         else if (streq(argv[0], "mkdev"))
                 r = verb_mkdev(argc, argv);
+        else if (streq(argv[0], "gc"))
+                r = verb_gc(argc, argv);
+        else if (streq(argv[0], "recompress"))
+                r = verb_recompress(argc, argv);
+        else if (streq(argv[0], "reshard"))
+                r = verb_reshard(argc, argv);
+        else if (streq(argv[0], "serve"))
+                r = verb_serve(argc, argv);
+        else if (streq(argv[0], "verify"))
+                r = verb_verify(argc, argv);
+        else if (streq(argv[0], "train-dictionary"))
+                r = verb_train_dictionary(argc, argv);
+        else if (streq(argv[0], "benchmark"))
+                r = verb_benchmark(argc, argv);
         else if (streq(argv[0], "mount"))
                 r = verb_mount(argc, argv);
+        else if (streq(argv[0], "prefetch"))
+                r = verb_prefetch(argc, argv);
         else if (streq(argv[0], "pull")) /* "Secret" verb, only to be called by ssh-based remoting. */
                 r = verb_pull(argc, argv);
         else if (streq(argv[0], "push")) /* Same here. */
@@ -4019,6 +9624,9 @@ int main(int argc, char *argv[]) {
         if (r <= 0)
                 goto finish;
 
+        if (arg_memory_limit != 0)
+                realloc_buffer_set_memory_limit(arg_memory_limit);
+
         install_exit_handler(NULL);
         block_exit_handler(SIG_UNBLOCK, NULL);
 
@@ -4027,6 +9635,11 @@ int main(int argc, char *argv[]) {
 
 finish:
         free(arg_store);
+        free(arg_cache);
+        free(arg_listen);
+        free(arg_stats_file);
+        free(arg_since);
+        free(arg_lazy);
         strv_free(arg_extra_stores);
         strv_free(arg_seeds);
 
@@ -1,7 +1,13 @@
 #include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/poll.h>
 #include <sys/stat.h>
 
+#include "cacache.h"
 #include "cachunk.h"
 #include "cachunker.h"
 #include "cadecoder.h"
@@ -9,6 +15,7 @@
 #include "caformat-util.h"
 #include "caformat.h"
 #include "caindex.h"
+#include "caprofile.h"
 #include "caprotocol.h"
 #include "caremote.h"
 #include "caseed.h"
@@ -32,6 +39,127 @@ typedef enum CaDirection {
         CA_SYNC_DECODE,
 } CaDirection;
 
+typedef enum CaSyncJobOperation {
+        CA_SYNC_JOB_MAKE,       /* compute the chunk ID and compress (encode path) */
+        CA_SYNC_JOB_DECOMPRESS, /* decompress a chunk read ahead of the decoder (decode path) */
+} CaSyncJobOperation;
+
+/* A chunk handed to a worker thread, either cut off the encoder stream (to calculate its chunk ID and
+ * compress it), or read ahead from the index on extract (to decompress it). The main thread consumes the
+ * results in submission order. */
+typedef struct CaSyncChunkJob CaSyncChunkJob;
+
+struct CaSyncChunkJob {
+        CaSyncChunkJob *queue_next; /* jobs not yet picked up by a worker */
+        CaSyncChunkJob *fifo_next;  /* all jobs in flight, in submission order */
+
+        CaSyncJobOperation op;
+
+        void *data;
+        size_t size;
+        size_t data_allocated;
+
+        CaChunkID id;
+        uint64_t usize; /* for decompress jobs: the uncompressed size the index declared */
+        CaLocation *cache_location; /* where the chunk's first byte came from, if it shall enter the chunking cache */
+        ReallocBuffer processed;
+
+        int fd; /* decompress jobs may carry the chunk file itself instead of its data, for kernel-side copying */
+
+        int result;
+        bool finished;
+};
+
+/* One file we already extracted in this run, by its hardlink digest. Later files with the same digest are
+ * hardlinked to the first copy instead of being stored a second time, see ca_sync_try_hardlink(). */
+typedef struct CaSyncDedupEntry {
+        CaChunkID digest;
+        char *path;
+} CaSyncDedupEntry;
+
+/* An index entry we read ahead of the decoder, but whose chunk we didn't load yet. While queued here the
+ * chunk file is prefetched into the page cache, so that many chunk reads are in flight at once. */
+typedef struct CaSyncLookaheadChunk {
+        CaChunkID id;
+        uint64_t size;
+} CaSyncLookaheadChunk;
+
+/* A recently decompressed chunk we keep around, so that chunks the index references more than once are
+ * loaded and decompressed only once. Bounded both in entries and in bytes, evicted least-recently-used. */
+typedef struct CaSyncCachedChunk {
+        CaChunkID id;
+        void *data;
+        uint64_t size;
+        uint64_t last_used; /* 0 if the entry is unused */
+} CaSyncCachedChunk;
+
+#define CA_SYNC_CHUNK_CACHE_ENTRIES 256
+#define CA_SYNC_DEFAULT_CHUNK_CACHE_BYTES (64U*1024U*1024U)
+
+/* The cache proper, reference counted so that multiple concurrent CaSync operations within one process
+ * can pool it: images provisioned together overlap heavily, hence chunks one operation fetched are
+ * reused by the others. The reference count doubles as the size of the sharing group, which also divides
+ * the request window fairly among the members. All members must be driven from the same thread. */
+typedef struct CaSyncChunkCache {
+        unsigned n_ref;
+        CaSyncCachedChunk *entries;
+        uint64_t bytes;
+        uint64_t max_bytes;
+        uint64_t generation;
+} CaSyncChunkCache;
+
+/* If our working buffers grew beyond this threshold, shrink them again whenever they run empty, so that
+ * transferring one huge file doesn't pin its high-water allocation for the rest of the run. */
+#define CA_SYNC_DEFAULT_BUFFER_BUDGET (64U*1024U*1024U)
+
+/* How many retired chunk jobs we keep around for reuse, so that the per-chunk job struct, its data copy
+ * and its output buffer aren't allocated afresh on every step iteration */
+#define CA_SYNC_JOB_FREELIST_MAX 64U
+
+/* How many chunks ahead of the decoder's index position we request from the remote. Bounding the window
+ * applies backpressure: chunks arrive out of order, and without a bound one slow chunk lets arbitrarily
+ * many later arrivals pile up while the decoder waits. New requests are issued as consumption advances. */
+#define CA_SYNC_PREFETCH_WINDOW 1024U
+
+/* How long the decoder may block on a single already-enqueued chunk before we re-request it with priority
+ * from an alternate store. */
+#define CA_SYNC_HOL_DEADLINE_NSEC (5U * NSEC_PER_SEC)
+
+/* One bucket of the unified seed index: maps the first 64 bit of a chunk ID to the set of seeds whose cache
+ * carries the chunk. A prefix collision can only add seeds to the candidate set, never hide one, hence
+ * lookups through this index miss nothing. */
+typedef struct CaSyncSeedIndexEntry {
+        uint64_t prefix;
+        uint32_t mask; /* 0 if the bucket is unused */
+} CaSyncSeedIndexEntry;
+
+#define CA_SYNC_SEED_INDEX_MAX_SEEDS 32U
+
+/* Physical-extent dedup for "make": a file whose FIEMAP layout is identical to one already chunked in this
+ * run (same device, same physical extents) necessarily carries the same bytes — reflinked snapshot copies
+ * in particular. For those the chunk records of the earlier file are replayed instead of re-reading and
+ * re-hashing the payload. The full extent layout is kept and compared, the hash only picks the bucket,
+ * hence a hash collision can never replay the wrong records. */
+
+typedef struct CaSyncPhysChunk {
+        CaChunkID id;
+        uint64_t size;
+} CaSyncPhysChunk;
+
+typedef struct CaSyncPhysFile {
+        uint64_t hash;
+        uint64_t *layout;        /* device, file size, then (logical, physical, length) per extent */
+        size_t n_layout;
+        CaSyncPhysChunk *chunks;
+        size_t n_chunks;
+        size_t n_chunks_allocated;
+        uint64_t covered;        /* how many payload bytes the chunk records cover */
+        bool sealed;             /* recording ended, the entry is replayable */
+} CaSyncPhysFile;
+
+/* Files more fragmented than this are not worth tracking */
+#define CA_SYNC_PHYS_EXTENTS_MAX 4096U
+
 typedef struct CaSync {
         CaDirection direction;
         bool started;
@@ -41,6 +169,13 @@ typedef struct CaSync {
 
         CaChunker chunker;
 
+        /* State of the fused chunking+digesting pass, see ca_sync_write_chunks(). The digest covers all
+         * bytes of the chunk currently being assembled, except that leading zeroes are merely counted in
+         * fused_digest_pending while fused_digest_dirty is still false, so that all-zero chunks can be
+         * served from the cached zero-chunk digest without hashing. */
+        bool fused_digest_dirty;
+        uint64_t fused_digest_pending;
+
         CaIndex *index;
         CaRemote *remote_index;
 
@@ -55,6 +190,12 @@ typedef struct CaSync {
         size_t n_rstores;
         CaStore *cache_store;
 
+        /* Chunking cache for incremental "make": remembers which chunks unchanged files produced last
+         * time, so that their payload needs neither rechunking, rehashing nor recompression. */
+        CaCache *cache;
+        CaLocation *cache_location; /* start of the chunk currently being assembled, if it is an
+                                     * uninterrupted run of a single file's payload, else NULL */
+
         CaRemote *remote_wstore;
         CaRemote **remote_rstores;
         size_t n_remote_rstores;
@@ -83,10 +224,72 @@ typedef struct CaSync {
 
         CaDigest *chunk_digest;
 
+        size_t n_threads;
+
+        pthread_t *workers;
+        size_t n_workers;
+        bool workers_exit;
+
+        pthread_mutex_t job_mutex;
+        pthread_cond_t job_submitted_cond;
+        pthread_cond_t job_finished_cond;
+
+        CaSyncChunkJob *job_queue, *job_queue_tail;
+        CaSyncChunkJob *job_fifo, *job_fifo_tail;
+        size_t n_jobs;
+
+        /* Retired jobs parked for reuse, linked through queue_next. Only the main thread touches this. */
+        CaSyncChunkJob *job_freelist;
+        size_t n_freelist_jobs;
+
+        bool lookahead_eof;
+
+        CaSyncLookaheadChunk *lookahead; /* circular buffer */
+        size_t lookahead_first, n_lookahead, lookahead_size;
+
+        CaSyncChunkCache *chunk_cache;
+
+        /* Head-of-line stall tracking: the chunk the decoder is currently blocked on, and since when */
+        CaChunkID hol_chunk;
+        uint64_t hol_since; /* CLOCK_MONOTONIC */
+        size_t hol_next_rstore;
+        bool hol_valid;
+
+        /* Physical-extent dedup state, see CaSyncPhysFile above */
+        CaSyncPhysFile **phys_files; /* open-addressed, power of two buckets */
+        size_t n_phys_buckets;
+        size_t n_phys_files;
+        CaSyncPhysFile *phys_rec;    /* the entry currently being recorded, if any */
+        char *phys_rec_path;
+        uint64_t phys_rec_offset;    /* the payload offset the next recorded chunk must start at */
+
+        uint64_t buffer_budget;
+
+        /* Unified lookup index across all seed caches, see ca_sync_build_seed_index() */
+        CaSyncSeedIndexEntry *seed_index;
+        size_t seed_index_buckets, seed_index_entries;
+        uint32_t seed_always_mask;
+        bool seed_index_built;
+
+        /* Sorted chunk set of the index the previously installed version was provisioned from, see
+         * ca_sync_set_since_index_path() */
+        char *since_index_path;
+        CaChunkID *since_ids;
+        size_t n_since_ids;
+        bool since_index_loaded;
+
+        /* The digest of the most recently hashed all-zero chunk, protected by the job mutex. Sparse images
+         * produce the same zero chunk over and over, almost always with the same size, hence a single entry
+         * per size suffices. The digest type is fixed for the lifetime of the sync. */
+        CaChunkID zero_chunk_id;
+        uint64_t zero_chunk_id_size;
+        bool zero_chunk_id_valid;
+
         bool archive_eof;
         bool remote_index_eof;
 
         size_t rate_limit_bps;
+        uint64_t rate_limit_burst;
 
         uint64_t feature_flags;
         uint64_t feature_flags_mask;
@@ -94,12 +297,22 @@ typedef struct CaSync {
         uint64_t n_written_chunks;
         uint64_t n_reused_chunks;
         uint64_t n_prefetched_chunks;
+        uint64_t n_cache_chunk_hits;
+
+        /* Optional mmap'd statistics block for external monitoring, see ca_sync_set_stats_path() */
+        CaSyncStats *stats;
+        uint64_t stats_start_nsec;
+
+        /* Per-stage performance counters, only collected when enabled. All instrumented call sites run on
+         * the synchronizer's main thread, hence no locking is needed. */
+        CaProfile profile;
 
         uint64_t archive_size;
 
         uint64_t chunk_skip;
 
         bool punch_holes:1;
+        bool direct_io:1;
         bool reflink:1;
         bool hardlink:1;
         bool delete:1;
@@ -110,8 +323,19 @@ typedef struct CaSync {
         bool hardlink_digest:1;
         bool payload_digest:1;
 
+        CaSyncMode sync_mode;
+        bool pack_mode:1;
+
         CaFileRoot *archive_root;
 
+        /* Extraction-time file dedup: files already extracted in this run, sorted by hardlink digest, plus
+         * a root for the destination directory to create the links relative to */
+        CaSyncDedupEntry *dedup_entries;
+        size_t n_dedup_entries;
+        size_t n_dedup_entries_allocated;
+        CaFileRoot *dedup_root;
+        int dedup_fd;
+
         uid_t uid_shift;
         uid_t uid_range; /* uid_range == 0 means "full range" */
 
@@ -120,6 +344,7 @@ typedef struct CaSync {
         uint64_t chunk_size_max;
 
         CaCompressionType compression_type;
+        int compression_level;
 } CaSync;
 
 static CaSync *ca_sync_new(void) {
@@ -129,7 +354,7 @@ static CaSync *ca_sync_new(void) {
         if (!s)
                 return NULL;
 
-        s->base_fd = s->boundary_fd = s->archive_fd = -1;
+        s->base_fd = s->boundary_fd = s->archive_fd = s->dedup_fd = -1;
         s->base_mode = (mode_t) -1;
         s->make_mode = (mode_t) -1;
 
@@ -144,6 +369,18 @@ static CaSync *ca_sync_new(void) {
         s->feature_flags = s->feature_flags_mask = UINT64_MAX;
 
         s->compression_type = CA_COMPRESSION_DEFAULT;
+        s->compression_level = CA_COMPRESSION_LEVEL_DEFAULT;
+
+        s->chunk_cache = new0(CaSyncChunkCache, 1);
+        if (!s->chunk_cache)
+                return mfree(s);
+        s->chunk_cache->n_ref = 1;
+        s->chunk_cache->max_bytes = CA_SYNC_DEFAULT_CHUNK_CACHE_BYTES;
+        s->buffer_budget = CA_SYNC_DEFAULT_BUFFER_BUDGET;
+
+        s->job_mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+        s->job_submitted_cond = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+        s->job_finished_cond = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
 
         return s;
 }
@@ -214,6 +451,26 @@ int ca_sync_set_chunk_size_max(CaSync *s, uint64_t v) {
         return 0;
 }
 
+int ca_sync_set_chunker_algorithm(CaSync *s, CaChunkerAlgorithm a) {
+        int r;
+
+        if (!s)
+                return -EINVAL;
+
+        r = ca_chunker_set_algorithm(&s->chunker, a);
+        if (r < 0)
+                return r;
+
+        /* The algorithm is part of the archive format, record it in the feature flags so that it ends up in
+         * the index header and seeds chunk the same way on extraction. */
+        if (a == CA_CHUNKER_FASTCDC)
+                s->feature_flags |= CA_FORMAT_FASTCDC_CHUNKER;
+        else
+                s->feature_flags &= ~CA_FORMAT_FASTCDC_CHUNKER;
+
+        return 0;
+}
+
 int ca_sync_get_chunk_size_avg(CaSync *s, uint64_t *ret) {
         if (!s)
                 return -EINVAL;
@@ -263,6 +520,46 @@ int ca_sync_set_punch_holes(CaSync *s, bool enabled) {
         return 0;
 }
 
+int ca_sync_set_direct_io(CaSync *s, bool enabled) {
+        int r;
+
+        if (!s)
+                return -EINVAL;
+        if (s->direction != CA_SYNC_DECODE)
+                return -ENOTTY;
+
+        if (s->decoder) {
+                r = ca_decoder_set_direct_io(s->decoder, enabled);
+                if (r < 0)
+                        return r;
+        }
+
+        s->direct_io = enabled;
+
+        return 0;
+}
+
+int ca_sync_set_sync_mode(CaSync *s, CaSyncMode mode) {
+        int r;
+
+        if (!s)
+                return -EINVAL;
+        if (mode < 0 || mode >= _CA_SYNC_MODE_MAX)
+                return -EINVAL;
+        if (s->direction != CA_SYNC_DECODE)
+                return -ENOTTY;
+
+        if (s->decoder) {
+                r = ca_decoder_set_sync_mode(s->decoder, mode);
+                if (r < 0)
+                        return r;
+        }
+
+        s->sync_mode = mode;
+
+        return 0;
+}
+
 int ca_sync_set_reflink(CaSync *s, bool enabled) {
         int r;
 
@@ -406,708 +703,625 @@ int ca_sync_set_uid_range(CaSync *s, uid_t u) {
         return 0;
 }
 
-CaSync *ca_sync_unref(CaSync *s) {
-        size_t i;
-
-        if (!s)
+static CaSyncChunkJob* ca_sync_chunk_job_free(CaSyncChunkJob *j) {
+        if (!j)
                 return NULL;
 
-        ca_encoder_unref(s->encoder);
-        ca_decoder_unref(s->decoder);
+        realloc_buffer_free(&j->processed);
+        ca_location_unref(j->cache_location);
+        free(j->data);
+        safe_close(j->fd);
+        return mfree(j);
+}
 
-        ca_store_unref(s->wstore);
-        for (i = 0; i < s->n_rstores; i++)
-                ca_store_unref(s->rstores[i]);
-        free(s->rstores);
-        ca_store_unref(s->cache_store);
+static CaSyncChunkJob* ca_sync_chunk_job_acquire(CaSync *s) {
+        CaSyncChunkJob *j;
 
-        ca_remote_unref(s->remote_wstore);
-        for (i = 0; i < s->n_remote_rstores; i++)
-                ca_remote_unref(s->remote_rstores[i]);
-        free(s->remote_rstores);
+        assert(s);
 
-        for (i = 0; i < s->n_seeds; i++)
-                ca_seed_unref(s->seeds[i]);
-        free(s->seeds);
+        /* Takes a job off the freelist if we have one, keeping its data allocation and the capacity its
+         * output buffer grew to, so that the hot loop doesn't go through the allocator for every chunk */
 
-        safe_close(s->base_fd);
-        safe_close(s->boundary_fd);
-        safe_close(s->archive_fd);
+        j = s->job_freelist;
+        if (j) {
+                s->job_freelist = j->queue_next;
+                s->n_freelist_jobs--;
 
-        free(s->base_path);
-        free(s->archive_path);
-        free(s->boundary_path);
+                *j = (CaSyncChunkJob) {
+                        .data = j->data,
+                        .data_allocated = j->data_allocated,
+                        .processed = j->processed,
+                        .fd = -1,
+                };
 
-        if (s->temporary_base_path) {
-                (void) unlink(s->temporary_base_path);
-                free(s->temporary_base_path);
-        }
-        if (s->temporary_archive_path) {
-                (void) unlink(s->temporary_archive_path);
-                free(s->temporary_archive_path);
+                realloc_buffer_empty(&j->processed);
+                return j;
         }
 
-        ca_index_unref(s->index);
-        ca_remote_unref(s->remote_index);
+        j = new0(CaSyncChunkJob, 1);
+        if (j)
+                j->fd = -1;
 
-        ca_remote_unref(s->remote_archive);
+        return j;
+}
 
-        realloc_buffer_free(&s->buffer);
-        realloc_buffer_free(&s->index_buffer);
-        realloc_buffer_free(&s->archive_buffer);
-        realloc_buffer_free(&s->compress_buffer);
+static void ca_sync_chunk_job_release(CaSync *s, CaSyncChunkJob *j) {
+        if (!j)
+                return;
 
-        ca_file_root_unref(s->archive_root);
+        if (!s || s->n_freelist_jobs >= CA_SYNC_JOB_FREELIST_MAX) {
+                ca_sync_chunk_job_free(j);
+                return;
+        }
 
-        ca_digest_free(s->chunk_digest);
+        j->cache_location = ca_location_unref(j->cache_location);
+        j->fd = safe_close(j->fd);
 
-        return mfree(s);
+        j->queue_next = s->job_freelist;
+        s->job_freelist = j;
+        s->n_freelist_jobs++;
 }
 
-int ca_sync_set_rate_limit_bps(CaSync *s, uint64_t rate_limit_bps) {
-        if (!s)
-                return -EINVAL;
+static int ca_sync_chunk_job_set_data(CaSyncChunkJob *j, const void *p, size_t l) {
+        assert(j);
+        assert(p || l == 0);
 
-        s->rate_limit_bps = rate_limit_bps;
+        if (l > 0) {
+                if (j->data_allocated < l) {
+                        void *m;
+
+                        m = realloc(j->data, l);
+                        if (!m)
+                                return -ENOMEM;
+
+                        j->data = m;
+                        j->data_allocated = l;
+                }
+
+                memcpy(j->data, p, l);
+        }
 
+        j->size = l;
         return 0;
 }
 
-int ca_sync_set_feature_flags(CaSync *s, uint64_t flags) {
-        if (!s)
-                return -EINVAL;
+static int ca_sync_make_chunk_id_cached(CaSync *s, CaDigest *digest, const void *p, size_t l, CaChunkID *ret) {
+        bool zero;
+        int r;
 
-        if (s->direction != CA_SYNC_ENCODE)
-                return -ENOTTY;
-        if (s->encoder)
-                return -EBUSY;
+        assert(s);
+        assert(digest);
+        assert(p || l == 0);
+        assert(ret);
 
-        return ca_feature_flags_normalize(flags, &s->feature_flags);
-}
+        /* Like ca_chunk_id_make(), except that all-zero chunks are served from the cached digest instead of
+         * being hashed again each time. */
 
-int ca_sync_get_feature_flags(CaSync *s, uint64_t *ret) {
-        if (!s)
-                return -EINVAL;
+        zero = l > 0 && zero_run_size(p, l) == l;
+        if (zero) {
+                assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
 
-        if (s->direction == CA_SYNC_ENCODE)
-                *ret = s->feature_flags;
-        else {
-                if (!s->decoder)
-                        return -ENODATA;
+                if (s->zero_chunk_id_valid && s->zero_chunk_id_size == l) {
+                        *ret = s->zero_chunk_id;
+                        assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
+                        return 0;
+                }
 
-                return ca_decoder_get_feature_flags(s->decoder, ret);
+                assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
         }
 
-        return 0;
-}
+        r = ca_chunk_id_make(digest, p, l, ret);
+        if (r < 0)
+                return r;
 
-int ca_sync_get_covering_feature_flags(CaSync *s, uint64_t *ret) {
-        if (!s)
-                return -EINVAL;
+        if (zero) {
+                assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
 
-        if (s->direction != CA_SYNC_ENCODE)
-                return -ENOTTY;
-        if (!s->encoder)
-                return -ENODATA;
+                s->zero_chunk_id = *ret;
+                s->zero_chunk_id_size = l;
+                s->zero_chunk_id_valid = true;
 
-        return ca_encoder_get_covering_feature_flags(s->encoder, ret);
+                assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
+        }
+
+        return 0;
 }
 
-int ca_sync_set_feature_flags_mask(CaSync *s, uint64_t mask) {
-        if (!s)
-                return -EINVAL;
+static void* ca_sync_worker_thread(void *arg) {
+        CaSync *s = arg;
+        CaDigest *digest = NULL;
 
-        if (s->direction != CA_SYNC_DECODE)
-                return -ENOTTY;
-        if (s->decoder)
-                return -EBUSY;
+        assert(s);
 
-        return ca_feature_flags_normalize_mask(mask, &s->feature_flags_mask);
-}
+        assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
 
-static int ca_sync_allocate_index(CaSync *s) {
-        assert(s);
+        for (;;) {
+                CaSyncChunkJob *j;
+                int r;
 
-        if (s->index)
-                return -EBUSY;
-        if (s->remote_index)
-                return -EBUSY;
+                j = s->job_queue;
+                if (!j) {
+                        if (s->workers_exit)
+                                break;
 
-        if (s->direction == CA_SYNC_ENCODE)
-                s->index = ca_index_new_write();
-        else if (s->direction == CA_SYNC_DECODE)
-                s->index = ca_index_new_read();
-        else
-                assert(false);
+                        pthread_cond_wait(&s->job_submitted_cond, &s->job_mutex);
+                        continue;
+                }
 
-        if (!s->index)
-                return -ENOMEM;
+                s->job_queue = j->queue_next;
+                if (!s->job_queue)
+                        s->job_queue_tail = NULL;
 
-        return 0;
-}
+                assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
 
-int ca_sync_set_index_fd(CaSync *s, int fd) {
-        int r;
+                if (j->op == CA_SYNC_JOB_DECOMPRESS)
+                        r = ca_decompress(j->data, j->size, &j->processed);
+                else {
+                        if (digest)
+                                r = 0;
+                        else
+                                r = ca_digest_new(ca_feature_flags_to_digest_type(s->feature_flags), &digest);
+                        if (r >= 0)
+                                r = ca_sync_make_chunk_id_cached(s, digest, j->data, j->size, &j->id);
+
+                        if (r >= 0 && s->wstore) {
+                                int level;
+
+                                /* Compress here, off the main thread. (The compression settings are
+                                 * immutable once the workers run, hence reading them here is fine.) If that
+                                 * doesn't work out (e.g. because the chunk is too small, or too high in
+                                 * entropy to be worth the effort) we'll simply hand the uncompressed data
+                                 * to the store later. */
+                                level = ca_compression_pick_level(s->compression_type, s->compression_level, j->data, j->size);
+                                if (level == -ENODATA ||
+                                    ca_compress_level(s->compression_type, level, j->data, j->size, &j->processed) < 0)
+                                        realloc_buffer_empty(&j->processed);
+                        }
+                }
 
-        if (!s)
-                return -EINVAL;
-        if (fd < 0)
-                return -EINVAL;
+                j->result = r;
 
-        r = ca_sync_allocate_index(s);
-        if (r < 0)
-                return r;
+                assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
 
-        r = ca_index_set_fd(s->index, fd);
-        if (r < 0) {
-                s->index = ca_index_unref(s->index);
-                return r;
+                j->finished = true;
+                pthread_cond_broadcast(&s->job_finished_cond);
         }
 
-        return 0;
+        assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
+
+        ca_digest_free(digest);
+        return NULL;
 }
 
-int ca_sync_set_index_path(CaSync *s, const char *path) {
-        int r;
+static bool ca_sync_want_workers(CaSync *s) {
+        assert(s);
 
-        if (!s)
-                return -EINVAL;
-        if (!path)
-                return -EINVAL;
+        if (s->direction == CA_SYNC_ENCODE)
+                return s->wstore || s->cache_store || s->index;
+
+        /* On decode the workers run lookahead decompression, which we only do in the simple all-local case:
+         * seeds deliver uncompressed data and remotes have their own prefetch logic. */
+        return s->index &&
+                s->n_seeds == 0 &&
+                !s->remote_wstore && s->n_remote_rstores == 0 &&
+                (s->wstore || s->cache_store || s->n_rstores > 0);
+}
 
-        r = ca_sync_allocate_index(s);
-        if (r < 0)
-                return r;
+static int ca_sync_start_workers(CaSync *s) {
+        size_t n, i;
 
-        r = ca_index_set_path(s->index, path);
-        if (r < 0) {
-                s->index = ca_index_unref(s->index);
-                return r;
+        assert(s);
+
+        if (s->n_workers > 0)
+                return 0;
+        if (!ca_sync_want_workers(s))
+                return 0;
+
+        n = s->n_threads;
+        if (n == 0) {
+                long k;
+
+                k = sysconf(_SC_NPROCESSORS_ONLN);
+                n = k <= 0 ? 1 : (size_t) k;
         }
+        if (n <= 1) /* The single-threaded code path is cheaper than a pool of one worker */
+                return 0;
 
-        return 0;
-}
+        s->workers = new0(pthread_t, n);
+        if (!s->workers)
+                return -ENOMEM;
 
-int ca_sync_set_index_remote(CaSync *s, const char *url) {
-        uint64_t flags;
-        int r;
+        s->workers_exit = false;
 
-        if (!s)
-                return -EINVAL;
-        if (!url)
-                return -EINVAL;
-
-        if (s->index)
-                return -EBUSY;
-        if (s->remote_index)
-                return -EBUSY;
-
-        flags = s->direction == CA_SYNC_ENCODE ? CA_PROTOCOL_PUSH_INDEX : CA_PROTOCOL_PULL_INDEX;
-
-        if (s->remote_wstore) {
-                /* Try to reuse the main store remote for the index too, if it matches the same server */
+        for (i = 0; i < n; i++) {
+                int k;
 
-                r = ca_remote_set_index_url(s->remote_wstore, url);
-                if (r >= 0) {
-                        r = ca_remote_add_local_feature_flags(s->remote_wstore, flags);
-                        if (r < 0)
-                                return r;
+                k = pthread_create(s->workers + i, NULL, ca_sync_worker_thread, s);
+                if (k != 0) {
+                        if (i == 0) {
+                                s->workers = mfree(s->workers);
+                                return -k;
+                        }
 
-                        s->remote_index = ca_remote_ref(s->remote_wstore);
-                        return 0;
+                        /* We got at least one worker, make do with what we have */
+                        break;
                 }
-                if (r != -EBUSY) /* Fail, except when the reason is that it matches the same server. */
-                        return r;
-        }
-
-        s->remote_index = ca_remote_new();
-        if (!s->remote_index)
-                return -ENOMEM;
 
-        if (s->rate_limit_bps > 0) {
-                r = ca_remote_set_rate_limit_bps(s->remote_index, s->rate_limit_bps);
-                if (r < 0)
-                        return r;
+                s->n_workers = i + 1;
         }
 
-        r = ca_remote_set_index_url(s->remote_index, url);
-        if (r < 0)
-                return r;
-
-        r = ca_remote_set_local_feature_flags(s->remote_index, flags);
-        if (r < 0)
-                return r;
-
         return 0;
 }
 
-int ca_sync_set_index_auto(CaSync *s, const char *locator) {
-        CaLocatorClass c;
+static CaSyncChunkCache *ca_sync_chunk_cache_free(CaSyncChunkCache *cache) {
+        size_t i;
 
-        if (!s)
-                return -EINVAL;
-        if (!locator)
-                return -EINVAL;
+        if (!cache)
+                return NULL;
 
-        c = ca_classify_locator(locator);
-        if (c < 0)
-                return -EINVAL;
+        assert(cache->n_ref > 0);
+        if (--cache->n_ref > 0)
+                return NULL;
 
-        if (c == CA_LOCATOR_PATH)
-                return ca_sync_set_index_path(s, locator);
+        if (cache->entries) {
+                for (i = 0; i < CA_SYNC_CHUNK_CACHE_ENTRIES; i++)
+                        free(cache->entries[i].data);
+                free(cache->entries);
+        }
 
-        return ca_sync_set_index_remote(s, locator);
+        return mfree(cache);
 }
 
-int ca_sync_set_base_fd(CaSync *s, int fd) {
-        if (!s)
-                return -EINVAL;
-        if (fd < 0)
-                return -EINVAL;
+static void ca_sync_stop_workers(CaSync *s) {
+        size_t i;
 
-        if (s->base_fd >= 0)
-                return -EBUSY;
-        if (s->base_mode != (mode_t) -1)
-                return -EBUSY;
-        if (s->base_path)
-                return -EBUSY;
-        if (s->boundary_fd >= 0)
-                return -EBUSY;
-        if (s->boundary_path)
-                return -EBUSY;
+        assert(s);
 
-        s->base_fd = fd;
-        return 0;
-}
+        if (s->n_workers > 0) {
+                assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
+                s->workers_exit = true;
+                pthread_cond_broadcast(&s->job_submitted_cond);
+                assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
 
-int ca_sync_set_base_path(CaSync *s, const char *path) {
-        if (!s)
-                return -EINVAL;
-        if (!path)
-                return -EINVAL;
+                for (i = 0; i < s->n_workers; i++)
+                        (void) pthread_join(s->workers[i], NULL);
 
-        if (s->base_fd >= 0)
-                return -EBUSY;
-        if (s->base_path)
-                return -EBUSY;
-        if (s->boundary_fd >= 0)
-                return -EBUSY;
-        if (s->boundary_path)
-                return -EBUSY;
+                s->n_workers = 0;
+        }
 
-        if (s->base_mode == (mode_t) -1 || S_ISDIR(s->base_mode)) {
+        s->workers = mfree(s->workers);
 
-                s->base_fd = open(path, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_DIRECTORY);
-                if (s->base_fd >= 0) /* Base exists already and is a directory */
-                        return 0;
+        while (s->job_fifo) {
+                CaSyncChunkJob *j = s->job_fifo;
 
-                if (s->direction == CA_SYNC_ENCODE && errno != ENOTDIR)
-                        return -errno;
+                s->job_fifo = j->fifo_next;
+                ca_sync_chunk_job_free(j);
         }
 
-        if (s->direction == CA_SYNC_ENCODE) {
+        s->job_fifo_tail = NULL;
+        s->job_queue = s->job_queue_tail = NULL;
+        s->n_jobs = 0;
 
-                s->base_fd = open(path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
-                if (s->base_fd < 0)
-                        return -errno;
+        while (s->job_freelist) {
+                CaSyncChunkJob *j = s->job_freelist;
 
-                return 0;
+                s->job_freelist = j->queue_next;
+                ca_sync_chunk_job_free(j);
         }
+        s->n_freelist_jobs = 0;
 
-        assert(s->direction == CA_SYNC_DECODE);
-
-        s->base_path = strdup(path);
-        if (!s->base_path)
-                return -ENOMEM;
-
-        return 0;
-}
+        s->lookahead = mfree(s->lookahead);
+        s->lookahead_first = s->n_lookahead = s->lookahead_size = 0;
 
-int ca_sync_set_make_mode(CaSync *s, mode_t m) {
-        if (!s)
-                return -EINVAL;
-        if (m & ~0666)
-                return -EINVAL;
-        if (s->direction != CA_SYNC_ENCODE)
-                return -ENOTTY;
+        /* Drop the cached chunks, unless other operations still share the cache with us */
+        if (s->chunk_cache && s->chunk_cache->n_ref == 1 && s->chunk_cache->entries) {
+                size_t i;
 
-        if (s->make_mode != (mode_t) -1)
-                return -EBUSY;
+                for (i = 0; i < CA_SYNC_CHUNK_CACHE_ENTRIES; i++)
+                        free(s->chunk_cache->entries[i].data);
 
-        s->make_mode = m;
-        return 0;
+                s->chunk_cache->entries = mfree(s->chunk_cache->entries);
+                s->chunk_cache->bytes = s->chunk_cache->generation = 0;
+        }
 }
 
-int ca_sync_set_base_mode(CaSync *s, mode_t m) {
+int ca_sync_set_threads(CaSync *s, size_t n_threads) {
         if (!s)
                 return -EINVAL;
-        if (m & ~(07777 | S_IFMT))
-                return -EINVAL;
-        if (!S_ISREG(m) && !S_ISDIR(m) && !S_ISBLK(m))
-                return -ENOTTY;
-        if (s->direction == CA_SYNC_ENCODE)
-                return -ENOTTY;
-
-        if (s->base_fd >= 0)
-                return -EBUSY;
-        if (s->base_mode != (mode_t) -1)
-                return -EBUSY;
-        if (s->boundary_fd >= 0)
-                return -EBUSY;
-        if (s->boundary_path)
+        if (s->started)
                 return -EBUSY;
 
-        s->base_mode = m;
+        s->n_threads = n_threads;
         return 0;
 }
 
-int ca_sync_set_boundary_fd(CaSync *s, int fd) {
+int ca_sync_set_chunk_cache_bytes(CaSync *s, uint64_t bytes) {
         if (!s)
                 return -EINVAL;
-        if (fd < 0)
-                return -EINVAL;
-
-        if (s->base_fd >= 0)
-                return -EBUSY;
-        if (s->base_mode != (mode_t) -1)
-                return -EBUSY;
-        if (s->base_path)
-                return -EBUSY;
-        if (s->boundary_fd >= 0)
-                return -EBUSY;
-        if (s->boundary_path)
-                return -EBUSY;
 
-        if (s->direction == CA_SYNC_ENCODE)
-                return -ENOTTY;
+        /* Sets the byte budget of the in-memory chunk cache. Zero disables the cache. */
 
-        s->boundary_fd = fd;
+        s->chunk_cache->max_bytes = bytes;
         return 0;
 }
 
-int ca_sync_set_boundary_path(CaSync *s, const char *p) {
+int ca_sync_share_chunk_cache(CaSync *s, CaSync *from) {
         if (!s)
                 return -EINVAL;
-        if (!p)
+        if (!from)
                 return -EINVAL;
-
-        if (s->base_fd >= 0)
-                return -EBUSY;
-        if (s->base_mode != (mode_t) -1)
-                return -EBUSY;
-        if (s->base_path)
-                return -EBUSY;
-        if (s->boundary_fd >= 0)
-                return -EBUSY;
-        if (s->boundary_path)
+        if (s == from)
+                return -EINVAL;
+        if (s->started)
                 return -EBUSY;
 
-        if (s->direction == CA_SYNC_ENCODE)
-                return -ENOTTY;
-
-        s->boundary_fd = open(p, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_DIRECTORY);
-        if (s->boundary_fd >= 0) /* Base exists already is a directory, good */
+        if (s->chunk_cache == from->chunk_cache)
                 return 0;
 
-        if (errno != ENOENT)
-                return -errno;
+        ca_sync_chunk_cache_free(s->chunk_cache);
 
-        s->boundary_path = strdup(p);
-        if (!s->boundary_path)
-                return -ENOMEM;
+        s->chunk_cache = from->chunk_cache;
+        s->chunk_cache->n_ref++;
 
         return 0;
 }
 
-int ca_sync_set_archive_fd(CaSync *s, int fd) {
-        if (!s)
-                return -EINVAL;
-        if (fd < 0)
-                return -EINVAL;
-
-        if (s->archive_fd >= 0)
-                return -EBUSY;
-        if (s->archive_path)
-                return -EBUSY;
-        if (s->remote_archive)
-                return -EBUSY;
-
-        s->archive_fd = fd;
-        return 0;
-}
+int ca_sync_set_buffer_budget(CaSync *s, uint64_t bytes) {
+        int r;
 
-int ca_sync_set_archive_path(CaSync *s, const char *path) {
         if (!s)
                 return -EINVAL;
-        if (!path)
-                return -EINVAL;
 
-        if (s->archive_fd >= 0)
-                return -EBUSY;
-        if (s->archive_path)
-                return -EBUSY;
-        if (s->remote_archive)
-                return -EBUSY;
+        /* Sets the allocation size above which our working buffers are shrunk again whenever they run
+         * empty. Zero means "unbounded", i.e. buffers keep their high-water allocation. */
 
-        if (s->direction == CA_SYNC_ENCODE) {
-                s->archive_path = strdup(path);
-                if (!s->archive_path)
-                        return -ENOMEM;
+        s->buffer_budget = bytes;
 
-                return 0;
+        if (s->encoder) {
+                r = ca_encoder_set_buffer_budget(s->encoder, bytes);
+                if (r < 0)
+                        return r;
         }
 
-        assert(s->direction == CA_SYNC_DECODE);
-
-        s->archive_fd = open(path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
-        if (s->archive_fd < 0)
-                return -errno;
-
         return 0;
 }
 
-int ca_sync_set_archive_remote(CaSync *s, const char *url) {
-        int r;
-
+int ca_sync_set_memory_limit(CaSync *s, uint64_t bytes) {
         if (!s)
                 return -EINVAL;
-        if (!url)
-                return -EINVAL;
 
-        if (s->archive_fd >= 0)
-                return -EBUSY;
-        if (s->archive_path)
-                return -EBUSY;
-        if (s->remote_archive)
-                return -EBUSY;
-
-        s->remote_archive = ca_remote_new();
-        if (!s->remote_archive)
-                return -ENOMEM;
-
-        r = ca_remote_set_archive_url(s->remote_archive, url);
-        if (r < 0)
-                return r;
+        /* Installs an overall byte budget for the I/O buffers. Note that the accounting is process-wide —
+         * the buffers are spread across our remotes, indexes and compressor paths, and on memory-starved
+         * systems it's their sum that matters. When the budget is approached, remote reads are paused,
+         * prefetching stops and drained buffers are compacted, until allocations are back below it. */
 
-        r = ca_remote_set_local_feature_flags(s->remote_archive,
-                                              s->direction == CA_SYNC_ENCODE ? CA_PROTOCOL_PUSH_ARCHIVE : CA_PROTOCOL_PULL_ARCHIVE);
-        if (r < 0)
-                return r;
+        realloc_buffer_set_memory_limit(bytes);
 
         return 0;
 }
 
-int ca_sync_set_archive_auto(CaSync *s, const char *locator) {
-        CaLocatorClass c;
+static void ca_sync_phys_flush(CaSync *s);
+
+CaSync *ca_sync_unref(CaSync *s) {
+        size_t i;
 
         if (!s)
-                return -EINVAL;
-        if (!locator)
-                return -EINVAL;
+                return NULL;
 
-        c = ca_classify_locator(locator);
-        if (c < 0)
-                return -EINVAL;
+        ca_sync_stop_workers(s);
 
-        if (c == CA_LOCATOR_PATH)
-                return ca_sync_set_archive_path(s, locator);
+        ca_encoder_unref(s->encoder);
+        ca_decoder_unref(s->decoder);
 
-        return ca_sync_set_archive_remote(s, locator);
-}
+        ca_store_unref(s->wstore);
+        for (i = 0; i < s->n_rstores; i++)
+                ca_store_unref(s->rstores[i]);
+        free(s->rstores);
+        ca_store_unref(s->cache_store);
+        ca_cache_unref(s->cache);
+        ca_location_unref(s->cache_location);
+        ca_sync_phys_flush(s);
 
-int ca_sync_set_store_path(CaSync *s, const char *path) {
-        int r;
+        ca_remote_unref(s->remote_wstore);
+        for (i = 0; i < s->n_remote_rstores; i++)
+                ca_remote_unref(s->remote_rstores[i]);
+        free(s->remote_rstores);
 
-        if (!s)
-                return -EINVAL;
-        if (!path)
-                return -EINVAL;
+        for (i = 0; i < s->n_seeds; i++)
+                ca_seed_unref(s->seeds[i]);
+        free(s->seeds);
 
-        if (s->wstore)
-                return -EBUSY;
-        if (s->remote_wstore)
-                return -EBUSY;
+        for (i = 0; i < s->n_dedup_entries; i++)
+                free(s->dedup_entries[i].path);
+        free(s->dedup_entries);
+        ca_file_root_unref(s->dedup_root);
 
-        s->wstore = ca_store_new();
-        if (!s->wstore)
-                return -ENOMEM;
+        if (s->stats)
+                (void) munmap(s->stats, sizeof(CaSyncStats));
 
-        r = ca_store_set_path(s->wstore, path);
-        if (r < 0) {
-                s->wstore = ca_store_unref(s->wstore);
-                return r;
+        safe_close(s->base_fd);
+        safe_close(s->boundary_fd);
+        safe_close(s->archive_fd);
+        safe_close(s->dedup_fd);
+
+        free(s->base_path);
+        free(s->archive_path);
+        free(s->boundary_path);
+
+        if (s->temporary_base_path) {
+                (void) unlink(s->temporary_base_path);
+                free(s->temporary_base_path);
+        }
+        if (s->temporary_archive_path) {
+                (void) unlink(s->temporary_archive_path);
+                free(s->temporary_archive_path);
         }
 
-        return 0;
-}
+        ca_index_unref(s->index);
+        ca_remote_unref(s->remote_index);
 
-int ca_sync_set_store_remote(CaSync *s, const char *url) {
-        uint64_t flags;
-        int r;
+        ca_remote_unref(s->remote_archive);
 
-        if (!s)
-                return -EINVAL;
-        if (!url)
-                return -EINVAL;
+        realloc_buffer_free(&s->buffer);
+        realloc_buffer_free(&s->index_buffer);
+        realloc_buffer_free(&s->archive_buffer);
+        realloc_buffer_free(&s->compress_buffer);
 
-        if (s->wstore)
-                return -EBUSY;
-        if (s->remote_wstore)
-                return -EBUSY;
+        ca_file_root_unref(s->archive_root);
 
-        flags = s->direction == CA_SYNC_ENCODE ? CA_PROTOCOL_PUSH_CHUNKS : CA_PROTOCOL_PULL_CHUNKS;
+        ca_digest_free(s->chunk_digest);
 
-        if (s->remote_index) {
-                /* Try to reuse the index remote for the main store too, if it matches the same server */
+        free(s->seed_index);
+        ca_sync_chunk_cache_free(s->chunk_cache);
 
-                r = ca_remote_set_store_url(s->remote_index, url);
-                if (r >= 0) {
+        free(s->since_index_path);
+        free(s->since_ids);
 
-                        r = ca_remote_add_local_feature_flags(s->remote_index, flags);
-                        if (r < 0)
-                                return r;
+        return mfree(s);
+}
 
-                        s->remote_wstore = ca_remote_ref(s->remote_index);
-                        return 0;
-                }
-                if (r != -EBUSY)
-                        return r;
-        }
+static void ca_sync_rebalance_rate_limit(CaSync *s) {
+        CaRemote *remotes[3];
+        size_t n = 0, n_total, i;
+        uint64_t share;
 
-        s->remote_wstore = ca_remote_new();
-        if (!s->remote_wstore)
-                return -ENOMEM;
+        assert(s);
 
-        if (s->rate_limit_bps > 0) {
-                r = ca_remote_set_rate_limit_bps(s->remote_wstore, s->rate_limit_bps);
-                if (r < 0)
-                        return r;
+        /* Divides the configured rate limit fairly among all distinct remote connections of this sync
+         * operation, so that pulling index, archive and chunks from separate servers in parallel still stays
+         * within the overall budget instead of multiplying it. Note that the index/wstore remotes might be
+         * references to the same connection, hence dedup by pointer. */
+
+        if (s->rate_limit_bps == 0)
+                return;
+
+        if (s->remote_archive)
+                remotes[n++] = s->remote_archive;
+        if (s->remote_index &&
+            s->remote_index != s->remote_archive)
+                remotes[n++] = s->remote_index;
+        if (s->remote_wstore &&
+            s->remote_wstore != s->remote_archive &&
+            s->remote_wstore != s->remote_index)
+                remotes[n++] = s->remote_wstore;
+
+        n_total = n + s->n_remote_rstores;
+        if (n_total == 0)
+                return;
+
+        share = MAX((uint64_t) s->rate_limit_bps / n_total, UINT64_C(1));
+
+        for (i = 0; i < n; i++) {
+                (void) ca_remote_set_rate_limit_bps(remotes[i], share);
+                (void) ca_remote_set_rate_limit_burst(remotes[i], s->rate_limit_burst);
         }
+        for (i = 0; i < s->n_remote_rstores; i++) {
+                (void) ca_remote_set_rate_limit_bps(s->remote_rstores[i], share);
+                (void) ca_remote_set_rate_limit_burst(s->remote_rstores[i], s->rate_limit_burst);
+        }
+}
 
-        r = ca_remote_set_store_url(s->remote_wstore, url);
-        if (r < 0)
-                return r;
+int ca_sync_set_rate_limit_bps(CaSync *s, uint64_t rate_limit_bps) {
+        if (!s)
+                return -EINVAL;
 
-        r = ca_remote_set_local_feature_flags(s->remote_wstore, flags);
-        if (r < 0)
-                return r;
+        s->rate_limit_bps = rate_limit_bps;
+        ca_sync_rebalance_rate_limit(s);
 
         return 0;
 }
 
-int ca_sync_set_store_auto(CaSync *s, const char *locator) {
-        CaLocatorClass c;
-
+int ca_sync_set_rate_limit_burst(CaSync *s, uint64_t burst_bytes) {
         if (!s)
                 return -EINVAL;
-        if (!locator)
-                return -EINVAL;
-
-        c = ca_classify_locator(locator);
-        if (c < 0)
-                return -EINVAL;
 
-        if (c == CA_LOCATOR_PATH)
-                return ca_sync_set_store_path(s, locator);
+        s->rate_limit_burst = burst_bytes;
+        ca_sync_rebalance_rate_limit(s);
 
-        return ca_sync_set_store_remote(s, locator);
+        return 0;
 }
 
-int ca_sync_add_store_path(CaSync *s, const char *path) {
-        CaStore **array, *store;
+int ca_sync_set_feature_flags(CaSync *s, uint64_t flags) {
         int r;
 
         if (!s)
                 return -EINVAL;
-        if (!path)
-                return -EINVAL;
 
-        store = ca_store_new();
-        if (!store)
-                return -ENOMEM;
+        if (s->direction != CA_SYNC_ENCODE)
+                return -ENOTTY;
+        if (s->encoder)
+                return -EBUSY;
 
-        r = ca_store_set_path(store, path);
-        if (r < 0) {
-                ca_store_unref(store);
+        r = ca_feature_flags_normalize(flags, &s->feature_flags);
+        if (r < 0)
                 return r;
-        }
-
-        array = realloc_multiply(s->rstores, sizeof(CaStore*), s->n_rstores+1);
-        if (!array) {
-                ca_store_unref(store);
-                return -ENOMEM;
-        }
-
-        s->rstores = array;
-        s->rstores[s->n_rstores++] = store;
 
-        return 0;
+        return ca_chunker_set_algorithm(&s->chunker,
+                                        (s->feature_flags & CA_FORMAT_FASTCDC_CHUNKER) ? CA_CHUNKER_FASTCDC : CA_CHUNKER_BUZHASH);
 }
 
-int ca_sync_add_store_remote(CaSync *s, const char *url) {
-        CaRemote **array, *remote;
-        int r;
-
+int ca_sync_get_feature_flags(CaSync *s, uint64_t *ret) {
         if (!s)
                 return -EINVAL;
-        if (!url)
-                return -EINVAL;
-
-        remote = ca_remote_new();
-        if (!remote)
-                return -ENOMEM;
 
-        r = ca_remote_set_store_url(remote, url);
-        if (r < 0) {
-                ca_remote_unref(remote);
-                return r;
-        }
+        if (s->direction == CA_SYNC_ENCODE)
+                *ret = s->feature_flags;
+        else {
+                if (!s->decoder)
+                        return -ENODATA;
 
-        array = realloc_multiply(s->remote_rstores, sizeof(CaRemote*),  s->n_remote_rstores+1);
-        if (!array) {
-                ca_remote_unref(remote);
-                return -ENOMEM;
+                return ca_decoder_get_feature_flags(s->decoder, ret);
         }
 
-        s->remote_rstores = array;
-        s->remote_rstores[s->n_remote_rstores++] = remote;
-
         return 0;
 }
 
-int ca_sync_add_store_auto(CaSync *s, const char *locator) {
-        CaLocatorClass c;
-
+int ca_sync_get_covering_feature_flags(CaSync *s, uint64_t *ret) {
         if (!s)
                 return -EINVAL;
-        if (!locator)
-                return -EINVAL;
 
-        c = ca_classify_locator(locator);
-        if (c < 0)
+        if (s->direction != CA_SYNC_ENCODE)
+                return -ENOTTY;
+        if (!s->encoder)
+                return -ENODATA;
+
+        return ca_encoder_get_covering_feature_flags(s->encoder, ret);
+}
+
+int ca_sync_set_feature_flags_mask(CaSync *s, uint64_t mask) {
+        if (!s)
                 return -EINVAL;
 
-        if (c == CA_LOCATOR_PATH)
-                return ca_sync_add_store_path(s, locator);
+        if (s->direction != CA_SYNC_DECODE)
+                return -ENOTTY;
+        if (s->decoder)
+                return -EBUSY;
 
-        return ca_sync_add_store_remote(s, locator);
+        return ca_feature_flags_normalize_mask(mask, &s->feature_flags_mask);
 }
 
-static int ca_sync_extend_seeds_array(CaSync *s) {
-        CaSeed **new_seeds;
-
+static int ca_sync_allocate_index(CaSync *s) {
         assert(s);
 
-        new_seeds = realloc_multiply(s->seeds, sizeof(CaSeed*), s->n_seeds+1);
-        if (!new_seeds)
+        if (s->index)
+                return -EBUSY;
+        if (s->remote_index)
+                return -EBUSY;
+
+        if (s->direction == CA_SYNC_ENCODE)
+                s->index = ca_index_new_write();
+        else if (s->direction == CA_SYNC_DECODE)
+                s->index = ca_index_new_read();
+        else
+                assert(false);
+
+        if (!s->index)
                 return -ENOMEM;
 
-        s->seeds = new_seeds;
         return 0;
 }
 
-int ca_sync_add_seed_fd(CaSync *s, int fd) {
-        CaSeed *seed;
+int ca_sync_set_index_fd(CaSync *s, int fd) {
         int r;
 
         if (!s)
@@ -1115,26 +1329,20 @@ int ca_sync_add_seed_fd(CaSync *s, int fd) {
         if (fd < 0)
                 return -EINVAL;
 
-        r = ca_sync_extend_seeds_array(s);
+        r = ca_sync_allocate_index(s);
         if (r < 0)
                 return r;
 
-        seed = ca_seed_new();
-        if (!seed)
-                return -ENOMEM;
-
-        r = ca_seed_set_base_fd(seed, fd);
+        r = ca_index_set_fd(s->index, fd);
         if (r < 0) {
-                ca_seed_unref(seed);
+                s->index = ca_index_unref(s->index);
                 return r;
         }
 
-        s->seeds[s->n_seeds++] = seed;
         return 0;
 }
 
-int ca_sync_add_seed_path(CaSync *s, const char *path) {
-        CaSeed *seed;
+int ca_sync_set_index_path(CaSync *s, const char *path) {
         int r;
 
         if (!s)
@@ -1142,590 +1350,2636 @@ int ca_sync_add_seed_path(CaSync *s, const char *path) {
         if (!path)
                 return -EINVAL;
 
-        r = ca_sync_extend_seeds_array(s);
+        r = ca_sync_allocate_index(s);
         if (r < 0)
                 return r;
 
-        seed = ca_seed_new();
-        if (!seed)
-                return -ENOMEM;
-
-        r = ca_seed_set_base_path(seed, path);
+        r = ca_index_set_path(s->index, path);
         if (r < 0) {
-                ca_seed_unref(seed);
+                s->index = ca_index_unref(s->index);
                 return r;
         }
 
-        s->seeds[s->n_seeds++] = seed;
         return 0;
 }
 
-static int ca_sync_start(CaSync *s) {
-        size_t i;
+int ca_sync_set_index_remote(CaSync *s, const char *url) {
+        uint64_t flags;
         int r;
 
+        if (!s)
+                return -EINVAL;
+        if (!url)
+                return -EINVAL;
+
+        if (s->index)
+                return -EBUSY;
+        if (s->remote_index)
+                return -EBUSY;
+
+        flags = s->direction == CA_SYNC_ENCODE ? CA_PROTOCOL_PUSH_INDEX : CA_PROTOCOL_PULL_INDEX;
+
+        if (s->remote_wstore) {
+                /* Try to reuse the main store remote for the index too, if it matches the same server */
+
+                r = ca_remote_set_index_url(s->remote_wstore, url);
+                if (r >= 0) {
+                        r = ca_remote_add_local_feature_flags(s->remote_wstore, flags);
+                        if (r < 0)
+                                return r;
+
+                        s->remote_index = ca_remote_ref(s->remote_wstore);
+                        return 0;
+                }
+                if (r != -EBUSY) /* Fail, except when the reason is that it matches the same server. */
+                        return r;
+        }
+
+        s->remote_index = ca_remote_new();
+        if (!s->remote_index)
+                return -ENOMEM;
+
+        ca_sync_rebalance_rate_limit(s);
+
+        r = ca_remote_set_index_url(s->remote_index, url);
+        if (r < 0)
+                return r;
+
+        r = ca_remote_set_local_feature_flags(s->remote_index, flags);
+        if (r < 0)
+                return r;
+
+        return 0;
+}
+
+int ca_sync_set_index_auto(CaSync *s, const char *locator) {
+        CaLocatorClass c;
+
+        if (!s)
+                return -EINVAL;
+        if (!locator)
+                return -EINVAL;
+
+        c = ca_classify_locator(locator);
+        if (c < 0)
+                return -EINVAL;
+
+        if (c == CA_LOCATOR_PATH)
+                return ca_sync_set_index_path(s, locator);
+
+        return ca_sync_set_index_remote(s, locator);
+}
+
+int ca_sync_set_base_fd(CaSync *s, int fd) {
+        if (!s)
+                return -EINVAL;
+        if (fd < 0)
+                return -EINVAL;
+
+        if (s->base_fd >= 0)
+                return -EBUSY;
+        if (s->base_mode != (mode_t) -1)
+                return -EBUSY;
+        if (s->base_path)
+                return -EBUSY;
+        if (s->boundary_fd >= 0)
+                return -EBUSY;
+        if (s->boundary_path)
+                return -EBUSY;
+
+        s->base_fd = fd;
+        return 0;
+}
+
+int ca_sync_set_base_path(CaSync *s, const char *path) {
+        if (!s)
+                return -EINVAL;
+        if (!path)
+                return -EINVAL;
+
+        if (s->base_fd >= 0)
+                return -EBUSY;
+        if (s->base_path)
+                return -EBUSY;
+        if (s->boundary_fd >= 0)
+                return -EBUSY;
+        if (s->boundary_path)
+                return -EBUSY;
+
+        if (s->base_mode == (mode_t) -1 || S_ISDIR(s->base_mode)) {
+
+                s->base_fd = open(path, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_DIRECTORY);
+                if (s->base_fd >= 0) /* Base exists already and is a directory */
+                        return 0;
+
+                if (s->direction == CA_SYNC_ENCODE && errno != ENOTDIR)
+                        return -errno;
+        }
+
+        if (s->direction == CA_SYNC_ENCODE) {
+
+                s->base_fd = open(path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+                if (s->base_fd < 0)
+                        return -errno;
+
+                return 0;
+        }
+
+        assert(s->direction == CA_SYNC_DECODE);
+
+        s->base_path = strdup(path);
+        if (!s->base_path)
+                return -ENOMEM;
+
+        return 0;
+}
+
+int ca_sync_set_make_mode(CaSync *s, mode_t m) {
+        if (!s)
+                return -EINVAL;
+        if (m & ~0666)
+                return -EINVAL;
+        if (s->direction != CA_SYNC_ENCODE)
+                return -ENOTTY;
+
+        if (s->make_mode != (mode_t) -1)
+                return -EBUSY;
+
+        s->make_mode = m;
+        return 0;
+}
+
+int ca_sync_set_base_mode(CaSync *s, mode_t m) {
+        if (!s)
+                return -EINVAL;
+        if (m & ~(07777 | S_IFMT))
+                return -EINVAL;
+        if (!S_ISREG(m) && !S_ISDIR(m) && !S_ISBLK(m))
+                return -ENOTTY;
+        if (s->direction == CA_SYNC_ENCODE)
+                return -ENOTTY;
+
+        if (s->base_fd >= 0)
+                return -EBUSY;
+        if (s->base_mode != (mode_t) -1)
+                return -EBUSY;
+        if (s->boundary_fd >= 0)
+                return -EBUSY;
+        if (s->boundary_path)
+                return -EBUSY;
+
+        s->base_mode = m;
+        return 0;
+}
+
+int ca_sync_set_boundary_fd(CaSync *s, int fd) {
+        if (!s)
+                return -EINVAL;
+        if (fd < 0)
+                return -EINVAL;
+
+        if (s->base_fd >= 0)
+                return -EBUSY;
+        if (s->base_mode != (mode_t) -1)
+                return -EBUSY;
+        if (s->base_path)
+                return -EBUSY;
+        if (s->boundary_fd >= 0)
+                return -EBUSY;
+        if (s->boundary_path)
+                return -EBUSY;
+
+        if (s->direction == CA_SYNC_ENCODE)
+                return -ENOTTY;
+
+        s->boundary_fd = fd;
+        return 0;
+}
+
+int ca_sync_set_boundary_path(CaSync *s, const char *p) {
+        if (!s)
+                return -EINVAL;
+        if (!p)
+                return -EINVAL;
+
+        if (s->base_fd >= 0)
+                return -EBUSY;
+        if (s->base_mode != (mode_t) -1)
+                return -EBUSY;
+        if (s->base_path)
+                return -EBUSY;
+        if (s->boundary_fd >= 0)
+                return -EBUSY;
+        if (s->boundary_path)
+                return -EBUSY;
+
+        if (s->direction == CA_SYNC_ENCODE)
+                return -ENOTTY;
+
+        s->boundary_fd = open(p, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_DIRECTORY);
+        if (s->boundary_fd >= 0) /* Base exists already is a directory, good */
+                return 0;
+
+        if (errno != ENOENT)
+                return -errno;
+
+        s->boundary_path = strdup(p);
+        if (!s->boundary_path)
+                return -ENOMEM;
+
+        return 0;
+}
+
+int ca_sync_set_archive_fd(CaSync *s, int fd) {
+        if (!s)
+                return -EINVAL;
+        if (fd < 0)
+                return -EINVAL;
+
+        if (s->archive_fd >= 0)
+                return -EBUSY;
+        if (s->archive_path)
+                return -EBUSY;
+        if (s->remote_archive)
+                return -EBUSY;
+
+        s->archive_fd = fd;
+        return 0;
+}
+
+int ca_sync_set_archive_path(CaSync *s, const char *path) {
+        if (!s)
+                return -EINVAL;
+        if (!path)
+                return -EINVAL;
+
+        if (s->archive_fd >= 0)
+                return -EBUSY;
+        if (s->archive_path)
+                return -EBUSY;
+        if (s->remote_archive)
+                return -EBUSY;
+
+        if (s->direction == CA_SYNC_ENCODE) {
+                s->archive_path = strdup(path);
+                if (!s->archive_path)
+                        return -ENOMEM;
+
+                return 0;
+        }
+
+        assert(s->direction == CA_SYNC_DECODE);
+
+        s->archive_fd = open(path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+        if (s->archive_fd < 0)
+                return -errno;
+
+        return 0;
+}
+
+int ca_sync_set_archive_remote(CaSync *s, const char *url) {
+        int r;
+
+        if (!s)
+                return -EINVAL;
+        if (!url)
+                return -EINVAL;
+
+        if (s->archive_fd >= 0)
+                return -EBUSY;
+        if (s->archive_path)
+                return -EBUSY;
+        if (s->remote_archive)
+                return -EBUSY;
+
+        s->remote_archive = ca_remote_new();
+        if (!s->remote_archive)
+                return -ENOMEM;
+
+        r = ca_remote_set_archive_url(s->remote_archive, url);
+        if (r < 0)
+                return r;
+
+        r = ca_remote_set_local_feature_flags(s->remote_archive,
+                                              s->direction == CA_SYNC_ENCODE ? CA_PROTOCOL_PUSH_ARCHIVE : CA_PROTOCOL_PULL_ARCHIVE);
+        if (r < 0)
+                return r;
+
+        ca_sync_rebalance_rate_limit(s);
+
+        return 0;
+}
+
+int ca_sync_set_archive_auto(CaSync *s, const char *locator) {
+        CaLocatorClass c;
+
+        if (!s)
+                return -EINVAL;
+        if (!locator)
+                return -EINVAL;
+
+        c = ca_classify_locator(locator);
+        if (c < 0)
+                return -EINVAL;
+
+        if (c == CA_LOCATOR_PATH)
+                return ca_sync_set_archive_path(s, locator);
+
+        return ca_sync_set_archive_remote(s, locator);
+}
+
+int ca_sync_set_store_path(CaSync *s, const char *path) {
+        int r;
+
+        if (!s)
+                return -EINVAL;
+        if (!path)
+                return -EINVAL;
+
+        if (s->wstore)
+                return -EBUSY;
+        if (s->remote_wstore)
+                return -EBUSY;
+
+        s->wstore = ca_store_new();
+        if (!s->wstore)
+                return -ENOMEM;
+
+        r = ca_store_set_path(s->wstore, path);
+        if (r < 0) {
+                s->wstore = ca_store_unref(s->wstore);
+                return r;
+        }
+
+        r = ca_store_set_pack_mode(s->wstore, s->pack_mode);
+        if (r < 0) {
+                s->wstore = ca_store_unref(s->wstore);
+                return r;
+        }
+
+        return 0;
+}
+
+int ca_sync_set_pack_mode(CaSync *s, bool b) {
+        int r;
+
+        if (!s)
+                return -EINVAL;
+
+        if (s->wstore) {
+                r = ca_store_set_pack_mode(s->wstore, b);
+                if (r < 0)
+                        return r;
+        }
+
+        s->pack_mode = b;
+
+        return 0;
+}
+
+int ca_sync_set_profile(CaSync *s, bool b) {
+        if (!s)
+                return -EINVAL;
+
+        s->profile.enabled = b;
+
+        return 0;
+}
+
+int ca_sync_get_profile(CaSync *s, const CaProfile **ret) {
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (!s->profile.enabled)
+                return -ENODATA;
+
+        *ret = &s->profile;
+
+        return 0;
+}
+
+int ca_sync_set_store_remote(CaSync *s, const char *url) {
+        uint64_t flags;
+        int r;
+
+        if (!s)
+                return -EINVAL;
+        if (!url)
+                return -EINVAL;
+
+        if (s->wstore)
+                return -EBUSY;
+        if (s->remote_wstore)
+                return -EBUSY;
+
+        flags = s->direction == CA_SYNC_ENCODE ? CA_PROTOCOL_PUSH_CHUNKS : CA_PROTOCOL_PULL_CHUNKS;
+
+        if (s->remote_index) {
+                /* Try to reuse the index remote for the main store too, if it matches the same server */
+
+                r = ca_remote_set_store_url(s->remote_index, url);
+                if (r >= 0) {
+
+                        r = ca_remote_add_local_feature_flags(s->remote_index, flags);
+                        if (r < 0)
+                                return r;
+
+                        s->remote_wstore = ca_remote_ref(s->remote_index);
+                        return 0;
+                }
+                if (r != -EBUSY)
+                        return r;
+        }
+
+        s->remote_wstore = ca_remote_new();
+        if (!s->remote_wstore)
+                return -ENOMEM;
+
+        ca_sync_rebalance_rate_limit(s);
+
+        r = ca_remote_set_store_url(s->remote_wstore, url);
+        if (r < 0)
+                return r;
+
+        r = ca_remote_set_local_feature_flags(s->remote_wstore, flags);
+        if (r < 0)
+                return r;
+
+        return 0;
+}
+
+int ca_sync_set_store_auto(CaSync *s, const char *locator) {
+        CaLocatorClass c;
+
+        if (!s)
+                return -EINVAL;
+        if (!locator)
+                return -EINVAL;
+
+        c = ca_classify_locator(locator);
+        if (c < 0)
+                return -EINVAL;
+
+        if (c == CA_LOCATOR_PATH)
+                return ca_sync_set_store_path(s, locator);
+
+        return ca_sync_set_store_remote(s, locator);
+}
+
+int ca_sync_add_store_path(CaSync *s, const char *path) {
+        CaStore **array, *store;
+        int r;
+
+        if (!s)
+                return -EINVAL;
+        if (!path)
+                return -EINVAL;
+
+        store = ca_store_new();
+        if (!store)
+                return -ENOMEM;
+
+        r = ca_store_set_path(store, path);
+        if (r < 0) {
+                ca_store_unref(store);
+                return r;
+        }
+
+        array = realloc_multiply(s->rstores, sizeof(CaStore*), s->n_rstores+1);
+        if (!array) {
+                ca_store_unref(store);
+                return -ENOMEM;
+        }
+
+        s->rstores = array;
+        s->rstores[s->n_rstores++] = store;
+
+        return 0;
+}
+
+int ca_sync_add_store_remote(CaSync *s, const char *url) {
+        CaRemote **array, *remote;
+        int r;
+
+        if (!s)
+                return -EINVAL;
+        if (!url)
+                return -EINVAL;
+
+        remote = ca_remote_new();
+        if (!remote)
+                return -ENOMEM;
+
+        r = ca_remote_set_store_url(remote, url);
+        if (r < 0) {
+                ca_remote_unref(remote);
+                return r;
+        }
+
+        array = realloc_multiply(s->remote_rstores, sizeof(CaRemote*),  s->n_remote_rstores+1);
+        if (!array) {
+                ca_remote_unref(remote);
+                return -ENOMEM;
+        }
+
+        s->remote_rstores = array;
+        s->remote_rstores[s->n_remote_rstores++] = remote;
+
+        ca_sync_rebalance_rate_limit(s);
+
+        return 0;
+}
+
+int ca_sync_add_store_auto(CaSync *s, const char *locator) {
+        CaLocatorClass c;
+
+        if (!s)
+                return -EINVAL;
+        if (!locator)
+                return -EINVAL;
+
+        c = ca_classify_locator(locator);
+        if (c < 0)
+                return -EINVAL;
+
+        if (c == CA_LOCATOR_PATH)
+                return ca_sync_add_store_path(s, locator);
+
+        return ca_sync_add_store_remote(s, locator);
+}
+
+static int ca_sync_extend_seeds_array(CaSync *s) {
+        CaSeed **new_seeds;
+
+        assert(s);
+
+        new_seeds = realloc_multiply(s->seeds, sizeof(CaSeed*), s->n_seeds+1);
+        if (!new_seeds)
+                return -ENOMEM;
+
+        s->seeds = new_seeds;
+        return 0;
+}
+
+int ca_sync_add_seed_fd(CaSync *s, int fd) {
+        CaSeed *seed;
+        int r;
+
+        if (!s)
+                return -EINVAL;
+        if (fd < 0)
+                return -EINVAL;
+
+        r = ca_sync_extend_seeds_array(s);
+        if (r < 0)
+                return r;
+
+        seed = ca_seed_new();
+        if (!seed)
+                return -ENOMEM;
+
+        r = ca_seed_set_base_fd(seed, fd);
+        if (r < 0) {
+                ca_seed_unref(seed);
+                return r;
+        }
+
+        s->seeds[s->n_seeds++] = seed;
+        return 0;
+}
+
+int ca_sync_add_seed_path(CaSync *s, const char *path) {
+        CaSeed *seed;
+        int r;
+
+        if (!s)
+                return -EINVAL;
+        if (!path)
+                return -EINVAL;
+
+        r = ca_sync_extend_seeds_array(s);
+        if (r < 0)
+                return r;
+
+        seed = ca_seed_new();
+        if (!seed)
+                return -ENOMEM;
+
+        r = ca_seed_set_base_path(seed, path);
+        if (r < 0) {
+                ca_seed_unref(seed);
+                return r;
+        }
+
+        s->seeds[s->n_seeds++] = seed;
+        return 0;
+}
+
+static int ca_sync_start(CaSync *s) {
+        size_t i;
+        int r;
+
+        assert(s);
+
+        if (s->started)
+                return 0;
+
+        if (s->direction == CA_SYNC_ENCODE && s->archive_path && s->archive_fd < 0) {
+                if (!s->temporary_archive_path) {
+                        r = tempfn_random(s->archive_path, &s->temporary_archive_path);
+                        if (r < 0)
+                                return r;
+                }
+
+                s->archive_fd = open(s->temporary_archive_path, O_WRONLY|O_CLOEXEC|O_NOCTTY|O_CREAT|O_EXCL, s->make_mode & 0666);
+                if (s->archive_fd < 0) {
+                        s->temporary_archive_path = mfree(s->temporary_archive_path);
+                        return -errno;
+                }
+        }
+
+        if (s->direction == CA_SYNC_ENCODE && !s->encoder) {
+
+                if (s->base_fd < 0)
+                        return -EUNATCH;
+
+                s->encoder = ca_encoder_new();
+                if (!s->encoder)
+                        return -ENOMEM;
+
+                /* The inline chunk section and the chunk alignment policy are properties of the index
+                 * file, not of the archive stream, hence don't let those bits alter the serialization (and
+                 * thereby the chunk IDs) */
+                r = ca_encoder_set_feature_flags(s->encoder, s->feature_flags & ~(CA_FORMAT_INLINE_CHUNKS|CA_FORMAT_FILE_ALIGNED_CHUNKS));
+                if (r < 0) {
+                        s->encoder = ca_encoder_unref(s->encoder);
+                        return r;
+                }
+
+                r = ca_encoder_set_base_fd(s->encoder, s->base_fd);
+                if (r < 0) {
+                        s->encoder = ca_encoder_unref(s->encoder);
+                        return r;
+                }
+
+                s->base_fd = -1;
+
+                r = ca_encoder_set_uid_shift(s->encoder, s->uid_shift);
+                if (r < 0)
+                        return r;
+                r = ca_encoder_set_uid_range(s->encoder, s->uid_range);
+                if (r < 0)
+                        return r;
+                r = ca_encoder_set_buffer_budget(s->encoder, s->buffer_budget);
+                if (r < 0)
+                        return r;
+        }
+
+        if (s->direction == CA_SYNC_DECODE && !s->decoder) {
+
+                if (s->boundary_fd < 0 && s->boundary_path) {
+
+                        if (mkdir(s->boundary_path, 0777) < 0 && errno != EEXIST)
+                                return -errno;
+
+                        s->boundary_fd = open(s->boundary_path, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_DIRECTORY);
+                        if (s->boundary_fd < 0)
+                                return -errno;
+                }
+
+                if (s->base_fd < 0 && s->base_path) {
+
+                        if (s->base_mode == (mode_t) -1)
+                                return -EUNATCH;
+
+                        if (S_ISDIR(s->base_mode)) {
+
+                                if (mkdir(s->base_path, 0777) < 0 && errno != EEXIST)
+                                        return -errno;
+
+                                s->base_fd = open(s->base_path, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_DIRECTORY);
+                                if (s->base_fd < 0)
+                                        return -errno;
+
+                        } else if (S_ISREG(s->base_mode)) {
+
+                                if (!s->temporary_base_path) {
+                                        r = tempfn_random(s->base_path, &s->temporary_base_path);
+                                        if (r < 0)
+                                                return r;
+                                }
+
+                                s->base_fd = open(s->temporary_base_path, O_WRONLY|O_CLOEXEC|O_NOCTTY|O_CREAT|O_EXCL, 0666);
+                                if (s->base_fd < 0) {
+                                        s->temporary_base_path = mfree(s->temporary_base_path);
+                                        return -errno;
+                                }
+
+                        } else {
+                                assert(S_ISBLK(s->base_mode));
+
+                                s->base_fd = open(s->base_path, O_WRONLY|O_CLOEXEC|O_NOCTTY);
+                                if (s->base_fd < 0)
+                                        return -errno;
+                        }
+                }
+
+                s->decoder = ca_decoder_new();
+                if (!s->decoder)
+                        return -ENOMEM;
+
+                /* There are three ways we can initialize the decoder:
+                 *
+                 * 1. We extract the whole archive. In this case we specify the "base" fd for the extraction, which is
+                 *    going to be the top-level object we'll write to. If the archive is a directory tree, this needs
+                 *    to be a directory fd, otherwise a regular file or block device.
+                 *
+                 * 2. We do not extract anything (i.e. only list the contents or such). In this case we don't specify
+                 *    any fd, but we do specify the file type (directory or regular file/block device) of the top-level
+                 *    object we'd extract to if we'd extract. This is necessary so that we know whether to simply
+                 *    decode a raw file contents blob, or a full directory tree.
+                 *
+                 * 3. We extract a subtree of the whole archive. In this case we specify a "boundary" directory fd,
+                 *    where to place the objected seeked to. Note that difference from the "base" fd: we'll always
+                 *    extract the seeked to file as a subfile of the specified fd.
+                 */
+
+                if (s->boundary_fd >= 0) {
+
+                        r = ca_decoder_set_boundary_fd(s->decoder, s->boundary_fd);
+                        if (r < 0)
+                                return r;
+
+                        s->boundary_fd = -1;
+
+                } else  if (s->base_fd >= 0) {
+
+                        /* With hardlinking enabled, keep a duplicate of the destination directory around,
+                         * so that files identical to something already extracted in this run can be
+                         * hardlinked to the first copy */
+                        if (s->hardlink && s->dedup_fd < 0) {
+                                struct stat st;
+
+                                if (fstat(s->base_fd, &st) >= 0 && S_ISDIR(st.st_mode))
+                                        s->dedup_fd = fcntl(s->base_fd, F_DUPFD_CLOEXEC, 3);
+                        }
+
+                        r = ca_decoder_set_base_fd(s->decoder, s->base_fd);
+                        if (r < 0)
+                                return r;
+
+                        s->base_fd = -1;
+                } else {
+
+                        if (s->base_mode == (mode_t) -1)
+                                return -EUNATCH;
+
+                        r = ca_decoder_set_base_mode(s->decoder, s->base_mode);
+                        if (r < 0)
+                                return r;
+                }
+
+                if (s->archive_size != UINT64_MAX) {
+                        r = ca_decoder_set_archive_size(s->decoder, s->archive_size);
+                        if (r < 0)
+                                return r;
+                }
+
+                r = ca_decoder_set_punch_holes(s->decoder, s->punch_holes);
+                if (r < 0)
+                        return r;
+                r = ca_decoder_set_direct_io(s->decoder, s->direct_io);
+                if (r < 0)
+                        return r;
+                r = ca_decoder_set_reflink(s->decoder, s->reflink);
+                if (r < 0)
+                        return r;
+                r = ca_decoder_set_hardlink(s->decoder, s->hardlink);
+                if (r < 0)
+                        return r;
+                r = ca_decoder_set_delete(s->decoder, s->delete);
+                if (r < 0)
+                        return r;
+                r = ca_decoder_set_payload(s->decoder, s->payload || s->remote_archive);
+                if (r < 0)
+                        return r;
+                r = ca_decoder_set_undo_immutable(s->decoder, s->undo_immutable);
+                if (r < 0)
+                        return r;
+                r = ca_decoder_set_threads(s->decoder, s->n_threads);
+                if (r < 0)
+                        return r;
+                r = ca_decoder_set_sync_mode(s->decoder, s->sync_mode);
+                if (r < 0)
+                        return r;
+                r = ca_decoder_set_uid_shift(s->decoder, s->uid_shift);
+                if (r < 0)
+                        return r;
+                r = ca_decoder_set_uid_range(s->decoder, s->uid_range);
+                if (r < 0)
+                        return r;
+                r = ca_decoder_set_feature_flags_mask(s->decoder, s->feature_flags_mask);
+                if (r < 0)
+                        return r;
+        }
+
+        if (s->remote_index && !s->index) {
+                if (s->direction == CA_SYNC_DECODE)
+                        s->index = ca_index_new_incremental_read();
+                else {
+                        assert(s->direction == CA_SYNC_ENCODE);
+                        s->index = ca_index_new_incremental_write();
+                }
+                if (!s->index)
+                        return -ENOMEM;
+        }
+
+        if (s->remote_index &&
+            s->remote_wstore == s->remote_index &&
+            s->direction == CA_SYNC_ENCODE &&
+            !s->cache_store) {
+
+                /* If we use the same server for index and storage, then we can optimize things a bit, and make the
+                 * server request what it is missing so far. */
+
+                s->cache_store = ca_store_new_cache();
+                if (!s->cache_store)
+                        return -ENOMEM;
+
+                r = ca_store_set_digest_type(s->cache_store, ca_feature_flags_to_digest_type(s->feature_flags));
+                if (r < 0)
+                        return r;
+
+                r = ca_remote_add_local_feature_flags(s->remote_index, CA_PROTOCOL_PUSH_INDEX_CHUNKS);
+                if (r < 0)
+                        return r;
+        }
+
+        if (s->encoder) {
+                /* If we are writing an index file we need the archive digest unconditionally, as it is included in its end */
+                r = ca_encoder_enable_archive_digest(s->encoder, s->archive_digest || s->index);
+                if (r < 0)
+                        return r;
+
+                r = ca_encoder_enable_payload_digest(s->encoder, s->payload_digest);
+                if (r < 0)
+                        return r;
+
+                r = ca_encoder_enable_hardlink_digest(s->encoder, s->hardlink_digest);
+                if (r < 0)
+                        return r;
+        }
+
+        if (s->decoder) {
+                r = ca_decoder_enable_archive_digest(s->decoder, s->archive_digest);
+                if (r < 0)
+                        return r;
+
+                r = ca_decoder_enable_payload_digest(s->decoder, s->payload_digest);
+                if (r < 0)
+                        return r;
+
+                r = ca_decoder_enable_hardlink_digest(s->decoder, s->hardlink_digest || s->hardlink);
+                if (r < 0)
+                        return r;
+        }
+
+        if (s->index) {
+
+                if (s->direction == CA_SYNC_ENCODE) {
+                        /* Propagate the chunk size to the index we generate */
+
+                        r = ca_index_set_feature_flags(s->index, s->feature_flags);
+                        if (r < 0)
+                                return r;
+
+                        r = ca_index_set_chunk_size_min(s->index, s->chunker.chunk_size_min);
+                        if (r < 0)
+                                return r;
+
+                        r = ca_index_set_chunk_size_avg(s->index, s->chunker.chunk_size_avg);
+                        if (r < 0)
+                                return r;
+
+                        r = ca_index_set_chunk_size_max(s->index, s->chunker.chunk_size_max);
+                        if (r < 0)
+                                return r;
+
+                        if (s->make_mode != (mode_t) -1) {
+                                r = ca_index_set_make_mode(s->index, s->make_mode);
+                                if (r < 0 && r != -ENOTTY)
+                                        return r;
+                        }
+                }
+
+                r = ca_index_open(s->index);
+                if (r < 0)
+                        return r;
+        }
+
+        for (i = 0; i < s->n_seeds; i++) {
+                /* Tell seeders whether to calculate hardlink and/or chunk seeds */
+
+                r = ca_seed_set_hardlink(s->seeds[i], s->hardlink);
+                if (r < 0)
+                        return r;
+
+                r = ca_seed_set_chunks(s->seeds[i], !!s->index);
+                if (r < 0)
+                        return r;
+
+                r = ca_seed_set_threads(s->seeds[i], s->n_threads);
+                if (r < 0)
+                        return r;
+        }
+
+        /* Tell the wstore which compression algorithm to use */
+        if (s->wstore) {
+                r = ca_store_set_compression_type(s->wstore, s->compression_type);
+                if (r < 0)
+                        return r;
+
+                r = ca_store_set_compression_level(s->wstore, s->compression_level);
+                if (r < 0)
+                        return r;
+        }
+
+        if (s->remote_wstore) {
+                r = ca_remote_set_compression_type(s->remote_wstore, s->compression_type);
+                if (r < 0)
+                        return r;
+        }
+
+        if (s->cache && s->encoder) {
+                char *t;
+
+                /* Entries only match when they were made with the same serialization and chunking
+                 * parameters, hence mix them all into the cache keys */
+                if (asprintf(&t, "%" PRIx64 ":%zu:%zu:%zu",
+                             s->feature_flags,
+                             s->chunker.chunk_size_min,
+                             s->chunker.chunk_size_avg,
+                             s->chunker.chunk_size_max) < 0)
+                        return -ENOMEM;
+
+                r = ca_cache_set_salt(s->cache, t);
+                free(t);
+                if (r < 0)
+                        return r;
+        }
+
+        r = ca_sync_start_workers(s);
+        if (r < 0)
+                return r;
+
+        s->started = true;
+
+        return 1;
+}
+
+static int ca_sync_write_archive(CaSync *s, const void *p, size_t l) {
+        assert(s);
+        assert(p || l == 0);
+
+        if (s->archive_fd < 0)
+                return 0;
+
+        return loop_write(s->archive_fd, p, l);
+}
+
+static int ca_sync_write_remote_archive(CaSync *s, const void *p, size_t l) {
+        assert(s);
+        assert(p || l == 0);
+
+        if (!s->remote_archive)
+                return 0;
+
+        return ca_remote_put_archive(s->remote_archive, p, l);
+}
+
+static uint64_t ca_sync_phys_hash(const uint64_t *layout, size_t n) {
+        const uint8_t *q = (const uint8_t*) layout;
+        uint64_t h = UINT64_C(0xcbf29ce484222325);
+        size_t i;
+
+        /* FNV-1a, only used to pick the hash bucket */
+
+        for (i = 0; i < n * sizeof(uint64_t); i++) {
+                h ^= q[i];
+                h *= UINT64_C(0x100000001b3);
+        }
+
+        return h;
+}
+
+static void ca_sync_phys_file_free(CaSyncPhysFile *f) {
+        if (!f)
+                return;
+
+        free(f->layout);
+        free(f->chunks);
+        free(f);
+}
+
+static void ca_sync_phys_flush(CaSync *s) {
+        size_t i;
+
+        assert(s);
+
+        for (i = 0; i < s->n_phys_buckets; i++)
+                ca_sync_phys_file_free(s->phys_files[i]);
+
+        s->phys_files = mfree(s->phys_files);
+        s->n_phys_buckets = s->n_phys_files = 0;
+
+        s->phys_rec = NULL;
+        s->phys_rec_path = mfree(s->phys_rec_path);
+        s->phys_rec_offset = 0;
+}
+
+static int ca_sync_phys_read_layout(int fd, uint64_t **ret, size_t *ret_n) {
+        union {
+                struct fiemap fiemap;
+                uint8_t space[offsetof(struct fiemap, fm_extents) + 128 * sizeof(struct fiemap_extent)];
+        } buffer;
+        size_t n = 0, allocated = 0;
+        uint64_t *layout = NULL;
+        uint64_t start = 0;
+        bool last = false;
+        struct stat st;
+
+        assert(fd >= 0);
+        assert(ret);
+        assert(ret_n);
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+        if (!S_ISREG(st.st_mode))
+                return -ENOTTY;
+
+        if (!GREEDY_REALLOC(layout, allocated, 2))
+                return -ENOMEM;
+
+        layout[n++] = (uint64_t) st.st_dev;
+        layout[n++] = (uint64_t) st.st_size;
+
+        while (!last) {
+                struct fiemap *fm = &buffer.fiemap;
+                uint32_t i;
+
+                memzero(&buffer, sizeof(buffer));
+                fm->fm_start = start;
+                fm->fm_length = UINT64_MAX - start;
+                fm->fm_flags = FIEMAP_FLAG_SYNC;
+                fm->fm_extent_count = 128;
+
+                if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0) {
+                        free(layout);
+                        return -errno;
+                }
+
+                if (fm->fm_mapped_extents == 0)
+                        break; /* Nothing further mapped, i.e. a hole up to EOF */
+
+                for (i = 0; i < fm->fm_mapped_extents; i++) {
+                        const struct fiemap_extent *e = fm->fm_extents + i;
+
+                        /* Only plain, committed, block-aligned extents have a physical identity we can
+                         * trust */
+                        if (e->fe_flags & (FIEMAP_EXTENT_UNKNOWN|
+                                           FIEMAP_EXTENT_DELALLOC|
+                                           FIEMAP_EXTENT_ENCODED|
+                                           FIEMAP_EXTENT_DATA_ENCRYPTED|
+                                           FIEMAP_EXTENT_DATA_INLINE|
+                                           FIEMAP_EXTENT_DATA_TAIL|
+                                           FIEMAP_EXTENT_UNWRITTEN|
+                                           FIEMAP_EXTENT_NOT_ALIGNED)) {
+                                free(layout);
+                                return -ENODATA;
+                        }
+
+                        if ((n - 2) / 3 >= CA_SYNC_PHYS_EXTENTS_MAX) {
+                                free(layout);
+                                return -ENODATA;
+                        }
+
+                        if (!GREEDY_REALLOC(layout, allocated, n + 3)) {
+                                free(layout);
+                                return -ENOMEM;
+                        }
+
+                        layout[n++] = e->fe_logical;
+                        layout[n++] = e->fe_physical;
+                        layout[n++] = e->fe_length;
+
+                        start = e->fe_logical + e->fe_length;
+
+                        if (e->fe_flags & FIEMAP_EXTENT_LAST) {
+                                last = true;
+                                break;
+                        }
+                }
+        }
+
+        if (n <= 2) { /* No extents at all? Then there's nothing to identify this file by */
+                free(layout);
+                return -ENODATA;
+        }
+
+        *ret = layout;
+        *ret_n = n;
+        return 0;
+}
+
+static CaSyncPhysFile* ca_sync_phys_find(CaSync *s, uint64_t hash, const uint64_t *layout, size_t n_layout) {
+        size_t i;
+
+        assert(s);
+        assert(layout);
+
+        if (s->n_phys_buckets == 0)
+                return NULL;
+
+        for (i = hash & (s->n_phys_buckets - 1); s->phys_files[i]; i = (i + 1) & (s->n_phys_buckets - 1)) {
+                CaSyncPhysFile *e = s->phys_files[i];
+
+                if (e->hash == hash &&
+                    e->n_layout == n_layout &&
+                    memcmp(e->layout, layout, n_layout * sizeof(uint64_t)) == 0)
+                        return e;
+        }
+
+        return NULL;
+}
+
+static int ca_sync_phys_insert(CaSync *s, CaSyncPhysFile *f) {
+        size_t i;
+
+        assert(s);
+        assert(f);
+
+        /* Grow at 75% load */
+        if ((s->n_phys_files + 1) * 4 > s->n_phys_buckets * 3) {
+                CaSyncPhysFile **t;
+                size_t m, j;
+
+                m = s->n_phys_buckets == 0 ? 256 : s->n_phys_buckets * 2;
+
+                t = new0(CaSyncPhysFile*, m);
+                if (!t)
+                        return -ENOMEM;
+
+                for (j = 0; j < s->n_phys_buckets; j++) {
+                        CaSyncPhysFile *e = s->phys_files[j];
+                        size_t k;
+
+                        if (!e)
+                                continue;
+
+                        for (k = e->hash & (m - 1); t[k]; k = (k + 1) & (m - 1))
+                                ;
+                        t[k] = e;
+                }
+
+                free(s->phys_files);
+                s->phys_files = t;
+                s->n_phys_buckets = m;
+        }
+
+        for (i = f->hash & (s->n_phys_buckets - 1); s->phys_files[i]; i = (i + 1) & (s->n_phys_buckets - 1))
+                ;
+
+        s->phys_files[i] = f;
+        s->n_phys_files++;
+
+        return 0;
+}
+
+static void ca_sync_phys_seal_recording(CaSync *s) {
+        assert(s);
+
+        if (!s->phys_rec)
+                return;
+
+        s->phys_rec->sealed = true;
+        s->phys_rec = NULL;
+        s->phys_rec_path = mfree(s->phys_rec_path);
+        s->phys_rec_offset = 0;
+}
+
+static void ca_sync_phys_record_chunk(CaSync *s, CaLocation *location, const CaChunkID *id, uint64_t size) {
+        assert(s);
+        assert(id);
+
+        if (!s->phys_rec)
+                return;
+
+        /* Only an uninterrupted, in-order run of the recorded file's payload stays replayable; the first
+         * chunk reaching beyond it ends the recording */
+        if (!location ||
+            location->designator != CA_LOCATION_PAYLOAD ||
+            !location->path ||
+            !streq(location->path, s->phys_rec_path) ||
+            location->offset != s->phys_rec_offset) {
+                ca_sync_phys_seal_recording(s);
+                return;
+        }
+
+        if (!GREEDY_REALLOC(s->phys_rec->chunks, s->phys_rec->n_chunks_allocated, s->phys_rec->n_chunks + 1)) {
+                ca_sync_phys_seal_recording(s);
+                return;
+        }
+
+        s->phys_rec->chunks[s->phys_rec->n_chunks++] = (CaSyncPhysChunk) { .id = *id, .size = size };
+        s->phys_rec->covered += size;
+        s->phys_rec_offset += size;
+}
+
+static int ca_sync_retire_chunk_job(CaSync *s, CaSyncChunkJob *j) {
+        uint64_t t;
+        int r;
+
+        assert(s);
+        assert(j);
+        assert(j->finished);
+
+        if (j->result < 0)
+                return j->result;
+
+        s->n_written_chunks++;
+
+        t = ca_profile_begin(&s->profile);
+
+        if (s->wstore) {
+                if (realloc_buffer_size(&j->processed) > 0)
+                        r = ca_store_put(s->wstore, &j->id, CA_CHUNK_COMPRESSED,
+                                         realloc_buffer_data(&j->processed),
+                                         realloc_buffer_size(&j->processed));
+                else
+                        r = ca_store_put(s->wstore, &j->id, CA_CHUNK_UNCOMPRESSED, j->data, j->size);
+                if (r == -EEXIST)
+                        s->n_reused_chunks++;
+                else if (r < 0)
+                        return r;
+        }
+
+        if (s->cache_store) {
+                r = ca_store_put(s->cache_store, &j->id, CA_CHUNK_UNCOMPRESSED, j->data, j->size);
+                if (r < 0 && r != -EEXIST)
+                        return r;
+        }
+
+        ca_profile_end(&s->profile, CA_PROFILE_STORE_PUT, t, j->size);
+
+        if (s->index) {
+                r = ca_index_write_chunk(s->index, &j->id, j->size);
+                if (r < 0)
+                        return r;
+
+                /* Where we have the store encoding at hand anyway, offer the chunk to the index file too,
+                 * sufficiently small ones then travel inline with it */
+                if (realloc_buffer_size(&j->processed) > 0)
+                        (void) ca_index_write_inline_chunk(s->index, &j->id,
+                                                           realloc_buffer_data(&j->processed),
+                                                           realloc_buffer_size(&j->processed));
+        }
+
+        if (s->cache && j->cache_location)
+                (void) ca_cache_put(s->cache, s->base_fd, j->cache_location, &j->id, j->size);
+
+        ca_sync_phys_record_chunk(s, j->cache_location, &j->id, j->size);
+
+        return 0;
+}
+
+static int ca_sync_process_chunk_jobs(CaSync *s, size_t max_pending) {
+        int r;
+
+        assert(s);
+
+        if (s->n_workers == 0)
+                return 0;
+
+        /* Retires finished jobs, in submission order, so that the index stays sequential. If more than
+         * max_pending jobs are in flight, waits until the oldest one completes. */
+
+        assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
+
+        for (;;) {
+                CaSyncChunkJob *j;
+
+                j = s->job_fifo;
+                if (!j)
+                        break;
+
+                if (!j->finished) {
+                        if (s->n_jobs <= max_pending)
+                                break;
+
+                        pthread_cond_wait(&s->job_finished_cond, &s->job_mutex);
+                        continue;
+                }
+
+                s->job_fifo = j->fifo_next;
+                if (!s->job_fifo)
+                        s->job_fifo_tail = NULL;
+                s->n_jobs--;
+
+                assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
+
+                r = ca_sync_retire_chunk_job(s, j);
+                ca_sync_chunk_job_release(s, j);
+                if (r < 0)
+                        return r;
+
+                assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
+        }
+
+        assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
+        return 0;
+}
+
+static int ca_sync_submit_chunk_job(CaSync *s, CaLocation *cache_location, const void *p, size_t l) {
+        CaSyncChunkJob *j;
+        int r;
+
+        assert(s);
+        assert(s->n_workers > 0);
+        assert(p || l == 0);
+
+        j = ca_sync_chunk_job_acquire(s);
+        if (!j)
+                return -ENOMEM;
+
+        r = ca_sync_chunk_job_set_data(j, p, l);
+        if (r < 0) {
+                ca_sync_chunk_job_release(s, j);
+                return r;
+        }
+
+        j->cache_location = ca_location_ref(cache_location);
+
+        assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
+
+        if (s->job_queue_tail)
+                s->job_queue_tail->queue_next = j;
+        else
+                s->job_queue = j;
+        s->job_queue_tail = j;
+
+        if (s->job_fifo_tail)
+                s->job_fifo_tail->fifo_next = j;
+        else
+                s->job_fifo = j;
+        s->job_fifo_tail = j;
+
+        s->n_jobs++;
+
+        pthread_cond_signal(&s->job_submitted_cond);
+        assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
+
+        /* Keep the number of chunks in flight (and thus the memory we use for copies of them) bounded */
+        return ca_sync_process_chunk_jobs(s, s->n_workers * 4);
+}
+
+static int ca_sync_fused_digest_feed(CaSync *s, const void *p, size_t l) {
+        static const uint8_t zeroes[BUFFER_SIZE] = {};
+        int r;
+
+        assert(s);
+        assert(p || l == 0);
+
+        /* Feeds more bytes of the chunk currently being assembled into the digest, while they are still
+         * cache-resident from the chunker's scan, so that no separate hashing pass over the assembled chunk
+         * is necessary anymore. */
+
+        if (l == 0)
+                return 0;
+
+        if (!s->fused_digest_dirty && zero_run_size(p, l) == l) {
+                s->fused_digest_pending += l;
+                return 0;
+        }
+
+        if (!s->chunk_digest) {
+                r = ca_digest_new(ca_feature_flags_to_digest_type(s->feature_flags), &s->chunk_digest);
+                if (r < 0)
+                        return r;
+        }
+
+        if (!s->fused_digest_dirty) {
+                /* First non-zero data of this chunk: catch up on the zero run we deferred so far */
+
+                r = ca_chunk_id_make_init(s->chunk_digest);
+                if (r < 0)
+                        return r;
+
+                while (s->fused_digest_pending > 0) {
+                        size_t m;
+
+                        m = (size_t) MIN(s->fused_digest_pending, (uint64_t) sizeof(zeroes));
+                        ca_digest_write(s->chunk_digest, zeroes, m);
+                        s->fused_digest_pending -= m;
+                }
+
+                s->fused_digest_dirty = true;
+        }
+
+        ca_digest_write(s->chunk_digest, p, l);
+        return 0;
+}
+
+static int ca_sync_fused_digest_finalize(CaSync *s, const void *chunk, size_t chunk_size, CaChunkID *ret) {
+        int r;
+
+        assert(s);
+        assert(chunk || chunk_size == 0);
+        assert(ret);
+
+        if (!s->fused_digest_dirty)
+                /* The chunk turned out to be all zeroes, hence take the cached zero-chunk route */
+                r = ca_sync_make_chunk_id(s, chunk, chunk_size, ret);
+        else
+                r = ca_chunk_id_make_final(s->chunk_digest, chunk_size, ret);
+
+        s->fused_digest_dirty = false;
+        s->fused_digest_pending = 0;
+
+        return r;
+}
+
+static int ca_sync_write_one_chunk_with_id(CaSync *s, const CaChunkID *id, const void *p, size_t l);
+
+static int ca_sync_write_one_chunk(CaSync *s, CaLocation *cache_location, const void *p, size_t l) {
+        CaChunkID id;
+        int r;
+
+        assert(s);
+        assert(p || l == 0);
+
+        if (s->n_workers > 0)
+                return ca_sync_submit_chunk_job(s, cache_location, p, l);
+
+        r = ca_sync_make_chunk_id(s, p, l, &id);
+        if (r < 0)
+                return r;
+
+        r = ca_sync_write_one_chunk_with_id(s, &id, p, l);
+        if (r < 0)
+                return r;
+
+        if (s->cache && cache_location)
+                (void) ca_cache_put(s->cache, s->base_fd, cache_location, &id, l);
+
+        ca_sync_phys_record_chunk(s, cache_location, &id, l);
+
+        return 0;
+}
+
+static int ca_sync_write_one_chunk_with_id(CaSync *s, const CaChunkID *id, const void *p, size_t l) {
+        uint64_t t;
+        int r;
+
+        assert(s);
+        assert(id);
+        assert(p || l == 0);
+
+        s->n_written_chunks++;
+
+        t = ca_profile_begin(&s->profile);
+
+        if (s->wstore) {
+                r = ca_store_put(s->wstore, id, CA_CHUNK_UNCOMPRESSED, p, l);
+                if (r == -EEXIST)
+                        s->n_reused_chunks++;
+                else if (r < 0)
+                        return r;
+        }
+
+        if (s->cache_store) {
+                r = ca_store_put(s->cache_store, id, CA_CHUNK_UNCOMPRESSED, p, l);
+                if (r < 0 && r != -EEXIST)
+                        return r;
+        }
+
+        ca_profile_end(&s->profile, CA_PROFILE_STORE_PUT, t, l);
+
+        if (s->index) {
+                r = ca_index_write_chunk(s->index, id, l);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int ca_sync_force_chunk_cut(CaSync *s) {
+        const void *chunk;
+        size_t chunk_size;
+        int r;
+
+        assert(s);
+
+        /* Flushes whatever the chunker has accumulated as a chunk of its own, so that the next byte fed
+         * starts a fresh chunk on a boundary of our choosing. */
+
+        chunk_size = realloc_buffer_size(&s->buffer);
+        if (chunk_size == 0) {
+                ca_chunker_restart(&s->chunker);
+                return 0;
+        }
+
+        chunk = realloc_buffer_data(&s->buffer);
+
+        if (s->n_workers == 0) {
+                CaChunkID id;
+
+                /* The fused digest already covers everything in the buffer, finish it up */
+                r = ca_sync_fused_digest_finalize(s, chunk, chunk_size, &id);
+                if (r < 0)
+                        return r;
+
+                r = ca_sync_write_one_chunk_with_id(s, &id, chunk, chunk_size);
+                if (r >= 0 && s->cache && s->cache_location)
+                        (void) ca_cache_put(s->cache, s->base_fd, s->cache_location, &id, chunk_size);
+                if (r >= 0)
+                        ca_sync_phys_record_chunk(s, s->cache_location, &id, chunk_size);
+        } else
+                r = ca_sync_write_one_chunk(s, s->cache_location, chunk, chunk_size);
+        if (r < 0)
+                return r;
+
+        realloc_buffer_empty(&s->buffer);
+        ca_chunker_restart(&s->chunker);
+
+        s->cache_location = ca_location_unref(s->cache_location);
+
+        return 0;
+}
+
+static bool ca_sync_phys_enabled(CaSync *s) {
+        assert(s);
+
+        /* Physical-extent dedup requires an index to replay records into, a base directory to map files
+         * from, and that nobody needs the actual byte stream (replaying seeks over the payload) */
+
+        return s->index &&
+               s->base_fd >= 0 &&
+               s->archive_fd < 0 &&
+               !s->remote_archive &&
+               !s->remote_wstore;
+}
+
+static int ca_sync_phys_try_file(CaSync *s, CaLocation *location) {
+        uint64_t *layout = NULL;
+        size_t n_layout = 0;
+        uint64_t hash, size = UINT64_MAX;
+        CaSyncPhysFile *f;
+        int fd, r;
+
         assert(s);
 
-        if (s->started)
+        /* Called whenever payload data is about to be chunked. Detects the aligned start of a sufficiently
+         * large file, maps its physical extent layout, and either replays the chunk records an extent-
+         * identical earlier file produced (returning 1), or starts recording this one (returning 0). */
+
+        if (!location ||
+            location->designator != CA_LOCATION_PAYLOAD ||
+            isempty(location->path))
+                return 0;
+        if (location->offset != 0) /* Only the very start of a file is interesting */
                 return 0;
+        if (realloc_buffer_size(&s->buffer) != 0)
+                return 0; /* No chunk boundary right at the payload start, records wouldn't line up */
 
-        if (s->direction == CA_SYNC_ENCODE && s->archive_path && s->archive_fd < 0) {
-                if (!s->temporary_archive_path) {
-                        r = tempfn_random(s->archive_path, &s->temporary_archive_path);
-                        if (r < 0)
-                                return r;
-                }
+        /* A new file begins, whatever we were recording so far is complete */
+        ca_sync_phys_seal_recording(s);
 
-                s->archive_fd = open(s->temporary_archive_path, O_WRONLY|O_CLOEXEC|O_NOCTTY|O_CREAT|O_EXCL, s->make_mode & 0666);
-                if (s->archive_fd < 0) {
-                        s->temporary_archive_path = mfree(s->temporary_archive_path);
-                        return -errno;
-                }
-        }
+        r = ca_encoder_current_size(s->encoder, &size);
+        if (r < 0 || size < s->chunker.chunk_size_avg)
+                return 0; /* Too small to ever produce a wholly contained chunk */
 
-        if (s->direction == CA_SYNC_ENCODE && !s->encoder) {
+        fd = openat(s->base_fd, location->path, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
+        if (fd < 0)
+                return 0;
 
-                if (s->base_fd < 0)
-                        return -EUNATCH;
+        r = ca_sync_phys_read_layout(fd, &layout, &n_layout);
+        safe_close(fd);
+        if (r == -ENOMEM)
+                return r;
+        if (r < 0) /* Not mappable (tmpfs, overlays, in-flight data, …), chunk the ordinary way */
+                return 0;
 
-                s->encoder = ca_encoder_new();
-                if (!s->encoder)
-                        return -ENOMEM;
+        hash = ca_sync_phys_hash(layout, n_layout);
 
-                r = ca_encoder_set_feature_flags(s->encoder, s->feature_flags);
-                if (r < 0) {
-                        s->encoder = ca_encoder_unref(s->encoder);
-                        return r;
-                }
+        f = ca_sync_phys_find(s, hash, layout, n_layout);
+        if (f) {
+                size_t i;
 
-                r = ca_encoder_set_base_fd(s->encoder, s->base_fd);
-                if (r < 0) {
-                        s->encoder = ca_encoder_unref(s->encoder);
-                        return r;
-                }
+                free(layout);
 
-                s->base_fd = -1;
+                if (!f->sealed || f->n_chunks == 0)
+                        return 0;
 
-                r = ca_encoder_set_uid_shift(s->encoder, s->uid_shift);
-                if (r < 0)
-                        return r;
-                r = ca_encoder_set_uid_range(s->encoder, s->uid_range);
+                /* Same device, same physical extents — necessarily the same bytes. Retire what the
+                 * workers still have in flight first, the index must stay sequential. */
+                r = ca_sync_process_chunk_jobs(s, 0);
                 if (r < 0)
                         return r;
-        }
 
-        if (s->direction == CA_SYNC_DECODE && !s->decoder) {
+                for (i = 0; i < f->n_chunks; i++) {
+                        r = ca_index_write_chunk(s->index, &f->chunks[i].id, f->chunks[i].size);
+                        if (r < 0)
+                                return r;
 
-                if (s->boundary_fd < 0 && s->boundary_path) {
+                        s->n_written_chunks++;
+                        s->n_reused_chunks++;
+                }
 
-                        if (mkdir(s->boundary_path, 0777) < 0 && errno != EEXIST)
-                                return -errno;
+                {
+                        CaLocation *end;
 
-                        s->boundary_fd = open(s->boundary_path, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_DIRECTORY);
-                        if (s->boundary_fd < 0)
-                                return -errno;
+                        /* Skip the encoder past everything the records cover; if the final chunk of the
+                         * original merged with whatever followed, the tail continues the ordinary way */
+                        r = ca_location_new(location->path, CA_LOCATION_PAYLOAD, f->covered, UINT64_MAX, &end);
+                        if (r < 0)
+                                return r;
+
+                        r = ca_encoder_seek_location(s->encoder, end);
+                        ca_location_unref(end);
+                        if (r < 0)
+                                return r;
                 }
 
-                if (s->base_fd < 0 && s->base_path) {
+                return 1;
+        }
 
-                        if (s->base_mode == (mode_t) -1)
-                                return -EUNATCH;
+        /* First time this layout shows up — remember it and record the chunks it produces */
+        f = new0(CaSyncPhysFile, 1);
+        if (!f) {
+                free(layout);
+                return -ENOMEM;
+        }
 
-                        if (S_ISDIR(s->base_mode)) {
+        f->hash = hash;
+        f->layout = layout;
+        f->n_layout = n_layout;
 
-                                if (mkdir(s->base_path, 0777) < 0 && errno != EEXIST)
-                                        return -errno;
+        r = ca_sync_phys_insert(s, f);
+        if (r < 0) {
+                ca_sync_phys_file_free(f);
+                return r;
+        }
 
-                                s->base_fd = open(s->base_path, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_DIRECTORY);
-                                if (s->base_fd < 0)
-                                        return -errno;
+        s->phys_rec_path = strdup(location->path);
+        if (!s->phys_rec_path) /* The empty entry stays in the map, which is harmless */
+                return -ENOMEM;
 
-                        } else if (S_ISREG(s->base_mode)) {
+        s->phys_rec = f;
+        s->phys_rec_offset = 0;
 
-                                if (!s->temporary_base_path) {
-                                        r = tempfn_random(s->base_path, &s->temporary_base_path);
-                                        if (r < 0)
-                                                return r;
-                                }
+        return 0;
+}
 
-                                s->base_fd = open(s->temporary_base_path, O_WRONLY|O_CLOEXEC|O_NOCTTY|O_CREAT|O_EXCL, 0666);
-                                if (s->base_fd < 0) {
-                                        s->temporary_base_path = mfree(s->temporary_base_path);
-                                        return -errno;
-                                }
+static int ca_sync_write_chunks(CaSync *s, CaLocation *location, const void *p, size_t l) {
+        uint64_t consumed = 0;
+        bool fused;
+        int r;
 
-                        } else {
-                                assert(S_ISBLK(s->base_mode));
+        assert(s);
+        assert(p || l == 0);
 
-                                s->base_fd = open(s->base_path, O_WRONLY|O_CLOEXEC|O_NOCTTY);
-                                if (s->base_fd < 0)
-                                        return -errno;
-                        }
-                }
+        if (!s->wstore && !s->cache_store && !s->index)
+                return 0;
 
-                s->decoder = ca_decoder_new();
-                if (!s->decoder)
-                        return -ENOMEM;
+        if (s->cache || s->phys_rec) {
+                /* Track whether the chunk currently being assembled is an uninterrupted run of a single
+                 * file's payload. Only such chunks enter the chunking cache (and the physical-extent
+                 * records), since only their content is fully identified by the file plus the start
+                 * offset. */
 
-                /* There are three ways we can initialize the decoder:
-                 *
-                 * 1. We extract the whole archive. In this case we specify the "base" fd for the extraction, which is
-                 *    going to be the top-level object we'll write to. If the archive is a directory tree, this needs
-                 *    to be a directory fd, otherwise a regular file or block device.
-                 *
-                 * 2. We do not extract anything (i.e. only list the contents or such). In this case we don't specify
-                 *    any fd, but we do specify the file type (directory or regular file/block device) of the top-level
-                 *    object we'd extract to if we'd extract. This is necessary so that we know whether to simply
-                 *    decode a raw file contents blob, or a full directory tree.
-                 *
-                 * 3. We extract a subtree of the whole archive. In this case we specify a "boundary" directory fd,
-                 *    where to place the objected seeked to. Note that difference from the "base" fd: we'll always
-                 *    extract the seeked to file as a subfile of the specified fd.
-                 */
+                if (realloc_buffer_size(&s->buffer) == 0) {
+                        ca_location_unref(s->cache_location);
+                        s->cache_location = NULL;
+
+                        if (location && location->designator == CA_LOCATION_PAYLOAD && location->path)
+                                s->cache_location = ca_location_ref(location);
+
+                } else if (s->cache_location &&
+                           (!location ||
+                            location->designator != CA_LOCATION_PAYLOAD ||
+                            !location->path ||
+                            !streq(location->path, s->cache_location->path) ||
+                            location->offset != s->cache_location->offset + realloc_buffer_size(&s->buffer)))
+                        s->cache_location = ca_location_unref(s->cache_location);
+        }
 
-                if (s->boundary_fd >= 0) {
+        /* Without worker threads the digest would make a second full pass over every byte right after the
+         * chunker's scan. Fuse the two instead: feed the digest with the very data the chunker just
+         * scanned, while it is still cache-resident. With workers the digest is computed off the main
+         * thread anyway, where the extra pass overlaps with I/O, hence leave it there. */
+        fused = s->n_workers == 0;
 
-                        r = ca_decoder_set_boundary_fd(s->decoder, s->boundary_fd);
-                        if (r < 0)
-                                return r;
+        while (l > 0) {
+                const void *chunk;
+                size_t chunk_size, k;
+                uint64_t t;
 
-                        s->boundary_fd = -1;
+                t = ca_profile_begin(&s->profile);
+                k = ca_chunker_scan(&s->chunker, p, l);
+                ca_profile_end(&s->profile, CA_PROFILE_CHUNKER, t, k == (size_t) -1 ? l : k);
 
-                } else  if (s->base_fd >= 0) {
+                if (k == (size_t) -1) {
+                        if (!realloc_buffer_append(&s->buffer, p, l))
+                                return -ENOMEM;
 
-                        r = ca_decoder_set_base_fd(s->decoder, s->base_fd);
+                        if (fused) {
+                                t = ca_profile_begin(&s->profile);
+                                r = ca_sync_fused_digest_feed(s, p, l);
+                                if (r < 0)
+                                        return r;
+                                ca_profile_end(&s->profile, CA_PROFILE_DIGEST, t, l);
+                        }
+
+                        return 0;
+                }
+
+                if (fused) {
+                        t = ca_profile_begin(&s->profile);
+                        r = ca_sync_fused_digest_feed(s, p, k);
                         if (r < 0)
                                 return r;
+                        ca_profile_end(&s->profile, CA_PROFILE_DIGEST, t, k);
+                }
 
-                        s->base_fd = -1;
+                if (realloc_buffer_size(&s->buffer) == 0) {
+                        chunk = p;
+                        chunk_size = k;
                 } else {
+                        if (!realloc_buffer_append(&s->buffer, p, k))
+                                return -ENOMEM;
 
-                        if (s->base_mode == (mode_t) -1)
-                                return -EUNATCH;
+                        chunk = realloc_buffer_data(&s->buffer);
+                        chunk_size = realloc_buffer_size(&s->buffer);
+                }
 
-                        r = ca_decoder_set_base_mode(s->decoder, s->base_mode);
+                if (fused) {
+                        CaChunkID id;
+
+                        r = ca_sync_fused_digest_finalize(s, chunk, chunk_size, &id);
                         if (r < 0)
                                 return r;
+
+                        r = ca_sync_write_one_chunk_with_id(s, &id, chunk, chunk_size);
+                        if (r >= 0 && s->cache && s->cache_location)
+                                (void) ca_cache_put(s->cache, s->base_fd, s->cache_location, &id, chunk_size);
+                        if (r >= 0)
+                                ca_sync_phys_record_chunk(s, s->cache_location, &id, chunk_size);
+                } else
+                        r = ca_sync_write_one_chunk(s, s->cache_location, chunk, chunk_size);
+                if (r < 0)
+                        return r;
+
+                realloc_buffer_empty(&s->buffer);
+
+                p = (const uint8_t*) p + k;
+                l -= k;
+                consumed += k;
+
+                if (s->cache || s->phys_rec) {
+                        /* The next chunk begins right here. If we are still in the middle of the same
+                         * payload run it is cachable again, at the advanced offset. */
+
+                        ca_location_unref(s->cache_location);
+                        s->cache_location = NULL;
+
+                        if (l > 0 && location && location->designator == CA_LOCATION_PAYLOAD && location->path)
+                                (void) ca_location_new(location->path, CA_LOCATION_PAYLOAD,
+                                                       location->offset + consumed, UINT64_MAX,
+                                                       &s->cache_location);
                 }
+        }
 
-                if (s->archive_size != UINT64_MAX) {
-                        r = ca_decoder_set_archive_size(s->decoder, s->archive_size);
+        return 0;
+}
+
+static int ca_sync_write_final_chunk(CaSync *s) {
+        int r;
+
+        assert(s);
+
+        if (!s->wstore && !s->cache_store && !s->index)
+                return 0;
+
+        if (realloc_buffer_size(&s->buffer) > 0) {
+
+                if (s->n_workers == 0) {
+                        CaChunkID id;
+
+                        /* The buffered remainder was already fed into the fused digest as it arrived */
+                        r = ca_sync_fused_digest_finalize(s, realloc_buffer_data(&s->buffer), realloc_buffer_size(&s->buffer), &id);
                         if (r < 0)
                                 return r;
-                }
 
-                r = ca_decoder_set_punch_holes(s->decoder, s->punch_holes);
-                if (r < 0)
-                        return r;
-                r = ca_decoder_set_reflink(s->decoder, s->reflink);
-                if (r < 0)
-                        return r;
-                r = ca_decoder_set_hardlink(s->decoder, s->hardlink);
-                if (r < 0)
-                        return r;
-                r = ca_decoder_set_delete(s->decoder, s->delete);
+                        r = ca_sync_write_one_chunk_with_id(s, &id, realloc_buffer_data(&s->buffer), realloc_buffer_size(&s->buffer));
+                        if (r >= 0 && s->cache && s->cache_location)
+                                (void) ca_cache_put(s->cache, s->base_fd, s->cache_location, &id, realloc_buffer_size(&s->buffer));
+                } else
+                        r = ca_sync_write_one_chunk(s, s->cache_location, realloc_buffer_data(&s->buffer), realloc_buffer_size(&s->buffer));
                 if (r < 0)
                         return r;
-                r = ca_decoder_set_payload(s->decoder, s->payload || s->remote_archive);
-                if (r < 0)
-                        return r;
-                r = ca_decoder_set_undo_immutable(s->decoder, s->undo_immutable);
-                if (r < 0)
-                        return r;
-                r = ca_decoder_set_uid_shift(s->decoder, s->uid_shift);
+
+                realloc_buffer_empty(&s->buffer);
+                s->cache_location = ca_location_unref(s->cache_location);
+        }
+
+        /* Wait for the worker threads to finish whatever is still in flight, before we write the index EOF */
+        r = ca_sync_process_chunk_jobs(s, 0);
+        if (r < 0)
+                return r;
+
+        if (s->index) {
+                r = ca_index_write_eof(s->index);
                 if (r < 0)
                         return r;
-                r = ca_decoder_set_uid_range(s->decoder, s->uid_range);
+
+                r = ca_index_install(s->index);
                 if (r < 0)
                         return r;
-                r = ca_decoder_set_feature_flags_mask(s->decoder, s->feature_flags_mask);
+        }
+
+        return 0;
+}
+
+static int ca_sync_install_archive(CaSync *s) {
+        assert(s);
+
+        if (!s->temporary_archive_path)
+                return 0;
+
+        if (!s->archive_path)
+                return 0;
+
+        if (rename(s->temporary_archive_path, s->archive_path) < 0)
+                return -errno;
+
+        s->temporary_archive_path = mfree(s->temporary_archive_path);
+        return 0;
+}
+
+static int ca_sync_write_remote_archive_eof(CaSync *s) {
+        assert(s);
+
+        if (!s->remote_archive)
+                return 0;
+
+        return ca_remote_put_archive_eof(s->remote_archive);
+}
+
+static int ca_sync_step_encode(CaSync *s) {
+        uint64_t t;
+        int r, step;
+
+        assert(s);
+
+        if (s->archive_eof)
+                return CA_SYNC_POLL;
+
+        if (!s->encoder)
+                return CA_SYNC_POLL;
+
+        if (s->remote_archive) {
+                /* If we shall store the result remotely, wait until the remote side accepts more data */
+                r = ca_remote_can_put_archive(s->remote_archive);
                 if (r < 0)
                         return r;
+                if (r == 0)
+                        return CA_SYNC_POLL;
         }
 
-        if (s->remote_index && !s->index) {
-                if (s->direction == CA_SYNC_DECODE)
-                        s->index = ca_index_new_incremental_read();
-                else {
-                        assert(s->direction == CA_SYNC_ENCODE);
-                        s->index = ca_index_new_incremental_write();
-                }
-                if (!s->index)
-                        return -ENOMEM;
-        }
-
-        if (s->remote_index &&
-            s->remote_wstore == s->remote_index &&
-            s->direction == CA_SYNC_ENCODE &&
-            !s->cache_store) {
+        t = ca_profile_begin(&s->profile);
+        step = ca_encoder_step(s->encoder);
+        ca_profile_end(&s->profile, CA_PROFILE_ENCODER, t, 0);
+        if (step < 0)
+                return step;
 
-                /* If we use the same server for index and storage, then we can optimize things a bit, and make the
-                 * server request what it is missing so far. */
+        switch (step) {
 
-                s->cache_store = ca_store_new_cache();
-                if (!s->cache_store)
-                        return -ENOMEM;
+        case CA_ENCODER_FINISHED:
 
-                r = ca_store_set_digest_type(s->cache_store, ca_feature_flags_to_digest_type(s->feature_flags));
+                r = ca_sync_write_final_chunk(s);
                 if (r < 0)
                         return r;
 
-                r = ca_remote_add_local_feature_flags(s->remote_index, CA_PROTOCOL_PUSH_INDEX_CHUNKS);
+                r = ca_sync_install_archive(s);
                 if (r < 0)
                         return r;
-        }
 
-        if (s->encoder) {
-                /* If we are writing an index file we need the archive digest unconditionally, as it is included in its end */
-                r = ca_encoder_enable_archive_digest(s->encoder, s->archive_digest || s->index);
+                r = ca_sync_write_remote_archive_eof(s);
                 if (r < 0)
                         return r;
 
-                r = ca_encoder_enable_payload_digest(s->encoder, s->payload_digest);
-                if (r < 0)
-                        return r;
+                s->archive_eof = true;
 
-                r = ca_encoder_enable_hardlink_digest(s->encoder, s->hardlink_digest);
-                if (r < 0)
-                        return r;
-        }
+                /* If we install an index or archive remotely, let's decide the peer when it's done */
+                if (s->remote_index || s->remote_archive)
+                        return CA_SYNC_STEP;
 
-        if (s->decoder) {
-                r = ca_decoder_enable_archive_digest(s->decoder, s->archive_digest);
-                if (r < 0)
-                        return r;
+                return CA_SYNC_FINISHED;
 
-                r = ca_decoder_enable_payload_digest(s->decoder, s->payload_digest);
-                if (r < 0)
-                        return r;
+        case CA_ENCODER_NEXT_FILE:
+        case CA_ENCODER_DONE_FILE:
+        case CA_ENCODER_PAYLOAD:
+        case CA_ENCODER_DATA: {
+                const void *p;
+                size_t l;
 
-                r = ca_decoder_enable_hardlink_digest(s->decoder, s->hardlink_digest || s->hardlink);
-                if (r < 0)
-                        return r;
-        }
+                /* If the index shall carry a table of contents, record each member's path, ENTRY offset and
+                 * mode the moment the encoder starts with it. The ENTRY record hasn't been serialized at
+                 * this point yet, hence the current archive offset is exactly where it will begin. */
+                if (step == CA_ENCODER_NEXT_FILE &&
+                    s->index &&
+                    (s->feature_flags & CA_FORMAT_TOC)) {
+                        uint64_t entry_offset;
+                        mode_t entry_mode;
 
-        if (s->index) {
+                        if (ca_encoder_current_archive_offset(s->encoder, &entry_offset) >= 0 &&
+                            ca_encoder_current_mode(s->encoder, &entry_mode) >= 0) {
+                                char *entry_path;
 
-                if (s->direction == CA_SYNC_ENCODE) {
-                        /* Propagate the chunk size to the index we generate */
+                                r = ca_encoder_current_path(s->encoder, &entry_path);
+                                if (r < 0)
+                                        return r;
 
-                        r = ca_index_set_feature_flags(s->index, s->feature_flags);
-                        if (r < 0)
-                                return r;
+                                r = ca_index_write_toc_entry(s->index, entry_path, entry_offset, entry_mode);
+                                free(entry_path);
+                                if (r < 0)
+                                        return r;
+                        }
+                }
 
-                        r = ca_index_set_chunk_size_min(s->index, s->chunker.chunk_size_min);
+                r = ca_encoder_get_data(s->encoder, &p, &l);
+                if (r >= 0) {
+                        CaLocation *location = NULL;
+
+                        if (s->cache || ca_sync_phys_enabled(s))
+                                (void) ca_encoder_current_location(s->encoder, 0, &location);
+
+                        /* With file-aligned chunking force a chunk boundary right where a sufficiently
+                         * large file's payload begins, so that inserting or changing one file doesn't
+                         * shift the chunking of everything that follows it in the archive */
+                        if (step == CA_ENCODER_PAYLOAD &&
+                            (s->feature_flags & CA_FORMAT_FILE_ALIGNED_CHUNKS)) {
+                                uint64_t offset = UINT64_MAX, fsize = 0;
+
+                                if (ca_encoder_current_payload_offset(s->encoder, &offset) >= 0 &&
+                                    offset == 0 &&
+                                    ca_encoder_current_size(s->encoder, &fsize) >= 0 &&
+                                    fsize >= s->chunker.chunk_size_avg) {
+
+                                        r = ca_sync_force_chunk_cut(s);
+                                        if (r < 0) {
+                                                ca_location_unref(location);
+                                                return r;
+                                        }
+                                }
+                        }
+
+                        /* If this is the aligned start of a file we may know its chunks from an extent-
+                         * identical file encoded earlier in this run */
+                        if (step == CA_ENCODER_PAYLOAD && ca_sync_phys_enabled(s)) {
+                                r = ca_sync_phys_try_file(s, location);
+                                if (r != 0) {
+                                        ca_location_unref(location);
+                                        if (r < 0)
+                                                return r;
+
+                                        return CA_SYNC_STEP;
+                                }
+                        }
+
+                        /* If a chunk starts right at this location, check whether the chunking cache
+                         * remembers what this payload produced last time. On a hit we reuse the recorded
+                         * chunk, skip chunking, hashing and compressing its data entirely, and seek the
+                         * encoder right past it. Only possible when nobody needs the actual byte stream,
+                         * i.e. no archive output is connected. */
+                        if (location &&
+                            s->index &&
+                            realloc_buffer_size(&s->buffer) == 0 &&
+                            s->archive_fd < 0 && !s->remote_archive && !s->remote_wstore) {
+
+                                CaChunkID id;
+                                uint64_t size;
+
+                                r = ca_cache_get(s->cache, s->base_fd, location, &id, &size);
+                                if (r >= 0 && (!s->wstore || ca_store_has(s->wstore, &id) > 0)) {
+                                        CaLocation *end;
+
+                                        /* Retire what the workers still have in flight first, the index
+                                         * must stay sequential */
+                                        r = ca_sync_process_chunk_jobs(s, 0);
+                                        if (r < 0)
+                                                goto fail;
+
+                                        r = ca_location_new(location->path, CA_LOCATION_PAYLOAD,
+                                                            location->offset + size, UINT64_MAX, &end);
+                                        if (r < 0)
+                                                goto fail;
+
+                                        r = ca_encoder_seek_location(s->encoder, end);
+                                        ca_location_unref(end);
+                                        if (r < 0)
+                                                goto fail;
+
+                                        r = ca_index_write_chunk(s->index, &id, size);
+                                        if (r < 0)
+                                                goto fail;
+
+                                        s->n_written_chunks++;
+                                        s->n_cache_chunk_hits++;
+
+                                        ca_location_unref(location);
+                                        return CA_SYNC_STEP;
+
+                                fail:
+                                        ca_location_unref(location);
+                                        return r;
+                                }
+                        }
+
+                        r = ca_sync_write_chunks(s, location, p, l);
+                        ca_location_unref(location);
                         if (r < 0)
                                 return r;
 
-                        r = ca_index_set_chunk_size_avg(s->index, s->chunker.chunk_size_avg);
+                        r = ca_sync_write_archive(s, p, l);
                         if (r < 0)
                                 return r;
 
-                        r = ca_index_set_chunk_size_max(s->index, s->chunker.chunk_size_max);
+                        r = ca_sync_write_remote_archive(s, p, l);
                         if (r < 0)
                                 return r;
 
-                        if (s->make_mode != (mode_t) -1) {
-                                r = ca_index_set_make_mode(s->index, s->make_mode);
-                                if (r < 0 && r != -ENOTTY)
-                                        return r;
-                        }
-                }
-
-                r = ca_index_open(s->index);
-                if (r < 0)
-                        return r;
-        }
-
-        for (i = 0; i < s->n_seeds; i++) {
-                /* Tell seeders whether to calculate hardlink and/or chunk seeds */
-
-                r = ca_seed_set_hardlink(s->seeds[i], s->hardlink);
-                if (r < 0)
+                } else if (r != -ENODATA)
                         return r;
 
-                r = ca_seed_set_chunks(s->seeds[i], !!s->index);
-                if (r < 0)
-                        return r;
+                return step == CA_ENCODER_NEXT_FILE ? CA_SYNC_NEXT_FILE :
+                       step == CA_ENCODER_DONE_FILE ? CA_SYNC_DONE_FILE :
+                       step == CA_ENCODER_PAYLOAD   ? CA_SYNC_PAYLOAD   :
+                                                      CA_SYNC_STEP;
         }
 
-        /* Tell the wstore which compression algorithm to use */
-        if (s->wstore) {
-                r = ca_store_set_compression_type(s->wstore, s->compression_type);
-                if (r < 0)
-                        return r;
+        default:
+                assert(false);
         }
+}
 
-        if (s->remote_wstore) {
-                r = ca_remote_set_compression_type(s->remote_wstore, s->compression_type);
-                if (r < 0)
-                        return r;
-        }
+static bool ca_sync_shall_seed(CaSync *s) {
 
-        s->started = true;
+        assert(s);
 
-        return 1;
+        if (s->direction != CA_SYNC_DECODE)
+                return false;  /* only run the seeds when decoding */
+        if (s->n_seeds == 0) /* no point in bothering if there are no seeds */
+                return false;
+
+        if (!s->index && !s->hardlink) /* If there's no chunk index and hardlinking is turned off, there's no point of managing seeds. */
+                return false;
+
+        return true;
 }
 
-static int ca_sync_write_archive(CaSync *s, const void *p, size_t l) {
+static bool ca_sync_seed_ready(CaSync *s) {
         assert(s);
-        assert(p || l == 0);
 
-        if (s->archive_fd < 0)
-                return 0;
+        if (!ca_sync_shall_seed(s))
+                return true;
 
-        return loop_write(s->archive_fd, p, l);
+        return s->current_seed >= s->n_seeds;
 }
 
-static int ca_sync_write_remote_archive(CaSync *s, const void *p, size_t l) {
-        assert(s);
-        assert(p || l == 0);
+static void ca_sync_prefetch_local(CaSync *s, const CaChunkID *id) {
+        size_t i;
 
-        if (!s->remote_archive)
-                return 0;
+        assert(s);
+        assert(id);
 
-        return ca_remote_put_archive(s->remote_archive, p, l);
+        if (s->wstore)
+                (void) ca_store_prefetch(s->wstore, id);
+        if (s->cache_store)
+                (void) ca_store_prefetch(s->cache_store, id);
+        for (i = 0; i < s->n_rstores; i++)
+                (void) ca_store_prefetch(s->rstores[i], id);
 }
 
-static int ca_sync_write_one_chunk(CaSync *s, const void *p, size_t l) {
-        CaChunkID id;
-        int r;
+static CaSyncCachedChunk* ca_sync_chunk_cache_find(CaSync *s, const CaChunkID *id) {
+        CaSyncChunkCache *cache;
+        size_t i;
 
         assert(s);
-        assert(p || l == 0);
-
-        r = ca_sync_make_chunk_id(s, p, l, &id);
-        if (r < 0)
-                return r;
+        assert(id);
 
-        s->n_written_chunks++;
+        cache = s->chunk_cache;
+        if (!cache->entries)
+                return NULL;
 
-        if (s->wstore) {
-                r = ca_store_put(s->wstore, &id, CA_CHUNK_UNCOMPRESSED, p, l);
-                if (r == -EEXIST)
-                        s->n_reused_chunks++;
-                else if (r < 0)
-                        return r;
-        }
+        for (i = 0; i < CA_SYNC_CHUNK_CACHE_ENTRIES; i++) {
+                CaSyncCachedChunk *c = cache->entries + i;
 
-        if (s->cache_store) {
-                r = ca_store_put(s->cache_store, &id, CA_CHUNK_UNCOMPRESSED, p, l);
-                if (r < 0 && r != -EEXIST)
-                        return r;
-        }
+                if (c->last_used == 0)
+                        continue;
+                if (!ca_chunk_id_equal(&c->id, id))
+                        continue;
 
-        if (s->index) {
-                r = ca_index_write_chunk(s->index, &id, l);
-                if (r < 0)
-                        return r;
+                c->last_used = ++cache->generation;
+                return c;
         }
 
-        return 0;
+        return NULL;
 }
 
-static int ca_sync_write_chunks(CaSync *s, const void *p, size_t l) {
-        int r;
+static void ca_sync_chunk_cache_put(CaSync *s, const CaChunkID *id, const void *data, uint64_t size) {
+        CaSyncCachedChunk *slot;
+        CaSyncChunkCache *cache;
+        size_t i;
 
         assert(s);
-        assert(p || l == 0);
+        assert(id);
+        assert(data || size == 0);
 
-        if (!s->wstore && !s->cache_store && !s->index)
-                return 0;
+        /* Best effort only: if the chunk doesn't fit or memory is short we simply don't cache it. */
 
-        while (l > 0) {
-                const void *chunk;
-                size_t chunk_size, k;
+        cache = s->chunk_cache;
 
-                k = ca_chunker_scan(&s->chunker, p, l);
-                if (k == (size_t) -1) {
-                        if (!realloc_buffer_append(&s->buffer, p, l))
-                                return -ENOMEM;
-                        return 0;
+        if (size == 0 || size > cache->max_bytes / 4)
+                return;
+
+        if (ca_sync_chunk_cache_find(s, id)) /* Already cached, the lookup refreshed its age */
+                return;
+
+        if (!cache->entries) {
+                cache->entries = new0(CaSyncCachedChunk, CA_SYNC_CHUNK_CACHE_ENTRIES);
+                if (!cache->entries)
+                        return;
+        }
+
+        for (;;) {
+                CaSyncCachedChunk *oldest = NULL;
+
+                slot = NULL;
+
+                for (i = 0; i < CA_SYNC_CHUNK_CACHE_ENTRIES; i++) {
+                        CaSyncCachedChunk *c = cache->entries + i;
+
+                        if (c->last_used == 0) {
+                                slot = c;
+                                continue;
+                        }
+
+                        if (!oldest || c->last_used < oldest->last_used)
+                                oldest = c;
                 }
 
-                if (realloc_buffer_size(&s->buffer) == 0) {
-                        chunk = p;
-                        chunk_size = k;
-                } else {
-                        if (!realloc_buffer_append(&s->buffer, p, k))
-                                return -ENOMEM;
+                /* Evict the least recently used entries until both the slot and the byte budget suffice */
+                if (!slot || cache->bytes + size > cache->max_bytes) {
+                        if (!oldest)
+                                return;
 
-                        chunk = realloc_buffer_data(&s->buffer);
-                        chunk_size = realloc_buffer_size(&s->buffer);
+                        assert(cache->bytes >= oldest->size);
+                        cache->bytes -= oldest->size;
+
+                        oldest->data = mfree(oldest->data);
+                        oldest->size = oldest->last_used = 0;
+                        continue;
                 }
 
-                r = ca_sync_write_one_chunk(s, chunk, chunk_size);
-                if (r < 0)
-                        return r;
+                break;
+        }
 
-                realloc_buffer_empty(&s->buffer);
+        slot->data = memdup(data, size);
+        if (!slot->data)
+                return;
+
+        slot->id = *id;
+        slot->size = size;
+        slot->last_used = ++cache->generation;
+        cache->bytes += size;
+}
+
+static int ca_sync_get_local_chunk_fd(CaSync *s, const CaChunkID *id, uint64_t *ret_size) {
+        size_t i;
+        int fd;
+
+        assert(s);
+        assert(id);
+
+        /* Opens the loose uncompressed chunk file from whichever local store carries it. Unlike
+         * ca_sync_get_local() this doesn't validate the content against the ID, callers only use it
+         * where the data flows to the output unparsed, trading the check for the kernel-side copy. */
+
+        if (s->wstore) {
+                fd = ca_store_get_fd(s->wstore, id, ret_size);
+                if (fd >= 0)
+                        return fd;
+        }
+
+        if (s->cache_store) {
+                fd = ca_store_get_fd(s->cache_store, id, ret_size);
+                if (fd >= 0)
+                        return fd;
+        }
 
-                p = (const uint8_t*) p + k;
-                l -= k;
+        for (i = 0; i < s->n_rstores; i++) {
+                fd = ca_store_get_fd(s->rstores[i], id, ret_size);
+                if (fd >= 0)
+                        return fd;
         }
 
-        return 0;
+        return -ENOENT;
 }
 
-static int ca_sync_write_final_chunk(CaSync *s) {
+static int ca_sync_fill_decode_lookahead(CaSync *s) {
         int r;
 
         assert(s);
+        assert(s->index);
+        assert(s->n_workers > 0);
 
-        if (!s->wstore && !s->cache_store && !s->index)
-                return 0;
+        /* Read ahead in the index, and queue decompression of the upcoming chunks on the worker threads, so
+         * that the decoder gets handed buffers that are already decompressed. */
 
-        if (realloc_buffer_size(&s->buffer) == 0)
-                return 0;
+        if (!s->lookahead) {
+                s->lookahead_size = s->n_workers * 4;
+                s->lookahead = new0(CaSyncLookaheadChunk, s->lookahead_size);
+                if (!s->lookahead)
+                        return -ENOMEM;
+        }
 
-        r = ca_sync_write_one_chunk(s, realloc_buffer_data(&s->buffer), realloc_buffer_size(&s->buffer));
-        if (r < 0)
-                return r;
+        /* First, pull index entries into the lookahead ring, and ask the kernel to start reading the chunk
+         * files they refer to. The ring is deeper than the number of decompression jobs we keep queued, so
+         * that the readahead advice is issued well before we actually load each chunk. */
+        while (!s->lookahead_eof && s->n_lookahead < s->lookahead_size) {
+                CaSyncLookaheadChunk *e = s->lookahead + (s->lookahead_first + s->n_lookahead) % s->lookahead_size;
 
-        if (s->index) {
-                r = ca_index_write_eof(s->index);
+                r = ca_index_read_chunk(s->index, &e->id, NULL, &e->size);
+                if (r == -EAGAIN) /* Not enough data */
+                        break;
                 if (r < 0)
                         return r;
+                if (r == 0) {
+                        s->lookahead_eof = true;
+                        break;
+                }
 
-                r = ca_index_install(s->index);
-                if (r < 0)
+                ca_sync_prefetch_local(s, &e->id);
+                s->n_lookahead++;
+        }
+
+        /* Then, load chunks off the front of the ring and queue their decompression */
+        while (s->n_lookahead > 0 && s->n_jobs < s->n_workers * 2) {
+                CaSyncLookaheadChunk *e = s->lookahead + s->lookahead_first;
+                CaChunkCompression effective;
+                CaSyncCachedChunk *cached;
+                CaSyncChunkJob *j;
+                CaChunkID id;
+                uint64_t size, l;
+                const void *p;
+
+                id = e->id;
+                size = e->size;
+
+                s->lookahead_first = (s->lookahead_first + 1) % s->lookahead_size;
+                s->n_lookahead--;
+
+                /* If the decoder takes the payload without looking at it, hand it the chunk file itself
+                 * where we have one, so that the kernel later copies the data straight to the output */
+                if (ca_decoder_can_put_data_fd(s->decoder) > 0) {
+                        uint64_t fsize = 0;
+                        int fd;
+
+                        fd = ca_sync_get_local_chunk_fd(s, &id, &fsize);
+                        if (fd >= 0) {
+
+                                if (size != UINT64_MAX && fsize != size)
+                                        /* The index disagrees on the size, let the validating path report that */
+                                        safe_close(fd);
+                                else {
+                                        j = ca_sync_chunk_job_acquire(s);
+                                        if (!j) {
+                                                safe_close(fd);
+                                                return -ENOMEM;
+                                        }
+
+                                        j->op = CA_SYNC_JOB_DECOMPRESS;
+                                        j->id = id;
+                                        j->usize = size;
+                                        j->fd = fd;
+                                        j->size = fsize;
+                                        j->finished = true; /* Nothing for the workers to do */
+
+                                        assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
+
+                                        if (s->job_fifo_tail)
+                                                s->job_fifo_tail->fifo_next = j;
+                                        else
+                                                s->job_fifo = j;
+                                        s->job_fifo_tail = j;
+                                        s->n_jobs++;
+
+                                        assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
+                                        continue;
+                                }
+                        }
+                }
+
+                /* If the index references the same chunk multiple times, reuse the uncompressed copy we
+                 * still have around instead of loading and decompressing it again */
+                cached = ca_sync_chunk_cache_find(s, &id);
+                if (cached) {
+                        p = cached->data;
+                        l = cached->size;
+                        effective = CA_CHUNK_UNCOMPRESSED;
+                } else {
+                        r = ca_sync_get_local(s, &id, CA_CHUNK_AS_IS, &p, &l, &effective, NULL);
+                        if (r < 0)
+                                return r;
+                }
+
+                j = ca_sync_chunk_job_acquire(s);
+                if (!j)
+                        return -ENOMEM;
+
+                j->op = CA_SYNC_JOB_DECOMPRESS;
+                j->id = id;
+                j->usize = size;
+
+                r = ca_sync_chunk_job_set_data(j, p, l);
+                if (r < 0) {
+                        ca_sync_chunk_job_release(s, j);
                         return r;
+                }
+
+                assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
+
+                if (s->job_fifo_tail)
+                        s->job_fifo_tail->fifo_next = j;
+                else
+                        s->job_fifo = j;
+                s->job_fifo_tail = j;
+                s->n_jobs++;
+
+                if (effective == CA_CHUNK_UNCOMPRESSED)
+                        /* Stored uncompressed, nothing for the workers to do */
+                        j->finished = true;
+                else {
+                        if (s->job_queue_tail)
+                                s->job_queue_tail->queue_next = j;
+                        else
+                                s->job_queue = j;
+                        s->job_queue_tail = j;
+
+                        pthread_cond_signal(&s->job_submitted_cond);
+                }
+
+                assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
         }
 
         return 0;
 }
 
-static int ca_sync_install_archive(CaSync *s) {
+static void ca_sync_drop_decode_lookahead(CaSync *s) {
+        CaSyncChunkJob *j;
+
         assert(s);
 
-        if (!s->temporary_archive_path)
-                return 0;
+        if (s->n_workers == 0)
+                return;
 
-        if (!s->archive_path)
-                return 0;
+        assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
 
-        if (rename(s->temporary_archive_path, s->archive_path) < 0)
-                return -errno;
+        /* Jobs no worker picked up yet form the tail of the submission fifo (possibly interleaved with jobs
+         * that were finished on submission), we can free those directly. */
+        j = s->job_queue;
+        if (j) {
+                CaSyncChunkJob **pp;
 
-        s->temporary_archive_path = mfree(s->temporary_archive_path);
-        return 0;
-}
+                for (pp = &s->job_fifo; *pp; pp = &(*pp)->fifo_next)
+                        if (*pp == j)
+                                break;
+                *pp = NULL;
 
-static int ca_sync_write_remote_archive_eof(CaSync *s) {
-        assert(s);
+                s->job_queue = s->job_queue_tail = NULL;
 
-        if (!s->remote_archive)
-                return 0;
+                while (j) {
+                        CaSyncChunkJob *n = j->fifo_next;
 
-        return ca_remote_put_archive_eof(s->remote_archive);
+                        s->n_jobs--;
+                        ca_sync_chunk_job_free(j);
+                        j = n;
+                }
+        }
+
+        /* Whatever is left is either finished or being processed right now, wait for it */
+        while (s->job_fifo) {
+                if (!s->job_fifo->finished) {
+                        pthread_cond_wait(&s->job_finished_cond, &s->job_mutex);
+                        continue;
+                }
+
+                j = s->job_fifo;
+                s->job_fifo = j->fifo_next;
+                s->n_jobs--;
+                ca_sync_chunk_job_free(j);
+        }
+
+        s->job_fifo_tail = NULL;
+        s->lookahead_eof = false;
+        s->lookahead_first = s->n_lookahead = 0;
+
+        assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
 }
 
-static int ca_sync_step_encode(CaSync *s) {
-        int r, step;
+static int ca_sync_process_decoder_request_lookahead(CaSync *s) {
+        CaSyncChunkJob *j;
+        const void *p;
+        uint64_t sz;
+        int r;
 
         assert(s);
+        assert(s->index);
+        assert(s->n_workers > 0);
 
-        if (s->archive_eof)
-                return CA_SYNC_POLL;
+        r = ca_sync_fill_decode_lookahead(s);
+        if (r < 0)
+                return r;
 
-        if (!s->encoder)
-                return CA_SYNC_POLL;
+        for (;;) {
+                assert_se(pthread_mutex_lock(&s->job_mutex) == 0);
 
-        if (s->remote_archive) {
-                /* If we shall store the result remotely, wait until the remote side accepts more data */
-                r = ca_remote_can_put_archive(s->remote_archive);
-                if (r < 0)
-                        return r;
-                if (r == 0)
-                        return CA_SYNC_POLL;
-        }
+                j = s->job_fifo;
+                if (!j) {
+                        assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
 
-        step = ca_encoder_step(s->encoder);
-        if (step < 0)
-                return step;
+                        if (s->lookahead_eof && s->n_lookahead == 0) {
+                                r = ca_decoder_put_eof(s->decoder);
+                                if (r < 0)
+                                        return r;
 
-        switch (step) {
+                                return CA_SYNC_STEP;
+                        }
 
-        case CA_ENCODER_FINISHED:
+                        return CA_SYNC_POLL; /* More index data necessary */
+                }
 
-                r = ca_sync_write_final_chunk(s);
-                if (r < 0)
-                        return r;
+                /* The oldest chunk is the one the decoder needs next, wait for it */
+                while (!j->finished)
+                        pthread_cond_wait(&s->job_finished_cond, &s->job_mutex);
 
-                r = ca_sync_install_archive(s);
-                if (r < 0)
-                        return r;
+                s->job_fifo = j->fifo_next;
+                if (!s->job_fifo)
+                        s->job_fifo_tail = NULL;
+                s->n_jobs--;
 
-                r = ca_sync_write_remote_archive_eof(s);
-                if (r < 0)
-                        return r;
+                assert_se(pthread_mutex_unlock(&s->job_mutex) == 0);
 
-                s->archive_eof = true;
+                if (j->result < 0) {
+                        r = j->result;
+                        ca_sync_chunk_job_free(j);
+                        return r;
+                }
 
-                /* If we install an index or archive remotely, let's decide the peer when it's done */
-                if (s->remote_index || s->remote_archive)
-                        return CA_SYNC_STEP;
+                if (j->fd >= 0) {
+                        p = NULL;
+                        sz = j->size;
+                } else if (realloc_buffer_size(&j->processed) > 0) {
+                        p = realloc_buffer_data(&j->processed);
+                        sz = realloc_buffer_size(&j->processed);
+                } else {
+                        p = j->data;
+                        sz = j->size;
+                }
 
-                return CA_SYNC_FINISHED;
+                if (j->usize != UINT64_MAX && /* usize will be -1 if we just seeked in the index file */
+                    j->usize != sz) {
+                        ca_sync_chunk_job_free(j);
+                        return -EBADMSG;
+                }
 
-        case CA_ENCODER_NEXT_FILE:
-        case CA_ENCODER_DONE_FILE:
-        case CA_ENCODER_PAYLOAD:
-        case CA_ENCODER_DATA: {
-                const void *p;
-                size_t l;
+                if (j->fd < 0)
+                        ca_sync_chunk_cache_put(s, &j->id, p, sz);
 
-                r = ca_encoder_get_data(s->encoder, &p, &l);
-                if (r >= 0) {
+                if (s->chunk_skip >= sz) {
+                        /* A seek or skip covered this chunk entirely, drop it */
+                        s->chunk_skip -= sz;
+                        ca_sync_chunk_job_release(s, j);
 
-                        r = ca_sync_write_chunks(s, p, l);
+                        r = ca_sync_fill_decode_lookahead(s);
                         if (r < 0)
                                 return r;
 
-                        r = ca_sync_write_archive(s, p, l);
-                        if (r < 0)
-                                return r;
+                        continue;
+                }
 
-                        r = ca_sync_write_remote_archive(s, p, l);
-                        if (r < 0)
-                                return r;
+                break;
+        }
 
-                } else if (r != -ENODATA)
-                        return r;
+        if (s->chunk_skip > 0) {
+                /* We might have seeked to a location inside of a chunk, hence skip as many bytes as necessary */
+                if (j->fd >= 0) {
+                        if (lseek(j->fd, s->chunk_skip, SEEK_SET) == (off_t) -1) {
+                                r = -errno;
+                                ca_sync_chunk_job_free(j);
+                                return r;
+                        }
+                } else
+                        p = (const uint8_t*) p + s->chunk_skip;
 
-                return step == CA_ENCODER_NEXT_FILE ? CA_SYNC_NEXT_FILE :
-                       step == CA_ENCODER_DONE_FILE ? CA_SYNC_DONE_FILE :
-                       step == CA_ENCODER_PAYLOAD   ? CA_SYNC_PAYLOAD   :
-                                                      CA_SYNC_STEP;
+                sz -= s->chunk_skip;
+                s->chunk_skip = 0;
         }
 
-        default:
-                assert(false);
-        }
+        if (j->fd >= 0) {
+                r = ca_decoder_put_data_fd(s->decoder, j->fd, sz);
+                if (r == -ENOTTY) {
+                        void *q;
+                        ssize_t k;
+
+                        /* The decoder can't take the fd after all (e.g. the payload ends mid-chunk),
+                         * hence degrade to reading the data and handing it over in memory */
+                        q = realloc_buffer_acquire(&j->processed, sz);
+                        if (!q) {
+                                ca_sync_chunk_job_free(j);
+                                return -ENOMEM;
+                        }
+
+                        k = loop_read(j->fd, q, sz);
+                        if (k < 0)
+                                r = (int) k;
+                        else if ((uint64_t) k != sz)
+                                r = -EPIPE;
+                        else
+                                r = ca_decoder_put_data(s->decoder, q, sz, NULL);
+                }
+        } else
+                r = ca_decoder_put_data(s->decoder, p, sz, NULL);
+
+        ca_sync_chunk_job_release(s, j);
+        if (r < 0)
+                return r;
+
+        return CA_SYNC_STEP;
 }
 
-static bool ca_sync_shall_seed(CaSync *s) {
+static int ca_sync_handle_hol_stall(CaSync *s) {
+        CaRemote *alternate = NULL;
+        uint64_t t;
+        int r;
 
         assert(s);
 
-        if (s->direction != CA_SYNC_DECODE)
-                return false;  /* only run the seeds when decoding */
-        if (s->n_seeds == 0) /* no point in bothering if there are no seeds */
-                return false;
+        /* The decoder is blocked on a chunk that was already requested, while later chunks keep arriving
+         * out of order. If the same chunk keeps us waiting past a deadline, re-request it with priority —
+         * preferably from an alternate store — instead of waiting on the original transfer indefinitely. */
 
-        if (!s->index && !s->hardlink) /* If there's no chunk index and hardlinking is turned off, there's no point of managing seeds. */
-                return false;
+        if (!s->hol_valid || !ca_chunk_id_equal(&s->hol_chunk, &s->next_chunk)) {
+                s->hol_chunk = s->next_chunk;
+                s->hol_since = now(CLOCK_MONOTONIC);
+                s->hol_next_rstore = 0;
+                s->hol_valid = true;
+                return CA_SYNC_POLL;
+        }
 
-        return true;
-}
+        t = now(CLOCK_MONOTONIC);
+        if (t < s->hol_since + CA_SYNC_HOL_DEADLINE_NSEC)
+                return CA_SYNC_POLL;
 
-static bool ca_sync_seed_ready(CaSync *s) {
-        assert(s);
+        /* Pick the next alternate store whose bloom filter doesn't rule the chunk out, falling back to the
+         * store we asked originally */
+        while (s->hol_next_rstore < s->n_remote_rstores) {
+                CaRemote *rr = s->remote_rstores[s->hol_next_rstore++];
 
-        if (!ca_sync_shall_seed(s))
-                return true;
+                if (ca_remote_test_bloom(rr, &s->next_chunk) == 0)
+                        continue;
 
-        return s->current_seed >= s->n_seeds;
+                alternate = rr;
+                break;
+        }
+
+        if (!alternate)
+                alternate = s->remote_wstore;
+        if (!alternate)
+                return CA_SYNC_POLL;
+
+        r = ca_remote_request_async(alternate, &s->next_chunk, CA_REMOTE_PRIORITY_HIGH);
+        if (r < 0)
+                return r;
+
+        /* Re-arm the deadline, so that we escalate to the next store if this one stalls too */
+        s->hol_since = t;
+
+        return CA_SYNC_STEP;
 }
 
 static int ca_sync_process_decoder_request(CaSync *s) {
@@ -1739,6 +3993,9 @@ static int ca_sync_process_decoder_request(CaSync *s) {
                 uint64_t chunk_size;
                 const void *p;
 
+                if (s->n_workers > 0 && s->direction == CA_SYNC_DECODE)
+                        return ca_sync_process_decoder_request_lookahead(s);
+
                 for (;;) {
                         if (s->next_chunk_valid) {
 
@@ -1772,13 +4029,44 @@ static int ca_sync_process_decoder_request(CaSync *s) {
                 if (!ca_sync_seed_ready(s))
                         return CA_SYNC_POLL;
 
+                /* If the decoder takes the payload without looking at it, try handing it the chunk file
+                 * itself, so that the kernel copies the data to the output without a detour through our
+                 * buffers */
+                if (s->chunk_skip == 0 && ca_decoder_can_put_data_fd(s->decoder) > 0) {
+                        uint64_t fsize = 0;
+                        int fd;
+
+                        fd = ca_sync_get_local_chunk_fd(s, &s->next_chunk, &fsize);
+                        if (fd >= 0) {
+
+                                if (s->next_chunk_size != UINT64_MAX && fsize != s->next_chunk_size)
+                                        /* The index disagrees on the size, let the validating path report that */
+                                        safe_close(fd);
+                                else {
+                                        r = ca_decoder_put_data_fd(s->decoder, fd, fsize);
+                                        safe_close(fd);
+                                        if (r >= 0) {
+                                                s->next_chunk_valid = false;
+                                                return CA_SYNC_STEP;
+                                        }
+                                        if (r != -ENOTTY)
+                                                return r;
+
+                                        /* The payload ends inside this chunk, take the in-memory path */
+                                }
+                        }
+                }
+
                 r = ca_sync_get(s, &s->next_chunk, CA_CHUNK_UNCOMPRESSED, &p, &chunk_size, NULL, &origin);
                 if (r == -EAGAIN) /* Don't have this right now, but requested it now */
                         return CA_SYNC_STEP;
                 if (r == -EALREADY) /* Don't have this right now, but it was already enqueued. */
-                        return CA_SYNC_POLL;
+                        return ca_sync_handle_hol_stall(s);
                 if (r < 0)
                         return r;
+
+                s->hol_valid = false;
+
                 if (s->next_chunk_size != UINT64_MAX && /* next_chunk_size will be -1 if we just seeked in the index file */
                     s->next_chunk_size != chunk_size) {
                         ca_origin_unref(origin);
@@ -1895,6 +4183,9 @@ static int ca_sync_install_base(CaSync *s) {
 static void ca_sync_reset_seek(CaSync *s) {
         assert(s);
 
+        if (s->direction == CA_SYNC_DECODE)
+                ca_sync_drop_decode_lookahead(s);
+
         s->archive_eof = false;
         s->remote_index_eof = false;
         s->next_chunk_valid = false;
@@ -1961,10 +4252,74 @@ static int ca_sync_process_decoder_skip(CaSync *s) {
         return CA_SYNC_STEP;
 }
 
+static size_t ca_sync_dedup_search(CaSync *s, const CaChunkID *digest, bool *ret_found) {
+        size_t lo = 0, hi;
+
+        assert(s);
+        assert(digest);
+        assert(ret_found);
+
+        /* Binary search in the sorted dedup array. Returns either the index of the matching entry, or the
+         * position a new entry would have to be inserted at. */
+
+        hi = s->n_dedup_entries;
+
+        while (lo < hi) {
+                size_t m = lo + (hi - lo) / 2;
+                int c;
+
+                c = memcmp(digest, &s->dedup_entries[m].digest, sizeof(CaChunkID));
+                if (c == 0) {
+                        *ret_found = true;
+                        return m;
+                }
+
+                if (c < 0)
+                        hi = m;
+                else
+                        lo = m + 1;
+        }
+
+        *ret_found = false;
+        return lo;
+}
+
+static int ca_sync_dedup_record(CaSync *s, const CaChunkID *digest, const char *path) {
+        CaSyncDedupEntry *e;
+        size_t idx;
+        bool found;
+        char *copy;
+
+        assert(s);
+        assert(digest);
+        assert(path);
+
+        idx = ca_sync_dedup_search(s, digest, &found);
+        if (found)
+                return 0;
+
+        if (!GREEDY_REALLOC(s->dedup_entries, s->n_dedup_entries_allocated, s->n_dedup_entries+1))
+                return -ENOMEM;
+
+        copy = strdup(path);
+        if (!copy)
+                return -ENOMEM;
+
+        e = s->dedup_entries + idx;
+        memmove(e + 1, e, (s->n_dedup_entries - idx) * sizeof(CaSyncDedupEntry));
+
+        e->digest = *digest;
+        e->path = copy;
+
+        s->n_dedup_entries++;
+        return 1;
+}
+
 static int ca_sync_try_hardlink(CaSync *s) {
         CaChunkID digest;
         mode_t mode;
-        size_t i;
+        size_t i, idx;
+        bool found;
         int r;
 
         assert(s);
@@ -1973,7 +4328,7 @@ static int ca_sync_try_hardlink(CaSync *s) {
                 return -ENOTTY;
         if (!s->hardlink)
                 return 0;
-        if (s->n_seeds == 0)
+        if (s->n_seeds == 0 && s->dedup_fd < 0)
                 return 0;
 
         r = ca_decoder_current_mode(s->decoder, &mode);
@@ -2010,10 +4365,43 @@ static int ca_sync_try_hardlink(CaSync *s) {
                         return 1;
         }
 
+        /* No seed has it — maybe we extracted an identical file earlier in this run. The digest covers the
+         * payload and the replayed metadata, hence anything that matches may safely share an inode. */
+        if (s->dedup_fd < 0)
+                return 0;
+
+        if (!s->dedup_root) {
+                r = ca_file_root_new(NULL, s->dedup_fd, &s->dedup_root);
+                if (r < 0)
+                        return r;
+        }
+
+        idx = ca_sync_dedup_search(s, &digest, &found);
+        if (found) {
+                r = ca_decoder_try_hardlink(s->decoder, s->dedup_root, s->dedup_entries[idx].path);
+                if (r < 0)
+                        return r;
+                if (r > 0)
+                        return 1;
+        } else {
+                char *p;
+
+                /* Remember where this file ended up, later identical files will link to it */
+                r = ca_decoder_current_path(s->decoder, &p);
+                if (r < 0)
+                        return r;
+
+                r = ca_sync_dedup_record(s, &digest, p);
+                free(p);
+                if (r < 0)
+                        return r;
+        }
+
         return 0;
 }
 
 static int ca_sync_step_decode(CaSync *s) {
+        uint64_t t;
         int step, r;
 
         assert(s);
@@ -2024,7 +4412,9 @@ static int ca_sync_step_decode(CaSync *s) {
         if (s->archive_eof)
                 return -EPIPE;
 
+        t = ca_profile_begin(&s->profile);
         step = ca_decoder_step(s->decoder);
+        ca_profile_end(&s->profile, CA_PROFILE_DECODER, t, 0);
         if (step < 0)
                 return step;
 
@@ -2195,6 +4585,11 @@ static int ca_sync_remote_prefetch(CaSync *s) {
         if (!ca_sync_seed_ready(s))
                 return CA_SYNC_POLL;
 
+        /* While memory is tight shrink the request window to nothing — what's in flight may still arrive
+         * and be processed, but we don't pile on more. */
+        if (realloc_buffer_under_memory_pressure())
+                return CA_SYNC_POLL;
+
         r = ca_index_get_available_chunks(s->index, &available);
         if (r == -ENODATA || r == -EAGAIN)
                 return CA_SYNC_POLL;
@@ -2214,6 +4609,13 @@ static int ca_sync_remote_prefetch(CaSync *s) {
         for (;;) {
                 CaChunkID id;
 
+                /* Don't run further ahead of the consumer than the reorder window allows; we'll resume as
+                 * the decoder's position advances. The window is treated as a per-process I/O depth
+                 * budget: operations pooling their chunk cache divide it fairly instead of multiplying
+                 * it. */
+                if (s->n_prefetched_chunks >= saved + MAX(CA_SYNC_PREFETCH_WINDOW / s->chunk_cache->n_ref, 1U))
+                        break;
+
                 r = ca_index_read_chunk(s->index, &id, NULL, NULL);
                 if (r == 0 || r == -EAGAIN)
                         break;
@@ -2228,7 +4630,7 @@ static int ca_sync_remote_prefetch(CaSync *s) {
                 if (r > 0)
                         continue;
 
-                r = ca_remote_request_async(s->remote_wstore, &id, false);
+                r = ca_remote_request_async(s->remote_wstore, &id, CA_REMOTE_PRIORITY_BACKGROUND);
                 if (r < 0)
                         return r;
 
@@ -2283,10 +4685,8 @@ static int ca_sync_remote_push_index(CaSync *s) {
         return CA_SYNC_STEP;
 }
 
-static int ca_sync_remote_push_chunk(CaSync *s) {
-        const void *p;
-        CaChunkID id;
-        uint64_t l;
+static int ca_sync_remote_push_chunk(CaSync *s) {
+        bool did_something = false;
         int r;
 
         assert(s);
@@ -2298,34 +4698,53 @@ static int ca_sync_remote_push_chunk(CaSync *s) {
         if (s->direction != CA_SYNC_ENCODE)
                 return CA_SYNC_POLL;
 
-        r = ca_remote_can_put_chunk(s->remote_wstore);
-        if (r < 0)
-                return r;
-        if (r == 0)
-                return CA_SYNC_POLL;
+        /* Answer as many of the peer's outstanding chunk requests as the output queue takes, rather than
+         * one per ca_sync_step() cycle. That way the uplink always has a full pipeline window of frames
+         * to drain while we go back to chunking and compressing new data, and an idle network never waits
+         * on the encoder nor the other way round. */
 
-        r = ca_remote_next_request(s->remote_index, &id);
-        if (r == -ENODATA)
-                return CA_SYNC_POLL;
-        if (r < 0)
-                return r;
+        for (;;) {
+                CaChunkCompression effective = CA_CHUNK_COMPRESSED;
+                const void *p;
+                CaChunkID id;
+                uint64_t l;
 
-        r = ca_sync_get_local(s, &id, CA_CHUNK_COMPRESSED, &p, &l, NULL, NULL);
-        if (r == -ENOENT) {
-                r = ca_remote_put_missing(s->remote_wstore, &id);
+                r = ca_remote_can_put_chunk(s->remote_wstore);
                 if (r < 0)
                         return r;
+                if (r == 0) /* Queue is full, let it drain */
+                        break;
 
-                return CA_SYNC_STEP;
-        }
-        if (r < 0)
-                return r;
+                r = ca_remote_next_request(s->remote_index, &id);
+                if (r == -ENODATA) /* No outstanding requests */
+                        break;
+                if (r < 0)
+                        return r;
 
-        r = ca_remote_put_chunk(s->remote_wstore, &id, CA_CHUNK_COMPRESSED, p, l);
-        if (r < 0)
-                return r;
+                /* If the peer uses the same compression algorithm as we do, hand chunks through in
+                 * whatever encoding our store keeps them in, skipping the transcoder */
+                r = ca_sync_get_local(s, &id,
+                                      ca_remote_no_transcode(s->remote_wstore) > 0 ? CA_CHUNK_AS_IS : CA_CHUNK_COMPRESSED,
+                                      &p, &l, &effective, NULL);
+                if (r == -ENOENT) {
+                        r = ca_remote_put_missing(s->remote_wstore, &id);
+                        if (r < 0)
+                                return r;
 
-        return CA_SYNC_STEP;
+                        did_something = true;
+                        continue;
+                }
+                if (r < 0)
+                        return r;
+
+                r = ca_remote_put_chunk(s->remote_wstore, &id, effective, p, l);
+                if (r < 0)
+                        return r;
+
+                did_something = true;
+        }
+
+        return did_something ? CA_SYNC_STEP : CA_SYNC_POLL;
 }
 
 static int ca_sync_remote_step_one(CaSync *s, CaRemote *rr) {
@@ -2486,148 +4905,504 @@ static int ca_sync_propagate_flags_to_seeds(CaSync *s, uint64_t flags, size_t cm
                         return r;
         }
 
-        return 0;
-}
+        return 0;
+}
+
+static int ca_sync_propagate_flags_to_remotes(CaSync *s, uint64_t flags) {
+        CaDigestType dtype;
+        size_t i;
+        int r;
+
+        dtype = ca_feature_flags_to_digest_type(flags);
+        if (dtype < 0)
+                return -EINVAL;
+
+        if (s->remote_archive) {
+                r = ca_remote_set_digest_type(s->remote_archive, dtype);
+                if (r < 0)
+                        return r;
+        }
+
+        if (s->remote_index) {
+                r = ca_remote_set_digest_type(s->remote_index, dtype);
+                if (r < 0)
+                        return r;
+        }
+
+        if (s->remote_wstore) {
+                r = ca_remote_set_digest_type(s->remote_wstore, dtype);
+                if (r < 0)
+                        return r;
+        }
+
+        for (i = 0; i < s->n_remote_rstores; i++) {
+                r = ca_remote_set_digest_type(s->remote_rstores[i], dtype);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int ca_sync_propagate_flags_to_decoder(CaSync *s, uint64_t flags) {
+        assert(s);
+
+        if (!s->decoder)
+                return 0;
+
+        return ca_decoder_set_expected_feature_flags(s->decoder, flags);
+}
+
+static int ca_sync_propagate_index_flags(CaSync *s) {
+        size_t cmin, cavg, cmax;
+        uint64_t flags;
+        int r;
+
+        assert(s);
+
+        /* If we read the header of the index file, make sure to propagate the flags and chunk size stored in it to the
+         * seeds and remotes. */
+
+        if (s->direction != CA_SYNC_DECODE)
+                return CA_SYNC_POLL;
+
+        if (!s->index || s->index_flags_propagated) /* The flags/chunk size is already propagated */
+                return CA_SYNC_POLL;
+
+        r = ca_index_get_feature_flags(s->index, &flags);
+        if (r == -ENODATA) /* haven't read enough from the index header yet, let's wait */
+                return CA_SYNC_POLL;
+
+        r = ca_index_get_chunk_size_min(s->index, &cmin);
+        if (r < 0)
+                return r;
+
+        r = ca_index_get_chunk_size_avg(s->index, &cavg);
+        if (r < 0)
+                return r;
+
+        r = ca_index_get_chunk_size_max(s->index, &cmax);
+        if (r < 0)
+                return r;
+
+        r = ca_sync_propagate_flags_to_stores(s, flags);
+        if (r < 0)
+                return r;
+
+        r = ca_sync_propagate_flags_to_seeds(s, flags, cmin, cavg, cmax);
+        if (r < 0)
+                return r;
+
+        r = ca_sync_propagate_flags_to_remotes(s, flags);
+        if (r < 0)
+                return r;
+
+        r = ca_sync_propagate_flags_to_decoder(s, flags);
+        if (r < 0)
+                return r;
+
+        s->index_flags_propagated = true;
+        return CA_SYNC_STEP;
+}
+
+static void ca_sync_compact_buffers(CaSync *s) {
+        assert(s);
+
+        /* If our working buffers together exceed the configured budget, shrink them again. We only touch
+         * buffers that are currently drained, so that no data ever has to be copied around, and we keep a
+         * reasonable base allocation so that steadily used buffers don't thrash. */
+
+        if (!realloc_buffer_under_memory_pressure()) {
+                if (s->buffer_budget == 0)
+                        return;
+
+                if (s->buffer.allocated + s->index_buffer.allocated +
+                    s->archive_buffer.allocated + s->compress_buffer.allocated <= s->buffer_budget)
+                        return;
+        }
+
+        if (realloc_buffer_size(&s->buffer) == 0)
+                realloc_buffer_compact(&s->buffer, BUFFER_SIZE);
+        if (realloc_buffer_size(&s->index_buffer) == 0)
+                realloc_buffer_compact(&s->index_buffer, BUFFER_SIZE);
+        if (realloc_buffer_size(&s->archive_buffer) == 0)
+                realloc_buffer_compact(&s->archive_buffer, BUFFER_SIZE);
+        if (realloc_buffer_size(&s->compress_buffer) == 0)
+                realloc_buffer_compact(&s->compress_buffer, BUFFER_SIZE);
+}
+
+static int ca_sync_step_dispatch(CaSync *s) {
+        int r;
+
+        r = ca_sync_start(s);
+        if (r < 0)
+                return r;
+
+        ca_sync_compact_buffers(s);
+
+        r = ca_sync_propagate_index_flags(s);
+        if (r != CA_SYNC_POLL)
+                return r;
+
+        r = ca_sync_seed_step(s);
+        if (r != CA_SYNC_POLL)
+                return r;
+
+        r = ca_sync_remote_prefetch(s);
+        if (r != CA_SYNC_POLL)
+                return r;
+
+        r = ca_sync_remote_push_index(s);
+        if (r != CA_SYNC_POLL)
+                return r;
+
+        r = ca_sync_remote_push_chunk(s);
+        if (r != CA_SYNC_POLL)
+                return r;
+
+        /* Try to decode as much as we already have received, before accepting new remote data */
+        r = ca_sync_step_decode(s);
+        if (r != CA_SYNC_POLL)
+                return r;
+
+        /* Then process any remote traffic and flush our own buffers */
+        r = ca_sync_remote_step(s);
+        if (r != CA_SYNC_POLL)
+                return r;
+
+        /* Finally, generate new data */
+        return ca_sync_step_encode(s);
+}
+
+static void ca_sync_update_stats(CaSync *s, int step) {
+        CaSyncStats *p;
+        uint64_t seq, t, v;
+
+        assert(s);
+
+        p = s->stats;
+        if (!p)
+                return;
+
+        t = now(CLOCK_MONOTONIC);
+        if (s->stats_start_nsec == 0)
+                s->stats_start_nsec = t;
+
+        /* Seqlock-style update: bump the counter to an odd value, fill in the block, bump it to even
+         * again. Readers copy the block and retry until the counter matches before and after, hence we
+         * never block them and they never see a torn update. */
+
+        seq = p->seq + 1;
+        __atomic_store_n(&p->seq, seq, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQ_REL);
+
+        p->phase = (uint64_t) (int64_t) step;
+        p->start_nsec = s->stats_start_nsec;
+        p->updated_nsec = t;
+
+        p->archive_size = ca_sync_get_archive_size(s, &v) >= 0 ? v : UINT64_MAX;
+        p->archive_offset = ca_sync_current_archive_offset(s, &v) >= 0 ? v : 0;
+
+        p->n_chunks = ca_sync_current_archive_chunks(s, &v) >= 0 ? v : 0;
+        p->n_reused_chunks = ca_sync_current_archive_reused_chunks(s, &v) >= 0 ? v : 0;
+        p->n_cache_hits = s->n_cache_chunk_hits;
+
+        p->seed_requests = ca_sync_get_seed_requests(s, &v) >= 0 ? v : 0;
+        p->seed_request_bytes = ca_sync_get_seed_request_bytes(s, &v) >= 0 ? v : 0;
+        p->local_requests = ca_sync_get_local_requests(s, &v) >= 0 ? v : 0;
+        p->local_request_bytes = ca_sync_get_local_request_bytes(s, &v) >= 0 ? v : 0;
+        p->remote_requests = ca_sync_get_remote_requests(s, &v) >= 0 ? v : 0;
+        p->remote_request_bytes = ca_sync_get_remote_request_bytes(s, &v) >= 0 ? v : 0;
+
+        p->punch_holes_bytes = ca_sync_get_punch_holes_bytes(s, &v) >= 0 ? v : 0;
+        p->reflink_bytes = ca_sync_get_reflink_bytes(s, &v) >= 0 ? v : 0;
+        p->hardlink_bytes = ca_sync_get_hardlink_bytes(s, &v) >= 0 ? v : 0;
+
+        /* Project the remaining time from the average rate so far. Floating point sidesteps the overflow
+         * that elapsed × remaining would hit on large archives. */
+        if (p->archive_size != UINT64_MAX &&
+            p->archive_offset > 0 &&
+            p->archive_offset <= p->archive_size &&
+            t > s->stats_start_nsec)
+                p->eta_nsec = (uint64_t) ((double) (t - s->stats_start_nsec) *
+                                          (p->archive_size - p->archive_offset) / p->archive_offset);
+        else
+                p->eta_nsec = UINT64_MAX;
+
+        __atomic_thread_fence(__ATOMIC_ACQ_REL);
+        __atomic_store_n(&p->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+int ca_sync_step(CaSync *s) {
+        int r;
+
+        if (!s)
+                return -EINVAL;
+
+        r = ca_sync_step_dispatch(s);
+        ca_sync_update_stats(s, r);
+
+        return r;
+}
+
+int ca_sync_set_stats_path(CaSync *s, const char *path) {
+        CaSyncStats *p;
+        int fd, r;
+
+        if (!s)
+                return -EINVAL;
+        if (isempty(path))
+                return -EINVAL;
+        if (s->stats)
+                return -EBUSY;
+
+        fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC|O_NOCTTY, 0644);
+        if (fd < 0)
+                return -errno;
+
+        if (ftruncate(fd, sizeof(CaSyncStats)) < 0) {
+                r = -errno;
+                safe_close(fd);
+                return r;
+        }
+
+        p = mmap(NULL, sizeof(CaSyncStats), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        safe_close(fd); /* the mapping keeps the file alive */
+        if (p == MAP_FAILED)
+                return -errno;
+
+        /* Fill in the header before publishing the magic, so that a reader that sees the magic sees a
+         * valid block */
+        p->version = CA_SYNC_STATS_VERSION;
+        p->seq = 0;
+        p->eta_nsec = UINT64_MAX;
+        p->archive_size = UINT64_MAX;
+        __atomic_store_n(&p->magic, CA_SYNC_STATS_MAGIC, __ATOMIC_RELEASE);
+
+        s->stats = p;
+        return 0;
+}
+
+int ca_sync_set_since_index_path(CaSync *s, const char *path) {
+        char *p;
+
+        if (!s)
+                return -EINVAL;
+        if (isempty(path))
+                return -EINVAL;
+        if (s->since_index_path)
+                return -EBUSY;
+
+        p = strdup(path);
+        if (!p)
+                return -ENOMEM;
+
+        s->since_index_path = p;
+        return 0;
+}
+
+static uint64_t ca_sync_chunk_id_prefix(const CaChunkID *id) {
+        uint64_t v;
+
+        memcpy(&v, id, sizeof(v));
+        return v;
+}
+
+static void ca_sync_seed_index_insert(
+                CaSyncSeedIndexEntry *table,
+                size_t n_buckets,
+                uint64_t prefix,
+                uint32_t bit,
+                size_t *n_entries) {
+
+        size_t b;
+
+        for (b = prefix & (n_buckets - 1); ; b = (b + 1) & (n_buckets - 1)) {
+
+                if (table[b].mask == 0) {
+                        table[b].prefix = prefix;
+                        table[b].mask = bit;
+                        (*n_entries)++;
+                        return;
+                }
+
+                if (table[b].prefix == prefix) {
+                        table[b].mask |= bit;
+                        return;
+                }
+        }
+}
+
+static int ca_sync_build_seed_index(CaSync *s) {
+        CaSyncSeedIndexEntry *table;
+        size_t n_buckets = 4096, n_entries = 0, i;
+        int r;
+
+        assert(s);
+
+        /* Builds a single hash table mapping chunk ID prefixes to the seeds that carry the chunk, so that
+         * chunk lookup costs one probe instead of one cache access per seed. Construction has to wait until
+         * all seeds finished scanning, as only then their caches are complete; and failure to build the
+         * index is never an error, it merely leaves lookups scanning the seeds one after the other, as
+         * before. */
+
+        if (s->seed_index_built)
+                return 0;
+
+        if (!ca_sync_seed_ready(s))
+                return 0;
+
+        s->seed_index_built = true;
+
+        if (s->n_seeds < 2 || s->n_seeds > CA_SYNC_SEED_INDEX_MAX_SEEDS)
+                return 0;
+
+        table = new0(CaSyncSeedIndexEntry, n_buckets);
+        if (!table)
+                return 0;
 
-static int ca_sync_propagate_flags_to_remotes(CaSync *s, uint64_t flags) {
-        CaDigestType dtype;
-        size_t i;
-        int r;
+        for (i = 0; i < s->n_seeds; i++) {
+                for (;;) {
+                        CaChunkID id;
 
-        dtype = ca_feature_flags_to_digest_type(flags);
-        if (dtype < 0)
-                return -EINVAL;
+                        r = ca_seed_enumerate_cached_chunks(s->seeds[i], &id);
+                        if (r == 0)
+                                break;
+                        if (r < 0) {
+                                /* Can't enumerate this seed? Then always include it in the candidate set. */
+                                s->seed_always_mask |= UINT32_C(1) << i;
+                                break;
+                        }
 
-        if (s->remote_archive) {
-                r = ca_remote_set_digest_type(s->remote_archive, dtype);
-                if (r < 0)
-                        return r;
-        }
+                        /* Grow when the table is at 75% load */
+                        if ((n_entries + 1) * 4 >= n_buckets * 3) {
+                                CaSyncSeedIndexEntry *enlarged;
+                                size_t m, b;
 
-        if (s->remote_index) {
-                r = ca_remote_set_digest_type(s->remote_index, dtype);
-                if (r < 0)
-                        return r;
-        }
+                                m = n_buckets * 2;
+                                enlarged = new0(CaSyncSeedIndexEntry, m);
+                                if (!enlarged) {
+                                        free(table);
+                                        return 0;
+                                }
 
-        if (s->remote_wstore) {
-                r = ca_remote_set_digest_type(s->remote_wstore, dtype);
-                if (r < 0)
-                        return r;
-        }
+                                n_entries = 0;
+                                for (b = 0; b < n_buckets; b++)
+                                        if (table[b].mask != 0)
+                                                ca_sync_seed_index_insert(enlarged, m, table[b].prefix, table[b].mask, &n_entries);
 
-        for (i = 0; i < s->n_remote_rstores; i++) {
-                r = ca_remote_set_digest_type(s->remote_rstores[i], dtype);
-                if (r < 0)
-                        return r;
+                                free(table);
+                                table = enlarged;
+                                n_buckets = m;
+                        }
+
+                        ca_sync_seed_index_insert(table, n_buckets, ca_sync_chunk_id_prefix(&id), UINT32_C(1) << i, &n_entries);
+                }
         }
 
+        s->seed_index = table;
+        s->seed_index_buckets = n_buckets;
+        s->seed_index_entries = n_entries;
+
         return 0;
 }
 
-static int ca_sync_propagate_flags_to_decoder(CaSync *s, uint64_t flags) {
+static uint32_t ca_sync_get_seed_mask(CaSync *s, const CaChunkID *chunk_id) {
+        uint64_t prefix;
+        size_t b;
+
         assert(s);
+        assert(chunk_id);
 
-        if (!s->decoder)
-                return 0;
+        /* Returns the set of seeds worth asking for the specified chunk, as a bitmask by seed number */
 
-        return ca_decoder_set_expected_feature_flags(s->decoder, flags);
-}
+        (void) ca_sync_build_seed_index(s);
 
-static int ca_sync_propagate_index_flags(CaSync *s) {
-        size_t cmin, cavg, cmax;
-        uint64_t flags;
-        int r;
+        if (!s->seed_index)
+                return UINT32_MAX;
 
-        assert(s);
+        prefix = ca_sync_chunk_id_prefix(chunk_id);
 
-        /* If we read the header of the index file, make sure to propagate the flags and chunk size stored in it to the
-         * seeds and remotes. */
+        for (b = prefix & (s->seed_index_buckets - 1); ; b = (b + 1) & (s->seed_index_buckets - 1)) {
 
-        if (s->direction != CA_SYNC_DECODE)
-                return CA_SYNC_POLL;
+                if (s->seed_index[b].mask == 0)
+                        return s->seed_always_mask;
 
-        if (!s->index || s->index_flags_propagated) /* The flags/chunk size is already propagated */
-                return CA_SYNC_POLL;
+                if (s->seed_index[b].prefix == prefix)
+                        return s->seed_index[b].mask | s->seed_always_mask;
+        }
+}
 
-        r = ca_index_get_feature_flags(s->index, &flags);
-        if (r == -ENODATA) /* haven't read enough from the index header yet, let's wait */
-                return CA_SYNC_POLL;
+static int ca_sync_compare_chunk_ids(const void *a, const void *b) {
+        return memcmp(a, b, sizeof(CaChunkID));
+}
 
-        r = ca_index_get_chunk_size_min(s->index, &cmin);
-        if (r < 0)
-                return r;
+static int ca_sync_load_since_index(CaSync *s) {
+        CaIndex *index = NULL;
+        CaChunkID *ids = NULL;
+        size_t n = 0, allocated = 0;
+        int r;
 
-        r = ca_index_get_chunk_size_avg(s->index, &cavg);
-        if (r < 0)
-                return r;
+        assert(s);
 
-        r = ca_index_get_chunk_size_max(s->index, &cmax);
-        if (r < 0)
-                return r;
+        /* Loads the chunk set of the index the previously installed version was provisioned from. With it
+         * loaded, chunk lookup can classify each chunk up-front: chunks the old version didn't reference
+         * cannot be in any seed or local store, hence they skip the local probing and go straight to the
+         * remote. */
 
-        r = ca_sync_propagate_flags_to_stores(s, flags);
-        if (r < 0)
-                return r;
+        if (!s->since_index_path || s->since_index_loaded)
+                return 0;
 
-        r = ca_sync_propagate_flags_to_seeds(s, flags, cmin, cavg, cmax);
-        if (r < 0)
-                return r;
+        s->since_index_loaded = true;
 
-        r = ca_sync_propagate_flags_to_remotes(s, flags);
-        if (r < 0)
-                return r;
+        index = ca_index_new_read();
+        if (!index)
+                return -ENOMEM;
 
-        r = ca_sync_propagate_flags_to_decoder(s, flags);
+        r = ca_index_set_path(index, s->since_index_path);
         if (r < 0)
-                return r;
-
-        s->index_flags_propagated = true;
-        return CA_SYNC_STEP;
-}
+                goto fail;
 
-int ca_sync_step(CaSync *s) {
-        int r;
+        r = ca_index_open(index);
+        if (r < 0)
+                goto fail;
 
-        if (!s)
-                return -EINVAL;
+        for (;;) {
+                CaChunkID id;
 
-        r = ca_sync_start(s);
-        if (r < 0)
-                return r;
+                r = ca_index_read_chunk(index, &id, NULL, NULL);
+                if (r == 0)
+                        break;
+                if (r < 0)
+                        goto fail;
 
-        r = ca_sync_propagate_index_flags(s);
-        if (r != CA_SYNC_POLL)
-                return r;
+                if (!GREEDY_REALLOC(ids, allocated, n + 1)) {
+                        r = -ENOMEM;
+                        goto fail;
+                }
 
-        r = ca_sync_seed_step(s);
-        if (r != CA_SYNC_POLL)
-                return r;
+                ids[n++] = id;
+        }
 
-        r = ca_sync_remote_prefetch(s);
-        if (r != CA_SYNC_POLL)
-                return r;
+        qsort(ids, n, sizeof(CaChunkID), ca_sync_compare_chunk_ids);
 
-        r = ca_sync_remote_push_index(s);
-        if (r != CA_SYNC_POLL)
-                return r;
+        s->since_ids = ids;
+        s->n_since_ids = n;
 
-        r = ca_sync_remote_push_chunk(s);
-        if (r != CA_SYNC_POLL)
-                return r;
+        ca_index_unref(index);
+        return 1;
 
-        /* Try to decode as much as we already have received, before accepting new remote data */
-        r = ca_sync_step_decode(s);
-        if (r != CA_SYNC_POLL)
-                return r;
+fail:
+        free(ids);
+        ca_index_unref(index);
+        return r;
+}
 
-        /* Then process any remote traffic and flush our own buffers */
-        r = ca_sync_remote_step(s);
-        if (r != CA_SYNC_POLL)
-                return r;
+static bool ca_sync_since_contains(CaSync *s, const CaChunkID *chunk_id) {
+        assert(s);
+        assert(chunk_id);
 
-        /* Finally, generate new data */
-        return ca_sync_step_encode(s);
+        return bsearch(chunk_id, s->since_ids, s->n_since_ids, sizeof(CaChunkID), ca_sync_compare_chunk_ids);
 }
 
 int ca_sync_get_local(
@@ -2639,6 +5414,9 @@ int ca_sync_get_local(
                 CaChunkCompression *ret_effective_compression,
                 CaOrigin **ret_origin) {
 
+        bool skip_local = false;
+        uint32_t seed_mask = 0;
+        uint64_t t;
         size_t i;
         int r;
 
@@ -2651,12 +5429,30 @@ int ca_sync_get_local(
         if (!ret_size)
                 return -EINVAL;
 
-        for (i = 0; i < s->n_seeds; i++) {
+        r = ca_sync_load_since_index(s);
+        if (r < 0)
+                return r;
+
+        /* Chunks absent from the previous version's index cannot have ended up in any seed or local
+         * store, hence don't stat for them there. The in-memory cache and inline chunks are still
+         * consulted, as both may carry chunks that never touched the disk. */
+        skip_local = s->since_ids && !ca_sync_since_contains(s, chunk_id);
+
+        if (!skip_local && s->n_seeds > 0)
+                seed_mask = ca_sync_get_seed_mask(s, chunk_id);
+
+        for (i = 0; !skip_local && i < s->n_seeds; i++) {
                 CaOrigin *origin = NULL;
                 const void *p;
                 size_t l;
 
+                if (i < CA_SYNC_SEED_INDEX_MAX_SEEDS && !(seed_mask & (UINT32_C(1) << i)))
+                        continue;
+
+                t = ca_profile_begin(&s->profile);
                 r = ca_seed_get(s->seeds[i], chunk_id, &p, &l, ret_origin ? &origin : NULL);
+                ca_profile_end(&s->profile, CA_PROFILE_SEED_GET, t, r >= 0 ? l : 0);
+
                 if (r == -ESTALE) {
                         fprintf(stderr, "Chunk cache is not up-to-date, ignoring.\n");
                         continue;
@@ -2697,9 +5493,77 @@ int ca_sync_get_local(
                 return r;
         }
 
+        /* Consult the in-memory chunk cache before the stores. Seeds come first, as they also provide
+         * origin information the cache doesn't keep. */
+        if (desired_compression != CA_CHUNK_COMPRESSED) {
+                CaSyncCachedChunk *cached;
+
+                cached = ca_sync_chunk_cache_find(s, chunk_id);
+                if (cached) {
+                        *ret = cached->data;
+                        *ret_size = cached->size;
+
+                        if (ret_effective_compression)
+                                *ret_effective_compression = CA_CHUNK_UNCOMPRESSED;
+                        if (ret_origin)
+                                *ret_origin = NULL;
+
+                        return 0;
+                }
+        }
+
+        /* Tiny chunks may travel inside the index file itself, see CA_FORMAT_INLINE_CHUNKS */
+        if (s->index) {
+                const void *p;
+                uint64_t l;
+
+                r = ca_index_get_inline_chunk(s->index, chunk_id, &p, &l);
+                if (r >= 0) {
+
+                        if (desired_compression == CA_CHUNK_UNCOMPRESSED) {
+                                realloc_buffer_empty(&s->compress_buffer);
+
+                                r = ca_decompress(p, l, &s->compress_buffer);
+                                if (r < 0)
+                                        return r;
+
+                                *ret = realloc_buffer_data(&s->compress_buffer);
+                                *ret_size = realloc_buffer_size(&s->compress_buffer);
+
+                                if (ret_effective_compression)
+                                        *ret_effective_compression = CA_CHUNK_UNCOMPRESSED;
+                        } else {
+                                *ret = p;
+                                *ret_size = l;
+
+                                if (ret_effective_compression)
+                                        *ret_effective_compression = CA_CHUNK_COMPRESSED;
+                        }
+
+                        if (ret_origin)
+                                *ret_origin = NULL;
+
+                        return 0;
+                }
+                if (!IN_SET(r, -ENOENT, -ENODATA, -ENOTTY))
+                        return r;
+        }
+
+        if (skip_local)
+                return -ENOENT;
+
         if (s->wstore) {
-                r = ca_store_get(s->wstore, chunk_id, desired_compression, ret, ret_size, ret_effective_compression);
+                CaChunkCompression effective;
+
+                t = ca_profile_begin(&s->profile);
+                r = ca_store_get(s->wstore, chunk_id, desired_compression, ret, ret_size, &effective);
+                ca_profile_end(&s->profile, CA_PROFILE_STORE_GET, t, r >= 0 ? *ret_size : 0);
+
                 if (r >= 0) {
+                        if (effective == CA_CHUNK_UNCOMPRESSED)
+                                ca_sync_chunk_cache_put(s, chunk_id, *ret, *ret_size);
+                        if (ret_effective_compression)
+                                *ret_effective_compression = effective;
                         if (ret_origin)
                                 *ret_origin = NULL;
                         return r;
@@ -2709,8 +5573,17 @@ int ca_sync_get_local(
         }
 
         if (s->cache_store) {
-                r = ca_store_get(s->cache_store, chunk_id, desired_compression, ret, ret_size, ret_effective_compression);
+                CaChunkCompression effective;
+
+                t = ca_profile_begin(&s->profile);
+                r = ca_store_get(s->cache_store, chunk_id, desired_compression, ret, ret_size, &effective);
+                ca_profile_end(&s->profile, CA_PROFILE_STORE_GET, t, r >= 0 ? *ret_size : 0);
+
                 if (r >= 0) {
+                        if (effective == CA_CHUNK_UNCOMPRESSED)
+                                ca_sync_chunk_cache_put(s, chunk_id, *ret, *ret_size);
+                        if (ret_effective_compression)
+                                *ret_effective_compression = effective;
                         if (ret_origin)
                                 *ret_origin = NULL;
                         return r;
@@ -2720,8 +5593,25 @@ int ca_sync_get_local(
         }
 
         for (i = 0; i < s->n_rstores; i++) {
-                r = ca_store_get(s->rstores[i], chunk_id, desired_compression, ret, ret_size, ret_effective_compression);
+                CaChunkCompression effective;
+
+                t = ca_profile_begin(&s->profile);
+                r = ca_store_get(s->rstores[i], chunk_id, desired_compression, ret, ret_size, &effective);
+                ca_profile_end(&s->profile, CA_PROFILE_STORE_GET, t, r >= 0 ? *ret_size : 0);
+
                 if (r >= 0) {
+                        /* Bubble the store that served us up one position, so that stores which keep
+                         * producing hits are probed before those which keep missing */
+                        if (i > 0) {
+                                CaStore *swap = s->rstores[i-1];
+                                s->rstores[i-1] = s->rstores[i];
+                                s->rstores[i] = swap;
+                        }
+
+                        if (effective == CA_CHUNK_UNCOMPRESSED)
+                                ca_sync_chunk_cache_put(s, chunk_id, *ret, *ret_size);
+                        if (ret_effective_compression)
+                                *ret_effective_compression = effective;
                         if (ret_origin)
                                 *ret_origin = NULL;
                         return r;
@@ -2757,9 +5647,22 @@ int ca_sync_get(CaSync *s,
         if (r != -ENOENT)
                 return r;
 
-        if (s->remote_wstore) {
-                r = ca_remote_request(s->remote_wstore, chunk_id, true, desired_compression, ret, ret_size, ret_effective_compression);
+        if (s->remote_wstore &&
+            ca_remote_test_bloom(s->remote_wstore, chunk_id) != 0) { /* Skip the round trip if the peer's
+                                                                     * bloom filter rules the chunk out */
+                CaChunkCompression effective;
+
+                r = ca_remote_request(s->remote_wstore, chunk_id, CA_REMOTE_PRIORITY_INTERACTIVE, desired_compression, ret, ret_size, &effective);
                 if (r >= 0) {
+                        /* Write remotely fetched chunks back into the local store, if there is one, so
+                         * that the next operation on this host finds them without the round-trip */
+                        if (s->wstore)
+                                (void) ca_store_put(s->wstore, chunk_id, effective, *ret, *ret_size);
+
+                        if (effective == CA_CHUNK_UNCOMPRESSED)
+                                ca_sync_chunk_cache_put(s, chunk_id, *ret, *ret_size);
+                        if (ret_effective_compression)
+                                *ret_effective_compression = effective;
                         if (ret_origin)
                                 *ret_origin = NULL;
                         return r;
@@ -2769,8 +5672,27 @@ int ca_sync_get(CaSync *s,
         }
 
         for (i = 0; i < s->n_remote_rstores; i++) {
-                r = ca_remote_request(s->remote_rstores[i], chunk_id, true, desired_compression, ret, ret_size, ret_effective_compression);
+                CaChunkCompression effective;
+
+                if (ca_remote_test_bloom(s->remote_rstores[i], chunk_id) == 0)
+                        continue;
+
+                r = ca_remote_request(s->remote_rstores[i], chunk_id, CA_REMOTE_PRIORITY_INTERACTIVE, desired_compression, ret, ret_size, &effective);
                 if (r >= 0) {
+                        /* As above, move remotes that keep serving hits to the front of the probe order */
+                        if (i > 0) {
+                                CaRemote *swap = s->remote_rstores[i-1];
+                                s->remote_rstores[i-1] = s->remote_rstores[i];
+                                s->remote_rstores[i] = swap;
+                        }
+
+                        if (s->wstore)
+                                (void) ca_store_put(s->wstore, chunk_id, effective, *ret, *ret_size);
+
+                        if (effective == CA_CHUNK_UNCOMPRESSED)
+                                ca_sync_chunk_cache_put(s, chunk_id, *ret, *ret_size);
+                        if (ret_effective_compression)
+                                *ret_effective_compression = effective;
                         if (ret_origin)
                                 *ret_origin = NULL;
                         return r;
@@ -2784,6 +5706,8 @@ int ca_sync_get(CaSync *s,
 
 int ca_sync_has_local(CaSync *s, const CaChunkID *chunk_id) {
 
+        bool skip_local = false;
+        uint32_t seed_mask = 0;
         size_t i;
         int r;
 
@@ -2792,12 +5716,36 @@ int ca_sync_has_local(CaSync *s, const CaChunkID *chunk_id) {
         if (!chunk_id)
                 return -EINVAL;
 
-        for (i = 0; i < s->n_seeds; i++) {
+        r = ca_sync_load_since_index(s);
+        if (r < 0)
+                return r;
+
+        /* See ca_sync_get_local() for the rationale of the since-index short-cut */
+        skip_local = s->since_ids && !ca_sync_since_contains(s, chunk_id);
+
+        if (!skip_local && s->n_seeds > 0)
+                seed_mask = ca_sync_get_seed_mask(s, chunk_id);
+
+        for (i = 0; !skip_local && i < s->n_seeds; i++) {
+                if (i < CA_SYNC_SEED_INDEX_MAX_SEEDS && !(seed_mask & (UINT32_C(1) << i)))
+                        continue;
+
                 r = ca_seed_has(s->seeds[i], chunk_id);
                 if (r != 0)
                         return r;
         }
 
+        if (s->index) {
+                const void *p;
+                uint64_t l;
+
+                if (ca_index_get_inline_chunk(s->index, chunk_id, &p, &l) >= 0)
+                        return 1;
+        }
+
+        if (skip_local)
+                return 0;
+
         if (s->wstore) {
                 r = ca_store_has(s->wstore, chunk_id);
                 if (r != 0)
@@ -2820,6 +5768,7 @@ int ca_sync_has_local(CaSync *s, const CaChunkID *chunk_id) {
 }
 
 int ca_sync_make_chunk_id(CaSync *s, const void *p, size_t l, CaChunkID *ret) {
+        uint64_t t;
         int r;
 
         if (!s)
@@ -2835,7 +5784,11 @@ int ca_sync_make_chunk_id(CaSync *s, const void *p, size_t l, CaChunkID *ret) {
                         return r;
         }
 
-        return ca_chunk_id_make(s->chunk_digest, p, l, ret);
+        t = ca_profile_begin(&s->profile);
+        r = ca_sync_make_chunk_id_cached(s, s->chunk_digest, p, l, ret);
+        ca_profile_end(&s->profile, CA_PROFILE_DIGEST, t, l);
+
+        return r;
 }
 
 int ca_sync_get_archive_digest(CaSync *s, CaChunkID *ret) {
@@ -2847,6 +5800,11 @@ int ca_sync_get_archive_digest(CaSync *s, CaChunkID *ret) {
         if (!s->archive_digest)
                 return -ENOMEDIUM;
 
+        /* Chunks served from the chunking cache never pass through the encoder, hence its digest doesn't
+         * cover the full archive */
+        if (s->n_cache_chunk_hits > 0)
+                return -ENODATA;
+
         if (s->direction == CA_SYNC_ENCODE && s->encoder)
                 return ca_encoder_get_archive_digest(s->encoder, ret);
         if (s->direction == CA_SYNC_DECODE && s->decoder)
@@ -3173,6 +6131,7 @@ static int ca_sync_add_pollfd(CaRemote *rr, struct pollfd *pollfd) {
 int ca_sync_poll(CaSync *s, uint64_t timeout_nsec, const sigset_t *ss) {
         struct pollfd *pollfd;
         size_t i, n = 0, n_pollfd;
+        uint64_t t;
         int r;
 
         if (!s)
@@ -3212,6 +6171,8 @@ int ca_sync_poll(CaSync *s, uint64_t timeout_nsec, const sigset_t *ss) {
         }
         assert_se(n == n_pollfd);
 
+        t = ca_profile_begin(&s->profile);
+
         if (timeout_nsec != UINT64_MAX) {
                 struct timespec ts;
 
@@ -3223,6 +6184,8 @@ int ca_sync_poll(CaSync *s, uint64_t timeout_nsec, const sigset_t *ss) {
         if (r < 0)
                 return -errno;
 
+        ca_profile_end(&s->profile, CA_PROFILE_POLL, t, 0);
+
         return n;
 }
 
@@ -3793,3 +6756,54 @@ int ca_sync_set_compression_type(CaSync *s, CaCompressionType compression) {
         s->compression_type = compression;
         return 0;
 }
+
+int ca_sync_set_cache_path(CaSync *s, const char *path) {
+        int r;
+
+        if (!s)
+                return -EINVAL;
+        if (isempty(path))
+                return -EINVAL;
+        if (s->direction != CA_SYNC_ENCODE)
+                return -ENOTTY;
+        if (s->started)
+                return -EBUSY;
+        if (s->cache)
+                return -EBUSY;
+
+        s->cache = ca_cache_new();
+        if (!s->cache)
+                return -ENOMEM;
+
+        r = ca_cache_set_path(s->cache, path);
+        if (r < 0) {
+                s->cache = ca_cache_unref(s->cache);
+                return r;
+        }
+
+        return 0;
+}
+
+int ca_sync_current_cache_hits(CaSync *s, uint64_t *ret) {
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+        if (!s->cache)
+                return -ENODATA;
+
+        *ret = s->n_cache_chunk_hits;
+        return 0;
+}
+
+int ca_sync_set_compression_level(CaSync *s, int level) {
+        if (!s)
+                return -EINVAL;
+        if (level < CA_COMPRESSION_LEVEL_AUTO)
+                return -EINVAL;
+        if (s->started)
+                return -EBUSY;
+
+        s->compression_level = level;
+        return 0;
+}
@@ -5,9 +5,11 @@
 #include <signal.h>
 
 #include "cachunk.h"
+#include "cachunker.h"
 #include "cachunkid.h"
 #include "cacommon.h"
 #include "caorigin.h"
+#include "caprofile.h"
 
 typedef struct CaSync CaSync;
 
@@ -29,6 +31,51 @@ CaSync *ca_sync_new_decode(void);
 CaSync *ca_sync_unref(CaSync *sync);
 
 int ca_sync_set_rate_limit_bps(CaSync *s, uint64_t rate_limit_bps);
+int ca_sync_set_rate_limit_burst(CaSync *s, uint64_t burst_bytes);
+
+int ca_sync_set_threads(CaSync *s, size_t n_threads);
+
+/* Binary statistics block exported via ca_sync_set_stats_path(): an mmap'd file that is updated wait-free
+ * once per ca_sync_step() iteration, so that external monitoring can poll transfer progress without
+ * parsing log output or perturbing the hot path. Fields are in native endianness, the file is only
+ * meaningful on the machine that writes it. 'seq' is a seqlock counter, odd while an update is in
+ * flight: readers retry until they see the same even value before and after copying the block. */
+typedef struct CaSyncStats {
+        uint64_t magic;                /* CA_SYNC_STATS_MAGIC, stored last during initialization */
+        uint64_t version;
+        uint64_t seq;
+        uint64_t phase;                /* most recent ca_sync_step() return code */
+        uint64_t start_nsec;           /* CLOCK_MONOTONIC timestamp of the first step */
+        uint64_t updated_nsec;         /* CLOCK_MONOTONIC timestamp of the last update */
+        uint64_t eta_nsec;             /* projected remaining time, UINT64_MAX if unknown */
+        uint64_t archive_size;         /* UINT64_MAX if unknown */
+        uint64_t archive_offset;
+        uint64_t n_chunks;
+        uint64_t n_reused_chunks;
+        uint64_t n_cache_hits;
+        uint64_t seed_requests;
+        uint64_t seed_request_bytes;
+        uint64_t local_requests;
+        uint64_t local_request_bytes;
+        uint64_t remote_requests;
+        uint64_t remote_request_bytes;
+        uint64_t punch_holes_bytes;
+        uint64_t reflink_bytes;
+        uint64_t hardlink_bytes;
+} CaSyncStats;
+
+#define CA_SYNC_STATS_MAGIC UINT64_C(0x6353d9a1c8f47b02)
+#define CA_SYNC_STATS_VERSION UINT64_C(1)
+
+int ca_sync_set_stats_path(CaSync *s, const char *path);
+int ca_sync_set_chunk_cache_bytes(CaSync *s, uint64_t bytes);
+
+/* Pool the in-memory chunk cache of multiple concurrent operations within one process: chunks one
+ * operation fetched are reused by the others, and the shared request window is divided fairly among the
+ * group. All members must be driven from the same thread. */
+int ca_sync_share_chunk_cache(CaSync *s, CaSync *from);
+int ca_sync_set_buffer_budget(CaSync *s, uint64_t bytes);
+int ca_sync_set_memory_limit(CaSync *s, uint64_t bytes); /* process-wide, 0 → unbounded */
 
 int ca_sync_set_feature_flags(CaSync *s, uint64_t flags);
 int ca_sync_get_feature_flags(CaSync *s, uint64_t *ret);
@@ -37,12 +84,16 @@ int ca_sync_set_feature_flags_mask(CaSync *s, uint64_t mask);
 int ca_sync_get_covering_feature_flags(CaSync *s, uint64_t *ret);
 
 int ca_sync_set_punch_holes(CaSync *s, bool enabled);
+int ca_sync_set_direct_io(CaSync *s, bool enabled);
+int ca_sync_set_sync_mode(CaSync *s, CaSyncMode mode);
+int ca_sync_set_pack_mode(CaSync *s, bool b);
 int ca_sync_set_reflink(CaSync *s, bool enabled);
 int ca_sync_set_hardlink(CaSync *s, bool enabled);
 int ca_sync_set_delete(CaSync *s, bool enabled);
 int ca_sync_set_payload(CaSync *s, bool enabled);
 int ca_sync_set_undo_immutable(CaSync *s, bool enabled);
 int ca_sync_set_compression_type(CaSync *s, CaCompressionType compression);
+int ca_sync_set_compression_level(CaSync *s, int level);
 
 int ca_sync_set_uid_shift(CaSync *s, uid_t uid);
 int ca_sync_set_uid_range(CaSync *s, uid_t uid);
@@ -77,6 +128,8 @@ int ca_sync_set_store_remote(CaSync *sync, const char *url);
 int ca_sync_set_store_auto(CaSync *s, const char *locator);
 
 /* Additional stores to use */
+int ca_sync_set_cache_path(CaSync *s, const char *path);
+
 int ca_sync_add_store_path(CaSync *sync, const char *path);
 int ca_sync_add_store_remote(CaSync *sync, const char *url);
 int ca_sync_add_store_auto(CaSync *sync, const char *locator);
@@ -85,6 +138,11 @@ int ca_sync_add_store_auto(CaSync *sync, const char *locator);
 int ca_sync_add_seed_fd(CaSync *sync, int fd);
 int ca_sync_add_seed_path(CaSync *sync, const char *path);
 
+/* The index of the previously installed version, for delta pulls: chunks it doesn't list cannot be
+ * available locally, hence lookup skips the per-chunk seed and store probing for them and requests them
+ * remotely right away. */
+int ca_sync_set_since_index_path(CaSync *sync, const char *path);
+
 int ca_sync_step(CaSync *sync);
 int ca_sync_poll(CaSync *s, uint64_t timeout_nsec, const sigset_t *ss);
 
@@ -115,12 +173,15 @@ int ca_sync_set_chunk_size_min(CaSync *s, uint64_t v);
 int ca_sync_set_chunk_size_avg(CaSync *s, uint64_t v);
 int ca_sync_set_chunk_size_max(CaSync *s, uint64_t v);
 
+int ca_sync_set_chunker_algorithm(CaSync *s, CaChunkerAlgorithm a);
+
 int ca_sync_get_chunk_size_avg(CaSync *s, uint64_t *ret);
 int ca_sync_get_chunk_size_min(CaSync *s, uint64_t *ret);
 int ca_sync_get_chunk_size_max(CaSync *s, uint64_t *ret);
 
 int ca_sync_current_archive_chunks(CaSync *s, uint64_t *ret);
 int ca_sync_current_archive_reused_chunks(CaSync *s, uint64_t *ret);
+int ca_sync_current_cache_hits(CaSync *s, uint64_t *ret);
 int ca_sync_current_archive_offset(CaSync *s, uint64_t *ret);
 
 int ca_sync_seek_offset(CaSync *s, uint64_t offset);
@@ -149,4 +210,7 @@ int ca_sync_get_local_request_bytes(CaSync *s, uint64_t *ret);
 int ca_sync_get_remote_requests(CaSync *s, uint64_t *ret);
 int ca_sync_get_remote_request_bytes(CaSync *s, uint64_t *ret);
 
+int ca_sync_set_profile(CaSync *s, bool b);
+int ca_sync_get_profile(CaSync *s, const CaProfile **ret);
+
 #endif
@@ -1,3 +1,5 @@
+#include <math.h>
+
 #include "compressor.h"
 #include "util.h"
 
@@ -7,6 +9,58 @@
 /* #undef EBADMSG */
 /* #define EBADMSG __LINE__ */
 
+/* An optional zstd dictionary, shared by all contexts of the process. With small chunks every compression
+ * context starts cold, which costs a lot of ratio; a dictionary trained on representative chunks gets most
+ * of it back. The digested forms below are immutable after creation and safe for concurrent use, hence a
+ * single copy serves all worker threads. */
+static ZSTD_CDict *zstd_cdict = NULL;
+static ZSTD_DDict *zstd_ddict = NULL;
+
+/* Creating a zstd context allocates and wires up a sizable workspace, which is pure overhead when it
+ * happens once per chunk, millions of times per sync. Hence cache one context of each kind per thread and
+ * reuse it: (re)initialization of an existing context just resets the workspace. The cache is per thread so
+ * no locking is needed; the worker threads live for the whole sync, so the one context a thread still holds
+ * when it exits is lost, which is bounded and harmless. The lzma and zlib streams are embedded in the
+ * CompressorContext by value and their re-initialization is cheap, hence they are not pooled. */
+/* Window size for the long-distance matching mode: 64M covers typical disk-image chunk sizes whole and
+ * stays below zstd's default decoder window limit, so any peer can decode the frames */
+#define COMPRESSOR_ZSTD_LDM_WINDOW_LOG 26
+
+static __thread ZSTD_CStream *zstd_cstream_cache = NULL;
+static __thread ZSTD_DStream *zstd_dstream_cache = NULL;
+
+int compressor_load_dictionary(const void *p, size_t size) {
+        ZSTD_CDict *cd;
+        ZSTD_DDict *dd;
+
+        if (!p)
+                return -EINVAL;
+        if (size == 0)
+                return -EINVAL;
+
+        cd = ZSTD_createCDict(p, size, 3);
+        if (!cd)
+                return -ENOMEM;
+
+        dd = ZSTD_createDDict(p, size);
+        if (!dd) {
+                ZSTD_freeCDict(cd);
+                return -ENOMEM;
+        }
+
+        ZSTD_freeCDict(zstd_cdict);
+        ZSTD_freeDDict(zstd_ddict);
+
+        zstd_cdict = cd;
+        zstd_ddict = dd;
+
+        return 0;
+}
+
+bool compressor_has_dictionary(void) {
+        return zstd_cdict && zstd_ddict;
+}
+
 int detect_compression(const void *buffer, size_t size) {
 
         static const uint8_t xz_signature[] = {
@@ -39,6 +93,38 @@ int detect_compression(const void *buffer, size_t size) {
         return -EBADMSG;
 }
 
+int compressor_estimate_entropy(const void *p, size_t size) {
+        unsigned histogram[256] = {};
+        const uint8_t *q = p;
+        size_t n = 0, stride, i;
+        double e = 0;
+
+        if (!p && size > 0)
+                return -EINVAL;
+        if (size == 0)
+                return 0;
+
+        /* A Shannon estimate over a sampled byte histogram. At most 64K bytes are looked at, evenly
+         * spread, so that the estimate stays cheap even for the largest chunks. */
+
+        stride = size > 64U*1024U ? size / (64U*1024U) : 1;
+
+        for (i = 0; i < size; i += stride, n++)
+                histogram[q[i]]++;
+
+        for (i = 0; i < 256; i++) {
+                double f;
+
+                if (histogram[i] == 0)
+                        continue;
+
+                f = (double) histogram[i] / (double) n;
+                e -= f * log2(f);
+        }
+
+        return (int) (e * 100);
+}
+
 int compressor_start_decode(CompressorContext *c, CaCompressionType compressor) {
         int r;
 
@@ -69,11 +155,22 @@ int compressor_start_decode(CompressorContext *c, CaCompressionType compressor)
                 break;
 
         case CA_COMPRESSION_ZSTD:
-                c->zstd.dstream = ZSTD_createDStream();
-                if (!c->zstd.dstream)
-                        return -ENOMEM;
+        case CA_COMPRESSION_ZSTD_LDM:
+                if (zstd_dstream_cache) {
+                        c->zstd.dstream = zstd_dstream_cache;
+                        zstd_dstream_cache = NULL;
+                } else {
+                        c->zstd.dstream = ZSTD_createDStream();
+                        if (!c->zstd.dstream)
+                                return -ENOMEM;
+                }
 
-                ZSTD_initDStream(c->zstd.dstream);
+                /* Frames that were written without the dictionary carry no dictionary ID and decode fine
+                 * with it, hence mixed stores work as long as the dictionary is loaded. */
+                if (zstd_ddict)
+                        ZSTD_initDStream_usingDDict(c->zstd.dstream, zstd_ddict);
+                else
+                        ZSTD_initDStream(c->zstd.dstream);
                 break;
 
         default:
@@ -81,12 +178,23 @@ int compressor_start_decode(CompressorContext *c, CaCompressionType compressor)
         }
 
         c->operation = COMPRESSOR_DECODE;
-        c->compressor = compressor;
+
+        /* Long-distance matching only configures the encoder, the streaming machinery below is plain
+         * zstd either way */
+        c->compressor = ca_compression_type_normalize(compressor);
 
         return 0;
 }
 
 int compressor_start_encode(CompressorContext *c, CaCompressionType compressor) {
+        return compressor_start_encode_full(c, compressor, CA_COMPRESSION_LEVEL_DEFAULT, UINT64_MAX);
+}
+
+int compressor_start_encode_level(CompressorContext *c, CaCompressionType compressor, int level) {
+        return compressor_start_encode_full(c, compressor, level, UINT64_MAX);
+}
+
+int compressor_start_encode_full(CompressorContext *c, CaCompressionType compressor, int level, uint64_t size_hint) {
         int r;
 
         if (!c)
@@ -101,7 +209,10 @@ int compressor_start_encode(CompressorContext *c, CaCompressionType compressor)
         case CA_COMPRESSION_XZ: {
                 lzma_ret xzr;
 
-                xzr = lzma_easy_encoder(&c->xz, LZMA_PRESET_DEFAULT, LZMA_CHECK_CRC64);
+                if (level > 9)
+                        return -EINVAL;
+
+                xzr = lzma_easy_encoder(&c->xz, level < 0 ? LZMA_PRESET_DEFAULT : (uint32_t) level, LZMA_CHECK_CRC64);
                 if (xzr != LZMA_OK)
                         return -EIO;
 
@@ -109,17 +220,68 @@ int compressor_start_encode(CompressorContext *c, CaCompressionType compressor)
         }
 
         case CA_COMPRESSION_GZIP:
-                r = deflateInit2(&c->gzip, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
+                if (level == 0 || level > 9)
+                        return -EINVAL;
+
+                r = deflateInit2(&c->gzip, level < 0 ? Z_DEFAULT_COMPRESSION : level, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
                 if (r != Z_OK)
                         return -EIO;
                 break;
 
         case CA_COMPRESSION_ZSTD:
-                c->zstd.cstream = ZSTD_createCStream();
-                if (!c->zstd.cstream)
-                        return -ENOMEM;
+                if (level == 0 || level > ZSTD_maxCLevel())
+                        return -EINVAL;
+
+                if (zstd_cstream_cache) {
+                        c->zstd.cstream = zstd_cstream_cache;
+                        zstd_cstream_cache = NULL;
+                } else {
+                        c->zstd.cstream = ZSTD_createCStream();
+                        if (!c->zstd.cstream)
+                                return -ENOMEM;
+                }
+
+                /* The dictionary carries the level it was digested with, hence it wins when loaded */
+                if (zstd_cdict)
+                        ZSTD_initCStream_usingCDict(c->zstd.cstream, zstd_cdict);
+                else
+                        ZSTD_initCStream(c->zstd.cstream, level < 0 ? ZSTD_CLEVEL_DEFAULT : level);
+                break;
+
+        case CA_COMPRESSION_ZSTD_LDM:
+                if (level == 0 || level > ZSTD_maxCLevel())
+                        return -EINVAL;
+
+                if (zstd_cstream_cache) {
+                        c->zstd.cstream = zstd_cstream_cache;
+                        zstd_cstream_cache = NULL;
+                } else {
+                        c->zstd.cstream = ZSTD_createCStream();
+                        if (!c->zstd.cstream)
+                                return -ENOMEM;
+                }
+
+#if ZSTD_VERSION_NUMBER >= 10400
+                /* Long-distance matching on top of the regular level, with a window large enough that
+                 * sizable disk-image chunks fit into it whole. Pledging the input size (when the caller
+                 * knows it) lets zstd shrink the declared window for small chunks, so that their frames
+                 * stay cheap to decode. */
+                ZSTD_CCtx_reset(c->zstd.cstream, ZSTD_reset_session_and_parameters);
+                if (ZSTD_isError(ZSTD_CCtx_setParameter(c->zstd.cstream, ZSTD_c_compressionLevel, level < 0 ? ZSTD_CLEVEL_DEFAULT : level)) ||
+                    ZSTD_isError(ZSTD_CCtx_setParameter(c->zstd.cstream, ZSTD_c_enableLongDistanceMatching, 1)) ||
+                    ZSTD_isError(ZSTD_CCtx_setParameter(c->zstd.cstream, ZSTD_c_windowLog, COMPRESSOR_ZSTD_LDM_WINDOW_LOG)))
+                        return -EIO;
+
+                if (size_hint != UINT64_MAX &&
+                    ZSTD_isError(ZSTD_CCtx_setPledgedSrcSize(c->zstd.cstream, size_hint)))
+                        return -EIO;
+#else
+                /* zstd predating the v1.4 advanced API can't enable long-distance matching on a
+                 * stream; fall back to regular frames at the requested level, which remain fully
+                 * compatible, just a bit larger. */
+                ZSTD_initCStream(c->zstd.cstream, level < 0 ? ZSTD_CLEVEL_DEFAULT : level);
+#endif
 
-                ZSTD_initCStream(c->zstd.cstream, 3);
                 break;
 
         default:
@@ -127,7 +289,9 @@ int compressor_start_encode(CompressorContext *c, CaCompressionType compressor)
         }
 
         c->operation = COMPRESSOR_ENCODE;
-        c->compressor = compressor;
+
+        /* See compressor_start_decode() */
+        c->compressor = ca_compression_type_normalize(compressor);
 
         return 0;
 }
@@ -154,11 +318,17 @@ void compressor_finish(CompressorContext *c) {
                 break;
 
         case CA_COMPRESSION_ZSTD:
-                if (c->operation == COMPRESSOR_ENCODE)
-                        ZSTD_freeCStream(c->zstd.cstream);
-                else if (c->operation == COMPRESSOR_DECODE)
-                        ZSTD_freeDStream(c->zstd.dstream);
-                else
+                if (c->operation == COMPRESSOR_ENCODE) {
+                        if (!zstd_cstream_cache)
+                                zstd_cstream_cache = c->zstd.cstream;
+                        else
+                                ZSTD_freeCStream(c->zstd.cstream);
+                } else if (c->operation == COMPRESSOR_DECODE) {
+                        if (!zstd_dstream_cache)
+                                zstd_dstream_cache = c->zstd.dstream;
+                        else
+                                ZSTD_freeDStream(c->zstd.dstream);
+                } else
                         assert_not_reached("Unknown operation.");
 
                 break;
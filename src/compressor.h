@@ -38,6 +38,9 @@ typedef struct CompressorContext {
 
 int compressor_start_decode(CompressorContext *c, CaCompressionType compressor);
 int compressor_start_encode(CompressorContext *c, CaCompressionType compressor);
+int compressor_start_encode_level(CompressorContext *c, CaCompressionType compressor, int level);
+/* size_hint is the number of bytes about to be compressed, or UINT64_MAX if unknown */
+int compressor_start_encode_full(CompressorContext *c, CaCompressionType compressor, int level, uint64_t size_hint);
 void compressor_finish(CompressorContext *c);
 
 int compressor_input(CompressorContext *c, const void *p, size_t sz);
@@ -53,4 +56,10 @@ int compressor_encode(CompressorContext *c, bool finalize, void *p, size_t size,
 
 int detect_compression(const void *buffer, size_t size);
 
+/* Estimates the entropy of a buffer in 1/100th bits per byte (0..800), from a sampled byte histogram */
+int compressor_estimate_entropy(const void *p, size_t size);
+
+int compressor_load_dictionary(const void *p, size_t size);
+bool compressor_has_dictionary(void);
+
 #endif
@@ -1,4 +1,12 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
 #include "copy.h"
+#include "def.h"
+#include "util.h"
 
 #if !HAVE_COPY_FILE_RANGE
 #  ifndef __NR_copy_file_range
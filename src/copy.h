@@ -0,0 +1,8 @@
+#ifndef foocopyhfoo
+#define foocopyhfoo
+
+#include <inttypes.h>
+
+int copy_bytes(int fdf, int fdt, uint64_t max_bytes);
+
+#endif
@@ -1,3 +1,12 @@
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include <linux/fs.h>
+
 #include "fssize.h"
 #include "util.h"
 
@@ -162,3 +171,74 @@ int read_file_system_size(int fd, uint64_t *ret) {
 
         return 0;
 }
+
+static int read_sysfs_queue_attribute(dev_t devnum, const char *attribute, uint64_t *ret) {
+        char path[256], buffer[64];
+        ssize_t n;
+        int fd;
+
+        assert(attribute);
+        assert(ret);
+
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s", major(devnum), minor(devnum), attribute);
+
+        fd = open(path, O_RDONLY|O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        n = read(fd, buffer, sizeof(buffer) - 1);
+        safe_close(fd);
+        if (n < 0)
+                return -errno;
+
+        buffer[n] = 0;
+        truncate_nl(buffer);
+
+        return safe_atou64(buffer, ret);
+}
+
+int probe_file_system_geometry(int fd, CaFsGeometry *ret) {
+        CaFsGeometry g = {};
+        struct statfs sfs;
+        struct stat st;
+
+        assert(fd >= 0);
+        assert(ret);
+
+        /* Determines the I/O geometry of the file system or block device behind the specified fd, so that
+         * callers can align their writes and hole punching to it. Whatever cannot be determined is reported
+         * as zero, failure to probe individual aspects is not an error. */
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        if (S_ISBLK(st.st_mode)) {
+                unsigned u;
+                int ssz;
+
+                if (ioctl(fd, BLKSSZGET, &ssz) >= 0 && ssz > 0 && IS_POWER_OF_TWO(ssz))
+                        g.block_size = (uint64_t) ssz;
+
+                /* The optimal I/O size is the full stripe on RAID arrays, the minimum one the stripe chunk */
+                if (ioctl(fd, BLKIOOPT, &u) >= 0 && u > 0)
+                        g.stripe_size = u;
+                else if (ioctl(fd, BLKIOMIN, &u) >= 0 && u > g.block_size)
+                        g.stripe_size = u;
+
+                (void) read_sysfs_queue_attribute(st.st_rdev, "discard_granularity", &g.discard_granularity);
+        } else {
+                if (fstatfs(fd, &sfs) >= 0 && sfs.f_bsize > 0 && IS_POWER_OF_TWO(sfs.f_bsize))
+                        g.block_size = (uint64_t) sfs.f_bsize;
+
+                /* File systems report their preferred I/O size — typically the stripe width of the array
+                 * they were created on — through st_blksize */
+                if ((uint64_t) st.st_blksize > g.block_size)
+                        g.stripe_size = (uint64_t) st.st_blksize;
+
+                if (major(st.st_dev) > 0)
+                        (void) read_sysfs_queue_attribute(st.st_dev, "discard_granularity", &g.discard_granularity);
+        }
+
+        *ret = g;
+        return 0;
+}
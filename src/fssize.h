@@ -5,4 +5,15 @@
 
 int read_file_system_size(int fd, uint64_t *ret);
 
+/* I/O geometry of an extraction target, as far as it can be determined: the file system's fundamental
+ * block size, the optimal I/O size (i.e. the full RAID stripe on striped arrays) and the discard
+ * granularity of the backing device. Fields that cannot be determined are zero. */
+typedef struct CaFsGeometry {
+        uint64_t block_size;
+        uint64_t stripe_size;
+        uint64_t discard_granularity;
+} CaFsGeometry;
+
+int probe_file_system_geometry(int fd, CaFsGeometry *ret);
+
 #endif
@@ -5,6 +5,42 @@
 #include "realloc-buffer.h"
 #include "util.h"
 
+/* The sum of all ReallocBuffer backing allocations in this process, and the configured budget. Maintained
+ * with relaxed atomics, since the compression workers grow their scratch buffers from their own threads. */
+static uint64_t memory_allocated = 0;
+static uint64_t memory_limit = 0;
+
+static void realloc_buffer_account(size_t from, size_t to) {
+        if (to > from)
+                __atomic_add_fetch(&memory_allocated, to - from, __ATOMIC_RELAXED);
+        else if (from > to)
+                __atomic_sub_fetch(&memory_allocated, from - to, __ATOMIC_RELAXED);
+}
+
+void realloc_buffer_set_memory_limit(uint64_t bytes) {
+        __atomic_store_n(&memory_limit, bytes, __ATOMIC_RELAXED);
+}
+
+uint64_t realloc_buffer_memory_limit(void) {
+        return __atomic_load_n(&memory_limit, __ATOMIC_RELAXED);
+}
+
+uint64_t realloc_buffer_memory_allocated(void) {
+        return __atomic_load_n(&memory_allocated, __ATOMIC_RELAXED);
+}
+
+bool realloc_buffer_under_memory_pressure(void) {
+        uint64_t l;
+
+        l = realloc_buffer_memory_limit();
+        if (l == 0)
+                return false;
+
+        /* Report pressure already at 7/8th of the budget, so that the backpressure hooks engage before we
+         * actually hit it. */
+        return realloc_buffer_memory_allocated() >= l - l / 8;
+}
+
 void* realloc_buffer_acquire(ReallocBuffer *b, size_t size) {
         size_t ns, na, ne;
         void *p;
@@ -53,6 +89,8 @@ void* realloc_buffer_acquire(ReallocBuffer *b, size_t size) {
                 b->start = 0;
         }
 
+        realloc_buffer_account(b->allocated, ns);
+
         b->data = p;
         b->end = size;
         b->allocated = ns;
@@ -92,6 +130,8 @@ void *realloc_buffer_acquire0(ReallocBuffer *b, size_t size) {
         if (!p)
                 return NULL;
 
+        realloc_buffer_account(b->allocated, ns);
+
         free(b->data);
         b->data = p;
         b->allocated = ns;
@@ -150,10 +190,50 @@ void realloc_buffer_free(ReallocBuffer *b) {
         if (!b)
                 return;
 
+        realloc_buffer_account(b->allocated, 0);
+
         b->data = mfree(b->data);
         b->allocated = b->end = b->start = 0;
 }
 
+void realloc_buffer_compact(ReallocBuffer *b, size_t keep) {
+        size_t ns;
+        void *p;
+
+        /* Shrinks the backing allocation to what's actually in use, so that a buffer that grew large once
+         * doesn't pin that memory forever. Contents are preserved. Allocations up to 'keep' bytes are left
+         * alone, so that hot buffers don't thrash. */
+
+        if (!b)
+                return;
+
+        ns = MAX(realloc_buffer_size(b), keep);
+        ns = ALIGN_TO(ns, page_size());
+
+        if (b->allocated <= ns)
+                return;
+
+        if (ns == 0) {
+                realloc_buffer_free(b);
+                return;
+        }
+
+        if (b->start > 0) {
+                memmove(b->data, realloc_buffer_data(b), realloc_buffer_size(b));
+                b->end -= b->start;
+                b->start = 0;
+        }
+
+        p = realloc(b->data, ns);
+        if (!p) /* If shrinking fails, keeping the larger allocation is fine */
+                return;
+
+        realloc_buffer_account(b->allocated, ns);
+
+        b->data = p;
+        b->allocated = ns;
+}
+
 int realloc_buffer_advance(ReallocBuffer *b, size_t sz) {
         size_t ns;
 
@@ -254,6 +334,8 @@ void* realloc_buffer_steal(ReallocBuffer *b) {
                 b->data = mfree(b->data);
         }
 
+        realloc_buffer_account(b->allocated, 0);
+
         b->start = b->end = b->allocated = 0;
 
         return p;
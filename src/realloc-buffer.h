@@ -1,6 +1,8 @@
 #ifndef fooreallocbufferhfoo
 #define fooreallocbufferhfoo
 
+#include <inttypes.h>
+#include <stdbool.h>
 #include <sys/types.h>
 
 #include "util.h"
@@ -55,6 +57,7 @@ void* realloc_buffer_extend0(ReallocBuffer *b, size_t size);
 void* realloc_buffer_append(ReallocBuffer *b, const void *p, size_t size);
 
 void realloc_buffer_free(ReallocBuffer *b);
+void realloc_buffer_compact(ReallocBuffer *b, size_t keep);
 
 static inline void realloc_buffer_empty(ReallocBuffer *b) {
         b->start = b->end = 0;
@@ -68,4 +71,15 @@ int realloc_buffer_read(ReallocBuffer *b, int fd);
 
 void* realloc_buffer_steal(ReallocBuffer *b);
 
+/* Process-wide accounting of the backing allocations of all ReallocBuffers. The buffers are scattered
+ * across CaSync, CaRemote, CaIndex and the compressor paths, each growing on its own — on small devices
+ * their sum is what matters. A limit of 0 means "unbounded". The limit is advisory: allocations don't fail
+ * when it is crossed, instead realloc_buffer_under_memory_pressure() starts reporting true shortly before
+ * it is reached, and the I/O paths react by pausing remote reads, stopping prefetch and compacting drained
+ * buffers. */
+void realloc_buffer_set_memory_limit(uint64_t bytes);
+uint64_t realloc_buffer_memory_limit(void);
+uint64_t realloc_buffer_memory_allocated(void);
+bool realloc_buffer_under_memory_pressure(void);
+
 #endif
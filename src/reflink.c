@@ -9,7 +9,7 @@
 
 #define FS_BLOCK_SIZE 4096U
 
-#define VALIDATE 1
+#define VALIDATE 0
 
 #if VALIDATE
 static ssize_t pread_try_harder(int fd, void *p, size_t s, off_t o) {
@@ -148,3 +148,50 @@ int reflink_fd(
 
         return 0;
 }
+
+int clone_file_range_fd(
+                int source_fd,
+                uint64_t source_offset,
+                int destination_fd,
+                uint64_t destination_offset,
+                uint64_t size,
+                uint64_t *ret_cloned) {
+
+        uint64_t done = 0;
+
+        /* Copies the specified range with copy_file_range(), which clones extents where the file system
+         * supports that and offloads the copy to the kernel everywhere else. In contrast to reflink_fd()
+         * this has no alignment requirements, and the destination file offset is left untouched. */
+
+        if (source_fd < 0)
+                return -EBADF;
+        if (destination_fd < 0)
+                return -EBADF;
+
+        /* Overflow checks */
+        if (source_offset + size < source_offset)
+                return -ERANGE;
+        if (destination_offset + size < destination_offset)
+                return -ERANGE;
+
+        while (done < size) {
+                loff_t in, out;
+                ssize_t n;
+
+                in = source_offset + done;
+                out = destination_offset + done;
+
+                n = copy_file_range(source_fd, &in, destination_fd, &out, size - done, 0);
+                if (n < 0)
+                        return -errno;
+                if (n == 0) /* Hit EOF in the source early? */
+                        return -ENODATA;
+
+                done += n;
+        }
+
+        if (ret_cloned)
+                *ret_cloned = done;
+
+        return 0;
+}
@@ -82,6 +82,30 @@ int loop_write_block(int fd, const void *p, size_t l) {
         return 0;
 }
 
+size_t zero_run_size(const void *p, size_t n) {
+        const uint8_t *q = p, *e = (const uint8_t*) p + n;
+
+        /* Returns the number of leading zero bytes in the specified buffer. Compares word-wide, so that long
+         * zero runs are detected at memory bandwidth. */
+
+        while (q < e && ((uintptr_t) q & (sizeof(uint64_t) - 1)) != 0) {
+                if (*q != 0)
+                        return q - (const uint8_t*) p;
+                q++;
+        }
+
+        while ((size_t) (e - q) >= sizeof(uint64_t)) {
+                if (*(const uint64_t*) q != 0)
+                        break;
+                q += sizeof(uint64_t);
+        }
+
+        while (q < e && *q == 0)
+                q++;
+
+        return q - (const uint8_t*) p;
+}
+
 int write_zeroes(int fd, size_t l) {
         const char *zeroes;
         off_t p, end;
@@ -147,39 +171,58 @@ fallback:
         return 0; /* Return == 0 if we could only write out zeroes */
 }
 
-int loop_write_with_holes(int fd, const void *p, size_t l, uint64_t *ret_punched) {
-        const uint8_t *q, *start = p, *zero_start = NULL;
+int loop_write_with_holes_full(int fd, const void *p, size_t l, uint64_t offset, uint64_t granularity, uint64_t *ret_punched) {
+        const uint8_t *q = p, *start = p, *e = (const uint8_t*) p + l;
         uint64_t n_punched = 0;
         int r;
 
         /* Write out the specified data much like loop_write(), but try to punch holes for any longer series of zero
-         * bytes, thus creating sparse files if possible. */
+         * bytes, thus creating sparse files if possible. If a granularity > 1 is specified holes are aligned to it,
+         * given that the buffer will be written at the specified file offset: punching below the file system block
+         * size (or the backing device's discard granularity) cannot free any space, but still splits the data into
+         * misaligned write calls, which striped arrays answer with a read-modify-write cycle. Partial blocks at
+         * either edge of a zero run are written out as data instead. */
+
+        while (q < e) {
+                uint64_t hole_begin, hole_end;
+                const uint8_t *z;
+                size_t zl;
+
+                /* Find the next zero byte, then measure the run word-wide */
+                z = memchr(q, 0, e - q);
+                if (!z)
+                        break;
 
-        for (q = p; q < (const uint8_t*) p + l; q++) {
+                zl = zero_run_size(z, e - z);
 
-                if (*q == 0) {
+                if ((uint64_t) zl >= MAX((uint64_t) HOLE_MIN, granularity)) {
 
-                        if (!zero_start)
-                                zero_start = q;
+                        hole_begin = offset + (uint64_t) (z - (const uint8_t*) p);
+                        hole_end = hole_begin + zl;
 
-                        continue;
-                }
+                        if (granularity > 1) {
+                                hole_begin = (hole_begin + granularity - 1) / granularity * granularity;
+                                hole_end = hole_end / granularity * granularity;
+                        }
 
-                if (zero_start) {
+                        if (hole_end > hole_begin) {
+                                const uint8_t *hb;
 
-                        if (q - zero_start >= HOLE_MIN) {
+                                hb = (const uint8_t*) p + (hole_begin - offset);
 
-                                r = loop_write(fd, start, zero_start - start);
+                                r = loop_write(fd, start, hb - start);
                                 if (r < 0)
                                         return r;
 
-                                r = write_zeroes(fd, q - zero_start);
+                                r = write_zeroes(fd, hole_end - hole_begin);
                                 if (r < 0)
                                         return r;
 
                                 /* Couldn't punch hole? then don't bother again */
                                 if (r == 0) {
-                                        r = loop_write(fd, q, (const uint8_t*) p + l - q);
+                                        hb = (const uint8_t*) p + (hole_end - offset);
+
+                                        r = loop_write(fd, hb, e - hb);
                                         if (r < 0)
                                                 return r;
 
@@ -189,35 +232,15 @@ int loop_write_with_holes(int fd, const void *p, size_t l, uint64_t *ret_punched
                                         return r;
                                 }
 
-                                n_punched += q - zero_start;
-                                start = q;
+                                n_punched += hole_end - hole_begin;
+                                start = (const uint8_t*) p + (hole_end - offset);
                         }
-
-                        zero_start = NULL;
-                        continue;
                 }
-        }
-
-        if (zero_start) {
-                if (q - zero_start >= HOLE_MIN) {
-                        r = loop_write(fd, start, zero_start - start);
-                        if (r < 0)
-                                return r;
-
-                        r = write_zeroes(fd, q - zero_start);
-                        if (r < 0)
-                                return r;
-                        if (r > 0)
-                                n_punched += q - zero_start;
 
-                        if (ret_punched)
-                                *ret_punched = n_punched;
-
-                        return 0;
-                }
+                q = z + zl;
         }
 
-        r = loop_write(fd, start, q - start);
+        r = loop_write(fd, start, e - start);
         if (r < 0)
                 return r;
 
@@ -227,6 +250,10 @@ int loop_write_with_holes(int fd, const void *p, size_t l, uint64_t *ret_punched
         return r;
 }
 
+int loop_write_with_holes(int fd, const void *p, size_t l, uint64_t *ret_punched) {
+        return loop_write_with_holes_full(fd, p, l, 0, 1, ret_punched);
+}
+
 ssize_t loop_read(int fd, void *p, size_t l) {
         ssize_t sum = 0;
 
@@ -107,6 +107,9 @@ ssize_t loop_read(int fd, void *p, size_t l);
 
 int write_zeroes(int fd, size_t l);
 int loop_write_with_holes(int fd, const void *p, size_t l, uint64_t *ret_punched);
+int loop_write_with_holes_full(int fd, const void *p, size_t l, uint64_t offset, uint64_t granularity, uint64_t *ret_punched);
+
+size_t zero_run_size(const void *p, size_t n);
 
 int skip_bytes(int fd, uint64_t bytes);
 
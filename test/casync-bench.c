@@ -0,0 +1,231 @@
+#include <assert.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cachunk.h"
+#include "cachunker.h"
+#include "cachunkid.h"
+#include "cadigest.h"
+#include "castore.h"
+#include "realloc-buffer.h"
+#include "rm-rf.h"
+#include "util.h"
+
+/* A microbenchmark harness for the hot paths: chunker scanning, digests, the compressor and store
+ * writes. Prints one JSON object per line to stdout, so that results from automated runs can be
+ * collected and compared between releases. Not run as part of the test suite. */
+
+#define BENCH_BUFFER_SIZE (64U*1024U*1024U)
+#define BENCH_CHUNK_SIZE (64U*1024U)
+
+typedef enum BenchProfile {
+        BENCH_PROFILE_ZERO,   /* all zeroes, the sparse image case */
+        BENCH_PROFILE_TEXT,   /* low entropy, repetitive text */
+        BENCH_PROFILE_RANDOM, /* incompressible pseudo-random data */
+        _BENCH_PROFILE_MAX,
+} BenchProfile;
+
+static const char *bench_profile_to_string(BenchProfile p) {
+        switch (p) {
+
+        case BENCH_PROFILE_ZERO:
+                return "zero";
+
+        case BENCH_PROFILE_TEXT:
+                return "text";
+
+        case BENCH_PROFILE_RANDOM:
+                return "random";
+
+        default:
+                return NULL;
+        }
+}
+
+/* A fixed-seed xorshift so that every run benches the exact same bytes */
+static uint64_t bench_rand_state = UINT64_C(0x853c49e6748fea9b);
+
+static uint64_t bench_rand(void) {
+        bench_rand_state ^= bench_rand_state << 13;
+        bench_rand_state ^= bench_rand_state >> 7;
+        bench_rand_state ^= bench_rand_state << 17;
+
+        return bench_rand_state;
+}
+
+static void bench_fill(BenchProfile profile, uint8_t *p, size_t l) {
+        static const char text[] =
+                "All human beings are born free and equal in dignity and rights. They are endowed "
+                "with reason and conscience and should act towards one another in a spirit of brotherhood. ";
+        size_t i;
+
+        switch (profile) {
+
+        case BENCH_PROFILE_ZERO:
+                memset(p, 0, l);
+                break;
+
+        case BENCH_PROFILE_TEXT:
+                for (i = 0; i < l; i++)
+                        p[i] = text[i % strlen(text)];
+                break;
+
+        case BENCH_PROFILE_RANDOM:
+                for (i = 0; i + sizeof(uint64_t) <= l; i += sizeof(uint64_t)) {
+                        uint64_t u = bench_rand();
+                        memcpy(p + i, &u, sizeof(u));
+                }
+                for (; i < l; i++)
+                        p[i] = (uint8_t) bench_rand();
+                break;
+
+        default:
+                assert(false);
+        }
+}
+
+static void bench_report(const char *benchmark, const char *variant, uint64_t n_bytes, uint64_t n_ops, uint64_t nsec) {
+
+        printf("{\"benchmark\":\"%s\",\"variant\":\"%s\",\"bytes\":%" PRIu64 ",\"ops\":%" PRIu64 ",\"nsec\":%" PRIu64,
+               benchmark, variant, n_bytes, n_ops, nsec);
+
+        if (nsec > 0) {
+                if (n_bytes > 0)
+                        printf(",\"mb_per_sec\":%.1f", (double) n_bytes * NSEC_PER_SEC / ((double) nsec * 1024 * 1024));
+                if (n_ops > 0)
+                        printf(",\"ops_per_sec\":%.1f", (double) n_ops * NSEC_PER_SEC / (double) nsec);
+        }
+
+        printf("}\n");
+        fflush(stdout);
+}
+
+static void bench_chunker(const uint8_t *buffer, BenchProfile profile) {
+        CaChunker chunker = CA_CHUNKER_INIT;
+        uint64_t t, n_chunks = 0;
+        const uint8_t *p = buffer;
+        size_t l = BENCH_BUFFER_SIZE;
+
+        t = now(CLOCK_MONOTONIC);
+
+        while (l > 0) {
+                size_t k;
+
+                k = ca_chunker_scan(&chunker, p, l);
+                if (k == (size_t) -1)
+                        break;
+
+                p += k;
+                l -= k;
+                n_chunks++;
+        }
+
+        bench_report("chunker", bench_profile_to_string(profile), BENCH_BUFFER_SIZE, n_chunks, now(CLOCK_MONOTONIC) - t);
+}
+
+static void bench_digest(const uint8_t *buffer, CaDigestType type) {
+        CaDigest *d = NULL;
+        uint64_t t;
+
+        assert_se(ca_digest_new(type, &d) >= 0);
+
+        t = now(CLOCK_MONOTONIC);
+        ca_digest_write(d, buffer, BENCH_BUFFER_SIZE);
+        (void) ca_digest_read(d);
+
+        bench_report("digest", ca_digest_type_to_string(type), BENCH_BUFFER_SIZE, 1, now(CLOCK_MONOTONIC) - t);
+
+        ca_digest_free(d);
+}
+
+static void bench_compression(const uint8_t *buffer, CaCompressionType type) {
+        ReallocBuffer compressed = {}, decompressed = {};
+        uint64_t t;
+
+        t = now(CLOCK_MONOTONIC);
+        assert_se(ca_compress(type, buffer, BENCH_BUFFER_SIZE, &compressed) >= 0);
+        bench_report("compress", ca_compression_type_to_string(type), BENCH_BUFFER_SIZE, 1, now(CLOCK_MONOTONIC) - t);
+
+        t = now(CLOCK_MONOTONIC);
+        assert_se(ca_decompress(realloc_buffer_data(&compressed), realloc_buffer_size(&compressed), &decompressed) >= 0);
+        bench_report("decompress", ca_compression_type_to_string(type), BENCH_BUFFER_SIZE, 1, now(CLOCK_MONOTONIC) - t);
+
+        assert_se(realloc_buffer_size(&decompressed) == BENCH_BUFFER_SIZE);
+
+        realloc_buffer_free(&compressed);
+        realloc_buffer_free(&decompressed);
+}
+
+static void bench_store_put(const uint8_t *buffer) {
+        char path[] = "/var/tmp/casync-bench.XXXXXX";
+        CaDigest *d = NULL;
+        CaStore *store;
+        uint64_t t, n_chunks = 0;
+        size_t i;
+
+        assert_se(mkdtemp(path));
+
+        store = ca_store_new();
+        assert_se(store);
+        assert_se(ca_store_set_path(store, path) >= 0);
+
+        assert_se(ca_digest_new(CA_DIGEST_DEFAULT, &d) >= 0);
+
+        t = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i + BENCH_CHUNK_SIZE <= BENCH_BUFFER_SIZE; i += BENCH_CHUNK_SIZE) {
+                CaChunkID id;
+
+                assert_se(ca_chunk_id_make(d, buffer + i, BENCH_CHUNK_SIZE, &id) >= 0);
+                assert_se(ca_store_put(store, &id, CA_CHUNK_UNCOMPRESSED, buffer + i, BENCH_CHUNK_SIZE) >= 0);
+                n_chunks++;
+        }
+
+        bench_report("store-put", "uncompressed", n_chunks * BENCH_CHUNK_SIZE, n_chunks, now(CLOCK_MONOTONIC) - t);
+
+        ca_digest_free(d);
+        ca_store_unref(store);
+        assert_se(rm_rf(path, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+}
+
+int main(int argc, char *argv[]) {
+        uint8_t *buffer;
+        BenchProfile profile;
+        CaDigestType dt;
+        CaCompressionType ct;
+
+        /* Pin to one CPU so that results aren't skewed by migration between cores of different speed */
+        {
+                cpu_set_t cpus;
+
+                CPU_ZERO(&cpus);
+                CPU_SET(0, &cpus);
+                (void) sched_setaffinity(0, sizeof(cpus), &cpus);
+        }
+
+        buffer = malloc(BENCH_BUFFER_SIZE);
+        assert_se(buffer);
+
+        for (profile = 0; profile < _BENCH_PROFILE_MAX; profile++) {
+                bench_fill(profile, buffer, BENCH_BUFFER_SIZE);
+                bench_chunker(buffer, profile);
+        }
+
+        /* Digest and compression run on the random profile, which is still in the buffer; the store
+         * writes need distinct chunk IDs, hence reuse it too */
+        for (dt = 0; dt < _CA_DIGEST_TYPE_MAX; dt++)
+                bench_digest(buffer, dt);
+
+        bench_fill(BENCH_PROFILE_TEXT, buffer, BENCH_BUFFER_SIZE);
+        for (ct = 0; ct < _CA_COMPRESSION_TYPE_MAX; ct++)
+                bench_compression(buffer, ct);
+
+        bench_fill(BENCH_PROFILE_RANDOM, buffer, BENCH_BUFFER_SIZE);
+        bench_store_put(buffer);
+
+        free(buffer);
+        return 0;
+}
@@ -0,0 +1,71 @@
+#include "cabloom.h"
+#include "util.h"
+
+#define TEST_N_ENTRIES 10000U
+
+static void make_id(CaChunkID *ret) {
+        assert_se(dev_urandom(ret, sizeof(CaChunkID)) >= 0);
+}
+
+int main(int argc, char *argv[]) {
+        static CaChunkID inserted[TEST_N_ENTRIES];
+        CaBloom *b, *c;
+        size_t i, n_positives = 0;
+
+        assert_se(b = ca_bloom_new(TEST_N_ENTRIES));
+
+        /* An empty filter must answer no for everything */
+        for (i = 0; i < 100; i++) {
+                CaChunkID id;
+
+                make_id(&id);
+                assert_se(ca_bloom_may_have(b, &id) == 0);
+        }
+
+        for (i = 0; i < TEST_N_ENTRIES; i++) {
+                make_id(inserted + i);
+                assert_se(ca_bloom_add(b, inserted + i) >= 0);
+        }
+
+        /* Never a false negative */
+        for (i = 0; i < TEST_N_ENTRIES; i++)
+                assert_se(ca_bloom_may_have(b, inserted + i) > 0);
+
+        /* With CA_BLOOM_BITS_PER_ENTRY/CA_BLOOM_DEFAULT_N_HASH the false positive rate on a disjoint set
+         * is slightly below 1%; allow a generous margin so random IDs never make this flaky. */
+        for (i = 0; i < TEST_N_ENTRIES; i++) {
+                CaChunkID id;
+                int r;
+
+                make_id(&id);
+
+                r = ca_bloom_may_have(b, &id);
+                assert_se(r >= 0);
+                n_positives += r > 0;
+        }
+
+        assert_se(n_positives < TEST_N_ENTRIES / 20);
+
+        /* Serialization round-trip: a filter rebuilt from the wire data must answer identically */
+        assert_se(c = ca_bloom_new_from_data(ca_bloom_get_n_hash(b), ca_bloom_get_data(b), ca_bloom_get_size(b)));
+
+        for (i = 0; i < TEST_N_ENTRIES; i++)
+                assert_se(ca_bloom_may_have(c, inserted + i) > 0);
+
+        for (i = 0; i < 1000; i++) {
+                CaChunkID id;
+
+                make_id(&id);
+                assert_se(ca_bloom_may_have(c, &id) == ca_bloom_may_have(b, &id));
+        }
+
+        /* Refuse nonsensical wire parameters */
+        assert_se(!ca_bloom_new_from_data(0, ca_bloom_get_data(b), ca_bloom_get_size(b)));
+        assert_se(!ca_bloom_new_from_data(65, ca_bloom_get_data(b), ca_bloom_get_size(b)));
+        assert_se(!ca_bloom_new_from_data(ca_bloom_get_n_hash(b), ca_bloom_get_data(b), 0));
+
+        ca_bloom_unref(c);
+        ca_bloom_unref(b);
+
+        return 0;
+}
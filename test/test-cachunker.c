@@ -87,6 +87,101 @@ finish:
         (void) close(fd);
 }
 
+static size_t scan_cuts(const uint8_t *p, size_t n, size_t step, CaChunkerAlgorithm algorithm, size_t *cuts, size_t max_cuts) {
+        CaChunker x = CA_CHUNKER_INIT;
+        size_t n_cuts = 0, pos = 0;
+
+        assert_se(ca_chunker_set_algorithm(&x, algorithm) >= 0);
+
+        while (pos < n) {
+                size_t m = MIN(step, n - pos), done = 0;
+
+                while (done < m) {
+                        size_t k;
+
+                        k = ca_chunker_scan(&x, p + pos + done, m - done);
+                        if (k == (size_t) -1)
+                                break;
+
+                        done += k;
+                        assert_se(n_cuts < max_cuts);
+                        cuts[n_cuts++] = pos + done;
+                }
+
+                pos += m;
+        }
+
+        return n_cuts;
+}
+
+static void test_zero_runs(void) {
+        size_t cuts_whole[256], cuts_sliced[256];
+        size_t n_whole, n_sliced, i;
+        uint8_t *buffer;
+        int fd;
+
+        /* Verify that the zero run fast path cuts chunks at exactly the same places as the byte-wise scan,
+         * which stays engaged when the input arrives in small slices. */
+
+        buffer = malloc(1024*1024);
+        assert_se(buffer);
+
+        fd = open("/dev/urandom", O_CLOEXEC|O_RDONLY|O_NOCTTY);
+        assert_se(fd >= 0);
+
+        memset(buffer, 0, 1024*1024);
+        assert_se(read(fd, buffer, 192*1024) == 192*1024);
+        assert_se(read(fd, buffer + 960*1024, 64*1024) == 64*1024);
+
+        (void) close(fd);
+
+        n_whole = scan_cuts(buffer, 1024*1024, 1024*1024, CA_CHUNKER_BUZHASH, cuts_whole, 256);
+        n_sliced = scan_cuts(buffer, 1024*1024, 512, CA_CHUNKER_BUZHASH, cuts_sliced, 256);
+
+        assert_se(n_whole == n_sliced);
+        for (i = 0; i < n_whole; i++)
+                assert_se(cuts_whole[i] == cuts_sliced[i]);
+
+        free(buffer);
+}
+
+static void test_fastcdc(void) {
+        size_t cuts_whole[256], cuts_sliced[256];
+        size_t n_whole, n_sliced, i, previous;
+        CaChunker c = CA_CHUNKER_INIT;
+        uint8_t *buffer;
+        int fd;
+
+        /* The gear chunker must pick identical cut points no matter how the input is sliced, and every
+         * produced chunk must stay within the configured bounds. */
+
+        buffer = malloc(1024*1024);
+        assert_se(buffer);
+
+        fd = open("/dev/urandom", O_CLOEXEC|O_RDONLY|O_NOCTTY);
+        assert_se(fd >= 0);
+        assert_se(read(fd, buffer, 1024*1024) == 1024*1024);
+        (void) close(fd);
+
+        n_whole = scan_cuts(buffer, 1024*1024, 1024*1024, CA_CHUNKER_FASTCDC, cuts_whole, 256);
+        n_sliced = scan_cuts(buffer, 1024*1024, 512, CA_CHUNKER_FASTCDC, cuts_sliced, 256);
+
+        assert_se(n_whole > 0);
+        assert_se(n_whole == n_sliced);
+
+        previous = 0;
+        for (i = 0; i < n_whole; i++) {
+                assert_se(cuts_whole[i] == cuts_sliced[i]);
+
+                assert_se(cuts_whole[i] - previous >= c.chunk_size_min);
+                assert_se(cuts_whole[i] - previous <= c.chunk_size_max);
+
+                previous = cuts_whole[i];
+        }
+
+        free(buffer);
+}
+
 static int test_set_size(void) {
         struct CaChunker x = CA_CHUNKER_INIT, y = CA_CHUNKER_INIT;
 
@@ -144,6 +239,8 @@ int main(int argc, char *argv[]) {
 
         test_rolling();
         test_chunk();
+        test_zero_runs();
+        test_fastcdc();
         test_set_size();
 
         return 0;
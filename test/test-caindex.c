@@ -1,19 +1,272 @@
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#include "util.h"
+#include "caformat.h"
 #include "caindex.h"
+#include "util.h"
 
-int main(int argc, char*argv[]) {
-        CaIndex* index;
-        int r;
+#define TEST_N_CHUNKS 32U
+#define TEST_N_INLINE 16U
+
+#define TEST_CHUNK_SIZE_MIN 1024U
+#define TEST_CHUNK_SIZE_AVG 4096U
+#define TEST_CHUNK_SIZE_MAX 16384U
+
+static void make_path(char **ret) {
+        const char *d;
+
+        assert_se(var_tmp_dir(&d) >= 0);
+        assert_se(asprintf(ret, "%s/test-caindex.%" PRIx64 ".caidx", d, random_u64()) >= 0);
+}
+
+static CaIndex *open_write(const char *path, uint64_t feature_flags) {
+        CaIndex *i;
+
+        assert_se(i = ca_index_new_write());
+        assert_se(ca_index_set_path(i, path) >= 0);
+        assert_se(ca_index_set_feature_flags(i, feature_flags) >= 0);
+        assert_se(ca_index_set_chunk_size_min(i, TEST_CHUNK_SIZE_MIN) >= 0);
+        assert_se(ca_index_set_chunk_size_avg(i, TEST_CHUNK_SIZE_AVG) >= 0);
+        assert_se(ca_index_set_chunk_size_max(i, TEST_CHUNK_SIZE_MAX) >= 0);
+        assert_se(ca_index_open(i) >= 0);
+
+        return i;
+}
 
-        if (argc != 2) {
-                fprintf(stderr, "Expected an index file as argument.\n");
-                return EXIT_FAILURE;
+static CaIndex *open_read(const char *path) {
+        CaIndex *i;
+
+        assert_se(i = ca_index_new_read());
+        assert_se(ca_index_set_path(i, path) >= 0);
+        assert_se(ca_index_open(i) >= 0);
+
+        return i;
+}
+
+static void truncate_tail(const char *path, uint64_t drop) {
+        struct stat st;
+        int fd;
+
+        fd = open(path, O_WRONLY|O_CLOEXEC|O_NOCTTY);
+        assert_se(fd >= 0);
+        assert_se(fstat(fd, &st) >= 0);
+        assert_se((uint64_t) st.st_size > drop);
+        assert_se(ftruncate(fd, st.st_size - drop) >= 0);
+        safe_close(fd);
+}
+
+static void test_inline_chunks(void) {
+        CaChunkID ids[TEST_N_CHUNKS], oversized_id, absent_id;
+        uint8_t inline_data[TEST_N_INLINE][CA_INDEX_INLINE_CHUNK_SIZE_MAX];
+        uint64_t inline_sizes[TEST_N_INLINE], sizes[TEST_N_CHUNKS];
+        uint8_t big[CA_INDEX_INLINE_CHUNK_SIZE_MAX + 1];
+        char *path;
+        CaIndex *i;
+        size_t n;
+
+        make_path(&path);
+
+        i = open_write(path, CA_FORMAT_INLINE_CHUNKS);
+
+        for (n = 0; n < TEST_N_CHUNKS; n++) {
+                assert_se(dev_urandom(ids + n, sizeof(CaChunkID)) >= 0);
+                sizes[n] = 1 + random_u64() % TEST_CHUNK_SIZE_MAX;
+
+                assert_se(ca_index_write_chunk(i, ids + n, sizes[n]) >= 0);
         }
 
+        for (n = 0; n < TEST_N_INLINE; n++) {
+                inline_sizes[n] = 1 + random_u64() % CA_INDEX_INLINE_CHUNK_SIZE_MAX;
+                assert_se(dev_urandom(inline_data[n], inline_sizes[n]) >= 0);
+
+                assert_se(ca_index_write_inline_chunk(i, ids + n, inline_data[n], inline_sizes[n]) > 0);
+
+                /* Handing over the same chunk twice is fine, and doesn't duplicate it */
+                assert_se(ca_index_write_inline_chunk(i, ids + n, inline_data[n], inline_sizes[n]) == 0);
+        }
+
+        /* Chunks beyond the size limit are quietly left to the store */
+        assert_se(dev_urandom(&oversized_id, sizeof(oversized_id)) >= 0);
+        assert_se(dev_urandom(big, sizeof(big)) >= 0);
+        assert_se(ca_index_write_inline_chunk(i, &oversized_id, big, sizeof(big)) == 0);
+
+        assert_se(ca_index_write_eof(i) >= 0);
+        assert_se(ca_index_install(i) >= 0);
+        ca_index_unref(i);
+
+        /* Read it back: the table must enumerate as written, and every inline chunk must be retrievable */
+
+        i = open_read(path);
+
+        for (n = 0; n < TEST_N_CHUNKS; n++) {
+                CaChunkID id;
+                uint64_t size;
+
+                assert_se(ca_index_read_chunk(i, &id, NULL, &size) > 0);
+                assert_se(memcmp(&id, ids + n, sizeof(CaChunkID)) == 0);
+                assert_se(size == sizes[n]);
+        }
+
+        assert_se(ca_index_read_chunk(i, NULL, NULL, NULL) == 0); /* EOF */
+
+        for (n = 0; n < TEST_N_CHUNKS; n++) {
+                const void *q;
+                uint64_t size;
+
+                if (n < TEST_N_INLINE) {
+                        assert_se(ca_index_get_inline_chunk(i, ids + n, &q, &size) == 0);
+                        assert_se(size == inline_sizes[n]);
+                        assert_se(memcmp(q, inline_data[n], size) == 0);
+                } else
+                        /* Table chunks that weren't inlined must come up empty */
+                        assert_se(ca_index_get_inline_chunk(i, ids + n, &q, &size) == -ENOENT);
+        }
+
+        {
+                const void *q;
+                uint64_t size;
+
+                assert_se(ca_index_get_inline_chunk(i, &oversized_id, &q, &size) == -ENOENT);
+
+                assert_se(dev_urandom(&absent_id, sizeof(absent_id)) >= 0);
+                assert_se(ca_index_get_inline_chunk(i, &absent_id, &q, &size) == -ENOENT);
+        }
+
+        ca_index_unref(i);
+
+        /* A truncated section must be rejected: cutting anything off the file shifts the tail marker away
+         * from the file end, which the loader must notice. */
+
+        truncate_tail(path, sizeof(uint64_t));
+
+        i = open_read(path);
+
+        {
+                const void *q;
+                uint64_t size;
+
+                assert_se(ca_index_get_inline_chunk(i, ids + 0, &q, &size) == -EBADMSG);
+        }
+
+        ca_index_unref(i);
+
+        assert_se(unlink(path) >= 0);
+        free(path);
+}
+
+static void test_toc_one(uint64_t feature_flags) {
+        static const struct {
+                const char *path;
+                mode_t mode;
+        } members[] = {
+                /* In stored order: sorted with '/' below every other byte, i.e. the depth-first order the
+                 * encoder serializes members in */
+                { "a.txt",        S_IFREG|0644 },
+                { "sub",          S_IFDIR|0755 },
+                { "sub/file.txt", S_IFREG|0644 },
+                { "sub/inner",    S_IFDIR|0700 },
+                { "sub/inner/x",  S_IFREG|0400 },
+                { "sub2",         S_IFDIR|0755 },
+        };
+
+        CaChunkID id;
+        char *path;
+        CaIndex *i;
+        size_t n;
+
+        make_path(&path);
+
+        i = open_write(path, feature_flags);
+
+        for (n = 0; n < 4; n++) {
+                assert_se(dev_urandom(&id, sizeof(id)) >= 0);
+                assert_se(ca_index_write_chunk(i, &id, 1024) >= 0);
+        }
+
+        if (feature_flags & CA_FORMAT_INLINE_CHUNKS) {
+                uint8_t data[16];
+
+                assert_se(dev_urandom(data, sizeof(data)) >= 0);
+                assert_se(ca_index_write_inline_chunk(i, &id, data, sizeof(data)) > 0);
+        }
+
+        /* Hand the members over in scrambled order, the index keeps them sorted */
+        for (n = 0; n < ELEMENTSOF(members); n++) {
+                size_t j = (n * 5 + 2) % ELEMENTSOF(members);
+
+                assert_se(ca_index_write_toc_entry(i, members[j].path, j * 4096, members[j].mode) > 0);
+        }
+
+        /* Duplicate paths are quietly ignored */
+        assert_se(ca_index_write_toc_entry(i, members[0].path, 0, members[0].mode) == 0);
+
+        assert_se(ca_index_write_eof(i) >= 0);
+        assert_se(ca_index_install(i) >= 0);
+        ca_index_unref(i);
+
+        /* Read it back: enumeration must follow the stored order, and path lookups must return what was
+         * written */
+
+        i = open_read(path);
+
+        for (n = 0; n < ELEMENTSOF(members); n++) {
+                const char *q;
+                uint64_t offset;
+                mode_t mode;
+
+                assert_se(ca_index_get_toc_entry_by_index(i, n, &q, &offset, &mode) == 0);
+                assert_se(streq(q, members[n].path));
+                assert_se(offset == n * 4096);
+                assert_se(mode == members[n].mode);
+        }
+
+        assert_se(ca_index_get_toc_entry_by_index(i, ELEMENTSOF(members), NULL, NULL, NULL) == -ERANGE);
+
+        {
+                uint64_t offset;
+                mode_t mode;
+
+                assert_se(ca_index_get_toc_entry(i, "sub/file.txt", &offset, &mode) == 0);
+                assert_se(offset == 2 * 4096);
+                assert_se(mode == (S_IFREG|0644));
+
+                /* Leading slashes are not significant */
+                assert_se(ca_index_get_toc_entry(i, "/sub/file.txt", &offset, &mode) == 0);
+                assert_se(offset == 2 * 4096);
+
+                assert_se(ca_index_get_toc_entry(i, "sub/absent", NULL, NULL) == -ENOENT);
+                assert_se(ca_index_get_toc_entry(i, "su", NULL, NULL) == -ENOENT);
+        }
+
+        ca_index_unref(i);
+
+        /* As with the inline chunk section, a truncated tail must be rejected */
+
+        truncate_tail(path, sizeof(uint64_t));
+
+        i = open_read(path);
+        assert_se(ca_index_get_toc_entry(i, members[0].path, NULL, NULL) == -EBADMSG);
+        ca_index_unref(i);
+
+        assert_se(unlink(path) >= 0);
+        free(path);
+}
+
+static void test_toc(void) {
+        /* Once with the TOC as the only extra section, and once with the inline chunk section following
+         * it, which the loader must skip over to find the TOC tail */
+        test_toc_one(CA_FORMAT_TOC);
+        test_toc_one(CA_FORMAT_TOC|CA_FORMAT_INLINE_CHUNKS);
+}
+
+static int dump_index(const char *arg) {
+        CaIndex* index;
+        int r;
+
         assert_se(index = ca_index_new_read());
-        assert_se(ca_index_set_path(index, argv[1]) >= 0);
+        assert_se(ca_index_set_path(index, arg) >= 0);
         assert_se(ca_index_open(index) >= 0);
 
         for (;;) {
@@ -36,3 +289,16 @@ int main(int argc, char*argv[]) {
 
         return 0;
 }
+
+int main(int argc, char*argv[]) {
+
+        /* With an argument: dump the specified index file, for manual inspection. Without one: run the
+         * self tests. */
+        if (argc == 2)
+                return dump_index(argv[1]);
+
+        test_inline_chunks();
+        test_toc();
+
+        return 0;
+}
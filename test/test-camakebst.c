@@ -51,11 +51,77 @@ static void test_makebst_size(size_t n) {
         assert_se(find_bst(b, n, n+1) == (size_t) -1);
 }
 
+static int compare_int(const void *key, const void *item) {
+        int a = *(const int*) key, b = *(const int*) item;
+
+        return a < b ? -1 : a > b ? 1 : 0;
+}
+
+static void test_bst_query_size(size_t n) {
+        int sorted[MAX(1U, n)], bst[MAX(1U, n)];
+        size_t i, j;
+
+        /* Differential check of ca_bst_find() and ca_bst_successor() against a linear scan of the sorted
+         * input, on random data with plenty of duplicate runs. */
+
+        for (i = 0; i < n; i++)
+                sorted[i] = (int) (random() % (n/3 + 1));
+
+        qsort(sorted, n, sizeof(int), compare_int);
+
+        ca_make_bst(sorted, n, sizeof(int), bst);
+
+        if (n > 0) {
+                /* find() of the smallest item plus repeated successor() must enumerate exactly the sorted
+                 * input, and find() must land on the in-order first item of each run of equal values. */
+
+                i = ca_bst_find(bst, n, sizeof(int), sorted + 0, compare_int);
+
+                for (j = 0; j < n; j++) {
+                        assert_se(i != (size_t) -1);
+                        assert_se(bst[i] == sorted[j]);
+
+                        if (j == 0 || sorted[j-1] != sorted[j])
+                                assert_se(ca_bst_find(bst, n, sizeof(int), sorted + j, compare_int) == i);
+
+                        i = ca_bst_successor(n, i);
+                }
+
+                assert_se(i == (size_t) -1);
+        }
+
+        /* Values not in the input must not be found */
+        for (j = 0; j < 16; j++) {
+                int v = (int) (random() % (n/3 + 10));
+                bool have = false;
+
+                for (i = 0; i < n; i++)
+                        if (sorted[i] == v) {
+                                have = true;
+                                break;
+                        }
+
+                if (!have)
+                        assert_se(ca_bst_find(bst, n, sizeof(int), &v, compare_int) == (size_t) -1);
+        }
+
+        {
+                int v = -1;
+
+                assert_se(ca_bst_find(bst, n, sizeof(int), &v, compare_int) == (size_t) -1);
+        }
+}
+
 int main(int argc, char *argv[]) {
         size_t i;
 
         for (i = 0; i < TEST_MAX; i++)
                 test_makebst_size(i);
 
+        srandom(4711); /* Deterministic, so failures reproduce */
+
+        for (i = 0; i < 1000; i++)
+                test_bst_query_size(i);
+
         return 0;
 }
@@ -0,0 +1,212 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "capack.h"
+#include "realloc-buffer.h"
+#include "util.h"
+
+#define TEST_N_CHUNKS 100U
+#define TEST_CHUNK_SIZE_MAX 4096U
+
+typedef struct TestChunk {
+        CaChunkID id;
+        uint8_t data[TEST_CHUNK_SIZE_MAX];
+        uint64_t size;
+        CaChunkCompression compression;
+} TestChunk;
+
+static TestChunk chunks[TEST_N_CHUNKS];
+
+static void make_chunks(void) {
+        size_t i;
+
+        for (i = 0; i < TEST_N_CHUNKS; i++) {
+                TestChunk *c = chunks + i;
+
+                assert_se(dev_urandom(&c->id, sizeof(c->id)) >= 0);
+
+                c->size = 1 + random_u64() % TEST_CHUNK_SIZE_MAX;
+                assert_se(dev_urandom(c->data, c->size) >= 0);
+
+                c->compression = (i % 2) ? CA_CHUNK_COMPRESSED : CA_CHUNK_UNCOMPRESSED;
+        }
+}
+
+static void verify_chunk(CaPack *p, const TestChunk *c) {
+        ReallocBuffer rb = {};
+        CaChunkCompression compression;
+
+        assert_se(ca_pack_get(p, &c->id, &rb, &compression) == 0);
+        assert_se(realloc_buffer_size(&rb) == c->size);
+        assert_se(memcmp(realloc_buffer_data(&rb), c->data, c->size) == 0);
+        assert_se(compression == c->compression);
+
+        realloc_buffer_free(&rb);
+}
+
+static char *find_pack_file(const char *pack_dir) {
+        struct dirent *de;
+        char *found = NULL;
+        DIR *d;
+
+        d = opendir(pack_dir);
+        assert_se(d);
+
+        errno = 0;
+        while ((de = readdir(d))) {
+                if (!endswith(de->d_name, CA_PACK_SUFFIX))
+                        continue;
+
+                assert_se(!found); /* The test writes everything into a single pack */
+                found = strjoin(pack_dir, "/", de->d_name, NULL);
+                assert_se(found);
+        }
+        assert_se(errno == 0);
+
+        closedir(d);
+
+        assert_se(found);
+        return found;
+}
+
+static void remove_tree(const char *pack_dir, const char *dir) {
+        struct dirent *de;
+        DIR *d;
+
+        d = opendir(pack_dir);
+        if (d) {
+                while ((de = readdir(d))) {
+                        if (dot_or_dot_dot(de->d_name))
+                                continue;
+
+                        assert_se(unlinkat(dirfd(d), de->d_name, 0) >= 0);
+                }
+
+                closedir(d);
+                assert_se(rmdir(pack_dir) >= 0);
+        }
+
+        assert_se(rmdir(dir) >= 0);
+}
+
+int main(int argc, char *argv[]) {
+        bool seen[TEST_N_CHUNKS] = {};
+        char *dir, *pack_dir, *pack_file, *index_file;
+        CaChunkID absent;
+        struct stat st;
+        uint64_t idx;
+        CaPack *p;
+        size_t i;
+        int fd;
+
+        const char *d;
+
+        assert_se(var_tmp_dir(&d) >= 0);
+        dir = strjoina(d, "/test-capack.XXXXXX");
+        assert_se(mkdtemp(dir));
+        pack_dir = strjoina(dir, "/pack");
+
+        make_chunks();
+
+        /* Write all chunks into a pack and read them back through the same object */
+
+        assert_se(p = ca_pack_new());
+        assert_se(ca_pack_set_path(p, pack_dir) >= 0);
+
+        for (i = 0; i < TEST_N_CHUNKS; i++)
+                assert_se(ca_pack_put(p, &chunks[i].id, chunks[i].compression, chunks[i].data, chunks[i].size) == 0);
+
+        assert_se(ca_pack_put(p, &chunks[0].id, chunks[0].compression, chunks[0].data, chunks[0].size) == -EEXIST);
+
+        for (i = 0; i < TEST_N_CHUNKS; i++)
+                verify_chunk(p, chunks + i);
+
+        assert_se(ca_pack_flush(p) >= 0);
+        p = ca_pack_unref(p);
+
+        /* Reopen the store fresh: everything must be discoverable via the sidecar index */
+
+        assert_se(p = ca_pack_new());
+        assert_se(ca_pack_set_path(p, pack_dir) >= 0);
+
+        assert_se(dev_urandom(&absent, sizeof(absent)) >= 0);
+        assert_se(ca_pack_has(p, &absent) == 0);
+
+        for (i = 0; i < TEST_N_CHUNKS; i++)
+                assert_se(ca_pack_has(p, &chunks[i].id) > 0);
+
+        idx = 0;
+        for (;;) {
+                CaChunkID id;
+                int r;
+
+                r = ca_pack_iterate(p, &idx, &id);
+                assert_se(r >= 0);
+                if (r == 0)
+                        break;
+
+                for (i = 0; i < TEST_N_CHUNKS; i++)
+                        if (memcmp(&id, &chunks[i].id, sizeof(CaChunkID)) == 0)
+                                break;
+
+                assert_se(i < TEST_N_CHUNKS);
+                assert_se(!seen[i]);
+                seen[i] = true;
+        }
+
+        for (i = 0; i < TEST_N_CHUNKS; i++) {
+                assert_se(seen[i]);
+                verify_chunk(p, chunks + i);
+        }
+
+        p = ca_pack_unref(p);
+
+        /* A corrupted sidecar index (bad magic) must be ignored in favour of rescanning the pack file, so
+         * that every chunk is still found. */
+
+        pack_file = find_pack_file(pack_dir);
+
+        index_file = strjoina(pack_file, ".index");
+        fd = open(index_file, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC|O_NOCTTY, 0644);
+        assert_se(fd >= 0);
+        assert_se(loop_write(fd, "garbage", 7) >= 0);
+        safe_close(fd);
+
+        assert_se(p = ca_pack_new());
+        assert_se(ca_pack_set_path(p, pack_dir) >= 0);
+
+        for (i = 0; i < TEST_N_CHUNKS; i++) {
+                assert_se(ca_pack_has(p, &chunks[i].id) > 0);
+                verify_chunk(p, chunks + i);
+        }
+
+        p = ca_pack_unref(p);
+
+        /* A truncated pack must drop the entries the truncation destroyed, while loading still succeeds.
+         * Cut the file right after the first entry's header, i.e. before any of its payload: nothing
+         * survives. The rewritten sidecar from the previous load no longer matches the file size, hence
+         * must be detected as stale. */
+
+        assert_se(stat(pack_file, &st) >= 0);
+        assert_se((uint64_t) st.st_size > sizeof(CaPackHeader) + sizeof(CaPackEntry));
+
+        fd = open(pack_file, O_WRONLY|O_CLOEXEC|O_NOCTTY);
+        assert_se(fd >= 0);
+        assert_se(ftruncate(fd, sizeof(CaPackHeader) + sizeof(CaPackEntry)) >= 0);
+        safe_close(fd);
+
+        assert_se(p = ca_pack_new());
+        assert_se(ca_pack_set_path(p, pack_dir) >= 0);
+
+        for (i = 0; i < TEST_N_CHUNKS; i++)
+                assert_se(ca_pack_has(p, &chunks[i].id) == 0);
+
+        p = ca_pack_unref(p);
+
+        free(pack_file);
+        remove_tree(pack_dir, dir);
+
+        return 0;
+}